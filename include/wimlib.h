@@ -198,6 +198,14 @@
  * the same on-disk WIM file, although "overwrites" should never be done in such
  * a scenario.
  *
+ * The one exception is that images can be added to the same ::WIMStruct by
+ * concurrent calls to wimlib_add_image() or wimlib_add_image_multisource(),
+ * provided that no other function is called on the ::WIMStruct at the same
+ * time.  Each image is scanned and its file data is hashed independently, and
+ * the data shared between the images is still deduplicated when the WIM is
+ * written.  The registered progress function may then be called from multiple
+ * threads at once.
+ *
  * In addition, several functions change global state and should only be called
  * when a single thread is active in the library.  These functions are:
  *
@@ -561,6 +569,8 @@ enum wimlib_compression_type {
 	 * implementation in Microsoft's WIMGAPI (as of Windows 8.1).
 	 * Non-default compression levels are also supported.  For example,
 	 * level 20 will provide fast compression, almost as fast as XPRESS.
+	 * Levels 20 and below use a greedy parser with a small hash table
+	 * matchfinder, trading some compression ratio for speed.
 	 *
 	 * If using wimlib_create_compressor() to create an LZX compressor
 	 * directly, the @p max_block_size parameter may be any positive value
@@ -798,6 +808,13 @@ enum wimlib_progress_msg {
 	 *	  build of the library only.
 	 */
 	WIMLIB_PROGRESS_MSG_HANDLE_ERROR = 31,
+
+	/** A WIM file has been written, or an extraction has finished, or,
+	 * with ::WIMLIB_INIT_FLAG_PROFILE_SYSCALLS, a directory tree has been
+	 * scanned.  @p info will point to ::wimlib_progress_info.stats, which
+	 * gives the library's cumulative performance counters.  See
+	 * wimlib_get_stats().  */
+	WIMLIB_PROGRESS_MSG_STATS = 32,
 };
 
 /** Valid return values from user-provided progress functions
@@ -817,6 +834,163 @@ enum wimlib_progress_status {
 	WIMLIB_PROGRESS_STATUS_ABORT	= 1,
 };
 
+/** Types of system calls whose latency is measured with
+ * ::WIMLIB_INIT_FLAG_PROFILE_SYSCALLS.  These are the calls made to read the
+ * files being captured, whether during the scan or when writing their data.  */
+enum wimlib_syscall_type {
+	/** Opening a directory to list it (UNIX-like systems only; on Windows,
+	 * this is counted as ::WIMLIB_SYSCALL_OPEN)  */
+	WIMLIB_SYSCALL_OPENDIR = 0,
+
+	/** Reading directory entries  */
+	WIMLIB_SYSCALL_READDIR = 1,
+
+	/** Getting the attributes of a file: stat() and its variants, or
+	 * NtQueryInformationFile() on Windows  */
+	WIMLIB_SYSCALL_STAT = 2,
+
+	/** Opening a file  */
+	WIMLIB_SYSCALL_OPEN = 3,
+
+	/** Reading the data of a file, up to a buffer at a time  */
+	WIMLIB_SYSCALL_READ = 4,
+
+	/** Listing or reading extended attributes  */
+	WIMLIB_SYSCALL_XATTR = 5,
+};
+
+#define WIMLIB_NUM_SYSCALL_TYPES		6
+
+#define WIMLIB_LATENCY_HISTOGRAM_BUCKETS	20
+
+/** Distribution of the latencies of one type of system call.  */
+struct wimlib_latency_histogram {
+	/** Number of calls, their total time, and the longest time of any one
+	 * call, in nanoseconds  */
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+
+	/** Number of calls by time taken: @p buckets[0] counts calls that took
+	 * under 1 microsecond, and @p buckets[i] for i >= 1 counts calls that
+	 * took from 2^(i-1) up to 2^i microseconds, except that the last bucket
+	 * also counts all longer calls.  */
+	uint64_t buckets[WIMLIB_LATENCY_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Performance counters of the library, as returned by wimlib_get_stats() and
+ * sent with ::WIMLIB_PROGRESS_MSG_STATS.  The counters are cumulative for the
+ * whole process, across all ::WIMStruct's and threads, since the library was
+ * loaded or wimlib_reset_stats() was last called.  Times are in nanoseconds.
+ *
+ * Comparing the counters tells which part of an operation is the bottleneck.
+ * For example, if @p compress_wait_ns is close to @p write_wall_ns, then
+ * writing was limited by compression; if @p compress_ns divided by the number
+ * of compression threads is much lower than @p write_wall_ns, then the
+ * compressor threads were mostly idle, waiting for data to be read or hashed.
+ */
+struct wimlib_stats {
+	/** Wall clock time and CPU time of the whole process spent scanning
+	 * directory trees, as done by wimlib_add_image() and
+	 * wimlib_update_image().  */
+	uint64_t scan_wall_ns;
+	uint64_t scan_cpu_ns;
+
+	/** Wall clock time and CPU time of the whole process spent writing WIM
+	 * files, as done by wimlib_write(), wimlib_overwrite(), and
+	 * wimlib_split().  This includes the reading, hashing, and compression
+	 * of the data being written.  */
+	uint64_t write_wall_ns;
+	uint64_t write_cpu_ns;
+
+	/** Wall clock time and CPU time of the whole process spent extracting
+	 * files.  */
+	uint64_t extract_wall_ns;
+	uint64_t extract_cpu_ns;
+
+	/** Time spent computing SHA-1 message digests, and the number of bytes
+	 * hashed, summed over all threads.  Only whole 64-byte blocks of data
+	 * passed at once are counted, so the hashing of very small buffers is
+	 * not.  */
+	uint64_t hash_ns;
+	uint64_t hash_bytes;
+
+	/** Time spent compressing chunks, summed over all threads, and the
+	 * total uncompressed and compressed sizes of these chunks.  */
+	uint64_t compress_ns;
+	uint64_t compress_in_bytes;
+	uint64_t compress_out_bytes;
+
+	/** Time that the thread writing a WIM file spent waiting for
+	 * compression threads to finish compressing data.  */
+	uint64_t compress_wait_ns;
+
+	/** Number of batches of chunks that were submitted to compression
+	 * threads, and the sum over these batches of the number of batches
+	 * queued or being compressed at the time, including the batch itself.
+	 * The ratio of the two is the average depth of the compression queue.
+	 */
+	uint64_t compress_batches;
+	uint64_t compress_queue_depth_sum;
+
+	/** Time spent decompressing chunks, summed over all threads, and the
+	 * total uncompressed size of these chunks.  */
+	uint64_t decompress_ns;
+	uint64_t decompress_out_bytes;
+
+	/** Number of read system calls made to read WIM files and, on
+	 * UNIX-like systems, files being captured, and the number of bytes
+	 * they returned.  Data read through a memory mapping is not counted.
+	 */
+	uint64_t read_calls;
+	uint64_t read_bytes;
+
+	/** Number of write system calls made to write WIM files, and the
+	 * number of bytes they wrote.  */
+	uint64_t write_calls;
+	uint64_t write_bytes;
+
+	/** Bytes of memory currently allocated, and the most allocated at any
+	 * one time, for image metadata: the metadata resources being parsed
+	 * and the directory entries and inodes of loaded images.  These and
+	 * the following memory counters cover the biggest uses of memory, not
+	 * every allocation.  They can be read from a progress function to find
+	 * out what an operation is using memory for.  */
+	uint64_t metadata_mem;
+	uint64_t metadata_mem_peak;
+
+	/** Likewise for blob tables: the hash tables, the blob descriptors, and
+	 * the blob tables being read or written.  */
+	uint64_t blob_table_mem;
+	uint64_t blob_table_mem_peak;
+
+	/** Likewise for compression: the working memory of the compressors, and
+	 * the buffers of chunks waiting to be compressed.  */
+	uint64_t compressor_mem;
+	uint64_t compressor_mem_peak;
+
+	/** Likewise for I/O buffers: buffers for reading and writing files,
+	 * buffers of compressed chunks being decompressed, and the cache of
+	 * decompressed chunks.  */
+	uint64_t io_buffer_mem;
+	uint64_t io_buffer_mem_peak;
+
+	/** Latencies of the system calls made to read the files being captured,
+	 * indexed by ::wimlib_syscall_type.  Only collected with
+	 * ::WIMLIB_INIT_FLAG_PROFILE_SYSCALLS.  On a network filesystem, these
+	 * tell whether metadata or data access is the bottleneck.  */
+	struct wimlib_latency_histogram syscall_latency[WIMLIB_NUM_SYSCALL_TYPES];
+
+	/** Wall clock time and CPU time of the whole process spent in
+	 * wimlib_verify_wim().  */
+	uint64_t verify_wall_ns;
+	uint64_t verify_cpu_ns;
+
+	/** Reserved; may be used by future versions of the library.  */
+	uint64_t reserved[8];
+};
+
 /**
  * A pointer to this union is passed to the user-supplied
  * ::wimlib_progress_func_t progress function.  One (or none) of the structures
@@ -972,7 +1146,8 @@ union wimlib_progress_info {
 	struct wimlib_progress_info_extract {
 
 		/** The 1-based index of the image from which files are being
-		 * extracted.  */
+		 * extracted, or 0 if all images are being extracted together
+		 * (see wimlib_extract_image()).  */
 		uint32_t image;
 
 		/** Extraction flags being used.  */
@@ -984,7 +1159,8 @@ union wimlib_progress_info {
 		const wimlib_tchar *wimfile_name;
 
 		/** Name of the image from which files are being extracted, or
-		 * the empty string if the image is unnamed.  */
+		 * the empty string if the image is unnamed or if all images
+		 * are being extracted together.  */
 		const wimlib_tchar *image_name;
 
 		/** Path to the directory or NTFS volume to which the files are
@@ -1251,6 +1427,12 @@ union wimlib_progress_info {
 		 */
 		bool will_ignore;
 	} handle_error;
+
+	/** Valid on messages ::WIMLIB_PROGRESS_MSG_STATS.  */
+	struct wimlib_progress_info_stats {
+		/** The library's performance counters.  */
+		const struct wimlib_stats *stats;
+	} stats;
 };
 
 /**
@@ -1425,13 +1607,15 @@ struct wimlib_wim_info {
  *    is_metadata flag.  In addition:
  *
  *    A. If the blob is located in a non-solid WIM resource, then we also know
- *       the sha1_hash, compressed_size, and offset.
+ *       the sha1_hash, compressed_size, and offset, and the chunk_size if the
+ *       resource is compressed.
  *
  *    B. If the blob is located in a solid WIM resource, then we also know the
  *       sha1_hash, offset, raw_resource_offset_in_wim,
- *       raw_resource_compressed_size, and raw_resource_uncompressed_size.  But
- *       the "offset" is actually the offset in the uncompressed solid resource
- *       rather than the offset from the beginning of the WIM file.
+ *       raw_resource_compressed_size, raw_resource_uncompressed_size, and
+ *       chunk_size.  But the "offset" is actually the offset in the
+ *       uncompressed solid resource rather than the offset from the beginning
+ *       of the WIM file.
  *
  *    C. If the blob is *not* located in any type of WIM resource, for example
  *       if it's in a external file that was scanned by wimlib_add_image(), then
@@ -1488,7 +1672,11 @@ struct wimlib_resource_entry {
 	/** 1 iff this blob is located in a solid resource.  */
 	uint32_t packed : 1;
 
-	uint32_t reserved_flags : 26;
+	/** 1 iff this blob is stored as a binary delta against another blob;
+	 * see ::WIMLIB_WRITE_FLAG_BINARY_DELTA.  */
+	uint32_t is_delta : 1;
+
+	uint32_t reserved_flags : 25;
 
 	/** If this blob is located in a solid WIM resource, then this is the
 	 * offset of that solid resource within the WIM file containing it.  */
@@ -1502,7 +1690,16 @@ struct wimlib_resource_entry {
 	 * uncompressed size of that solid resource.  */
 	uint64_t raw_resource_uncompressed_size;
 
-	uint64_t reserved[1];
+	/** If this blob is located in a compressed WIM resource, then this is
+	 * the size of the chunks that resource was compressed in, which is
+	 * always a power of 2.  Each chunk is decompressed independently, so
+	 * for a blob in a solid resource, reading the blob requires
+	 * decompressing only chunks <tt>offset / chunk_size</tt> through
+	 * <tt>(offset + uncompressed_size - 1) / chunk_size</tt> of that solid
+	 * resource.  */
+	uint32_t chunk_size;
+
+	uint32_t reserved32;
 };
 
 /**
@@ -1708,6 +1905,40 @@ typedef int (*wimlib_iterate_dir_tree_callback_t)(const struct wimlib_dir_entry
 typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resource_entry *resource,
 						      void *user_ctx);
 
+/**
+ * Callback functions for wimlib_read_blobs().  Each of them is optional and
+ * may be @c NULL.  Each is passed the @p user_ctx of this structure as its last
+ * parameter, and must return 0 on success; any other value aborts the read, and
+ * wimlib_read_blobs() then returns that value.
+ */
+struct wimlib_read_blob_callbacks {
+
+	/** Called when starting to read the data of a blob, which is described
+	 * by @p blob.  */
+	int (*begin_blob)(const struct wimlib_resource_entry *blob,
+			  void *user_ctx);
+
+	/** Called with each chunk of the uncompressed data of @p blob, in order.
+	 * @p offset is the offset of the chunk in the blob and @p size, which
+	 * is never 0, its size in bytes.  The chunk is passed directly from
+	 * wimlib's buffers, so it is only valid until this function returns.
+	 */
+	int (*blob_data)(const struct wimlib_resource_entry *blob,
+			 uint64_t offset, const void *chunk, size_t size,
+			 void *user_ctx);
+
+	/** Called when done reading @p blob.  @p status is 0 if all of its
+	 * data was read and matched the blob's SHA-1 message digest, or else
+	 * the ::wimlib_error_code value or the nonzero callback return value
+	 * which is aborting the read.  If @p status is nonzero, the return
+	 * value of this function is ignored.  */
+	int (*end_blob)(const struct wimlib_resource_entry *blob, int status,
+			void *user_ctx);
+
+	/** An extra parameter that is passed to each callback function.  */
+	void *user_ctx;
+};
+
 /** For wimlib_iterate_dir_tree(): Iterate recursively on children rather than
  * just on the specified path. */
 #define WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE 0x00000001
@@ -1723,6 +1954,28 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * the @ref wimlib_resource_entry::is_missing "is_missing" flag.  */
 #define WIMLIB_ITERATE_DIR_TREE_FLAG_RESOURCES_NEEDED  0x00000004
 
+/** For wimlib_iterate_dir_tree(): Don't build the full path of each file.  The
+ * @ref wimlib_dir_entry::full_path "full_path" passed to the callback will be
+ * @c NULL.  This saves work for callers that only need each file's name and
+ * depth.  */
+#define WIMLIB_ITERATE_DIR_TREE_FLAG_NO_FULL_PATH		0x00000008
+
+/** For wimlib_iterate_dir_tree(): Don't fill in the @ref
+ * wimlib_dir_entry::dos_name "dos_name", the security descriptor, the UNIX
+ * metadata, or the object ID of each file.  These fields will be left zeroed.
+ */
+#define WIMLIB_ITERATE_DIR_TREE_FLAG_NO_EXTRA_METADATA	0x00000010
+
+/** For wimlib_iterate_dir_tree(): Only fill in the stream entry for the unnamed
+ * data stream of each file.  The @ref wimlib_dir_entry::num_named_streams
+ * "num_named_streams" will be 0.  */
+#define WIMLIB_ITERATE_DIR_TREE_FLAG_UNNAMED_STREAM_ONLY	0x00000020
+
+/** For wimlib_iterate_dir_tree(): Don't fill in any stream entries, not even
+ * for the unnamed data stream.  The stream entries will be left zeroed, and
+ * ::WIMLIB_ITERATE_DIR_TREE_FLAG_RESOURCES_NEEDED has no effect.  */
+#define WIMLIB_ITERATE_DIR_TREE_FLAG_NO_STREAMS		0x00000040
+
 
 /** @} */
 /** @addtogroup G_modifying_wims
@@ -1872,7 +2125,9 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * a running Windows system without running into problems with locked files.
  * For the VSS snapshot to be successfully created, your application must be run
  * as an Administrator, and it cannot be run in WoW64 mode (i.e. if Windows is
- * 64-bit, then your application must be 64-bit as well).
+ * 64-bit, then your application must be 64-bit as well).  If several sources
+ * of one update or multi-source capture use this option, then the volumes
+ * containing them are all snapshotted together, as one VSS snapshot set.
  */
 #define WIMLIB_ADD_FLAG_SNAPSHOT		0x00008000
 
@@ -1886,6 +2141,106 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_ADD_FLAG_FILE_PATHS_UNNEEDED	0x00010000
 
+/**
+ * Compute the SHA-1 message digests of the files' data on multiple threads
+ * while the scan is still running, instead of leaving this to when the WIM is
+ * written.  Duplicate files are then already merged once wimlib_add_image(),
+ * wimlib_update_image(), etc. return, so the blob table and the total size
+ * reported by ::WIMLIB_PROGRESS_MSG_WRITE_STREAMS are accurate from the start
+ * of the write.  The threads used are those of the thread pool set with
+ * wimlib_set_thread_pool(), if any.
+ *
+ * This helps most when scanning is slow, e.g. on a network filesystem, since
+ * the files are then read while the scan is waiting for metadata.  The cost is
+ * that every file's data is read twice, even files which could be recognized
+ * as unique by their size alone.  Files whose data can't be read during the
+ * scan are hashed as usual when they are written.  Currently this only affects
+ * UNIX-style and Windows-native capture, not NTFS-3G capture.
+ */
+#define WIMLIB_ADD_FLAG_HASH_DURING_SCAN	0x00020000
+
+/**
+ * Allow the metadata of the files being scanned to come from the filesystem's
+ * cache, without making sure that it is up to date.  On network filesystems
+ * such as NFS and SMB this avoids a round trip to the server for each file,
+ * but files changed recently by another client may be captured with stale
+ * metadata.  Currently this only makes a difference on Linux, where it uses
+ * statx() with AT_STATX_DONT_SYNC.
+ */
+#define WIMLIB_ADD_FLAG_CACHED_METADATA		0x00040000
+
+/**
+ * Read the files' data in the order it is laid out on disk, rather than in
+ * order of path, when the image is written.  This requires opening each
+ * regular file during the scan to find out where its data starts, but can
+ * make reading the data much faster on hard disks.  Currently this only makes
+ * a difference in UNIX-style capture on Linux, where it uses the FIEMAP ioctl.
+ * Windows-native capture always reads files in this order.
+ */
+#define WIMLIB_ADD_FLAG_PHYSICAL_ORDER		0x00080000
+
+/**
+ * The source path is a tar or cpio archive rather than a directory.  The
+ * directory tree stored in the archive is captured without extracting it: the
+ * data of the files is read directly from the archive when the image is
+ * written.  Therefore, the archive must be a regular file, not a pipe, and it
+ * must not be modified or deleted until the WIM has been written.
+ *
+ * Supported are POSIX ustar and pax archives, GNU tar archives except for
+ * sparse files, and cpio archives in the "newc" format.  Compressed archives
+ * must be decompressed first.  Absolute symbolic link targets are taken to be
+ * relative to the root of the archive, as for reparse point fixups.  With
+ * ::WIMLIB_ADD_FLAG_UNIX_DATA, the owners, modes, and device numbers recorded in
+ * the archive are captured.
+ *
+ * This flag is currently only supported on UNIX-like systems.
+ */
+#define WIMLIB_ADD_FLAG_ARCHIVE			0x00100000
+
+/**
+ * Cache the SHA-1 message digests of the regular files being captured in the
+ * files themselves, so that later captures of the same files needn't read them
+ * again just to compute their digests, e.g. to find out that they are already
+ * in the WIM being appended to.
+ *
+ * When a file is hashed, its digest is stored in its extended attribute
+ * "user.wimlib.sha1" along with its size, last modification time, and inode
+ * number.  When a file is scanned, its digest is taken from this attribute if
+ * these all still match.  Thus, like wimlib_reference_template_image(), this
+ * assumes that files aren't modified without their last modification time
+ * changing.  Files which can't be written to, or which were modified in the
+ * last few seconds before the digest was computed, are left alone.  The
+ * attribute itself is never captured with ::WIMLIB_ADD_FLAG_UNIX_DATA.
+ *
+ * This flag currently only has an effect in UNIX-style capture on Linux.
+ */
+#define WIMLIB_ADD_FLAG_HASH_CACHE		0x00200000
+
+/**
+ * Capture a directory tree too large for its metadata to fit in memory.  As
+ * the scan completes each directory, the directory's entries are written to a
+ * temporary file in the format of a metadata resource and freed, and the
+ * metadata resource of the new image is later assembled from this file when
+ * the WIM is written.  Only the blob descriptors, i.e. the size, SHA-1 message
+ * digest, and location of each unique file, remain in memory for all the
+ * files.  The temporary file is created in the directory named by the TMPDIR
+ * environment variable, or in /tmp, and is deleted immediately, so it
+ * disappears when the ::WIMStruct is freed.  It needs somewhat more space than
+ * the uncompressed metadata resource.
+ *
+ * The file data is read during the scan to compute the message digests, like
+ * with ::WIMLIB_ADD_FLAG_HASH_DURING_SCAN, but without threads.  Files that
+ * have hard links stay in memory, along with their parent directories.
+ *
+ * This flag currently only has an effect in UNIX-style capture of a single
+ * directory tree as the root of a new image, without
+ * ::WIMLIB_ADD_FLAG_DEREFERENCE or ::WIMLIB_ADD_FLAG_WIMBOOT, and in particular
+ * with wimlib_add_image().  Otherwise it is ignored.  Any operation that needs
+ * the whole new image, such as wimlib_update_image() or wimlib_export_image(),
+ * loads it all into memory.
+ */
+#define WIMLIB_ADD_FLAG_SPILL_METADATA		0x00400000
+
 /** @} */
 /** @addtogroup G_modifying_wims
  * @{ */
@@ -2075,6 +2430,20 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_EXTRACT_FLAG_WIMBOOT			0x00400000
 
+/**
+ * When a blob is to be extracted to more than one file that is not a hard link
+ * of the others, write the data only to the first file, then make the others
+ * clones of it which share its extents on disk.  This saves both time and disk
+ * space when extracting images such as container layers, in which many
+ * unrelated files have the same contents.
+ *
+ * Currently this is only implemented on Linux, using the FICLONE ioctl, which
+ * is supported by filesystems such as Btrfs and XFS.  Files are copied instead
+ * if the target filesystem cannot clone files, and this flag is ignored on
+ * other platforms.
+ */
+#define WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES		0x00800000
+
 /**
  * Since wimlib v1.8.2 and Windows-only: compress the extracted files using
  * System Compression, when possible.  This only works on either Windows 10 or
@@ -2097,6 +2466,46 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * 32768 byte chunks.  */
 #define WIMLIB_EXTRACT_FLAG_COMPACT_LZX			0x08000000
 
+/**
+ * Update an existing directory tree at the target to match the image, rather
+ * than writing every file from scratch.  This is meant for redeploying a new
+ * version of an image onto a system that already has an older one.
+ *
+ * A regular file that already exists at the target with the same size, the
+ * same last modification time and, with ::WIMLIB_EXTRACT_FLAG_UNIX_DATA, the
+ * same mode and owner, is assumed to be unchanged and is left alone.  If only
+ * its size matches, its contents are checksummed, and if they match the file in
+ * the image, only its metadata is updated.  Other files are extracted as usual.
+ * In addition, any file or directory in an extracted directory of the target
+ * that does not exist in the image is deleted.
+ *
+ * Currently this is only supported by the UNIX extraction backend.  Elsewhere,
+ * ::WIMLIB_ERR_UNSUPPORTED is returned.
+ */
+#define WIMLIB_EXTRACT_FLAG_UPDATE			0x10000000
+
+/**
+ * UNIX-like systems only:  Write the files to a tar archive rather than to a
+ * directory.  The extraction target is then the path of the archive to create,
+ * or "-" for standard output.  The archive is in the POSIX pax format, which
+ * can be read by GNU tar, bsdtar, and most other tar implementations.
+ *
+ * Directories, empty files, and special files come first in the archive, then
+ * the other files in the order in which their data is laid out in the WIM, so
+ * that the WIM is read sequentially.  Hard links are stored as hard links.
+ * With ::WIMLIB_EXTRACT_FLAG_UNIX_DATA, the owners, modes, and device numbers
+ * captured with ::WIMLIB_ADD_FLAG_UNIX_DATA are stored, as are extended
+ * attributes (as "SCHILY.xattr" records); otherwise the files are owned by
+ * root with default permissions.  Timestamps are stored in whole seconds.
+ * Files that share their contents with other files, but aren't hard links to
+ * them, have their data copied to a temporary file first.
+ *
+ * This flag cannot be combined with ::WIMLIB_EXTRACT_FLAG_NTFS,
+ * ::WIMLIB_EXTRACT_FLAG_TO_STDOUT, or ::WIMLIB_EXTRACT_FLAG_UPDATE, nor used
+ * to extract all images at once.
+ */
+#define WIMLIB_EXTRACT_FLAG_TAR				0x00000004
+
 /** @} */
 /** @addtogroup G_mounting_wim_images
  * @{ */
@@ -2126,6 +2535,13 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * allow_other option to fuse_main().  */
 #define WIMLIB_MOUNT_FLAG_ALLOW_OTHER			0x00000040
 
+/** Let FUSE serve requests on multiple threads, so that files can be read and
+ * decompressed in parallel.  Each thread decompresses data with its own
+ * decompressor, and decompressed chunks are shared by all threads through the
+ * cache set by wimlib_set_chunk_cache_size().  Other operations are still
+ * serialized.  Only valid for read-only mounts.  */
+#define WIMLIB_MOUNT_FLAG_MULTITHREADED			0x00000080
+
 /** @} */
 /** @addtogroup G_creating_and_opening_wims
  * @{ */
@@ -2153,6 +2569,18 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * called.  */
 #define WIMLIB_OPEN_FLAG_WRITE_ACCESS			0x00000004
 
+/** Map the WIM file into memory, and read its data from the mapping rather
+ * than with separate read calls.  This saves a system call and a copy for each
+ * chunk of data read.  In particular, uncompressed data is passed directly from
+ * the mapping to wherever it is going, and compressed chunks are decompressed
+ * directly from the mapping.  The kernel is also asked to read in each
+ * resource shortly before it is needed.  This is only supported on 64-bit
+ * platforms other than Windows; elsewhere, or if the file can't be mapped, this
+ * flag is ignored.  The mapping is dropped before the WIM file is modified by
+ * wimlib_overwrite().  The WIM file must not be truncated by another program
+ * while it is mapped, or the program may crash.  */
+#define WIMLIB_OPEN_FLAG_MMAP				0x00000008
+
 /** @} */
 /** @addtogroup G_mounting_wim_images
  * @{ */
@@ -2299,7 +2727,10 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * to wimlib_delete_image(), which is to rebuild the entire WIM file.  With this
  * flag, only minimal changes to correctly remove the image from the WIM file
  * will be taken.  This can be much faster, but it will result in the WIM file
- * getting larger rather than smaller.
+ * getting larger rather than smaller.  However, if the WIM file has no
+ * integrity table and the filesystem supports it, then the data no longer
+ * referenced by any image is deallocated ("hole-punched"), so that its disk
+ * space is reclaimed even though the file size isn't reduced.
  *
  * wimlib_write() ignores this flag.
  */
@@ -2397,6 +2828,10 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * to know what they are doing and assume responsibility for any data corruption
  * that may result.</b>
  *
+ * The resources are moved by several threads at once, up to the
+ * @p num_threads passed to wimlib_overwrite(), each one starting as soon as the
+ * data it would overwrite has been moved out of the way.
+ *
  * If the WIM file cannot be compacted in-place because of its structure, its
  * layout, or other requested write parameters, then wimlib_overwrite() fails
  * with ::WIMLIB_ERR_COMPACTION_NOT_POSSIBLE, and the caller may wish to retry
@@ -2404,6 +2839,169 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_WRITE_FLAG_UNSAFE_COMPACT		0x00008000
 
+/**
+ * Compress each chunk of data more than one way and keep whichever output is
+ * smallest.  Currently, each chunk is compressed at the default compression
+ * level for the compression type (see wimlib_set_default_compression_level())
+ * and also at a higher level: twice the default level, but at least 100.  This
+ * makes compression several times slower, but it can improve the compression
+ * ratio somewhat, since a higher level isn't better on every chunk.  This is
+ * intended for WIM files that are written once and read many times.
+ * Decompression is unaffected, and the resulting WIM files are compatible
+ * with all software that can read WIM files.
+ *
+ * Like the compression level, this only affects data that is actually
+ * compressed by this write; use ::WIMLIB_WRITE_FLAG_RECOMPRESS to also apply it
+ * to data that is already compressed in a compatible format.
+ */
+#define WIMLIB_WRITE_FLAG_MULTI_CANDIDATE		0x00010000
+
+/**
+ * When arranging file data for solid compression, also group together files
+ * whose contents look similar, regardless of their names.  Normally, the data
+ * is only arranged by file extension and name.  Similarity is estimated from a
+ * small MinHash sketch of the first 64 KiB of each file, so this requires
+ * reading that much of each file an extra time before writing.  This can
+ * improve the compression ratio of solid resources, especially with LZMS,
+ * which can find matches far back in its large chunks.
+ *
+ * This flag has no effect unless solid resources are being written, and it
+ * has no effect if ::WIMLIB_WRITE_FLAG_NO_SOLID_SORT is also specified.
+ */
+#define WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT		0x00020000
+
+/**
+ * When not using ::WIMLIB_WRITE_FLAG_SOLID, still write the data of small files
+ * into solid resources, while other file data is written in non-solid
+ * resources as usual.  A file is considered small if its data fits in one chunk
+ * of the WIM's main chunk size.  Normally, each such file is compressed on its
+ * own, so the compressor can't take advantage of data that the file has in
+ * common with other files.  The solid resources written by this flag use the
+ * WIM's main compression type, rather than that set by
+ * wimlib_set_output_pack_compression_type(), and chunks of at most 1 MiB (or
+ * the largest chunk size allowed for the compression type, if smaller), so
+ * reading a small file still requires decompressing only a little other data.
+ * This can considerably improve the compression ratio of WIM files that
+ * contain many small files, such as source trees.
+ *
+ * Like ::WIMLIB_WRITE_FLAG_SOLID, this flag causes the WIM version number to be
+ * set to the one for solid resources, and it can't be used together with
+ * ::WIMLIB_WRITE_FLAG_PIPABLE.  Microsoft's software may not be able to read
+ * solid resources that are not compressed with LZMS.  This flag has no effect
+ * if the WIM is uncompressed.
+ */
+#define WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES		0x00040000
+
+/**
+ * Keep the data of the WIM file being written out of the operating system's
+ * file cache, as far as possible.  When writing a large WIM file, the written
+ * data would otherwise fill the cache even though it usually won't be read
+ * back soon, evicting data that will be, such as the files being captured.
+ * With this flag, wimlib periodically starts writing back the data written so
+ * far, waits for the previous part to be written, and then asks the operating
+ * system to drop that part from the cache.  This has a similar effect to
+ * unbuffered ("direct") I/O while keeping the writes themselves buffered: at
+ * most a few megabytes of the output stay cached at a time, at the cost of the
+ * writes being paced by the speed of the output device.
+ *
+ * This is currently only effective on Linux, where sync_file_range() is
+ * available; on other UNIX-like systems, only data that has already been
+ * written back is dropped from the cache.  This flag is ignored on Windows and
+ * when writing to a pipe.
+ */
+#define WIMLIB_WRITE_FLAG_UNCACHED			0x00080000
+
+/**
+ * When not using ::WIMLIB_WRITE_FLAG_SOLID, compress the data of large files
+ * using a larger chunk size than the WIM's main chunk size: 2 MiB, or the
+ * largest chunk size allowed for the compression type if that is smaller.  A
+ * file is considered large if its data spans at least 4 such chunks.  Since
+ * non-solid resources must all use the chunk size in the WIM header, the data
+ * of each large file is written as a solid resource containing only that
+ * file's data, which records its own chunk size.  Small files keep the main
+ * chunk size, so reading them stays cheap; reading part of a large file
+ * requires decompressing at most one larger chunk.  This can improve the
+ * compression ratio of compressible large files, especially with LZX.
+ *
+ * Like ::WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES, with which it can be combined,
+ * this flag causes the WIM version number to be set to the one for solid
+ * resources, and it can't be used together with ::WIMLIB_WRITE_FLAG_PIPABLE.
+ * Microsoft's software may not be able to read solid resources that are not
+ * compressed with LZMS.  This flag has no effect if the WIM is uncompressed or
+ * if the main chunk size is already at least as large as the larger chunk
+ * size.
+ */
+#define WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS		0x00100000
+
+/**
+ * Write the image metadata, but no file data.  The data of each file is still
+ * read so that its SHA-1 message digest can be computed, but it is not
+ * compressed or written.  Each blob is still listed in the blob table, with its
+ * SHA-1 message digest and uncompressed size, but with part number 0, meaning
+ * that its data is in no part of the WIM.  The result is a small WIM that
+ * describes the image(s) and their file data exactly, e.g. for estimating how
+ * much data several images have in common, but from which the file data cannot
+ * be extracted.
+ *
+ * When such a WIM is read, the blob table entries with part number 0 are
+ * ignored, so the file data is treated as missing, as with a WIM written with
+ * ::WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS.  It can be supplied from other WIMs
+ * with wimlib_reference_resources().
+ *
+ * This flag is not accepted by wimlib_overwrite() or wimlib_split(), and it
+ * can't be used together with ::WIMLIB_WRITE_FLAG_PIPABLE.
+ */
+#define WIMLIB_WRITE_FLAG_NO_FILE_DATA			0x00200000
+
+/**
+ * When writing a delta WIM with ::WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS, store
+ * the data of each modified file as a binary delta against the data of the
+ * file's old version in a referenced WIM, when that saves enough space.  A
+ * file's old version is known only if the image was captured as an update of
+ * an image in a referenced WIM, using wimlib_reference_template_image(); it is
+ * the data of the file at the same path in that image.  Only files of between
+ * 4 KiB and 64 MiB are delta-encoded, and only if at least about half of the
+ * new data is found in the old data.  The deltas are compressed like other
+ * non-solid resources.  This can make a delta WIM of an update that modifies
+ * large files only slightly much smaller.
+ *
+ * This is a wimlib extension to the WIM format: the data of such files can be
+ * read only by wimlib, and only when the base WIM is referenced with
+ * wimlib_reference_resources() or wimlib_reference_resource_files(), as is
+ * needed for any delta WIM anyway.  When the files are written to another WIM,
+ * e.g. with wimlib_export_image(), their data is stored in full again.  This
+ * flag has no effect when writing a pipable WIM.
+ */
+#define WIMLIB_WRITE_FLAG_BINARY_DELTA			0x00400000
+
+/**
+ * Make an interrupted write resumable.  While the file data is being written,
+ * the location of each blob whose data has been written is recorded in a
+ * checkpoint file, named by appending ".checkpoint" to the path of the WIM
+ * file.  The records are committed about every 256 MiB of output, after the
+ * data written so far has been synced to disk, and also when the write fails.
+ * If wimlib_write() is called again with this flag for the same path, and the
+ * checkpoint file matches the partially written WIM file, the file data already
+ * written is kept: each blob recorded in the checkpoint file is not written
+ * again, and the remaining data is appended after it.  The checkpoint file is
+ * deleted when the write succeeds.
+ *
+ * The blobs are matched by SHA-1 message digest, so the images being written
+ * need not be exactly the same ones, e.g. when a capture that was interrupted
+ * is started over from scratch; but the data of files that haven't been
+ * checksummed yet, such as those of a new capture, must be read again to know
+ * whether it was written.  The blobs of a solid resource are recorded only once
+ * the whole resource has been written, so with ::WIMLIB_WRITE_FLAG_SOLID it
+ * helps to split the data into several solid resources, see
+ * wimlib_set_output_solid_resource_count().  The write starts over if the
+ * compression type, chunk size, or WIM version number differs from the
+ * interrupted write.
+ *
+ * This flag is only accepted by wimlib_write(), and it can't be used together
+ * with ::WIMLIB_WRITE_FLAG_PIPABLE or ::WIMLIB_WRITE_FLAG_NO_FILE_DATA.
+ */
+#define WIMLIB_WRITE_FLAG_RESUMABLE			0x00800000
+
 /** @} */
 /** @addtogroup G_general
  * @{ */
@@ -2443,6 +3041,12 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * This does not apply to mounted images.  */
 #define WIMLIB_INIT_FLAG_DEFAULT_CASE_INSENSITIVE	0x00000020
 
+/** Measure how long the system calls made to read the files being captured
+ * take, and collect the times in ::wimlib_stats.syscall_latency.  With this
+ * flag, ::WIMLIB_PROGRESS_MSG_STATS is also sent after each directory tree has
+ * been scanned.  */
+#define WIMLIB_INIT_FLAG_PROFILE_SYSCALLS		0x00000040
+
 /** @} */
 /** @addtogroup G_nonstandalone_wims
  * @{ */
@@ -2621,6 +3225,8 @@ enum wimlib_error_code {
 	WIMLIB_ERR_SNAPSHOT_FAILURE                   = 89,
 	WIMLIB_ERR_INVALID_XATTR                      = 90,
 	WIMLIB_ERR_SET_XATTR                          = 91,
+	WIMLIB_ERR_INVALID_ARCHIVE                    = 92,
+	WIMLIB_ERR_COMPRESSION_WORKER                 = 93,
 };
 
 
@@ -2710,6 +3316,9 @@ wimlib_add_empty_image(WIMStruct *wim,
  * returned by wimlib_add_empty_image() may be returned, as well as any error
  * codes returned by wimlib_update_image() other than ones documented as only
  * being returned specifically by an update involving delete or rename commands.
+ * The image is built in a separate ::WIMStruct and moved into @p wim when it
+ * is complete, so this function may be called from several threads at once to
+ * add different images to the same ::WIMStruct; see @ref subsec_thread_safety.
  *
  * If a progress function is registered with @p wim, then it will receive the
  * messages ::WIMLIB_PROGRESS_MSG_SCAN_BEGIN and ::WIMLIB_PROGRESS_MSG_SCAN_END.
@@ -2846,6 +3455,15 @@ wimlib_delete_path(WIMStruct *wim, int image,
  * the directory tree of a source or destination image cannot be updated
  * following an export until one of the two images has been freed from memory.
  *
+ * When consolidating images from many source WIMs into one, each source
+ * ::WIMStruct may be freed with wimlib_free() as soon as its images have been
+ * exported, before the destination WIM is written.  This releases the source's
+ * blob table, so only the blobs referenced by the exported images, and not the
+ * full blob tables of all the sources, remain in memory.  The source WIM files
+ * themselves stay open until the destination ::WIMStruct is freed.  Combining
+ * this with ::WIMLIB_EXPORT_FLAG_GIFT avoids duplicating the exported blob
+ * descriptors.
+ *
  * @param src_wim
  *	The WIM from which to export the images, specified as a pointer to the
  *	::WIMStruct for a standalone WIM file, a delta WIM file, or part 1 of a
@@ -2925,7 +3543,12 @@ wimlib_export_image(WIMStruct *src_wim, int src_image,
  * @param image
  *	The 1-based index of the image to extract, or ::WIMLIB_ALL_IMAGES to
  *	extract all images.  Note: ::WIMLIB_ALL_IMAGES is unsupported in NTFS-3G
- *	extraction mode.
+ *	extraction mode.  With ::WIMLIB_ALL_IMAGES, each image is extracted to a
+ *	subdirectory of @p target named after the image, or after its index if
+ *	the name can't be used as a directory name.  On UNIX-like systems, the
+ *	images are then normally extracted together, in one pass, so that data
+ *	shared by several images is read only once; this requires the metadata
+ *	of all the images to be in memory at the same time.
  * @param target
  *	A null-terminated string which names the location to which the image(s)
  *	will be extracted.  By default, this is interpreted as a path to a
@@ -3014,7 +3637,9 @@ wimlib_export_image(WIMStruct *src_wim, int src_image,
  * zero or more ::WIMLIB_PROGRESS_MSG_EXTRACT_FILE_STRUCTURE messages, then zero
  * or more ::WIMLIB_PROGRESS_MSG_EXTRACT_STREAMS messages, then zero or more
  * ::WIMLIB_PROGRESS_MSG_EXTRACT_METADATA messages, then
- * ::WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END.
+ * ::WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END.  When all images are extracted
+ * together, this sequence of messages is sent only once, with @p
+ * wimlib_progress_info.extract.image set to 0.
  */
 WIMLIBAPI int
 wimlib_extract_image(WIMStruct *wim, int image,
@@ -3034,6 +3659,11 @@ wimlib_extract_image(WIMStruct *wim, int image,
  * wimlib_open_wim() to transparently open a pipable WIM if it's available as a
  * seekable file, not a pipe.)
  *
+ * As an exception, if @p pipe_fd is actually a regular file, positioned at the
+ * start of a complete, nonsplit pipable WIM, then the WIM is read with random
+ * access, and only the data needed for the image being extracted is read.  In
+ * that case the file offset of @p pipe_fd is left unspecified.
+ *
  * @param pipe_fd
  *	File descriptor, which may be a pipe, opened for reading and positioned
  *	at the start of the pipable WIM.
@@ -3298,6 +3928,33 @@ WIMLIBAPI const wimlib_tchar *
 wimlib_get_image_property(const WIMStruct *wim, int image,
 			  const wimlib_tchar *property_name);
 
+/**
+ * @ingroup G_general
+ *
+ * Get the library's performance counters.  See ::wimlib_stats.  Collecting
+ * these costs little, so it is always done.
+ *
+ * @param stats
+ *	The ::wimlib_stats structure into which to copy the counters.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_get_stats(struct wimlib_stats *stats);
+
+/**
+ * @ingroup G_general
+ *
+ * Reset all of the library's performance counters to 0, except that the
+ * memory counters keep counting the memory still allocated, and their peaks are
+ * set to it.  Calling this before an operation therefore makes the peaks that
+ * operation's high-water marks.  This should not be called while another
+ * thread is using the library, or the counters of the operation in progress
+ * will be inconsistent.
+ */
+WIMLIBAPI void
+wimlib_reset_stats(void);
+
 /**
  * @ingroup G_general
  *
@@ -3394,7 +4051,9 @@ wimlib_global_init(int init_flags);
  * @ingroup G_general
  *
  * Cleanup function for wimlib.  You are not required to call this function, but
- * it will release any global resources allocated by the library.
+ * it will release any global resources allocated by the library, including the
+ * threads that run asynchronous jobs.  Any such jobs must have been waited for
+ * with wimlib_wait_job() first.
  */
 WIMLIBAPI void
 wimlib_global_cleanup(void);
@@ -3622,8 +4281,10 @@ wimlib_load_text_file(const wimlib_tchar *path,
  *	@p image does not exist in @p wim.
  * @retval ::WIMLIB_ERR_INVALID_PARAM
  *	@p wim was @c NULL; or @p dir was NULL or an empty string; or an
- *	unrecognized flag was specified in @p mount_flags; or the image has
- *	already been modified in memory (e.g. by wimlib_update_image()).
+ *	unrecognized flag was specified in @p mount_flags; or
+ *	::WIMLIB_MOUNT_FLAG_MULTITHREADED was specified together with
+ *	::WIMLIB_MOUNT_FLAG_READWRITE; or the image has already been modified in
+ *	memory (e.g. by wimlib_update_image()).
  * @retval ::WIMLIB_ERR_MKDIR
  *	::WIMLIB_MOUNT_FLAG_READWRITE was specified in @p mount_flags, but the
  *	staging directory could not be created.
@@ -3757,6 +4418,61 @@ wimlib_open_wim_with_progress(const wimlib_tchar *wim_file,
 			      wimlib_progress_func_t progfunc,
 			      void *progctx);
 
+/**
+ * @ingroup G_creating_and_opening_wims
+ *
+ * Callbacks through which wimlib reads a WIM file that is not available as a
+ * local file; see wimlib_open_wim_from_reader().  For example, the callbacks
+ * may read the WIM file from object storage using HTTP range requests.
+ */
+struct wimlib_wim_reader {
+
+	/** Size of the WIM file, in bytes.  */
+	uint64_t size;
+
+	/** Read exactly @p count bytes at @p offset in the WIM file into @p buf.
+	 * Return 0 on success, or a nonzero value on failure, preferably with
+	 * @c errno set.  Reads are never beyond the end of the file.  wimlib
+	 * serves small reads from a cache of larger aligned blocks, so each
+	 * call is usually for at least 256 KiB.  This function may be called
+	 * concurrently from multiple threads.  */
+	int (*read_at)(void *ctx, void *buf, size_t count, uint64_t offset);
+
+	/** If not NULL, called when wimlib is done with the reader.  */
+	void (*close)(void *ctx);
+
+	/** User-specified context passed to the callbacks.  */
+	void *ctx;
+};
+
+/**
+ * @ingroup G_creating_and_opening_wims
+ *
+ * Same as wimlib_open_wim_with_progress(), but read the WIM file through the
+ * callbacks in @p reader rather than from a file.  This allows extracting
+ * files from, or exporting images from, a WIM file in remote storage without
+ * downloading it first.  Only the parts of the WIM file actually needed are
+ * read.
+ *
+ * The callbacks are copied, so @p reader itself needn't remain valid.  If @p
+ * reader is valid, its @c close callback is called exactly once, when the
+ * resulting ::WIMStruct is freed or when this function fails.
+ *
+ * The resulting ::WIMStruct has no backing file, so it cannot be committed with
+ * wimlib_overwrite().  Accordingly, @p open_flags may only contain
+ * ::WIMLIB_OPEN_FLAG_CHECK_INTEGRITY and ::WIMLIB_OPEN_FLAG_ERROR_IF_SPLIT.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.  The possible
+ * error codes are the same as for wimlib_open_wim(), except that
+ * ::WIMLIB_ERR_READ means the @c read_at callback failed.
+ */
+WIMLIBAPI int
+wimlib_open_wim_from_reader(const struct wimlib_wim_reader *reader,
+			    int open_flags,
+			    WIMStruct **wim_ret,
+			    wimlib_progress_func_t progfunc,
+			    void *progctx);
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
@@ -3791,7 +4507,8 @@ wimlib_open_wim_with_progress(const wimlib_tchar *wim_file,
  *	Bitwise OR of relevant flags prefixed with WIMLIB_WRITE_FLAG.
  * @param num_threads
  *	The number of threads to use for compressing data, or 0 to have the
- *	library automatically choose an appropriate number.
+ *	library automatically choose an appropriate number.  This is ignored if
+ *	a thread pool has been set with wimlib_set_thread_pool().
  *
  * @return 0 on success; a ::wimlib_error_code value on failure.  This function
  * may return most error codes returned by wimlib_write() as well as the
@@ -3850,6 +4567,55 @@ wimlib_print_available_images(const WIMStruct *wim, int image);
 WIMLIBAPI void
 wimlib_print_header(const WIMStruct *wim);
 
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Read the data of the specified blobs, passing it to callback functions
+ * rather than extracting it to files.  This allows reading the contents of
+ * files in a WIM image, e.g. to scan or index them, without extracting them
+ * or mounting the image.
+ *
+ * The blobs are identified by their SHA-1 message digests, which can be found
+ * in the ::wimlib_resource_entry's given by wimlib_iterate_dir_tree() for the
+ * streams of each file, or by wimlib_iterate_lookup_table() for all blobs.
+ *
+ * The blobs are read in the order in which their data is located rather than
+ * in the order given, so that the WIM file is read sequentially and each solid
+ * resource is decompressed only once.  Each blob is read once, even if its
+ * message digest is given more than once.  As in extraction, the data of each
+ * blob is checked against its SHA-1 message digest.
+ *
+ * @param wim
+ *	Pointer to the ::WIMStruct containing the blobs.
+ * @param hashes
+ *	Array of the SHA-1 message digests of the blobs to read.  A digest of
+ *	all zeroes, which stands for empty data, is ignored.
+ * @param num_hashes
+ *	Number of entries in @p hashes.
+ * @param flags
+ *	Reserved; set to 0.
+ * @param cbs
+ *	Callback functions that will receive the data of the blobs.
+ *
+ * @return 0 if all blobs were read successfully and all callbacks returned 0;
+ * otherwise the first nonzero value returned by a callback, or a
+ * ::wimlib_error_code value.
+ *
+ * @retval ::WIMLIB_ERR_RESOURCE_NOT_FOUND
+ *	A blob could not be found in the blob lookup table of @p wim.  No data
+ *	was read.
+ * @retval ::WIMLIB_ERR_INVALID_RESOURCE_HASH
+ *	The data of a blob was corrupt.
+ *
+ * This function can additionally return ::WIMLIB_ERR_DECOMPRESSION,
+ * ::WIMLIB_ERR_READ, or ::WIMLIB_ERR_UNEXPECTED_END_OF_FILE, all of which
+ * indicate failure (for different reasons) to read the data of a blob.
+ */
+WIMLIBAPI int
+wimlib_read_blobs(WIMStruct *wim, const uint8_t (*hashes)[20],
+		  size_t num_hashes, int flags,
+		  const struct wimlib_read_blob_callbacks *cbs);
+
 /**
  * @ingroup G_nonstandalone_wims
  *
@@ -3946,7 +4712,16 @@ wimlib_reference_resources(WIMStruct *wim, WIMStruct **resource_wims,
  * (This is, however, assuming that timestamps have not been manipulated or
  * unmaintained as to trick this function into thinking a file has not been
  * modified when really it has.  To partly guard against such cases, other
- * metadata such as file sizes will be checked as well.)
+ * metadata such as file sizes will be checked as well.  If both images were
+ * captured on a UNIX-like system with ::WIMLIB_ADD_FLAG_UNIX_DATA, the files'
+ * inode numbers and status change times must match too, which also catches
+ * files whose last write time was set back.)
+ *
+ * For each file that does appear to have changed, the data of the file at the
+ * same path in the template image is remembered as the file's old data, if that
+ * data is in a WIM referenced by @p wim (see wimlib_reference_resources()).
+ * ::WIMLIB_WRITE_FLAG_BINARY_DELTA can then store the new data as a delta
+ * against the old data.
  *
  * This function must be called after adding the new image (e.g. with
  * wimlib_add_image()), but before writing the updated WIM file (e.g. with
@@ -4056,6 +4831,150 @@ WIMLIBAPI int
 wimlib_resolve_image(WIMStruct *wim,
 		     const wimlib_tchar *image_name_or_num);
 
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Set the number of threads that will be used to decompress data read from a
+ * ::WIMStruct's backing file.  This affects any operation that reads
+ * compressed resources, such as wimlib_extract_image(), wimlib_export_image()
+ * followed by wimlib_write(), and wimlib_verify_wim().
+ *
+ * When more than one thread is used, compressed chunks are read ahead and
+ * decompressed concurrently, while the decompressed data is still processed
+ * in order.  This mainly helps with large resources, such as solid resources.
+ * Each thread requires buffers for its chunks, so the number of threads may be
+ * reduced automatically to limit memory usage.
+ *
+ * This setting only applies to data located in the backing file of @p wim
+ * itself.  For data located in WIMs that were referenced with
+ * wimlib_reference_resources(), such as other parts of a split WIM, set the
+ * number of threads for those WIMs as well.  WIMs that are referenced with
+ * wimlib_reference_resource_files() after this function is called use the
+ * same number of threads as @p wim.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the number of decompression threads.
+ * @param num_threads
+ *	The number of threads to use, or 0 to use one thread per processor.  The
+ *	default is 1, which means that data is decompressed only by the calling
+ *	thread.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_decompression_threads(WIMStruct *wim, unsigned num_threads);
+
+/**
+ * @ingroup G_mounting_wim_images
+ *
+ * Set the memory budget of the cache of decompressed data that is used when
+ * reading data from a ::WIMStruct's backing file at arbitrary offsets, as is
+ * done when reading files from a mounted WIM image.  Without the cache, each
+ * such read must decompress every chunk that it touches, which is very slow for
+ * small reads of data in large chunks, such as in solid resources.  The cache
+ * holds the most recently used decompressed chunks and the chunk tables of the
+ * most recently used resources.
+ *
+ * The most recently used chunk is always kept, even if it alone exceeds the
+ * budget.  Extraction, export, and other operations that read data
+ * sequentially use the cache only for chunks of which they need just part, as
+ * when extracting some of the files in a solid resource, and only when data is
+ * decompressed by the calling thread and the chunks are at most half the
+ * budget.  Note that solid resources use 64 MiB chunks by default.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the cache size.
+ * @param max_size
+ *	The maximum number of bytes of data to cache, or 0 to disable the cache.
+ *	The default is 33554432 (32 MiB).
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_chunk_cache_size(WIMStruct *wim, uint64_t max_size);
+
+/**
+ * @ingroup G_mounting_wim_images
+ *
+ * Share the decompressed data that is read from a ::WIMStruct's backing file
+ * with other ::WIMStructs and processes that read the same WIM file, such as
+ * several mounts of the same image or several partial extractions running at
+ * the same time.  The shared cache is a file that all the users map into
+ * memory.  Each chunk that one of them decompresses is offered to the cache,
+ * and each chunk that one of them needs is looked for in the cache before it is
+ * read and decompressed.  The cache is used for the same reads as the cache set
+ * by wimlib_set_chunk_cache_size(), and also for the chunks that extraction
+ * needs in full when data is decompressed by the calling thread only.
+ *
+ * Chunks are identified by the GUID of the WIM file, the identity and
+ * modification time of the file, the offset of the resource in the file, and
+ * the index of the chunk.  Chunks larger than the cache's slots, which are
+ * sized for the chunks of the first WIM file the cache was created for but are
+ * at least 32768 bytes, are not shared; this includes the chunks of solid
+ * resources.  When the cache is full, the least recently used chunk of a small
+ * group of slots is replaced, so the cache can be of any size.  The cache needs
+ * no locks and stays consistent if a process using it is killed.
+ *
+ * Anyone who can write to the cache file can change the data that is read
+ * through it, so it should only be shared by processes that trust each other.
+ * The file is created readable and writable by its owner only.  This is
+ * currently supported on UNIX-like systems only.
+ *
+ * The cache is used only for data read from @p wim itself, not for data read
+ * from WIM files referenced with wimlib_reference_resource_files() or
+ * wimlib_reference_resources(); call this function for those WIMStructs as well
+ * to share their data too.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the shared cache.
+ * @param path
+ *	Path to the cache file, or @c NULL to stop using a shared cache.  If the
+ *	file doesn't exist, it is created.  To keep the data in memory only, put
+ *	the file on a memory file system, such as /dev/shm on Linux.
+ * @param size
+ *	The size in bytes of the cache file if it is created.  Ignored if the
+ *	cache file already exists.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p path exists but isn't a shared chunk cache, or @p size is too small
+ *	to hold a single group of slots.
+ * @retval ::WIMLIB_ERR_LINK
+ *	The cache file could not be created.
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	The cache file could not be mapped into memory.
+ * @retval ::WIMLIB_ERR_OPEN
+ *	The cache file could not be opened or created.
+ * @retval ::WIMLIB_ERR_UNSUPPORTED
+ *	Shared chunk caches are not supported on this platform.
+ */
+WIMLIBAPI int
+wimlib_set_shared_chunk_cache(WIMStruct *wim, const wimlib_tchar *path,
+			      uint64_t size);
+
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Set how far ahead of the data currently being read wimlib asks the operating
+ * system to read in a ::WIMStruct's backing file.  When extracting or exporting
+ * many blobs, the blobs are read in the order their data is laid out in the
+ * WIM file, so the upcoming reads are known in advance; requesting them early
+ * keeps several reads in flight at once.  A larger distance can reduce stalls
+ * on storage with high latency, such as hard disks or network storage with a
+ * cold cache.  This currently has an effect on UNIX-like systems only.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the read-ahead distance.
+ * @param size
+ *	The read-ahead distance in bytes, or 0 to disable read-ahead requests.
+ *	The default is 8388608 (8 MiB).
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_read_ahead_size(WIMStruct *wim, uint64_t size);
+
 /**
  * @ingroup G_general
  *
@@ -4196,6 +5115,28 @@ wimlib_set_memory_allocator(void *(*malloc_func)(size_t),
 			    void (*free_func)(void *),
 			    void *(*realloc_func)(void *, size_t));
 
+/**
+ * @ingroup G_general
+ *
+ * Set the amount of memory that wimlib should try to stay within when it
+ * chooses how many threads and buffers to use for compressing and
+ * decompressing data in parallel.  If needed to stay within the limit, fewer
+ * threads are used.  This is not a hard limit on wimlib's memory usage.
+ *
+ * This setting is global and not per-WIM.
+ *
+ * By default, the limit is the amount of physical memory.  On Linux, if the
+ * process is in a cgroup with a lower memory limit (as is common in
+ * containers), then that limit is used instead.
+ *
+ * @param limit
+ *	The memory limit in bytes, or 0 to restore the default.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_memory_limit(uint64_t limit);
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
@@ -4266,6 +5207,363 @@ WIMLIBAPI int
 wimlib_set_output_pack_compression_type(WIMStruct *wim,
 					enum wimlib_compression_type ctype);
 
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Set the number of solid resources into which subsequent calls to
+ * wimlib_write(), wimlib_write_to_fd(), and wimlib_overwrite() on a ::WIMStruct
+ * divide the file data they compress with ::WIMLIB_WRITE_FLAG_SOLID.  The data
+ * is divided in the order it is written, which groups similar files together,
+ * into resources of about the same uncompressed size.
+ *
+ * Each solid resource has its own chunk table and is compressed independently
+ * of the others.  Extracting files from one resource therefore never requires
+ * decompressing data of another, damage to one resource doesn't affect the
+ * others, and exporting or optimizing a WIM can copy a resource as-is when all
+ * its files are kept.  On the other hand, the compression ratio gets somewhat
+ * worse as the number of resources increases.  The resources are written one
+ * after another, and the chunks of each are compressed using all compression
+ * threads.
+ *
+ * Data that is copied without being recompressed keeps its existing resources.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the number of solid resources.
+ * @param count
+ *	The number of solid resources, or 0 or 1 to write all the data into
+ *	one solid resource, which is the default.  Fewer resources are written
+ *	if there are fewer files than @p count.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_output_solid_resource_count(WIMStruct *wim, unsigned count);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Set the size of the buffer in which subsequent calls to wimlib_write(),
+ * wimlib_write_to_fd(), and wimlib_overwrite() on a ::WIMStruct collect the
+ * data being written, so that it can be written to the output file with a few
+ * large writes rather than with one write per compressed chunk.  This can
+ * greatly speed up writing to network filesystems, where each write may
+ * require a round trip to the server.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the output buffer size.
+ * @param size
+ *	The size of the buffer in bytes, or 0 to write the data directly.  The
+ *	default is 8388608 (8 MiB).
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_output_buffer_size(WIMStruct *wim, size_t size);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Set a target for the rate at which subsequent calls to wimlib_write(),
+ * wimlib_write_to_fd(), and wimlib_overwrite() on a ::WIMStruct compress file
+ * data.  While data is being compressed on multiple threads, the rate achieved
+ * is measured about twice a second.  The compression level is lowered when the
+ * rate is below the target and compression is what's holding the write back,
+ * and raised again when the rate is well above the target.  This lets a backup
+ * finish within its time window on a busy or slow system, while compressing
+ * as well as the time allows.  To meet a deadline instead, divide the size of
+ * the data by the time available.
+ *
+ * The level starts at the default compression level (see
+ * wimlib_set_default_compression_level()) and ranges from 10 to 100.  Only the
+ * level is adjusted: the chunk size is fixed for the whole WIM file, or for
+ * each solid resource, before any data is compressed.  The target is ignored
+ * when compressing on a single thread and with
+ * ::WIMLIB_WRITE_FLAG_MULTI_CANDIDATE.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the target.
+ * @param mb_per_sec
+ *	The target in megabytes (1000000 bytes) of uncompressed data per
+ *	second, or 0 to always use the default compression level.  The default
+ *	is 0.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_output_compression_target(WIMStruct *wim, unsigned mb_per_sec);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Set the compression workers that subsequent calls to wimlib_write(),
+ * wimlib_write_to_fd(), and wimlib_overwrite() on a ::WIMStruct send file data
+ * to be compressed.  A compression worker is a process running
+ * wimlib_serve_compression_worker(), typically on another machine, and each
+ * worker is sent chunks over as many connections as it has threads.  Chunks
+ * are still compressed on local threads as well, which get more of the work
+ * whenever the workers can't keep up; and if a worker can't be reached or stops
+ * responding, its chunks are compressed locally instead.  Each chunk that
+ * comes back from a worker is decompressed and checked before it is written.
+ * Offloading compression is most worthwhile for solid LZMS compression, where
+ * compressing a chunk takes far longer than sending it.
+ *
+ * Compression workers are only used when there is enough data to compress in
+ * parallel.  A compression target set with
+ * wimlib_set_output_compression_target() only applies to the local threads.
+ *
+ * This is not supported on Windows.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the compression workers.
+ * @param workers
+ *	A comma-separated list of the addresses of the workers, each in the
+ *	form HOST:PORT, where HOST is a host name or an IP address (in brackets
+ *	if it is an IPv6 address).  @c NULL or an empty string means to
+ *	compress only on local threads, which is the default.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Failed to allocate memory.
+ * @retval ::WIMLIB_ERR_UNSUPPORTED
+ *	Compression workers are not supported on this platform.
+ */
+WIMLIBAPI int
+wimlib_set_output_compression_workers(WIMStruct *wim,
+				      const wimlib_tchar *workers);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Serve as a compression worker for other processes using wimlib; see
+ * wimlib_set_output_compression_workers().  This listens for connections on
+ * @p address and compresses the chunks received over each connection on a
+ * thread of its own.  It doesn't return unless an error occurs.
+ *
+ * The workers are trusted to the extent that anyone who can connect to one can
+ * make it use CPU time and memory, so a worker should only listen where its
+ * clients can reach it.  The data is not encrypted.  To limit the damage, a
+ * worker serves at most 4 connections per thread at a time and closes any
+ * further ones right away, drops a connection on which nothing has been
+ * received for 2 minutes, and only accepts chunk sizes that are valid in a WIM
+ * file for the compression type.
+ *
+ * This is not supported on Windows.
+ *
+ * @param address
+ *	The address on which to listen, in the form HOST:PORT, or just PORT to
+ *	listen on all addresses.
+ * @param num_threads
+ *	The number of threads which the worker advertises to its clients, which
+ *	is how many connections each client makes to it; or 0 for the number of
+ *	processors.
+ *
+ * @return a ::wimlib_error_code value.
+ *
+ * @retval ::WIMLIB_ERR_COMPRESSION_WORKER
+ *	Failed to listen on, or to accept connections on, @p address.
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p address was not a valid address.
+ * @retval ::WIMLIB_ERR_UNSUPPORTED
+ *	Compression workers are not supported on this platform.
+ */
+WIMLIBAPI int
+wimlib_serve_compression_worker(const wimlib_tchar *address,
+				unsigned num_threads);
+
+/** Opaque handle to a pool of compression threads; see
+ * wimlib_create_thread_pool().  */
+struct wimlib_thread_pool;
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Create a pool of threads that can be used to compress data when writing
+ * WIMs.  Normally, each call to wimlib_write(), wimlib_overwrite(), and
+ * similar functions creates its own compression threads and compressors, and
+ * frees them when the call returns.  A thread pool instead persists between
+ * calls.  It can be attached to any number of ::WIMStructs with
+ * wimlib_set_thread_pool(), and it can be used by multiple writes at the same
+ * time, even from different application threads.  This avoids the cost of
+ * creating threads and compressors for each write, and it limits the total
+ * number of threads used for compression to the size of the pool.
+ *
+ * The pool also keeps some idle compressors, so that later writes that use
+ * the same compression type, chunk size, and compression level can reuse
+ * them.  At most two idle compressors per thread are kept.
+ *
+ * On Windows, the pool is also used to compress extracted files with System
+ * Compression when extracting with ::WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS4K or
+ * a similar flag.  The pool is not used for decompression; see
+ * wimlib_set_decompression_threads() for that.
+ *
+ * @param num_threads
+ *	The number of threads to create, or 0 to create one thread per
+ *	processor.
+ * @param pool_ret
+ *	On success, a pointer to the new thread pool is written to this
+ *	location.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p pool_ret was @c NULL.
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Insufficient memory was available, or no threads could be created.
+ */
+WIMLIBAPI int
+wimlib_create_thread_pool(unsigned num_threads,
+			  struct wimlib_thread_pool **pool_ret);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Release a thread pool created by wimlib_create_thread_pool().  The threads
+ * are not actually stopped until every ::WIMStruct that the pool is attached
+ * to has been freed or detached from it, and any writes using the pool have
+ * finished.
+ *
+ * @param pool
+ *	The thread pool to release, or @c NULL.
+ */
+WIMLIBAPI void
+wimlib_free_thread_pool(struct wimlib_thread_pool *pool);
+
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Attach a thread pool to a ::WIMStruct.  Subsequent calls to wimlib_write(),
+ * wimlib_overwrite(), and similar functions on @p wim will compress data using
+ * the threads of @p pool, and they will ignore their @c num_threads
+ * parameter.  The ::WIMStruct holds a reference to the pool until it is freed
+ * or another pool is set.
+ *
+ * @param wim
+ *	The ::WIMStruct to which to attach the thread pool.
+ * @param pool
+ *	The thread pool to use, or @c NULL to go back to creating new threads
+ *	for each write.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_thread_pool(WIMStruct *wim, struct wimlib_thread_pool *pool);
+
+/** Opaque handle to an operation started by wimlib_write_async(),
+ * wimlib_extract_image_async(), or wimlib_export_image_async().  */
+struct wimlib_job;
+
+/**
+ * @ingroup G_general
+ *
+ * Type of a function that is called when an asynchronous operation finishes.
+ * It is called on the thread that ran the operation, just before
+ * wimlib_wait_job() can return.  @p result is the value that the synchronous
+ * version of the operation would have returned.  The function must not call
+ * wimlib_wait_job() on @p job, and it must not wait for any other job either,
+ * since that job may be queued behind this one.
+ */
+typedef void (*wimlib_job_done_func_t)(struct wimlib_job *job, int result,
+				       void *done_ctx);
+
+/**
+ * @ingroup G_general
+ *
+ * Start wimlib_write() in the background and return immediately.
+ *
+ * The operation is queued to run on one of the library's job threads.  These
+ * are shared by all jobs, and there are at most as many of them as there are
+ * CPUs, but at least 2 and at most 16; a job started while they are all busy
+ * waits until one is free.  The compression work of the job is done by the
+ * thread pool attached to @p wim with wimlib_set_thread_pool(), if any, so many
+ * jobs sharing one pool don't use more compression threads than the pool has.
+ *
+ * Until the job has finished, @p wim must not be used or freed by any other
+ * thread, except that progress messages are still sent to the progress
+ * function registered on @p wim.
+ *
+ * @param wim, path, image, write_flags, num_threads
+ *	Same as the corresponding parameters to wimlib_write().
+ * @param done_func
+ *	If not @c NULL, a function to call when the operation finishes.
+ * @param done_ctx
+ *	Context passed to @p done_func.
+ * @param job_ret
+ *	On success, a handle to the job is written to this location.  It must
+ *	be passed to wimlib_wait_job() exactly once to free it.
+ *
+ * @return 0 if the job was started; a ::wimlib_error_code value otherwise.
+ * Errors from the operation itself are returned by wimlib_wait_job() and
+ * passed to @p done_func.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p wim, @p path, or @p job_ret was @c NULL.
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Insufficient memory was available, or there were no job threads and
+ *	none could be created.
+ */
+WIMLIBAPI int
+wimlib_write_async(WIMStruct *wim, const wimlib_tchar *path, int image,
+		   int write_flags, unsigned num_threads,
+		   wimlib_job_done_func_t done_func, void *done_ctx,
+		   struct wimlib_job **job_ret);
+
+/**
+ * @ingroup G_general
+ *
+ * Start wimlib_extract_image() in the background and return immediately.  See
+ * wimlib_write_async() for details.
+ */
+WIMLIBAPI int
+wimlib_extract_image_async(WIMStruct *wim, int image,
+			   const wimlib_tchar *target, int extract_flags,
+			   wimlib_job_done_func_t done_func, void *done_ctx,
+			   struct wimlib_job **job_ret);
+
+/**
+ * @ingroup G_general
+ *
+ * Start wimlib_export_image() in the background and return immediately.  See
+ * wimlib_write_async() for details.  Neither @p src_wim nor @p dest_wim may be
+ * used by any other thread until the job has finished.
+ */
+WIMLIBAPI int
+wimlib_export_image_async(WIMStruct *src_wim, int src_image,
+			  WIMStruct *dest_wim, const wimlib_tchar *dest_name,
+			  const wimlib_tchar *dest_description,
+			  int export_flags,
+			  wimlib_job_done_func_t done_func, void *done_ctx,
+			  struct wimlib_job **job_ret);
+
+/**
+ * @ingroup G_general
+ *
+ * Ask an asynchronous operation to stop.  The operation fails with
+ * ::WIMLIB_ERR_ABORTED_BY_PROGRESS at its next progress message, or right away
+ * if it hasn't started yet, and it cleans up just as if a progress function
+ * had returned ::WIMLIB_PROGRESS_STATUS_ABORT.  Operations that send few
+ * progress messages, such as exports, may still run to completion.  This
+ * function doesn't wait; use wimlib_wait_job() for that.
+ *
+ * @param job
+ *	The job to cancel, or @c NULL.
+ */
+WIMLIBAPI void
+wimlib_cancel_job(struct wimlib_job *job);
+
+/**
+ * @ingroup G_general
+ *
+ * Wait for an asynchronous operation to finish, then free its handle.
+ *
+ * @param job
+ *	The job to wait for.
+ *
+ * @return The result of the operation.
+ */
+WIMLIBAPI int
+wimlib_wait_job(struct wimlib_job *job);
+
 /**
  * @ingroup G_general
  *
@@ -4344,9 +5642,11 @@ wimlib_set_wim_info(WIMStruct *wim, const struct wimlib_wim_info *info,
  *
  * @retval ::WIMLIB_ERR_INVALID_PARAM
  *	@p swm_name was not a nonempty string, or @p part_size was 0.
- * @retval ::WIMLIB_ERR_UNSUPPORTED
- *	The WIM contains solid resources.  Splitting a WIM containing solid
- *	resources is not supported.
+ *
+ * If the WIM contains solid resources, then each solid resource is placed
+ * whole into a single part and is copied without being recompressed, and the
+ * parts are written in the solid WIM format.  A solid resource cannot be
+ * divided among parts, so this may make some parts exceed @p part_size.
  *
  * If a progress function is registered with @p wim, then for each split WIM
  * part that is written it will receive the messages
@@ -4491,6 +5791,9 @@ wimlib_unmount_image_with_progress(const wimlib_tchar *dir,
  *	there was another problem with the provided parameters.
  * @retval ::WIMLIB_ERR_INVALID_REPARSE_DATA
  *	While executing an add command, a reparse point had invalid data.
+ * @retval ::WIMLIB_ERR_INVALID_ARCHIVE
+ *	An add command with ::WIMLIB_ADD_FLAG_ARCHIVE specified was given a file
+ *	that is not a valid tar or cpio archive.
  * @retval ::WIMLIB_ERR_IS_DIRECTORY
  *	An add command attempted to replace a directory with a non-directory; or
  *	a delete command without ::WIMLIB_DELETE_FLAG_RECURSIVE attempted to
@@ -4575,7 +5878,8 @@ wimlib_update_image(WIMStruct *wim,
  *	Bitwise OR of flags prefixed with @c WIMLIB_WRITE_FLAG.
  * @param num_threads
  *	The number of threads to use for compressing data, or 0 to have the
- *	library automatically choose an appropriate number.
+ *	library automatically choose an appropriate number.  This is ignored if
+ *	a thread pool has been set with wimlib_set_thread_pool().
  *
  * @return 0 on success; a ::wimlib_error_code value on failure.
  *
@@ -4643,6 +5947,72 @@ wimlib_write_to_fd(WIMStruct *wim,
 		   int write_flags,
 		   unsigned num_threads);
 
+/**
+ * @ingroup G_writing_and_overwriting_wims
+ *
+ * Same as wimlib_write(), but store the file data of the image(s) in a shared
+ * blob store rather than in the new WIM file.  The blob store is the directory
+ * @p store_dir, which is created if it doesn't exist yet; it contains "pack"
+ * files, which are WIM files that contain no images, only file data.  Since
+ * blobs are identified by their SHA-1 message digests, many WIM files whose
+ * images have much file data in common can share one blob store, and each file
+ * data blob is stored only once.
+ *
+ * All packs in the blob store (all files in @p store_dir whose names end in
+ * ".wim") are first referenced by @p wim, as if by
+ * wimlib_reference_resource_files().  The file data of the image(s) that is
+ * not in any pack yet is then written to a new pack, "pack-<GUID>.wim"; no pack
+ * is created if there is no such data.  Finally, the WIM file at @p path is
+ * written as if with ::WIMLIB_WRITE_FLAG_NO_FILE_DATA, so it contains only the
+ * image metadata and a blob table that refers to the file data in the blob
+ * store.  To read its file data, reference the packs of the blob store with
+ * wimlib_reference_resource_files(), e.g. using ::WIMLIB_REF_FLAG_GLOB_ENABLE
+ * and a glob that matches all ".wim" files in @p store_dir.
+ *
+ * Packs are never modified once written, so a blob store can be read by any
+ * number of processes while a new pack is being written; but only one process
+ * at a time should write to a blob store, or the same data may end up in more
+ * than one pack.  Deleting a pack loses the file data of all WIM files that
+ * refer to it.
+ *
+ * @param wim
+ *	Pointer to the ::WIMStruct being written.
+ * @param path
+ *	Path to the WIM file to write.
+ * @param image
+ *	The 1-based index of the image inside the WIM to write.  Use
+ *	::WIMLIB_ALL_IMAGES to include all images.
+ * @param store_dir
+ *	Path to the directory of the blob store.
+ * @param write_flags
+ *	Bitwise OR of flags prefixed with @c WIMLIB_WRITE_FLAG, as for
+ *	wimlib_write().  They apply to both the new pack and the WIM file.
+ *	::WIMLIB_WRITE_FLAG_PIPABLE, ::WIMLIB_WRITE_FLAG_NO_FILE_DATA, and
+ *	::WIMLIB_WRITE_FLAG_RESUMABLE are not accepted.
+ * @param num_threads
+ *	The number of threads to use for compressing data, or 0 to have the
+ *	library automatically choose an appropriate number.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.  The possible
+ * error codes include those that can be returned by wimlib_write() and
+ * wimlib_reference_resource_files() as well as the following:
+ *
+ * @retval ::WIMLIB_ERR_INVALID_PARAM
+ *	@p path or @p store_dir was @c NULL or empty, or @p write_flags
+ *	contained a flag that is not accepted.
+ * @retval ::WIMLIB_ERR_MKDIR
+ *	The blob store directory could not be created.
+ * @retval ::WIMLIB_ERR_RENAME
+ *	The new pack could not be renamed into place.
+ */
+WIMLIBAPI int
+wimlib_write_with_blob_store(WIMStruct *wim,
+			     const wimlib_tchar *path,
+			     int image,
+			     const wimlib_tchar *store_dir,
+			     int write_flags,
+			     unsigned num_threads);
+
 /**
  * @defgroup G_compression Compression and decompression functions
  *
@@ -4665,6 +6035,12 @@ struct wimlib_compressor;
 /** Opaque decompressor handle.  */
 struct wimlib_decompressor;
 
+/** Opaque handle for a compressor that produces a compressed stream.  */
+struct wimlib_stream_compressor;
+
+/** Opaque handle for reading a compressed stream.  */
+struct wimlib_compressed_stream;
+
 /**
  * Set the default compression level for the specified compression type.  This
  * is the compression level that wimlib_create_compressor() assumes if it is
@@ -4899,6 +6275,166 @@ wimlib_decompress(const void *compressed_data, size_t compressed_size,
 WIMLIBAPI void
 wimlib_free_decompressor(struct wimlib_decompressor *decompressor);
 
+/**
+ * Type of a callback function that receives the output of a stream compressor.
+ * It must write all @p size bytes at @p data and return 0, or return a nonzero
+ * error code, which will then be returned by the stream compressor function
+ * that called it.
+ */
+typedef int (*wimlib_stream_write_func_t)(const void *data, size_t size,
+					  void *ctx);
+
+/**
+ * Type of a callback function that provides the data of a compressed stream.
+ * It must read exactly @p size bytes at offset @p offset of the compressed
+ * stream into @p buf and return 0, or return a nonzero error code, which will
+ * then be returned by the function that called it.
+ */
+typedef int (*wimlib_stream_read_func_t)(void *buf, size_t size,
+					 uint64_t offset, void *ctx);
+
+/**
+ * Create a compressor that compresses an arbitrarily long stream of data, which
+ * need not be part of a WIM file.
+ *
+ * The data is split into chunks of @p chunk_size bytes which are compressed
+ * independently, possibly in parallel, in the same way as the data of WIM
+ * resources.  The compressed stream is written sequentially through @p
+ * write_func in a simple format ending with a table of chunk sizes, so that it
+ * can later be read with random access using wimlib_open_compressed_stream().
+ * The default compression level for @p ctype is used.
+ *
+ * @param ctype
+ *	The compression format to use.
+ * @param chunk_size
+ *	The chunk size to use.  This must be a chunk size accepted by
+ *	wimlib_create_compressor() for @p ctype.
+ * @param num_threads
+ *	The number of threads to use for compression, or 0 to use one thread
+ *	per processor.
+ * @param write_func
+ *	The function to which the compressed stream is written, in order.
+ * @param write_ctx
+ *	An extra parameter passed to @p write_func.
+ * @param compressor_ret
+ *	On success, a pointer to the new stream compressor is written here.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_COMPRESSION_TYPE
+ *	@p ctype was not a supported compression type.
+ * @retval ::WIMLIB_ERR_INVALID_CHUNK_SIZE
+ *	@p chunk_size was invalid for @p ctype.
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Insufficient memory was available.
+ *
+ * This function can also fail with any error returned by @p write_func, since
+ * the header of the compressed stream is written immediately.
+ */
+WIMLIBAPI int
+wimlib_create_stream_compressor(enum wimlib_compression_type ctype,
+				uint32_t chunk_size, unsigned num_threads,
+				wimlib_stream_write_func_t write_func,
+				void *write_ctx,
+				struct wimlib_stream_compressor **compressor_ret);
+
+/**
+ * Append data to a stream being compressed with a stream compressor.  The data
+ * may be passed in pieces of any size.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.  After a
+ * failure, all later calls with the same stream compressor, other than
+ * wimlib_free_stream_compressor(), fail with the same error.
+ */
+WIMLIBAPI int
+wimlib_stream_compress(struct wimlib_stream_compressor *compressor,
+		       const void *data, size_t size);
+
+/**
+ * Finish compressing a stream: write any remaining compressed chunks, followed
+ * by the chunk table and footer.  No more data can be passed to the stream
+ * compressor afterwards.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ */
+WIMLIBAPI int
+wimlib_finish_stream_compressor(struct wimlib_stream_compressor *compressor);
+
+/**
+ * Free a stream compressor previously allocated with
+ * wimlib_create_stream_compressor().  If wimlib_finish_stream_compressor() was
+ * not called, the compressed stream is left incomplete.
+ *
+ * @param compressor
+ *	The stream compressor to free.  If @c NULL, no action is taken.
+ */
+WIMLIBAPI void
+wimlib_free_stream_compressor(struct wimlib_stream_compressor *compressor);
+
+/**
+ * Open a compressed stream that was written by a stream compressor, for random
+ * access to its uncompressed data.
+ *
+ * @param read_func
+ *	The function used to read the compressed stream.
+ * @param read_ctx
+ *	An extra parameter passed to @p read_func.
+ * @param compressed_size
+ *	The total size of the compressed stream, in bytes.
+ * @param stream_ret
+ *	On success, a pointer to the opened compressed stream is written here.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_NOT_A_WIM_FILE
+ *	The data was not a compressed stream written by a stream compressor.
+ * @retval ::WIMLIB_ERR_INVALID_HEADER
+ *	The chunk table or footer of the compressed stream was invalid.
+ * @retval ::WIMLIB_ERR_UNEXPECTED_END_OF_FILE
+ *	@p compressed_size was too small to be a compressed stream.
+ * @retval ::WIMLIB_ERR_NOMEM
+ *	Insufficient memory was available.
+ *
+ * This function can also fail with ::WIMLIB_ERR_INVALID_COMPRESSION_TYPE or
+ * ::WIMLIB_ERR_INVALID_CHUNK_SIZE, or with any error returned by @p read_func.
+ */
+WIMLIBAPI int
+wimlib_open_compressed_stream(wimlib_stream_read_func_t read_func,
+			      void *read_ctx, uint64_t compressed_size,
+			      struct wimlib_compressed_stream **stream_ret);
+
+/**
+ * Return the uncompressed size, in bytes, of a compressed stream.
+ */
+WIMLIBAPI uint64_t
+wimlib_get_compressed_stream_size(const struct wimlib_compressed_stream *stream);
+
+/**
+ * Read uncompressed data from a compressed stream.  Only the chunks that
+ * overlap the requested range are read and decompressed, and the most recently
+ * decompressed chunk is cached so that sequential reads are efficient.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_UNEXPECTED_END_OF_FILE
+ *	The requested range extended past the end of the uncompressed data.
+ * @retval ::WIMLIB_ERR_DECOMPRESSION
+ *	A chunk of the compressed stream was invalid.
+ */
+WIMLIBAPI int
+wimlib_read_compressed_stream(struct wimlib_compressed_stream *stream,
+			      uint64_t offset, void *buf, size_t size);
+
+/**
+ * Close a compressed stream previously opened with
+ * wimlib_open_compressed_stream().
+ *
+ * @param stream
+ *	The compressed stream to close.  If @c NULL, no action is taken.
+ */
+WIMLIBAPI void
+wimlib_close_compressed_stream(struct wimlib_compressed_stream *stream);
+
 
 /**
  * @}
@@ -3,6 +3,7 @@
 
 #include "wimlib/compiler.h"
 #include "wimlib/file_io.h"
+#include "wimlib/inode.h"
 #include "wimlib/list.h"
 #include "wimlib/progress.h"
 #include "wimlib/types.h"
@@ -66,6 +67,12 @@ struct apply_ctx {
 	/* Features supported by the extraction mode (with booleans)  */
 	struct wim_features supported_features;
 
+	/* True if all images are being extracted at once.  The dentry tree
+	 * being extracted then has a placeholder root directory, which stands
+	 * for @target itself, and each image's root directory is a child of it,
+	 * extracted to a subdirectory of @target.  */
+	bool all_images;
+
 	/* The members below should not be used outside of extract.c  */
 	const struct apply_operations *apply_ops;
 	u64 next_progress;
@@ -255,6 +262,21 @@ struct apply_operations {
 	 */
 	int (*will_back_from_wim)(struct wim_dentry *dentry, struct apply_ctx *ctx);
 
+	/*
+	 * For WIMLIB_EXTRACT_FLAG_UPDATE: find the files in @dentry_list that
+	 * already exist at the target with the contents they have in the image,
+	 * and set 'i_unchanged' on their inodes.  The data of these files is
+	 * then not extracted, and the extraction backend must not recreate
+	 * them.  This is called before the blobs to extract are determined.
+	 *
+	 * This routine is optional.  If it isn't provided, then
+	 * WIMLIB_EXTRACT_FLAG_UPDATE is unsupported.
+	 *
+	 * Return 0 if successful; otherwise a positive wimlib error code.
+	 */
+	int (*find_unchanged_files)(struct list_head *dentry_list,
+				    struct apply_ctx *ctx);
+
 	/*
 	 * Size of the backend-specific extraction context.  It must contain
 	 * 'struct apply_ctx' as its first member.
@@ -266,12 +288,41 @@ struct apply_operations {
 	 * that form a single tree, not multiple trees.
 	 */
 	bool single_tree_only;
+
+	/*
+	 * Set this if the extraction backend can extract a blob to any number
+	 * of targets itself, without having more than MAX_OPEN_FILES open at
+	 * once.  Otherwise, blobs with more targets than that are first
+	 * extracted to a temporary file by the common extraction code.
+	 */
+	bool unlimited_blob_targets;
+
+	/*
+	 * Set this if the extraction backend can only extract a blob to one
+	 * target at a time, e.g. because it writes the files sequentially.
+	 * Blobs with more than one target are then first extracted to a
+	 * temporary file by the common extraction code, and each target gets
+	 * its own pass over the data.
+	 */
+	bool single_blob_target;
 };
 
+/* Should the specified file be extracted as a directory on UNIX?  We extract
+ * the file as a directory if FILE_ATTRIBUTE_DIRECTORY is set and the file does
+ * not have a symlink or junction reparse point.  It *may* have a different type
+ * of reparse point.  */
+static inline bool
+should_extract_as_directory(const struct wim_inode *inode)
+{
+	return (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+		!inode_is_symlink(inode);
+}
+
 #ifdef _WIN32
   extern const struct apply_operations win32_apply_ops;
 #else
   extern const struct apply_operations unix_apply_ops;
+  extern const struct apply_operations tar_apply_ops;
 #endif
 
 #ifdef WITH_NTFS_3G
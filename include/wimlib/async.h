@@ -0,0 +1,7 @@
+#ifndef _WIMLIB_ASYNC_H
+#define _WIMLIB_ASYNC_H
+
+void
+cleanup_async_jobs(void);
+
+#endif /* _WIMLIB_ASYNC_H */
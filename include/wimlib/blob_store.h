@@ -0,0 +1,10 @@
+#ifndef _WIMLIB_BLOB_STORE_H
+#define _WIMLIB_BLOB_STORE_H
+
+#include "wimlib/types.h"
+
+extern int
+reference_blob_store_packs(WIMStruct *wim, const tchar * const *paths,
+			   unsigned num_paths);
+
+#endif /* _WIMLIB_BLOB_STORE_H */
@@ -26,10 +26,22 @@ enum blob_location {
 	 * pointed to by @attached_buffer.  */
 	BLOB_IN_ATTACHED_BUFFER,
 
+	/* The blob is the metadata resource of the image @dentry_tree_imd,
+	 * which is serialized from the image's dentry tree each time the blob
+	 * is read.  See prepare_metadata_resource().  */
+	BLOB_IN_DENTRY_TREE,
+
+	/* The blob's data is the result of applying the delta data in the
+	 * delta resource (WIM_RESHDR_FLAG_DELTA) whose delta data is described
+	 * by @rdesc to a base blob, which is looked up in the blob table of
+	 * @rdesc->wim.  See delta.c.  */
+	BLOB_IN_WIM_DELTA,
+
 #ifdef WITH_FUSE
 	/* The blob's data is available as the contents of the file with name
 	 * @staging_file_name relative to the open directory file descriptor
-	 * @staging_dir_fd.  */
+	 * @staging_dir_fd, except for any blocks that @staging_cow says are
+	 * still to be read from another blob.  */
 	BLOB_IN_STAGING_FILE,
 #endif
 
@@ -65,9 +77,6 @@ struct blob_extraction_target {
  */
 struct blob_descriptor {
 
-	/* List node for a hash bucket of the blob table  */
-	struct hlist_node hash_list;
-
 	/*
 	 * Uncompressed size of this blob.
 	 *
@@ -154,10 +163,24 @@ struct blob_descriptor {
 	/* Only used by wimlib_export_image() */
 	u16 was_exported : 1;
 
+	/* 1 iff this blob's SHA-1 message digest should be cached in the file
+	 * from which it was captured once it has been computed
+	 * (WIMLIB_ADD_FLAG_HASH_CACHE)  */
+	u16 save_hash_in_file : 1;
+
+	/* 1 iff this blob's data is known to be present in a pack of the blob
+	 * store being written to (wimlib_write_with_blob_store())  */
+	u16 in_blob_store : 1;
+
+	/* If not NULL, the slab from which this blob descriptor was allocated
+	 * by read_blob_table(), rather than individually.  */
+	struct blob_slab *slab;
+
 	/* Specification of where this blob's data is located.  Which member of
 	 * this union is valid is determined by the @blob_location field.  */
 	union {
-		/* BLOB_IN_WIM  */
+		/* BLOB_IN_WIM
+		 * BLOB_IN_WIM_DELTA  */
 		struct {
 			struct wim_resource_descriptor *rdesc;
 			u64 offset_in_res;
@@ -179,16 +202,41 @@ struct blob_descriptor {
 						struct windows_file *windows_file;
 					};
 					struct wim_inode *file_inode;
+
+					/* BLOB_IN_FILE_ON_DISK only: the
+					 * physical location of the start of the
+					 * file's data on its device, if known
+					 * (see WIMLIB_ADD_FLAG_PHYSICAL_ORDER),
+					 * else 0  */
+					u64 file_physical_offset;
+
+					/* BLOB_IN_FILE_ON_DISK only: the
+					 * offset of the data in the file, which
+					 * is nonzero if the file is an archive
+					 * (see WIMLIB_ADD_FLAG_ARCHIVE)  */
+					u64 file_data_offset;
+
+					/* A blob in a referenced WIM of which
+					 * this blob is likely a modified
+					 * version, or NULL.  Set by
+					 * wimlib_reference_template_image() for
+					 * use with
+					 * WIMLIB_WRITE_FLAG_BINARY_DELTA.  */
+					struct blob_descriptor *delta_base;
 				};
 
 				/* BLOB_IN_ATTACHED_BUFFER */
 				void *attached_buffer;
 
+				/* BLOB_IN_DENTRY_TREE */
+				struct wim_image_metadata *dentry_tree_imd;
+
 			#ifdef WITH_FUSE
 				/* BLOB_IN_STAGING_FILE  */
 				struct {
 					char *staging_file_name;
 					int staging_dir_fd;
+					struct staging_cow *staging_cow;
 				};
 			#endif
 
@@ -240,6 +288,12 @@ struct blob_descriptor {
 			};
 		};
 
+		/* Used temporarily during a scan with a scan_hasher, and by a
+		 * read-write mount for the staging files of closed streams:
+		 * the job computing this blob's SHA-1 message digest, or NULL.
+		 */
+		struct scan_hash_job *scan_hash_job;
+
 		/* Used temporarily during extraction.  This is an array of
 		 * references to the streams being extracted that use this blob.
 		 * out_refcnt tracks the number of slots filled.  */
@@ -279,7 +333,7 @@ write_blob_table_from_blob_list(struct list_head *blob_list,
 				struct filedes *out_fd,
 				u16 part_number,
 				struct wim_reshdr *out_reshdr,
-				int write_resource_flags);
+				bool pipable, bool no_file_data);
 
 struct blob_descriptor *
 new_blob_descriptor(void);
@@ -287,6 +341,16 @@ new_blob_descriptor(void);
 struct blob_descriptor *
 clone_blob_descriptor(const struct blob_descriptor *blob);
 
+struct blob_descriptor *
+clone_blob_descriptor_from_slab(const struct blob_descriptor *blob,
+				struct blob_slab **slab_p);
+
+void
+put_blob_slab(struct blob_slab *slab);
+
+struct blob_descriptor *
+move_blob_descriptor_out_of_slab(struct blob_descriptor *blob);
+
 void
 blob_decrement_refcnt(struct blob_descriptor *blob, struct blob_table *table);
 
@@ -297,6 +361,35 @@ blob_subtract_refcnt(struct blob_descriptor *blob, struct blob_table *table,
 #ifdef WITH_FUSE
 void
 blob_decrement_num_opened_fds(struct blob_descriptor *blob);
+
+/*
+ * For a blob in a staging file, the blocks of data that haven't been written
+ * since the stream was opened for writing, and so are still to be read from
+ * the blob it had before.  The staging file is sparse there.  See
+ * mount_image.c.
+ */
+struct staging_cow {
+	/* Copy of the previous blob descriptor, not in any blob table  */
+	struct blob_descriptor *base;
+
+	/* Bytes of the blob that may still be read from @base; anything in a
+	 * clean block beyond this was truncated and reads as zeroes  */
+	u64 base_size;
+
+	/* Number of blocks in @clean_map, and how many of them are clean  */
+	u64 num_blocks;
+	u64 num_clean;
+
+	/* One bit per block, set if the block is clean  */
+	machine_word_t clean_map[];
+};
+
+struct staging_cow *
+new_staging_cow(const struct blob_descriptor *base, u64 base_size,
+		u32 block_order);
+
+void
+free_staging_cow(struct staging_cow *cow);
 #endif
 
 void
@@ -305,6 +398,9 @@ blob_release_location(struct blob_descriptor *blob);
 void
 free_blob_descriptor(struct blob_descriptor *blob);
 
+void
+blob_table_reserve_for(struct blob_table *table, const struct blob_table *src);
+
 void
 blob_table_insert(struct blob_table *table, struct blob_descriptor *blob);
 
@@ -380,6 +476,25 @@ blob_set_is_located_in_attached_buffer(struct blob_descriptor *blob,
 	blob->size = size;
 }
 
+static inline void
+blob_set_is_located_in_dentry_tree(struct blob_descriptor *blob,
+				   struct wim_image_metadata *imd, u64 size)
+{
+	blob->blob_location = BLOB_IN_DENTRY_TREE;
+	blob->dentry_tree_imd = imd;
+	blob->size = size;
+}
+
+/* Return true if the blob's data is located in the WIM file @wim, either in a
+ * normal resource or in a delta resource.  */
+static inline bool
+blob_is_in_wim(const struct blob_descriptor *blob, const WIMStruct *wim)
+{
+	return (blob->blob_location == BLOB_IN_WIM ||
+		blob->blob_location == BLOB_IN_WIM_DELTA) &&
+		blob->rdesc->wim == wim;
+}
+
 static inline bool
 blob_is_in_file(const struct blob_descriptor *blob)
 {
@@ -421,6 +536,23 @@ hash_unhashed_blob(struct blob_descriptor *blob, struct blob_table *blob_table,
 struct blob_descriptor **
 retrieve_pointer_to_unhashed_blob(struct blob_descriptor *blob);
 
+#ifndef _WIN32
+/* unix_capture.c */
+void
+save_blob_hash_in_file(struct blob_descriptor *blob);
+#endif
+
+/* Called when the SHA-1 message digest of the unhashed @blob has just been
+ * computed.  */
+static inline void
+blob_hash_computed(struct blob_descriptor *blob)
+{
+#ifndef _WIN32
+	if (unlikely(blob->save_hash_in_file))
+		save_blob_hash_in_file(blob);
+#endif
+}
+
 static inline void
 prepare_unhashed_blob(struct blob_descriptor *blob,
 		      struct wim_inode *back_inode, u32 stream_id,
@@ -75,23 +75,6 @@
 #undef TEMPLATED
 #define TEMPLATED(name)		CONCAT(name, MF_SUFFIX)
 
-#ifndef _WIMLIB_BT_MATCHFINDER_H
-#define _WIMLIB_BT_MATCHFINDER_H
-
-/* Non-templated definitions  */
-
-/* Representation of a match found by the bt_matchfinder  */
-struct lz_match {
-
-	/* The number of bytes matched.  */
-	u32 length;
-
-	/* The offset back from the current position that was matched.  */
-	u32 offset;
-};
-
-#endif /* _WIMLIB_BT_MATCHFINDER_H */
-
 struct TEMPLATED(bt_matchfinder) {
 
 	/* The hash table for finding length 2 matches, if enabled  */
@@ -171,6 +154,7 @@ TEMPLATED(bt_matchfinder_advance_one_byte)(struct TEMPLATED(bt_matchfinder) * co
 	STATIC_ASSERT(BT_MATCHFINDER_HASH3_WAYS >= 1 &&
 		      BT_MATCHFINDER_HASH3_WAYS <= 2);
 	u32 cur_node;
+	u32 cur_node_4;
 #if BT_MATCHFINDER_HASH3_WAYS >= 2
 	u32 cur_node_2;
 #endif
@@ -190,6 +174,14 @@ TEMPLATED(bt_matchfinder_advance_one_byte)(struct TEMPLATED(bt_matchfinder) * co
 	prefetchw(&mf->hash3_tab[next_hashes[0]]);
 	prefetchw(&mf->hash4_tab[next_hashes[1]]);
 
+	/* Look up the root of the binary tree first, and prefetch its string
+	 * and children so that the cache misses on them, which are frequent
+	 * with large buffers, overlap with the length 2 and 3 searches.  */
+	cur_node_4 = mf->hash4_tab[hash4];
+	mf->hash4_tab[hash4] = cur_pos;
+	prefetchr(&in_begin[cur_node_4]);
+	prefetchw(TEMPLATED(bt_left_child)(mf, cur_node_4));
+
 #ifdef BT_MATCHFINDER_HASH2_ORDER
 	seq2 = load_u16_unaligned(in_next);
 	hash2 = lz_hash(seq2, BT_MATCHFINDER_HASH2_ORDER);
@@ -227,8 +219,7 @@ TEMPLATED(bt_matchfinder_advance_one_byte)(struct TEMPLATED(bt_matchfinder) * co
 	#endif
 	}
 
-	cur_node = mf->hash4_tab[hash4];
-	mf->hash4_tab[hash4] = cur_pos;
+	cur_node = cur_node_4;
 
 	pending_lt_ptr = TEMPLATED(bt_left_child)(mf, cur_pos);
 	pending_gt_ptr = TEMPLATED(bt_right_child)(mf, cur_pos);
@@ -0,0 +1,54 @@
+/*
+ * chunk_cache.h
+ *
+ * A cache of decompressed chunks and parsed chunk tables of WIM resources, for
+ * random-access reads.
+ */
+
+#ifndef _WIMLIB_CHUNK_CACHE_H
+#define _WIMLIB_CHUNK_CACHE_H
+
+#include "wimlib/list.h"
+#include "wimlib/types.h"
+
+/* The chunk index under which a resource's parsed chunk table is cached  */
+#define CHUNK_CACHE_CHUNK_TABLE_INDEX	(~(u64)0)
+
+/* An item in a chunk cache: either the uncompressed data of one chunk of a
+ * resource, or the parsed chunk table of a resource.  Resources are identified
+ * by their offset in the WIM file, which is unique for as long as the file
+ * isn't rewritten.  */
+struct cached_chunk {
+	struct hlist_node hash_node;
+	struct list_head lru_node;
+	u64 res_offset;
+	u64 index;
+	u64 size;
+	u8 data[];
+};
+
+struct chunk_cache;
+
+int
+new_chunk_cache(struct chunk_cache **cache_ret);
+
+void
+free_chunk_cache(struct chunk_cache *cache);
+
+void
+chunk_cache_clear(struct chunk_cache *cache);
+
+struct cached_chunk *
+chunk_cache_lookup(struct chunk_cache *cache, u64 res_offset, u64 index);
+
+struct cached_chunk *
+new_cached_chunk(u64 res_offset, u64 index, size_t size);
+
+void
+chunk_cache_shrink(struct chunk_cache *cache, u64 max_size);
+
+void
+chunk_cache_insert(struct chunk_cache *cache, struct cached_chunk *chunk,
+		   u64 max_size);
+
+#endif /* _WIMLIB_CHUNK_CACHE_H */
@@ -9,6 +9,8 @@
 
 #include "wimlib/types.h"
 
+struct wimlib_thread_pool;
+
 /* Interface for chunk compression.  Users can submit chunks of data to be
  * compressed, then retrieve them later in order.  This interface can be
  * implemented either in serial (having the calling thread compress the chunks
@@ -65,11 +67,22 @@ struct chunk_compressor {
 
 int
 new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
-			      unsigned num_threads, u64 max_memory,
+			      unsigned num_threads,
+			      struct wimlib_thread_pool *pool, u64 max_memory,
+			      bool multi_candidate, unsigned target_mb_per_sec,
 			      struct chunk_compressor **compressor_ret);
 
+int
+new_remote_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    const tchar *workers, unsigned num_threads,
+			    struct wimlib_thread_pool *pool, u64 max_memory,
+			    bool multi_candidate, unsigned target_mb_per_sec,
+			    struct chunk_compressor **compressor_ret);
+
 int
 new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    struct wimlib_thread_pool *pool,
+			    bool multi_candidate,
 			    struct chunk_compressor **compressor_ret);
 
 #endif /* _WIMLIB_CHUNK_COMPRESSOR_H  */
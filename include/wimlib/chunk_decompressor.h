@@ -0,0 +1,106 @@
+/*
+ * chunk_decompressor.h
+ *
+ * Interface for parallel chunk decompression.
+ */
+
+#ifndef _WIMLIB_CHUNK_DECOMPRESSOR_H
+#define _WIMLIB_CHUNK_DECOMPRESSOR_H
+
+#include "wimlib/types.h"
+
+struct filedes;
+struct wimlib_decompressor;
+
+/* Interface for chunk decompression.  Users can submit chunks of compressed
+ * data to be decompressed, then retrieve the uncompressed data later in order.
+ * This is the counterpart of `struct chunk_compressor', but currently there is
+ * only a parallel implementation; the serial case is handled directly by
+ * read_compressed_wim_resource().  */
+struct chunk_decompressor {
+	/* Variables set by the chunk decompressor when it is created.  */
+	int in_ctype;
+	u32 in_chunk_size;
+	unsigned num_threads;
+
+	/* Variable set by the user of the chunk decompressor.  If true, chunks
+	 * that fail to decompress will be filled with whatever data could be
+	 * recovered rather than being reported as errors.  Applies to chunks
+	 * submitted after it is set.  */
+	bool recover_data;
+
+	/* Free the chunk decompressor.  */
+	void (*destroy)(struct chunk_decompressor *);
+
+	/* Try to borrow a buffer into which the compressed data for the next
+	 * chunk should be read.  The buffer has space for at least
+	 * @in_chunk_size bytes.
+	 *
+	 * Only one buffer can be borrowed at a time.
+	 *
+	 * Returns a pointer to the buffer, or NULL if no buffer is available.
+	 * If no buffer is available, you must call ->get_decompression_result()
+	 * to retrieve a decompressed chunk before trying again.  */
+	void *(*get_chunk_buffer)(struct chunk_decompressor *);
+
+	/* Signals to the chunk decompressor that the buffer which was loaned
+	 * out from ->get_chunk_buffer() has finished being filled and contains
+	 * the specified number of bytes of compressed data, which decompress to
+	 * the specified number of bytes of uncompressed data.  If the two sizes
+	 * are equal, the chunk is stored uncompressed.  */
+	void (*signal_chunk_filled)(struct chunk_decompressor *, u32, u32);
+
+	/* Alternative to ->get_chunk_buffer() and ->signal_chunk_filled():
+	 * submit a chunk whose compressed data a worker thread should read
+	 * itself from the specified seekable file at the specified offset.  The
+	 * last two arguments are the compressed and uncompressed sizes, as for
+	 * ->signal_chunk_filled().  This keeps the reads off the submitting
+	 * thread.
+	 *
+	 * Returns %false if no buffer is available, in which case you must call
+	 * ->get_decompression_result() before trying again.  */
+	bool (*submit_chunk_read)(struct chunk_decompressor *, struct filedes *,
+				  u64, u32, u32);
+
+	/* Get the next chunk of uncompressed data.
+	 *
+	 * The uncompressed data, its size, and a status code are returned in
+	 * the locations pointed to by arguments 2-4.  The status code is 0 on
+	 * success, or WIMLIB_ERR_DECOMPRESSION or (for chunks submitted with
+	 * ->submit_chunk_read()) an error code from full_pread(), in which case
+	 * an error message has already been printed and errno is set.  The uncompressed data is in storage internal to the
+	 * chunk decompressor, and it cannot be accessed beyond any subsequent
+	 * calls to the chunk decompressor.
+	 *
+	 * Chunks will be returned in the same order in which they were
+	 * submitted for decompression.
+	 *
+	 * The return value is %true if a chunk was successfully retrieved, or
+	 * %false if there are no chunks currently being decompressed.  */
+	bool (*get_decompression_result)(struct chunk_decompressor *,
+					 const void **, u32 *, int *);
+};
+
+int
+new_parallel_chunk_decompressor(int in_ctype, u32 in_chunk_size,
+				unsigned num_threads, u64 max_memory,
+				struct chunk_decompressor **decompressor_ret);
+
+/* Drain and discard any chunks still being decompressed.  */
+static inline void
+chunk_decompressor_drain(struct chunk_decompressor *d)
+{
+	const void *udata;
+	u32 usize;
+	int status;
+
+	while ((*d->get_decompression_result)(d, &udata, &usize, &status))
+		;
+}
+
+/* Decompress a single chunk, implemented in resource.c  */
+int
+decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
+		 struct wimlib_decompressor *decompressor, bool recover_data);
+
+#endif /* _WIMLIB_CHUNK_DECOMPRESSOR_H */
@@ -16,4 +16,32 @@ void
 make_canonical_huffman_code(unsigned num_syms, unsigned max_codeword_len,
 			    const u32 freqs[], u8 lens[], u32 codewords[]);
 
+void
+make_canonical_huffman_code_lens(unsigned num_syms, unsigned max_codeword_len,
+				 const u32 freqs[], u8 lens[],
+				 u32 working_space[]);
+
+/* Chunks are only checked with chunk_looks_incompressible() at compression
+ * levels up to this one.  At higher levels, the user has asked for small output
+ * over speed, and compressing chunks that look incompressible still saves some
+ * space now and then.  */
+#define MAX_INCOMPRESSIBLE_PROBE_LEVEL	34
+
+/* Working space for chunk_looks_incompressible()  */
+struct incompressible_probe {
+	u32 counts[256];
+	u32 seqs[1 << 12];
+};
+
+bool
+chunk_looks_incompressible(struct incompressible_probe *probe,
+			   const u8 *data, u32 size);
+
+struct wimlib_compressor;
+
+u32
+compress_chunk_best_of(const void *udata, u32 usize, u8 **cdata, u8 **scratch,
+		       struct wimlib_compressor * const compressors[],
+		       unsigned num_compressors);
+
 #endif /* _WIMLIB_COMPRESS_COMMON_H */
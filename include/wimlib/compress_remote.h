@@ -0,0 +1,29 @@
+/*
+ * compress_remote.h
+ *
+ * Client side of the protocol for compressing chunks on compression workers
+ * (see wimlib_serve_compression_worker()).
+ */
+
+#ifndef _WIMLIB_COMPRESS_REMOTE_H
+#define _WIMLIB_COMPRESS_REMOTE_H
+
+#include "wimlib/types.h"
+
+/* A connection to a compression worker  */
+struct remote_compressor;
+
+int
+remote_compressor_connect(const tchar *address, int ctype, u32 chunk_size,
+			  const unsigned levels[], unsigned num_levels,
+			  struct remote_compressor **rc_ret,
+			  unsigned *num_threads_ret);
+
+int
+remote_compress_chunk(struct remote_compressor *rc, const void *udata,
+		      u32 usize, void *cdata, u32 *csize_ret);
+
+void
+remote_compressor_close(struct remote_compressor *rc);
+
+#endif /* _WIMLIB_COMPRESS_REMOTE_H */
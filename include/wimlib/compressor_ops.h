@@ -33,4 +33,13 @@ extern const struct compressor_ops lzx_compressor_ops;
 extern const struct compressor_ops xpress_compressor_ops;
 extern const struct compressor_ops lzms_compressor_ops;
 
+unsigned int
+get_default_compression_level(int ctype);
+
+#define MAX_COMPRESSION_CANDIDATES	2
+
+unsigned int
+get_candidate_compression_levels(int ctype,
+				 unsigned int levels[MAX_COMPRESSION_CANDIDATES]);
+
 #endif /* _WIMLIB_COMPRESSOR_OPS_H */
@@ -209,10 +209,10 @@ bitstream_align(struct input_bitstream *is)
 
 /*
  * Required alignment for the Huffman decode tables.  We require this alignment
- * so that we can fill the entries with vector or word instructions and not have
- * to deal with misaligned buffers.
+ * so that we can fill the entries with vector or word instructions (up to 256
+ * bits wide) and not have to deal with misaligned buffers.
  */
-#define DECODE_TABLE_ALIGNMENT 16
+#define DECODE_TABLE_ALIGNMENT 32
 
 /*
  * Each decode table entry is 16 bits divided into two fields: 'symbol' (high 12
@@ -428,16 +428,21 @@ copy_word_unaligned(const void *src, void *dst)
 }
 
 static forceinline machine_word_t
-repeat_u16(u16 b)
+repeat_u32(u32 b)
 {
 	machine_word_t v = b;
 
 	STATIC_ASSERT(WORDBITS == 32 || WORDBITS == 64);
-	v |= v << 16;
 	v |= v << ((WORDBITS == 64) ? 32 : 0);
 	return v;
 }
 
+static forceinline machine_word_t
+repeat_u16(u16 b)
+{
+	return repeat_u32(((u32)b << 16) | b);
+}
+
 static forceinline machine_word_t
 repeat_byte(u8 b)
 {
@@ -502,41 +507,59 @@ lz_copy(u32 length, u32 offset, u8 *out_begin, u8 *out_next, u8 *out_end,
 	 * example, if a word is 8 bytes and the match is of length 5, then
 	 * we'll simply copy 8 bytes.  This is okay as long as we don't write
 	 * beyond the end of the output buffer, hence the check for (out_end -
-	 * end >= WORDBYTES - 1).
+	 * end >= 2 * WORDBYTES - 1), which leaves room for the loops below to
+	 * write two words per iteration.
 	 */
-	if (UNALIGNED_ACCESS_IS_FAST && likely(out_end - end >= WORDBYTES - 1))
+	if (UNALIGNED_ACCESS_IS_FAST &&
+	    likely(out_end - end >= 2 * WORDBYTES - 1))
 	{
+		machine_word_t v;
+
 		if (offset >= WORDBYTES) {
-			/* The source and destination words don't overlap. */
+			/* The source and destination words don't overlap.
+			 * Copy two words per iteration, which helps long
+			 * matches such as the ones that make up runs of
+			 * zeroes. */
 			do {
 				copy_word_unaligned(src, out_next);
-				src += WORDBYTES;
-				out_next += WORDBYTES;
-			} while (out_next < end);
-			return 0;
-		} else if (offset == 1) {
-			/* Offset 1 matches are equivalent to run-length
-			 * encoding of the previous byte.  This case is common
-			 * if the data contains many repeated bytes. */
-			machine_word_t v = repeat_byte(*(out_next - 1));
-			do {
-				store_word_unaligned(v, out_next);
-				src += WORDBYTES;
-				out_next += WORDBYTES;
+				copy_word_unaligned(src + WORDBYTES,
+						    out_next + WORDBYTES);
+				src += 2 * WORDBYTES;
+				out_next += 2 * WORDBYTES;
 			} while (out_next < end);
 			return 0;
 		}
+
 		/*
+		 * Offsets which divide the word size are run-length encoding
+		 * of a 1, 2, or 4-byte pattern.  Broadcast the pattern to a
+		 * full word and store it repeatedly; since the pattern repeats
+		 * exactly within each word, this produces the same result as
+		 * a bytewise copy.  Offset 1 is common if the data contains
+		 * many repeated bytes, and offsets 2 and 4 are common for
+		 * arrays of 16-bit and 32-bit values.
+		 *
 		 * We don't bother with special cases for other 'offset <
-		 * WORDBYTES', which are usually rarer than 'offset == 1'.
-		 * Extra checks will just slow things down.  Actually, it's
-		 * possible to handle all the 'offset < WORDBYTES' cases using
-		 * the same code, but it still becomes more complicated doesn't
-		 * seem any faster overall; it definitely slows down the more
-		 * common 'offset == 1' case.
+		 * WORDBYTES', which are rarer.  Extra checks will just slow
+		 * things down.
 		 */
+		if (offset == 1)
+			v = repeat_byte(*(out_next - 1));
+		else if (offset == 2)
+			v = repeat_u16(load_u16_unaligned(src));
+		else if (offset == 4)
+			v = repeat_u32(load_u32_unaligned(src));
+		else
+			goto bytewise;
+		do {
+			store_word_unaligned(v, out_next);
+			store_word_unaligned(v, out_next + WORDBYTES);
+			out_next += 2 * WORDBYTES;
+		} while (out_next < end);
+		return 0;
 	}
 
+bytewise:
 	/* Fall back to a bytewise copy.  */
 	if (min_length >= 2)
 		*out_next++ = *src++;
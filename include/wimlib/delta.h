@@ -0,0 +1,70 @@
+#ifndef _WIMLIB_DELTA_H
+#define _WIMLIB_DELTA_H
+
+#include "wimlib/resource.h"
+
+struct blob_descriptor;
+struct wim_reshdr;
+
+/*
+ * [wimlib extension] On-disk header at the start of a resource with
+ * WIM_RESHDR_FLAG_DELTA set.  It is followed by the delta data itself, stored
+ * like the data of a non-solid resource: compressed using the WIM's default
+ * compression type if WIM_RESHDR_FLAG_COMPRESSED is set, otherwise
+ * uncompressed.  The 'uncompressed_size' in the resource header is the size of
+ * the blob that results from applying the delta to the base blob.
+ */
+struct delta_resource_header_disk {
+	/* Uncompressed size of the delta data, in bytes.  */
+	le64 delta_size;
+
+	/* SHA-1 message digest of the blob to which the delta applies.  */
+	u8 base_hash[SHA1_HASH_SIZE];
+
+	/* Reserved; must be 0.  */
+	le32 reserved;
+} __attribute__((packed));
+
+/* A resource descriptor for the delta data of a blob located in a delta
+ * resource (BLOB_IN_WIM_DELTA), along with the hash of its base blob.  */
+struct delta_resource_descriptor {
+	struct wim_resource_descriptor rdesc;
+	u8 base_hash[SHA1_HASH_SIZE];
+
+	/* The decoded delta data, kept from the first read of only part of the
+	 * blob, so that further such reads (for example, sequential reads of a
+	 * file in a mounted image) don't decompress all of it again.  NULL if
+	 * not loaded.  Once set, it doesn't change until the descriptor is
+	 * freed.  */
+	u8 *delta_data;
+};
+
+/* Blobs larger than this are never delta-encoded, nor used as base blobs,
+ * since the encoder holds both blobs in memory at once.  */
+#define DELTA_MAX_BLOB_SIZE	(64 << 20)
+
+/* Blobs smaller than this are never delta-encoded.  */
+#define DELTA_MIN_BLOB_SIZE	4096
+
+int
+load_delta_resource(WIMStruct *wim, const struct wim_reshdr *reshdr,
+		    struct blob_descriptor *blob);
+
+void
+free_delta_resource_descriptor(struct wim_resource_descriptor *rdesc);
+
+void
+delta_blob_get_reshdr(const struct blob_descriptor *blob,
+		      struct wim_reshdr *reshdr);
+
+int
+read_delta_blob_range(const struct blob_descriptor *blob, u64 offset, u64 size,
+		      const struct consume_chunk_callback *cb,
+		      bool recover_data);
+
+size_t
+create_blob_delta(const u8 *base, size_t base_size,
+		  const u8 *target, size_t target_size,
+		  u8 *out, size_t max_out_size);
+
+#endif /* _WIMLIB_DELTA_H */
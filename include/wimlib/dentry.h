@@ -10,6 +10,8 @@
 
 struct wim_inode;
 struct blob_table;
+struct metadata_out;
+struct wim_image_metadata;
 
 /* Base size of a WIM dentry in the on-disk format, up to and including the file
  * name length.  This does not include the variable-length file name, short
@@ -51,12 +53,12 @@ struct wim_dentry {
 	 * its inode (d_inode) */
 	struct hlist_node d_alias_node;
 
-	/* Pointer to the UTF-16LE filename (malloc()ed buffer), or NULL if this
-	 * dentry has no filename.  */
+	/* Pointer to the UTF-16LE filename (malloc()ed buffer, unless
+	 * d_names_in_arena), or NULL if this dentry has no filename.  */
 	utf16lechar *d_name;
 
-	/* Pointer to the UTF-16LE short filename (malloc()ed buffer), or NULL
-	 * if this dentry has no short name.  */
+	/* Pointer to the UTF-16LE short filename (malloc()ed buffer, unless
+	 * d_names_in_arena), or NULL if this dentry has no short name.  */
 	utf16lechar *d_short_name;
 
 	/* Length of 'd_name' in bytes, excluding the terminating null  */
@@ -81,11 +83,35 @@ struct wim_dentry {
 	/* Used by wimlib_update_image()  */
 	u16 d_is_orphan : 1;
 
+	/* Set on a directory whose children haven't been read from the
+	 * metadata resource yet, since the image is being loaded lazily.  In
+	 * that case d_subdir_offset is still valid.  */
+	u16 d_children_unloaded : 1;
+
+	/* Set if this dentry, or its names, respectively, were allocated from
+	 * the dentry arena of the image rather than with malloc().  Then they
+	 * are freed along with the arena.  Both names are always replaced
+	 * together, so d_names_in_arena is cleared when they are.  */
+	u16 d_in_arena : 1;
+	u16 d_names_in_arena : 1;
+
+	/* (Capture only) Set on a directory whose subtree contains a file that
+	 * can't be spilled out of memory, such as a hard link.  See spill.c.  */
+	u16 d_unspillable : 1;
+
 	union {
-		/* The subdir offset is only used while reading and writing this
-		 * dentry.  See the corresponding field in `struct
-		 * wim_dentry_on_disk' for explanation.  */
-		u64 d_subdir_offset;
+		struct {
+			/* The subdir offset is only used while reading and
+			 * writing this dentry, or until the children of the
+			 * dentry are loaded.  See the corresponding field in
+			 * `struct wim_dentry_on_disk' for explanation.  */
+			u64 d_subdir_offset;
+
+			/* For a directory with d_children_unloaded: the subdir
+			 * offset to write for it, since d_subdir_offset is
+			 * still needed to load its children.  */
+			u64 d_out_subdir_offset;
+		};
 
 		/* Temporary list field  */
 		struct list_head d_tmp_list;
@@ -177,7 +203,8 @@ dentry_get_next_ci_match(struct wim_dentry *dentry,
 	     (ci_match) = dentry_get_next_ci_match((dentry), (ci_match)))
 
 void
-calculate_subdir_offsets(struct wim_dentry *root, u64 *subdir_offset_p);
+calculate_subdir_offsets(struct wim_image_metadata *imd,
+			 struct wim_dentry *root, u64 *subdir_offset_p);
 
 int
 dentry_set_name(struct wim_dentry *dentry, const tchar *name);
@@ -240,12 +267,51 @@ rename_wim_path(WIMStruct *wim, const tchar *from, const tchar *to,
 		struct update_command_journal *j);
 
 
+struct dentry_arena;
+
+/* A position in a dentry arena, to which the arena can be reset  */
+struct dentry_arena_mark {
+	struct dentry_arena_block *block;
+	u8 *next;
+	u8 *end;
+	size_t next_block_size;
+};
+
+struct dentry_arena *
+new_dentry_arena(void);
+
+void *
+dentry_arena_alloc(struct dentry_arena *arena, size_t size);
+
+void
+dentry_arena_get_mark(const struct dentry_arena *arena,
+		      struct dentry_arena_mark *mark);
+
+void
+dentry_arena_release(struct dentry_arena *arena,
+		     const struct dentry_arena_mark *mark);
+
+void
+free_dentry_arena(struct dentry_arena *arena);
+
+int
+read_dentry_tree(const u8 *buf, size_t buf_len, u64 root_offset, bool lazy,
+		 struct dentry_arena *arena, struct hlist_head *inodes,
+		 struct wim_dentry **root_ret);
+
 int
-read_dentry_tree(const u8 *buf, size_t buf_len,
-		 u64 root_offset, struct wim_dentry **root_ret);
+read_dentry_subdir(const u8 *buf, size_t buf_len, struct dentry_arena *arena,
+		   struct wim_dentry *dir);
+
+void
+unread_dentry_subdir(struct wim_dentry *dir);
 
 u8 *
-write_dentry_tree(struct wim_dentry *root, u8 *p);
+write_dentry(const struct wim_dentry * restrict dentry, u8 * restrict p);
+
+int
+write_dentry_tree(struct wim_image_metadata *imd, struct wim_dentry *root,
+		  struct metadata_out *out);
 
 static inline bool
 dentry_is_root(const struct wim_dentry *dentry)
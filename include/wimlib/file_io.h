@@ -5,15 +5,64 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+#include "wimlib/types.h"
+
+/* Function which observes the data written to a file.  @sequential is true if
+ * the data was written at the file position, as by full_write(), and false if
+ * it was written elsewhere, as by full_pwrite().  */
+typedef void (*filedes_write_hook_t)(const void *buf, size_t count,
+				     off_t offset, bool sequential, void *ctx);
+
 /* Wrapper around a file descriptor that keeps track of offset (including in
  * pipes, which don't support lseek()) and a cached flag that tells whether the
- * file descriptor is a pipe or not.  */
+ * file descriptor is a pipe or not.  A file descriptor open for reading may
+ * also have the file mapped into memory; see filedes_map().  */
 struct filedes {
 	int fd;
 	unsigned int is_pipe : 1;
+
+	/* If set, data written with full_write() is dropped from the page
+	 * cache after it has been written back; see filedes_set_uncached().  */
+	unsigned int uncached : 1;
+
+	/* If set, the file was extended past the data written to it by
+	 * filedes_preallocate(), so it must be truncated when done.  */
+	unsigned int preallocated : 1;
 	off_t offset;
+	const void *map;
+	size_t map_size;
+
+	/* When @uncached is set, the offset up to which writeback of the data
+	 * written with full_write() has been started  */
+	off_t writeback_offset;
+
+	/* If not NULL, a buffer in which data written with full_write() is
+	 * collected so that it can be written with fewer, larger writes; see
+	 * filedes_set_write_buffer().  @offset includes the buffered data up to
+	 * @write_buf_used.  @write_buf_filled is larger than @write_buf_used if
+	 * filedes_seek() went back into the buffered data.  */
+	u8 *write_buf;
+	size_t write_buf_size;
+	size_t write_buf_used;
+	size_t write_buf_filled;
+
+	/* For a pipe, if not NULL, a thread which reads ahead from the pipe into
+	 * memory; see filedes_start_pipe_reader().  */
+	struct pipe_reader *pipe_reader;
+
+	/* If not NULL, the file is read through callbacks supplied by the
+	 * library user rather than from @fd, which is -1; see
+	 * filedes_init_reader().  */
+	struct filedes_reader *reader;
+
+	/* If not NULL, called with each piece of data as it is actually written
+	 * to the file, after any buffering; see filedes_set_write_hook().  */
+	filedes_write_hook_t write_hook;
+	void *write_hook_ctx;
 };
 
+struct wimlib_wim_reader;
+
 int
 full_read(struct filedes *fd, void *buf, size_t n);
 
@@ -36,24 +85,98 @@ filedes_seek(struct filedes *fd, off_t offset);
 bool
 filedes_is_seekable(struct filedes *fd);
 
+bool
+filedes_map(struct filedes *fd, off_t size);
+
+void
+filedes_unmap(struct filedes *fd);
+
+void
+filedes_prefetch(const struct filedes *fd, off_t offset, off_t size);
+
+u64
+filedes_copy_range(struct filedes *in_fd, off_t in_offset,
+		   struct filedes *out_fd, u64 size);
+
+u64
+filedes_copy_range_at(struct filedes *in_fd, off_t in_offset,
+		      struct filedes *out_fd, off_t out_offset, u64 size);
+
+bool
+filedes_start_pipe_reader(struct filedes *fd);
+
+void
+filedes_stop_pipe_reader(struct filedes *fd);
+
+int
+filedes_init_reader(struct filedes *fd, const struct wimlib_wim_reader *ops);
+
+bool
+filedes_set_write_buffer(struct filedes *fd, size_t size);
+
+int
+filedes_flush(struct filedes *fd);
+
+int
+filedes_free_write_buffer(struct filedes *fd);
+
+void
+filedes_set_uncached(struct filedes *fd);
+
+void
+filedes_preallocate(struct filedes *fd, u64 end);
+
+void
+filedes_set_write_hook(struct filedes *fd, filedes_write_hook_t hook,
+		       void *ctx);
+
+void
+filedes_drop_written_data(struct filedes *fd);
+
+int
+filedes_close(struct filedes *fd);
+
+/* If the specified range of the file is mapped into memory, return a pointer
+ * to it; otherwise return NULL.  */
+static inline const void *
+filedes_mapped_range(const struct filedes *fd, off_t offset, size_t size)
+{
+	if (fd->map == NULL || offset < 0 || (size_t)offset > fd->map_size ||
+	    size > fd->map_size - (size_t)offset)
+		return NULL;
+	return (const char *)fd->map + offset;
+}
+
 static inline void filedes_init(struct filedes *fd, int raw_fd)
 {
 	fd->fd = raw_fd;
 	fd->offset = 0;
 	fd->is_pipe = 0;
+	fd->uncached = 0;
+	fd->preallocated = 0;
+	fd->map = NULL;
+	fd->map_size = 0;
+	fd->writeback_offset = 0;
+	fd->write_buf = NULL;
+	fd->write_buf_size = 0;
+	fd->write_buf_used = 0;
+	fd->write_buf_filled = 0;
+	fd->pipe_reader = NULL;
+	fd->reader = NULL;
+	fd->write_hook = NULL;
+	fd->write_hook_ctx = NULL;
 }
 
 static inline void filedes_invalidate(struct filedes *fd)
 {
 	fd->fd = -1;
+	fd->reader = NULL;
 }
 
-#define filedes_close(f) close((f)->fd)
-
 static inline bool
 filedes_valid(const struct filedes *fd)
 {
-	return fd->fd != -1;
+	return fd->fd != -1 || fd->reader != NULL;
 }
 
 #endif /* _WIMLIB_FILE_IO_H */
@@ -123,6 +123,9 @@
 
 #include "wimlib/matchfinder_common.h"
 
+/* The maximum number of bits in the hash codes.  hc_matchfinder_init() uses
+ * fewer bits for buffers too small to benefit from the full-size hash tables,
+ * so that it doesn't have to clear them entirely for every small buffer.  */
 #define HC_MATCHFINDER_HASH3_ORDER	15
 #define HC_MATCHFINDER_HASH4_ORDER	16
 
@@ -132,6 +135,10 @@
 
 struct TEMPLATED(hc_matchfinder) {
 
+	/* The number of hash code bits in use for the current buffer  */
+	u32 hash3_order;
+	u32 hash4_order;
+
 	/* The hash table for finding length 3 matches  */
 	mf_pos_t hash3_tab[1UL << HC_MATCHFINDER_HASH3_ORDER];
 
@@ -153,11 +160,18 @@ TEMPLATED(hc_matchfinder_size)(size_t max_bufsize)
 		(max_bufsize * sizeof(mf_pos_t));
 }
 
-/* Prepare the matchfinder for a new input buffer.  */
+/* Prepare the matchfinder for a new input buffer of @bufsize bytes.  */
 static forceinline void
-TEMPLATED(hc_matchfinder_init)(struct TEMPLATED(hc_matchfinder) *mf)
+TEMPLATED(hc_matchfinder_init)(struct TEMPLATED(hc_matchfinder) *mf,
+			       size_t bufsize)
 {
-	memset(mf, 0, sizeof(*mf));
+	u32 order = ilog2_ceil(max(bufsize, 256)) + 1;
+
+	mf->hash4_order = min(order, HC_MATCHFINDER_HASH4_ORDER);
+	mf->hash3_order = min(order - 1, HC_MATCHFINDER_HASH3_ORDER);
+
+	memset(mf->hash3_tab, 0, sizeof(mf->hash3_tab[0]) << mf->hash3_order);
+	memset(mf->hash4_tab, 0, sizeof(mf->hash4_tab[0]) << mf->hash4_order);
 }
 
 /*
@@ -232,8 +246,8 @@ TEMPLATED(hc_matchfinder_longest_match)(struct TEMPLATED(hc_matchfinder) * const
 
 	/* Compute the next hash codes.  */
 	next_hashseq = get_unaligned_le32(in_next + 1);
-	next_hashes[0] = lz_hash(next_hashseq & 0xFFFFFF, HC_MATCHFINDER_HASH3_ORDER);
-	next_hashes[1] = lz_hash(next_hashseq, HC_MATCHFINDER_HASH4_ORDER);
+	next_hashes[0] = lz_hash(next_hashseq & 0xFFFFFF, mf->hash3_order);
+	next_hashes[1] = lz_hash(next_hashseq, mf->hash4_order);
 	prefetchw(&mf->hash3_tab[next_hashes[0]]);
 	prefetchw(&mf->hash4_tab[next_hashes[1]]);
 
@@ -366,6 +380,8 @@ TEMPLATED(hc_matchfinder_skip_bytes)(struct TEMPLATED(hc_matchfinder) * const mf
 	u32 hash3, hash4;
 	u32 next_hashseq;
 	u32 remaining = count;
+	const u32 hash3_order = mf->hash3_order;
+	const u32 hash4_order = mf->hash4_order;
 
 	if (unlikely(count + 5 > in_end - in_next))
 		return;
@@ -379,8 +395,8 @@ TEMPLATED(hc_matchfinder_skip_bytes)(struct TEMPLATED(hc_matchfinder) * const mf
 		mf->hash4_tab[hash4] = cur_pos;
 
 		next_hashseq = get_unaligned_le32(++in_next);
-		hash3 = lz_hash(next_hashseq & 0xFFFFFF, HC_MATCHFINDER_HASH3_ORDER);
-		hash4 = lz_hash(next_hashseq, HC_MATCHFINDER_HASH4_ORDER);
+		hash3 = lz_hash(next_hashseq & 0xFFFFFF, hash3_order);
+		hash4 = lz_hash(next_hashseq, hash4_order);
 		cur_pos++;
 	} while (--remaining);
 
@@ -0,0 +1,205 @@
+/*
+ * ht_matchfinder.h - Lempel-Ziv matchfinding with a hash table
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ *
+ * ---------------------------------------------------------------------------
+ *
+ * This is a Hash Table (ht) matchfinder.
+ *
+ * This is a variant of the Hash Chains (hc) matchfinder that is optimized for
+ * very fast compression.  The ht_matchfinder stores the hash chains inline in
+ * the hash table, whereas the hc_matchfinder stores them in a separate array.
+ * Storing the hash chains inline is the faster method when max_search_depth
+ * (the maximum chain length) is very small.  It is not appropriate when
+ * max_search_depth is larger, as then it uses too much memory.
+ *
+ * Due to its focus on speed, the ht_matchfinder doesn't support length 3
+ * matches, and it has no separate hash table for them either.  It also doesn't
+ * allow max_search_depth to vary at runtime; it is fixed at build time as
+ * HT_MATCHFINDER_BUCKET_SIZE.
+ *
+ * See hc_matchfinder.h for more information.
+ */
+
+#include <string.h>
+
+#include "wimlib/matchfinder_common.h"
+
+#define HT_MATCHFINDER_HASH_ORDER	14
+#define HT_MATCHFINDER_BUCKET_SIZE	2
+
+#define HT_MATCHFINDER_MIN_MATCH_LEN	4
+/* Minimum value of max_len for ht_matchfinder_longest_match() */
+#define HT_MATCHFINDER_REQUIRED_NBYTES	5
+
+/* TEMPLATED functions and structures have MF_SUFFIX appended to their name.  */
+#undef TEMPLATED
+#define TEMPLATED(name)		CONCAT(name, MF_SUFFIX)
+
+struct TEMPLATED(ht_matchfinder) {
+	mf_pos_t hash_tab[1UL << HT_MATCHFINDER_HASH_ORDER]
+			 [HT_MATCHFINDER_BUCKET_SIZE];
+};
+
+/* Return the number of bytes that must be allocated for a 'ht_matchfinder'.
+ * Unlike the other matchfinders, this doesn't depend on the buffer size.  */
+static forceinline size_t
+TEMPLATED(ht_matchfinder_size)(size_t max_bufsize)
+{
+	return sizeof(struct TEMPLATED(ht_matchfinder));
+}
+
+/* Prepare the matchfinder for a new input buffer.  */
+static forceinline void
+TEMPLATED(ht_matchfinder_init)(struct TEMPLATED(ht_matchfinder) *mf)
+{
+	memset(mf, 0, sizeof(*mf));
+}
+
+/*
+ * Find the longest match of at least HT_MATCHFINDER_MIN_MATCH_LEN bytes.
+ *
+ * @mf
+ *	The matchfinder structure.
+ * @in_begin
+ *	Pointer to the beginning of the input buffer.
+ * @in_next
+ *	Pointer to the next position in the input buffer, i.e. the sequence
+ *	being matched against.
+ * @max_len
+ *	The maximum permissible match length at this position.
+ * @nice_len
+ *	Stop searching if a match of at least this length is found.
+ *	Must be <= @max_len.
+ * @next_hash
+ *	The precomputed hash code for the sequence beginning at @in_next.  This
+ *	will be used and then updated with the precomputed hash code for the
+ *	sequence beginning at @in_next + 1.
+ * @offset_ret
+ *	If a match is found, its offset is returned in this location.
+ *
+ * Return the length of the match found, or 0 if no match was found.
+ */
+static forceinline u32
+TEMPLATED(ht_matchfinder_longest_match)(struct TEMPLATED(ht_matchfinder) * const mf,
+					const u8 * const in_begin,
+					const u8 * const in_next,
+					const u32 max_len,
+					const u32 nice_len,
+					u32 * const next_hash,
+					u32 * const offset_ret)
+{
+	u32 best_len = 0;
+	const u8 *best_matchptr = in_next;
+	u32 cur_pos = in_next - in_begin;
+	u32 hash;
+	u32 seq;
+	mf_pos_t cur_node;
+	const u8 *matchptr;
+	u32 len;
+
+	if (unlikely(max_len < HT_MATCHFINDER_REQUIRED_NBYTES))
+		goto out;
+
+	/* Get the precomputed hash code, and compute the next one.  */
+	hash = *next_hash;
+	*next_hash = lz_hash(get_unaligned_le32(in_next + 1),
+			     HT_MATCHFINDER_HASH_ORDER);
+	prefetchw(&mf->hash_tab[*next_hash]);
+
+	seq = load_u32_unaligned(in_next);
+
+	/* Check each node in the bucket, shifting the older nodes down to make
+	 * room for the node for the current sequence.  Node 0 means "empty",
+	 * so the very first position in the buffer is never matched against,
+	 * just like in the hc_matchfinder.  */
+	STATIC_ASSERT(HT_MATCHFINDER_BUCKET_SIZE == 2); /* loop is unrolled */
+
+	cur_node = mf->hash_tab[hash][0];
+	mf->hash_tab[hash][0] = cur_pos;
+	if (!cur_node)
+		goto out;
+	matchptr = &in_begin[cur_node];
+	if (load_u32_unaligned(matchptr) == seq) {
+		best_len = lz_extend(in_next, matchptr, 4, max_len);
+		best_matchptr = matchptr;
+		if (best_len >= nice_len)
+			goto out_shift;
+	}
+
+	matchptr = &in_begin[mf->hash_tab[hash][1]];
+	mf->hash_tab[hash][1] = cur_node;
+	if (matchptr != in_begin && load_u32_unaligned(matchptr) == seq) {
+		len = lz_extend(in_next, matchptr, 4, max_len);
+		if (len > best_len) {
+			best_len = len;
+			best_matchptr = matchptr;
+		}
+	}
+	goto out;
+
+out_shift:
+	mf->hash_tab[hash][1] = cur_node;
+out:
+	*offset_ret = in_next - best_matchptr;
+	return best_len;
+}
+
+/*
+ * Advance the matchfinder, but don't search for matches.
+ *
+ * @mf
+ *	The matchfinder structure.
+ * @in_begin
+ *	Pointer to the beginning of the input buffer.
+ * @in_next
+ *	Pointer to the next position in the input buffer.
+ * @in_end
+ *	Pointer to the end of the input buffer.
+ * @count
+ *	The number of bytes to advance.  Must be > 0.
+ * @next_hash
+ *	The precomputed hash code for the sequence beginning at @in_next.  This
+ *	will be used and then updated with the precomputed hash code for the
+ *	sequence beginning at @in_next + @count.
+ */
+static forceinline void
+TEMPLATED(ht_matchfinder_skip_bytes)(struct TEMPLATED(ht_matchfinder) * const mf,
+				     const u8 * const in_begin,
+				     const u8 *in_next,
+				     const u8 * const in_end,
+				     const u32 count,
+				     u32 * const next_hash)
+{
+	u32 cur_pos = in_next - in_begin;
+	u32 hash;
+	u32 remaining = count;
+
+	if (unlikely(count + HT_MATCHFINDER_REQUIRED_NBYTES > in_end - in_next))
+		return;
+
+	hash = *next_hash;
+	do {
+		mf->hash_tab[hash][1] = mf->hash_tab[hash][0];
+		mf->hash_tab[hash][0] = cur_pos;
+
+		hash = lz_hash(get_unaligned_le32(++in_next),
+			       HT_MATCHFINDER_HASH_ORDER);
+		cur_pos++;
+	} while (--remaining);
+
+	prefetchw(&mf->hash_tab[hash]);
+	*next_hash = hash;
+}
@@ -9,6 +9,8 @@
 struct avl_tree_node;
 struct blob_descriptor;
 struct blob_table;
+struct dentry_arena;
+struct dentry_child_index;
 struct wim_dentry;
 struct wim_inode_extra;
 struct wim_security_data;
@@ -112,6 +114,11 @@ struct wim_inode {
 	 * tree (NULL).  */
 	struct avl_tree_node *i_children;
 
+	/* If not NULL, an additional index of the entries in 'i_children' by
+	 * case-folded filename, built on demand when lookups are made in a
+	 * large directory.  See dentry.c.  */
+	struct dentry_child_index *i_child_index;
+
 	/* List of dentries that are aliases for this inode.  There will be
 	 * i_nlink dentries in this list.  */
 	struct hlist_head i_alias_list;
@@ -122,7 +129,12 @@ struct wim_inode {
 	struct hlist_node i_hlist_node;
 
 	/* Number of dentries that are aliases for this inode.  */
-	u32 i_nlink : 30;
+	u32 i_nlink : 27;
+
+	/* (Capture only) Set by the scan if this inode is known to have no
+	 * other names than the ones found so far, e.g. because its link count
+	 * on disk is 1.  Only such inodes can be spilled; see spill.c.  */
+	u32 i_single_link : 1;
 
 	/* Flag used by some code to mark this inode as visited.  It will be 0
 	 * by default, and it always must be cleared after use.  */
@@ -131,6 +143,15 @@ struct wim_inode {
 	/* Cached value  */
 	u32 i_can_externally_back : 1;
 
+	/* Set during an extraction with WIMLIB_EXTRACT_FLAG_UPDATE if this
+	 * file already exists at the target with the right contents, so its
+	 * data needn't be extracted again.  */
+	u32 i_unchanged : 1;
+
+	/* Set if this inode was allocated from the dentry arena of the image
+	 * rather than with malloc().  Then it's freed along with the arena.  */
+	u32 i_in_arena : 1;
+
 	/* If not NULL, a pointer to the extra data that was read from the
 	 * dentry.  This should be a series of tagged items, each of which
 	 * represents a bit of extra metadata, such as the file's object ID.
@@ -226,9 +247,18 @@ struct wim_inode {
 #endif
 };
 
+/* Number of tags whose items are indexed in struct wim_inode_extra  */
+#define NUM_INDEXED_TAGS	6
+
 /* Optional extra data for a WIM inode  */
 struct wim_inode_extra {
 	size_t size;	/* Size of the extra data in bytes  */
+
+	/* For each tag known to tagged_items.c, the offset in @data of the
+	 * first tagged item with that tag, or UINT32_MAX if there is none.  This
+	 * saves searching the items each time one of them is needed.  */
+	u32 item_offsets[NUM_INDEXED_TAGS];
+
 	u8 data[] __attribute__((aligned(8))); /* The extra data  */
 };
 
@@ -267,6 +297,9 @@ struct wim_inode_extra {
 struct wim_inode *
 new_inode(struct wim_dentry *dentry, bool set_timestamps);
 
+struct wim_inode *
+new_inode_in_arena(struct wim_dentry *dentry, struct dentry_arena *arena);
+
 /* Iterate through each alias of the specified inode.  */
 #define inode_for_each_dentry(dentry, inode) \
 	hlist_for_each_entry((dentry), &(inode)->i_alias_list, d_alias_node)
@@ -428,6 +461,21 @@ inode_unref_blobs(struct wim_inode *inode, struct blob_table *blob_table);
 
 /* inode_fixup.c  */
 int
-dentry_tree_fix_inodes(struct wim_dentry *root, struct hlist_head *inode_list);
+dentry_tree_fix_inodes(struct hlist_head *inodes, struct hlist_head *inode_list);
+
+struct inode_fixup;
+
+int
+new_inode_fixup(struct inode_fixup **fixup_ret);
+
+int
+inode_fixup_add_children(struct inode_fixup *fixup, struct wim_dentry *dir,
+			 struct hlist_head *inode_list);
+
+void
+finish_inode_fixup(struct inode_fixup *fixup, struct hlist_head *inode_list);
+
+void
+free_inode_fixup(struct inode_fixup *fixup);
 
 #endif /* _WIMLIB_INODE_H  */
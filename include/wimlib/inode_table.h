@@ -2,42 +2,72 @@
 #define _WIMLIB_INODE_TABLE_H
 
 #include "wimlib/list.h"
+#include "wimlib/threads.h"
 #include "wimlib/types.h"
 #include "wimlib/util.h"
 
 struct wim_dentry;
 
+#define INODE_TABLE_SHARD_ORDER		4
+#define INODE_TABLE_NUM_SHARDS		(1 << INODE_TABLE_SHARD_ORDER)
+
+/* One shard of a 'struct wim_inode_table': a hash table of its own, with its
+ * own lock.  */
+struct wim_inode_table_shard {
+	struct mutex lock;
+	struct hlist_head *array;
+	size_t filled;
+	size_t capacity;
+};
+
 /* Hash table to find inodes for hard link detection, given an inode number (in
  * the case of reading a WIM image), or both an inode number and a device number
  * (in the case of adding files to a WIM image).  Also contains an extra list to
  * hold inodes for which no additional hard link detection is desired.  In both
- * cases the inodes are linked by i_hlist_node.  */
+ * cases the inodes are linked by i_hlist_node.
+ *
+ * The table is divided into shards by the high bits of the hash, each locked
+ * separately, so that inode_table_new_dentry() can be called by several
+ * scanning threads at once without them all contending for one lock.  */
 struct wim_inode_table {
-	struct hlist_head *array;
-	size_t filled;
-	size_t capacity;
+	struct wim_inode_table_shard shards[INODE_TABLE_NUM_SHARDS];
+	struct mutex extra_lock;
 	struct hlist_head extra_inodes;
 };
 
+static inline u64
+inode_hash(u64 ino, u64 devno)
+{
+	return hash_u64(ino) + devno;
+}
+
+/* Return the shard of @table which holds inodes with the given hash.  */
+static inline struct wim_inode_table_shard *
+inode_table_shard(struct wim_inode_table *table, u64 hash)
+{
+	return &table->shards[hash >> (64 - INODE_TABLE_SHARD_ORDER)];
+}
 
-/* Compute the index of the hash bucket to use for the given inode number and
- * device number.  */
+/* Compute the index of the hash bucket to use in @shard for the given hash.  */
 static inline size_t
-hash_inode(const struct wim_inode_table *table, u64 ino, u64 devno)
+hash_inode(const struct wim_inode_table_shard *shard, u64 hash)
 {
-	return (hash_u64(ino) + devno) & (table->capacity - 1);
+	return hash & (shard->capacity - 1);
 }
 
 int
 init_inode_table(struct wim_inode_table *table, size_t capacity);
 
+void
+inode_table_reserve(struct wim_inode_table *table, size_t count);
+
 int
 inode_table_new_dentry(struct wim_inode_table *table, const tchar *name,
 		       u64 ino, u64 devno, bool noshare,
 		       struct wim_dentry **dentry_ret);
 
 void
-enlarge_inode_table(struct wim_inode_table *table);
+inode_table_shard_inserted(struct wim_inode_table_shard *shard);
 
 void
 inode_table_prepare_inode_list(struct wim_inode_table *table,
@@ -23,6 +23,12 @@ write_integrity_table(WIMStruct *wim,
 		      off_t old_blob_table_end,
 		      struct integrity_table *old_table);
 
+void
+start_integrity_hasher(WIMStruct *wim);
+
+void
+stop_integrity_hasher(WIMStruct *wim);
+
 int
 check_wim_integrity(WIMStruct *wim);
 
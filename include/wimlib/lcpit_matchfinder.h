@@ -31,6 +31,7 @@
 #ifndef _LCPIT_MATCHFINDER_H
 #define _LCPIT_MATCHFINDER_H
 
+#include "wimlib/matchfinder_common.h"
 #include "wimlib/types.h"
 
 struct lcpit_matchfinder {
@@ -39,7 +40,7 @@ struct lcpit_matchfinder {
 	u32 *pos_data;
 	union {
 		u32 *intervals;
-		u64 *intervals64;
+		u8 *intervals40;
 	};
 	u32 min_match_len;
 	u32 nice_match_len;
@@ -47,11 +48,6 @@ struct lcpit_matchfinder {
 	u32 orig_nice_match_len;
 };
 
-struct lz_match {
-	u32 length;
-	u32 offset;
-};
-
 u64
 lcpit_matchfinder_get_needed_memory(size_t max_bufsize);
 
@@ -31,6 +31,17 @@
 #include "wimlib/bitops.h"
 #include "wimlib/unaligned.h"
 
+/* Representation of a match found by the bt_matchfinder or the
+ * lcpit_matchfinder  */
+struct lz_match {
+
+	/* The number of bytes matched.  */
+	u32 length;
+
+	/* The offset back from the current position that was matched.  */
+	u32 offset;
+};
+
 /*
  * Given a 32-bit value that was loaded with the platform's native endianness,
  * return a 32-bit value whose high-order 8 bits are 0 and whose low-order 24
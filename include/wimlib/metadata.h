@@ -6,6 +6,12 @@
 #include "wimlib/types.h"
 #include "wimlib/wim.h"
 
+struct consume_chunk_callback;
+struct dentry_arena_mark;
+struct metadata_spill;
+struct wim_dentry;
+struct wim_inode;
+
 /*
  * This structure holds the directory tree that comprises a WIM image, along
  * with other information maintained at the image level.  It is populated either
@@ -18,6 +24,17 @@
  * created from scratch, on the other hand, is considered "dirty" and is never
  * automatically unloaded.
  *
+ * A clean image can also be loaded lazily by select_wim_image_lazily(), for
+ * read-only use.  Then its directories are only read from the metadata resource
+ * as they're loaded with load_dentry_children() or load_dentry_tree(), and they
+ * may be unloaded again if they were only needed temporarily.  A later
+ * select_wim_image() loads the rest of the image.
+ *
+ * An image captured with WIMLIB_ADD_FLAG_SPILL_METADATA is dirty, but it is
+ * loaded the same way from the spill file to which the scan wrote the
+ * directories it completed.  Writing it doesn't load it all at once; see
+ * finish_loading_unspilled_image().
+ *
  * To implement exports, it's allowed that multiple WIMStructs reference the
  * same wim_image_metadata.
  */
@@ -35,6 +52,11 @@ struct wim_image_metadata {
 	 * completely empty or is not currently loaded.  */
 	struct wim_dentry *root_dentry;
 
+	/* The arena from which the dentries and inodes read from the metadata
+	 * resource were allocated, or NULL if this image is not currently
+	 * loaded from a metadata resource.  */
+	struct dentry_arena *arena;
+
 	/* Pointer to the security data of this image, or NULL if this image is
 	 * not currently loaded.  */
 	struct wim_security_data *security_data;
@@ -61,6 +83,11 @@ struct wim_image_metadata {
 	/* Are the filecount/bytecount stats (in the XML info) out of date for
 	 * this image?  */
 	bool stats_outdated;
+
+	/* If this image is only partially loaded, the state needed to load the
+	 * rest of it; otherwise NULL.  While this is set, the inode list only
+	 * contains the inodes of the loaded dentries.  */
+	struct metadata_loader *loader;
 };
 
 /* Retrieve the metadata of the image in @wim currently selected with
@@ -150,6 +177,56 @@ can_unload_image(const struct wim_image_metadata *imd)
 #define image_for_each_unhashed_blob_safe(blob, tmp, imd) \
 	list_for_each_entry_safe(blob, tmp, &(imd)->unhashed_blobs, unhashed_list)
 
+int
+load_dentry_children(struct wim_image_metadata *imd, struct wim_dentry *dir);
+
+int
+load_dentry_tree(struct wim_image_metadata *imd, struct wim_dentry *root);
+
+int
+load_dentry_children_temporarily(struct wim_image_metadata *imd,
+				 struct wim_dentry *dir,
+				 struct dentry_arena_mark *mark,
+				 bool *loaded_ret);
+
+void
+unload_dentry_children(struct wim_image_metadata *imd, struct wim_dentry *dir,
+		       const struct dentry_arena_mark *mark);
+
+int
+finish_loading_image(struct wim_image_metadata *imd);
+
+int
+finish_loading_unspilled_image(struct wim_image_metadata *imd);
+
+int
+start_spill_load(struct wim_image_metadata *imd, struct metadata_spill *spill);
+
+u64
+unloaded_subtree_size(const struct wim_image_metadata *imd,
+		      const struct wim_dentry *dir);
+
+int
+visit_unloaded_inodes(struct wim_image_metadata *imd,
+		      int (*visitor)(struct wim_inode *, void *), void *arg);
+
+void
+free_metadata_loader(struct metadata_loader *loader);
+
+/* A buffer into which a metadata resource is serialized a piece at a time.
+ * Each time it fills up, its contents are passed to @cb, up to a total of
+ * @remaining bytes, and it is reused.  */
+struct metadata_out {
+	u8 *begin;
+	u8 *next;
+	u8 *end;
+	u64 remaining;
+	const struct consume_chunk_callback *cb;
+};
+
+int
+metadata_out_reserve(struct metadata_out *out, size_t size);
+
 void
 put_image_metadata(struct wim_image_metadata *imd);
 
@@ -3,9 +3,11 @@
 
 #include "wimlib/types.h"
 
+struct pattern_set;
+struct string_list;
 struct wim_dentry;
 
-/* Flags for match_path() and match_pattern_list() */
+/* Flags for match_path(), match_pattern_list(), and match_pattern_set()  */
 
 /*
  * If set, subdirectories (and sub-files) are also matched.
@@ -23,8 +25,21 @@ bool
 match_path(const tchar *path, const tchar *pattern, int match_flags);
 
 int
-expand_path_pattern(struct wim_dentry *root, const tchar *pattern,
-		    int (*consume_dentry)(struct wim_dentry *, void *),
-		    void *ctx);
+new_pattern_set(const struct string_list *list, struct pattern_set **set_ret);
+
+void
+free_pattern_set(struct pattern_set *set);
+
+bool
+match_pattern_set(const tchar *path, const struct pattern_set *set,
+		  int match_flags);
+
+int
+expand_pattern_set(struct wim_dentry *root, struct pattern_set *set,
+		   int (*consume_dentry)(struct wim_dentry *, void *),
+		   void *ctx);
+
+bool
+pattern_set_matched(struct pattern_set *set, const tchar *pattern);
 
 #endif /* _WIMLIB_PATTERN_H  */
@@ -3,7 +3,7 @@
 
 #include "wimlib/types.h"
 
-struct regf;
+struct hive;
 
 enum hive_status {
 	HIVE_OK,
@@ -14,21 +14,33 @@ enum hive_status {
 	HIVE_VALUE_IS_WRONG_TYPE,
 	HIVE_OUT_OF_MEMORY,
 	HIVE_ITERATION_STOPPED,
+	HIVE_READ_ERROR,
 };
 
+/* Function which reads @size bytes at @offset in a registry hive file into
+ * @buf, returning 0 or a WIMLIB_ERR_* code  */
+typedef int (*hive_read_func_t)(void *ctx, u64 offset, size_t size, void *buf);
+
+enum hive_status
+hive_open(size_t size, hive_read_func_t read_func, void *read_ctx,
+	  struct hive **hive_ret);
+
 enum hive_status
-hive_validate(const void *hive_mem, size_t hive_size);
+hive_open_buffer(const void *mem, size_t size, struct hive **hive_ret);
+
+void
+hive_close(struct hive *hive);
 
 enum hive_status
-hive_get_string(const struct regf *regf, const tchar *key_name,
+hive_get_string(struct hive *hive, const tchar *key_name,
 		const tchar *value_name, tchar **value_ret);
 
 enum hive_status
-hive_get_number(const struct regf *regf, const tchar *key_name,
+hive_get_number(struct hive *hive, const tchar *key_name,
 		const tchar *value_name, s64 *value_ret);
 
 enum hive_status
-hive_list_subkeys(const struct regf *regf, const tchar *key_name,
+hive_list_subkeys(struct hive *hive, const tchar *key_name,
 		  tchar ***subkeys_ret);
 
 void
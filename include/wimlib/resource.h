@@ -6,8 +6,11 @@
 #include "wimlib/types.h"
 
 struct blob_descriptor;
+struct chunk_decompressor;
 struct filedes;
+struct mutex;
 struct wim_image_metadata;
+struct wimlib_decompressor;
 
 /*
  * Description of a "resource" in a WIM file.  A "resource" is a standalone,
@@ -55,6 +58,11 @@ struct wim_resource_descriptor {
 	/* Compression chunk size of this resource.  Irrelevant if the resource
 	 * is uncompressed.  */
 	u32 chunk_size;
+
+	/* For a solid resource whose chunk table has been read, the offset of
+	 * each chunk relative to the start of the resource, followed by the
+	 * size of the resource; otherwise NULL.  */
+	u64 *chunk_offsets;
 };
 
 /* On-disk version of a WIM resource header.  */
@@ -103,6 +111,11 @@ struct wim_reshdr {
  * This flag is only allowed if the WIM version number is WIM_VERSION_SOLID.  */
 #define WIM_RESHDR_FLAG_SOLID		0x10
 
+/* [wimlib extension] The resource contains a binary delta which is applied to
+ * another blob to produce the blob's data; see delta.h.  This flag is only
+ * allowed in non-solid, non-metadata resources.  */
+#define WIM_RESHDR_FLAG_DELTA		0x20
+
 /* Magic number in the 'uncompressed_size' field of the resource header that
  * identifies the main entry for a solid resource.  */
 #define SOLID_RESOURCE_MAGIC_NUMBER	0x100000000ULL
@@ -175,9 +188,76 @@ int
 read_partial_wim_blob_into_buf(const struct blob_descriptor *blob,
 			       u64 offset, size_t size, void *buf);
 
+/* A decompressor owned by one of the threads calling
+ * read_partial_wim_blob_into_buf_mt(), and the parameters it was created for.
+ * Zero-initialize before first use.  */
+struct thread_decompressor {
+	struct wimlib_decompressor *decompressor;
+	u8 ctype;
+	u32 max_block_size;
+};
+
+int
+read_partial_wim_blob_into_buf_mt(const struct blob_descriptor *blob,
+				  u64 offset, size_t size, void *buf,
+				  struct mutex *lock,
+				  struct thread_decompressor *td);
+
+void
+thread_decompressor_destroy(struct thread_decompressor *td);
+
+/* State for reading ahead of the sequential reads of a blob; see
+ * chunk_readahead_update().  Zero-initialize before first use.  */
+struct chunk_readahead {
+	struct chunk_decompressor *decompressor;
+
+	/* Offset in the blob at which a sequential read would start  */
+	u64 next_offset;
+
+	/* Number of sequential reads so far, up to the number that starts
+	 * reading ahead  */
+	unsigned num_sequential;
+
+	/* Set if reading ahead isn't possible or has failed  */
+	bool disabled;
+
+	/* Index in the resource of the next chunk to submit to the chunk
+	 * decompressor, and of the next chunk it will return; equal when no
+	 * chunks are outstanding  */
+	u64 next_submit;
+	u64 next_result;
+};
+
+void
+chunk_readahead_update(const struct blob_descriptor *blob, u64 offset,
+		       size_t size, struct chunk_readahead *ra,
+		       struct mutex *lock);
+
+void
+chunk_readahead_destroy(struct chunk_readahead *ra);
+
 int
 read_blob_into_buf(const struct blob_descriptor *blob, void *buf);
 
+int
+read_blob_prefix_into_buf(const struct blob_descriptor *blob, u64 size,
+			  void *buf);
+
+bool
+can_read_partial_blob(const struct blob_descriptor *blob);
+
+int
+read_partial_blob_into_buf(const struct blob_descriptor *blob, u64 offset,
+			   size_t size, void *buf);
+
+int
+sha1_file_on_disk_ends(const struct blob_descriptor *blob, size_t sample_size,
+		       u8 hash[SHA1_HASH_SIZE]);
+
+u64
+copy_file_on_disk_range(const struct blob_descriptor *blob,
+			struct filedes *out_fd);
+
 int
 read_blob_into_alloc_buf(const struct blob_descriptor *blob, void **buf_ret);
 
@@ -192,6 +272,10 @@ wim_reshdr_to_hash(const struct wim_reshdr *reshdr, WIMStruct *wim,
 int
 skip_wim_resource(const struct wim_resource_descriptor *rdesc);
 
+int
+read_wim_resource_into_buf(const struct wim_resource_descriptor *rdesc,
+			   void *buf, bool recover_data);
+
 /*
  * Callback function for reading chunks.  Called whenever the next chunk of
  * uncompressed data is available, passing 'ctx' as the last argument. 'size' is
@@ -201,6 +285,12 @@ skip_wim_resource(const struct wim_resource_descriptor *rdesc);
 struct consume_chunk_callback {
 	int (*func)(const void *chunk, size_t size, void *ctx);
 	void *ctx;
+
+	/* If not NULL, the callback just appends the data to the buffer at
+	 * *dest and advances *dest.  The reader may then put the data at *dest
+	 * itself, e.g. by decompressing it there, and pass *dest as 'chunk', in
+	 * which case the callback doesn't copy it.  */
+	void **dest;
 };
 
 /* Pass a chunk of data to the specified consume_chunk callback */
@@ -274,6 +364,7 @@ call_end_blob(struct blob_descriptor *blob, int status,
 #define COMPUTE_MISSING_BLOB_HASHES	0x2
 #define BLOB_LIST_ALREADY_SORTED	0x4
 #define RECOVER_DATA			0x8
+#define HASH_BLOBS_ASYNC		0x10
 
 int
 read_blob_list(struct list_head *blob_list, size_t list_head_offset,
@@ -303,10 +394,18 @@ sha1_blob(struct blob_descriptor *blob);
 /* Functions to read/write metadata resources.  */
 
 int
-read_metadata_resource(struct wim_image_metadata *imd);
+read_metadata_resource(struct wim_image_metadata *imd, bool lazy);
+
+int
+preload_images(WIMStruct *wim, int first_image, int last_image);
+
+int
+prepare_metadata_resource(WIMStruct *wim, int image,
+			  struct blob_descriptor *blob);
 
 int
-write_metadata_resource(WIMStruct *wim, int image, int write_resource_flags);
+serialize_metadata_resource(struct wim_image_metadata *imd, u64 size,
+			    const struct consume_chunk_callback *cb);
 
 /* Definitions specific to pipable WIM resources.  */
 
@@ -9,7 +9,13 @@
 #include "wimlib/textfile.h"
 #include "wimlib/util.h"
 
+struct blob_descriptor;
 struct blob_table;
+struct metadata_spill;
+struct pattern_set;
+struct scan_hasher;
+struct stat_prefetcher;
+struct vss_snapshot;
 struct wim_dentry;
 struct wim_inode;
 
@@ -21,6 +27,10 @@ struct capture_config {
 	/* List of path patterns to include, overriding exclusion_pats  */
 	struct string_list exclusion_exception_pats;
 
+	/* The above lists compiled for matching  */
+	struct pattern_set *exclusion_set;
+	struct pattern_set *exclusion_exception_set;
+
 	void *buf;
 };
 
@@ -69,6 +79,20 @@ struct scan_params {
 	/* Can be used by the scan implementation.  */
 	u64 capture_root_ino;
 	u64 capture_root_dev;
+	struct stat_prefetcher *stat_prefetcher;
+	struct rpfix_cache *rpfix_cache;
+
+	/* If not NULL, the hasher to which new blobs are submitted as they are
+	 * discovered (WIMLIB_ADD_FLAG_HASH_DURING_SCAN)  */
+	struct scan_hasher *hasher;
+
+	/* If not NULL, the VSS snapshot set shared by all the sources of the
+	 * update (Windows only, WIMLIB_ADD_FLAG_SNAPSHOT)  */
+	struct vss_snapshot *snapshot_set;
+
+	/* If not NULL, the spill file to which completed directories are
+	 * written (WIMLIB_ADD_FLAG_SPILL_METADATA)  */
+	struct metadata_spill *spill;
 };
 
 /* scan.c */
@@ -94,6 +118,17 @@ match_pattern_list(const tchar *path, const struct string_list *list,
 int
 try_exclude(const struct scan_params *params);
 
+int
+start_scan_hasher(struct wimlib_thread_pool *pool,
+		  struct scan_hasher **hasher_ret);
+
+void
+scan_hasher_submit(struct scan_hasher *hasher, struct blob_descriptor *blob);
+
+void
+stop_scan_hasher(struct scan_hasher *hasher, struct list_head *unhashed_blobs,
+		 struct blob_table *blob_table);
+
 typedef int (*scan_tree_t)(struct wim_dentry **, const tchar *,
 			   struct scan_params *);
 
@@ -117,6 +152,11 @@ int
 unix_build_dentry_tree(struct wim_dentry **root_ret,
 		       const tchar *root_disk_path, struct scan_params *params);
 #define platform_default_scan_tree unix_build_dentry_tree
+
+/* tar_capture.c */
+int
+tar_build_dentry_tree(struct wim_dentry **root_ret,
+		      const tchar *archive_path, struct scan_params *params);
 #endif
 
 #ifdef ENABLE_TEST_SUPPORT
@@ -139,7 +179,10 @@ should_ignore_filename(const tchar *name, int name_nchars);
 
 void
 attach_scanned_tree(struct wim_dentry *parent, struct wim_dentry *child,
-		    struct blob_table *blob_table);
+		    struct scan_params *params);
+
+void
+free_scanned_tree(struct scan_params *params, struct wim_dentry *tree);
 
 int
 pathbuf_init(struct scan_params *params, const tchar *root_path);
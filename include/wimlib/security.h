@@ -9,10 +9,18 @@ struct avl_tree_node;
 /* Map from SHA1 message digests of security descriptors to security IDs, which
  * are themselves indices into the table of security descriptors in the 'struct
  * wim_security_data'. */
+#define SD_SET_NUM_RECENT	4
+
 struct wim_sd_set {
 	struct wim_security_data *sd;
 	struct avl_tree_node *root;
 	s32 orig_num_entries;
+
+	/* Security IDs most recently returned by sd_set_add_sd(), most recent
+	 * first, or -1.  Files near each other in a directory tree usually
+	 * have the same security descriptor, so comparing with these first
+	 * usually avoids computing the SHA-1 message digest.  */
+	s32 recent_ids[SD_SET_NUM_RECENT];
 };
 
 /* Table of security descriptors for a WIM image. */
@@ -0,0 +1,36 @@
+/*
+ * shared_chunk_cache.h
+ *
+ * A cache of decompressed chunks in shared memory, for sharing decompressed
+ * data between processes that read the same WIM file.
+ */
+
+#ifndef _WIMLIB_SHARED_CHUNK_CACHE_H
+#define _WIMLIB_SHARED_CHUNK_CACHE_H
+
+#include "wimlib/types.h"
+
+struct filedes;
+struct shared_chunk_cache;
+
+int
+shared_chunk_cache_open(const tchar *path, u64 size, u32 slot_size,
+			const u8 *guid, const struct filedes *in_fd,
+			struct shared_chunk_cache **cache_ret);
+
+void
+shared_chunk_cache_close(struct shared_chunk_cache *cache);
+
+void
+shared_chunk_cache_set_file(struct shared_chunk_cache *cache,
+			    const struct filedes *in_fd);
+
+bool
+shared_chunk_cache_lookup(struct shared_chunk_cache *cache, u64 res_offset,
+			  u64 index, void *buf, u32 size);
+
+void
+shared_chunk_cache_insert(struct shared_chunk_cache *cache, u64 res_offset,
+			  u64 index, const void *data, u32 size);
+
+#endif /* _WIMLIB_SHARED_CHUNK_CACHE_H */
@@ -1,9 +1,12 @@
 #ifndef _WIMLIB_SOLID_H
 #define _WIMLIB_SOLID_H
 
+#include <stdbool.h>
+
 struct list_head;
 
 int
-sort_blob_list_for_solid_compression(struct list_head *blob_list);
+sort_blob_list_for_solid_compression(struct list_head *blob_list,
+				     bool by_content);
 
 #endif /* _WIMLIB_SOLID_H */
@@ -0,0 +1,35 @@
+#ifndef _WIMLIB_SPILL_H
+#define _WIMLIB_SPILL_H
+
+#include "wimlib/types.h"
+
+struct blob_table;
+struct metadata_spill;
+struct wim_dentry;
+
+/*
+ * Out-of-core capture (WIMLIB_ADD_FLAG_SPILL_METADATA).  As the scan completes
+ * directories, their children are written to a temporary "spill file" in the
+ * metadata resource format and freed.  The spilled directories stay in the tree
+ * with d_children_unloaded set, and after the scan, the spill file serves as
+ * the image's lazy loader (see metadata_resource.c).
+ */
+
+int
+new_metadata_spill(struct blob_table *blob_table,
+		   struct metadata_spill **spill_ret);
+
+void
+free_metadata_spill(struct metadata_spill *spill);
+
+void
+metadata_spill_attached(struct metadata_spill *spill, struct wim_dentry *child);
+
+void
+metadata_spill_free_tree(struct metadata_spill *spill, struct wim_dentry *tree);
+
+int
+metadata_spill_finish(struct metadata_spill *spill, const u8 **buf_ret,
+		      size_t *buf_len_ret);
+
+#endif /* _WIMLIB_SPILL_H */
@@ -0,0 +1,148 @@
+/*
+ * stats.h
+ *
+ * Performance counters, as returned by wimlib_get_stats().
+ */
+
+#ifndef _WIMLIB_STATS_H
+#define _WIMLIB_STATS_H
+
+#include "wimlib.h"
+#include "wimlib/compiler.h"
+#include "wimlib/types.h"
+
+extern struct wimlib_stats global_stats;
+
+/* Add @v to a counter in global_stats.  Counters are updated by many threads,
+ * so this is atomic, but it imposes no ordering, so it is cheap.  Counters
+ * should only be updated at a coarse granularity, such as once per chunk or
+ * system call, to keep the cache line bouncing between threads rarely.  */
+#define STATS_ADD(field, v)	\
+	__atomic_fetch_add(&global_stats.field, (v), __ATOMIC_RELAXED)
+
+/* Account for @size bytes of memory being allocated for @cat, which is one of
+ * metadata, blob_table, compressor, or io_buffer, and update its peak.  */
+#define MEM_ALLOCATED(cat, size)					\
+	mem_allocated(&global_stats.cat##_mem,				\
+		      &global_stats.cat##_mem_peak, (size))
+
+/* Account for @size bytes of memory allocated for @cat being freed.  */
+#define MEM_FREED(cat, size)	\
+	__atomic_fetch_sub(&global_stats.cat##_mem, (size), __ATOMIC_RELAXED)
+
+/* Atomically raise *@max to @v if @v is greater.  */
+static inline void
+stats_update_max(u64 *max, u64 v)
+{
+	u64 p = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (v > p && !__atomic_compare_exchange_n(max, &p, v, true,
+						      __ATOMIC_RELAXED,
+						      __ATOMIC_RELAXED))
+		;
+}
+
+static inline void
+mem_allocated(u64 *live, u64 *peak, u64 size)
+{
+	stats_update_max(peak, __atomic_add_fetch(live, size, __ATOMIC_RELAXED));
+}
+
+/* Return a monotonic time in nanoseconds.  */
+u64
+stats_now_ns(void);
+
+/* Return the CPU time consumed by the whole process so far, in nanoseconds.  */
+u64
+stats_cpu_ns(void);
+
+/* Add the time elapsed since @start, as returned by stats_now_ns(), to a
+ * counter in global_stats.  */
+#define STATS_ADD_ELAPSED(field, start)	\
+	STATS_ADD(field, stats_now_ns() - (start))
+
+/* The start of a phase of an operation, such as the scanning of a directory
+ * tree or the writing of a WIM file, whose wall clock and CPU times are
+ * counted.  */
+struct stats_phase {
+	u64 wall_start;
+	u64 cpu_start;
+};
+
+static inline void
+stats_begin_phase(struct stats_phase *phase)
+{
+	phase->wall_start = stats_now_ns();
+	phase->cpu_start = stats_cpu_ns();
+}
+
+#define stats_end_phase(phase, name)					\
+do {									\
+	STATS_ADD(name##_wall_ns, stats_now_ns() - (phase)->wall_start);	\
+	STATS_ADD(name##_cpu_ns, stats_cpu_ns() - (phase)->cpu_start);	\
+} while (0)
+
+int
+report_stats(wimlib_progress_func_t progfunc, void *progctx);
+
+/*
+ * Latency histograms of the system calls made to read the files being
+ * captured, collected with WIMLIB_INIT_FLAG_PROFILE_SYSCALLS.  Wrap each call
+ * like this:
+ *
+ *	u64 start = syscall_profile_begin();
+ *	ret = fstatat(...);
+ *	syscall_profile_end(WIMLIB_SYSCALL_STAT, start);
+ *
+ * When profiling is disabled, this costs only a test of a global flag.
+ */
+extern bool syscall_profiling_enabled;
+
+static inline u64
+syscall_profile_begin(void)
+{
+	return unlikely(syscall_profiling_enabled) ? stats_now_ns() : 0;
+}
+
+void
+record_syscall_latency(enum wimlib_syscall_type type, u64 start);
+
+static inline void
+syscall_profile_end(enum wimlib_syscall_type type, u64 start)
+{
+	if (unlikely(start))
+		record_syscall_latency(type, start);
+}
+
+/*
+ * Tracing of what the threads are doing, for tuning the thread pool and the
+ * parallel compressor.  If the environment variable WIMLIB_TRACE_FILE is set
+ * when the library is initialized, events are appended to that file in the
+ * JSON array flavor of the Chrome trace event format, which can be loaded into
+ * chrome://tracing or Perfetto.  Thread 0 is whichever thread called into the
+ * library; each thread of each thread pool gets its own number.
+ */
+extern bool trace_enabled;
+
+void
+init_trace(void);
+
+void
+flush_trace(void);
+
+void
+cleanup_trace(void);
+
+unsigned
+trace_register_thread(const char *name, unsigned idx);
+
+/* Record that thread @tid spent the time from @start_ns to @end_ns, as returned
+ * by stats_now_ns(), doing what @name says.  */
+void
+trace_span(unsigned tid, const char *name, u64 start_ns, u64 end_ns);
+
+/* Record the value of a counter, such as a queue depth, at the current time. */
+void
+trace_counter(const char *name, u64 value);
+
+#endif /* _WIMLIB_STATS_H */
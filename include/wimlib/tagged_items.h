@@ -20,6 +20,24 @@ struct wim_inode;
  */
 #define TAG_WIMLIB_LINUX_XATTRS		0x337DD874
 
+/*
+ * [wimlib extension] UNIX inode number and status change time, recorded only
+ * to detect unmodified files when capturing an update of an image
+ */
+#define TAG_WIMLIB_UNIX_CHANGE_INFO	0x337DD875
+
+/*
+ * [wimlib extension] NTFS file reference number and update sequence number
+ * (USN), recorded only to detect unmodified files when capturing an update of
+ * an image
+ */
+#define TAG_WIMLIB_NTFS_USN_INFO	0x337DD876
+
+struct wim_inode_extra;
+
+void
+index_tagged_items(struct wim_inode_extra *extra);
+
 void *
 inode_get_tagged_item(const struct wim_inode *inode, u32 tag, u32 min_len,
 		      u32 *actual_len_ret);
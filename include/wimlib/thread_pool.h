@@ -0,0 +1,51 @@
+/*
+ * thread_pool.h
+ *
+ * A pool of compression threads that can be shared by multiple operations.
+ */
+
+#ifndef _WIMLIB_THREAD_POOL_H
+#define _WIMLIB_THREAD_POOL_H
+
+#include "wimlib/list.h"
+#include "wimlib/types.h"
+
+struct wimlib_compressor;
+struct wimlib_thread_pool;
+
+/* An item of work to be run by one of the threads of a thread pool.  */
+struct thread_pool_work {
+	struct list_head list;
+	void (*run)(struct thread_pool_work *work);
+
+	/* What the work does, for tracing; NULL means "work".  */
+	const char *name;
+};
+
+int
+thread_pool_create(unsigned num_threads, struct wimlib_thread_pool **pool_ret);
+
+void
+thread_pool_get(struct wimlib_thread_pool *pool);
+
+void
+thread_pool_put(struct wimlib_thread_pool *pool);
+
+unsigned
+thread_pool_num_threads(const struct wimlib_thread_pool *pool);
+
+void
+thread_pool_submit(struct wimlib_thread_pool *pool,
+		   struct thread_pool_work *work, unsigned *cursor);
+
+int
+thread_pool_get_compressor(struct wimlib_thread_pool *pool, int ctype,
+			   u32 max_block_size, unsigned level,
+			   struct wimlib_compressor **compressor_ret);
+
+void
+thread_pool_put_compressor(struct wimlib_thread_pool *pool, int ctype,
+			   u32 max_block_size, unsigned level,
+			   struct wimlib_compressor *compressor);
+
+#endif /* _WIMLIB_THREAD_POOL_H */
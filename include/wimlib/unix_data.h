@@ -30,4 +30,20 @@ bool
 inode_set_unix_data(struct wim_inode *inode,
 		    struct wimlib_unix_data *unix_data, int which);
 
+/* The identity of a file at capture time, as far as UNIX can tell: the inode
+ * number, and the time of the last change to the file's data or metadata (as a
+ * WIM timestamp).  Neither is restored when extracting.  */
+struct wimlib_unix_change_info {
+	u64 ino;
+	u64 ctime;
+};
+
+bool
+inode_get_unix_change_info(const struct wim_inode *inode,
+			   struct wimlib_unix_change_info *info);
+
+bool
+inode_set_unix_change_info(struct wim_inode *inode,
+			   const struct wimlib_unix_change_info *info);
+
 #endif /* _WIMLIB_UNIX_DATA_H  */
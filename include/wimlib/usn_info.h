@@ -0,0 +1,54 @@
+#ifndef _WIMLIB_USN_INFO_H
+#define _WIMLIB_USN_INFO_H
+
+#include "wimlib/endianness.h"
+#include "wimlib/tagged_items.h"
+
+/*
+ * The state of a file in the NTFS change journal at capture time.  NTFS stores
+ * in each file the USN of the last change journal record written for it, and
+ * USNs only increase within a journal, so a file whose USN is unchanged in the
+ * same journal hasn't been modified.  Unlike timestamps, USNs can't be set by
+ * applications.
+ */
+struct wimlib_usn_info {
+	u64 journal_id;
+	u64 file_id;
+	u64 usn;
+};
+
+struct wimlib_usn_info_disk {
+	le64 journal_id;
+	le64 file_id;
+	le64 usn;
+};
+
+static inline bool
+inode_get_usn_info(const struct wim_inode *inode, struct wimlib_usn_info *info)
+{
+	const struct wimlib_usn_info_disk *p;
+
+	p = inode_get_tagged_item(inode, TAG_WIMLIB_NTFS_USN_INFO,
+				  sizeof(*p), NULL);
+	if (!p)
+		return false;
+	info->journal_id = le64_to_cpu(p->journal_id);
+	info->file_id = le64_to_cpu(p->file_id);
+	info->usn = le64_to_cpu(p->usn);
+	return true;
+}
+
+static inline bool
+inode_set_usn_info(struct wim_inode *inode, const struct wimlib_usn_info *info)
+{
+	struct wimlib_usn_info_disk p = {
+		.journal_id = cpu_to_le64(info->journal_id),
+		.file_id = cpu_to_le64(info->file_id),
+		.usn = cpu_to_le64(info->usn),
+	};
+
+	return inode_set_tagged_item(inode, TAG_WIMLIB_NTFS_USN_INFO,
+				     &p, sizeof(p));
+}
+
+#endif /* _WIMLIB_USN_INFO_H */
@@ -68,6 +68,14 @@ wimlib_aligned_malloc(size_t size, size_t alignment);
 void
 wimlib_aligned_free(void *ptr);
 
+/* Allocate a large, long-lived buffer, 64-byte aligned and backed by huge
+ * pages if possible.  Must be freed with wimlib_large_free().  */
+void *
+wimlib_large_malloc(size_t size);
+
+void
+wimlib_large_free(void *ptr);
+
 void *
 memdup(const void *mem, size_t size);
 
@@ -79,6 +87,8 @@ memdup(const void *mem, size_t size);
 #define WCSDUP		wimlib_wcsdup
 #define ALIGNED_MALLOC	wimlib_aligned_malloc
 #define ALIGNED_FREE	wimlib_aligned_free
+#define LARGE_MALLOC	wimlib_large_malloc
+#define LARGE_FREE	wimlib_large_free
 
 /*******************
  * String utilities
@@ -146,4 +156,7 @@ get_available_cpus(void);
 u64
 get_available_memory(void);
 
+u64
+get_memory_limit(void);
+
 #endif /* _WIMLIB_UTIL_H */
@@ -9,10 +9,16 @@
 #include "wimlib/file_io.h"
 #include "wimlib/header.h"
 #include "wimlib/list.h"
+#include "wimlib/threads.h"
 
+struct blob_table;
+struct chunk_cache;
+struct chunk_decompressor;
+struct integrity_hasher;
 struct wim_image_metadata;
 struct wim_xml_info;
-struct blob_table;
+struct windows_info_cache;
+struct write_checkpoint;
 
 /*
  * WIMStruct - represents a WIM, or a part of a non-standalone WIM
@@ -34,9 +40,10 @@ struct blob_table;
  *	  (as this references the metadata rather than copies it)
  *
  * Note 3: It is unsafe for multiple threads to operate on the same WIMStruct at
- * the same time.  This extends to references to other WIMStructs as noted
- * above.  But besides this, it is safe to operate on *different* WIMStructs in
- * different threads concurrently.
+ * the same time, except that images may be added by concurrent calls to
+ * wimlib_add_image_multisource(); see 'add_image_lock'.  This extends to
+ * references to other WIMStructs as noted above.  But besides this, it is safe
+ * to operate on *different* WIMStructs in different threads concurrently.
  */
 struct WIMStruct {
 
@@ -61,6 +68,10 @@ struct WIMStruct {
 	 * also maintained for a WIMStruct not backed by a file.  */
 	struct wim_xml_info *xml_info;
 
+	/* Windows-specific image information gathered from files seen in
+	 * images captured so far, or NULL; see xml_windows.c.  */
+	struct windows_info_cache *windows_info_cache;
+
 	/* The blob table for this WIMStruct.  If this WIMStruct has a backing
 	 * file, then this table will index the blobs contained in that file.
 	 * In addition, this table may index blobs that were added by updates or
@@ -96,6 +107,14 @@ struct WIMStruct {
 	 * Otherwise, this field is invalid (!filedes_valid(&out_fd)).  */
 	struct filedes out_fd;
 
+	/* If not NULL, computes the integrity table of the file being written
+	 * to @out_fd as the data is written; see start_integrity_hasher().  */
+	struct integrity_hasher *integrity_hasher;
+
+	/* If not NULL, records the blobs written to @out_fd so that the write
+	 * can be resumed if it is interrupted; see write_checkpoint_open().  */
+	struct write_checkpoint *write_checkpoint;
+
 	/* The size of the backing file, or 0 if unknown */
 	u64 file_size;
 
@@ -113,6 +132,42 @@ struct WIMStruct {
 	u8 decompressor_ctype;
 	u32 decompressor_max_block_size;
 
+	/* The cached parallel chunk decompressor for this WIM file, or NULL if
+	 * none is cached yet.  This is used instead of @decompressor when
+	 * reading multiple chunks at once, if @num_decompression_threads is not
+	 * 1.  */
+	struct chunk_decompressor *parallel_decompressor;
+
+	/* Number of threads to use for decompressing data from this WIM file,
+	 * or 0 to use one thread per processor.  Can be changed by
+	 * wimlib_set_decompression_threads(); defaults to 1.  */
+	unsigned num_decompression_threads;
+
+	/* Cache of decompressed chunks and parsed chunk tables for
+	 * random-access reads of compressed resources from this WIM file, or
+	 * NULL if not allocated yet; and the memory budget for it, or 0 to
+	 * disable it.  The budget can be changed by
+	 * wimlib_set_chunk_cache_size().  */
+	struct chunk_cache *chunk_cache;
+	u64 max_chunk_cache_size;
+
+	/* Cache of decompressed chunks shared with other processes reading
+	 * this WIM file, or NULL if none.  Set by
+	 * wimlib_set_shared_chunk_cache().  */
+	struct shared_chunk_cache *shared_chunk_cache;
+
+	/* The thread pool to use for compressing data written from this
+	 * WIMStruct, or NULL to create threads for each write.  Set by
+	 * wimlib_set_thread_pool().  A reference to the pool is held.  */
+	struct wimlib_thread_pool *thread_pool;
+
+	/* Serializes the calls to wimlib_add_image_multisource() that are
+	 * adding images to this WIMStruct concurrently.  Each of them captures
+	 * its image into a separate WIMStruct, and only takes this lock to
+	 * check the image name and to move the finished image, its XML
+	 * information, and its blobs into this WIMStruct.  */
+	struct mutex add_image_lock;
+
 	/* Temporary field; use sparingly  */
 	void *private;
 
@@ -126,6 +181,10 @@ struct WIMStruct {
 	 * with WIMLIB_WRITE_FLAG_UNSAFE_COMPACT  */
 	u8 being_compacted : 1;
 
+	/* 1 if the WIM file was opened from a file descriptor rather than by
+	 * name, so it has no filename  */
+	u8 opened_from_fd : 1;
+
 	/* If this WIM is backed by a file, then this is the compression type
 	 * for non-solid resources in that file.  */
 	u8 compression_type;
@@ -152,6 +211,31 @@ struct WIMStruct {
 	 * wimlib_set_output_pack_chunk_size().  */
 	u32 out_solid_chunk_size;
 
+	/* Number of solid resources into which to divide the file data written
+	 * in solid mode, or 0 for one; can be set with
+	 * wimlib_set_output_solid_resource_count().  */
+	unsigned out_num_solid_resources;
+
+	/* Size of the buffer in which data written to the output WIM file is
+	 * collected before it is written, or 0 for no buffer; can be set with
+	 * wimlib_set_output_buffer_size().  */
+	size_t out_buffer_size;
+
+	/* Target rate, in megabytes per second, at which to compress data when
+	 * writing, or 0 for none; can be set with
+	 * wimlib_set_output_compression_target().  */
+	unsigned out_compression_target;
+
+	/* Comma-separated addresses of the compression workers to which to
+	 * send data to be compressed when writing, or NULL for none; can be set
+	 * with wimlib_set_output_compression_workers().  */
+	tchar *out_compression_workers;
+
+	/* How far ahead of the data being read the kernel is asked to read in
+	 * the WIM file, or 0 for no read-ahead requests; can be set with
+	 * wimlib_set_read_ahead_size().  */
+	u64 read_ahead_size;
+
 	/* Currently registered progress function for this WIMStruct, or NULL if
 	 * no progress function is currently registered for this WIMStruct.  */
 	wimlib_progress_func_t progfunc;
@@ -194,6 +278,15 @@ wim_decrement_refcnt(WIMStruct *wim);
 bool
 wim_has_solid_resources(const WIMStruct *wim);
 
+bool
+wim_compression_type_valid(enum wimlib_compression_type ctype);
+
+bool
+wim_chunk_size_valid(u32 chunk_size, enum wimlib_compression_type ctype);
+
+u32
+wim_max_chunk_size(enum wimlib_compression_type ctype);
+
 int
 read_wim_header(WIMStruct *wim, struct wim_header *hdr);
 
@@ -207,12 +300,24 @@ write_wim_header_flags(u32 hdr_flags, struct filedes *out_fd);
 int
 select_wim_image(WIMStruct *wim, int image);
 
+int
+select_wim_image_lazily(WIMStruct *wim, int image);
+
 void
 deselect_current_wim_image(WIMStruct *wim);
 
+void
+pin_current_wim_image(WIMStruct *wim);
+
+void
+unpin_wim_image(WIMStruct *wim, int image);
+
 int
 for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *));
 
+int
+for_image_lazily(WIMStruct *wim, int image, int (*visitor)(WIMStruct *));
+
 int
 wim_checksum_unhashed_blobs(WIMStruct *wim);
 
@@ -222,6 +327,8 @@ delete_wim_image(WIMStruct *wim, int image);
 /* Internal open flags (pass to open_wim_as_WIMStruct(), not wimlib_open_wim())
  */
 #define WIMLIB_OPEN_FLAG_FROM_PIPE	0x80000000
+#define WIMLIB_OPEN_FLAG_FROM_READER	0x40000000
+#define WIMLIB_OPEN_FLAG_FROM_FD	0x20000000
 
 int
 open_wim_as_WIMStruct(const void *wim_filename_or_fd, int open_flags,
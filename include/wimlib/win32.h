@@ -46,6 +46,9 @@ win32_rename_replacement(const tchar *oldpath, const tchar *newpath);
 int
 win32_truncate_replacement(const tchar *path, off_t size);
 
+int
+win32_set_file_size(int fd, u64 size);
+
 int
 win32_strerror_r_replacement(int errnum, tchar *buf, size_t buflen);
 
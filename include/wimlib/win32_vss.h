@@ -8,6 +8,8 @@
 
 #include "wimlib/win32_common.h"
 
+struct wimlib_update_command;
+
 /* A reference counter for a VSS snapshot.  This is embedded in another data
  * structure only visible to win32_vss.c.  */
 struct vss_snapshot {
@@ -36,7 +38,12 @@ vss_put_snapshot(struct vss_snapshot *snapshot)
 }
 
 int
-vss_create_snapshot(const wchar_t *source, UNICODE_STRING *vss_path_ret,
+vss_create_snapshot_set(const struct wimlib_update_command *cmds,
+			size_t num_cmds, struct vss_snapshot **snapshot_ret);
+
+int
+vss_create_snapshot(const wchar_t *source, struct vss_snapshot *snapshot_set,
+		    UNICODE_STRING *vss_path_ret,
 		    struct vss_snapshot **snapshot_ret);
 
 void
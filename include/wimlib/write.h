@@ -10,6 +10,7 @@
 #define WIMLIB_WRITE_FLAG_NO_NEW_BLOBS			0x20000000
 #define WIMLIB_WRITE_FLAG_USE_EXISTING_TOTALBYTES	0x10000000
 #define WIMLIB_WRITE_FLAG_NO_METADATA			0x08000000
+#define WIMLIB_WRITE_FLAG_BLOB_STORE_PACK		0x04000000
 
 /* Keep in sync with wimlib.h  */
 #define WIMLIB_WRITE_MASK_PUBLIC (			  \
@@ -28,7 +29,15 @@
 	WIMLIB_WRITE_FLAG_SOLID				| \
 	WIMLIB_WRITE_FLAG_SEND_DONE_WITH_FILE_MESSAGES	| \
 	WIMLIB_WRITE_FLAG_NO_SOLID_SORT			| \
-	WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)
+	WIMLIB_WRITE_FLAG_UNSAFE_COMPACT		| \
+	WIMLIB_WRITE_FLAG_MULTI_CANDIDATE		| \
+	WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT		| \
+	WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES		| \
+	WIMLIB_WRITE_FLAG_UNCACHED			| \
+	WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS		| \
+	WIMLIB_WRITE_FLAG_NO_FILE_DATA			| \
+	WIMLIB_WRITE_FLAG_BINARY_DELTA			| \
+	WIMLIB_WRITE_FLAG_RESUMABLE)
 
 #if defined(HAVE_SYS_FILE_H) && defined(HAVE_FLOCK)
 int
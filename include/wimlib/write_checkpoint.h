@@ -0,0 +1,44 @@
+/*
+ * write_checkpoint.h
+ *
+ * Checkpoints that allow an interrupted write of a WIM file to be resumed.
+ */
+
+#ifndef _WIMLIB_WRITE_CHECKPOINT_H
+#define _WIMLIB_WRITE_CHECKPOINT_H
+
+#include "wimlib/sha1.h"
+#include "wimlib/types.h"
+
+struct blob_descriptor;
+struct filedes;
+struct wim_header;
+struct write_checkpoint;
+
+int
+write_checkpoint_open(const tchar *wim_path, struct wim_header *out_hdr,
+		      struct write_checkpoint **cp_ret);
+
+u64
+write_checkpoint_resume_offset(const struct write_checkpoint *cp);
+
+bool
+write_checkpoint_has_size(const struct write_checkpoint *cp, u64 size);
+
+bool
+write_checkpoint_restore_blob(const struct write_checkpoint *cp,
+			      const u8 hash[SHA1_HASH_SIZE],
+			      struct blob_descriptor *blob);
+
+int
+write_checkpoint_add_blob(struct write_checkpoint *cp,
+			  const struct blob_descriptor *blob,
+			  struct filedes *out_fd);
+
+int
+write_checkpoint_commit(struct write_checkpoint *cp, struct filedes *out_fd);
+
+void
+write_checkpoint_close(struct write_checkpoint *cp, bool remove);
+
+#endif /* _WIMLIB_WRITE_CHECKPOINT_H */
@@ -6,4 +6,7 @@
 int
 set_windows_specific_info(WIMStruct *wim);
 
+void
+free_windows_info_cache(WIMStruct *wim);
+
 #endif /* _WIMLIB_XML_WINDOWS_H */
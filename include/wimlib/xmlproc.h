@@ -19,6 +19,10 @@ struct xml_node {
 	struct xml_node *parent;	/* parent, or NULL if none */
 	struct list_head children;	/* children; only used for ELEMENT */
 	struct list_head sibling_link;
+	/* If not NULL, the raw text of the contents of this ELEMENT, which
+	 * haven't been parsed yet; see xml_parse_document_lazily().  Then the
+	 * only children so far are ATTRIBUTEs.  */
+	tchar *deferred_contents;
 };
 
 /* Iterate through the children of an xml_node.  Does nothing if passed NULL. */
@@ -76,6 +80,13 @@ xml_legal_value(const tchar *value);
 int
 xml_parse_document(const tchar *raw_doc, struct xml_node **doc_ret);
 
+int
+xml_parse_document_lazily(const tchar *raw_doc, const tchar *lazy_name,
+			  struct xml_node **doc_ret);
+
+int
+xml_element_parse_deferred(struct xml_node *element);
+
 /*****************************************************************************/
 
 struct xml_out_buf {
@@ -129,6 +129,9 @@ enum {
 #endif
 	CMD_UPDATE,
 	CMD_VERIFY,
+#ifndef _WIN32
+	CMD_WORKER,
+#endif
 	CMD_MAX,
 };
 
@@ -160,16 +163,25 @@ static void imagex_flush_output(void)
 		fflush(imagex_info_file);
 }
 
+/* Long option values.  These start above the range of characters so that none
+ * of them can be confused with the '?' that getopt returns for an unrecognized
+ * option.  */
 enum {
-	IMAGEX_ALLOW_OTHER_OPTION,
+	IMAGEX_ALLOW_OTHER_OPTION = 256,
+	IMAGEX_ARCHIVE_OPTION,
+	IMAGEX_BINARY_DELTA_OPTION,
 	IMAGEX_BLOBS_OPTION,
+	IMAGEX_BLOB_STORE_OPTION,
 	IMAGEX_BOOT_OPTION,
+	IMAGEX_CACHED_METADATA_OPTION,
 	IMAGEX_CHECK_OPTION,
 	IMAGEX_CHUNK_SIZE_OPTION,
+	IMAGEX_CLONE_DUPLICATES_OPTION,
 	IMAGEX_COMMAND_OPTION,
 	IMAGEX_COMMIT_OPTION,
 	IMAGEX_COMPACT_OPTION,
 	IMAGEX_COMPRESS_OPTION,
+	IMAGEX_COMPRESSION_WORKERS_OPTION,
 	IMAGEX_CONFIG_OPTION,
 	IMAGEX_CREATE_OPTION,
 	IMAGEX_DEBUG_OPTION,
@@ -180,24 +192,32 @@ enum {
 	IMAGEX_EXTRACT_XML_OPTION,
 	IMAGEX_FLAGS_OPTION,
 	IMAGEX_FORCE_OPTION,
+	IMAGEX_HASH_CACHE_OPTION,
+	IMAGEX_HASH_DURING_SCAN_OPTION,
 	IMAGEX_HEADER_OPTION,
 	IMAGEX_IMAGE_PROPERTY_OPTION,
 	IMAGEX_INCLUDE_INTEGRITY_OPTION,
 	IMAGEX_INCLUDE_INVALID_NAMES_OPTION,
+	IMAGEX_LARGE_FILE_CHUNKS_OPTION,
 	IMAGEX_LAZY_OPTION,
 	IMAGEX_METADATA_OPTION,
+	IMAGEX_MMAP_OPTION,
+	IMAGEX_MULTI_CANDIDATE_OPTION,
+	IMAGEX_MULTITHREADED_OPTION,
 	IMAGEX_NEW_IMAGE_OPTION,
 	IMAGEX_NOCHECK_OPTION,
 	IMAGEX_NORPFIX_OPTION,
 	IMAGEX_NOT_PIPABLE_OPTION,
 	IMAGEX_NO_ACLS_OPTION,
 	IMAGEX_NO_ATTRIBUTES_OPTION,
+	IMAGEX_NO_FILE_DATA_OPTION,
 	IMAGEX_NO_GLOBS_OPTION,
 	IMAGEX_NO_REPLACE_OPTION,
 	IMAGEX_NO_SOLID_SORT_OPTION,
 	IMAGEX_NULLGLOB_OPTION,
 	IMAGEX_ONE_FILE_ONLY_OPTION,
 	IMAGEX_PATH_OPTION,
+	IMAGEX_PHYSICAL_ORDER_OPTION,
 	IMAGEX_PIPABLE_OPTION,
 	IMAGEX_PRESERVE_DIR_STRUCTURE_OPTION,
 	IMAGEX_REBUILD_OPTION,
@@ -205,20 +225,30 @@ enum {
 	IMAGEX_RECOVER_DATA_OPTION,
 	IMAGEX_RECURSIVE_OPTION,
 	IMAGEX_REF_OPTION,
+	IMAGEX_RESUMABLE_OPTION,
 	IMAGEX_RPFIX_OPTION,
+	IMAGEX_SHARED_CHUNK_CACHE_OPTION,
 	IMAGEX_SNAPSHOT_OPTION,
 	IMAGEX_SOFT_OPTION,
 	IMAGEX_SOLID_CHUNK_SIZE_OPTION,
 	IMAGEX_SOLID_COMPRESS_OPTION,
 	IMAGEX_SOLID_OPTION,
+	IMAGEX_SOLID_RESOURCES_OPTION,
+	IMAGEX_SOLID_SMALL_FILES_OPTION,
+	IMAGEX_SOLID_SORT_BY_CONTENT_OPTION,
 	IMAGEX_SOURCE_LIST_OPTION,
+	IMAGEX_SPILL_METADATA_OPTION,
 	IMAGEX_STAGING_DIR_OPTION,
+	IMAGEX_STATS_OPTION,
 	IMAGEX_STREAMS_INTERFACE_OPTION,
 	IMAGEX_STRICT_ACLS_OPTION,
+	IMAGEX_TAR_OPTION,
 	IMAGEX_THREADS_OPTION,
 	IMAGEX_TO_STDOUT_OPTION,
+	IMAGEX_UNCACHED_OPTION,
 	IMAGEX_UNIX_DATA_OPTION,
 	IMAGEX_UNSAFE_COMPACT_OPTION,
+	IMAGEX_UPDATE_OPTION,
 	IMAGEX_UPDATE_OF_OPTION,
 	IMAGEX_VERBOSE_OPTION,
 	IMAGEX_WIMBOOT_CONFIG_OPTION,
@@ -241,6 +271,12 @@ static const struct option apply_options[] = {
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("compact"),     required_argument, NULL, IMAGEX_COMPACT_OPTION},
 	{T("recover-data"), no_argument,      NULL, IMAGEX_RECOVER_DATA_OPTION},
+	{T("mmap"),        no_argument,       NULL, IMAGEX_MMAP_OPTION},
+	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("clone-duplicates"), no_argument,  NULL, IMAGEX_CLONE_DUPLICATES_OPTION},
+	{T("update"),      no_argument,       NULL, IMAGEX_UPDATE_OPTION},
+	{T("tar"),         no_argument,       NULL, IMAGEX_TAR_OPTION},
+	{T("stats"),       no_argument,       NULL, IMAGEX_STATS_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -255,7 +291,17 @@ static const struct option capture_or_append_options[] = {
 	{T("solid"),       no_argument,      NULL, IMAGEX_SOLID_OPTION},
 	{T("solid-compress"),required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
+	{T("solid-resources"),required_argument, NULL, IMAGEX_SOLID_RESOURCES_OPTION},
+	{T("compression-workers"), required_argument, NULL, IMAGEX_COMPRESSION_WORKERS_OPTION},
 	{T("no-solid-sort"), no_argument,     NULL, IMAGEX_NO_SOLID_SORT_OPTION},
+	{T("solid-sort-by-content"), no_argument, NULL, IMAGEX_SOLID_SORT_BY_CONTENT_OPTION},
+	{T("solid-small-files"), no_argument, NULL, IMAGEX_SOLID_SMALL_FILES_OPTION},
+	{T("large-file-chunks"), no_argument, NULL, IMAGEX_LARGE_FILE_CHUNKS_OPTION},
+	{T("uncached"),    no_argument,       NULL, IMAGEX_UNCACHED_OPTION},
+	{T("multi-candidate"), no_argument,   NULL, IMAGEX_MULTI_CANDIDATE_OPTION},
+	{T("no-file-data"), no_argument,      NULL, IMAGEX_NO_FILE_DATA_OPTION},
+	{T("resumable"),   no_argument,       NULL, IMAGEX_RESUMABLE_OPTION},
+	{T("blob-store"),  required_argument, NULL, IMAGEX_BLOB_STORE_OPTION},
 	{T("config"),      required_argument, NULL, IMAGEX_CONFIG_OPTION},
 	{T("dereference"), no_argument,       NULL, IMAGEX_DEREFERENCE_OPTION},
 	{T("flags"),       required_argument, NULL, IMAGEX_FLAGS_OPTION},
@@ -274,10 +320,18 @@ static const struct option capture_or_append_options[] = {
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
 	{T("update-of"),   required_argument, NULL, IMAGEX_UPDATE_OF_OPTION},
 	{T("delta-from"),  required_argument, NULL, IMAGEX_DELTA_FROM_OPTION},
+	{T("binary-delta"), no_argument,      NULL, IMAGEX_BINARY_DELTA_OPTION},
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("unsafe-compact"), no_argument,    NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
 	{T("snapshot"),    no_argument,       NULL, IMAGEX_SNAPSHOT_OPTION},
 	{T("create"),      no_argument,       NULL, IMAGEX_CREATE_OPTION},
+	{T("hash-during-scan"), no_argument,  NULL, IMAGEX_HASH_DURING_SCAN_OPTION},
+	{T("hash-cache"),  no_argument,       NULL, IMAGEX_HASH_CACHE_OPTION},
+	{T("spill-metadata"), no_argument,    NULL, IMAGEX_SPILL_METADATA_OPTION},
+	{T("cached-metadata"), no_argument,   NULL, IMAGEX_CACHED_METADATA_OPTION},
+	{T("physical-order"), no_argument,    NULL, IMAGEX_PHYSICAL_ORDER_OPTION},
+	{T("archive"),     no_argument,       NULL, IMAGEX_ARCHIVE_OPTION},
+	{T("stats"),       no_argument,       NULL, IMAGEX_STATS_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -309,7 +363,14 @@ static const struct option export_options[] = {
 	{T("solid"),       no_argument,       NULL, IMAGEX_SOLID_OPTION},
 	{T("solid-compress"),required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
+	{T("solid-resources"),required_argument, NULL, IMAGEX_SOLID_RESOURCES_OPTION},
+	{T("compression-workers"), required_argument, NULL, IMAGEX_COMPRESSION_WORKERS_OPTION},
 	{T("no-solid-sort"), no_argument,     NULL, IMAGEX_NO_SOLID_SORT_OPTION},
+	{T("solid-sort-by-content"), no_argument, NULL, IMAGEX_SOLID_SORT_BY_CONTENT_OPTION},
+	{T("solid-small-files"), no_argument, NULL, IMAGEX_SOLID_SMALL_FILES_OPTION},
+	{T("large-file-chunks"), no_argument, NULL, IMAGEX_LARGE_FILE_CHUNKS_OPTION},
+	{T("uncached"),    no_argument,       NULL, IMAGEX_UNCACHED_OPTION},
+	{T("multi-candidate"), no_argument,   NULL, IMAGEX_MULTI_CANDIDATE_OPTION},
 	{T("ref"),         required_argument, NULL, IMAGEX_REF_OPTION},
 	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
 	{T("rebuild"),     no_argument,       NULL, IMAGEX_REBUILD_OPTION},
@@ -317,6 +378,7 @@ static const struct option export_options[] = {
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("unsafe-compact"), no_argument,    NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
+	{T("stats"),       no_argument,       NULL, IMAGEX_STATS_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -339,6 +401,10 @@ static const struct option extract_options[] = {
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("compact"),     required_argument, NULL, IMAGEX_COMPACT_OPTION},
 	{T("recover-data"), no_argument,      NULL, IMAGEX_RECOVER_DATA_OPTION},
+	{T("mmap"),        no_argument,       NULL, IMAGEX_MMAP_OPTION},
+	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("clone-duplicates"), no_argument,  NULL, IMAGEX_CLONE_DUPLICATES_OPTION},
+	{T("shared-chunk-cache"), required_argument, NULL, IMAGEX_SHARED_CHUNK_CACHE_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -372,6 +438,8 @@ static const struct option mount_options[] = {
 	{T("staging-dir"),       required_argument, NULL, IMAGEX_STAGING_DIR_OPTION},
 	{T("unix-data"),         no_argument,       NULL, IMAGEX_UNIX_DATA_OPTION},
 	{T("allow-other"),       no_argument,       NULL, IMAGEX_ALLOW_OTHER_OPTION},
+	{T("multithreaded"),     no_argument,       NULL, IMAGEX_MULTITHREADED_OPTION},
+	{T("shared-chunk-cache"), required_argument, NULL, IMAGEX_SHARED_CHUNK_CACHE_OPTION},
 	{NULL, 0, NULL, 0},
 };
 #endif
@@ -387,11 +455,19 @@ static const struct option optimize_options[] = {
 	{T("solid"),       no_argument,       NULL, IMAGEX_SOLID_OPTION},
 	{T("solid-compress"),required_argument, NULL, IMAGEX_SOLID_COMPRESS_OPTION},
 	{T("solid-chunk-size"),required_argument, NULL, IMAGEX_SOLID_CHUNK_SIZE_OPTION},
+	{T("solid-resources"),required_argument, NULL, IMAGEX_SOLID_RESOURCES_OPTION},
+	{T("compression-workers"), required_argument, NULL, IMAGEX_COMPRESSION_WORKERS_OPTION},
 	{T("no-solid-sort"), no_argument,     NULL, IMAGEX_NO_SOLID_SORT_OPTION},
+	{T("solid-sort-by-content"), no_argument, NULL, IMAGEX_SOLID_SORT_BY_CONTENT_OPTION},
+	{T("solid-small-files"), no_argument, NULL, IMAGEX_SOLID_SMALL_FILES_OPTION},
+	{T("large-file-chunks"), no_argument, NULL, IMAGEX_LARGE_FILE_CHUNKS_OPTION},
+	{T("uncached"),    no_argument,       NULL, IMAGEX_UNCACHED_OPTION},
+	{T("multi-candidate"), no_argument,   NULL, IMAGEX_MULTI_CANDIDATE_OPTION},
 	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
 	{T("pipable"),     no_argument,       NULL, IMAGEX_PIPABLE_OPTION},
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
 	{T("unsafe-compact"), no_argument,    NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
+	{T("stats"),       no_argument,       NULL, IMAGEX_STATS_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -448,10 +524,19 @@ static const struct option update_options[] = {
 static const struct option verify_options[] = {
 	{T("ref"), required_argument, NULL, IMAGEX_REF_OPTION},
 	{T("nocheck"), no_argument, NULL, IMAGEX_NOCHECK_OPTION},
+	{T("threads"), required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{T("stats"), no_argument, NULL, IMAGEX_STATS_OPTION},
 
 	{NULL, 0, NULL, 0},
 };
 
+#ifndef _WIN32
+static const struct option worker_options[] = {
+	{T("threads"), required_argument, NULL, IMAGEX_THREADS_OPTION},
+	{NULL, 0, NULL, 0},
+};
+#endif
+
 #if 0
 #	define _format_attribute(type, format_str, args_start) \
 			__attribute__((format(type, format_str, args_start)))
@@ -674,6 +759,21 @@ wim_reference_globs(WIMStruct *wim, struct string_list *list, int open_flags)
 					       open_flags);
 }
 
+/* Size of the cache file that --shared-chunk-cache creates if it doesn't exist
+ * yet  */
+#define SHARED_CHUNK_CACHE_SIZE		((uint64_t)256 << 20)
+
+static int
+set_shared_chunk_cache(WIMStruct *wim, const tchar *path)
+{
+	int ret = wimlib_set_shared_chunk_cache(wim, path,
+						SHARED_CHUNK_CACHE_SIZE);
+	if (ret)
+		imagex_error(T("Can't use \"%"TS"\" as a shared chunk cache"),
+			     path);
+	return ret;
+}
+
 static int
 append_image_property_argument(struct string_list *image_properties)
 {
@@ -1045,6 +1145,124 @@ report_split_progress(uint64_t bytes_completed_in_part)
 		      last_split_progress.total_parts);
 }
 
+/* Totals from the progress messages, used by print_stats() together with the
+ * library's performance counters.  */
+static struct {
+	uint64_t scanned_bytes;
+	uint64_t written_bytes;
+	uint64_t extracted_bytes;
+	uint64_t verified_bytes;
+	unsigned compression_threads;
+	bool compressed;
+} stats_progress;
+
+static double
+to_mb_per_sec(uint64_t bytes, uint64_t ns)
+{
+	return ns ? (double)bytes / 1e6 / ((double)ns / 1e9) : 0;
+}
+
+static void
+print_phase_stats(const tchar *name, uint64_t bytes,
+		  uint64_t wall_ns, uint64_t cpu_ns)
+{
+	if (wall_ns == 0)
+		return;
+	imagex_printf(T("  %-22"TS"%.3f s (%.3f s CPU), %.1f MB/s\n"),
+		      name, wall_ns / 1e9, cpu_ns / 1e9,
+		      to_mb_per_sec(bytes, wall_ns));
+}
+
+static void
+print_mem_stats(const tchar *name, uint64_t peak)
+{
+	unsigned unit_shift;
+	const tchar *unit_name;
+
+	unit_shift = get_unit(peak, &unit_name);
+	imagex_printf(T("    %-20"TS"%"PRIu64" %"TS"\n"),
+		      name, peak >> unit_shift, unit_name);
+}
+
+/* Print the breakdown of where the time of the command went, for --stats.  */
+static void
+print_stats(void)
+{
+	struct wimlib_stats s;
+	uint64_t busy_wall_ns;
+
+	wimlib_get_stats(&s);
+
+	imagex_printf(T("\nStatistics:\n"));
+	print_phase_stats(T("Scanning:"), stats_progress.scanned_bytes,
+			  s.scan_wall_ns, s.scan_cpu_ns);
+	print_phase_stats(T("Writing:"), stats_progress.written_bytes,
+			  s.write_wall_ns, s.write_cpu_ns);
+	print_phase_stats(T("Extracting:"), stats_progress.extracted_bytes,
+			  s.extract_wall_ns, s.extract_cpu_ns);
+	print_phase_stats(T("Verifying:"), stats_progress.verified_bytes,
+			  s.verify_wall_ns, s.verify_cpu_ns);
+
+	/* Data that was scanned but not written was a duplicate of other data
+	 * in the image or of data already in the WIM file.  */
+	if (stats_progress.scanned_bytes && s.write_wall_ns) {
+		imagex_printf(T("  %-22"TS"%.3f (%"PRIu64" bytes scanned, "
+				"%"PRIu64" bytes unique)\n"),
+			      T("Deduplication ratio:"),
+			      stats_progress.written_bytes ?
+				(double)stats_progress.scanned_bytes /
+					stats_progress.written_bytes : 0,
+			      stats_progress.scanned_bytes,
+			      stats_progress.written_bytes);
+	}
+	if (s.compress_in_bytes) {
+		imagex_printf(T("  %-22"TS"%.3f (%"PRIu64" => %"PRIu64" bytes)\n"),
+			      T("Compression ratio:"),
+			      (double)s.compress_out_bytes / s.compress_in_bytes,
+			      s.compress_in_bytes, s.compress_out_bytes);
+	}
+
+	/* The per-thread times divided by the wall clock time of the phase give
+	 * the average number of threads that were busy.  */
+	if (stats_progress.compressed && s.write_wall_ns) {
+		double busy = (double)s.compress_ns / s.write_wall_ns;
+
+		imagex_printf(T("  %-22"TS"%.2f of %u threads busy (%.0f%%), "
+				"%.1f MB/s per thread\n"),
+			      T("Compression:"), busy,
+			      stats_progress.compression_threads,
+			      stats_progress.compression_threads ?
+				busy * 100 / stats_progress.compression_threads : 0,
+			      to_mb_per_sec(s.compress_in_bytes, s.compress_ns));
+		imagex_printf(T("  %-22"TS"%.3f s\n"),
+			      T("Waiting to compress:"), s.compress_wait_ns / 1e9);
+	}
+	busy_wall_ns = s.extract_wall_ns + s.verify_wall_ns;
+	if (s.decompress_ns && busy_wall_ns) {
+		imagex_printf(T("  %-22"TS"%.2f threads busy, "
+				"%.1f MB/s per thread\n"),
+			      T("Decompression:"),
+			      (double)s.decompress_ns / busy_wall_ns,
+			      to_mb_per_sec(s.decompress_out_bytes,
+					    s.decompress_ns));
+	}
+	busy_wall_ns = s.scan_wall_ns + s.write_wall_ns + s.extract_wall_ns +
+		       s.verify_wall_ns;
+	if (s.hash_ns && busy_wall_ns) {
+		imagex_printf(T("  %-22"TS"%.2f threads busy, "
+				"%.1f MB/s per thread\n"),
+			      T("SHA-1 hashing:"),
+			      (double)s.hash_ns / busy_wall_ns,
+			      to_mb_per_sec(s.hash_bytes, s.hash_ns));
+	}
+
+	imagex_printf(T("  Peak memory:\n"));
+	print_mem_stats(T("Image metadata:"), s.metadata_mem_peak);
+	print_mem_stats(T("Blob tables:"), s.blob_table_mem_peak);
+	print_mem_stats(T("Compression:"), s.compressor_mem_peak);
+	print_mem_stats(T("I/O buffers:"), s.io_buffer_mem_peak);
+}
+
 /* Progress callback function passed to various wimlib functions. */
 static enum wimlib_progress_status
 imagex_progress_func(enum wimlib_progress_msg msg,
@@ -1077,6 +1295,10 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 				started = true;
 			}
 		}
+		stats_progress.written_bytes = info->write_streams.total_bytes;
+		stats_progress.compression_threads = info->write_streams.num_threads;
+		if (info->write_streams.compression_type != WIMLIB_COMPRESSION_TYPE_NONE)
+			stats_progress.compressed = true;
 		unit_shift = get_unit(info->write_streams.total_bytes, &unit_name);
 		percent_done = TO_PERCENT(info->write_streams.completed_bytes,
 					  info->write_streams.total_bytes);
@@ -1133,6 +1355,7 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 		break;
 	case WIMLIB_PROGRESS_MSG_SCAN_END:
 		report_scan_progress(&info->scan, true);
+		stats_progress.scanned_bytes += info->scan.num_bytes_scanned;
 		imagex_printf(T("\n"));
 		break;
 	case WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY:
@@ -1165,6 +1388,13 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 			imagex_printf(T("\n"));
 		break;
 	case WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_BEGIN:
+		if (info->extract.image == 0) {
+			imagex_printf(T("Applying all images from \"%"TS"\" "
+					"to directory \"%"TS"\"\n"),
+				      info->extract.wimfile_name,
+				      info->extract.target);
+			break;
+		}
 		imagex_printf(T("Applying image %d (\"%"TS"\") from \"%"TS"\" "
 			  "to %"TS" \"%"TS"\"\n"),
 			info->extract.image,
@@ -1210,6 +1440,10 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 				imagex_printf(T("\n"));
 		}
 		break;
+	case WIMLIB_PROGRESS_MSG_EXTRACT_IMAGE_END:
+	case WIMLIB_PROGRESS_MSG_EXTRACT_TREE_END:
+		stats_progress.extracted_bytes += info->extract.total_bytes;
+		break;
 	case WIMLIB_PROGRESS_MSG_EXTRACT_SPWM_PART_BEGIN:
 		if (info->extract.total_parts != 1) {
 			imagex_printf(T("\nReading split pipable WIM part %u of %u\n"),
@@ -1266,6 +1500,7 @@ imagex_progress_func(enum wimlib_progress_msg msg,
 			      info->verify_image.total_images);
 		break;
 	case WIMLIB_PROGRESS_MSG_VERIFY_STREAMS:
+		stats_progress.verified_bytes = info->verify_streams.total_bytes;
 		percent_done = TO_PERCENT(info->verify_streams.completed_bytes,
 					  info->verify_streams.total_bytes);
 		unit_shift = get_unit(info->verify_streams.total_bytes, &unit_name);
@@ -1299,6 +1534,18 @@ parse_num_threads(const tchar *optarg)
 	}
 }
 
+static unsigned
+parse_solid_resources(const tchar *optarg)
+{
+	tchar *tmp;
+	unsigned long count = tstrtoul(optarg, &tmp, 10);
+	if (count == 0 || count >= UINT_MAX || *tmp || tmp == optarg) {
+		imagex_error(T("Number of solid resources must be a positive integer!"));
+		return UINT_MAX;
+	}
+	return count;
+}
+
 static uint32_t
 parse_chunk_size(const tchar *optarg)
 {
@@ -1558,6 +1805,8 @@ imagex_apply(int argc, tchar **argv, int cmd)
 	const tchar *target;
 	const tchar *image_num_or_name = NULL;
 	int extract_flags = 0;
+	unsigned num_threads = 0;
+	bool stats = false;
 
 	STRING_LIST(refglobs);
 
@@ -1607,6 +1856,26 @@ imagex_apply(int argc, tchar **argv, int cmd)
 		case IMAGEX_RECOVER_DATA_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_RECOVER_DATA;
 			break;
+		case IMAGEX_CLONE_DUPLICATES_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES;
+			break;
+		case IMAGEX_UPDATE_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_UPDATE;
+			break;
+		case IMAGEX_TAR_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_TAR;
+			break;
+		case IMAGEX_MMAP_OPTION:
+			open_flags |= WIMLIB_OPEN_FLAG_MMAP;
+			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			break;
+		case IMAGEX_STATS_OPTION:
+			stats = true;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -1634,6 +1903,7 @@ imagex_apply(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_free_refglobs;
 
+		wimlib_set_decompression_threads(wim, num_threads);
 		wimlib_get_wim_info(wim, &info);
 
 		if (argc >= 3) {
@@ -1671,8 +1941,16 @@ imagex_apply(int argc, tchar **argv, int cmd)
 			goto out_wimlib_free;
 	}
 
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_TAR) {
+		/* Keep progress messages out of a tar stream written to
+		 * standard output.  */
+		if (!tstrcmp(target, T("-"))) {
+			imagex_output_to_stderr();
+			set_fd_to_binary_mode(STDOUT_FILENO);
+		}
+	}
 #ifndef _WIN32
-	{
+	else {
 		/* Interpret a regular file or block device target as an NTFS
 		 * volume.  */
 		struct stat stbuf;
@@ -1705,6 +1983,8 @@ imagex_apply(int argc, tchar **argv, int cmd)
 	}
 	if (ret == 0) {
 		imagex_printf(T("Done applying WIM image.\n"));
+		if (stats)
+			print_stats();
 	} else if (ret == WIMLIB_ERR_RESOURCE_NOT_FOUND) {
 		if (wim) {
 			do_resource_not_found_warning(wimfile, &info, &refglobs);
@@ -1725,6 +2005,7 @@ out_free_refglobs:
 
 out_usage:
 	usage(CMD_APPLY, stderr);
+out_err:
 	ret = -1;
 	goto out_free_refglobs;
 }
@@ -1750,6 +2031,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 	int compression_type = WIMLIB_COMPRESSION_TYPE_INVALID;
 	uint32_t chunk_size = UINT32_MAX;
 	uint32_t solid_chunk_size = UINT32_MAX;
+	unsigned solid_resources = 0;
+	const tchar *compression_workers = NULL;
+	const tchar *blob_store = NULL;
 	int solid_ctype = WIMLIB_COMPRESSION_TYPE_INVALID;
 	const tchar *wimfile;
 	int wim_fd;
@@ -1774,6 +2058,7 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 	tchar *config_file = NULL;
 
 	bool source_list = false;
+	bool stats = false;
 	size_t source_list_nchars = 0;
 	tchar *source_list_contents;
 	bool capture_sources_malloced;
@@ -1814,6 +2099,14 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 			if (solid_chunk_size == UINT32_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_SOLID_RESOURCES_OPTION:
+			solid_resources = parse_solid_resources(optarg);
+			if (solid_resources == UINT_MAX)
+				goto out_err;
+			break;
+		case IMAGEX_COMPRESSION_WORKERS_OPTION:
+			compression_workers = optarg;
+			break;
 		case IMAGEX_SOLID_COMPRESS_OPTION:
 			solid_ctype = get_compression_type(optarg, true);
 			if (solid_ctype == WIMLIB_COMPRESSION_TYPE_INVALID)
@@ -1825,6 +2118,30 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_SOLID_SORT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_NO_SOLID_SORT;
 			break;
+		case IMAGEX_SOLID_SORT_BY_CONTENT_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT;
+			break;
+		case IMAGEX_SOLID_SMALL_FILES_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES;
+			break;
+		case IMAGEX_LARGE_FILE_CHUNKS_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS;
+			break;
+		case IMAGEX_UNCACHED_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_UNCACHED;
+			break;
+		case IMAGEX_MULTI_CANDIDATE_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_MULTI_CANDIDATE;
+			break;
+		case IMAGEX_NO_FILE_DATA_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_NO_FILE_DATA;
+			break;
+		case IMAGEX_RESUMABLE_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_RESUMABLE;
+			break;
+		case IMAGEX_BLOB_STORE_OPTION:
+			blob_store = optarg;
+			break;
 		case IMAGEX_FLAGS_OPTION: {
 			tchar *p = alloca((6 + tstrlen(optarg) + 1) * sizeof(tchar));
 			tsprintf(p, T("FLAGS=%"TS), optarg);
@@ -1858,6 +2175,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		case IMAGEX_SOURCE_LIST_OPTION:
 			source_list = true;
 			break;
+		case IMAGEX_STATS_OPTION:
+			stats = true;
+			break;
 		case IMAGEX_NO_ACLS_OPTION:
 			add_flags |= WIMLIB_ADD_FLAG_NO_ACLS;
 			break;
@@ -1904,6 +2224,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 				goto out;
 			write_flags |= WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS;
 			break;
+		case IMAGEX_BINARY_DELTA_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_BINARY_DELTA;
+			break;
 		case IMAGEX_WIMBOOT_OPTION:
 			add_flags |= WIMLIB_ADD_FLAG_WIMBOOT;
 			break;
@@ -1913,6 +2236,24 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		case IMAGEX_SNAPSHOT_OPTION:
 			add_flags |= WIMLIB_ADD_FLAG_SNAPSHOT;
 			break;
+		case IMAGEX_HASH_DURING_SCAN_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_HASH_DURING_SCAN;
+			break;
+		case IMAGEX_HASH_CACHE_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_HASH_CACHE;
+			break;
+		case IMAGEX_SPILL_METADATA_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_SPILL_METADATA;
+			break;
+		case IMAGEX_CACHED_METADATA_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_CACHED_METADATA;
+			break;
+		case IMAGEX_PHYSICAL_ORDER_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_PHYSICAL_ORDER;
+			break;
+		case IMAGEX_ARCHIVE_OPTION:
+			add_flags |= WIMLIB_ADD_FLAG_ARCHIVE;
+			break;
 		case IMAGEX_CREATE_OPTION:
 			if (cmd == CMD_CAPTURE) {
 				imagex_error(T("'--create' is only valid for 'wimappend', not 'wimcapture'"));
@@ -2000,6 +2341,30 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		goto out_err;
 	}
 
+	if ((write_flags & WIMLIB_WRITE_FLAG_NO_FILE_DATA) &&
+	    (appending || (write_flags & WIMLIB_WRITE_FLAG_PIPABLE))) {
+		imagex_error(T("'--no-file-data' is only valid for capturing "
+			       "a new, non-pipable WIM!"));
+		goto out_err;
+	}
+
+	if ((write_flags & WIMLIB_WRITE_FLAG_RESUMABLE) &&
+	    (appending || (write_flags & (WIMLIB_WRITE_FLAG_PIPABLE |
+					  WIMLIB_WRITE_FLAG_NO_FILE_DATA)))) {
+		imagex_error(T("'--resumable' is only valid for capturing "
+			       "a new, non-pipable WIM with file data!"));
+		goto out_err;
+	}
+
+	if (blob_store &&
+	    (appending || (write_flags & (WIMLIB_WRITE_FLAG_PIPABLE |
+					  WIMLIB_WRITE_FLAG_NO_FILE_DATA |
+					  WIMLIB_WRITE_FLAG_RESUMABLE)))) {
+		imagex_error(T("'--blob-store' is only valid for capturing "
+			       "a new, non-pipable WIM with file data!"));
+		goto out_err;
+	}
+
 	/* If template image was specified using --update-of=IMAGE rather
 	 * than --update-of=WIMFILE:IMAGE, set the default WIMFILE.  */
 	if (template_image_name_or_num && !template_wimfile) {
@@ -2126,11 +2491,23 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_free_wim;
 	}
+	if (solid_resources != 0) {
+		ret = wimlib_set_output_solid_resource_count(wim,
+							     solid_resources);
+		if (ret)
+			goto out_free_wim;
+	}
+	if (compression_workers) {
+		ret = wimlib_set_output_compression_workers(wim,
+							    compression_workers);
+		if (ret)
+			goto out_free_wim;
+	}
 
 #ifndef _WIN32
 	/* Detect if source is regular file or block device and set NTFS volume
-	 * capture mode.  */
-	if (!source_list) {
+	 * capture mode, unless it was said to be an archive.  */
+	if (!source_list && !(add_flags & WIMLIB_ADD_FLAG_ARCHIVE)) {
 		struct stat stbuf;
 
 		if (tstat(source, &stbuf) == 0) {
@@ -2292,6 +2669,11 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 	 * appended.  */
 	if (appending) {
 		ret = wimlib_overwrite(wim, write_flags, num_threads);
+	} else if (blob_store) {
+		ret = wimlib_write_with_blob_store(wim, wimfile,
+						   WIMLIB_ALL_IMAGES,
+						   blob_store, write_flags,
+						   num_threads);
 	} else if (wimfile) {
 		ret = wimlib_write(wim, wimfile, WIMLIB_ALL_IMAGES,
 				   write_flags, num_threads);
@@ -2299,6 +2681,8 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		ret = wimlib_write_to_fd(wim, wim_fd, WIMLIB_ALL_IMAGES,
 					 write_flags, num_threads);
 	}
+	if (ret == 0 && stats)
+		print_stats();
 out_free_template_wim:
 	/* 'template_wim' may alias 'wim' or any of the 'base_wims' */
 	if (template_wim == wim)
@@ -2558,6 +2942,8 @@ print_resource(const struct wimlib_resource_entry *resource,
 			tprintf(T("WIM_RESHDR_FLAG_SPANNED  "));
 		if (resource->packed)
 			tprintf(T("WIM_RESHDR_FLAG_SOLID  "));
+		if (resource->is_delta)
+			tprintf(T("WIM_RESHDR_FLAG_DELTA  "));
 		tputchar(T('\n'));
 	}
 	tputchar(T('\n'));
@@ -2754,6 +3140,11 @@ imagex_dir(int argc, tchar **argv, int cmd)
 			goto out_wimlib_free;
 	}
 
+	/* Only the full paths are printed unless --detailed was given.  */
+	if (!options.detailed)
+		iterate_flags |= WIMLIB_ITERATE_DIR_TREE_FLAG_NO_EXTRA_METADATA |
+				 WIMLIB_ITERATE_DIR_TREE_FLAG_NO_STREAMS;
+
 	ret = wimlib_iterate_dir_tree(wim, image, path, iterate_flags,
 				      print_dentry, &options);
 	if (ret == WIMLIB_ERR_METADATA_NOT_FOUND) {
@@ -2801,7 +3192,10 @@ imagex_export(int argc, tchar **argv, int cmd)
 	unsigned num_threads = 0;
 	uint32_t chunk_size = UINT32_MAX;
 	uint32_t solid_chunk_size = UINT32_MAX;
+	unsigned solid_resources = 0;
+	const tchar *compression_workers = NULL;
 	int solid_ctype = WIMLIB_COMPRESSION_TYPE_INVALID;
+	bool stats = false;
 
 	for_opt(c, export_options) {
 		switch (c) {
@@ -2831,6 +3225,21 @@ imagex_export(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_SOLID_SORT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_NO_SOLID_SORT;
 			break;
+		case IMAGEX_SOLID_SORT_BY_CONTENT_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT;
+			break;
+		case IMAGEX_SOLID_SMALL_FILES_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES;
+			break;
+		case IMAGEX_LARGE_FILE_CHUNKS_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS;
+			break;
+		case IMAGEX_UNCACHED_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_UNCACHED;
+			break;
+		case IMAGEX_MULTI_CANDIDATE_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_MULTI_CANDIDATE;
+			break;
 		case IMAGEX_CHUNK_SIZE_OPTION:
 			chunk_size = parse_chunk_size(optarg);
 			if (chunk_size == UINT32_MAX)
@@ -2841,6 +3250,14 @@ imagex_export(int argc, tchar **argv, int cmd)
 			if (solid_chunk_size == UINT32_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_SOLID_RESOURCES_OPTION:
+			solid_resources = parse_solid_resources(optarg);
+			if (solid_resources == UINT_MAX)
+				goto out_err;
+			break;
+		case IMAGEX_COMPRESSION_WORKERS_OPTION:
+			compression_workers = optarg;
+			break;
 		case IMAGEX_SOLID_COMPRESS_OPTION:
 			solid_ctype = get_compression_type(optarg, true);
 			if (solid_ctype == WIMLIB_COMPRESSION_TYPE_INVALID)
@@ -2856,6 +3273,9 @@ imagex_export(int argc, tchar **argv, int cmd)
 			if (num_threads == UINT_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_STATS_OPTION:
+			stats = true;
+			break;
 		case IMAGEX_REBUILD_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_REBUILD;
 			break;
@@ -2889,6 +3309,7 @@ imagex_export(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	wimlib_set_decompression_threads(src_wim, num_threads);
 	wimlib_get_wim_info(src_wim, &src_info);
 
 	/* Determine if the destination is an existing file or not.  If so, we
@@ -3017,6 +3438,18 @@ imagex_export(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_free_dest_wim;
 	}
+	if (solid_resources != 0) {
+		ret = wimlib_set_output_solid_resource_count(dest_wim,
+							     solid_resources);
+		if (ret)
+			goto out_free_dest_wim;
+	}
+	if (compression_workers) {
+		ret = wimlib_set_output_compression_workers(dest_wim,
+							    compression_workers);
+		if (ret)
+			goto out_free_dest_wim;
+	}
 
 	image = wimlib_resolve_image(src_wim, src_image_num_or_name);
 	ret = verify_image_exists(image, src_image_num_or_name, src_wimfile);
@@ -3059,6 +3492,8 @@ imagex_export(int argc, tchar **argv, int cmd)
 		ret = wimlib_write_to_fd(dest_wim, dest_wim_fd,
 					 WIMLIB_ALL_IMAGES, write_flags,
 					 num_threads);
+	if (ret == 0 && stats)
+		print_stats();
 out_free_dest_wim:
 	wimlib_free(dest_wim);
 out_free_src_wim:
@@ -3090,6 +3525,8 @@ imagex_extract(int argc, tchar **argv, int cmd)
 			    WIMLIB_EXTRACT_FLAG_GLOB_PATHS |
 			    WIMLIB_EXTRACT_FLAG_STRICT_GLOB;
 	int notlist_extract_flags = WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE;
+	unsigned num_threads = UINT_MAX;
+	const tchar *shared_chunk_cache = NULL;
 
 	STRING_LIST(refglobs);
 
@@ -3152,6 +3589,20 @@ imagex_extract(int argc, tchar **argv, int cmd)
 		case IMAGEX_RECOVER_DATA_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_RECOVER_DATA;
 			break;
+		case IMAGEX_CLONE_DUPLICATES_OPTION:
+			extract_flags |= WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES;
+			break;
+		case IMAGEX_MMAP_OPTION:
+			open_flags |= WIMLIB_OPEN_FLAG_MMAP;
+			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				goto out_err;
+			break;
+		case IMAGEX_SHARED_CHUNK_CACHE_OPTION:
+			shared_chunk_cache = optarg;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -3180,6 +3631,17 @@ imagex_extract(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	/* Chunks can only be shared when they are decompressed by the
+	 * extracting thread, and the point of sharing them is to save CPU time
+	 * anyway, so by default use one thread when sharing.  */
+	if (num_threads == UINT_MAX)
+		num_threads = shared_chunk_cache ? 1 : 0;
+	wimlib_set_decompression_threads(wim, num_threads);
+	if (shared_chunk_cache) {
+		ret = set_shared_chunk_cache(wim, shared_chunk_cache);
+		if (ret)
+			goto out_wimlib_free;
+	}
 	image = wimlib_resolve_image(wim, image_num_or_name);
 	ret = verify_image_exists_and_is_single(image,
 						image_num_or_name,
@@ -3576,6 +4038,7 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 	int mount_flags = 0;
 	int open_flags = 0;
 	const tchar *staging_dir = NULL;
+	const tchar *shared_chunk_cache = NULL;
 	const tchar *wimfile;
 	const tchar *dir;
 	WIMStruct *wim;
@@ -3601,6 +4064,14 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 		case IMAGEX_DEBUG_OPTION:
 			mount_flags |= WIMLIB_MOUNT_FLAG_DEBUG;
 			break;
+		case IMAGEX_MULTITHREADED_OPTION:
+			if (cmd == CMD_MOUNTRW) {
+				imagex_error(T("--multithreaded is only "
+					       "valid for read-only mounts"));
+				goto out_usage;
+			}
+			mount_flags |= WIMLIB_MOUNT_FLAG_MULTITHREADED;
+			break;
 		case IMAGEX_STREAMS_INTERFACE_OPTION:
 			if (!tstrcasecmp(optarg, T("none")))
 				mount_flags |= WIMLIB_MOUNT_FLAG_STREAM_INTERFACE_NONE;
@@ -3619,6 +4090,9 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 			if (ret)
 				goto out_free_refglobs;
 			break;
+		case IMAGEX_SHARED_CHUNK_CACHE_OPTION:
+			shared_chunk_cache = optarg;
+			break;
 		case IMAGEX_STAGING_DIR_OPTION:
 			staging_dir = optarg;
 			break;
@@ -3670,6 +4144,12 @@ imagex_mount_rw_or_ro(int argc, tchar **argv, int cmd)
 			goto out_free_wim;
 	}
 
+	if (shared_chunk_cache) {
+		ret = set_shared_chunk_cache(wim, shared_chunk_cache);
+		if (ret)
+			goto out_free_wim;
+	}
+
 	ret = wimlib_mount_image(wim, image, dir, mount_flags, staging_dir);
 	if (ret) {
 		if (ret == WIMLIB_ERR_METADATA_NOT_FOUND) {
@@ -3703,6 +4183,8 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 	int compression_type = WIMLIB_COMPRESSION_TYPE_INVALID;
 	uint32_t chunk_size = UINT32_MAX;
 	uint32_t solid_chunk_size = UINT32_MAX;
+	unsigned solid_resources = 0;
+	const tchar *compression_workers = NULL;
 	int solid_ctype = WIMLIB_COMPRESSION_TYPE_INVALID;
 	int ret;
 	WIMStruct *wim;
@@ -3711,6 +4193,7 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 	off_t old_size;
 	off_t new_size;
 	unsigned num_threads = 0;
+	bool stats = false;
 
 	for_opt(c, optimize_options) {
 		switch (c) {
@@ -3742,6 +4225,14 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 			if (solid_chunk_size == UINT32_MAX)
 				goto out_err;
 			break;
+		case IMAGEX_SOLID_RESOURCES_OPTION:
+			solid_resources = parse_solid_resources(optarg);
+			if (solid_resources == UINT_MAX)
+				goto out_err;
+			break;
+		case IMAGEX_COMPRESSION_WORKERS_OPTION:
+			compression_workers = optarg;
+			break;
 		case IMAGEX_SOLID_COMPRESS_OPTION:
 			solid_ctype = get_compression_type(optarg, true);
 			if (solid_ctype == WIMLIB_COMPRESSION_TYPE_INVALID)
@@ -3757,6 +4248,21 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 		case IMAGEX_NO_SOLID_SORT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_NO_SOLID_SORT;
 			break;
+		case IMAGEX_SOLID_SORT_BY_CONTENT_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT;
+			break;
+		case IMAGEX_SOLID_SMALL_FILES_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES;
+			break;
+		case IMAGEX_LARGE_FILE_CHUNKS_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS;
+			break;
+		case IMAGEX_UNCACHED_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_UNCACHED;
+			break;
+		case IMAGEX_MULTI_CANDIDATE_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_MULTI_CANDIDATE;
+			break;
 		case IMAGEX_THREADS_OPTION:
 			num_threads = parse_num_threads(optarg);
 			if (num_threads == UINT_MAX)
@@ -3771,6 +4277,9 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 		case IMAGEX_UNSAFE_COMPACT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_UNSAFE_COMPACT;
 			break;
+		case IMAGEX_STATS_OPTION:
+			stats = true;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -3783,6 +4292,16 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 
 	wimfile = argv[0];
 
+	if ((write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT) &&
+	    (write_flags & WIMLIB_WRITE_FLAG_RECOMPRESS))
+	{
+		imagex_error(T("'--unsafe-compact' cannot be combined with "
+			       "options that recompress the data, such as\n"
+			       "       '--recompress', '--compress', or "
+			       "'--solid'!"));
+		goto out_err;
+	}
+
 	ret = wimlib_open_wim_with_progress(wimfile, open_flags, &wim,
 					    imagex_progress_func, NULL);
 	if (ret)
@@ -3818,6 +4337,18 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_wimlib_free;
 	}
+	if (solid_resources != 0) {
+		ret = wimlib_set_output_solid_resource_count(wim,
+							     solid_resources);
+		if (ret)
+			goto out_wimlib_free;
+	}
+	if (compression_workers) {
+		ret = wimlib_set_output_compression_workers(wim,
+							    compression_workers);
+		if (ret)
+			goto out_wimlib_free;
+	}
 
 	old_size = file_get_size(wimfile);
 	tprintf(T("\"%"TS"\" original size: "), wimfile);
@@ -3846,6 +4377,8 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 	} else {
 		tputs(T("Unknown"));
 	}
+	if (stats)
+		print_stats();
 	ret = 0;
 out_wimlib_free:
 	wimlib_free(wim);
@@ -4235,6 +4768,8 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	int open_flags = WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 	int verify_flags = 0;
 	STRING_LIST(refglobs);
+	unsigned num_threads = 0;
+	bool stats = false;
 	int c;
 
 	for_opt(c, verify_options) {
@@ -4247,6 +4782,16 @@ imagex_verify(int argc, tchar **argv, int cmd)
 		case IMAGEX_NOCHECK_OPTION:
 			open_flags &= ~WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX) {
+				ret = -1;
+				goto out_free_refglobs;
+			}
+			break;
+		case IMAGEX_STATS_OPTION:
+			stats = true;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -4273,6 +4818,8 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	wimlib_set_decompression_threads(wim, num_threads);
+
 	ret = wim_reference_globs(wim, &refglobs, open_flags);
 	if (ret)
 		goto out_wimlib_free;
@@ -4291,6 +4838,8 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	} else {
 		imagex_printf(T("\n\"%"TS"\" was successfully verified.\n"),
 			      wimfile);
+		if (stats)
+			print_stats();
 	}
 
 out_wimlib_free:
@@ -4305,6 +4854,50 @@ out_usage:
 	goto out_free_refglobs;
 }
 
+#ifndef _WIN32
+/* Serve as a compression worker for other invocations of capture, append,
+ * export, and optimize given the --compression-workers option.  */
+static int
+imagex_worker(int argc, tchar **argv, int cmd)
+{
+	unsigned num_threads = 0;
+	int ret;
+	int c;
+
+	for_opt(c, worker_options) {
+		switch (c) {
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX)
+				return -1;
+			break;
+		default:
+			goto out_usage;
+		}
+	}
+	argv += optind;
+	argc -= optind;
+
+	if (argc != 1) {
+		if (argc == 0)
+			imagex_error(T("Must specify the port to listen on!"));
+		else
+			imagex_error(T("Too many arguments!"));
+		goto out_usage;
+	}
+
+	imagex_printf(T("Serving compression requests on \"%"TS"\"\n"),
+		      argv[0]);
+	imagex_flush_output();
+	ret = wimlib_serve_compression_worker(argv[0], num_threads);
+	return ret;
+
+out_usage:
+	usage(CMD_WORKER, stderr);
+	return -1;
+}
+#endif
+
 struct imagex_command {
 	const tchar *name;
 	int (*func)(int argc, tchar **argv, int cmd);
@@ -4331,6 +4924,9 @@ static const struct imagex_command imagex_commands[] = {
 #endif
 	[CMD_UPDATE]   = {T("update"),   imagex_update},
 	[CMD_VERIFY]   = {T("verify"),   imagex_verify},
+#ifndef _WIN32
+	[CMD_WORKER]   = {T("worker"),   imagex_worker},
+#endif
 };
 
 #ifdef _WIN32
@@ -4358,8 +4954,12 @@ T(
 "                    [--boot] [--check] [--nocheck] [--config=FILE]\n"
 "                    [--threads=NUM_THREADS] [--no-acls] [--strict-acls]\n"
 "                    [--rpfix] [--norpfix] [--update-of=[WIMFILE:]IMAGE]\n"
-"                    [--delta-from=WIMFILE] [--wimboot] [--unix-data]\n"
-"                    [--dereference] [--snapshot] [--create]\n"
+"                    [--delta-from=WIMFILE] [--binary-delta] [--wimboot]\n"
+"                    [--unix-data] [--dereference] [--snapshot] [--create]\n"
+"                    [--hash-during-scan] [--hash-cache]\n"
+"                    [--spill-metadata] [--cached-metadata]\n"
+"                    [--physical-order] [--archive]\n"
+"                    [--compression-workers=LIST] [--stats]\n"
 ),
 [CMD_APPLY] =
 T(
@@ -4368,6 +4968,8 @@ T(
 "                    [--no-attributes] [--rpfix] [--norpfix]\n"
 "                    [--include-invalid-names] [--wimboot] [--unix-data]\n"
 "                    [--compact=FORMAT] [--recover-data]\n"
+"                    [--threads=NUM_THREADS] [--mmap] [--clone-duplicates]\n"
+"                    [--update] [--tar] [--stats]\n"
 ),
 [CMD_CAPTURE] =
 T(
@@ -4376,8 +4978,13 @@ T(
 "                    [--config=FILE] [--threads=NUM_THREADS]\n"
 "                    [--no-acls] [--strict-acls] [--rpfix] [--norpfix]\n"
 "                    [--update-of=[WIMFILE:]IMAGE] [--delta-from=WIMFILE]\n"
-"                    [--wimboot] [--unix-data] [--dereference] [--solid]\n"
-"                    [--snapshot]\n"
+"                    [--binary-delta] [--wimboot] [--unix-data]\n"
+"                    [--dereference] [--solid]\n"
+"                    [--snapshot] [--hash-during-scan] [--hash-cache]\n"
+"                    [--spill-metadata] [--cached-metadata]\n"
+"                    [--physical-order] [--no-file-data] [--archive]\n"
+"                    [--compression-workers=LIST] [--stats] [--resumable]\n"
+"                    [--blob-store=DIR]\n"
 ),
 [CMD_DELETE] =
 T(
@@ -4393,7 +5000,8 @@ T(
 "                        [DEST_IMAGE_NAME [DEST_IMAGE_DESC]]\n"
 "                    [--boot] [--check] [--nocheck] [--compress=TYPE]\n"
 "                    [--ref=\"GLOB\"] [--threads=NUM_THREADS] [--rebuild]\n"
-"                    [--wimboot] [--solid]\n"
+"                    [--wimboot] [--solid] [--compression-workers=LIST]\n"
+"                    [--stats]\n"
 ),
 [CMD_EXTRACT] =
 T(
@@ -4402,6 +5010,8 @@ T(
 "                    [--to-stdout] [--no-acls] [--strict-acls]\n"
 "                    [--no-attributes] [--include-invalid-names] [--no-globs]\n"
 "                    [--nullglob] [--preserve-dir-structure] [--recover-data]\n"
+"                    [--threads=NUM_THREADS] [--mmap] [--clone-duplicates]\n"
+"                    [--shared-chunk-cache=FILE]\n"
 ),
 [CMD_INFO] =
 T(
@@ -4420,12 +5030,14 @@ T(
 "    %"TS" WIMFILE [IMAGE] DIRECTORY\n"
 "                    [--check] [--streams-interface=INTERFACE]\n"
 "                    [--ref=\"GLOB\"] [--allow-other] [--unix-data]\n"
+"                    [--multithreaded] [--shared-chunk-cache=FILE]\n"
 ),
 [CMD_MOUNTRW] =
 T(
 "    %"TS" WIMFILE [IMAGE] DIRECTORY\n"
 "                    [--check] [--streams-interface=INTERFACE]\n"
 "                    [--staging-dir=CMD_DIR] [--allow-other] [--unix-data]\n"
+"                    [--shared-chunk-cache=FILE]\n"
 ),
 #endif
 [CMD_OPTIMIZE] =
@@ -4433,6 +5045,7 @@ T(
 "    %"TS" WIMFILE\n"
 "                    [--recompress] [--compress=TYPE] [--threads=NUM_THREADS]\n"
 "                    [--check] [--nocheck] [--solid]\n"
+"                    [--compression-workers=LIST] [--stats]\n"
 "\n"
 ),
 [CMD_SPLIT] =
@@ -4456,8 +5069,14 @@ T(
 ),
 [CMD_VERIFY] =
 T(
-"    %"TS" WIMFILE [--ref=\"GLOB\"]\n"
+"    %"TS" WIMFILE [--ref=\"GLOB\"] [--threads=NUM_THREADS] [--stats]\n"
+),
+#ifndef _WIN32
+[CMD_WORKER] =
+T(
+"    %"TS" [HOST:]PORT [--threads=NUM_THREADS]\n"
 ),
+#endif
 };
 
 static const tchar *invocation_name;
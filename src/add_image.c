@@ -26,8 +26,10 @@
 #include "wimlib.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/error.h"
+#include "wimlib/inode.h"
 #include "wimlib/metadata.h"
 #include "wimlib/security.h"
+#include "wimlib/wim.h"
 #include "wimlib/xml.h"
 
 /* API function documented in wimlib.h  */
@@ -97,6 +99,189 @@ capture_sources_to_add_cmds(const struct wimlib_capture_source *sources,
 	return add_cmds;
 }
 
+/*
+ * Create the WIMStruct into which wimlib_add_image_multisource() captures an
+ * image before moving it into @wim.  Capturing into a separate WIMStruct means
+ * that the scan, the hashing of file data, and the new image's security
+ * descriptors don't touch @wim at all, so several images can be captured into
+ * the same WIMStruct from different threads at once.
+ *
+ * The new WIMStruct gets the settings of @wim that affect capturing, and the
+ * cache of Windows-specific image information if no other capture is using it.
+ * *@add_flags is updated so that reparse point fixups are done by default as
+ * they would be when capturing directly into @wim.
+ */
+static int
+begin_staged_add(WIMStruct *wim, const tchar *name, int *add_flags,
+		 WIMStruct **staging_ret)
+{
+	WIMStruct *staging;
+	int ret;
+
+	ret = wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_NONE, &staging);
+	if (ret)
+		return ret;
+
+	mutex_lock(&wim->add_image_lock);
+
+	if (!wim_has_metadata(wim)) {
+		ret = WIMLIB_ERR_METADATA_NOT_FOUND;
+		goto out_unlock;
+	}
+
+	if (wimlib_image_name_in_use(wim, name)) {
+		ERROR("There is already an image named \"%"TS"\" in the WIM!",
+		      name);
+		ret = WIMLIB_ERR_IMAGE_NAME_COLLISION;
+		goto out_unlock;
+	}
+
+	wimlib_register_progress_function(staging, wim->progfunc,
+					  wim->progctx);
+	wimlib_set_thread_pool(staging, wim->thread_pool);
+	staging->windows_info_cache = wim->windows_info_cache;
+	wim->windows_info_cache = NULL;
+
+	/* Reparse point fixups are done by default when capturing the first
+	 * image or when the previous images have them, but the new image is
+	 * always the first one in @staging.  */
+	if (wim->hdr.flags & WIM_HDR_FLAG_RP_FIX)
+		staging->hdr.flags |= WIM_HDR_FLAG_RP_FIX;
+	else if (wim->hdr.image_count != 0 &&
+		 !(*add_flags & (WIMLIB_ADD_FLAG_RPFIX |
+				 WIMLIB_ADD_FLAG_NORPFIX)))
+		*add_flags |= WIMLIB_ADD_FLAG_NORPFIX;
+	ret = 0;
+out_unlock:
+	mutex_unlock(&wim->add_image_lock);
+	if (ret)
+		wimlib_free(staging);
+	else
+		*staging_ret = staging;
+	return ret;
+}
+
+struct blob_merge_ctx {
+	struct blob_table *src;
+	struct blob_table *dest;
+	size_t num_duplicates;
+};
+
+/* Move a blob to the destination table unless it already has the same blob.  */
+static int
+move_new_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct blob_merge_ctx *ctx = _ctx;
+
+	if (lookup_blob(ctx->dest, blob->hash)) {
+		ctx->num_duplicates++;
+	} else {
+		blob_table_unlink(ctx->src, blob);
+		blob_table_insert(ctx->dest, blob);
+	}
+	return 0;
+}
+
+/* Give the references to a blob to the same blob in the destination table.  */
+static int
+merge_duplicate_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct blob_merge_ctx *ctx = _ctx;
+
+	lookup_blob(ctx->dest, blob->hash)->refcnt += blob->refcnt;
+	blob_table_unlink(ctx->src, blob);
+	free_blob_descriptor(blob);
+	return 0;
+}
+
+/*
+ * Move the blobs of the image @imd from the blob table of @staging into the
+ * blob table of @wim.  Where @wim already has a blob, the image is changed to
+ * use it instead, just as if the image had been captured directly into @wim.
+ * The image's unhashed blobs stay on its list and are deduplicated when they
+ * are hashed.  Any spilled directories refer to blobs by hash, so they are
+ * unaffected.
+ */
+static void
+merge_staged_blobs(WIMStruct *wim, WIMStruct *staging,
+		   struct wim_image_metadata *imd)
+{
+	struct blob_merge_ctx ctx = {
+		.src = staging->blob_table,
+		.dest = wim->blob_table,
+	};
+	struct wim_inode *inode;
+
+	blob_table_reserve_for(ctx.dest, ctx.src);
+	for_blob_in_table(ctx.src, move_new_blob, &ctx);
+	if (ctx.num_duplicates == 0)
+		return;
+
+	image_for_each_inode(inode, imd) {
+		for (unsigned i = 0; i < inode->i_num_streams; i++) {
+			struct wim_inode_stream *strm = &inode->i_streams[i];
+			struct blob_descriptor *blob;
+
+			if (!strm->stream_resolved)
+				continue;
+			blob = stream_blob_resolved(strm);
+			if (blob && !blob->unhashed)
+				strm->_stream_blob = lookup_blob(ctx.dest,
+								 blob->hash);
+		}
+	}
+	for_blob_in_table(ctx.src, merge_duplicate_blob, &ctx);
+}
+
+/* Move the image captured into @staging by wimlib_add_image_multisource() into
+ * @wim as its last image.  */
+static int
+commit_staged_add(WIMStruct *wim, WIMStruct *staging, const tchar *name,
+		  int add_flags)
+{
+	struct wim_image_metadata *imd = staging->image_metadata[0];
+	int ret;
+
+	mutex_lock(&wim->add_image_lock);
+
+	/* Another thread may have added an image with the same name.  */
+	if (wimlib_image_name_in_use(wim, name)) {
+		ERROR("There is already an image named \"%"TS"\" in the WIM!",
+		      name);
+		ret = WIMLIB_ERR_IMAGE_NAME_COLLISION;
+		goto out_unlock;
+	}
+
+	ret = xml_export_image(staging->xml_info, 1, wim->xml_info, name,
+			       NULL, false);
+	if (ret)
+		goto out_unlock;
+
+	ret = append_image_metadata(wim, imd);
+	if (ret) {
+		xml_delete_image(wim->xml_info, wim->hdr.image_count + 1);
+		goto out_unlock;
+	}
+	imd->refcnt++;
+
+	merge_staged_blobs(wim, staging, imd);
+
+	wim->hdr.flags |= staging->hdr.flags & WIM_HDR_FLAG_RP_FIX;
+
+	/* If requested, set this image as the WIM's bootable image.  */
+	if (add_flags & WIMLIB_ADD_FLAG_BOOT)
+		wim->hdr.boot_idx = wim->hdr.image_count;
+out_unlock:
+	/* Give back the cache of Windows-specific information unless another
+	 * capture has already given back one.  */
+	if (!wim->windows_info_cache) {
+		wim->windows_info_cache = staging->windows_info_cache;
+		staging->windows_info_cache = NULL;
+	}
+	mutex_unlock(&wim->add_image_lock);
+	return ret;
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_add_image_multisource(WIMStruct *wim,
@@ -107,6 +292,7 @@ wimlib_add_image_multisource(WIMStruct *wim,
 			     int add_flags)
 {
 	int ret;
+	WIMStruct *staging;
 	struct wimlib_update_command *add_cmds;
 
 	/* Make sure no reserved fields are set.  */
@@ -114,41 +300,46 @@ wimlib_add_image_multisource(WIMStruct *wim,
 		if (sources[i].reserved != 0)
 			return WIMLIB_ERR_INVALID_PARAM;
 
-	/* Add the new image (initially empty).  */
-	ret = wimlib_add_empty_image(wim, name, NULL);
+	ret = begin_staged_add(wim, name, &add_flags, &staging);
 	if (ret)
 		return ret;
 
+	/* Add the new image (initially empty).  */
+	ret = wimlib_add_empty_image(staging, name, NULL);
+	if (ret)
+		goto out;
+
 	/* Translate the "capture sources" into generic update commands.  */
 	ret = WIMLIB_ERR_NOMEM;
 	add_cmds = capture_sources_to_add_cmds(sources, num_sources,
 					       add_flags, config_file);
 	if (!add_cmds)
-		goto out_delete_image;
+		goto out;
 
 	/* Delegate the work to wimlib_update_image().  */
-	ret = wimlib_update_image(wim, wim->hdr.image_count, add_cmds,
-				  num_sources, 0);
+	ret = wimlib_update_image(staging, 1, add_cmds, num_sources, 0);
 	FREE(add_cmds);
 	if (ret)
-		goto out_delete_image;
+		goto out;
 
 	/* If requested, mark the new image as WIMBoot-compatible.  */
 	if (add_flags & WIMLIB_ADD_FLAG_WIMBOOT) {
-		ret = xml_set_wimboot(wim->xml_info, wim->hdr.image_count);
+		ret = xml_set_wimboot(staging->xml_info, 1);
 		if (ret)
-			goto out_delete_image;
+			goto out;
 	}
 
-	/* If requested, set this image as the WIM's bootable image.  */
-	if (add_flags & WIMLIB_ADD_FLAG_BOOT)
-		wim->hdr.boot_idx = wim->hdr.image_count;
-
-	return 0;
-
-out_delete_image:
-	/* Unsuccessful; rollback by removing the new image.  */
-	delete_wim_image(wim, wim->hdr.image_count);
+	ret = commit_staged_add(wim, staging, name, add_flags);
+out:
+	if (ret && staging->windows_info_cache) {
+		mutex_lock(&wim->add_image_lock);
+		if (!wim->windows_info_cache) {
+			wim->windows_info_cache = staging->windows_info_cache;
+			staging->windows_info_cache = NULL;
+		}
+		mutex_unlock(&wim->add_image_lock);
+	}
+	wimlib_free(staging);
 	return ret;
 }
 
@@ -0,0 +1,413 @@
+/*
+ * async.c
+ *
+ * Asynchronous versions of the long-running API functions, which run the
+ * operation on a library thread and report completion through a callback.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * Jobs are put on a queue that is shared by the whole library, and they are run
+ * by a limited number of job threads, which are started as needed and kept
+ * until wimlib_global_cleanup().  So starting many jobs doesn't start many
+ * threads; jobs beyond the limit just wait their turn.  The job threads aren't
+ * the threads of a compression thread pool, since the operations submit
+ * compression work to the pool attached to the WIMStruct and wait for it, and
+ * that could deadlock once every pool thread was busy waiting.  The job threads
+ * spend their time reading, writing, and waiting, while the CPU-heavy work of
+ * all the jobs shares the pool.
+ *
+ * Cancellation works through the progress function: the job installs its own
+ * progress function on the WIMStruct, which returns
+ * WIMLIB_PROGRESS_STATUS_ABORT once the job has been cancelled, and otherwise
+ * forwards the message to the progress function the WIMStruct had before.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/async.h"
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+enum job_type {
+	JOB_WRITE,
+	JOB_EXTRACT_IMAGE,
+	JOB_EXPORT_IMAGE,
+};
+
+/* The most job threads that can exist.  Fewer are used if there are fewer
+ * CPUs, but always at least MIN_JOB_THREADS, since the jobs spend much of their
+ * time waiting for I/O.  */
+#define MAX_JOB_THREADS		16
+#define MIN_JOB_THREADS		2
+
+struct wimlib_job {
+	/* Link in job_queue while the job is waiting to be run  */
+	struct list_head queue_node;
+	enum job_type type;
+
+	/* The WIMStruct whose progress function reports on the operation  */
+	WIMStruct *wim;
+
+	/* The progress function of @wim before the job started  */
+	wimlib_progress_func_t orig_progfunc;
+	void *orig_progctx;
+
+	wimlib_job_done_func_t done_func;
+	void *done_ctx;
+
+	bool cancelled;
+	bool done;
+	int result;
+
+	/* Arguments of the operation  */
+	int image;
+	int flags;
+	unsigned num_threads;
+	tchar *path;
+	WIMStruct *dest_wim;
+	tchar *dest_name;
+	tchar *dest_description;
+};
+
+/* The jobs that are waiting for a job thread, and the job threads.  Everything
+ * here is protected by job_queue_lock.  job_queue_cond is signaled when a job is
+ * queued, and job_done_cond is broadcast when any job finishes.  */
+static struct mutex job_queue_lock = MUTEX_INITIALIZER;
+static struct condvar job_queue_cond;
+static struct condvar job_done_cond;
+static bool job_queue_initialized;
+static LIST_HEAD(job_queue);
+static unsigned num_queued_jobs;
+static struct thread job_threads[MAX_JOB_THREADS];
+static unsigned num_job_threads;
+static unsigned num_idle_job_threads;
+static bool job_threads_stop;
+
+static enum wimlib_progress_status
+job_progress(enum wimlib_progress_msg msg, union wimlib_progress_info *info,
+	     void *progctx)
+{
+	struct wimlib_job *job = progctx;
+
+	if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED))
+		return WIMLIB_PROGRESS_STATUS_ABORT;
+	if (job->orig_progfunc)
+		return (*job->orig_progfunc)(msg, info, job->orig_progctx);
+	return WIMLIB_PROGRESS_STATUS_CONTINUE;
+}
+
+static int
+run_job(struct wimlib_job *job)
+{
+	if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED))
+		return WIMLIB_ERR_ABORTED_BY_PROGRESS;
+
+	switch (job->type) {
+	case JOB_WRITE:
+		return wimlib_write(job->wim, job->path, job->image,
+				    job->flags, job->num_threads);
+	case JOB_EXTRACT_IMAGE:
+		return wimlib_extract_image(job->wim, job->image, job->path,
+					    job->flags);
+	case JOB_EXPORT_IMAGE:
+		return wimlib_export_image(job->wim, job->image,
+					   job->dest_wim, job->dest_name,
+					   job->dest_description, job->flags);
+	}
+	return WIMLIB_ERR_INVALID_PARAM;
+}
+
+static void
+execute_job(struct wimlib_job *job)
+{
+	WIMStruct *wim = job->wim;
+
+	wim->progfunc = job_progress;
+	wim->progctx = job;
+
+	job->result = run_job(job);
+
+	wim->progfunc = job->orig_progfunc;
+	wim->progctx = job->orig_progctx;
+
+	if (job->done_func)
+		(*job->done_func)(job, job->result, job->done_ctx);
+}
+
+static void *
+job_thread_proc(void *arg)
+{
+	struct wimlib_job *job;
+
+	mutex_lock(&job_queue_lock);
+	for (;;) {
+		while (list_empty(&job_queue) && !job_threads_stop) {
+			num_idle_job_threads++;
+			condvar_wait(&job_queue_cond, &job_queue_lock);
+			num_idle_job_threads--;
+		}
+		if (list_empty(&job_queue))
+			break;
+		job = list_first_entry(&job_queue, struct wimlib_job,
+				       queue_node);
+		list_del(&job->queue_node);
+		num_queued_jobs--;
+		mutex_unlock(&job_queue_lock);
+
+		execute_job(job);
+
+		mutex_lock(&job_queue_lock);
+		job->done = true;
+		condvar_broadcast(&job_done_cond);
+	}
+	mutex_unlock(&job_queue_lock);
+	return NULL;
+}
+
+static void
+free_job(struct wimlib_job *job)
+{
+	FREE(job->path);
+	FREE(job->dest_name);
+	FREE(job->dest_description);
+	FREE(job);
+}
+
+static struct wimlib_job *
+new_job(enum job_type type, WIMStruct *wim, wimlib_job_done_func_t done_func,
+	void *done_ctx)
+{
+	struct wimlib_job *job = CALLOC(1, sizeof(*job));
+
+	if (!job)
+		return NULL;
+	job->type = type;
+	job->wim = wim;
+	job->orig_progfunc = wim->progfunc;
+	job->orig_progctx = wim->progctx;
+	job->done_func = done_func;
+	job->done_ctx = done_ctx;
+	return job;
+}
+
+/* Copy an optional string argument.  */
+static int
+dup_arg(const tchar *str, tchar **copy_ret)
+{
+	*copy_ret = NULL;
+	if (str) {
+		*copy_ret = TSTRDUP(str);
+		if (!*copy_ret)
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+static bool
+init_job_queue(void)
+{
+	if (job_queue_initialized)
+		return true;
+	if (!condvar_init(&job_queue_cond))
+		return false;
+	if (!condvar_init(&job_done_cond)) {
+		condvar_destroy(&job_queue_cond);
+		return false;
+	}
+	job_queue_initialized = true;
+	return true;
+}
+
+static unsigned
+max_job_threads(void)
+{
+	return min(max(get_available_cpus(), MIN_JOB_THREADS),
+		   MAX_JOB_THREADS);
+}
+
+/* Queue @job, and start another job thread if the idle ones aren't enough to
+ * pick up all the queued jobs and the limit hasn't been reached.  Failing to
+ * start a thread is only an error if there are no job threads at all.  */
+static int
+start_job(struct wimlib_job *job, struct wimlib_job **job_ret)
+{
+	mutex_lock(&job_queue_lock);
+	if (!init_job_queue()) {
+		mutex_unlock(&job_queue_lock);
+		free_job(job);
+		return WIMLIB_ERR_NOMEM;
+	}
+	list_add_tail(&job->queue_node, &job_queue);
+	num_queued_jobs++;
+	if (num_queued_jobs > num_idle_job_threads &&
+	    num_job_threads < max_job_threads())
+	{
+		if (thread_create(&job_threads[num_job_threads],
+				  job_thread_proc, NULL))
+			num_job_threads++;
+	}
+	if (num_job_threads == 0) {
+		list_del(&job->queue_node);
+		num_queued_jobs--;
+		mutex_unlock(&job_queue_lock);
+		free_job(job);
+		return WIMLIB_ERR_NOMEM;
+	}
+	condvar_signal(&job_queue_cond);
+	mutex_unlock(&job_queue_lock);
+	*job_ret = job;
+	return 0;
+}
+
+/* Stop the job threads.  This is called by wimlib_global_cleanup(), by which
+ * time every job must have been waited for.  */
+void
+cleanup_async_jobs(void)
+{
+	mutex_lock(&job_queue_lock);
+	if (!job_queue_initialized) {
+		mutex_unlock(&job_queue_lock);
+		return;
+	}
+	job_threads_stop = true;
+	condvar_broadcast(&job_queue_cond);
+	mutex_unlock(&job_queue_lock);
+
+	for (unsigned i = 0; i < num_job_threads; i++)
+		thread_join(&job_threads[i]);
+
+	condvar_destroy(&job_done_cond);
+	condvar_destroy(&job_queue_cond);
+	num_job_threads = 0;
+	job_threads_stop = false;
+	job_queue_initialized = false;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_write_async(WIMStruct *wim, const tchar *path, int image,
+		   int write_flags, unsigned num_threads,
+		   wimlib_job_done_func_t done_func, void *done_ctx,
+		   struct wimlib_job **job_ret)
+{
+	struct wimlib_job *job;
+	int ret;
+
+	if (!wim || !path || !job_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	job = new_job(JOB_WRITE, wim, done_func, done_ctx);
+	if (!job)
+		return WIMLIB_ERR_NOMEM;
+	job->image = image;
+	job->flags = write_flags;
+	job->num_threads = num_threads;
+	ret = dup_arg(path, &job->path);
+	if (ret) {
+		free_job(job);
+		return ret;
+	}
+	return start_job(job, job_ret);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_extract_image_async(WIMStruct *wim, int image, const tchar *target,
+			   int extract_flags,
+			   wimlib_job_done_func_t done_func, void *done_ctx,
+			   struct wimlib_job **job_ret)
+{
+	struct wimlib_job *job;
+	int ret;
+
+	if (!wim || !target || !job_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	job = new_job(JOB_EXTRACT_IMAGE, wim, done_func, done_ctx);
+	if (!job)
+		return WIMLIB_ERR_NOMEM;
+	job->image = image;
+	job->flags = extract_flags;
+	ret = dup_arg(target, &job->path);
+	if (ret) {
+		free_job(job);
+		return ret;
+	}
+	return start_job(job, job_ret);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_export_image_async(WIMStruct *src_wim, int src_image,
+			  WIMStruct *dest_wim, const tchar *dest_name,
+			  const tchar *dest_description, int export_flags,
+			  wimlib_job_done_func_t done_func, void *done_ctx,
+			  struct wimlib_job **job_ret)
+{
+	struct wimlib_job *job;
+	int ret;
+
+	if (!src_wim || !dest_wim || !job_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	job = new_job(JOB_EXPORT_IMAGE, src_wim, done_func, done_ctx);
+	if (!job)
+		return WIMLIB_ERR_NOMEM;
+	job->image = src_image;
+	job->flags = export_flags;
+	job->dest_wim = dest_wim;
+	ret = dup_arg(dest_name, &job->dest_name);
+	if (!ret)
+		ret = dup_arg(dest_description, &job->dest_description);
+	if (ret) {
+		free_job(job);
+		return ret;
+	}
+	return start_job(job, job_ret);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_cancel_job(struct wimlib_job *job)
+{
+	if (job)
+		__atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_wait_job(struct wimlib_job *job)
+{
+	int ret;
+
+	if (!job)
+		return WIMLIB_ERR_INVALID_PARAM;
+	mutex_lock(&job_queue_lock);
+	while (!job->done)
+		condvar_wait(&job_done_cond, &job_queue_lock);
+	mutex_unlock(&job_queue_lock);
+	ret = job->result;
+	free_job(job);
+	return ret;
+}
@@ -0,0 +1,207 @@
+/*
+ * blob_store.c
+ *
+ * Writing WIM files whose file data lives in a shared, content-addressed blob
+ * store.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * A blob store is a directory of "pack" files, each of which is a WIM file
+ * containing no images, only file data.  Since blobs are identified by their
+ * SHA-1 message digests, the packs together form a content-addressed store
+ * which many WIM files can share.
+ *
+ * Writing a WIM file "into" a blob store is done in two steps.  First, the
+ * blobs of the image(s) being written that aren't in any pack yet are written
+ * to a new pack; this is like a write with WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS
+ * after referencing the existing packs, except that only the store's blobs are
+ * skipped.  Second, the WIM file itself is written with
+ * WIMLIB_WRITE_FLAG_NO_FILE_DATA, so that it contains only the image metadata
+ * and a blob table that refers to the data in the store.  Such a WIM file is
+ * read by referencing the packs, e.g. by passing a glob that matches every
+ * .wim file in the store directory to wimlib_reference_resource_files().
+ *
+ * A new pack is written to a temporary name and renamed into place only once
+ * complete, so an interrupted write never leaves a truncated pack behind.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+#include "wimlib/blob_store.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/error.h"
+#include "wimlib/glob.h"
+#include "wimlib/guid.h"
+#include "wimlib/paths.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+#include "wimlib/write.h"
+
+#define PACK_GLOB	T("*.wim")
+#define PACK_PREFIX	T("pack-")
+#define PACK_SUFFIX	T(".wim")
+#define TMP_SUFFIX	T(".tmp")
+
+static int
+blob_clear_in_blob_store(struct blob_descriptor *blob, void *_ignore)
+{
+	blob->in_blob_store = 0;
+	return 0;
+}
+
+/* Reference the blobs in all packs of the blob store at @store_dir.  An empty
+ * store is fine.  */
+static int
+reference_blob_store(WIMStruct *wim, const tchar *store_dir)
+{
+	size_t dir_len = tstrlen(store_dir);
+	tchar pattern[dir_len + 1 + ARRAY_LEN(PACK_GLOB)];
+	glob_t globbuf;
+	int ret;
+
+	tsprintf(pattern, T("%"TS"%"TC"%"TS), store_dir,
+		 OS_PREFERRED_PATH_SEPARATOR, PACK_GLOB);
+
+	/* Note: glob() is replaced in Windows native builds.  */
+	ret = tglob(pattern, GLOB_ERR | GLOB_NOSORT, NULL, &globbuf);
+	if (ret == GLOB_NOMATCH)
+		return 0;
+	if (unlikely(ret)) {
+		ERROR_WITH_ERRNO("Failed to list the blob store \"%"TS"\"",
+				 store_dir);
+		if (ret == GLOB_NOSPACE)
+			return WIMLIB_ERR_NOMEM;
+		return WIMLIB_ERR_READ;
+	}
+
+	ret = reference_blob_store_packs(wim,
+					 (const tchar * const *)globbuf.gl_pathv,
+					 globbuf.gl_pathc);
+	globfree(&globbuf);
+	return ret;
+}
+
+/* Write the blobs of @image that the blob store doesn't have yet to a new pack
+ * in @store_dir.  No pack is created if there are no such blobs.  */
+static int
+write_blob_store_pack(WIMStruct *wim, int image, const tchar *store_dir,
+		      int write_flags, unsigned num_threads)
+{
+	size_t dir_len = tstrlen(store_dir);
+	size_t name_len = ARRAY_LEN(PACK_PREFIX) - 1 + 2 * GUID_SIZE +
+			  ARRAY_LEN(PACK_SUFFIX) - 1;
+	tchar pack_path[dir_len + 1 + name_len + 1];
+	tchar tmp_path[dir_len + 1 + name_len + ARRAY_LEN(TMP_SUFFIX)];
+	tchar *p;
+	u8 guid[GUID_SIZE];
+	int ret;
+
+	/* Name the pack after its GUID, which is random.  */
+	generate_guid(guid);
+	p = pack_path;
+	p += tsprintf(p, T("%"TS"%"TC"%"TS), store_dir,
+		      OS_PREFERRED_PATH_SEPARATOR, PACK_PREFIX);
+	for (int i = 0; i < GUID_SIZE; i++)
+		p += tsprintf(p, T("%02x"), guid[i]);
+	tstrcpy(p, PACK_SUFFIX);
+	tsprintf(tmp_path, T("%"TS"%"TS), pack_path, TMP_SUFFIX);
+
+	write_flags &= ~WIMLIB_WRITE_FLAG_RETAIN_GUID;
+	write_flags |= WIMLIB_WRITE_FLAG_NO_METADATA |
+		       WIMLIB_WRITE_FLAG_BLOB_STORE_PACK;
+
+	ret = write_wim_part(wim, tmp_path, image, write_flags, num_threads,
+			     1, 1, NULL, guid);
+	if (ret) {
+		tunlink(tmp_path);
+		return ret;
+	}
+
+	/* Everything was already in the store?  */
+	if (wim->out_hdr.blob_table_reshdr.uncompressed_size == 0) {
+		tunlink(tmp_path);
+		return 0;
+	}
+
+	if (trename(tmp_path, pack_path)) {
+		ERROR_WITH_ERRNO("Failed to rename \"%"TS"\" to \"%"TS"\"",
+				 tmp_path, pack_path);
+		tunlink(tmp_path);
+		return WIMLIB_ERR_RENAME;
+	}
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_write_with_blob_store(WIMStruct *wim, const tchar *path, int image,
+			     const tchar *store_dir, int write_flags,
+			     unsigned num_threads)
+{
+	int ret;
+
+	if (write_flags & ~WIMLIB_WRITE_MASK_PUBLIC)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (write_flags & (WIMLIB_WRITE_FLAG_PIPABLE |
+			   WIMLIB_WRITE_FLAG_NO_FILE_DATA |
+			   WIMLIB_WRITE_FLAG_RESUMABLE))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (path == NULL || path[0] == T('\0') ||
+	    store_dir == NULL || store_dir[0] == T('\0'))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (image != WIMLIB_ALL_IMAGES &&
+	     (image < 1 || image > wim->hdr.image_count))
+		return WIMLIB_ERR_INVALID_IMAGE;
+
+	if (!wim_has_metadata(wim))
+		return WIMLIB_ERR_METADATA_NOT_FOUND;
+
+	if (tmkdir(store_dir, 0755) && errno != EEXIST) {
+		ERROR_WITH_ERRNO("Can't create blob store directory \"%"TS"\"",
+				 store_dir);
+		return WIMLIB_ERR_MKDIR;
+	}
+
+	/* Forget about any other blob store.  */
+	for_blob_in_table(wim->blob_table, blob_clear_in_blob_store, NULL);
+
+	ret = reference_blob_store(wim, store_dir);
+	if (ret)
+		return ret;
+
+	ret = write_blob_store_pack(wim, image, store_dir, write_flags,
+				    num_threads);
+	if (ret)
+		return ret;
+
+	/* All blobs have been hashed while writing the pack, so this only has
+	 * to write the metadata and the blob table.  */
+	return write_wim_part(wim, path, image,
+			      write_flags | WIMLIB_WRITE_FLAG_NO_FILE_DATA,
+			      num_threads, 1, 1, NULL, NULL);
+}
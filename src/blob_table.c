@@ -36,6 +36,7 @@
 #include "wimlib/assert.h"
 #include "wimlib/bitops.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/delta.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
@@ -43,39 +44,158 @@
 #include "wimlib/metadata.h"
 #include "wimlib/ntfs_3g.h"
 #include "wimlib/resource.h"
+#include "wimlib/stats.h"
 #include "wimlib/unaligned.h"
 #include "wimlib/util.h"
 #include "wimlib/win32.h"
 #include "wimlib/write.h"
 
-/* A hash table mapping SHA-1 message digests to blob descriptors  */
+/*
+ * A hash table mapping SHA-1 message digests to blob descriptors.
+ *
+ * This is an open addressing table made of cache line sized buckets, each of
+ * which holds up to BLOB_TABLE_BUCKET_SLOTS blob descriptor pointers along with
+ * a control word containing one byte per slot.  A control byte is either
+ * CTRL_EMPTY, CTRL_DELETED, or a 7-bit tag taken from the SHA-1 message digest
+ * of the blob in the slot.  A lookup compares the tags of a whole bucket at
+ * once and dereferences only the blob descriptors whose tag matches, so it
+ * usually touches a single cache line of the table plus the blob it finds.
+ *
+ * A blob's home bucket is selected by the low bits of its hash; if that bucket
+ * is full the following buckets are tried in turn.  A lookup therefore ends at
+ * the first bucket that contains an empty slot.  Unlinking a blob from a bucket
+ * that has no empty slot leaves a CTRL_DELETED marker so that such probe
+ * sequences aren't cut short.  Blobs never move except when the table is
+ * rebuilt during an insertion, so unlinking doesn't disturb an iteration in
+ * progress.
+ */
+
+#define BLOB_TABLE_BUCKET_SLOTS	7
+
+#define CTRL_EMPTY	0x80
+#define CTRL_DELETED	0xFE
+
+#define CTRL_LOW_BITS	0x0001010101010101ULL
+#define CTRL_HIGH_BITS	(CTRL_LOW_BITS << 7)
+
+struct blob_table_bucket {
+	/* Byte i (counting from the least significant) is the control byte of
+	 * slot i.  The most significant byte is unused and kept zero.  */
+	u64 ctrl;
+	struct blob_descriptor *slots[BLOB_TABLE_BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
 struct blob_table {
-	struct hlist_head *array;
+	struct blob_table_bucket *buckets;
 	size_t num_blobs;
-	size_t mask; /* capacity - 1; capacity is a power of 2  */
+	size_t num_deleted;
+	size_t mask; /* number of buckets - 1; a power of 2 minus 1  */
 };
 
+static forceinline size_t
+blob_table_capacity(const struct blob_table *table)
+{
+	return (table->mask + 1) * BLOB_TABLE_BUCKET_SLOTS;
+}
+
+/* The table is rebuilt before the occupied and deleted slots together would
+ * exceed 7/8 of the capacity.  */
+static forceinline size_t
+blob_table_max_load(size_t capacity)
+{
+	return capacity - (capacity / 8);
+}
+
+static forceinline size_t
+hash_to_bucket(const struct blob_table *table, const u8 *hash)
+{
+	return load_size_t_unaligned(hash) & table->mask;
+}
+
+/* The tag is taken from the other end of the digest than the bucket index, so
+ * that the two are independent.  */
+static forceinline u8
+hash_to_tag(const u8 *hash)
+{
+	return hash[SHA1_HASH_SIZE - 1] & 0x7F;
+}
+
+/* Return a mask with the high bit of each control byte in @ctrl that equals
+ * @c set, and all other bits clear.  */
+static forceinline u64
+ctrl_match(u64 ctrl, u8 c)
+{
+	u64 v = ctrl ^ (CTRL_LOW_BITS * c);
+
+	/* The addition sets the high bit of each byte whose low 7 bits are
+	 * nonzero, without carrying into the next byte.  */
+	return ~(((v & ~CTRL_HIGH_BITS) + ~CTRL_HIGH_BITS) | v) & CTRL_HIGH_BITS;
+}
+
+/* Return a mask with the high bit of each empty or deleted slot's control
+ * byte set.  */
+static forceinline u64
+ctrl_match_free(u64 ctrl)
+{
+	return ctrl & CTRL_HIGH_BITS;
+}
+
+/* Convert a bit from one of the above masks into a slot index.  */
+static forceinline unsigned
+ctrl_bit_to_slot(u64 mask)
+{
+	return bsf64(mask) >> 3;
+}
+
+static forceinline void
+set_ctrl(struct blob_table_bucket *bucket, unsigned slot, u8 c)
+{
+	bucket->ctrl &= ~((u64)0xFF << (8 * slot));
+	bucket->ctrl |= (u64)c << (8 * slot);
+}
+
+static bool
+alloc_blob_table_buckets(struct blob_table *table, size_t num_buckets)
+{
+	struct blob_table_bucket *buckets;
+
+	buckets = ALIGNED_MALLOC(num_buckets * sizeof(buckets[0]),
+				 sizeof(buckets[0]));
+	if (!buckets)
+		return false;
+	MEM_ALLOCATED(blob_table, num_buckets * sizeof(buckets[0]));
+	for (size_t i = 0; i < num_buckets; i++)
+		buckets[i].ctrl = CTRL_LOW_BITS * CTRL_EMPTY;
+	table->buckets = buckets;
+	table->num_blobs = 0;
+	table->num_deleted = 0;
+	table->mask = num_buckets - 1;
+	return true;
+}
+
+/* Return the number of buckets a table needs so that @capacity blobs fit
+ * without rebuilding it.  */
+static size_t
+blob_table_buckets_for_capacity(size_t capacity)
+{
+	return roundup_pow_of_2(DIV_ROUND_UP(capacity + (capacity / 7) + 1,
+					     BLOB_TABLE_BUCKET_SLOTS));
+}
+
 struct blob_table *
 new_blob_table(size_t capacity)
 {
 	struct blob_table *table;
-	struct hlist_head *array;
-
-	capacity = roundup_pow_of_2(capacity);
+	size_t num_buckets = blob_table_buckets_for_capacity(capacity);
 
 	table = MALLOC(sizeof(struct blob_table));
 	if (table == NULL)
 		goto oom;
 
-	array = CALLOC(capacity, sizeof(array[0]));
-	if (array == NULL) {
+	if (!alloc_blob_table_buckets(table, num_buckets)) {
 		FREE(table);
 		goto oom;
 	}
-
-	table->num_blobs = 0;
-	table->mask = capacity - 1;
-	table->array = array;
 	return table;
 
 oom:
@@ -96,7 +216,8 @@ free_blob_table(struct blob_table *table)
 {
 	if (table) {
 		for_blob_in_table(table, do_free_blob_descriptor, NULL);
-		FREE(table->array);
+		ALIGNED_FREE(table->buckets);
+		MEM_FREED(blob_table, (table->mask + 1) * sizeof(table->buckets[0]));
 		FREE(table);
 	}
 }
@@ -104,34 +225,167 @@ free_blob_table(struct blob_table *table)
 struct blob_descriptor *
 new_blob_descriptor(void)
 {
+	struct blob_descriptor *blob;
+
 	STATIC_ASSERT(BLOB_NONEXISTENT == 0);
-	return CALLOC(1, sizeof(struct blob_descriptor));
+	blob = CALLOC(1, sizeof(struct blob_descriptor));
+	if (blob)
+		MEM_ALLOCATED(blob_table, sizeof(struct blob_descriptor));
+	return blob;
 }
 
-struct blob_descriptor *
-clone_blob_descriptor(const struct blob_descriptor *old)
+/* Number of blob descriptors in each slab  */
+#define BLOBS_PER_SLAB	256
+
+/*
+ * A block of memory from which read_blob_table() allocates the blob descriptors
+ * for the entries of a blob table, which may number in the millions, rather
+ * than allocating each one separately.  Blob descriptors from a slab are still
+ * freed individually with free_blob_descriptor(), and they may be moved to
+ * other blob tables and outlive the WIMStruct, so the slab itself is freed only
+ * when all the blob descriptors allocated from it have been freed.
+ */
+struct blob_slab {
+	/* Number of blob descriptors allocated from this slab that haven't been
+	 * freed yet, plus 1 while the slab is still being allocated from  */
+	size_t num_live;
+
+	/* Number of blob descriptors allocated from this slab so far  */
+	size_t num_used;
+
+	struct blob_descriptor blobs[BLOBS_PER_SLAB];
+};
+
+void
+put_blob_slab(struct blob_slab *slab)
 {
-	struct blob_descriptor *new;
+	if (slab && --slab->num_live == 0) {
+		FREE(slab);
+		MEM_FREED(blob_table, sizeof(*slab));
+	}
+}
 
-	new = memdup(old, sizeof(struct blob_descriptor));
-	if (new == NULL)
+/* Allocate a zeroed blob descriptor from the slab *@slab_p, first starting a
+ * new slab if there is no current slab or it is full.  The caller must release
+ * the current slab with put_blob_slab() when done allocating from it.  */
+static struct blob_descriptor *
+new_blob_descriptor_from_slab(struct blob_slab **slab_p)
+{
+	struct blob_slab *slab = *slab_p;
+	struct blob_descriptor *blob;
+
+	if (!slab || slab->num_used == BLOBS_PER_SLAB) {
+		put_blob_slab(slab);
+		slab = MALLOC(sizeof(*slab));
+		*slab_p = slab;
+		if (!slab)
+			return NULL;
+		MEM_ALLOCATED(blob_table, sizeof(*slab));
+		slab->num_live = 1;
+		slab->num_used = 0;
+	}
+	blob = &slab->blobs[slab->num_used++];
+	memset(blob, 0, sizeof(*blob));
+	blob->slab = slab;
+	slab->num_live++;
+	return blob;
+}
+
+#ifdef WITH_FUSE
+static size_t
+staging_cow_alloc_size(u64 num_blocks)
+{
+	return sizeof(struct staging_cow) +
+	       DIV_ROUND_UP(num_blocks, WORDBITS) * sizeof(machine_word_t);
+}
+
+struct staging_cow *
+new_staging_cow(const struct blob_descriptor *base, u64 base_size,
+		u32 block_order)
+{
+	struct staging_cow *cow;
+	u64 num_blocks = DIV_ROUND_UP(base_size, (u64)1 << block_order);
+
+	cow = CALLOC(1, staging_cow_alloc_size(num_blocks));
+	if (!cow)
+		return NULL;
+	cow->base = clone_blob_descriptor(base);
+	if (!cow->base) {
+		FREE(cow);
 		return NULL;
+	}
+	cow->base_size = base_size;
+	cow->num_blocks = num_blocks;
+	cow->num_clean = num_blocks;
+	for (u64 i = 0; i < num_blocks / WORDBITS; i++)
+		cow->clean_map[i] = ~(machine_word_t)0;
+	if (num_blocks % WORDBITS)
+		cow->clean_map[num_blocks / WORDBITS] =
+			((machine_word_t)1 << (num_blocks % WORDBITS)) - 1;
+	return cow;
+}
+
+static struct staging_cow *
+clone_staging_cow(const struct staging_cow *old)
+{
+	struct staging_cow *new;
+
+	new = memdup(old, staging_cow_alloc_size(old->num_blocks));
+	if (new) {
+		new->base = clone_blob_descriptor(old->base);
+		if (!new->base) {
+			FREE(new);
+			new = NULL;
+		}
+	}
+	return new;
+}
+
+void
+free_staging_cow(struct staging_cow *cow)
+{
+	if (cow) {
+		free_blob_descriptor(cow->base);
+		FREE(cow);
+	}
+}
+#endif
+
+/* Make the blob descriptor @new, whose 'slab' field has been set, a copy of
+ * @old.  On failure, @new is freed and NULL is returned.  */
+static struct blob_descriptor *
+copy_blob_descriptor(struct blob_descriptor *new,
+		     const struct blob_descriptor *old)
+{
+	struct blob_slab *slab = new->slab;
+
+	memcpy(new, old, sizeof(struct blob_descriptor));
+	new->slab = slab;
 
 	switch (new->blob_location) {
 	case BLOB_IN_WIM:
+	case BLOB_IN_WIM_DELTA:
 		list_add(&new->rdesc_node, &new->rdesc->blob_list);
 		break;
 
 	case BLOB_IN_FILE_ON_DISK:
-#ifdef WITH_FUSE
-	case BLOB_IN_STAGING_FILE:
-		STATIC_ASSERT((void*)&old->file_on_disk ==
-			      (void*)&old->staging_file_name);
-#endif
 		new->file_on_disk = TSTRDUP(old->file_on_disk);
 		if (new->file_on_disk == NULL)
 			goto out_free;
 		break;
+#ifdef WITH_FUSE
+	case BLOB_IN_STAGING_FILE:
+		new->staging_cow = NULL;
+		new->staging_file_name = STRDUP(old->staging_file_name);
+		if (new->staging_file_name == NULL)
+			goto out_free;
+		if (old->staging_cow) {
+			new->staging_cow = clone_staging_cow(old->staging_cow);
+			if (new->staging_cow == NULL)
+				goto out_free;
+		}
+		break;
+#endif
 #ifdef _WIN32
 	case BLOB_IN_WINDOWS_FILE:
 		new->windows_file = clone_windows_file(old->windows_file);
@@ -157,28 +411,91 @@ out_free:
 	return NULL;
 }
 
+struct blob_descriptor *
+clone_blob_descriptor(const struct blob_descriptor *old)
+{
+	struct blob_descriptor *new;
+
+	new = MALLOC(sizeof(struct blob_descriptor));
+	if (new == NULL)
+		return NULL;
+	MEM_ALLOCATED(blob_table, sizeof(struct blob_descriptor));
+	new->slab = NULL;
+	return copy_blob_descriptor(new, old);
+}
+
+/* Like clone_blob_descriptor(), but allocate the clone from the slab *@slab_p
+ * like new_blob_descriptor_from_slab() does.  This is for callers that clone
+ * entire blob tables.  */
+struct blob_descriptor *
+clone_blob_descriptor_from_slab(const struct blob_descriptor *old,
+				struct blob_slab **slab_p)
+{
+	struct blob_descriptor *new;
+
+	new = new_blob_descriptor_from_slab(slab_p);
+	if (new == NULL)
+		return NULL;
+	return copy_blob_descriptor(new, old);
+}
+
+/*
+ * Return a blob descriptor equivalent to @blob that was not allocated from a
+ * slab, freeing @blob's slot in its slab.  This is used when a blob descriptor
+ * is being moved into a table that may long outlive the one it came from, so
+ * that it doesn't keep alive the slab and the descriptors of BLOBS_PER_SLAB - 1
+ * unrelated blobs.  @blob must not be linked into a blob table.  Returns @blob
+ * itself if it was not allocated from a slab or if memory is exhausted.
+ */
+struct blob_descriptor *
+move_blob_descriptor_out_of_slab(struct blob_descriptor *blob)
+{
+	struct blob_descriptor *new;
+
+	if (!blob->slab)
+		return blob;
+
+	new = memdup(blob, sizeof(struct blob_descriptor));
+	if (!new)
+		return blob;
+	MEM_ALLOCATED(blob_table, sizeof(struct blob_descriptor));
+	new->slab = NULL;
+	if (blob->blob_location == BLOB_IN_WIM ||
+	    blob->blob_location == BLOB_IN_WIM_DELTA)
+		list_replace(&blob->rdesc_node, &new->rdesc_node);
+	put_blob_slab(blob->slab);
+	return new;
+}
+
 /* Release a blob descriptor from its location, if any, and set its new location
  * to BLOB_NONEXISTENT.  */
 void
 blob_release_location(struct blob_descriptor *blob)
 {
 	switch (blob->blob_location) {
-	case BLOB_IN_WIM: {
+	case BLOB_IN_WIM:
+	case BLOB_IN_WIM_DELTA: {
 		struct wim_resource_descriptor *rdesc = blob->rdesc;
 
 		list_del(&blob->rdesc_node);
 		if (list_empty(&rdesc->blob_list)) {
 			wim_decrement_refcnt(rdesc->wim);
-			FREE(rdesc);
+			if (blob->blob_location == BLOB_IN_WIM_DELTA) {
+				free_delta_resource_descriptor(rdesc);
+			} else {
+				FREE(rdesc->chunk_offsets);
+				FREE(rdesc);
+			}
 		}
 		break;
 	}
-	case BLOB_IN_FILE_ON_DISK:
 #ifdef WITH_FUSE
 	case BLOB_IN_STAGING_FILE:
-		STATIC_ASSERT((void*)&blob->file_on_disk ==
-			      (void*)&blob->staging_file_name);
+		free_staging_cow(blob->staging_cow);
+		FREE(blob->staging_file_name);
+		break;
 #endif
+	case BLOB_IN_FILE_ON_DISK:
 	case BLOB_IN_ATTACHED_BUFFER:
 		STATIC_ASSERT((void*)&blob->file_on_disk ==
 			      (void*)&blob->attached_buffer);
@@ -203,7 +520,12 @@ free_blob_descriptor(struct blob_descriptor *blob)
 {
 	if (blob) {
 		blob_release_location(blob);
-		FREE(blob);
+		if (blob->slab) {
+			put_blob_slab(blob->slab);
+		} else {
+			FREE(blob);
+			MEM_FREED(blob_table, sizeof(struct blob_descriptor));
+		}
 	}
 }
 
@@ -211,7 +533,8 @@ free_blob_descriptor(struct blob_descriptor *blob)
 static bool
 should_retain_blob(const struct blob_descriptor *blob)
 {
-	return blob->blob_location == BLOB_IN_WIM;
+	return blob->blob_location == BLOB_IN_WIM ||
+	       blob->blob_location == BLOB_IN_WIM_DELTA;
 }
 
 static void
@@ -301,53 +624,123 @@ blob_decrement_num_opened_fds(struct blob_descriptor *blob)
 static void
 blob_table_insert_raw(struct blob_table *table, struct blob_descriptor *blob)
 {
-	size_t i = blob->hash_short & table->mask;
+	size_t i = hash_to_bucket(table, blob->hash);
+
+	for (;;) {
+		struct blob_table_bucket *bucket = &table->buckets[i];
+		u64 free_mask = ctrl_match_free(bucket->ctrl);
 
-	hlist_add_head(&blob->hash_list, &table->array[i]);
+		if (free_mask) {
+			unsigned slot = ctrl_bit_to_slot(free_mask);
+
+			if ((u8)(bucket->ctrl >> (8 * slot)) == CTRL_DELETED)
+				table->num_deleted--;
+			set_ctrl(bucket, slot, hash_to_tag(blob->hash));
+			bucket->slots[slot] = blob;
+			table->num_blobs++;
+			return;
+		}
+		i = (i + 1) & table->mask;
+	}
 }
 
+/* Rebuild the blob table with the specified number of buckets, which drops all
+ * CTRL_DELETED markers.  On allocation failure the table is left unchanged.  */
 static void
-enlarge_blob_table(struct blob_table *table)
+rebuild_blob_table(struct blob_table *table, size_t num_buckets)
 {
-	size_t old_capacity, new_capacity;
-	struct hlist_head *old_array, *new_array;
-	struct blob_descriptor *blob;
-	struct hlist_node *tmp;
-	size_t i;
+	struct blob_table old = *table;
 
-	old_capacity = table->mask + 1;
-	new_capacity = old_capacity * 2;
-	new_array = CALLOC(new_capacity, sizeof(struct hlist_head));
-	if (new_array == NULL)
+	if (!alloc_blob_table_buckets(table, num_buckets)) {
+		*table = old;
 		return;
-	old_array = table->array;
-	table->array = new_array;
-	table->mask = new_capacity - 1;
+	}
+	for (size_t i = 0; i <= old.mask; i++) {
+		const struct blob_table_bucket *bucket = &old.buckets[i];
 
-	for (i = 0; i < old_capacity; i++)
-		hlist_for_each_entry_safe(blob, tmp, &old_array[i], hash_list)
-			blob_table_insert_raw(table, blob);
-	FREE(old_array);
+		for (unsigned slot = 0; slot < BLOB_TABLE_BUCKET_SLOTS; slot++)
+			if (!((bucket->ctrl >> (8 * slot)) & CTRL_EMPTY))
+				blob_table_insert_raw(table,
+						      bucket->slots[slot]);
+	}
+	ALIGNED_FREE(old.buckets);
+	MEM_FREED(blob_table, (old.mask + 1) * sizeof(old.buckets[0]));
+}
+
+/*
+ * Make room in the blob table @table for the blobs of the table @src, so that
+ * they can be added to it without it being rebuilt.  This should be done before
+ * moving or copying a whole table into another: the blobs arrive in the order
+ * of @src's buckets, and inserting them in that order into a table with fewer
+ * buckets piles them up into long probe sequences before the table grows.  On
+ * allocation failure the table is left unchanged and just grows as usual.
+ */
+void
+blob_table_reserve_for(struct blob_table *table, const struct blob_table *src)
+{
+	size_t num_buckets = blob_table_buckets_for_capacity(table->num_blobs +
+							     src->num_blobs);
+
+	if (num_buckets > table->mask + 1)
+		rebuild_blob_table(table, num_buckets);
 }
 
 /* Insert a blob descriptor into the blob table.  */
 void
 blob_table_insert(struct blob_table *table, struct blob_descriptor *blob)
 {
+	size_t capacity = blob_table_capacity(table);
+
+	if (table->num_blobs + table->num_deleted >=
+	    blob_table_max_load(capacity))
+	{
+		/* Double the size of the table unless it's mostly full of
+		 * deleted slots, in which case just clean those up.  */
+		size_t num_buckets = table->mask + 1;
+
+		if (table->num_blobs >= capacity / 2)
+			num_buckets *= 2;
+		rebuild_blob_table(table, num_buckets);
+	}
+	wimlib_assert(table->num_blobs < blob_table_capacity(table));
 	blob_table_insert_raw(table, blob);
-	if (table->num_blobs++ > table->mask)
-		enlarge_blob_table(table);
 }
 
 /* Unlinks a blob descriptor from the blob table; does not free it.  */
 void
 blob_table_unlink(struct blob_table *table, struct blob_descriptor *blob)
 {
+	size_t i = hash_to_bucket(table, blob->hash);
+	const u8 tag = hash_to_tag(blob->hash);
+
 	wimlib_assert(!blob->unhashed);
 	wimlib_assert(table->num_blobs != 0);
 
-	hlist_del(&blob->hash_list);
-	table->num_blobs--;
+	for (size_t n = 0; n <= table->mask; n++) {
+		struct blob_table_bucket *bucket = &table->buckets[i];
+		u64 match = ctrl_match(bucket->ctrl, tag);
+
+		while (match) {
+			unsigned slot = ctrl_bit_to_slot(match);
+
+			if (bucket->slots[slot] == blob) {
+				/* If this bucket already has an empty slot, no
+				 * probe sequence continues past it, so the
+				 * slot can become empty too.  */
+				if (ctrl_match(bucket->ctrl, CTRL_EMPTY)) {
+					set_ctrl(bucket, slot, CTRL_EMPTY);
+				} else {
+					set_ctrl(bucket, slot, CTRL_DELETED);
+					table->num_deleted++;
+				}
+				table->num_blobs--;
+				return;
+			}
+			match &= match - 1;
+		}
+		i = (i + 1) & table->mask;
+	}
+	wimlib_assert(0);
 }
 
 /* Given a SHA-1 message digest, return the corresponding blob descriptor from
@@ -355,31 +748,45 @@ blob_table_unlink(struct blob_table *table, struct blob_descriptor *blob)
 struct blob_descriptor *
 lookup_blob(const struct blob_table *table, const u8 *hash)
 {
-	size_t i;
-	struct blob_descriptor *blob;
+	size_t i = hash_to_bucket(table, hash);
+	const u8 tag = hash_to_tag(hash);
+
+	for (size_t n = 0; n <= table->mask; n++) {
+		const struct blob_table_bucket *bucket = &table->buckets[i];
+		u64 match = ctrl_match(bucket->ctrl, tag);
 
-	i = load_size_t_unaligned(hash) & table->mask;
-	hlist_for_each_entry(blob, &table->array[i], hash_list)
-		if (hashes_equal(hash, blob->hash))
-			return blob;
+		while (match) {
+			struct blob_descriptor *blob =
+				bucket->slots[ctrl_bit_to_slot(match)];
+
+			if (hashes_equal(hash, blob->hash))
+				return blob;
+			match &= match - 1;
+		}
+		if (ctrl_match(bucket->ctrl, CTRL_EMPTY))
+			break;
+		i = (i + 1) & table->mask;
+	}
 	return NULL;
 }
 
 /* Call a function on all blob descriptors in the specified blob table.  Stop
- * early and return nonzero if any call to the function returns nonzero.  */
+ * early and return nonzero if any call to the function returns nonzero.  The
+ * function may unlink or free the blob it is passed, but it must not insert
+ * blobs into the table.  */
 int
 for_blob_in_table(struct blob_table *table,
 		  int (*visitor)(struct blob_descriptor *, void *), void *arg)
 {
-	struct blob_descriptor *blob;
-	struct hlist_node *tmp;
 	int ret;
 
 	for (size_t i = 0; i <= table->mask; i++) {
-		hlist_for_each_entry_safe(blob, tmp, &table->array[i],
-					  hash_list)
-		{
-			ret = visitor(blob, arg);
+		struct blob_table_bucket *bucket = &table->buckets[i];
+
+		for (unsigned slot = 0; slot < BLOB_TABLE_BUCKET_SLOTS; slot++) {
+			if ((bucket->ctrl >> (8 * slot)) & CTRL_EMPTY)
+				continue;
+			ret = visitor(bucket->slots[slot], arg);
 			if (ret)
 				return ret;
 		}
@@ -456,12 +863,19 @@ cmp_blobs_by_sequential_order(const void *p1, const void *p2)
 		return cmp_u64(blob1->offset_in_res, blob2->offset_in_res);
 
 	case BLOB_IN_FILE_ON_DISK:
+		/* Compare files by where their data starts on disk, if known.
+		 * Otherwise compare them by path: just a heuristic that will
+		 * place files in the same directory next to each other.  */
+		v = cmp_u64(blob1->file_physical_offset,
+			    blob2->file_physical_offset);
+		if (v)
+			return v;
+		return tstrcmp(blob1->file_on_disk, blob2->file_on_disk);
 #ifdef WITH_FUSE
 	case BLOB_IN_STAGING_FILE:
+		return strcmp(blob1->staging_file_name,
+			      blob2->staging_file_name);
 #endif
-		/* Compare files by path: just a heuristic that will place files
-		 * in the same directory next to each other.  */
-		return tstrcmp(blob1->file_on_disk, blob2->file_on_disk);
 #ifdef _WIN32
 	case BLOB_IN_WINDOWS_FILE:
 		return cmp_windows_files(blob1->windows_file, blob2->windows_file);
@@ -478,6 +892,127 @@ cmp_blobs_by_sequential_order(const void *p1, const void *p2)
 	}
 }
 
+/*
+ * Blobs to be sorted in sequential order are usually all in the same WIM file,
+ * in which case the order is given by the pair (resource offset, offset in
+ * resource).  When both fit in one 64-bit key, the blobs are sorted with an LSD
+ * radix sort on that key instead of with qsort() and
+ * cmp_blobs_by_sequential_order(), which has to follow two pointers per blob
+ * and per comparison.  Only the bytes of the key that can be nonzero are
+ * sorted on, and passes over bytes that are the same in all keys are skipped,
+ * so this usually takes only a few linear passes over the blobs.
+ */
+
+#define RADIX_SORT_MIN_BLOBS	256
+
+struct blob_sort_item {
+	u64 key;
+	struct blob_descriptor *blob;
+};
+
+/* Sort @items by key, using @tmp as scratch space.  Returns the array, either
+ * @items or @tmp, which holds the sorted items.  */
+static struct blob_sort_item *
+radix_sort_blob_items(struct blob_sort_item *items,
+		      struct blob_sort_item *tmp, size_t num_items,
+		      unsigned num_key_bits)
+{
+	for (unsigned shift = 0; shift < num_key_bits; shift += 8) {
+		size_t counts[256] = {};
+		size_t pos = 0;
+		struct blob_sort_item *swap;
+
+		for (size_t i = 0; i < num_items; i++)
+			counts[(items[i].key >> shift) & 0xFF]++;
+
+		/* All keys have the same byte here?  */
+		if (counts[(items[0].key >> shift) & 0xFF] == num_items)
+			continue;
+
+		for (unsigned b = 0; b < 256; b++) {
+			size_t count = counts[b];
+
+			counts[b] = pos;
+			pos += count;
+		}
+		for (size_t i = 0; i < num_items; i++)
+			tmp[counts[(items[i].key >> shift) & 0xFF]++] = items[i];
+
+		swap = items;
+		items = tmp;
+		tmp = swap;
+	}
+	return items;
+}
+
+/* Try to sort @array in sequential order with a radix sort.  Returns false if
+ * the blobs aren't suitable for it, or if memory couldn't be allocated.  */
+static bool
+radix_sort_blobs_by_sequential_order(struct blob_descriptor **array,
+				     size_t num_blobs)
+{
+	const WIMStruct *wim = NULL;
+	u64 max_res_offset = 0;
+	u64 max_offset_in_res = 0;
+	unsigned offset_in_res_bits;
+	unsigned num_key_bits;
+	struct blob_sort_item *items, *sorted;
+
+	if (num_blobs < RADIX_SORT_MIN_BLOBS)
+		return false;
+
+	for (size_t i = 0; i < num_blobs; i++) {
+		const struct blob_descriptor *blob = array[i];
+
+		if (blob->blob_location != BLOB_IN_WIM)
+			return false;
+		if (blob->rdesc->wim != wim) {
+			if (wim)
+				return false;
+			wim = blob->rdesc->wim;
+		}
+		max_res_offset = max(max_res_offset, blob->rdesc->offset_in_wim);
+		max_offset_in_res = max(max_offset_in_res, blob->offset_in_res);
+	}
+
+	offset_in_res_bits = max_offset_in_res ? 1 + bsr64(max_offset_in_res) : 0;
+	num_key_bits = offset_in_res_bits +
+		       (max_res_offset ? 1 + bsr64(max_res_offset) : 0);
+	if (num_key_bits > 64)
+		return false;
+
+	items = MALLOC(2 * num_blobs * sizeof(items[0]));
+	if (!items)
+		return false;
+
+	for (size_t i = 0; i < num_blobs; i++) {
+		const struct blob_descriptor *blob = array[i];
+
+		/* (Shifting by 64 is undefined, but then the offset is 0.)  */
+		items[i].key = blob->offset_in_res;
+		if (offset_in_res_bits < 64)
+			items[i].key |= blob->rdesc->offset_in_wim <<
+					offset_in_res_bits;
+		items[i].blob = array[i];
+	}
+
+	sorted = radix_sort_blob_items(items, &items[num_blobs], num_blobs,
+				       num_key_bits);
+	for (size_t i = 0; i < num_blobs; i++)
+		array[i] = sorted[i].blob;
+	FREE(items);
+	return true;
+}
+
+static void
+sort_blob_array_by_sequential_order(struct blob_descriptor **array,
+				    size_t num_blobs)
+{
+	if (!radix_sort_blobs_by_sequential_order(array, num_blobs))
+		qsort(array, num_blobs, sizeof(array[0]),
+		      cmp_blobs_by_sequential_order);
+}
+
 int
 sort_blob_list(struct list_head *blob_list, size_t list_head_offset,
 	       int (*compar)(const void *, const void*))
@@ -505,7 +1040,10 @@ sort_blob_list(struct list_head *blob_list, size_t list_head_offset,
 		cur = cur->next;
 	}
 
-	qsort(array, num_blobs, sizeof(array[0]), compar);
+	if (compar == cmp_blobs_by_sequential_order)
+		sort_blob_array_by_sequential_order(array, num_blobs);
+	else
+		qsort(array, num_blobs, sizeof(array[0]), compar);
 
 	INIT_LIST_HEAD(blob_list);
 	for (i = 0; i < num_blobs; i++) {
@@ -553,8 +1091,7 @@ for_blob_in_table_sorted_by_sequential_order(struct blob_table *table,
 
 	wimlib_assert(p == blob_array + num_blobs);
 
-	qsort(blob_array, num_blobs, sizeof(blob_array[0]),
-	      cmp_blobs_by_sequential_order);
+	sort_blob_array_by_sequential_order(blob_array, num_blobs);
 	ret = 0;
 	for (size_t i = 0; i < num_blobs; i++) {
 		ret = visitor(blob_array[i], arg);
@@ -751,6 +1288,7 @@ free_solid_rdescs(struct wim_resource_descriptor **rdescs, size_t num_rdescs)
 		for (size_t i = 0; i < num_rdescs; i++) {
 			if (list_empty(&rdescs[i]->blob_list)) {
 				rdescs[i]->wim->refcnt--;
+				FREE(rdescs[i]->chunk_offsets);
 				FREE(rdescs[i]);
 			}
 		}
@@ -879,6 +1417,7 @@ read_blob_table(WIMStruct *wim)
 	void *buf = NULL;
 	struct blob_table *table = NULL;
 	struct blob_descriptor *cur_blob = NULL;
+	struct blob_slab *slab = NULL;
 	size_t num_duplicate_blobs = 0;
 	size_t num_empty_blobs = 0;
 	size_t num_wrong_part_blobs = 0;
@@ -894,6 +1433,7 @@ read_blob_table(WIMStruct *wim)
 	ret = wim_reshdr_to_data(&wim->hdr.blob_table_reshdr, wim, &buf);
 	if (ret)
 		goto out;
+	MEM_ALLOCATED(blob_table, wim->hdr.blob_table_reshdr.uncompressed_size);
 
 	/* Allocate a hash table to map SHA-1 message digests into blob
 	 * descriptors.  This is the in-memory "blob table".  */
@@ -918,7 +1458,7 @@ read_blob_table(WIMStruct *wim)
 			reshdr.flags &= ~WIM_RESHDR_FLAG_SOLID;
 
 		/* Allocate a new 'struct blob_descriptor'.  */
-		cur_blob = new_blob_descriptor();
+		cur_blob = new_blob_descriptor_from_slab(&slab);
 		if (!cur_blob)
 			goto oom;
 
@@ -969,23 +1509,31 @@ read_blob_table(WIMStruct *wim)
 					goto out;
 			}
 
-			if (unlikely(!(reshdr.flags & WIM_RESHDR_FLAG_COMPRESSED) &&
-				     (reshdr.size_in_wim != reshdr.uncompressed_size)))
+			if (reshdr.flags & WIM_RESHDR_FLAG_DELTA) {
+				/* [wimlib extension] Binary delta against
+				 * another blob  */
+				ret = load_delta_resource(wim, &reshdr,
+							  cur_blob);
+				if (ret)
+					goto out;
+			} else if (unlikely(!(reshdr.flags & WIM_RESHDR_FLAG_COMPRESSED) &&
+					    (reshdr.size_in_wim != reshdr.uncompressed_size)))
 			{
 				ERROR("Uncompressed resource has "
 				      "size_in_wim != uncompressed_size");
 				ret = WIMLIB_ERR_INVALID_LOOKUP_TABLE_ENTRY;
 				goto out;
+			} else {
+				/* Set up a resource descriptor for this blob.
+				 */
+				rdesc = MALLOC(sizeof(struct wim_resource_descriptor));
+				if (!rdesc)
+					goto oom;
+
+				wim_reshdr_to_desc_and_blob(&reshdr, wim, rdesc,
+							    cur_blob);
+				wim->refcnt++;
 			}
-
-			/* Set up a resource descriptor for this blob.  */
-
-			rdesc = MALLOC(sizeof(struct wim_resource_descriptor));
-			if (!rdesc)
-				goto oom;
-
-			wim_reshdr_to_desc_and_blob(&reshdr, wim, rdesc, cur_blob);
-			wim->refcnt++;
 		}
 
 		/* cur_blob is now a blob bound to a resource.  */
@@ -1000,6 +1548,12 @@ read_blob_table(WIMStruct *wim)
 			goto free_cur_blob_and_continue;
 		}
 
+		/* Part number 0 marks a blob whose data was intentionally not
+		 * written (WIMLIB_WRITE_FLAG_NO_FILE_DATA).  Such blobs
+		 * are simply missing, like blobs in other WIM files.  */
+		if (unlikely(part_number == 0))
+			goto free_cur_blob_and_continue;
+
 		/* Verify that the part number matches that of the underlying
 		 * WIM file.  */
 		if (unlikely(part_number != wim->hdr.part_number)) {
@@ -1118,7 +1672,12 @@ out:
 	free_blob_descriptor(cur_blob);
 	free_blob_table(table);
 out_free_buf:
-	FREE(buf);
+	put_blob_slab(slab);
+	if (buf) {
+		FREE(buf);
+		MEM_FREED(blob_table,
+			  wim->hdr.blob_table_reshdr.uncompressed_size);
+	}
 	return ret;
 }
 
@@ -1133,50 +1692,61 @@ write_blob_descriptor(struct blob_descriptor_disk *disk_entry,
 	copy_hash(disk_entry->hash, hash);
 }
 
-/* Note: the list of blob descriptors must be sorted so that all entries for the
- * same solid resource are consecutive.  In addition, blob descriptors for
- * metadata resources must be in the same order as the indices of the underlying
- * images.  */
-int
-write_blob_table_from_blob_list(struct list_head *blob_list,
-				struct filedes *out_fd,
-				u16 part_number,
-				struct wim_reshdr *out_reshdr,
-				int write_resource_flags)
+/* Number of on-disk blob descriptors that write_blob_table_from_blob_list()
+ * fills in before passing them on, so that the memory needed to write a blob
+ * table doesn't depend on its size.  */
+#define BLOB_TABLE_BATCH_ENTRIES	2048
+
+struct blob_table_writer {
+	struct filedes *out_fd;	/* NULL to only compute the size and hash  */
+	struct sha1_ctx sha_ctx;
+	u64 table_size;
+	size_t num_entries;
+	struct blob_descriptor_disk entries[BLOB_TABLE_BATCH_ENTRIES];
+};
+
+static int
+flush_blob_table_batch(struct blob_table_writer *w)
 {
-	size_t table_size;
-	struct blob_descriptor *blob;
-	struct blob_descriptor_disk *table_buf;
-	struct blob_descriptor_disk *table_buf_ptr;
+	size_t size = w->num_entries * sizeof(w->entries[0]);
 	int ret;
+
+	w->num_entries = 0;
+	w->table_size += size;
+	if (!w->out_fd) {
+		sha1_update(&w->sha_ctx, w->entries, size);
+		return 0;
+	}
+	ret = full_write(w->out_fd, w->entries, size);
+	if (ret)
+		ERROR_WITH_ERRNO("Error writing blob table to WIM file");
+	return ret;
+}
+
+/* Convert the blobs in @blob_list to on-disk blob descriptors and feed them to
+ * @w in batches.  If @no_file_data, the entries for blobs other than metadata
+ * resources get part number 0, since their data wasn't written.  */
+static int
+emit_blob_table(struct list_head *blob_list, u16 part_number,
+		bool no_file_data, struct blob_table_writer *w)
+{
+	struct blob_descriptor *blob;
 	u64 prev_res_offset_in_wim = ~0ULL;
-	u64 prev_uncompressed_size;
-	u64 logical_offset;
+	u64 prev_uncompressed_size = 0;
+	u64 logical_offset = 0;
+	int ret;
 
-	table_size = 0;
+	w->table_size = 0;
+	w->num_entries = 0;
 	list_for_each_entry(blob, blob_list, blob_table_list) {
-		table_size += sizeof(struct blob_descriptor_disk);
 
-		if (blob->out_reshdr.flags & WIM_RESHDR_FLAG_SOLID &&
-		    blob->out_res_offset_in_wim != prev_res_offset_in_wim)
-		{
-			table_size += sizeof(struct blob_descriptor_disk);
-			prev_res_offset_in_wim = blob->out_res_offset_in_wim;
+		/* Each blob needs at most two entries.  */
+		if (w->num_entries > BLOB_TABLE_BATCH_ENTRIES - 2) {
+			ret = flush_blob_table_batch(w);
+			if (ret)
+				return ret;
 		}
-	}
 
-	table_buf = MALLOC(table_size);
-	if (table_buf == NULL) {
-		ERROR("Failed to allocate %zu bytes for temporary blob table",
-		      table_size);
-		return WIMLIB_ERR_NOMEM;
-	}
-	table_buf_ptr = table_buf;
-
-	prev_res_offset_in_wim = ~0ULL;
-	prev_uncompressed_size = 0;
-	logical_offset = 0;
-	list_for_each_entry(blob, blob_list, blob_table_list) {
 		if (blob->out_reshdr.flags & WIM_RESHDR_FLAG_SOLID) {
 			struct wim_reshdr tmp_reshdr;
 
@@ -1191,8 +1761,9 @@ write_blob_table_from_blob_list(struct list_head *blob_list,
 				tmp_reshdr.uncompressed_size = SOLID_RESOURCE_MAGIC_NUMBER;
 				tmp_reshdr.flags = WIM_RESHDR_FLAG_SOLID;
 
-				write_blob_descriptor(table_buf_ptr++, &tmp_reshdr,
-						      part_number, 1, zero_hash);
+				write_blob_descriptor(&w->entries[w->num_entries++],
+						      &tmp_reshdr, part_number,
+						      1, zero_hash);
 
 				logical_offset += prev_uncompressed_size;
 
@@ -1201,28 +1772,95 @@ write_blob_table_from_blob_list(struct list_head *blob_list,
 			}
 			tmp_reshdr = blob->out_reshdr;
 			tmp_reshdr.offset_in_wim += logical_offset;
-			write_blob_descriptor(table_buf_ptr++, &tmp_reshdr,
-					      part_number, blob->out_refcnt, blob->hash);
+			write_blob_descriptor(&w->entries[w->num_entries++],
+					      &tmp_reshdr, part_number,
+					      blob->out_refcnt, blob->hash);
+		} else if (no_file_data &&
+			   !(blob->out_reshdr.flags & WIM_RESHDR_FLAG_METADATA)) {
+			write_blob_descriptor(&w->entries[w->num_entries++],
+					      &blob->out_reshdr, 0,
+					      blob->out_refcnt, blob->hash);
 		} else {
-			write_blob_descriptor(table_buf_ptr++, &blob->out_reshdr,
-					      part_number, blob->out_refcnt, blob->hash);
+			write_blob_descriptor(&w->entries[w->num_entries++],
+					      &blob->out_reshdr, part_number,
+					      blob->out_refcnt, blob->hash);
 		}
+	}
+	return flush_blob_table_batch(w);
+}
+
+/*
+ * Write the blob table for the blobs in @blob_list to @out_fd, and set
+ * @out_reshdr to describe it.
+ *
+ * Note: the list of blob descriptors must be sorted so that all entries for the
+ * same solid resource are consecutive.  In addition, blob descriptors for
+ * metadata resources must be in the same order as the indices of the underlying
+ * images.
+ *
+ * The blob table is always written uncompressed.  Although wimlib can handle a
+ * compressed blob table, MS software cannot.  That also means it can be written
+ * directly as it is generated, in batches of BLOB_TABLE_BATCH_ENTRIES entries.
+ * The one complication is that in a pipable WIM the resource is preceded by a
+ * header containing its size and SHA-1 message digest, so those are computed
+ * by a first pass over the list.
+ */
+int
+write_blob_table_from_blob_list(struct list_head *blob_list,
+				struct filedes *out_fd,
+				u16 part_number,
+				struct wim_reshdr *out_reshdr,
+				bool pipable, bool no_file_data)
+{
+	struct blob_table_writer *w;
+	u64 res_offset_in_wim;
+	int ret;
 
+	w = MALLOC(sizeof(*w));
+	if (!w)
+		return WIMLIB_ERR_NOMEM;
+	MEM_ALLOCATED(blob_table, sizeof(*w));
+
+	if (pipable) {
+		struct pwm_blob_hdr blob_hdr;
+
+		w->out_fd = NULL;
+		sha1_init(&w->sha_ctx);
+		emit_blob_table(blob_list, part_number, no_file_data, w);
+		if (w->table_size == 0)
+			goto out_empty;
+
+		blob_hdr.magic = cpu_to_le64(PWM_BLOB_MAGIC);
+		blob_hdr.uncompressed_size = cpu_to_le64(w->table_size);
+		sha1_final(&w->sha_ctx, blob_hdr.hash);
+		blob_hdr.flags = cpu_to_le32(WIM_RESHDR_FLAG_METADATA);
+		ret = full_write(out_fd, &blob_hdr, sizeof(blob_hdr));
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing blob header to WIM file");
+			goto out;
+		}
 	}
-	wimlib_assert((u8*)table_buf_ptr - (u8*)table_buf == table_size);
-
-	/* Write the blob table uncompressed.  Although wimlib can handle a
-	 * compressed blob table, MS software cannot.  */
-	ret = write_wim_resource_from_buffer(table_buf,
-					     table_size,
-					     true,
-					     out_fd,
-					     WIMLIB_COMPRESSION_TYPE_NONE,
-					     0,
-					     out_reshdr,
-					     NULL,
-					     write_resource_flags);
-	FREE(table_buf);
+
+	w->out_fd = out_fd;
+	res_offset_in_wim = out_fd->offset;
+	ret = emit_blob_table(blob_list, part_number, no_file_data, w);
+	if (ret)
+		goto out;
+	if (w->table_size == 0)
+		goto out_empty;
+
+	out_reshdr->offset_in_wim = res_offset_in_wim;
+	out_reshdr->size_in_wim = w->table_size;
+	out_reshdr->uncompressed_size = w->table_size;
+	out_reshdr->flags = WIM_RESHDR_FLAG_METADATA;
+	goto out;
+
+out_empty:
+	zero_reshdr(out_reshdr);
+	ret = 0;
+out:
+	FREE(w);
+	MEM_FREED(blob_table, sizeof(*w));
 	return ret;
 }
 
@@ -1264,6 +1902,7 @@ after_blob_hashed(struct blob_descriptor *blob,
 {
 	struct blob_descriptor *duplicate_blob;
 
+	blob_hash_computed(blob);
 	list_del(&blob->unhashed_list);
 	blob->unhashed = 0;
 
@@ -1351,11 +1990,26 @@ blob_to_wimlib_resource_entry(const struct blob_descriptor *blob,
 		wentry->raw_resource_offset_in_wim = blob->rdesc->offset_in_wim;
 		wentry->raw_resource_compressed_size = blob->rdesc->size_in_wim;
 		wentry->raw_resource_uncompressed_size = blob->rdesc->uncompressed_size;
+		if (blob->rdesc->compression_type != WIMLIB_COMPRESSION_TYPE_NONE)
+			wentry->chunk_size = blob->rdesc->chunk_size;
 
 		wentry->is_compressed = (res_flags & WIM_RESHDR_FLAG_COMPRESSED) != 0;
 		wentry->is_free = (res_flags & WIM_RESHDR_FLAG_FREE) != 0;
 		wentry->is_spanned = (res_flags & WIM_RESHDR_FLAG_SPANNED) != 0;
 		wentry->packed = (res_flags & WIM_RESHDR_FLAG_SOLID) != 0;
+	} else if (blob->blob_location == BLOB_IN_WIM_DELTA) {
+		struct wim_reshdr reshdr;
+
+		delta_blob_get_reshdr(blob, &reshdr);
+		wentry->part_number = blob->rdesc->wim->hdr.part_number;
+		wentry->compressed_size = reshdr.size_in_wim;
+		wentry->offset = reshdr.offset_in_wim;
+		wentry->raw_resource_offset_in_wim = reshdr.offset_in_wim;
+		wentry->raw_resource_compressed_size = reshdr.size_in_wim;
+		wentry->raw_resource_uncompressed_size = blob->size;
+		wentry->is_compressed = (reshdr.flags &
+					 WIM_RESHDR_FLAG_COMPRESSED) != 0;
+		wentry->is_delta = 1;
 	}
 	if (!blob->unhashed)
 		copy_hash(wentry->sha1_hash, blob->hash);
@@ -0,0 +1,175 @@
+/*
+ * chunk_cache.c
+ *
+ * A cache of decompressed chunks and parsed chunk tables of WIM resources, for
+ * random-access reads.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/stats.h"
+#include "wimlib/util.h"
+
+/* Number of hash buckets.  Each item in the cache is usually at least a few
+ * kilobytes in size, so even with a large memory budget the chains stay short.
+ */
+#define CHUNK_CACHE_HASH_ORDER	10
+#define CHUNK_CACHE_NUM_BUCKETS	(1 << CHUNK_CACHE_HASH_ORDER)
+
+/*
+ * The cache is a hash table of items, which are also linked in least recently
+ * used order.  When inserting an item brings the total size over the memory
+ * budget, the least recently used items are evicted.  The item just inserted is
+ * never evicted, so that reading a resource whose chunks are larger than the
+ * budget still doesn't require decompressing the same chunk over and over.
+ *
+ * Like the WIMStruct containing it, a chunk cache is not thread-safe.
+ */
+struct chunk_cache {
+	struct hlist_head buckets[CHUNK_CACHE_NUM_BUCKETS];
+
+	/* All items, most recently used first  */
+	struct list_head lru_list;
+
+	/* Total size of the data of all items  */
+	u64 total_size;
+};
+
+static struct hlist_head *
+chunk_cache_bucket(struct chunk_cache *cache, u64 res_offset, u64 index)
+{
+	u64 hash = hash_u64(hash_u64(res_offset) + index);
+
+	return &cache->buckets[hash >> (64 - CHUNK_CACHE_HASH_ORDER)];
+}
+
+int
+new_chunk_cache(struct chunk_cache **cache_ret)
+{
+	struct chunk_cache *cache;
+
+	cache = MALLOC(sizeof(*cache));
+	if (!cache)
+		return WIMLIB_ERR_NOMEM;
+	for (size_t i = 0; i < CHUNK_CACHE_NUM_BUCKETS; i++)
+		INIT_HLIST_HEAD(&cache->buckets[i]);
+	INIT_LIST_HEAD(&cache->lru_list);
+	cache->total_size = 0;
+	*cache_ret = cache;
+	return 0;
+}
+
+static void
+evict_cached_chunk(struct chunk_cache *cache, struct cached_chunk *chunk)
+{
+	hlist_del(&chunk->hash_node);
+	list_del(&chunk->lru_node);
+	cache->total_size -= chunk->size;
+	MEM_FREED(io_buffer, chunk->size);
+	FREE(chunk);
+}
+
+/* Remove all items from a chunk cache.  This must be done whenever the WIM file
+ * is rewritten, since the offsets no longer identify the same resources.  */
+void
+chunk_cache_clear(struct chunk_cache *cache)
+{
+	while (!list_empty(&cache->lru_list)) {
+		evict_cached_chunk(cache, list_entry(cache->lru_list.next,
+						     struct cached_chunk,
+						     lru_node));
+	}
+}
+
+void
+free_chunk_cache(struct chunk_cache *cache)
+{
+	if (cache) {
+		chunk_cache_clear(cache);
+		FREE(cache);
+	}
+}
+
+/* Evict the least recently used items from a chunk cache until the total size
+ * is at most @max_size or only the most recently used item is left.  */
+void
+chunk_cache_shrink(struct chunk_cache *cache, u64 max_size)
+{
+	while (cache->total_size > max_size &&
+	       cache->lru_list.prev != cache->lru_list.next)
+	{
+		evict_cached_chunk(cache, list_entry(cache->lru_list.prev,
+						     struct cached_chunk,
+						     lru_node));
+	}
+}
+
+/* Look up an item in a chunk cache, and mark it as the most recently used if
+ * found.  Returns NULL if the item isn't cached.  */
+struct cached_chunk *
+chunk_cache_lookup(struct chunk_cache *cache, u64 res_offset, u64 index)
+{
+	struct cached_chunk *chunk;
+
+	hlist_for_each_entry(chunk, chunk_cache_bucket(cache, res_offset, index),
+			     hash_node)
+	{
+		if (chunk->res_offset == res_offset && chunk->index == index) {
+			list_move(&chunk->lru_node, &cache->lru_list);
+			return chunk;
+		}
+	}
+	return NULL;
+}
+
+/* Allocate an item with space for @size bytes of data, to be filled in by the
+ * caller and then passed to chunk_cache_insert().  Returns NULL if out of
+ * memory.  */
+struct cached_chunk *
+new_cached_chunk(u64 res_offset, u64 index, size_t size)
+{
+	struct cached_chunk *chunk;
+
+	chunk = MALLOC(sizeof(*chunk) + size);
+	if (chunk) {
+		chunk->res_offset = res_offset;
+		chunk->index = index;
+		chunk->size = size;
+	}
+	return chunk;
+}
+
+/* Add an item to a chunk cache as the most recently used one, then shrink the
+ * cache to @max_size bytes, without evicting the new item.  The item must not
+ * already be cached.  */
+void
+chunk_cache_insert(struct chunk_cache *cache, struct cached_chunk *chunk,
+		   u64 max_size)
+{
+	hlist_add_head(&chunk->hash_node,
+		       chunk_cache_bucket(cache, chunk->res_offset,
+					  chunk->index));
+	list_add(&chunk->lru_node, &cache->lru_list);
+	cache->total_size += chunk->size;
+	MEM_ALLOCATED(io_buffer, chunk->size);
+	chunk_cache_shrink(cache, max_size);
+}
@@ -29,6 +29,7 @@
 #include "wimlib.h"
 #include "wimlib/error.h"
 #include "wimlib/compressor_ops.h"
+#include "wimlib/stats.h"
 #include "wimlib/util.h"
 
 struct wimlib_compressor {
@@ -36,6 +37,7 @@ struct wimlib_compressor {
 	void *private;
 	enum wimlib_compression_type ctype;
 	size_t max_block_size;
+	u64 mem_size;	/* for the memory statistics  */
 };
 
 static const struct compressor_ops * const compressor_ops[] = {
@@ -73,6 +75,37 @@ wimlib_set_default_compression_level(int ctype, unsigned int compression_level)
 	return 0;
 }
 
+/* Return the compression level that a compressor of the specified type is
+ * created with when no compression level is explicitly specified.  */
+unsigned int
+get_default_compression_level(int ctype)
+{
+	if (default_compression_levels[ctype] != 0)
+		return default_compression_levels[ctype];
+	return DEFAULT_COMPRESSION_LEVEL;
+}
+
+/*
+ * Get the compression levels with which to compress each chunk when the
+ * smallest of several candidate outputs is wanted.  Returns the number of
+ * levels, which is at most MAX_COMPRESSION_CANDIDATES.  Only the compressor
+ * for the last level should be destructive, as the others must leave the
+ * input intact for the next one.
+ */
+unsigned int
+get_candidate_compression_levels(int ctype,
+				 unsigned int levels[MAX_COMPRESSION_CANDIDATES])
+{
+	unsigned int level = get_default_compression_level(ctype);
+	unsigned int strong_level = min(max(level * 2, 100), 0xFFFFFF);
+
+	levels[0] = level;
+	if (strong_level == level)
+		return 1;
+	levels[1] = strong_level;
+	return 2;
+}
+
 WIMLIBAPI u64
 wimlib_get_compressor_needed_memory(enum wimlib_compression_type ctype,
 				    size_t max_block_size,
@@ -97,9 +130,7 @@ wimlib_get_compressor_needed_memory(enum wimlib_compression_type ctype,
 	ops = compressor_ops[ctype];
 
 	if (compression_level == 0)
-		compression_level = default_compression_levels[ctype];
-	if (compression_level == 0)
-		compression_level = DEFAULT_COMPRESSION_LEVEL;
+		compression_level = get_default_compression_level(ctype);
 
 	if (ops->get_needed_memory) {
 		size = ops->get_needed_memory(max_block_size, compression_level,
@@ -150,11 +181,10 @@ wimlib_create_compressor(enum wimlib_compression_type ctype,
 	c->private = NULL;
 	c->ctype = ctype;
 	c->max_block_size = max_block_size;
+	c->mem_size = sizeof(*c);
 	if (c->ops->create_compressor) {
 		if (compression_level == 0)
-			compression_level = default_compression_levels[ctype];
-		if (compression_level == 0)
-			compression_level = DEFAULT_COMPRESSION_LEVEL;
+			compression_level = get_default_compression_level(ctype);
 
 		ret = c->ops->create_compressor(max_block_size,
 						compression_level,
@@ -164,7 +194,12 @@ wimlib_create_compressor(enum wimlib_compression_type ctype,
 			FREE(c);
 			return ret;
 		}
+		if (c->ops->get_needed_memory)
+			c->mem_size += c->ops->get_needed_memory(max_block_size,
+								 compression_level,
+								 destructive);
 	}
+	MEM_ALLOCATED(compressor, c->mem_size);
 	*c_ret = c;
 	return 0;
 }
@@ -174,12 +209,21 @@ wimlib_compress(const void *uncompressed_data, size_t uncompressed_size,
 		void *compressed_data, size_t compressed_size_avail,
 		struct wimlib_compressor *c)
 {
+	u64 start;
+	size_t csize;
+
 	if (unlikely(uncompressed_size == 0 || uncompressed_size > c->max_block_size))
 		return 0;
 
-	return c->ops->compress(uncompressed_data, uncompressed_size,
-				compressed_data, compressed_size_avail,
-				c->private);
+	start = stats_now_ns();
+	csize = c->ops->compress(uncompressed_data, uncompressed_size,
+				 compressed_data, compressed_size_avail,
+				 c->private);
+	STATS_ADD_ELAPSED(compress_ns, start);
+	STATS_ADD(compress_in_bytes, uncompressed_size);
+	/* Data that didn't compress will be stored as-is.  */
+	STATS_ADD(compress_out_bytes, csize ? csize : uncompressed_size);
+	return csize;
 }
 
 WIMLIBAPI void
@@ -188,6 +232,7 @@ wimlib_free_compressor(struct wimlib_compressor *c)
 	if (c) {
 		if (c->ops->free_compressor)
 			c->ops->free_compressor(c->private);
+		MEM_FREED(compressor, c->mem_size);
 		FREE(c);
 	}
 }
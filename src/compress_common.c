@@ -33,8 +33,10 @@
 
 #include <string.h>
 
+#include "wimlib.h"
 #include "wimlib/assert.h"
 #include "wimlib/compress_common.h"
+#include "wimlib/unaligned.h"
 #include "wimlib/util.h"
 
 /*
@@ -380,15 +382,14 @@ compute_length_counts(u32 A[], unsigned root_idx, unsigned len_counts[],
 }
 
 /*
- * Generate the codewords for a canonical Huffman code.
+ * Assign codeword lengths to the symbols.
  *
  * @A
- *	The output array for codewords.  In addition, initially this
- *	array must contain the symbols, sorted primarily by frequency and
- *	secondarily by symbol value, in the low NUM_SYMBOL_BITS bits of
- *	each entry.
+ *	An array that contains the symbols, sorted primarily by frequency and
+ *	secondarily by symbol value, in the low NUM_SYMBOL_BITS bits of each
+ *	entry.
  *
- * @len
+ * @lens
  *	Output array for codeword lengths.
  *
  * @len_counts
@@ -397,19 +398,13 @@ compute_length_counts(u32 A[], unsigned root_idx, unsigned len_counts[],
  *
  * @max_codeword_len
  *	Maximum length, in bits, of each codeword.
- *
- * @num_syms
- *	Number of symbols in the alphabet, including symbols with zero
- *	frequency.  This is the length of the 'A' and 'len' arrays.
  */
 static void
-gen_codewords(u32 A[], u8 lens[], const unsigned len_counts[],
-	      unsigned max_codeword_len, unsigned num_syms)
+gen_lens(const u32 A[], u8 lens[], const unsigned len_counts[],
+	 unsigned max_codeword_len)
 {
-	u32 next_codewords[MAX_CODEWORD_LEN + 1];
 	unsigned i;
 	unsigned len;
-	unsigned sym;
 
 	/*
 	 * Given the number of codewords that will have each length, assign
@@ -423,6 +418,35 @@ gen_codewords(u32 A[], u8 lens[], const unsigned len_counts[],
 		while (count--)
 			lens[A[i++] & SYMBOL_MASK] = len;
 	}
+}
+
+/*
+ * Generate the codewords for a canonical Huffman code.
+ *
+ * @codewords
+ *	The output array for codewords.
+ *
+ * @lens
+ *	The codeword lengths, as assigned by gen_lens().
+ *
+ * @len_counts
+ *	An array that provides the number of codewords that will have
+ *	each possible length <= max_codeword_len.
+ *
+ * @max_codeword_len
+ *	Maximum length, in bits, of each codeword.
+ *
+ * @num_syms
+ *	Number of symbols in the alphabet, including symbols with zero
+ *	frequency.  This is the length of the 'codewords' and 'lens' arrays.
+ */
+static void
+gen_codewords(u32 codewords[], const u8 lens[], const unsigned len_counts[],
+	      unsigned max_codeword_len, unsigned num_syms)
+{
+	u32 next_codewords[MAX_CODEWORD_LEN + 1];
+	unsigned len;
+	unsigned sym;
 
 	/*
 	 * Generate the codewords themselves.  We initialize the
@@ -437,7 +461,89 @@ gen_codewords(u32 A[], u8 lens[], const unsigned len_counts[],
 			(next_codewords[len - 1] + len_counts[len - 1]) << 1;
 
 	for (sym = 0; sym < num_syms; sym++)
-		A[sym] = next_codewords[lens[sym]]++;
+		codewords[sym] = next_codewords[lens[sym]]++;
+}
+
+/*
+ * Compute the codeword lengths of a length-limited Huffman code, as described
+ * for make_canonical_huffman_code(), and the number of codewords having each
+ * length.  'A' is working space for 'num_syms' entries.  Returns false if no
+ * symbols are used, in which case the code is empty.
+ */
+static bool
+compute_code_lens(unsigned num_syms, unsigned max_codeword_len,
+		  const u32 freqs[], u8 lens[], u32 A[], unsigned len_counts[])
+{
+	unsigned num_used_syms;
+
+	wimlib_assert(num_syms <= MAX_NUM_SYMS);
+	STATIC_ASSERT(MAX_NUM_SYMS <= 1 << NUM_SYMBOL_BITS);
+	wimlib_assert(max_codeword_len <= MAX_CODEWORD_LEN);
+
+	/*
+	 * We begin by sorting the symbols primarily by frequency and
+	 * secondarily by symbol value.  As an optimization, the array used for
+	 * this purpose ('A') shares storage with the space in which we will
+	 * eventually return the codewords.
+	 */
+	num_used_syms = sort_symbols(num_syms, freqs, lens, A);
+
+	/*
+	 * 'num_used_syms' is the number of symbols with nonzero frequency.
+	 * This may be less than @num_syms.  'num_used_syms' is also the number
+	 * of entries in 'A' that are valid.  Each entry consists of a distinct
+	 * symbol and a nonzero frequency packed into a 32-bit integer.
+	 */
+
+	/*
+	 * Handle special cases where only 0 or 1 symbols were used (had nonzero
+	 * frequency).
+	 */
+
+	if (unlikely(num_used_syms == 0)) {
+		/*
+		 * Code is empty.  sort_symbols() already set all lengths to 0,
+		 * so there is nothing more to do.
+		 */
+		return false;
+	}
+
+	if (unlikely(num_used_syms == 1)) {
+		/*
+		 * Only one symbol was used, so we only need one codeword.  But
+		 * two codewords are needed to form the smallest complete
+		 * Huffman code, which uses codewords 0 and 1.  Therefore, we
+		 * choose another symbol to which to assign a codeword.  We use
+		 * 0 (if the used symbol is not 0) or 1 (if the used symbol is
+		 * 0).  Assigning codewords in symbol order then gives the
+		 * lesser-valued symbol codeword 0, so the code is canonical.
+		 */
+
+		unsigned sym = A[0] & SYMBOL_MASK;
+		unsigned nonzero_idx = sym ? sym : 1;
+		unsigned len;
+
+		for (len = 0; len <= max_codeword_len; len++)
+			len_counts[len] = 0;
+		len_counts[1] = 2;
+		lens[0] = 1;
+		lens[nonzero_idx] = 1;
+		return true;
+	}
+
+	/*
+	 * Build a stripped-down version of the Huffman tree, sharing the array
+	 * 'A' with the symbol values.  Then extract length counts from the tree
+	 * and use them to assign the codeword lengths.
+	 */
+
+	build_tree(A, num_used_syms);
+
+	compute_length_counts(A, num_used_syms - 2, len_counts,
+			      max_codeword_len);
+
+	gen_lens(A, lens, len_counts, max_codeword_len);
+	return true;
 }
 
 /*
@@ -540,6 +646,15 @@ gen_codewords(u32 A[], u8 lens[], const unsigned len_counts[],
  * Many of these optimizations are based on the implementation in 7-Zip (source
  * file: C/HuffEnc.c), which was placed in the public domain by Igor Pavlov.
  *
+ * The result is already close to linear time in the number of symbols, and
+ * the remaining cost is mostly in the inherently serial parts: the increments
+ * of the sort counters, and the choice between a leaf and a non-leaf in
+ * build_tree().  Making these branchless or splitting the counters does not
+ * help; the branchless tree construction is much slower because each choice
+ * then waits on the store of the previous one.  Package-merge would produce
+ * optimal length-limited codes, but it is slower, and the length limit is
+ * rarely reached for the alphabets and block sizes used here.
+ *
  * NOTE: in general, the same frequencies can be used to generate different
  * length-limited canonical Huffman codes.  One choice we have is during tree
  * construction, when we must decide whether to prefer a leaf or non-leaf when
@@ -596,76 +711,123 @@ void
 make_canonical_huffman_code(unsigned num_syms, unsigned max_codeword_len,
 			    const u32 freqs[], u8 lens[], u32 codewords[])
 {
-	u32 *A = codewords;
-	unsigned num_used_syms;
-
-	wimlib_assert(num_syms <= MAX_NUM_SYMS);
-	STATIC_ASSERT(MAX_NUM_SYMS <= 1 << NUM_SYMBOL_BITS);
-	wimlib_assert(max_codeword_len <= MAX_CODEWORD_LEN);
+	unsigned len_counts[MAX_CODEWORD_LEN + 1];
 
-	/*
-	 * We begin by sorting the symbols primarily by frequency and
-	 * secondarily by symbol value.  As an optimization, the array used for
-	 * this purpose ('A') shares storage with the space in which we will
-	 * eventually return the codewords.
-	 */
-	num_used_syms = sort_symbols(num_syms, freqs, lens, A);
-
-	/*
-	 * 'num_used_syms' is the number of symbols with nonzero frequency.
-	 * This may be less than @num_syms.  'num_used_syms' is also the number
-	 * of entries in 'A' that are valid.  Each entry consists of a distinct
-	 * symbol and a nonzero frequency packed into a 32-bit integer.
-	 */
-
-	/*
-	 * Handle special cases where only 0 or 1 symbols were used (had nonzero
-	 * frequency).
-	 */
-
-	if (unlikely(num_used_syms == 0)) {
-		/*
-		 * Code is empty.  sort_symbols() already set all lengths to 0,
-		 * so there is nothing more to do.
-		 */
-		return;
-	}
+	if (compute_code_lens(num_syms, max_codeword_len, freqs, lens,
+			      codewords, len_counts))
+		gen_codewords(codewords, lens, len_counts, max_codeword_len,
+			      num_syms);
+}
 
-	if (unlikely(num_used_syms == 1)) {
-		/*
-		 * Only one symbol was used, so we only need one codeword.  But
-		 * two codewords are needed to form the smallest complete
-		 * Huffman code, which uses codewords 0 and 1.  Therefore, we
-		 * choose another symbol to which to assign a codeword.  We use
-		 * 0 (if the used symbol is not 0) or 1 (if the used symbol is
-		 * 0).  In either case, the lesser-valued symbol must be
-		 * assigned codeword 0 so that the resulting code is canonical.
-		 */
+/*
+ * Like make_canonical_huffman_code(), but only compute the codeword lengths.
+ * This is for decompressors that need to build the same code as the
+ * compressor, such as the LZMS decompressor, and that only need the lengths
+ * to build their decode tables.  @working_space must have room for @num_syms
+ * entries.
+ */
+void
+make_canonical_huffman_code_lens(unsigned num_syms, unsigned max_codeword_len,
+				 const u32 freqs[], u8 lens[],
+				 u32 working_space[])
+{
+	unsigned len_counts[MAX_CODEWORD_LEN + 1];
 
-		unsigned sym = A[0] & SYMBOL_MASK;
-		unsigned nonzero_idx = sym ? sym : 1;
+	compute_code_lens(num_syms, max_codeword_len, freqs, lens,
+			  working_space, len_counts);
+}
 
-		codewords[0] = 0;
-		lens[0] = 1;
-		codewords[nonzero_idx] = 1;
-		lens[nonzero_idx] = 1;
-		return;
+/*
+ * Return true if the specified chunk of data is very unlikely to be
+ * compressible, for example because it is already-compressed media or archive
+ * data.  This is meant to be called before handing a chunk to a compressor, so
+ * that no time is wasted trying to compress such data.
+ *
+ * Two cheap tests are used.  First, the byte histogram must be nearly flat.
+ * This is measured by the probability that two randomly chosen bytes are equal,
+ * which for compressed data is very close to the 1/256 of random data.
+ * Second, data with a flat histogram can still contain long repeated sequences,
+ * so a sample of 8-byte sequences, chosen by their content so that repeated
+ * sequences are sampled in every copy, must be almost free of repeats.
+ *
+ * @probe is working space, which the caller keeps with its compressors rather
+ * than on the stack.
+ */
+bool
+chunk_looks_incompressible(struct incompressible_probe *probe,
+			   const u8 *data, u32 size)
+{
+	u32 *counts = probe->counts;
+	u32 *seqs = probe->seqs;
+	u64 sum_sq = 0;
+	u32 num_samples = 0;
+	u32 num_repeats = 0;
+
+	/* Small chunks are cheap to compress; don't bother.  */
+	if (size < 4096)
+		return false;
+
+	memset(counts, 0, sizeof(probe->counts));
+	for (u32 i = 0; i < size; i++)
+		counts[data[i]]++;
+	for (unsigned i = 0; i < 256; i++)
+		sum_sq += (u64)counts[i] * counts[i];
+
+	/* Require sum(count^2) <= (size^2 / 256) * (1 + 1/64) + size.  For
+	 * random data the expected value is about size^2 / 256 + size, so the
+	 * extra term keeps the threshold independent of the chunk size.  */
+	if (sum_sq > (((u64)size * size * 65) >> 14) + size)
+		return false;
+
+	memset(seqs, 0, sizeof(probe->seqs));
+	for (u32 i = 0; i + 8 <= size; i++) {
+		u32 h = load_u32_unaligned(&data[i]) * 0x9E3779B1;
+		u64 seq;
+
+		if (h & 0xFC000000)	/* Sample 1 in 64 positions.  */
+			continue;
+		seq = load_u64_unaligned(&data[i]) * 0x9E3779B97F4A7C15;
+		num_samples++;
+		if (seqs[seq >> 52] == (u32)seq)
+			num_repeats++;
+		else
+			seqs[seq >> 52] = (u32)seq;
 	}
+	return num_repeats * 32 <= num_samples;
+}
 
-	/*
-	 * Build a stripped-down version of the Huffman tree, sharing the array
-	 * 'A' with the symbol values.  Then extract length counts from the tree
-	 * and use them to generate the final codewords.
-	 */
-
-	build_tree(A, num_used_syms);
-
-	{
-		unsigned len_counts[MAX_CODEWORD_LEN + 1];
-
-		compute_length_counts(A, num_used_syms - 2,
-				      len_counts, max_codeword_len);
-
-		gen_codewords(A, lens, len_counts, max_codeword_len, num_syms);
+/*
+ * Compress a chunk with each of the specified compressors in turn, keeping the
+ * smallest output.  Only the last compressor may be destructive.  *@cdata and
+ * *@scratch must point to buffers of at least @usize - 1 bytes; they are
+ * swapped as needed so that *@cdata ends up pointing to the output.  @scratch
+ * is unused if there is only one compressor.
+ *
+ * Returns the compressed size, or 0 if no compressor made the chunk smaller.
+ */
+u32
+compress_chunk_best_of(const void *udata, u32 usize, u8 **cdata, u8 **scratch,
+		       struct wimlib_compressor * const compressors[],
+		       unsigned num_compressors)
+{
+	u32 best_csize = 0;
+
+	for (unsigned i = 0; i < num_compressors; i++) {
+		u8 *out = best_csize ? *scratch : *cdata;
+		u32 csize;
+
+		/* Later candidates only need to be stored if they are smaller
+		 * than the best so far.  */
+		csize = wimlib_compress(udata, usize, out,
+					(best_csize ? best_csize : usize) - 1,
+					compressors[i]);
+		if (csize) {
+			if (best_csize) {
+				*scratch = *cdata;
+				*cdata = out;
+			}
+			best_csize = csize;
+		}
 	}
+	return best_csize;
 }
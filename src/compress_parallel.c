@@ -31,9 +31,15 @@
 
 #include "wimlib/assert.h"
 #include "wimlib/chunk_compressor.h"
+#include "wimlib/compress_common.h"
+#include "wimlib/compress_remote.h"
+#include "wimlib/compressor_ops.h"
 #include "wimlib/error.h"
 #include "wimlib/list.h"
+#include "wimlib/stats.h"
+#include "wimlib/thread_pool.h"
 #include "wimlib/threads.h"
+#include "wimlib/timestamp.h"
 #include "wimlib/util.h"
 
 struct message_queue {
@@ -41,18 +47,23 @@ struct message_queue {
 	struct mutex lock;
 	struct condvar msg_avail_cond;
 	struct condvar space_avail_cond;
-	bool terminating;
-};
-
-struct compressor_thread_data {
-	struct thread thread;
-	struct message_queue *chunks_to_compress_queue;
-	struct message_queue *compressed_chunks_queue;
-	struct wimlib_compressor *compressor;
 };
 
 #define MAX_CHUNKS_PER_MSG 16
 
+/* The amount of compression work, in 100-nanosecond units, to aim for per
+ * message.  Bigger messages reduce the synchronization overhead, whereas
+ * smaller messages spread the work more evenly across the threads.  */
+#define TARGET_MSG_TIME 50000
+
+/* With a compression target, how often to measure the compression rate and
+ * maybe change the compression level, and the levels to choose from.  */
+#define AUTOTUNE_INTERVAL_NS 500000000
+static const unsigned autotune_levels[] = { 10, 20, 35, 50, 65, 80, 100 };
+
+/* The most connections to make to one compression worker  */
+#define MAX_CONNECTIONS_PER_WORKER 64
+
 struct message {
 	u8 *uncompressed_chunks[MAX_CHUNKS_PER_MSG];
 	u8 *compressed_chunks[MAX_CHUNKS_PER_MSG];
@@ -63,22 +74,99 @@ struct message {
 	struct list_head list;
 	bool complete;
 	struct list_head submission_list;
+	u64 compress_time;
+	u8 *scratch_chunk;
+	struct incompressible_probe *probe;
+	size_t buffers_size;
+	struct thread_pool_work work;
+	struct parallel_chunk_compressor *ctx;
+};
+
+/* A connection to a compression worker (see compress_remote.c).  Its thread
+ * sends the messages in @queue to the worker one chunk at a time.  If the
+ * worker fails, the connection is marked failed, and its messages are given to
+ * the local threads instead.  */
+struct remote_connection {
+	struct remote_compressor *rc;
+	const tchar *address;
+	struct parallel_chunk_compressor *ctx;
+	struct thread thread;
+	struct mutex lock;
+	struct condvar cond;
+	struct list_head queue;
+	unsigned num_pending;
+	unsigned next_queue_idx;
+	bool started;
+	bool failed;
+	bool stop;
 };
 
 struct parallel_chunk_compressor {
 	struct chunk_compressor base;
 
-	struct message_queue chunks_to_compress_queue;
 	struct message_queue compressed_chunks_queue;
-	struct compressor_thread_data *thread_data;
-	unsigned num_thread_data;
-	unsigned num_started_threads;
+
+	/* The threads that do the compression.  This is either a pool shared
+	 * with other operations, or one created just for this compressor.  */
+	struct wimlib_thread_pool *pool;
+	unsigned next_queue_idx;
+
+	/* The compressors, in sets of one per candidate compression level.
+	 * There is one set for each message that can be compressed at the same
+	 * time.  @avail_sets is a stack of the sets not currently in use by any
+	 * thread.  @compressor_levels gives the level of each compressor.  */
+	struct mutex compressors_lock;
+	struct wimlib_compressor **compressors;
+	unsigned *compressor_levels;
+	unsigned num_compressors;
+	struct wimlib_compressor ***avail_sets;
+	unsigned num_avail_sets;
+	unsigned num_candidates;
+
+	/* If set, each message gets working space for
+	 * chunk_looks_incompressible(), and chunks are checked with it before
+	 * being compressed whenever the level is one of the fast ones.  With a
+	 * compression target, the level can change, so this only says that it
+	 * may be fast.  The compressors of the workers don't change level, so
+	 * @remote_probe says whether to check the chunks sent to them.  */
+	bool may_probe;
+	bool remote_probe;
+
+	/* With a compression target, the main thread measures the rate at which
+	 * chunks are compressed over each interval and moves @cur_level along
+	 * autotune_levels; a thread that picks up a set of compressors replaces
+	 * its compressor if the level has changed.  @target_rate is in bytes
+	 * per second, or 0 if there is no target.  */
+	u64 target_rate;
+	unsigned level_idx;
+	unsigned cur_level;
+	u64 interval_start;
+	u64 interval_bytes;
+	u64 interval_wait_ns;
+
+	/* Number of chunks to put in each message.  This is adjusted based on
+	 * how long chunks are observed to take to compress, but it never
+	 * exceeds the number of chunks allocated in each message.  */
+	size_t chunks_per_msg;
+	size_t max_chunks_per_msg;
+	u64 avg_chunk_time;
+
+	/* The connections to compression workers, if any.  A message is sent
+	 * to a connection that has fewer than @msgs_per_connection messages
+	 * pending, or else it is compressed on the local threads.  So when the
+	 * workers can't keep up, the local threads take more of the work.  */
+	struct remote_connection *conns;
+	unsigned num_conns;
+	unsigned next_conn_idx;
+	unsigned msgs_per_connection;
+	tchar *workers;
 
 	struct message *msgs;
 	size_t num_messages;
 
 	struct list_head available_msgs;
 	struct list_head submitted_msgs;
+	size_t num_submitted_msgs;
 	struct message *next_submit_msg;
 	struct message *next_ready_msg;
 	size_t next_chunk_idx;
@@ -131,38 +219,50 @@ message_queue_get(struct message_queue *q)
 	struct message *msg;
 
 	mutex_lock(&q->lock);
-	while (list_empty(&q->list) && !q->terminating)
+	while (list_empty(&q->list))
 		condvar_wait(&q->msg_avail_cond, &q->lock);
-	if (!q->terminating) {
-		msg = list_entry(q->list.next, struct message, list);
-		list_del(&msg->list);
-	} else
-		msg = NULL;
+	msg = list_entry(q->list.next, struct message, list);
+	list_del(&msg->list);
 	mutex_unlock(&q->lock);
 	return msg;
 }
 
-static void
-message_queue_terminate(struct message_queue *q)
-{
-	mutex_lock(&q->lock);
-	q->terminating = true;
-	condvar_broadcast(&q->msg_avail_cond);
-	mutex_unlock(&q->lock);
-}
-
-static int
-init_message(struct message *msg, size_t num_chunks, u32 out_chunk_size)
+/* Allocate the buffers for the chunk at index @i of a message.  The buffers are
+ * only allocated when first needed, so that writing a small amount of data
+ * doesn't allocate the maximum number of buffers.  */
+static bool
+alloc_chunk_buffers(struct message *msg, size_t i, u32 out_chunk_size,
+		    bool need_scratch, bool need_probe)
 {
-	msg->num_alloc_chunks = num_chunks;
-	for (size_t i = 0; i < num_chunks; i++) {
-		msg->compressed_chunks[i] = MALLOC(out_chunk_size - 1);
+	if (need_probe && msg->probe == NULL) {
+		msg->probe = MALLOC(sizeof(*msg->probe));
+		if (msg->probe == NULL)
+			return false;
+		msg->buffers_size += sizeof(*msg->probe);
+		MEM_ALLOCATED(compressor, sizeof(*msg->probe));
+	}
+	if (need_scratch && msg->scratch_chunk == NULL) {
+		msg->scratch_chunk = MALLOC(out_chunk_size - 1);
+		if (msg->scratch_chunk == NULL)
+			return false;
+		msg->buffers_size += out_chunk_size - 1;
+		MEM_ALLOCATED(compressor, out_chunk_size - 1);
+	}
+	if (msg->uncompressed_chunks[i] == NULL) {
 		msg->uncompressed_chunks[i] = MALLOC(out_chunk_size);
-		if (msg->compressed_chunks[i] == NULL ||
-		    msg->uncompressed_chunks[i] == NULL)
-			return WIMLIB_ERR_NOMEM;
+		if (msg->uncompressed_chunks[i] == NULL)
+			return false;
+		msg->buffers_size += out_chunk_size;
+		MEM_ALLOCATED(compressor, out_chunk_size);
 	}
-	return 0;
+	if (msg->compressed_chunks[i] == NULL) {
+		msg->compressed_chunks[i] = MALLOC(out_chunk_size - 1);
+		if (msg->compressed_chunks[i] == NULL)
+			return false;
+		msg->buffers_size += out_chunk_size - 1;
+		MEM_ALLOCATED(compressor, out_chunk_size - 1);
+	}
+	return true;
 }
 
 static void
@@ -172,6 +272,9 @@ destroy_message(struct message *msg)
 		FREE(msg->compressed_chunks[i]);
 		FREE(msg->uncompressed_chunks[i]);
 	}
+	FREE(msg->scratch_chunk);
+	FREE(msg->probe);
+	MEM_FREED(compressor, msg->buffers_size);
 }
 
 static void
@@ -185,74 +288,346 @@ free_messages(struct message *msgs, size_t num_messages)
 }
 
 static struct message *
-allocate_messages(size_t count, size_t chunks_per_msg, u32 out_chunk_size)
+allocate_messages(size_t count, size_t chunks_per_msg)
 {
 	struct message *msgs;
 
 	msgs = CALLOC(count, sizeof(struct message));
 	if (msgs == NULL)
 		return NULL;
-	for (size_t i = 0; i < count; i++) {
-		if (init_message(&msgs[i], chunks_per_msg, out_chunk_size)) {
-			free_messages(msgs, count);
-			return NULL;
-		}
-	}
+	for (size_t i = 0; i < count; i++)
+		msgs[i].num_alloc_chunks = chunks_per_msg;
 	return msgs;
 }
 
 static void
-compress_chunks(struct message *msg, struct wimlib_compressor *compressor)
+compress_chunks(struct message *msg, struct wimlib_compressor * const *compressors,
+		unsigned num_compressors, struct incompressible_probe *probe)
 {
+	u64 start_time = now_as_wim_timestamp();
+	u64 end_time;
 
 	for (size_t i = 0; i < msg->num_filled_chunks; i++) {
 		wimlib_assert(msg->uncompressed_chunk_sizes[i] != 0);
+		if (probe &&
+		    chunk_looks_incompressible(probe,
+					       msg->uncompressed_chunks[i],
+					       msg->uncompressed_chunk_sizes[i]))
+		{
+			msg->compressed_chunk_sizes[i] = 0;
+			continue;
+		}
 		msg->compressed_chunk_sizes[i] =
-			wimlib_compress(msg->uncompressed_chunks[i],
-					msg->uncompressed_chunk_sizes[i],
-					msg->compressed_chunks[i],
-					msg->uncompressed_chunk_sizes[i] - 1,
-					compressor);
+			compress_chunk_best_of(msg->uncompressed_chunks[i],
+					       msg->uncompressed_chunk_sizes[i],
+					       &msg->compressed_chunks[i],
+					       &msg->scratch_chunk,
+					       compressors, num_compressors);
 	}
+
+	/* The clock is not necessarily monotonic, so be careful.  */
+	end_time = now_as_wim_timestamp();
+	msg->compress_time = (end_time > start_time) ? end_time - start_time : 0;
+}
+
+/* Replace the compressor in @set, which must have only one, if the compression
+ * level has been changed since it was last used.  If a compressor for the new
+ * level can't be allocated, keep using the old one.  */
+static void
+switch_compressor_level(struct parallel_chunk_compressor *ctx,
+			struct wimlib_compressor **set)
+{
+	size_t i = set - ctx->compressors;
+	unsigned level = __atomic_load_n(&ctx->cur_level, __ATOMIC_RELAXED) |
+			 WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+	struct wimlib_compressor *c;
+
+	if (ctx->compressor_levels[i] == level)
+		return;
+	if (thread_pool_get_compressor(ctx->pool, ctx->base.out_ctype,
+				       ctx->base.out_chunk_size, level, &c))
+		return;
+	thread_pool_put_compressor(ctx->pool, ctx->base.out_ctype,
+				   ctx->base.out_chunk_size,
+				   ctx->compressor_levels[i], *set);
+	*set = c;
+	ctx->compressor_levels[i] = level;
+}
+
+/* Compress a message on one of the pool's threads, then hand it back to the
+ * main thread.  */
+static void
+compress_message(struct thread_pool_work *work)
+{
+	struct message *msg = container_of(work, struct message, work);
+	struct parallel_chunk_compressor *ctx = msg->ctx;
+	struct wimlib_compressor **set;
+	struct incompressible_probe *probe = NULL;
+
+	mutex_lock(&ctx->compressors_lock);
+	wimlib_assert(ctx->num_avail_sets > 0);
+	set = ctx->avail_sets[--ctx->num_avail_sets];
+	mutex_unlock(&ctx->compressors_lock);
+
+	if (ctx->target_rate)
+		switch_compressor_level(ctx, set);
+	if (ctx->may_probe &&
+	    (ctx->compressor_levels[set - ctx->compressors] &
+	     ~WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE) <=
+	    MAX_INCOMPRESSIBLE_PROBE_LEVEL)
+		probe = msg->probe;
+	compress_chunks(msg, set, ctx->num_candidates, probe);
+
+	mutex_lock(&ctx->compressors_lock);
+	ctx->avail_sets[ctx->num_avail_sets++] = set;
+	mutex_unlock(&ctx->compressors_lock);
+
+	message_queue_put(&ctx->compressed_chunks_queue, msg);
+}
+
+/* Compress a message on a compression worker.  */
+static int
+compress_chunks_remotely(struct remote_connection *conn, struct message *msg)
+{
+	u64 start_time = now_as_wim_timestamp();
+	u64 end_time;
+	int ret;
+
+	for (size_t i = 0; i < msg->num_filled_chunks; i++) {
+		if (conn->ctx->remote_probe &&
+		    chunk_looks_incompressible(msg->probe,
+					       msg->uncompressed_chunks[i],
+					       msg->uncompressed_chunk_sizes[i]))
+		{
+			msg->compressed_chunk_sizes[i] = 0;
+			continue;
+		}
+		ret = remote_compress_chunk(conn->rc,
+					    msg->uncompressed_chunks[i],
+					    msg->uncompressed_chunk_sizes[i],
+					    msg->compressed_chunks[i],
+					    &msg->compressed_chunk_sizes[i]);
+		if (ret)
+			return ret;
+	}
+
+	end_time = now_as_wim_timestamp();
+	msg->compress_time = (end_time > start_time) ? end_time - start_time : 0;
+	return 0;
 }
 
 static void *
-compressor_thread_proc(void *arg)
+remote_connection_thread(void *arg)
 {
-	struct compressor_thread_data *params = arg;
+	struct remote_connection *conn = arg;
+	struct parallel_chunk_compressor *ctx = conn->ctx;
 	struct message *msg;
+	int ret;
+
+	mutex_lock(&conn->lock);
+	for (;;) {
+		while (list_empty(&conn->queue) && !conn->stop)
+			condvar_wait(&conn->cond, &conn->lock);
+		if (list_empty(&conn->queue))
+			break;
+		msg = list_entry(conn->queue.next, struct message, list);
+		list_del(&msg->list);
+		mutex_unlock(&conn->lock);
 
-	while ((msg = message_queue_get(params->chunks_to_compress_queue)) != NULL) {
-		compress_chunks(msg, params->compressor);
-		message_queue_put(params->compressed_chunks_queue, msg);
+		if (conn->failed)
+			ret = WIMLIB_ERR_COMPRESSION_WORKER;
+		else
+			ret = compress_chunks_remotely(conn, msg);
+		if (ret)
+			thread_pool_submit(ctx->pool, &msg->work,
+					   &conn->next_queue_idx);
+		else
+			message_queue_put(&ctx->compressed_chunks_queue, msg);
+
+		mutex_lock(&conn->lock);
+		if (ret && !conn->failed) {
+			WARNING("Compression worker \"%"TS"\" failed; "
+				"compressing its chunks locally", conn->address);
+			conn->failed = true;
+		}
+		conn->num_pending--;
 	}
+	mutex_unlock(&conn->lock);
 	return NULL;
 }
 
+/* Send @msg to a connection to a compression worker that has room for it, if
+ * there is one.  */
+static bool
+submit_to_remote_connection(struct parallel_chunk_compressor *ctx,
+			    struct message *msg)
+{
+	for (unsigned n = 0; n < ctx->num_conns; n++) {
+		struct remote_connection *conn = &ctx->conns[ctx->next_conn_idx];
+
+		if (++ctx->next_conn_idx == ctx->num_conns)
+			ctx->next_conn_idx = 0;
+
+		mutex_lock(&conn->lock);
+		if (!conn->failed &&
+		    conn->num_pending < ctx->msgs_per_connection)
+		{
+			list_add_tail(&msg->list, &conn->queue);
+			conn->num_pending++;
+			condvar_signal(&conn->cond);
+			mutex_unlock(&conn->lock);
+			return true;
+		}
+		mutex_unlock(&conn->lock);
+	}
+	return false;
+}
+
+/*
+ * Connect to the compression workers in the comma-separated list
+ * @ctx->workers, making as many connections to each worker as it has threads.
+ * A worker that can't be connected to is skipped with a warning.
+ */
+static int
+connect_to_workers(struct parallel_chunk_compressor *ctx,
+		   const unsigned levels[], unsigned num_levels)
+{
+	size_t max_conns = 0;
+	tchar *address, *next;
+
+	for (const tchar *p = ctx->workers; p; p = tstrchr(p + 1, T(',')))
+		max_conns += MAX_CONNECTIONS_PER_WORKER;
+	ctx->conns = CALLOC(max_conns, sizeof(ctx->conns[0]));
+	if (ctx->conns == NULL)
+		return WIMLIB_ERR_NOMEM;
+
+	for (address = ctx->workers; address; address = next) {
+		struct remote_compressor *rc;
+		unsigned num_threads, dummy;
+		int ret;
+
+		next = tstrchr(address, T(','));
+		if (next)
+			*next++ = T('\0');
+		if (*address == T('\0'))
+			continue;
+
+		ret = remote_compressor_connect(address, ctx->base.out_ctype,
+						ctx->base.out_chunk_size,
+						levels, num_levels, &rc,
+						&num_threads);
+		if (ret == WIMLIB_ERR_NOMEM)
+			return ret;
+		if (ret) {
+			WARNING("Not using compression worker \"%"TS"\"",
+				address);
+			continue;
+		}
+		num_threads = min(num_threads, MAX_CONNECTIONS_PER_WORKER);
+		for (unsigned i = 0; ; ) {
+			ctx->conns[ctx->num_conns].rc = rc;
+			ctx->conns[ctx->num_conns].address = address;
+			ctx->num_conns++;
+			if (++i == num_threads)
+				break;
+			if (remote_compressor_connect(address,
+						      ctx->base.out_ctype,
+						      ctx->base.out_chunk_size,
+						      levels, num_levels, &rc,
+						      &dummy))
+				break;
+		}
+	}
+	return 0;
+}
+
+/* Start the threads of the connections to compression workers.  A connection
+ * whose thread can't be started is just not used.  */
+static void
+start_remote_connections(struct parallel_chunk_compressor *ctx)
+{
+	for (unsigned i = 0; i < ctx->num_conns; i++) {
+		struct remote_connection *conn = &ctx->conns[i];
+
+		conn->ctx = ctx;
+		INIT_LIST_HEAD(&conn->queue);
+		conn->failed = true;
+		if (!mutex_init(&conn->lock))
+			continue;
+		if (!condvar_init(&conn->cond)) {
+			mutex_destroy(&conn->lock);
+			continue;
+		}
+		if (!thread_create(&conn->thread, remote_connection_thread,
+				   conn))
+		{
+			condvar_destroy(&conn->cond);
+			mutex_destroy(&conn->lock);
+			continue;
+		}
+		conn->started = true;
+		conn->failed = false;
+	}
+}
+
+static void
+stop_remote_connections(struct parallel_chunk_compressor *ctx)
+{
+	for (unsigned i = 0; i < ctx->num_conns; i++) {
+		struct remote_connection *conn = &ctx->conns[i];
+
+		if (conn->started) {
+			mutex_lock(&conn->lock);
+			conn->stop = true;
+			condvar_signal(&conn->cond);
+			mutex_unlock(&conn->lock);
+			thread_join(&conn->thread);
+			condvar_destroy(&conn->cond);
+			mutex_destroy(&conn->lock);
+		}
+		remote_compressor_close(conn->rc);
+	}
+	FREE(ctx->conns);
+}
+
 static void
 parallel_chunk_compressor_destroy(struct chunk_compressor *_ctx)
 {
 	struct parallel_chunk_compressor *ctx = (struct parallel_chunk_compressor *)_ctx;
-	unsigned i;
+	struct message *msg;
 
 	if (ctx == NULL)
 		return;
 
-	if (ctx->num_started_threads != 0) {
-		message_queue_terminate(&ctx->chunks_to_compress_queue);
+	/* Wait for any messages that are still being compressed, since the
+	 * pool's threads may outlive this compressor.  */
+	if (ctx->submitted_msgs.next != NULL) {
+		list_for_each_entry(msg, &ctx->submitted_msgs, submission_list)
+			while (!msg->complete)
+				message_queue_get(&ctx->compressed_chunks_queue)->complete = true;
+	}
 
-		for (i = 0; i < ctx->num_started_threads; i++)
-			thread_join(&ctx->thread_data[i].thread);
+	stop_remote_connections(ctx);
+	FREE(ctx->workers);
+
+	if (ctx->compressors != NULL) {
+		for (unsigned i = 0; i < ctx->num_compressors; i++)
+			thread_pool_put_compressor(ctx->pool, ctx->base.out_ctype,
+						   ctx->base.out_chunk_size,
+						   ctx->compressor_levels[i],
+						   ctx->compressors[i]);
+		FREE(ctx->compressors);
+		FREE(ctx->compressor_levels);
+		FREE(ctx->avail_sets);
+		mutex_destroy(&ctx->compressors_lock);
 	}
 
-	message_queue_destroy(&ctx->chunks_to_compress_queue);
-	message_queue_destroy(&ctx->compressed_chunks_queue);
+	if (ctx->pool)
+		thread_pool_put(ctx->pool);
 
-	if (ctx->thread_data != NULL)
-		for (i = 0; i < ctx->num_thread_data; i++)
-			wimlib_free_compressor(ctx->thread_data[i].compressor);
+	flush_trace();
 
-	FREE(ctx->thread_data);
+	message_queue_destroy(&ctx->compressed_chunks_queue);
 
 	free_messages(ctx->msgs, ctx->num_messages);
 
@@ -266,8 +641,73 @@ submit_compression_msg(struct parallel_chunk_compressor *ctx)
 
 	msg->complete = false;
 	list_add_tail(&msg->submission_list, &ctx->submitted_msgs);
-	message_queue_put(&ctx->chunks_to_compress_queue, msg);
+	if (!submit_to_remote_connection(ctx, msg))
+		thread_pool_submit(ctx->pool, &msg->work, &ctx->next_queue_idx);
 	ctx->next_submit_msg = NULL;
+
+	STATS_ADD(compress_batches, 1);
+	STATS_ADD(compress_queue_depth_sum, ++ctx->num_submitted_msgs);
+	trace_counter("messages being compressed", ctx->num_submitted_msgs);
+}
+
+/* Update the number of chunks to put in each message, given that @msg has just
+ * finished being compressed.  */
+static void
+update_chunks_per_msg(struct parallel_chunk_compressor *ctx,
+		      const struct message *msg)
+{
+	u64 chunk_time = msg->compress_time / msg->num_filled_chunks;
+	u64 n;
+
+	/* Exponential moving average of the time per chunk  */
+	if (ctx->avg_chunk_time == 0)
+		ctx->avg_chunk_time = chunk_time;
+	else
+		ctx->avg_chunk_time = (3 * ctx->avg_chunk_time + chunk_time) / 4;
+
+	n = TARGET_MSG_TIME / max(ctx->avg_chunk_time, 1);
+	n = max(min(n, ctx->max_chunks_per_msg), 1);
+	if (n != ctx->chunks_per_msg)
+		trace_counter("chunks per message", n);
+	ctx->chunks_per_msg = n;
+}
+
+/* With a compression target, account for @msg having just been compressed, and
+ * at the end of each interval, change the compression level if the rate was
+ * off target.  The level is only lowered if the writer spent a good part of the
+ * interval waiting for compression, since otherwise something else, such as
+ * reading the data, is what's too slow.  */
+static void
+autotune_compression_level(struct parallel_chunk_compressor *ctx,
+			   const struct message *msg)
+{
+	u64 now = stats_now_ns();
+	u64 elapsed = now - ctx->interval_start;
+	double rate;
+	unsigned idx = ctx->level_idx;
+
+	for (size_t i = 0; i < msg->num_filled_chunks; i++)
+		ctx->interval_bytes += msg->uncompressed_chunk_sizes[i];
+	if (elapsed < AUTOTUNE_INTERVAL_NS)
+		return;
+
+	rate = ctx->interval_bytes / ((double)elapsed / 1e9);
+	if (rate < ctx->target_rate) {
+		if (idx > 0 && ctx->interval_wait_ns > elapsed / 4)
+			idx--;
+	} else if (rate > ctx->target_rate + ctx->target_rate / 4) {
+		if (idx < ARRAY_LEN(autotune_levels) - 1)
+			idx++;
+	}
+	if (idx != ctx->level_idx) {
+		ctx->level_idx = idx;
+		__atomic_store_n(&ctx->cur_level, autotune_levels[idx],
+				 __ATOMIC_RELAXED);
+		trace_counter("compression level", autotune_levels[idx]);
+	}
+	ctx->interval_start = now;
+	ctx->interval_bytes = 0;
+	ctx->interval_wait_ns = 0;
 }
 
 static void *
@@ -288,6 +728,25 @@ parallel_chunk_compressor_get_chunk_buffer(struct chunk_compressor *_ctx)
 		msg->num_filled_chunks = 0;
 	}
 
+	if (unlikely(!alloc_chunk_buffers(msg, msg->num_filled_chunks,
+					  ctx->base.out_chunk_size,
+					  ctx->num_candidates > 1,
+					  ctx->may_probe)))
+	{
+		/* Out of memory.  Make do with the buffers that were already
+		 * allocated: send off what has been filled so far, and make
+		 * the caller wait for a compressed chunk.  If nothing at all
+		 * is being compressed, the caller will fail with
+		 * WIMLIB_ERR_NOMEM.  */
+		if (msg->num_filled_chunks) {
+			submit_compression_msg(ctx);
+		} else {
+			list_add(&msg->list, &ctx->available_msgs);
+			ctx->next_submit_msg = NULL;
+		}
+		return NULL;
+	}
+
 	return msg->uncompressed_chunks[msg->num_filled_chunks];
 }
 
@@ -303,7 +762,7 @@ parallel_chunk_compressor_signal_chunk_filled(struct chunk_compressor *_ctx, u32
 
 	msg = ctx->next_submit_msg;
 	msg->uncompressed_chunk_sizes[msg->num_filled_chunks] = usize;
-	if (++msg->num_filled_chunks == msg->num_alloc_chunks)
+	if (++msg->num_filled_chunks >= ctx->chunks_per_msg)
 		submit_compression_msg(ctx);
 }
 
@@ -324,11 +783,23 @@ parallel_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 		if (list_empty(&ctx->submitted_msgs))
 			return false;
 
-		while (!(msg = list_entry(ctx->submitted_msgs.next,
-					  struct message,
-					  submission_list))->complete)
-			message_queue_get(&ctx->compressed_chunks_queue)->complete = true;
+		msg = list_entry(ctx->submitted_msgs.next, struct message,
+				 submission_list);
+		if (!msg->complete) {
+			u64 start = stats_now_ns();
+			u64 end;
+
+			while (!msg->complete)
+				message_queue_get(&ctx->compressed_chunks_queue)->complete = true;
+			end = stats_now_ns();
+			STATS_ADD(compress_wait_ns, end - start);
+			ctx->interval_wait_ns += end - start;
+			trace_span(0, "wait for compressed chunks", start, end);
+		}
 
+		update_chunks_per_msg(ctx, msg);
+		if (ctx->target_rate)
+			autotune_compression_level(ctx, msg);
 		ctx->next_ready_msg = msg;
 		ctx->next_chunk_idx = 0;
 	}
@@ -344,38 +815,112 @@ parallel_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 
 	if (++ctx->next_chunk_idx == msg->num_filled_chunks) {
 		list_del(&msg->submission_list);
-		list_add_tail(&msg->list, &ctx->available_msgs);
+		ctx->num_submitted_msgs--;
+		/* Reuse this message first, rather than one whose buffers may
+		 * not have been allocated yet.  */
+		list_add(&msg->list, &ctx->available_msgs);
 		ctx->next_ready_msg = NULL;
 	}
 	return true;
 }
 
-int
-new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
-			      unsigned num_threads, u64 max_memory,
-			      struct chunk_compressor **compressor_ret)
+static int
+create_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			unsigned num_threads, struct wimlib_thread_pool *pool,
+			u64 max_memory, bool multi_candidate,
+			unsigned target_mb_per_sec, const tchar *workers,
+			struct chunk_compressor **compressor_ret)
 {
 	u64 approx_mem_required;
 	size_t chunks_per_msg;
 	size_t msgs_per_thread;
 	struct parallel_chunk_compressor *ctx;
-	unsigned i;
+	unsigned num_sets;
+	unsigned levels[MAX_COMPRESSION_CANDIDATES];
+	unsigned num_candidates;
+	u64 compressor_mem;
 	int ret;
 	unsigned desired_num_threads;
 
 	wimlib_assert(out_chunk_size > 0);
 
-	if (num_threads == 0)
+	if (pool)
+		num_threads = thread_pool_num_threads(pool);
+	else if (num_threads == 0)
 		num_threads = get_available_cpus();
 
-	if (num_threads == 1)
+	if (num_threads == 1 && workers == NULL)
 		return -1;
 
 	if (max_memory == 0)
-		max_memory = get_available_memory();
+		max_memory = get_memory_limit();
 
 	desired_num_threads = num_threads;
 
+	/* Choose the compression level of each candidate compressor.  Only the
+	 * last candidate can be destructive, since the others must leave the
+	 * chunk intact.  Then account for the memory that the compressors will
+	 * actually use.  */
+	if (multi_candidate) {
+		num_candidates = get_candidate_compression_levels(out_ctype,
+								  levels);
+	} else {
+		levels[0] = get_default_compression_level(out_ctype);
+		num_candidates = 1;
+		if (target_mb_per_sec) {
+			/* Start at the highest autotuning level that isn't
+			 * above the default.  */
+			levels[0] = autotune_levels[0];
+			for (unsigned i = 1; i < ARRAY_LEN(autotune_levels); i++)
+				if (autotune_levels[i] <=
+				    get_default_compression_level(out_ctype))
+					levels[0] = autotune_levels[i];
+		}
+	}
+	levels[num_candidates - 1] |= WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+	compressor_mem = 0;
+	for (unsigned i = 0; i < num_candidates; i++)
+		compressor_mem += wimlib_get_compressor_needed_memory(out_ctype,
+								      out_chunk_size,
+								      levels[i]);
+	/* With a target, make sure there is memory for the most expensive
+	 * level that may be used.  */
+	if (target_mb_per_sec && !multi_candidate)
+		compressor_mem = max(compressor_mem,
+				     wimlib_get_compressor_needed_memory(out_ctype,
+									 out_chunk_size,
+									 100));
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx = CALLOC(1, sizeof(*ctx));
+	if (ctx == NULL)
+		goto err;
+
+	ctx->base.out_ctype = out_ctype;
+	ctx->base.out_chunk_size = out_chunk_size;
+	ctx->base.destroy = parallel_chunk_compressor_destroy;
+	ctx->base.get_chunk_buffer = parallel_chunk_compressor_get_chunk_buffer;
+	ctx->base.signal_chunk_filled = parallel_chunk_compressor_signal_chunk_filled;
+	ctx->base.get_compression_result = parallel_chunk_compressor_get_compression_result;
+
+	INIT_LIST_HEAD(&ctx->available_msgs);
+	INIT_LIST_HEAD(&ctx->submitted_msgs);
+
+	/* Connect to the compression workers first, since each connection
+	 * needs messages of its own.  If none can be connected to, this is
+	 * just a parallel chunk compressor.  */
+	if (workers) {
+		ctx->workers = TSTRDUP(workers);
+		if (ctx->workers == NULL)
+			goto err;
+		ret = connect_to_workers(ctx, levels, num_candidates);
+		if (ret)
+			goto err;
+		ret = -1;
+		if (num_threads == 1 && ctx->num_conns == 0)
+			goto err;
+	}
+
 	if (out_chunk_size < ((u32)1 << 23)) {
 		/* Relatively small chunks.  Use 2 messages per thread, each
 		 * with at least 2 chunks.  Use more chunks per message if there
@@ -395,13 +940,12 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 		approx_mem_required =
 			(u64)chunks_per_msg *
 			(u64)msgs_per_thread *
-			(u64)num_threads *
+			(u64)(num_threads + ctx->num_conns) *
 			(u64)out_chunk_size
 			+ out_chunk_size
 			+ 1000000
-			+ num_threads * wimlib_get_compressor_needed_memory(out_ctype,
-									    out_chunk_size,
-									    0);
+			+ num_threads * compressor_mem
+			+ ctx->num_conns * (u64)out_chunk_size;
 		if (approx_mem_required <= max_memory)
 			break;
 
@@ -421,79 +965,95 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 			desired_num_threads, num_threads);
 	}
 
-	if (num_threads == 1)
-		return -2;
-
-	ret = WIMLIB_ERR_NOMEM;
-	ctx = CALLOC(1, sizeof(*ctx));
-	if (ctx == NULL)
-		goto err;
-
-	ctx->base.out_ctype = out_ctype;
-	ctx->base.out_chunk_size = out_chunk_size;
-	ctx->base.destroy = parallel_chunk_compressor_destroy;
-	ctx->base.get_chunk_buffer = parallel_chunk_compressor_get_chunk_buffer;
-	ctx->base.signal_chunk_filled = parallel_chunk_compressor_signal_chunk_filled;
-	ctx->base.get_compression_result = parallel_chunk_compressor_get_compression_result;
-
-	ctx->num_thread_data = num_threads;
-
-	ret = message_queue_init(&ctx->chunks_to_compress_queue);
-	if (ret)
+	ret = -2;
+	if (num_threads == 1 && ctx->num_conns == 0)
 		goto err;
 
 	ret = message_queue_init(&ctx->compressed_chunks_queue);
 	if (ret)
 		goto err;
 
-	ret = WIMLIB_ERR_NOMEM;
-	ctx->thread_data = CALLOC(num_threads, sizeof(ctx->thread_data[0]));
-	if (ctx->thread_data == NULL)
-		goto err;
-
-	for (i = 0; i < num_threads; i++) {
-		struct compressor_thread_data *dat;
-
-		dat = &ctx->thread_data[i];
-
-		dat->chunks_to_compress_queue = &ctx->chunks_to_compress_queue;
-		dat->compressed_chunks_queue = &ctx->compressed_chunks_queue;
-		ret = wimlib_create_compressor(out_ctype, out_chunk_size,
-					       WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE,
-					       &dat->compressor);
+	if (pool) {
+		thread_pool_get(pool);
+		ctx->pool = pool;
+	} else {
+		ret = thread_pool_create(num_threads, &ctx->pool);
 		if (ret)
 			goto err;
-	}
-
-	for (ctx->num_started_threads = 0;
-	     ctx->num_started_threads < num_threads;
-	     ctx->num_started_threads++)
-	{
-		if (!thread_create(&ctx->thread_data[ctx->num_started_threads].thread,
-				   compressor_thread_proc,
-				   &ctx->thread_data[ctx->num_started_threads]))
-		{
-			ret = WIMLIB_ERR_NOMEM;
-			if (ctx->num_started_threads >= 2)
-				break;
+		ret = WIMLIB_ERR_NOMEM;
+		if (thread_pool_num_threads(ctx->pool) < 2 &&
+		    ctx->num_conns == 0)
 			goto err;
-		}
 	}
 
-	ctx->base.num_threads = ctx->num_started_threads;
+	/* Limiting the number of messages also limits how many of the pool's
+	 * threads can be compressing data for us at the same time.  */
+	num_threads = min(num_threads, thread_pool_num_threads(ctx->pool));
+	ctx->base.num_threads = num_threads + ctx->num_conns;
+	ctx->chunks_per_msg = chunks_per_msg;
+	ctx->max_chunks_per_msg = chunks_per_msg;
+	ctx->msgs_per_connection = msgs_per_thread;
 
 	ret = WIMLIB_ERR_NOMEM;
-	ctx->num_messages = ctx->num_started_threads * msgs_per_thread;
-	ctx->msgs = allocate_messages(ctx->num_messages,
-				      chunks_per_msg, out_chunk_size);
+	ctx->num_messages = (num_threads + ctx->num_conns) * msgs_per_thread;
+	ctx->msgs = allocate_messages(ctx->num_messages, chunks_per_msg);
 	if (ctx->msgs == NULL)
 		goto err;
 
-	INIT_LIST_HEAD(&ctx->available_msgs);
-	for (size_t i = 0; i < ctx->num_messages; i++)
+	for (size_t i = 0; i < ctx->num_messages; i++) {
+		ctx->msgs[i].work.run = compress_message;
+		ctx->msgs[i].work.name = "compress";
+		ctx->msgs[i].ctx = ctx;
 		list_add_tail(&ctx->msgs[i].list, &ctx->available_msgs);
+	}
 
-	INIT_LIST_HEAD(&ctx->submitted_msgs);
+	/* Messages that the compression workers fail to compress are
+	 * compressed locally, so there must be local compressors even if
+	 * they're usually idle.  */
+	ctx->num_candidates = num_candidates;
+	ctx->remote_probe = (num_candidates == 1 &&
+			     (levels[0] & ~WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE) <=
+			     MAX_INCOMPRESSIBLE_PROBE_LEVEL);
+	ctx->may_probe = ctx->remote_probe ||
+			 (num_candidates == 1 && target_mb_per_sec);
+	num_sets = min(ctx->num_messages, thread_pool_num_threads(ctx->pool));
+	ctx->compressors = CALLOC(num_sets * num_candidates,
+				  sizeof(ctx->compressors[0]));
+	ctx->compressor_levels = CALLOC(num_sets * num_candidates,
+					sizeof(ctx->compressor_levels[0]));
+	ctx->avail_sets = CALLOC(num_sets, sizeof(ctx->avail_sets[0]));
+	if (ctx->compressors == NULL || ctx->compressor_levels == NULL ||
+	    ctx->avail_sets == NULL || !mutex_init(&ctx->compressors_lock))
+	{
+		FREE(ctx->compressors);
+		FREE(ctx->compressor_levels);
+		FREE(ctx->avail_sets);
+		ctx->compressors = NULL;
+		goto err;
+	}
+	while (ctx->num_compressors < num_sets * num_candidates) {
+		unsigned level = levels[ctx->num_compressors % num_candidates];
+
+		ret = thread_pool_get_compressor(ctx->pool, out_ctype,
+						 out_chunk_size, level,
+						 &ctx->compressors[ctx->num_compressors]);
+		if (ret)
+			goto err;
+		ctx->compressor_levels[ctx->num_compressors++] = level;
+	}
+	for (unsigned i = 0; i < num_sets; i++)
+		ctx->avail_sets[i] = &ctx->compressors[i * num_candidates];
+	ctx->num_avail_sets = num_sets;
+
+	if (target_mb_per_sec && !multi_candidate) {
+		ctx->target_rate = (u64)target_mb_per_sec * 1000000;
+		ctx->cur_level = levels[0] & ~WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+		while (autotune_levels[ctx->level_idx] != ctx->cur_level)
+			ctx->level_idx++;
+		ctx->interval_start = stats_now_ns();
+	}
+
+	start_remote_connections(ctx);
 
 	*compressor_ret = &ctx->base;
 	return 0;
@@ -502,3 +1062,55 @@ err:
 	parallel_chunk_compressor_destroy(&ctx->base);
 	return ret;
 }
+
+/*
+ * Create a chunk compressor that compresses chunks on multiple threads.  If
+ * @multi_candidate is true, each chunk is compressed at several compression
+ * levels and the smallest output is kept.
+ *
+ * If @pool is not NULL, the threads of that pool are used, and @num_threads is
+ * ignored in favor of the pool's number of threads.  Otherwise, a pool of
+ * @num_threads threads (or one per processor if 0) is created just for the
+ * new chunk compressor.
+ *
+ * If @target_mb_per_sec is nonzero and @multi_candidate is false, the
+ * compression level is adjusted to compress about that many megabytes per
+ * second (see wimlib_set_output_compression_target()).
+ *
+ * Returns 0 on success, a positive error code on failure, or a negative value
+ * if compressing in parallel is not worthwhile and the serial chunk compressor
+ * should be used instead.
+ */
+int
+new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			      unsigned num_threads,
+			      struct wimlib_thread_pool *pool, u64 max_memory,
+			      bool multi_candidate, unsigned target_mb_per_sec,
+			      struct chunk_compressor **compressor_ret)
+{
+	return create_chunk_compressor(out_ctype, out_chunk_size, num_threads,
+				       pool, max_memory, multi_candidate,
+				       target_mb_per_sec, NULL,
+				       compressor_ret);
+}
+
+/*
+ * Like new_parallel_chunk_compressor(), but also send chunks to the compression
+ * workers in the comma-separated list @workers (see
+ * wimlib_set_output_compression_workers()).  Chunks are compressed on the local
+ * threads when the workers have as much work as they can take, and also when a
+ * worker fails.  Workers that can't be connected to are skipped with a warning.
+ * A compression target only applies to the local threads.
+ */
+int
+new_remote_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    const tchar *workers, unsigned num_threads,
+			    struct wimlib_thread_pool *pool, u64 max_memory,
+			    bool multi_candidate, unsigned target_mb_per_sec,
+			    struct chunk_compressor **compressor_ret)
+{
+	return create_chunk_compressor(out_ctype, out_chunk_size, num_threads,
+				       pool, max_memory, multi_candidate,
+				       target_mb_per_sec, workers,
+				       compressor_ret);
+}
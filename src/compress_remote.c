@@ -0,0 +1,615 @@
+/*
+ * compress_remote.c
+ *
+ * Compress chunks of data on other machines ("compression workers").
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * The protocol runs over a TCP connection and consists of 32-bit little endian
+ * integers and chunk data.  The client starts by sending the magic number, the
+ * protocol version, the compression type, the chunk size, the number of
+ * compression levels, and the levels themselves.  The worker replies with a
+ * status, which is 0 or a wimlib error code, and the number of threads it has,
+ * which is how many connections the client may usefully make to it.
+ *
+ * Then, for each chunk, the client sends the uncompressed size followed by the
+ * uncompressed data, and the worker replies with the compressed size followed
+ * by the compressed data.  A compressed size of 0 means the chunk didn't
+ * compress, and no data follows.  An uncompressed size of 0 ends the session.
+ *
+ * Each connection handles one chunk at a time, so neither side ever blocks
+ * sending while the other is also sending.  To compress several chunks at the
+ * same time, the client makes several connections.  The client decompresses
+ * every chunk it gets back and compares it with the original, so a bad worker
+ * can't silently corrupt the WIM file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/error.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "wimlib/assert.h"
+#include "wimlib/compress_common.h"
+#include "wimlib/compress_remote.h"
+#include "wimlib/compressor_ops.h"
+#include "wimlib/endianness.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+#define WORKER_MAGIC		0x57434c57	/* "WLCW" */
+#define WORKER_PROTOCOL_VERSION	1
+
+/* How long the client waits for a worker, and a worker for a client, before
+ * giving up on it  */
+#define WORKER_TIMEOUT_SECS	120
+
+/* The most sessions a worker serves at the same time, per thread it advertises.
+ * One client makes up to one connection per thread, so this allows several
+ * clients at once, but not an unbounded number of threads and buffers.  */
+#define WORKER_MAX_SESSIONS_PER_THREAD	4
+
+struct remote_compressor {
+	int sock;
+	u32 chunk_size;
+	struct wimlib_decompressor *decompressor;
+	u8 *verify_buf;
+};
+
+static bool
+send_all(int sock, const void *buf, size_t count)
+{
+	while (count) {
+		ssize_t ret = send(sock, buf, count, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += ret;
+		count -= ret;
+	}
+	return true;
+}
+
+static bool
+recv_all(int sock, void *buf, size_t count)
+{
+	while (count) {
+		ssize_t ret = recv(sock, buf, count, 0);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret == 0)
+				errno = ECONNRESET;
+			return false;
+		}
+		buf += ret;
+		count -= ret;
+	}
+	return true;
+}
+
+static bool
+send_u32(int sock, u32 v)
+{
+	le32 v_le = cpu_to_le32(v);
+
+	return send_all(sock, &v_le, sizeof(v_le));
+}
+
+static bool
+recv_u32(int sock, u32 *v_ret)
+{
+	le32 v_le;
+
+	if (!recv_all(sock, &v_le, sizeof(v_le)))
+		return false;
+	*v_ret = le32_to_cpu(v_le);
+	return true;
+}
+
+/*
+ * Split a worker address of the form HOST:PORT, where HOST may be an IPv6
+ * address in brackets, into its host and port.  If @passive is true, HOST and
+ * the colon may be omitted, and *host_ret is set to NULL.  The strings point
+ * into *buf_ret, which the caller must free.
+ */
+static int
+split_address(const char *address, bool passive, char **buf_ret,
+	      const char **host_ret, const char **port_ret)
+{
+	char *buf = STRDUP(address);
+	char *host = buf;
+	char *port;
+
+	if (buf == NULL)
+		return WIMLIB_ERR_NOMEM;
+
+	if (*buf == '[') {
+		host++;
+		port = strchr(host, ']');
+		if (port == NULL || port[1] != ':')
+			goto invalid;
+		*port++ = '\0';
+		*port++ = '\0';
+	} else {
+		port = strrchr(buf, ':');
+		if (port != NULL) {
+			*port++ = '\0';
+		} else if (passive) {
+			host = NULL;
+			port = buf;
+		} else {
+			goto invalid;
+		}
+	}
+	if ((host != NULL && *host == '\0') || *port == '\0')
+		goto invalid;
+	*buf_ret = buf;
+	*host_ret = host;
+	*port_ret = port;
+	return 0;
+
+invalid:
+	FREE(buf);
+	ERROR("\"%s\" is not a valid address; expected %sHOST:PORT",
+	      address, passive ? "PORT or " : "");
+	return WIMLIB_ERR_INVALID_PARAM;
+}
+
+/* Set the options used on both ends of a connection.  The timeouts keep a peer
+ * that stops responding from holding up the other end forever.  */
+static void
+set_socket_options(int sock)
+{
+	struct timeval timeout = { .tv_sec = WORKER_TIMEOUT_SECS };
+	int one = 1;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static int
+connect_to_worker(const char *address, int *sock_ret)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	char *buf;
+	const char *host, *port;
+	int sock = -1;
+	int ret;
+
+	ret = split_address(address, false, &buf, &host, &port);
+	if (ret)
+		return ret;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	FREE(buf);
+	if (ret) {
+		ERROR("Can't resolve compression worker address \"%s\": %s",
+		      address, gai_strerror(ret));
+		return WIMLIB_ERR_COMPRESSION_WORKER;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0)
+			continue;
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	if (sock < 0) {
+		ERROR_WITH_ERRNO("Can't connect to compression worker \"%s\"",
+				 address);
+		return WIMLIB_ERR_COMPRESSION_WORKER;
+	}
+
+	set_socket_options(sock);
+	*sock_ret = sock;
+	return 0;
+}
+
+/*
+ * Connect to the compression worker at @address, which is HOST:PORT, and ask it
+ * to compress chunks of type @ctype and up to @chunk_size bytes, keeping the
+ * smallest output of the compression levels @levels.  On success, the number of
+ * threads the worker has is returned in *num_threads_ret.
+ */
+int
+remote_compressor_connect(const tchar *address, int ctype, u32 chunk_size,
+			  const unsigned levels[], unsigned num_levels,
+			  struct remote_compressor **rc_ret,
+			  unsigned *num_threads_ret)
+{
+	struct remote_compressor *rc;
+	u32 status, num_threads;
+	int ret;
+
+	rc = CALLOC(1, sizeof(*rc));
+	if (rc == NULL)
+		return WIMLIB_ERR_NOMEM;
+	rc->sock = -1;
+	rc->chunk_size = chunk_size;
+
+	ret = wimlib_create_decompressor(ctype, chunk_size, &rc->decompressor);
+	if (ret)
+		goto err;
+	ret = WIMLIB_ERR_NOMEM;
+	rc->verify_buf = MALLOC(chunk_size);
+	if (rc->verify_buf == NULL)
+		goto err;
+
+	ret = connect_to_worker(address, &rc->sock);
+	if (ret)
+		goto err;
+
+	ret = WIMLIB_ERR_COMPRESSION_WORKER;
+	if (!send_u32(rc->sock, WORKER_MAGIC) ||
+	    !send_u32(rc->sock, WORKER_PROTOCOL_VERSION) ||
+	    !send_u32(rc->sock, ctype) ||
+	    !send_u32(rc->sock, chunk_size) ||
+	    !send_u32(rc->sock, num_levels))
+		goto err_io;
+	for (unsigned i = 0; i < num_levels; i++)
+		if (!send_u32(rc->sock,
+			      levels[i] & ~WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE))
+			goto err_io;
+	if (!recv_u32(rc->sock, &status) || !recv_u32(rc->sock, &num_threads))
+		goto err_io;
+	if (status != 0) {
+		ERROR("Compression worker \"%s\" refused the connection: %"TS,
+		      address, wimlib_get_error_string(status));
+		goto err;
+	}
+
+	*rc_ret = rc;
+	*num_threads_ret = max(num_threads, 1);
+	return 0;
+
+err_io:
+	ERROR_WITH_ERRNO("Error communicating with compression worker \"%s\"",
+			 address);
+err:
+	remote_compressor_close(rc);
+	return ret;
+}
+
+/*
+ * Compress the chunk @udata of @usize bytes on the worker.  On success, the
+ * compressed data is written to @cdata, which must have space for @usize - 1
+ * bytes, and its size is returned in *csize_ret, or 0 is returned there if the
+ * chunk didn't compress.  No message is printed on failure, since the caller
+ * can compress the chunk itself instead.
+ */
+int
+remote_compress_chunk(struct remote_compressor *rc, const void *udata,
+		      u32 usize, void *cdata, u32 *csize_ret)
+{
+	u32 csize;
+
+	wimlib_assert(usize > 0 && usize <= rc->chunk_size);
+
+	if (!send_u32(rc->sock, usize) || !send_all(rc->sock, udata, usize) ||
+	    !recv_u32(rc->sock, &csize) || csize >= usize)
+		return WIMLIB_ERR_COMPRESSION_WORKER;
+	if (csize != 0) {
+		if (!recv_all(rc->sock, cdata, csize) ||
+		    wimlib_decompress(cdata, csize, rc->verify_buf, usize,
+				      rc->decompressor) ||
+		    memcmp(rc->verify_buf, udata, usize))
+			return WIMLIB_ERR_COMPRESSION_WORKER;
+	}
+	*csize_ret = csize;
+	return 0;
+}
+
+void
+remote_compressor_close(struct remote_compressor *rc)
+{
+	if (rc == NULL)
+		return;
+	if (rc->sock >= 0) {
+		send_u32(rc->sock, 0);
+		close(rc->sock);
+	}
+	wimlib_free_decompressor(rc->decompressor);
+	FREE(rc->verify_buf);
+	FREE(rc);
+}
+
+/* A connection being served by wimlib_serve_compression_worker()  */
+struct worker_connection {
+	int sock;
+	u32 num_threads;
+	struct thread thread;
+	bool done;
+	struct list_head list;
+};
+
+static int
+start_worker_session(int sock, u32 *chunk_size_ret,
+		     struct wimlib_compressor *compressors[],
+		     unsigned *num_compressors_ret)
+{
+	u32 hello[5];
+	u32 levels[MAX_COMPRESSION_CANDIDATES];
+	u32 num_levels;
+	int ret;
+
+	for (int i = 0; i < ARRAY_LEN(hello); i++)
+		if (!recv_u32(sock, &hello[i]))
+			return -1;
+	if (hello[0] != WORKER_MAGIC)
+		return -1;
+	if (hello[1] != WORKER_PROTOCOL_VERSION)
+		return WIMLIB_ERR_UNSUPPORTED;
+	/* The chunk size decides how much memory the session allocates, so
+	 * only accept chunk sizes that a WIM file can actually use.  */
+	if (hello[2] == WIMLIB_COMPRESSION_TYPE_NONE ||
+	    !wim_compression_type_valid(hello[2]))
+		return WIMLIB_ERR_INVALID_COMPRESSION_TYPE;
+	if (hello[3] == 0 || !wim_chunk_size_valid(hello[3], hello[2]))
+		return WIMLIB_ERR_INVALID_CHUNK_SIZE;
+	num_levels = hello[4];
+	if (num_levels < 1 || num_levels > MAX_COMPRESSION_CANDIDATES)
+		return WIMLIB_ERR_INVALID_PARAM;
+	for (u32 i = 0; i < num_levels; i++)
+		if (!recv_u32(sock, &levels[i]))
+			return -1;
+
+	for (u32 i = 0; i < num_levels; i++) {
+		unsigned level = levels[i] & ~WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+
+		/* Only the last compressor can be destructive.  */
+		if (i == num_levels - 1)
+			level |= WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+		ret = wimlib_create_compressor(hello[2], hello[3], level,
+					       &compressors[i]);
+		if (ret)
+			return ret;
+		*num_compressors_ret = i + 1;
+	}
+	*chunk_size_ret = hello[3];
+	return 0;
+}
+
+static void *
+serve_connection(void *arg)
+{
+	struct worker_connection *conn = arg;
+	struct wimlib_compressor *compressors[MAX_COMPRESSION_CANDIDATES];
+	unsigned num_compressors = 0;
+	u32 chunk_size = 0;
+	u8 *udata = NULL, *cdata = NULL, *scratch = NULL;
+	u32 usize, csize;
+	int ret;
+
+	ret = start_worker_session(conn->sock, &chunk_size, compressors,
+				   &num_compressors);
+	if (ret < 0)
+		goto out;
+	if (ret == 0) {
+		udata = MALLOC(chunk_size);
+		cdata = MALLOC(chunk_size - 1);
+		if (num_compressors > 1)
+			scratch = MALLOC(chunk_size - 1);
+		if (!udata || !cdata || (num_compressors > 1 && !scratch))
+			ret = WIMLIB_ERR_NOMEM;
+	}
+	if (!send_u32(conn->sock, ret) ||
+	    !send_u32(conn->sock, conn->num_threads) || ret)
+		goto out;
+
+	while (recv_u32(conn->sock, &usize) && usize != 0 &&
+	       usize <= chunk_size && recv_all(conn->sock, udata, usize))
+	{
+		csize = compress_chunk_best_of(udata, usize, &cdata, &scratch,
+					       compressors, num_compressors);
+		if (!send_u32(conn->sock, csize) ||
+		    !send_all(conn->sock, cdata, csize))
+			break;
+	}
+out:
+	for (unsigned i = 0; i < num_compressors; i++)
+		wimlib_free_compressor(compressors[i]);
+	FREE(udata);
+	FREE(cdata);
+	FREE(scratch);
+	close(conn->sock);
+	__atomic_store_n(&conn->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* Join the threads of the connections that have ended.  Returns the number of
+ * connections still being served.  */
+static unsigned
+reap_connections(struct list_head *connections, bool all)
+{
+	struct worker_connection *conn, *tmp;
+	unsigned num_active = 0;
+
+	list_for_each_entry_safe(conn, tmp, connections, list) {
+		if (all || __atomic_load_n(&conn->done, __ATOMIC_ACQUIRE)) {
+			thread_join(&conn->thread);
+			list_del(&conn->list);
+			FREE(conn);
+		} else {
+			num_active++;
+		}
+	}
+	return num_active;
+}
+
+static int
+listen_on(const char *address, int *sock_ret)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *res, *ai;
+	char *buf;
+	const char *host, *port;
+	int one = 1;
+	int sock = -1;
+	int ret;
+
+	ret = split_address(address, true, &buf, &host, &port);
+	if (ret)
+		return ret;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	FREE(buf);
+	if (ret) {
+		ERROR("Can't resolve address \"%s\": %s",
+		      address, gai_strerror(ret));
+		return WIMLIB_ERR_INVALID_PARAM;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0)
+			continue;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(sock, 16) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	if (sock < 0) {
+		ERROR_WITH_ERRNO("Can't listen on \"%s\"", address);
+		return WIMLIB_ERR_COMPRESSION_WORKER;
+	}
+	*sock_ret = sock;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_serve_compression_worker(const tchar *address, unsigned num_threads)
+{
+	LIST_HEAD(connections);
+	struct worker_connection *conn;
+	unsigned max_sessions;
+	int listen_sock;
+	int sock;
+	int ret;
+
+	if (address == NULL)
+		return WIMLIB_ERR_INVALID_PARAM;
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	max_sessions = num_threads * WORKER_MAX_SESSIONS_PER_THREAD;
+
+	ret = listen_on(address, &listen_sock);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		sock = accept(listen_sock, NULL, NULL);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			ERROR_WITH_ERRNO("Error accepting connection");
+			ret = WIMLIB_ERR_COMPRESSION_WORKER;
+			break;
+		}
+		/* Turn away connections beyond the limit.  The client sees
+		 * the connection fail, and makes do with the ones it has.  */
+		if (reap_connections(&connections, false) >= max_sessions) {
+			close(sock);
+			continue;
+		}
+
+		conn = CALLOC(1, sizeof(*conn));
+		if (conn == NULL) {
+			close(sock);
+			continue;
+		}
+		set_socket_options(sock);
+		conn->sock = sock;
+		conn->num_threads = num_threads;
+		if (!thread_create(&conn->thread, serve_connection, conn)) {
+			close(sock);
+			FREE(conn);
+			continue;
+		}
+		list_add_tail(&conn->list, &connections);
+	}
+	reap_connections(&connections, true);
+	close(listen_sock);
+	return ret;
+}
+
+#else /* !_WIN32 */
+
+#include "wimlib/compress_remote.h"
+
+int
+remote_compressor_connect(const tchar *address, int ctype, u32 chunk_size,
+			  const unsigned levels[], unsigned num_levels,
+			  struct remote_compressor **rc_ret,
+			  unsigned *num_threads_ret)
+{
+	return WIMLIB_ERR_UNSUPPORTED;
+}
+
+int
+remote_compress_chunk(struct remote_compressor *rc, const void *udata,
+		      u32 usize, void *cdata, u32 *csize_ret)
+{
+	return WIMLIB_ERR_UNSUPPORTED;
+}
+
+void
+remote_compressor_close(struct remote_compressor *rc)
+{
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_serve_compression_worker(const tchar *address, unsigned num_threads)
+{
+	return WIMLIB_ERR_UNSUPPORTED;
+}
+
+#endif /* _WIN32 */
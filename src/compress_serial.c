@@ -30,13 +30,22 @@
 #include "wimlib.h"
 #include "wimlib/assert.h"
 #include "wimlib/chunk_compressor.h"
+#include "wimlib/compress_common.h"
+#include "wimlib/compressor_ops.h"
+#include "wimlib/stats.h"
+#include "wimlib/thread_pool.h"
 #include "wimlib/util.h"
 
 struct serial_chunk_compressor {
 	struct chunk_compressor base;
-	struct wimlib_compressor *compressor;
+	struct wimlib_compressor *compressors[MAX_COMPRESSION_CANDIDATES];
+	unsigned levels[MAX_COMPRESSION_CANDIDATES];
+	unsigned num_compressors;
+	struct wimlib_thread_pool *pool;
 	u8 *udata;
 	u8 *cdata;
+	u8 *scratch;
+	struct incompressible_probe *probe;
 	u32 usize;
 	u8 *result_data;
 	u32 result_size;
@@ -50,9 +59,28 @@ serial_chunk_compressor_destroy(struct chunk_compressor *_ctx)
 	if (ctx == NULL)
 		return;
 
-	wimlib_free_compressor(ctx->compressor);
+	for (unsigned i = 0; i < ctx->num_compressors; i++) {
+		if (ctx->pool)
+			thread_pool_put_compressor(ctx->pool,
+						   ctx->base.out_ctype,
+						   ctx->base.out_chunk_size,
+						   ctx->levels[i],
+						   ctx->compressors[i]);
+		else
+			wimlib_free_compressor(ctx->compressors[i]);
+	}
+	if (ctx->pool)
+		thread_pool_put(ctx->pool);
+	if (ctx->udata)
+		MEM_FREED(compressor, ctx->base.out_chunk_size);
+	if (ctx->cdata)
+		MEM_FREED(compressor, ctx->base.out_chunk_size - 1);
+	if (ctx->scratch)
+		MEM_FREED(compressor, ctx->base.out_chunk_size - 1);
 	FREE(ctx->udata);
 	FREE(ctx->cdata);
+	FREE(ctx->scratch);
+	FREE(ctx->probe);
 	FREE(ctx);
 }
 
@@ -76,8 +104,13 @@ serial_chunk_compressor_signal_chunk_filled(struct chunk_compressor *_ctx, u32 u
 	wimlib_assert(usize <= ctx->base.out_chunk_size);
 
 	ctx->usize = usize;
-	csize = wimlib_compress(ctx->udata, usize, ctx->cdata, usize - 1,
-				ctx->compressor);
+	if (ctx->probe &&
+	    chunk_looks_incompressible(ctx->probe, ctx->udata, usize))
+		csize = 0;
+	else
+		csize = compress_chunk_best_of(ctx->udata, usize, &ctx->cdata,
+					       &ctx->scratch, ctx->compressors,
+					       ctx->num_compressors);
 	if (csize) {
 		ctx->result_data = ctx->cdata;
 		ctx->result_size = csize;
@@ -105,11 +138,24 @@ serial_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 	return true;
 }
 
+/*
+ * Create a chunk compressor that compresses chunks on the calling thread.  If
+ * @multi_candidate is true, each chunk is compressed at several compression
+ * levels and the smallest output is kept.
+ *
+ * If @pool is not NULL, the compressors are taken from, and given back to, that
+ * pool's cache of idle compressors, so that they can be shared with other chunk
+ * compressors using the same pool.  No work is submitted to the pool.
+ */
 int
 new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
+			    struct wimlib_thread_pool *pool,
+			    bool multi_candidate,
 			    struct chunk_compressor **compressor_ret)
 {
 	struct serial_chunk_compressor *ctx;
+	unsigned *levels;
+	unsigned num_levels;
 	int ret;
 
 	wimlib_assert(out_chunk_size > 0);
@@ -126,15 +172,67 @@ new_serial_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	ctx->base.signal_chunk_filled = serial_chunk_compressor_signal_chunk_filled;
 	ctx->base.get_compression_result = serial_chunk_compressor_get_compression_result;
 
-	ret = wimlib_create_compressor(out_ctype, out_chunk_size,
-				       WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE,
-				       &ctx->compressor);
-	if (ret)
-		goto err;
+	if (pool) {
+		thread_pool_get(pool);
+		ctx->pool = pool;
+	}
+
+	/* Only the last compressor can be destructive.  The default level is
+	 * spelled out, as the parallel chunk compressor does, so that cached
+	 * compressors match regardless of which kind of chunk compressor
+	 * created them.  */
+	levels = ctx->levels;
+	if (multi_candidate) {
+		num_levels = get_candidate_compression_levels(out_ctype, levels);
+	} else {
+		levels[0] = get_default_compression_level(out_ctype);
+		num_levels = 1;
+	}
+	levels[num_levels - 1] |= WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE;
+
+	for (; ctx->num_compressors < num_levels; ctx->num_compressors++) {
+		struct wimlib_compressor **c =
+			&ctx->compressors[ctx->num_compressors];
+
+		if (pool)
+			ret = thread_pool_get_compressor(pool, out_ctype,
+							 out_chunk_size,
+							 levels[ctx->num_compressors],
+							 c);
+		else
+			ret = wimlib_create_compressor(out_ctype,
+						       out_chunk_size,
+						       levels[ctx->num_compressors],
+						       c);
+		if (ret)
+			goto err;
+	}
 
 	ctx->udata = MALLOC(out_chunk_size);
+	if (ctx->udata)
+		MEM_ALLOCATED(compressor, out_chunk_size);
 	ctx->cdata = MALLOC(out_chunk_size - 1);
-	if (ctx->udata == NULL || ctx->cdata == NULL) {
+	if (ctx->cdata)
+		MEM_ALLOCATED(compressor, out_chunk_size - 1);
+	if (num_levels > 1) {
+		ctx->scratch = MALLOC(out_chunk_size - 1);
+		if (ctx->scratch)
+			MEM_ALLOCATED(compressor, out_chunk_size - 1);
+	}
+	/* Only look for incompressible chunks at the fast levels.  */
+	if (num_levels == 1 &&
+	    (levels[0] & ~WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE) <=
+	    MAX_INCOMPRESSIBLE_PROBE_LEVEL)
+	{
+		ctx->probe = MALLOC(sizeof(*ctx->probe));
+		if (ctx->probe == NULL) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto err;
+		}
+	}
+	if (ctx->udata == NULL || ctx->cdata == NULL ||
+	    (num_levels > 1 && ctx->scratch == NULL))
+	{
 		ret = WIMLIB_ERR_NOMEM;
 		goto err;
 	}
@@ -0,0 +1,493 @@
+/*
+ * compress_stream.c
+ *
+ * Compression of arbitrarily large streams of data, outside of WIM files, into
+ * a simple seekable format made of independently compressed chunks.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * The format of a compressed stream is:
+ *
+ *	header			(struct stream_header_disk)
+ *	chunk data		(one entry per chunk)
+ *	chunk table		(one le32 compressed size per chunk)
+ *	footer			(struct stream_footer_disk)
+ *
+ * Every chunk except the last has an uncompressed size of exactly the chunk
+ * size given in the header.  As in WIM resources, a chunk whose compressed size
+ * is equal to its uncompressed size is stored uncompressed.  Since the chunk
+ * table and footer are at the end, the stream can be written in one pass, and
+ * a reader can locate any chunk after reading just the footer and the table.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/chunk_compressor.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/util.h"
+
+#define STREAM_MAGIC		"WLZSTRM1"
+#define STREAM_MAGIC_LEN	8
+
+struct stream_header_disk {
+	u8 magic[STREAM_MAGIC_LEN];
+	le32 ctype;
+	le32 chunk_size;
+} __attribute__((packed));
+
+struct stream_footer_disk {
+	le64 uncompressed_size;
+	le64 num_chunks;
+	u8 magic[STREAM_MAGIC_LEN];
+} __attribute__((packed));
+
+struct wimlib_stream_compressor {
+	struct chunk_compressor *compressor;
+	wimlib_stream_write_func_t write_func;
+	void *write_ctx;
+
+	/* Chunk buffer currently borrowed from the chunk compressor, or NULL  */
+	u8 *chunk_buf;
+	u32 chunk_buf_filled;
+
+	u64 uncompressed_size;
+
+	/* Compressed size of each chunk written so far  */
+	le32 *chunk_csizes;
+	size_t num_chunks;
+	size_t num_alloc_chunks;
+
+	/* Once a call fails, all later calls fail with the same error.  */
+	int status;
+	bool finished;
+};
+
+struct wimlib_compressed_stream {
+	wimlib_stream_read_func_t read_func;
+	void *read_ctx;
+	struct wimlib_decompressor *decompressor;
+	u32 chunk_size;
+	u64 uncompressed_size;
+	u64 num_chunks;
+
+	/* Offset in the compressed stream of each chunk, plus the offset of the
+	 * end of the last chunk  */
+	u64 *chunk_offsets;
+
+	/* The most recently decompressed chunk, so that sequential reads don't
+	 * decompress each chunk more than once  */
+	u8 *ubuf;
+	u8 *cbuf;
+	u64 cached_chunk;
+};
+
+static int
+stream_write(struct wimlib_stream_compressor *c, const void *data, size_t size)
+{
+	int ret = (*c->write_func)(data, size, c->write_ctx);
+
+	if (ret)
+		c->status = ret;
+	return ret;
+}
+
+/* Write the next compressed chunk and record its size.  */
+static int
+write_chunk(struct wimlib_stream_compressor *c, const void *cdata, u32 csize)
+{
+	if (c->num_chunks == c->num_alloc_chunks) {
+		size_t new_num_alloc = max(c->num_alloc_chunks * 2, 64);
+		le32 *new_csizes = REALLOC(c->chunk_csizes,
+					   new_num_alloc * sizeof(le32));
+		if (!new_csizes)
+			return c->status = WIMLIB_ERR_NOMEM;
+		c->chunk_csizes = new_csizes;
+		c->num_alloc_chunks = new_num_alloc;
+	}
+	c->chunk_csizes[c->num_chunks++] = cpu_to_le32(csize);
+	return stream_write(c, cdata, csize);
+}
+
+/* Borrow a chunk buffer from the chunk compressor, writing compressed chunks as
+ * needed to free one up.  */
+static int
+prepare_chunk_buffer(struct wimlib_stream_compressor *c)
+{
+	while (!(c->chunk_buf = c->compressor->get_chunk_buffer(c->compressor)))
+	{
+		const void *cdata;
+		u32 csize;
+		u32 usize;
+		int ret;
+
+		if (!c->compressor->get_compression_result(c->compressor, &cdata,
+							   &csize, &usize))
+			return c->status = WIMLIB_ERR_NOMEM;
+		ret = write_chunk(c, cdata, csize);
+		if (ret)
+			return ret;
+	}
+	c->chunk_buf_filled = 0;
+	return 0;
+}
+
+WIMLIBAPI int
+wimlib_create_stream_compressor(enum wimlib_compression_type ctype,
+				uint32_t chunk_size, unsigned num_threads,
+				wimlib_stream_write_func_t write_func,
+				void *write_ctx,
+				struct wimlib_stream_compressor **compressor_ret)
+{
+	struct wimlib_stream_compressor *c;
+	struct stream_header_disk hdr;
+	int ret;
+
+	if (!write_func || !compressor_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (ctype != WIMLIB_COMPRESSION_TYPE_XPRESS &&
+	    ctype != WIMLIB_COMPRESSION_TYPE_LZX &&
+	    ctype != WIMLIB_COMPRESSION_TYPE_LZMS)
+		return WIMLIB_ERR_INVALID_COMPRESSION_TYPE;
+
+	if (chunk_size == 0 ||
+	    wimlib_get_compressor_needed_memory(ctype, chunk_size, 0) == 0)
+		return WIMLIB_ERR_INVALID_CHUNK_SIZE;
+
+	c = CALLOC(1, sizeof(*c));
+	if (!c)
+		return WIMLIB_ERR_NOMEM;
+	c->write_func = write_func;
+	c->write_ctx = write_ctx;
+
+	/* As when writing a WIM file, prefer the parallel chunk compressor, but
+	 * fall back to the serial one if there is only one thread or the
+	 * parallel one can't be created.  */
+	if (num_threads != 1) {
+		ret = new_parallel_chunk_compressor(ctype, chunk_size,
+						    num_threads, NULL, 0,
+						    false, 0, &c->compressor);
+		if (ret > 0) {
+			WARNING("Couldn't create parallel chunk compressor: %"TS".\n"
+				"          Falling back to single-threaded compression.",
+				wimlib_get_error_string(ret));
+		}
+	}
+	if (!c->compressor) {
+		ret = new_serial_chunk_compressor(ctype, chunk_size, NULL, false,
+						  &c->compressor);
+		if (ret)
+			goto err;
+	}
+
+	memcpy(hdr.magic, STREAM_MAGIC, STREAM_MAGIC_LEN);
+	hdr.ctype = cpu_to_le32(ctype);
+	hdr.chunk_size = cpu_to_le32(chunk_size);
+	ret = stream_write(c, &hdr, sizeof(hdr));
+	if (ret)
+		goto err;
+
+	*compressor_ret = c;
+	return 0;
+
+err:
+	wimlib_free_stream_compressor(c);
+	return ret;
+}
+
+WIMLIBAPI int
+wimlib_stream_compress(struct wimlib_stream_compressor *c,
+		       const void *data, size_t size)
+{
+	const u8 *p = data;
+	u32 chunk_size;
+	int ret;
+
+	if (c->status)
+		return c->status;
+	if (c->finished)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	chunk_size = c->compressor->out_chunk_size;
+	while (size) {
+		u32 n;
+
+		if (!c->chunk_buf) {
+			ret = prepare_chunk_buffer(c);
+			if (ret)
+				return ret;
+		}
+		n = min(size, chunk_size - c->chunk_buf_filled);
+		memcpy(&c->chunk_buf[c->chunk_buf_filled], p, n);
+		c->chunk_buf_filled += n;
+		c->uncompressed_size += n;
+		p += n;
+		size -= n;
+		if (c->chunk_buf_filled == chunk_size) {
+			c->compressor->signal_chunk_filled(c->compressor,
+							   chunk_size);
+			c->chunk_buf = NULL;
+		}
+	}
+	return 0;
+}
+
+WIMLIBAPI int
+wimlib_finish_stream_compressor(struct wimlib_stream_compressor *c)
+{
+	struct stream_footer_disk footer;
+	const void *cdata;
+	u32 csize;
+	u32 usize;
+	int ret;
+
+	if (c->status)
+		return c->status;
+	if (c->finished)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (c->chunk_buf) {
+		if (c->chunk_buf_filled)
+			c->compressor->signal_chunk_filled(c->compressor,
+							   c->chunk_buf_filled);
+		c->chunk_buf = NULL;
+	}
+	while (c->compressor->get_compression_result(c->compressor, &cdata,
+						     &csize, &usize))
+	{
+		ret = write_chunk(c, cdata, csize);
+		if (ret)
+			return ret;
+	}
+
+	ret = stream_write(c, c->chunk_csizes,
+			   c->num_chunks * sizeof(c->chunk_csizes[0]));
+	if (ret)
+		return ret;
+
+	footer.uncompressed_size = cpu_to_le64(c->uncompressed_size);
+	footer.num_chunks = cpu_to_le64(c->num_chunks);
+	memcpy(footer.magic, STREAM_MAGIC, STREAM_MAGIC_LEN);
+	ret = stream_write(c, &footer, sizeof(footer));
+	if (ret)
+		return ret;
+
+	c->finished = true;
+	return 0;
+}
+
+WIMLIBAPI void
+wimlib_free_stream_compressor(struct wimlib_stream_compressor *c)
+{
+	if (!c)
+		return;
+	if (c->compressor)
+		c->compressor->destroy(c->compressor);
+	FREE(c->chunk_csizes);
+	FREE(c);
+}
+
+static int
+stream_read(struct wimlib_compressed_stream *s, void *buf, size_t size,
+	    u64 offset)
+{
+	return (*s->read_func)(buf, size, offset, s->read_ctx);
+}
+
+WIMLIBAPI int
+wimlib_open_compressed_stream(wimlib_stream_read_func_t read_func,
+			      void *read_ctx, uint64_t compressed_size,
+			      struct wimlib_compressed_stream **stream_ret)
+{
+	struct wimlib_compressed_stream *s;
+	struct stream_header_disk hdr;
+	struct stream_footer_disk footer;
+	enum wimlib_compression_type ctype;
+	le32 *csizes = NULL;
+	u64 table_offset;
+	u64 offset;
+	int ret;
+
+	if (!read_func || !stream_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if (compressed_size < sizeof(hdr) + sizeof(footer))
+		return WIMLIB_ERR_UNEXPECTED_END_OF_FILE;
+
+	s = CALLOC(1, sizeof(*s));
+	if (!s)
+		return WIMLIB_ERR_NOMEM;
+	s->read_func = read_func;
+	s->read_ctx = read_ctx;
+	s->cached_chunk = UINT64_MAX;
+
+	ret = stream_read(s, &hdr, sizeof(hdr), 0);
+	if (ret)
+		goto out;
+	ret = stream_read(s, &footer, sizeof(footer),
+			  compressed_size - sizeof(footer));
+	if (ret)
+		goto out;
+
+	ret = WIMLIB_ERR_NOT_A_WIM_FILE;
+	if (memcmp(hdr.magic, STREAM_MAGIC, STREAM_MAGIC_LEN) ||
+	    memcmp(footer.magic, STREAM_MAGIC, STREAM_MAGIC_LEN))
+		goto out;
+
+	ctype = le32_to_cpu(hdr.ctype);
+	s->chunk_size = le32_to_cpu(hdr.chunk_size);
+	s->uncompressed_size = le64_to_cpu(footer.uncompressed_size);
+	s->num_chunks = le64_to_cpu(footer.num_chunks);
+
+	ret = WIMLIB_ERR_INVALID_CHUNK_SIZE;
+	if (s->chunk_size == 0)
+		goto out;
+
+	ret = wimlib_create_decompressor(ctype, s->chunk_size,
+					 &s->decompressor);
+	if (ret)
+		goto out;
+
+	/* The chunk table must fit between the header and the footer, and the
+	 * number of chunks must match the uncompressed size.  */
+	ret = WIMLIB_ERR_INVALID_HEADER;
+	if (s->num_chunks > (compressed_size - sizeof(hdr) - sizeof(footer)) /
+			    sizeof(le32) ||
+	    s->num_chunks != DIV_ROUND_UP(s->uncompressed_size, s->chunk_size))
+		goto out;
+	table_offset = compressed_size - sizeof(footer) -
+		       s->num_chunks * sizeof(le32);
+
+	ret = WIMLIB_ERR_NOMEM;
+	csizes = MALLOC(s->num_chunks * sizeof(le32));
+	s->chunk_offsets = MALLOC((s->num_chunks + 1) * sizeof(u64));
+	s->ubuf = MALLOC(s->chunk_size);
+	s->cbuf = MALLOC(s->chunk_size);
+	if (!csizes || !s->chunk_offsets || !s->ubuf || !s->cbuf)
+		goto out;
+
+	ret = stream_read(s, csizes, s->num_chunks * sizeof(le32),
+			  table_offset);
+	if (ret)
+		goto out;
+
+	ret = WIMLIB_ERR_INVALID_HEADER;
+	offset = sizeof(hdr);
+	for (u64 i = 0; i < s->num_chunks; i++) {
+		u32 csize = le32_to_cpu(csizes[i]);
+
+		if (csize == 0 || csize > s->chunk_size)
+			goto out;
+		s->chunk_offsets[i] = offset;
+		offset += csize;
+	}
+	s->chunk_offsets[s->num_chunks] = offset;
+	if (offset != table_offset)
+		goto out;
+
+	*stream_ret = s;
+	s = NULL;
+	ret = 0;
+out:
+	FREE(csizes);
+	wimlib_close_compressed_stream(s);
+	return ret;
+}
+
+WIMLIBAPI uint64_t
+wimlib_get_compressed_stream_size(const struct wimlib_compressed_stream *s)
+{
+	return s->uncompressed_size;
+}
+
+/* Decompress the specified chunk into s->ubuf, unless it's already there.  */
+static int
+load_chunk(struct wimlib_compressed_stream *s, u64 chunk_idx)
+{
+	u64 offset = s->chunk_offsets[chunk_idx];
+	u32 csize = s->chunk_offsets[chunk_idx + 1] - offset;
+	u32 usize = min(s->chunk_size,
+			s->uncompressed_size - chunk_idx * s->chunk_size);
+	int ret;
+
+	if (chunk_idx == s->cached_chunk)
+		return 0;
+	s->cached_chunk = UINT64_MAX;
+
+	if (csize > usize)
+		return WIMLIB_ERR_INVALID_HEADER;
+	if (csize == usize) {
+		ret = stream_read(s, s->ubuf, usize, offset);
+		if (ret)
+			return ret;
+	} else {
+		ret = stream_read(s, s->cbuf, csize, offset);
+		if (ret)
+			return ret;
+		if (wimlib_decompress(s->cbuf, csize, s->ubuf, usize,
+				      s->decompressor))
+			return WIMLIB_ERR_DECOMPRESSION;
+	}
+	s->cached_chunk = chunk_idx;
+	return 0;
+}
+
+WIMLIBAPI int
+wimlib_read_compressed_stream(struct wimlib_compressed_stream *s,
+			      uint64_t offset, void *buf, size_t size)
+{
+	u8 *p = buf;
+
+	if (offset > s->uncompressed_size ||
+	    size > s->uncompressed_size - offset)
+		return WIMLIB_ERR_UNEXPECTED_END_OF_FILE;
+
+	while (size) {
+		u64 chunk_idx = offset / s->chunk_size;
+		u32 offset_in_chunk = offset % s->chunk_size;
+		u32 n = min(size, s->chunk_size - offset_in_chunk);
+		int ret;
+
+		ret = load_chunk(s, chunk_idx);
+		if (ret)
+			return ret;
+		memcpy(p, &s->ubuf[offset_in_chunk], n);
+		p += n;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+WIMLIBAPI void
+wimlib_close_compressed_stream(struct wimlib_compressed_stream *s)
+{
+	if (!s)
+		return;
+	wimlib_free_decompressor(s->decompressor);
+	FREE(s->chunk_offsets);
+	FREE(s->ubuf);
+	FREE(s->cbuf);
+	FREE(s);
+}
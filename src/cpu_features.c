@@ -110,6 +110,8 @@ get_cpu_features(void)
 
 	/* EAX=7, ECX=0: Extended Features */
 	cpuid(7, 0, &a, &b, &c, &d);
+	if ((b & (1 << 5)) && (features & X86_CPU_FEATURE_AVX))
+		features |= X86_CPU_FEATURE_AVX2;
 	if (b & (1 << 8))
 		features |= X86_CPU_FEATURE_BMI2;
 	if (b & (1 << 29))
@@ -253,6 +255,7 @@ static const struct {
 	{"sse4.1",	X86_CPU_FEATURE_SSE4_1},
 	{"sse4.2",	X86_CPU_FEATURE_SSE4_2},
 	{"avx",		X86_CPU_FEATURE_AVX},
+	{"avx2",	X86_CPU_FEATURE_AVX2},
 	{"bmi2",	X86_CPU_FEATURE_BMI2},
 	{"sha",		X86_CPU_FEATURE_SHA},
 	{"sha1",	X86_CPU_FEATURE_SHA},
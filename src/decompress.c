@@ -28,6 +28,7 @@
 
 #include "wimlib.h"
 #include "wimlib/decompressor_ops.h"
+#include "wimlib/stats.h"
 #include "wimlib/util.h"
 
 struct wimlib_decompressor {
@@ -94,12 +95,19 @@ wimlib_decompress(const void *compressed_data, size_t compressed_size,
 		  void *uncompressed_data, size_t uncompressed_size,
 		  struct wimlib_decompressor *dec)
 {
+	u64 start;
+	int ret;
+
 	if (unlikely(uncompressed_size > dec->max_block_size))
 		return -2;
 
-	return dec->ops->decompress(compressed_data, compressed_size,
-				    uncompressed_data, uncompressed_size,
-				    dec->private);
+	start = stats_now_ns();
+	ret = dec->ops->decompress(compressed_data, compressed_size,
+				   uncompressed_data, uncompressed_size,
+				   dec->private);
+	STATS_ADD_ELAPSED(decompress_ns, start);
+	STATS_ADD(decompress_out_bytes, uncompressed_size);
+	return ret;
 }
 
 WIMLIBAPI void
@@ -33,12 +33,54 @@
 
 #include <string.h>
 
-#ifdef __SSE2__
-#  include <emmintrin.h>
+#if defined(__i386__) || defined(__x86_64__)
+#  include <immintrin.h>
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
 #endif
 
+#include "wimlib/cpu_features.h"
 #include "wimlib/decompress_common.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * Fill root table entries one 256-bit vector (16 entries) at a time with AVX2.
+ * This handles the codeword lengths for which each codeword has at least 16
+ * entries, i.e. the first part of the loop nest in make_huffman_decode_table(),
+ * and advances '*entry_ptr_p', '*sym_idx_p', and '*codeword_len_p' accordingly.
+ */
+#define HAVE_FILL_ENTRIES_AVX2
+static void __attribute__((target("avx2")))
+fill_entries_avx2(void **entry_ptr_p, unsigned *sym_idx_p,
+		  unsigned *codeword_len_p, unsigned table_bits,
+		  const u16 len_counts[], const u16 sorted_syms[])
+{
+	void *entry_ptr = *entry_ptr_p;
+	unsigned sym_idx = *sym_idx_p;
+	unsigned codeword_len = *codeword_len_p;
+
+	for (unsigned stores_per_loop = (1U << (table_bits - codeword_len)) /
+				    (sizeof(__m256i) / sizeof(u16));
+	     stores_per_loop != 0; codeword_len++, stores_per_loop >>= 1)
+	{
+		unsigned end_sym_idx = sym_idx + len_counts[codeword_len];
+		for (; sym_idx < end_sym_idx; sym_idx++) {
+			__m256i v = _mm256_set1_epi16(
+				MAKE_DECODE_TABLE_ENTRY(sorted_syms[sym_idx],
+							codeword_len));
+			unsigned n = stores_per_loop;
+			do {
+				_mm256_store_si256(entry_ptr, v);
+				entry_ptr += sizeof(v);
+			} while (--n);
+		}
+	}
+	*entry_ptr_p = entry_ptr;
+	*sym_idx_p = sym_idx;
+	*codeword_len_p = codeword_len;
+}
+#endif /* x86 */
+
 /*
  * make_huffman_decode_table() -
  *
@@ -194,35 +236,50 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 	 * The table will start with entries for the shortest codeword(s), which
 	 * will have the most entries.  From there, the number of entries per
 	 * codeword will decrease.  As an optimization, we may begin filling
-	 * entries with SSE2 vector accesses (8 entries/store), then change to
-	 * word accesses (2 or 4 entries/store), then change to 16-bit accesses
-	 * (1 entry/store).
+	 * entries with AVX2 vector accesses (16 entries/store) if the CPU
+	 * supports them, then change to SSE2 or NEON vector accesses (8
+	 * entries/store), then change to word accesses (2 or 4 entries/store),
+	 * then change to 16-bit accesses (1 entry/store).
 	 */
 	sym_idx = offsets[0];
 
-#ifdef __SSE2__
+#ifdef HAVE_FILL_ENTRIES_AVX2
+	if (cpu_features & X86_CPU_FEATURE_AVX2)
+		fill_entries_avx2(&entry_ptr, &sym_idx, &codeword_len,
+				  table_bits, len_counts, sorted_syms);
+#endif
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
 	/* Fill entries one 128-bit vector (8 entries) at a time. */
 	for (unsigned stores_per_loop = (1U << (table_bits - codeword_len)) /
-				    (sizeof(__m128i) / sizeof(decode_table[0]));
+				    (16 / sizeof(decode_table[0]));
 	     stores_per_loop != 0; codeword_len++, stores_per_loop >>= 1)
 	{
 		unsigned end_sym_idx = sym_idx + len_counts[codeword_len];
 		for (; sym_idx < end_sym_idx; sym_idx++) {
+			u16 e = MAKE_DECODE_TABLE_ENTRY(sorted_syms[sym_idx],
+							codeword_len);
+		#ifdef __SSE2__
 			/* Note: unlike in the "word" version below, the __m128i
 			 * type already has __attribute__((may_alias)), so using
 			 * it to access an array of u16 will not violate strict
 			 * aliasing.  */
-			__m128i v = _mm_set1_epi16(
-				MAKE_DECODE_TABLE_ENTRY(sorted_syms[sym_idx],
-							codeword_len));
+			__m128i v = _mm_set1_epi16(e);
+		#else
+			uint16x8_t v = vdupq_n_u16(e);
+		#endif
 			unsigned n = stores_per_loop;
 			do {
+			#ifdef __SSE2__
 				*(__m128i *)entry_ptr = v;
+			#else
+				vst1q_u16(entry_ptr, v);
+			#endif
 				entry_ptr += sizeof(v);
 			} while (--n);
 		}
 	}
-#endif /* __SSE2__ */
+#endif /* __SSE2__ || __ARM_NEON */
 
 #ifdef __GNUC__
 	/* Fill entries one word (2 or 4 entries) at a time. */
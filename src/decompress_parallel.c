@@ -0,0 +1,540 @@
+/*
+ * decompress_parallel.c
+ *
+ * Decompress chunks of data (parallel version).
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/assert.h"
+#include "wimlib/chunk_decompressor.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+struct message_queue {
+	struct list_head list;
+	struct mutex lock;
+	struct condvar msg_avail_cond;
+	bool terminating;
+};
+
+struct decompressor_thread_data {
+	struct thread thread;
+	struct message_queue *chunks_to_decompress_queue;
+	struct message_queue *decompressed_chunks_queue;
+	struct wimlib_decompressor *decompressor;
+};
+
+#define MAX_CHUNKS_PER_MSG 16
+
+struct message {
+	u8 *compressed_chunks[MAX_CHUNKS_PER_MSG];
+	u8 *uncompressed_chunks[MAX_CHUNKS_PER_MSG];
+	u32 compressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
+	u32 uncompressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
+	int statuses[MAX_CHUNKS_PER_MSG];
+	int errnos[MAX_CHUNKS_PER_MSG];
+	struct filedes *in_fds[MAX_CHUNKS_PER_MSG];
+	u64 in_offsets[MAX_CHUNKS_PER_MSG];
+	size_t num_filled_chunks;
+	size_t num_alloc_chunks;
+	bool recover_data;
+	struct list_head list;
+	bool complete;
+	struct list_head submission_list;
+};
+
+struct parallel_chunk_decompressor {
+	struct chunk_decompressor base;
+
+	struct message_queue chunks_to_decompress_queue;
+	struct message_queue decompressed_chunks_queue;
+	struct decompressor_thread_data *thread_data;
+	unsigned num_thread_data;
+	unsigned num_started_threads;
+
+	struct message *msgs;
+	size_t num_messages;
+
+	struct list_head available_msgs;
+	struct list_head submitted_msgs;
+	struct message *next_submit_msg;
+	struct message *next_ready_msg;
+	size_t next_chunk_idx;
+};
+
+static int
+message_queue_init(struct message_queue *q)
+{
+	if (!mutex_init(&q->lock))
+		goto err;
+	if (!condvar_init(&q->msg_avail_cond))
+		goto err_destroy_lock;
+	INIT_LIST_HEAD(&q->list);
+	return 0;
+
+err_destroy_lock:
+	mutex_destroy(&q->lock);
+err:
+	return WIMLIB_ERR_NOMEM;
+}
+
+static void
+message_queue_destroy(struct message_queue *q)
+{
+	if (q->list.next != NULL) {
+		mutex_destroy(&q->lock);
+		condvar_destroy(&q->msg_avail_cond);
+	}
+}
+
+static void
+message_queue_put(struct message_queue *q, struct message *msg)
+{
+	mutex_lock(&q->lock);
+	list_add_tail(&msg->list, &q->list);
+	condvar_signal(&q->msg_avail_cond);
+	mutex_unlock(&q->lock);
+}
+
+static struct message *
+message_queue_get(struct message_queue *q)
+{
+	struct message *msg;
+
+	mutex_lock(&q->lock);
+	while (list_empty(&q->list) && !q->terminating)
+		condvar_wait(&q->msg_avail_cond, &q->lock);
+	if (!q->terminating) {
+		msg = list_entry(q->list.next, struct message, list);
+		list_del(&msg->list);
+	} else
+		msg = NULL;
+	mutex_unlock(&q->lock);
+	return msg;
+}
+
+static void
+message_queue_terminate(struct message_queue *q)
+{
+	mutex_lock(&q->lock);
+	q->terminating = true;
+	condvar_broadcast(&q->msg_avail_cond);
+	mutex_unlock(&q->lock);
+}
+
+static int
+init_message(struct message *msg, size_t num_chunks, u32 in_chunk_size)
+{
+	msg->num_alloc_chunks = num_chunks;
+	for (size_t i = 0; i < num_chunks; i++) {
+		msg->compressed_chunks[i] = MALLOC(in_chunk_size);
+		msg->uncompressed_chunks[i] = MALLOC(in_chunk_size);
+		if (msg->compressed_chunks[i] == NULL ||
+		    msg->uncompressed_chunks[i] == NULL)
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+static void
+destroy_message(struct message *msg)
+{
+	for (size_t i = 0; i < msg->num_alloc_chunks; i++) {
+		FREE(msg->compressed_chunks[i]);
+		FREE(msg->uncompressed_chunks[i]);
+	}
+}
+
+static void
+free_messages(struct message *msgs, size_t num_messages)
+{
+	if (msgs) {
+		for (size_t i = 0; i < num_messages; i++)
+			destroy_message(&msgs[i]);
+		FREE(msgs);
+	}
+}
+
+static struct message *
+allocate_messages(size_t count, size_t chunks_per_msg, u32 in_chunk_size)
+{
+	struct message *msgs;
+
+	msgs = CALLOC(count, sizeof(struct message));
+	if (msgs == NULL)
+		return NULL;
+	for (size_t i = 0; i < count; i++) {
+		if (init_message(&msgs[i], chunks_per_msg, in_chunk_size)) {
+			free_messages(msgs, count);
+			return NULL;
+		}
+	}
+	return msgs;
+}
+
+static void
+decompress_chunks(struct message *msg, struct wimlib_decompressor *decompressor)
+{
+	for (size_t i = 0; i < msg->num_filled_chunks; i++) {
+		u32 csize = msg->compressed_chunk_sizes[i];
+		u32 usize = msg->uncompressed_chunk_sizes[i];
+		int status = 0;
+
+		if (msg->in_fds[i]) {
+			/* Read the compressed data first.  */
+			status = full_pread(msg->in_fds[i],
+					    msg->compressed_chunks[i], csize,
+					    msg->in_offsets[i]);
+			if (unlikely(status))
+				ERROR_WITH_ERRNO("Error reading data from WIM file");
+		}
+
+		/* Chunks stored uncompressed need no further processing.  */
+		if (status == 0 && csize != usize) {
+			status = decompress_chunk(msg->compressed_chunks[i],
+						  csize,
+						  msg->uncompressed_chunks[i],
+						  usize, decompressor,
+						  msg->recover_data);
+		}
+		msg->statuses[i] = status;
+		msg->errnos[i] = (status ? errno : 0);
+	}
+}
+
+static void *
+decompressor_thread_proc(void *arg)
+{
+	struct decompressor_thread_data *params = arg;
+	struct message *msg;
+
+	while ((msg = message_queue_get(params->chunks_to_decompress_queue)) != NULL) {
+		decompress_chunks(msg, params->decompressor);
+		message_queue_put(params->decompressed_chunks_queue, msg);
+	}
+	return NULL;
+}
+
+static void
+parallel_chunk_decompressor_destroy(struct chunk_decompressor *_ctx)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	unsigned i;
+
+	if (ctx == NULL)
+		return;
+
+	if (ctx->num_started_threads != 0) {
+		message_queue_terminate(&ctx->chunks_to_decompress_queue);
+
+		for (i = 0; i < ctx->num_started_threads; i++)
+			thread_join(&ctx->thread_data[i].thread);
+	}
+
+	message_queue_destroy(&ctx->chunks_to_decompress_queue);
+	message_queue_destroy(&ctx->decompressed_chunks_queue);
+
+	if (ctx->thread_data != NULL)
+		for (i = 0; i < ctx->num_thread_data; i++)
+			wimlib_free_decompressor(ctx->thread_data[i].decompressor);
+
+	FREE(ctx->thread_data);
+
+	free_messages(ctx->msgs, ctx->num_messages);
+
+	FREE(ctx);
+}
+
+static void
+submit_decompression_msg(struct parallel_chunk_decompressor *ctx)
+{
+	struct message *msg = ctx->next_submit_msg;
+
+	msg->complete = false;
+	msg->recover_data = ctx->base.recover_data;
+	list_add_tail(&msg->submission_list, &ctx->submitted_msgs);
+	message_queue_put(&ctx->chunks_to_decompress_queue, msg);
+	ctx->next_submit_msg = NULL;
+}
+
+static void *
+parallel_chunk_decompressor_get_chunk_buffer(struct chunk_decompressor *_ctx)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+
+	if (ctx->next_submit_msg) {
+		msg = ctx->next_submit_msg;
+	} else {
+		if (list_empty(&ctx->available_msgs))
+			return NULL;
+
+		msg = list_entry(ctx->available_msgs.next, struct message, list);
+		list_del(&msg->list);
+		ctx->next_submit_msg = msg;
+		msg->num_filled_chunks = 0;
+	}
+
+	return msg->compressed_chunks[msg->num_filled_chunks];
+}
+
+static void
+parallel_chunk_decompressor_signal_chunk_filled(struct chunk_decompressor *_ctx,
+						u32 csize, u32 usize)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+
+	wimlib_assert(csize > 0 && csize <= usize);
+	wimlib_assert(usize <= ctx->base.in_chunk_size);
+	wimlib_assert(ctx->next_submit_msg);
+
+	msg = ctx->next_submit_msg;
+	msg->compressed_chunk_sizes[msg->num_filled_chunks] = csize;
+	msg->uncompressed_chunk_sizes[msg->num_filled_chunks] = usize;
+	msg->in_fds[msg->num_filled_chunks] = NULL;
+	if (++msg->num_filled_chunks == msg->num_alloc_chunks)
+		submit_decompression_msg(ctx);
+}
+
+static bool
+parallel_chunk_decompressor_submit_chunk_read(struct chunk_decompressor *_ctx,
+					      struct filedes *in_fd, u64 offset,
+					      u32 csize, u32 usize)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+
+	if (!parallel_chunk_decompressor_get_chunk_buffer(_ctx))
+		return false;
+
+	wimlib_assert(csize > 0 && csize <= usize);
+	wimlib_assert(usize <= ctx->base.in_chunk_size);
+
+	msg = ctx->next_submit_msg;
+	msg->compressed_chunk_sizes[msg->num_filled_chunks] = csize;
+	msg->uncompressed_chunk_sizes[msg->num_filled_chunks] = usize;
+	msg->in_fds[msg->num_filled_chunks] = in_fd;
+	msg->in_offsets[msg->num_filled_chunks] = offset;
+	if (++msg->num_filled_chunks == msg->num_alloc_chunks)
+		submit_decompression_msg(ctx);
+	return true;
+}
+
+static bool
+parallel_chunk_decompressor_get_decompression_result(struct chunk_decompressor *_ctx,
+						     const void **udata_ret,
+						     u32 *usize_ret,
+						     int *status_ret)
+{
+	struct parallel_chunk_decompressor *ctx = (struct parallel_chunk_decompressor *)_ctx;
+	struct message *msg;
+	size_t idx;
+
+	if (ctx->next_submit_msg)
+		submit_decompression_msg(ctx);
+
+	if (ctx->next_ready_msg) {
+		msg = ctx->next_ready_msg;
+	} else {
+		if (list_empty(&ctx->submitted_msgs))
+			return false;
+
+		while (!(msg = list_entry(ctx->submitted_msgs.next,
+					  struct message,
+					  submission_list))->complete)
+			message_queue_get(&ctx->decompressed_chunks_queue)->complete = true;
+
+		ctx->next_ready_msg = msg;
+		ctx->next_chunk_idx = 0;
+	}
+
+	idx = ctx->next_chunk_idx;
+	if (msg->compressed_chunk_sizes[idx] == msg->uncompressed_chunk_sizes[idx])
+		*udata_ret = msg->compressed_chunks[idx];
+	else
+		*udata_ret = msg->uncompressed_chunks[idx];
+	*usize_ret = msg->uncompressed_chunk_sizes[idx];
+	*status_ret = msg->statuses[idx];
+	if (unlikely(*status_ret))
+		errno = msg->errnos[idx];
+
+	if (++ctx->next_chunk_idx == msg->num_filled_chunks) {
+		list_del(&msg->submission_list);
+		list_add_tail(&msg->list, &ctx->available_msgs);
+		ctx->next_ready_msg = NULL;
+	}
+	return true;
+}
+
+int
+new_parallel_chunk_decompressor(int in_ctype, u32 in_chunk_size,
+				unsigned num_threads, u64 max_memory,
+				struct chunk_decompressor **decompressor_ret)
+{
+	u64 approx_mem_required;
+	size_t chunks_per_msg;
+	size_t msgs_per_thread;
+	size_t extra_msgs;
+	struct parallel_chunk_decompressor *ctx;
+	unsigned i;
+	int ret;
+
+	wimlib_assert(in_chunk_size > 0);
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+
+	if (num_threads == 1)
+		return -1;
+
+	if (max_memory == 0)
+		max_memory = get_memory_limit() / 2;
+
+	if (in_chunk_size < ((u32)1 << 23)) {
+		/* Relatively small chunks.  Decompression is much faster than
+		 * compression, so batch more chunks per message to keep the
+		 * locking overhead low.  */
+		chunks_per_msg = 4;
+		chunks_per_msg += num_threads * (65536 / in_chunk_size) / 8;
+		chunks_per_msg = min(chunks_per_msg, MAX_CHUNKS_PER_MSG);
+		msgs_per_thread = 2;
+		extra_msgs = 0;
+	} else {
+		/* Big chunks, e.g. in solid resources: one buffer per thread,
+		 * plus a couple more so that the threads can keep working
+		 * while the oldest chunk is being consumed.  Any more would
+		 * just waste memory, which matters with 64 MiB chunks and many
+		 * threads.  */
+		chunks_per_msg = 1;
+		msgs_per_thread = 1;
+		extra_msgs = 2;
+	}
+	for (;;) {
+		approx_mem_required =
+			2 * (u64)chunks_per_msg *
+			    ((u64)msgs_per_thread * num_threads + extra_msgs) *
+			    (u64)in_chunk_size
+			+ 1000000;
+		if (approx_mem_required <= max_memory)
+			break;
+
+		if (chunks_per_msg > 1)
+			chunks_per_msg--;
+		else if (msgs_per_thread > 1)
+			msgs_per_thread--;
+		else if (extra_msgs > 1)
+			extra_msgs--;
+		else if (num_threads > 1)
+			num_threads--;
+		else
+			break;
+	}
+
+	if (num_threads == 1)
+		return -2;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx = CALLOC(1, sizeof(*ctx));
+	if (ctx == NULL)
+		goto err;
+
+	ctx->base.in_ctype = in_ctype;
+	ctx->base.in_chunk_size = in_chunk_size;
+	ctx->base.destroy = parallel_chunk_decompressor_destroy;
+	ctx->base.get_chunk_buffer = parallel_chunk_decompressor_get_chunk_buffer;
+	ctx->base.signal_chunk_filled = parallel_chunk_decompressor_signal_chunk_filled;
+	ctx->base.submit_chunk_read = parallel_chunk_decompressor_submit_chunk_read;
+	ctx->base.get_decompression_result = parallel_chunk_decompressor_get_decompression_result;
+
+	ctx->num_thread_data = num_threads;
+
+	ret = message_queue_init(&ctx->chunks_to_decompress_queue);
+	if (ret)
+		goto err;
+
+	ret = message_queue_init(&ctx->decompressed_chunks_queue);
+	if (ret)
+		goto err;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->thread_data = CALLOC(num_threads, sizeof(ctx->thread_data[0]));
+	if (ctx->thread_data == NULL)
+		goto err;
+
+	for (i = 0; i < num_threads; i++) {
+		struct decompressor_thread_data *dat;
+
+		dat = &ctx->thread_data[i];
+
+		dat->chunks_to_decompress_queue = &ctx->chunks_to_decompress_queue;
+		dat->decompressed_chunks_queue = &ctx->decompressed_chunks_queue;
+		ret = wimlib_create_decompressor(in_ctype, in_chunk_size,
+						 &dat->decompressor);
+		if (ret)
+			goto err;
+	}
+
+	for (ctx->num_started_threads = 0;
+	     ctx->num_started_threads < num_threads;
+	     ctx->num_started_threads++)
+	{
+		if (!thread_create(&ctx->thread_data[ctx->num_started_threads].thread,
+				   decompressor_thread_proc,
+				   &ctx->thread_data[ctx->num_started_threads]))
+		{
+			ret = WIMLIB_ERR_NOMEM;
+			if (ctx->num_started_threads >= 2)
+				break;
+			goto err;
+		}
+	}
+
+	ctx->base.num_threads = ctx->num_started_threads;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx->num_messages = ctx->num_started_threads * msgs_per_thread +
+			    extra_msgs;
+	ctx->msgs = allocate_messages(ctx->num_messages,
+				      chunks_per_msg, in_chunk_size);
+	if (ctx->msgs == NULL)
+		goto err;
+
+	INIT_LIST_HEAD(&ctx->available_msgs);
+	for (size_t i = 0; i < ctx->num_messages; i++)
+		list_add_tail(&ctx->msgs[i].list, &ctx->available_msgs);
+
+	INIT_LIST_HEAD(&ctx->submitted_msgs);
+
+	*decompressor_ret = &ctx->base;
+	return 0;
+
+err:
+	parallel_chunk_decompressor_destroy(&ctx->base);
+	return ret;
+}
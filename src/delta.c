@@ -0,0 +1,536 @@
+/*
+ * delta.c
+ *
+ * Binary deltas of blobs against other blobs, used to store a modified file in
+ * a delta WIM as the differences from its old version in the base WIM.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * The delta data is a sequence of commands which produce the target blob from
+ * start to end.  Each command begins with a variable-length integer 'v' (7 bits
+ * per byte, least significant first, high bit set in all bytes but the last).
+ * If bit 0 of 'v' is clear, the command is a literal: the next 'v >> 1' bytes
+ * of the delta data are copied to the output.  Otherwise the command is a copy:
+ * it is followed by another variable-length integer giving the signed distance,
+ * zigzag-encoded, from the end of the previous copy in the base blob (or from
+ * its start for the first copy) to the start of the 'v >> 1' bytes of the base
+ * blob to copy to the output.
+ *
+ * The delta data is then stored compressed like any other resource, which takes
+ * care of compressing the literals.  Copies are found by indexing the base blob
+ * with a rolling hash of DELTA_MATCH_LEN bytes at every DELTA_INDEX_STRIDE'th
+ * position, then sliding the same hash over the target blob; this finds the
+ * long matches at any distance that are typical of a modified file, which the
+ * chunked compression of the resource could never see.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/assert.h"
+#include "wimlib/bitops.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/delta.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/resource.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+/* Length of the sequences which are hashed to find copies.  This is also the
+ * minimum length of a copy.  */
+#define DELTA_MATCH_LEN		32
+
+/* Spacing of the positions in the base blob which are indexed  */
+#define DELTA_INDEX_STRIDE	16
+
+/* Multiplier of the rolling hash  */
+#define DELTA_HASH_MULT		0x01000193
+
+/* Size of the buffer through which copies are read from the base blob  */
+#define DELTA_COPY_BUF_SIZE	65536
+
+/* Return DELTA_HASH_MULT to the power DELTA_MATCH_LEN, modulo 2^32: the factor
+ * with which a byte leaves the rolling hash.  */
+static u32
+delta_hash_out_factor(void)
+{
+	u32 f = 1;
+
+	for (int i = 0; i < DELTA_MATCH_LEN; i++)
+		f *= DELTA_HASH_MULT;
+	return f;
+}
+
+static u32
+delta_hash_init(const u8 *p)
+{
+	u32 h = 0;
+
+	for (int i = 0; i < DELTA_MATCH_LEN; i++)
+		h = h * DELTA_HASH_MULT + p[i];
+	return h;
+}
+
+/* Slide the hash of p[0...DELTA_MATCH_LEN - 1] forward by one byte.  */
+static forceinline u32
+delta_hash_roll(u32 h, const u8 *p, u32 out_factor)
+{
+	return h * DELTA_HASH_MULT + p[DELTA_MATCH_LEN] - p[0] * out_factor;
+}
+
+static forceinline u32
+delta_hash_bucket(u32 h, unsigned num_bits)
+{
+	return (u32)(h * 0x9E3779B1) >> (32 - num_bits);
+}
+
+static u8 *
+put_varint(u8 *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static const u8 *
+get_varint(const u8 *p, const u8 *end, u64 *v_ret)
+{
+	u64 v = 0;
+
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (p == end)
+			return NULL;
+		v |= (u64)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80)) {
+			*v_ret = v;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* The maximum number of bytes a command takes, excluding literal bytes  */
+#define DELTA_MAX_COMMAND_SIZE	20
+
+static u8 *
+put_literal(u8 *p, u8 *end, const u8 *lit, size_t len)
+{
+	if (!len)
+		return p;
+	if ((size_t)(end - p) < DELTA_MAX_COMMAND_SIZE + len)
+		return NULL;
+	p = put_varint(p, (u64)len << 1);
+	return mempcpy(p, lit, len);
+}
+
+static u8 *
+put_copy(u8 *p, u8 *end, size_t src, size_t len, size_t *prev_end_p)
+{
+	s64 dist = (s64)src - (s64)*prev_end_p;
+
+	if (end - p < DELTA_MAX_COMMAND_SIZE)
+		return NULL;
+	p = put_varint(p, ((u64)len << 1) | 1);
+	p = put_varint(p, ((u64)dist << 1) ^ (u64)(dist >> 63));
+	*prev_end_p = src + len;
+	return p;
+}
+
+/*
+ * Encode the blob data @target as a delta against the blob data @base, writing
+ * the delta data to @out.  Returns the size of the delta data, or 0 if it
+ * wouldn't fit in @max_out_size bytes, in which case the blob should be stored
+ * in full instead.  0 is also returned if memory is exhausted, since that just
+ * means that the blob will be stored in full.
+ */
+size_t
+create_blob_delta(const u8 *base, size_t base_size,
+		  const u8 *target, size_t target_size,
+		  u8 *out, size_t max_out_size)
+{
+	const u32 out_factor = delta_hash_out_factor();
+	unsigned num_bits;
+	u32 *index;
+	u8 *p = out;
+	u8 * const end = out + max_out_size;
+	size_t prev_end = 0;
+	size_t lit_start = 0;
+	size_t pos;
+	u32 h;
+
+	if (base_size < DELTA_MATCH_LEN || target_size < DELTA_MATCH_LEN)
+		return 0;
+
+	/* Index the base blob.  Each bucket remembers the last indexed position
+	 * (plus 1) whose sequence hashed to it.  */
+	num_bits = max(ilog2_ceil(base_size / DELTA_INDEX_STRIDE), 10);
+	index = CALLOC((size_t)1 << num_bits, sizeof(index[0]));
+	if (!index)
+		return 0;
+	h = delta_hash_init(base);
+	for (pos = 0; ; pos++) {
+		if (pos % DELTA_INDEX_STRIDE == 0)
+			index[delta_hash_bucket(h, num_bits)] = pos + 1;
+		if (pos + DELTA_MATCH_LEN >= base_size)
+			break;
+		h = delta_hash_roll(h, &base[pos], out_factor);
+	}
+
+	/* Find the copies in the target blob.  */
+	pos = 0;
+	h = delta_hash_init(target);
+	for (;;) {
+		u32 cand = index[delta_hash_bucket(h, num_bits)];
+
+		if (cand && !memcmp(&base[cand - 1], &target[pos],
+				    DELTA_MATCH_LEN)) {
+			size_t src = cand - 1;
+			size_t len = DELTA_MATCH_LEN;
+
+			/* Extend the match forwards, then backwards over the
+			 * pending literals.  */
+			while (src + len < base_size &&
+			       pos + len < target_size &&
+			       base[src + len] == target[pos + len])
+				len++;
+			while (src > 0 && pos > lit_start &&
+			       base[src - 1] == target[pos - 1]) {
+				src--;
+				pos--;
+				len++;
+			}
+			p = put_literal(p, end, &target[lit_start],
+					pos - lit_start);
+			if (p)
+				p = put_copy(p, end, src, len, &prev_end);
+			if (!p)
+				break;
+			pos += len;
+			lit_start = pos;
+			if (pos + DELTA_MATCH_LEN > target_size)
+				break;
+			h = delta_hash_init(&target[pos]);
+			continue;
+		}
+		if (pos + DELTA_MATCH_LEN >= target_size)
+			break;
+		h = delta_hash_roll(h, &target[pos], out_factor);
+		pos++;
+	}
+	if (p)
+		p = put_literal(p, end, &target[lit_start],
+				target_size - lit_start);
+	FREE(index);
+	return p ? p - out : 0;
+}
+
+static int
+delta_data_invalid(void)
+{
+	ERROR("Invalid delta data in WIM resource");
+	return WIMLIB_ERR_DECOMPRESSION;
+}
+
+/* Find the base blob of the delta blob @blob.  */
+static int
+find_delta_base(const struct blob_descriptor *blob,
+		const struct blob_descriptor **base_ret)
+{
+	const struct delta_resource_descriptor *drdesc =
+		container_of(blob->rdesc, struct delta_resource_descriptor,
+			     rdesc);
+	const struct blob_table *table = blob->rdesc->wim->blob_table;
+	const struct blob_descriptor *base;
+
+	base = table ? lookup_blob(table, drdesc->base_hash) : NULL;
+
+	/* The base of a delta is never itself a delta.  */
+	if (!base || base->blob_location != BLOB_IN_WIM) {
+		if (wimlib_print_errors) {
+			tchar hashstr[SHA1_HASH_STRING_LEN];
+
+			sprint_hash(drdesc->base_hash, hashstr);
+			ERROR("Blob %"TS", the base of a binary delta, "
+			      "was not found.\n"
+			      "        Reference the WIM on which the delta "
+			      "WIM is based.", hashstr);
+		}
+		return WIMLIB_ERR_RESOURCE_NOT_FOUND;
+	}
+	*base_ret = base;
+	return 0;
+}
+
+/* Feed @size bytes at @offset in the base blob @base to @cb.  */
+static int
+consume_base_data(const struct blob_descriptor *base, u64 offset, u64 size,
+		  u8 *buf, const struct consume_chunk_callback *cb)
+{
+	while (size) {
+		size_t n = min(size, DELTA_COPY_BUF_SIZE);
+		int ret;
+
+		ret = read_partial_blob_into_buf(base, offset, n, buf);
+		if (!ret)
+			ret = consume_chunk(cb, buf, n);
+		if (ret)
+			return ret;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * Get the decoded delta data of the delta blob @blob.  If only part of the blob
+ * is being read (@partial), the data is cached in the resource descriptor, and
+ * *@cached_ret is set to true to tell the caller not to free it; otherwise the
+ * caller must free it.
+ */
+static int
+load_delta_data(const struct blob_descriptor *blob, bool partial,
+		bool recover_data, u8 **delta_ret, bool *cached_ret)
+{
+	struct delta_resource_descriptor *drdesc =
+		container_of(blob->rdesc, struct delta_resource_descriptor,
+			     rdesc);
+	u8 *delta, *cached = NULL;
+	int ret;
+
+	delta = __atomic_load_n(&drdesc->delta_data, __ATOMIC_ACQUIRE);
+	if (delta) {
+		*delta_ret = delta;
+		*cached_ret = true;
+		return 0;
+	}
+
+	if ((size_t)drdesc->rdesc.uncompressed_size !=
+	    drdesc->rdesc.uncompressed_size)
+		return WIMLIB_ERR_NOMEM;
+	delta = MALLOC(max(drdesc->rdesc.uncompressed_size, 1));
+	if (!delta)
+		return WIMLIB_ERR_NOMEM;
+	ret = read_wim_resource_into_buf(&drdesc->rdesc, delta, recover_data);
+	if (ret) {
+		FREE(delta);
+		return ret;
+	}
+
+	/* Another thread may have cached the data in the meantime.  */
+	if (partial &&
+	    !__atomic_compare_exchange_n(&drdesc->delta_data, &cached, delta,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE))
+	{
+		FREE(delta);
+		delta = cached;
+	}
+	*delta_ret = delta;
+	*cached_ret = partial;
+	return 0;
+}
+
+/*
+ * Read @size bytes at @offset in the uncompressed data of the blob @blob, which
+ * is located in a delta resource (BLOB_IN_WIM_DELTA), and feed the data to @cb.
+ * The delta data is needed in full, but from the base blob only the parts that
+ * are copied into the requested range are read.
+ */
+int
+read_delta_blob_range(const struct blob_descriptor *blob, u64 offset, u64 size,
+		      const struct consume_chunk_callback *cb,
+		      bool recover_data)
+{
+	const struct wim_resource_descriptor *rdesc = blob->rdesc;
+	const struct blob_descriptor *base;
+	bool cached = false;
+	u8 *delta = NULL, *buf = NULL;
+	const u8 *p, *delta_end;
+	const u64 range_end = offset + size;
+	u64 pos = 0;
+	u64 prev_end = 0;
+	int ret;
+
+	wimlib_assert(blob->blob_location == BLOB_IN_WIM_DELTA);
+
+	if (!size)
+		return 0;
+
+	ret = find_delta_base(blob, &base);
+	if (ret)
+		return ret;
+
+	ret = load_delta_data(blob, offset != 0 || size != blob->size,
+			      recover_data, &delta, &cached);
+	if (ret)
+		return ret;
+
+	p = delta;
+	delta_end = delta + rdesc->uncompressed_size;
+	while (pos < range_end) {
+		u64 v, len, skip, n;
+
+		p = get_varint(p, delta_end, &v);
+		if (!p)
+			goto invalid;
+		len = v >> 1;
+		if (len == 0 || len > blob->size - pos)
+			goto invalid;
+		skip = (offset > pos) ? min(offset - pos, len) : 0;
+		n = min(len - skip, range_end - pos - skip);
+
+		if (v & 1) {
+			u64 zz, src;
+
+			p = get_varint(p, delta_end, &zz);
+			if (!p)
+				goto invalid;
+			src = prev_end + (u64)((s64)(zz >> 1) ^ -(s64)(zz & 1));
+			if (src > base->size || len > base->size - src)
+				goto invalid;
+			prev_end = src + len;
+			if (n) {
+				if (!buf) {
+					buf = MALLOC(DELTA_COPY_BUF_SIZE);
+					if (!buf) {
+						ret = WIMLIB_ERR_NOMEM;
+						goto out;
+					}
+				}
+				ret = consume_base_data(base, src + skip, n,
+							buf, cb);
+				if (ret)
+					goto out;
+			}
+		} else {
+			if (len > (u64)(delta_end - p))
+				goto invalid;
+			if (n) {
+				ret = consume_chunk(cb, p + skip, n);
+				if (ret)
+					goto out;
+			}
+			p += len;
+		}
+		pos += len;
+	}
+
+	/* When reading through the end of the blob, all the delta data must
+	 * have been used.  */
+	if (range_end == blob->size && p != delta_end)
+		goto invalid;
+	ret = 0;
+	goto out;
+
+invalid:
+	ret = delta_data_invalid();
+out:
+	FREE(buf);
+	if (!cached)
+		FREE(delta);
+	return ret;
+}
+
+/*
+ * Set up the blob descriptor @blob, whose blob table entry has the resource
+ * header @reshdr with WIM_RESHDR_FLAG_DELTA set, to be located in that delta
+ * resource.  This reads the header at the start of the resource.
+ */
+int
+load_delta_resource(WIMStruct *wim, const struct wim_reshdr *reshdr,
+		    struct blob_descriptor *blob)
+{
+	struct delta_resource_header_disk hdr;
+	struct delta_resource_descriptor *drdesc;
+	struct wim_reshdr delta_reshdr;
+	int ret;
+
+	if ((reshdr->flags & (WIM_RESHDR_FLAG_METADATA |
+			      WIM_RESHDR_FLAG_SOLID)) ||
+	    reshdr->size_in_wim < sizeof(hdr) || wim_is_pipable(wim))
+		goto invalid;
+
+	ret = full_pread(&wim->in_fd, &hdr, sizeof(hdr), reshdr->offset_in_wim);
+	if (ret) {
+		ERROR("Failed to read header of delta resource "
+		      "(offset_in_wim=%"PRIu64")", reshdr->offset_in_wim);
+		return ret;
+	}
+
+	delta_reshdr.offset_in_wim = reshdr->offset_in_wim + sizeof(hdr);
+	delta_reshdr.size_in_wim = reshdr->size_in_wim - sizeof(hdr);
+	delta_reshdr.uncompressed_size = le64_to_cpu(hdr.delta_size);
+	delta_reshdr.flags = reshdr->flags & WIM_RESHDR_FLAG_COMPRESSED;
+
+	if (hdr.reserved != 0 ||
+	    (!(delta_reshdr.flags & WIM_RESHDR_FLAG_COMPRESSED) &&
+	     delta_reshdr.size_in_wim != delta_reshdr.uncompressed_size))
+		goto invalid;
+
+	drdesc = MALLOC(sizeof(*drdesc));
+	if (!drdesc)
+		return WIMLIB_ERR_NOMEM;
+	wim_reshdr_to_desc(&delta_reshdr, wim, &drdesc->rdesc);
+	copy_hash(drdesc->base_hash, hdr.base_hash);
+	drdesc->delta_data = NULL;
+
+	blob->size = reshdr->uncompressed_size;
+	blob_set_is_located_in_wim_resource(blob, &drdesc->rdesc, 0);
+	blob->blob_location = BLOB_IN_WIM_DELTA;
+	wim->refcnt++;
+	return 0;
+
+invalid:
+	ERROR("Invalid delta resource (offset_in_wim=%"PRIu64")",
+	      reshdr->offset_in_wim);
+	return WIMLIB_ERR_INVALID_LOOKUP_TABLE_ENTRY;
+}
+
+/* Free the resource descriptor of a delta resource once no blob uses it.  */
+void
+free_delta_resource_descriptor(struct wim_resource_descriptor *rdesc)
+{
+	struct delta_resource_descriptor *drdesc =
+		container_of(rdesc, struct delta_resource_descriptor, rdesc);
+
+	FREE(drdesc->delta_data);
+	FREE(drdesc->rdesc.chunk_offsets);
+	FREE(drdesc);
+}
+
+/* Get the resource header of the delta resource in which the blob @blob is
+ * located (BLOB_IN_WIM_DELTA).  */
+void
+delta_blob_get_reshdr(const struct blob_descriptor *blob,
+		      struct wim_reshdr *reshdr)
+{
+	const struct wim_resource_descriptor *rdesc = blob->rdesc;
+
+	reshdr->offset_in_wim = rdesc->offset_in_wim -
+				sizeof(struct delta_resource_header_disk);
+	reshdr->size_in_wim = rdesc->size_in_wim +
+			      sizeof(struct delta_resource_header_disk);
+	reshdr->uncompressed_size = blob->size;
+	reshdr->flags = rdesc->flags | WIM_RESHDR_FLAG_DELTA;
+}
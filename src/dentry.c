@@ -62,12 +62,15 @@
 #include <errno.h>
 
 #include "wimlib/assert.h"
+#include "wimlib/bitops.h"
 #include "wimlib/dentry.h"
 #include "wimlib/inode.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/metadata.h"
 #include "wimlib/paths.h"
+#include "wimlib/stats.h"
+#include "wimlib/tagged_items.h"
 
 /* On-disk format of a WIM dentry (directory entry), located in the metadata
  * resource for a WIM image.  */
@@ -226,15 +229,18 @@ static void
 do_dentry_set_name(struct wim_dentry *dentry, utf16lechar *name,
 		   size_t name_nbytes)
 {
-	FREE(dentry->d_name);
+	if (!dentry->d_names_in_arena)
+		FREE(dentry->d_name);
 	dentry->d_name = name;
 	dentry->d_name_nbytes = name_nbytes;
 
 	if (dentry_has_short_name(dentry)) {
-		FREE(dentry->d_short_name);
+		if (!dentry->d_names_in_arena)
+			FREE(dentry->d_short_name);
 		dentry->d_short_name = NULL;
 		dentry->d_short_name_nbytes = 0;
 	}
+	dentry->d_names_in_arena = 0;
 }
 
 /*
@@ -520,22 +526,33 @@ dentry_full_path(struct wim_dentry *dentry)
 	return dentry->d_full_path;
 }
 
+struct subdir_offset_ctx {
+	struct wim_image_metadata *imd;
+	u64 subdir_offset;
+};
+
 static int
-dentry_calculate_subdir_offset(struct wim_dentry *dentry, void *_subdir_offset_p)
+dentry_calculate_subdir_offset(struct wim_dentry *dentry, void *_ctx)
 {
-	if (dentry_is_directory(dentry)) {
-		u64 *subdir_offset_p = _subdir_offset_p;
+	struct subdir_offset_ctx *ctx = _ctx;
+
+	if (dentry->d_children_unloaded) {
+		/* The whole subtree of this directory is still in the image's
+		 * spill file; it will be written at this offset.  */
+		dentry->d_out_subdir_offset = ctx->subdir_offset;
+		ctx->subdir_offset += unloaded_subtree_size(ctx->imd, dentry);
+	} else if (dentry_is_directory(dentry)) {
 		struct wim_dentry *child;
 
 		/* Set offset of directory's child dentries  */
-		dentry->d_subdir_offset = *subdir_offset_p;
+		dentry->d_subdir_offset = ctx->subdir_offset;
 
 		/* Account for child dentries  */
 		for_dentry_child(child, dentry)
-			*subdir_offset_p += dentry_out_total_length(child);
+			ctx->subdir_offset += dentry_out_total_length(child);
 
 		/* Account for end-of-directory entry  */
-		*subdir_offset_p += 8;
+		ctx->subdir_offset += 8;
 	} else {
 		/* Not a directory; set the subdir offset to 0  */
 		dentry->d_subdir_offset = 0;
@@ -556,11 +573,21 @@ dentry_calculate_subdir_offset(struct wim_dentry *dentry, void *_subdir_offset_p
  *
  * When this function returns, *subdir_offset_p will have been advanced past the
  * size needed for the dentry tree within the uncompressed metadata resource.
+ *
+ * The tree may have directories whose children are unloaded only if @imd is an
+ * image captured with WIMLIB_ADD_FLAG_SPILL_METADATA.
  */
 void
-calculate_subdir_offsets(struct wim_dentry *root, u64 *subdir_offset_p)
+calculate_subdir_offsets(struct wim_image_metadata *imd,
+			 struct wim_dentry *root, u64 *subdir_offset_p)
 {
-	for_dentry_in_tree(root, dentry_calculate_subdir_offset, subdir_offset_p);
+	struct subdir_offset_ctx ctx = {
+		.imd = imd,
+		.subdir_offset = *subdir_offset_p,
+	};
+
+	for_dentry_in_tree(root, dentry_calculate_subdir_offset, &ctx);
+	*subdir_offset_p = ctx.subdir_offset;
 }
 
 static int
@@ -605,6 +632,205 @@ bool default_ignore_case =
 #endif
 ;
 
+/*
+ * A directory's children are indexed by a binary search tree, which is needed
+ * for iterating through them in collation order.  But looking up a name in a
+ * directory with hundreds of thousands of entries then takes a couple dozen
+ * name comparisons, which is slow when done for every path being extracted or
+ * updated.  So, large directories additionally get a hash table of their
+ * children, keyed by case-folded name so that it serves both case-sensitive and
+ * case-insensitive lookups.  It's built by the first lookup that has to go deep
+ * into the search tree, then kept up to date by dentry_add_child() and
+ * unlink_dentry().  If memory runs out while doing so, the index is just
+ * dropped, since the search tree always remains authoritative.
+ *
+ * The hash table uses open addressing with linear probing, and it is kept at
+ * most half full.
+ */
+
+/* Search tree depth at which a lookup builds a hash index of the directory.
+ * Only directories with at least several hundred children can have search
+ * paths this long.  */
+#define CHILD_INDEX_MIN_SEARCH_DEPTH	12
+
+#define CHILD_INDEX_MIN_CAPACITY	1024
+
+struct dentry_child_index_slot {
+	struct wim_dentry *dentry;
+	u32 hash;
+};
+
+struct dentry_child_index {
+	size_t num_entries;
+	size_t mask;
+	struct dentry_child_index_slot slots[];
+};
+
+/* Hash a filename, ignoring case.  */
+static u32
+hash_dentry_name(const utf16lechar *name, size_t name_nbytes)
+{
+	u64 hash = 0;
+
+	for (size_t i = 0; i < name_nbytes / 2; i++)
+		hash = hash_u64(hash + upcase[le16_to_cpu(name[i])]);
+	return hash >> 32;
+}
+
+static struct dentry_child_index *
+alloc_child_index(size_t capacity)
+{
+	struct dentry_child_index *index;
+
+	index = CALLOC(1, sizeof(*index) +
+			  capacity * sizeof(index->slots[0]));
+	if (index)
+		index->mask = capacity - 1;
+	return index;
+}
+
+static void
+child_index_insert(struct dentry_child_index *index,
+		   struct wim_dentry *dentry, u32 hash)
+{
+	size_t i = hash & index->mask;
+
+	while (index->slots[i].dentry)
+		i = (i + 1) & index->mask;
+	index->slots[i].dentry = dentry;
+	index->slots[i].hash = hash;
+	index->num_entries++;
+}
+
+static void
+build_child_index(struct wim_inode *dir)
+{
+	struct dentry_child_index *index;
+	struct wim_dentry *child;
+	size_t num_children = 0;
+
+	for_inode_child(child, dir)
+		num_children++;
+
+	index = alloc_child_index(max(roundup_pow_of_2(num_children * 2),
+				      CHILD_INDEX_MIN_CAPACITY));
+	if (!index)
+		return;
+	for_inode_child(child, dir) {
+		child_index_insert(index, child,
+				   hash_dentry_name(child->d_name,
+						    child->d_name_nbytes));
+	}
+	dir->i_child_index = index;
+}
+
+static void
+drop_child_index(struct wim_inode *dir)
+{
+	FREE(dir->i_child_index);
+	dir->i_child_index = NULL;
+}
+
+/* Add @child to the hash index of @dir, if it has one.  */
+static void
+child_index_add(struct wim_inode *dir, struct wim_dentry *child)
+{
+	struct dentry_child_index *index = dir->i_child_index;
+
+	if (!index)
+		return;
+
+	if ((index->num_entries + 1) * 2 > index->mask + 1) {
+		struct dentry_child_index *new_index;
+
+		new_index = alloc_child_index((index->mask + 1) * 2);
+		if (!new_index) {
+			drop_child_index(dir);
+			return;
+		}
+		for (size_t i = 0; i <= index->mask; i++) {
+			if (index->slots[i].dentry) {
+				child_index_insert(new_index,
+						   index->slots[i].dentry,
+						   index->slots[i].hash);
+			}
+		}
+		FREE(index);
+		index = new_index;
+		dir->i_child_index = index;
+	}
+	child_index_insert(index, child,
+			   hash_dentry_name(child->d_name, child->d_name_nbytes));
+}
+
+/* Remove @child from the hash index of @dir, if it has one.  */
+static void
+child_index_remove(struct wim_inode *dir, struct wim_dentry *child)
+{
+	struct dentry_child_index *index = dir->i_child_index;
+	size_t i, j;
+
+	if (!index)
+		return;
+
+	i = hash_dentry_name(child->d_name, child->d_name_nbytes) & index->mask;
+	while (index->slots[i].dentry != child) {
+		if (!index->slots[i].dentry) {
+			/* The dentry was renamed while linked, so it isn't
+			 * where its current name says it should be.  */
+			i = 0;
+			while (index->slots[i].dentry != child)
+				i++;
+			break;
+		}
+		i = (i + 1) & index->mask;
+	}
+
+	/* Fill the hole by moving back any following entries that can't be
+	 * found otherwise.  */
+	j = i;
+	for (;;) {
+		size_t home;
+
+		j = (j + 1) & index->mask;
+		if (!index->slots[j].dentry)
+			break;
+		home = index->slots[j].hash & index->mask;
+		if (((j - home) & index->mask) >= ((j - i) & index->mask)) {
+			index->slots[i] = index->slots[j];
+			i = j;
+		}
+	}
+	index->slots[i].dentry = NULL;
+	index->num_entries--;
+}
+
+/* Search for @wanted's name among the children of @dir using its hash index.
+ * Return the case-sensitive match if there is one; otherwise return NULL and
+ * set *ci_match_ret to a case-insensitive match, if there is one.  */
+static struct wim_dentry *
+child_index_lookup(const struct wim_inode *dir,
+		   const struct wim_dentry *wanted,
+		   struct wim_dentry **ci_match_ret)
+{
+	const struct dentry_child_index *index = dir->i_child_index;
+	u32 hash = hash_dentry_name(wanted->d_name, wanted->d_name_nbytes);
+	size_t i = hash & index->mask;
+
+	for (; index->slots[i].dentry; i = (i + 1) & index->mask) {
+		struct wim_dentry *child = index->slots[i].dentry;
+
+		if (index->slots[i].hash != hash ||
+		    dentry_compare_names(wanted, child, true))
+			continue;
+		if (!dentry_compare_names(wanted, child, false))
+			return child;
+		if (!*ci_match_ret)
+			*ci_match_ret = child;
+	}
+	return NULL;
+}
+
 /*
  * Find the dentry within the given directory that has the given UTF-16LE
  * filename.  Return it if found, otherwise return NULL.  This has configurable
@@ -620,12 +846,23 @@ get_dentry_child_with_utf16le_name(const struct wim_dentry *dir,
 	struct avl_tree_node *cur = dir->d_inode->i_children;
 	struct wim_dentry *ci_match = NULL;
 
+	unsigned depth = 0;
+
 	wanted.d_name = (utf16lechar *)name;
 	wanted.d_name_nbytes = name_nbytes;
 
 	if (unlikely(wanted.d_name_nbytes != name_nbytes))
 		return NULL; /* overflow */
 
+	if (dir->d_inode->i_child_index) {
+		struct wim_dentry *child;
+
+		child = child_index_lookup(dir->d_inode, &wanted, &ci_match);
+		if (child)
+			return child;
+		goto no_exact_match;
+	}
+
 	/* Note: we can't use avl_tree_lookup_node() here because we need to
 	 * save case-insensitive matches. */
 	while (cur) {
@@ -640,16 +877,26 @@ get_dentry_child_with_utf16le_name(const struct wim_dentry *dir,
 			ci_match = child;
 
 			res = dentry_compare_names(&wanted, child, false);
-			if (!res)
-				return child; /* case-sensitive match found */
+			if (!res) {
+				/* case-sensitive match found */
+				if (depth >= CHILD_INDEX_MIN_SEARCH_DEPTH)
+					build_child_index(dir->d_inode);
+				return child;
+			}
 		}
 
 		if (res < 0)
 			cur = cur->left;
 		else
 			cur = cur->right;
+		depth++;
 	}
 
+	if (depth >= CHILD_INDEX_MIN_SEARCH_DEPTH)
+		build_child_index(dir->d_inode);
+
+no_exact_match:
+
 	/* No case-sensitive match; use a case-insensitive match if possible. */
 
 	if (!will_ignore_case(case_type))
@@ -712,6 +959,7 @@ get_dentry_utf16le(WIMStruct *wim, const utf16lechar *path,
 {
 	struct wim_dentry *cur_dentry;
 	const utf16lechar *name_start, *name_end;
+	int ret;
 
 	/* Start with the root directory of the image.  Note: this will be NULL
 	 * if an image has been added directly with wimlib_add_empty_image() but
@@ -741,6 +989,13 @@ get_dentry_utf16le(WIMStruct *wim, const utf16lechar *path,
 			++name_end;
 		} while (*name_end != cpu_to_le16(WIM_PATH_SEPARATOR) && *name_end);
 
+		ret = load_dentry_children(wim_get_current_image_metadata(wim),
+					   cur_dentry);
+		if (unlikely(ret)) {
+			errno = (ret == WIMLIB_ERR_NOMEM) ? ENOMEM : EIO;
+			return NULL;
+		}
+
 		cur_dentry = get_dentry_child_with_utf16le_name(cur_dentry,
 								name_start,
 								(u8*)name_end - (u8*)name_start,
@@ -790,6 +1045,9 @@ get_dentry_utf16le(WIMStruct *wim, const utf16lechar *path,
  *	ENOTDIR if one of the path components used as a directory existed but
  *	was not, in fact, a directory.
  *
+ *	ENOMEM or EIO if the image is being loaded lazily and a directory along
+ *	the path couldn't be loaded.
+ *
  *	ENOENT otherwise.
  *
  * Additional notes:
@@ -882,6 +1140,7 @@ new_dentry(const tchar *name, struct wim_dentry **dentry_ret)
 			return ret;
 		}
 	}
+	MEM_ALLOCATED(metadata, sizeof(struct wim_dentry));
 	dentry->d_parent = dentry;
 	*dentry_ret = dentry;
 	return 0;
@@ -955,10 +1214,15 @@ free_dentry(struct wim_dentry *dentry)
 {
 	if (dentry) {
 		d_disassociate(dentry);
-		FREE(dentry->d_name);
-		FREE(dentry->d_short_name);
+		if (!dentry->d_names_in_arena) {
+			FREE(dentry->d_name);
+			FREE(dentry->d_short_name);
+		}
 		FREE(dentry->d_full_path);
-		FREE(dentry);
+		if (!dentry->d_in_arena) {
+			FREE(dentry);
+			MEM_FREED(metadata, sizeof(struct wim_dentry));
+		}
 	}
 }
 
@@ -1085,6 +1349,7 @@ dentry_add_child(struct wim_dentry *parent, struct wim_dentry *child)
 	if (duplicate)
 		return avl_tree_entry(duplicate, struct wim_dentry, d_index_node);
 
+	child_index_add(dir, child);
 	child->d_parent = parent;
 	return NULL;
 }
@@ -1101,12 +1366,143 @@ unlink_dentry(struct wim_dentry *dentry)
 
 	avl_tree_remove(&dentry->d_parent->d_inode->i_children,
 			&dentry->d_index_node);
+	child_index_remove(dentry->d_parent->d_inode, dentry);
 
 	/* Not actually necessary, but to be safe don't retain the now-obsolete
 	 * parent pointer.  */
 	dentry->d_parent = dentry;
 }
 
+/*
+ * An arena from which read_dentry() allocates the dentries and preliminary
+ * inodes it reads from a metadata resource, and the dentries' names, rather
+ * than allocating each one separately.  Images can have millions of files, and
+ * an arena makes loading them faster and keeps the heap from fragmenting.
+ *
+ * Objects in the arena are marked with d_in_arena, d_names_in_arena or
+ * i_in_arena, and freeing them individually does nothing.  The memory is only
+ * freed, all at once, when the arena is freed along with the image's dentry
+ * tree.  Since dentries and inodes never move from one image to another, this
+ * is safe even if the image is modified.
+ */
+struct dentry_arena_block {
+	struct dentry_arena_block *next;
+	size_t size;
+	u64 data[];
+};
+
+struct dentry_arena {
+	struct dentry_arena_block *blocks;
+	u8 *next;
+	u8 *end;
+	size_t next_block_size;
+};
+
+/* The arena's blocks start at this size and double up to the maximum, so that
+ * loading a small image, or a single directory, doesn't waste much memory.  */
+#define DENTRY_ARENA_MIN_BLOCK_SIZE	16384
+#define DENTRY_ARENA_MAX_BLOCK_SIZE	4194304
+
+struct dentry_arena *
+new_dentry_arena(void)
+{
+	struct dentry_arena *arena;
+
+	arena = CALLOC(1, sizeof(struct dentry_arena));
+	if (arena)
+		arena->next_block_size = DENTRY_ARENA_MIN_BLOCK_SIZE;
+	return arena;
+}
+
+/* Allocate @size bytes, aligned to 8 bytes and uninitialized, from @arena.
+ * Returns NULL if out of memory.  */
+void *
+dentry_arena_alloc(struct dentry_arena *arena, size_t size)
+{
+	void *p;
+
+	size = ALIGN(size, 8);
+	if (unlikely(size > arena->end - arena->next)) {
+		struct dentry_arena_block *block;
+		size_t block_size;
+
+		block_size = max(arena->next_block_size,
+				 sizeof(*block) + size);
+		block = MALLOC(block_size);
+		if (!block)
+			return NULL;
+		MEM_ALLOCATED(metadata, block_size);
+		block->size = block_size;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->next = (u8 *)block->data;
+		arena->end = (u8 *)block + block_size;
+		if (arena->next_block_size < DENTRY_ARENA_MAX_BLOCK_SIZE)
+			arena->next_block_size *= 2;
+	}
+	p = arena->next;
+	arena->next += size;
+	return p;
+}
+
+void
+dentry_arena_get_mark(const struct dentry_arena *arena,
+		      struct dentry_arena_mark *mark)
+{
+	mark->block = arena->blocks;
+	mark->next = arena->next;
+	mark->end = arena->end;
+	mark->next_block_size = arena->next_block_size;
+}
+
+/* Free everything that was allocated from @arena since @mark was taken.  */
+void
+dentry_arena_release(struct dentry_arena *arena,
+		     const struct dentry_arena_mark *mark)
+{
+	while (arena->blocks != mark->block) {
+		struct dentry_arena_block *next = arena->blocks->next;
+
+		MEM_FREED(metadata, arena->blocks->size);
+		FREE(arena->blocks);
+		arena->blocks = next;
+	}
+	arena->next = mark->next;
+	arena->end = mark->end;
+	arena->next_block_size = mark->next_block_size;
+}
+
+void
+free_dentry_arena(struct dentry_arena *arena)
+{
+	if (arena) {
+		while (arena->blocks) {
+			struct dentry_arena_block *next = arena->blocks->next;
+
+			MEM_FREED(metadata, arena->blocks->size);
+			FREE(arena->blocks);
+			arena->blocks = next;
+		}
+		FREE(arena);
+	}
+}
+
+/* Copy a name of @nbytes bytes, which isn't null-terminated, into @arena and
+ * null-terminate it.  */
+static utf16lechar *
+dentry_arena_dup_name(struct dentry_arena *arena, const u8 *name,
+		      size_t nbytes)
+{
+	u8 *p = dentry_arena_alloc(arena, nbytes + 2);
+
+	if (p) {
+		memcpy(p, name, nbytes);
+		p[nbytes] = 0;
+		p[nbytes + 1] = 0;
+	}
+	return (utf16lechar *)p;
+}
+
 static int
 read_extra_data(const u8 *p, const u8 *end, struct wim_inode *inode)
 {
@@ -1120,6 +1516,7 @@ read_extra_data(const u8 *p, const u8 *end, struct wim_inode *inode)
 			return WIMLIB_ERR_NOMEM;
 		inode->i_extra->size = end - p;
 		memcpy(inode->i_extra->data, p, end - p);
+		index_tagged_items(inode->i_extra);
 	}
 	return 0;
 }
@@ -1320,7 +1717,8 @@ setup_inode_streams(const u8 *p, const u8 *end, struct wim_inode *inode,
  * uncompressed metadata resource buffer.  */
 static int
 read_dentry(const u8 * restrict buf, size_t buf_len,
-	    u64 *offset_p, struct wim_dentry **dentry_ret)
+	    struct dentry_arena *arena, u64 *offset_p,
+	    struct wim_dentry **dentry_ret)
 {
 	u64 offset = *offset_p;
 	u64 length;
@@ -1367,11 +1765,18 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 
 	/* Allocate new dentry structure, along with a preliminary inode.  */
-	ret = new_dentry_with_new_inode(NULL, false, &dentry);
-	if (ret)
-		return ret;
-
-	inode = dentry->d_inode;
+	dentry = dentry_arena_alloc(arena, sizeof(struct wim_dentry));
+	if (unlikely(!dentry))
+		return WIMLIB_ERR_NOMEM;
+	memset(dentry, 0, sizeof(struct wim_dentry));
+	dentry->d_in_arena = 1;
+	dentry->d_names_in_arena = 1;
+	dentry->d_parent = dentry;
+	inode = new_inode_in_arena(dentry, arena);
+	if (unlikely(!inode)) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto err_free_dentry;
+	}
 
 	/* Read more fields: some into the dentry, and some into the inode.  */
 	inode->i_attributes = le32_to_cpu(disk_dentry->attributes);
@@ -1419,7 +1824,7 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 	/* Read the filename if present.  Note: if the filename is empty, there
 	 * is no null terminator following it.  */
 	if (name_nbytes) {
-		dentry->d_name = utf16le_dupz(p, name_nbytes);
+		dentry->d_name = dentry_arena_dup_name(arena, p, name_nbytes);
 		if (unlikely(!dentry->d_name)) {
 			ret = WIMLIB_ERR_NOMEM;
 			goto err_free_dentry;
@@ -1431,7 +1836,8 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 	/* Read the short filename if present.  Note: if there is no short
 	 * filename, there is no null terminator following it. */
 	if (short_name_nbytes) {
-		dentry->d_short_name = utf16le_dupz(p, short_name_nbytes);
+		dentry->d_short_name = dentry_arena_dup_name(arena, p,
+							     short_name_nbytes);
 		if (unlikely(!dentry->d_short_name)) {
 			ret = WIMLIB_ERR_NOMEM;
 			goto err_free_dentry;
@@ -1523,9 +1929,17 @@ should_ignore_dentry(struct wim_dentry *dir, const struct wim_dentry *dentry)
 	return false;
 }
 
+/*
+ * Read the children of the directory @dir, which is at the given depth in the
+ * tree.  If @inodes is NULL, then the children of its subdirectories are left
+ * unread and those subdirectories are marked with d_children_unloaded;
+ * otherwise the whole subtree is read, and the inode of each dentry read is
+ * added to @inodes.
+ */
 static int
-read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
-			   struct wim_dentry * restrict dir, unsigned depth)
+read_dentry_children(const u8 * restrict buf, size_t buf_len,
+		     struct dentry_arena *arena, struct wim_dentry * restrict dir,
+		     unsigned depth, struct hlist_head *inodes)
 {
 	u64 cur_offset = dir->d_subdir_offset;
 
@@ -1541,7 +1955,7 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
 		int ret;
 
 		/* Read next child of @dir.  */
-		ret = read_dentry(buf, buf_len, &cur_offset, &child);
+		ret = read_dentry(buf, buf_len, arena, &cur_offset, &child);
 		if (ret)
 			return ret;
 
@@ -1569,14 +1983,20 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
 			continue;
 		}
 
+		if (inodes)
+			hlist_add_head(&child->d_inode->i_hlist_node, inodes);
+
 		/* If this child is a directory that itself has children, call
-		 * this procedure recursively.  */
+		 * this procedure recursively, or leave it for later.  */
 		if (child->d_subdir_offset != 0) {
 			if (likely(dentry_is_directory(child))) {
-				ret = read_dentry_tree_recursive(buf,
-								 buf_len,
-								 child,
-								 depth + 1);
+				if (!inodes) {
+					child->d_children_unloaded = 1;
+					continue;
+				}
+				ret = read_dentry_children(buf, buf_len, arena,
+							   child, depth + 1,
+							   inodes);
 				if (ret)
 					return ret;
 			} else {
@@ -1600,6 +2020,21 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
  * @root_offset
  *	Offset in the metadata resource of the root of the dentry tree.
  *
+ * @lazy:
+ *	If true, read only the root dentry, marking it with d_children_unloaded
+ *	if it has children.  The children can later be read, one directory at a
+ *	time, using read_dentry_subdir() on the same buffer.
+ *
+ * @arena:
+ *	Arena from which to allocate the dentries, inodes and names.  The caller
+ *	must free it with free_dentry_arena() after freeing the dentry tree.
+ *
+ * @inodes:
+ *	If not @lazy, then on success the inodes of all the dentries read, each
+ *	of which still has a single name, are linked into this list by their
+ *	i_hlist_node, in the reverse of the order they were read.  This allows
+ *	dentry_tree_fix_inodes() to process them without walking the tree.
+ *
  * @root_ret:
  *	On success, either NULL or a pointer to the root dentry is written to
  *	this location.  The former case only occurs in the unexpected case that
@@ -1611,13 +2046,14 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
  *	WIMLIB_ERR_NOMEM
  */
 int
-read_dentry_tree(const u8 *buf, size_t buf_len,
-		 u64 root_offset, struct wim_dentry **root_ret)
+read_dentry_tree(const u8 *buf, size_t buf_len, u64 root_offset, bool lazy,
+		 struct dentry_arena *arena, struct hlist_head *inodes,
+		 struct wim_dentry **root_ret)
 {
 	int ret;
 	struct wim_dentry *root;
 
-	ret = read_dentry(buf, buf_len, &root_offset, &root);
+	ret = read_dentry(buf, buf_len, arena, &root_offset, &root);
 	if (ret)
 		return ret;
 
@@ -1636,10 +2072,18 @@ read_dentry_tree(const u8 *buf, size_t buf_len,
 			goto err_free_dentry_tree;
 		}
 
+		if (!lazy)
+			hlist_add_head(&root->d_inode->i_hlist_node, inodes);
+
 		if (likely(root->d_subdir_offset != 0)) {
-			ret = read_dentry_tree_recursive(buf, buf_len, root, 0);
-			if (ret)
-				goto err_free_dentry_tree;
+			if (lazy) {
+				root->d_children_unloaded = 1;
+			} else {
+				ret = read_dentry_children(buf, buf_len, arena,
+							   root, 0, inodes);
+				if (ret)
+					goto err_free_dentry_tree;
+			}
 		}
 	} else {
 		WARNING("The metadata resource has no directory entries; "
@@ -1653,6 +2097,55 @@ err_free_dentry_tree:
 	return ret;
 }
 
+/*
+ * Read the children of the directory @dir, which was marked with
+ * d_children_unloaded by read_dentry_tree() or by a previous call to this
+ * function.  Subdirectories of @dir are themselves marked, not read.  @arena
+ * must be the arena that was passed to read_dentry_tree().
+ *
+ * On failure, @dir is left as it was.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS (0)
+ *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
+ *	WIMLIB_ERR_NOMEM
+ */
+int
+read_dentry_subdir(const u8 *buf, size_t buf_len, struct dentry_arena *arena,
+		   struct wim_dentry *dir)
+{
+	unsigned depth = 0;
+	int ret;
+
+	wimlib_assert(dir->d_children_unloaded && !dentry_has_children(dir));
+
+	for (const struct wim_dentry *d = dir; !dentry_is_root(d);
+	     d = d->d_parent)
+		depth++;
+
+	ret = read_dentry_children(buf, buf_len, arena, dir, depth, NULL);
+	if (ret) {
+		unread_dentry_subdir(dir);
+		return ret;
+	}
+	dir->d_children_unloaded = 0;
+	return 0;
+}
+
+/* Undo read_dentry_subdir() on @dir, freeing its children, which must not have
+ * any loaded children themselves or be referenced from anywhere else.  */
+void
+unread_dentry_subdir(struct wim_dentry *dir)
+{
+	struct wim_dentry *child;
+
+	for_dentry_child_postorder(child, dir)
+		free_dentry(child);
+	dir->d_inode->i_children = NULL;
+	drop_child_index(dir->d_inode);
+	dir->d_children_unloaded = 1;
+}
+
 static u8 *
 write_extra_stream_entry(u8 * restrict p, const utf16lechar * restrict name,
 			 const u8 * restrict hash)
@@ -1792,7 +2285,7 @@ write_dentry_streams(const struct wim_inode *inode,
  *
  * Returns a pointer to the byte following the last written.
  */
-static u8 *
+u8 *
 write_dentry(const struct wim_dentry * restrict dentry, u8 * restrict p)
 {
 	const struct wim_inode *inode;
@@ -1859,22 +2352,117 @@ write_dentry(const struct wim_dentry * restrict dentry, u8 * restrict p)
 	return write_dentry_streams(inode, disk_dentry, p);
 }
 
+/* Write a dentry, including any extra stream entries, to @out.  */
+static int
+write_dentry_to_out(const struct wim_dentry *dentry, struct metadata_out *out)
+{
+	int ret;
+
+	ret = metadata_out_reserve(out, dentry_out_total_length(dentry));
+	if (ret)
+		return ret;
+	if (unlikely(dentry->d_children_unloaded)) {
+		struct wim_dentry_on_disk *disk_dentry = (void *)out->next;
+
+		out->next = write_dentry(dentry, out->next);
+		disk_dentry->subdir_offset =
+			cpu_to_le64(dentry->d_out_subdir_offset);
+	} else {
+		out->next = write_dentry(dentry, out->next);
+	}
+	return 0;
+}
+
+/* Write an end-of-directory entry to @out.  */
+static int
+write_end_of_dir_to_out(struct metadata_out *out)
+{
+	int ret;
+
+	ret = metadata_out_reserve(out, 8);
+	if (ret)
+		return ret;
+	*(u64 *)out->next = 0;
+	out->next += 8;
+	return 0;
+}
+
+struct write_dentries_ctx {
+	struct wim_image_metadata *imd;
+	struct metadata_out *out;
+};
+
+/* Write the subtree of the directory @dir, whose children are unloaded, to the
+ * position dir->d_out_subdir_offset that calculate_subdir_offsets() reserved
+ * for it: the children of @dir, then the subtree of each child directory in
+ * turn.  The directories are loaded only while they're being written.  */
 static int
-write_dir_dentries(struct wim_dentry *dir, void *_pp)
+write_unloaded_dir(struct wim_image_metadata *imd, struct wim_dentry *dir,
+		   struct metadata_out *out)
 {
+	struct dentry_arena_mark mark;
+	struct wim_dentry *child;
+	bool loaded;
+	u64 subdir_offset;
+	int ret;
+
+	ret = load_dentry_children_temporarily(imd, dir, &mark, &loaded);
+	if (ret)
+		return ret;
+
+	subdir_offset = dir->d_out_subdir_offset + 8;
+	for_dentry_child(child, dir)
+		subdir_offset += dentry_out_total_length(child);
+	for_dentry_child(child, dir) {
+		if (child->d_children_unloaded) {
+			child->d_out_subdir_offset = subdir_offset;
+			subdir_offset += unloaded_subtree_size(imd, child);
+		}
+	}
+
+	for_dentry_child(child, dir) {
+		ret = write_dentry_to_out(child, out);
+		if (ret)
+			goto out;
+	}
+	ret = write_end_of_dir_to_out(out);
+	if (ret)
+		goto out;
+
+	for_dentry_child(child, dir) {
+		if (child->d_children_unloaded) {
+			ret = write_unloaded_dir(imd, child, out);
+			if (ret)
+				goto out;
+		}
+	}
+out:
+	if (loaded)
+		unload_dentry_children(imd, dir, &mark);
+	return ret;
+}
+
+static int
+write_dir_dentries(struct wim_dentry *dir, void *_ctx)
+{
+	struct write_dentries_ctx *ctx = _ctx;
+
+	if (unlikely(dir->d_children_unloaded))
+		return write_unloaded_dir(ctx->imd, dir, ctx->out);
+
 	if (dir->d_subdir_offset != 0) {
-		u8 **pp = _pp;
-		u8 *p = *pp;
 		struct wim_dentry *child;
+		int ret;
 
 		/* write child dentries */
-		for_dentry_child(child, dir)
-			p = write_dentry(child, p);
+		for_dentry_child(child, dir) {
+			ret = write_dentry_to_out(child, ctx->out);
+			if (ret)
+				return ret;
+		}
 
 		/* write end of directory entry */
-		*(u64*)p = 0;
-		p += 8;
-		*pp = p;
+		return write_end_of_dir_to_out(ctx->out);
 	}
 	return 0;
 }
@@ -1882,27 +2470,40 @@ write_dir_dentries(struct wim_dentry *dir, void *_pp)
 /*
  * Write a directory tree to the metadata resource.
  *
+ * @imd:
+ *	The image to which the tree belongs.  This is used to load any
+ *	directories whose children are unloaded.
+ *
  * @root:
  *	The root of a dentry tree on which calculate_subdir_offsets() has been
  *	called.  This cannot be NULL; if the dentry tree is empty, the caller is
  *	expected to first generate a dummy root directory.
  *
- * @p:
- *	Pointer to a buffer with enough space for the dentry tree.  This size
- *	must have been obtained by calculate_subdir_offsets().
+ * @out:
+ *	The buffer to which to write the dentry tree.  The data will be passed
+ *	on to its callback as the buffer fills up.
  *
- * Returns a pointer to the byte following the last written.
+ * Returns 0 on success, or an error code returned by the callback or from
+ * growing the buffer or loading directories.
  */
-u8 *
-write_dentry_tree(struct wim_dentry *root, u8 *p)
+int
+write_dentry_tree(struct wim_image_metadata *imd, struct wim_dentry *root,
+		  struct metadata_out *out)
 {
+	struct write_dentries_ctx ctx = {
+		.imd = imd,
+		.out = out,
+	};
+	int ret;
+
 	/* write root dentry and end-of-directory entry following it */
-	p = write_dentry(root, p);
-	*(u64*)p = 0;
-	p += 8;
+	ret = write_dentry_to_out(root, out);
+	if (ret)
+		return ret;
+	ret = write_end_of_dir_to_out(out);
+	if (ret)
+		return ret;
 
 	/* write the rest of the dentry tree */
-	for_dentry_in_tree(root, write_dir_dentries, &p);
-
-	return p;
+	return for_dentry_in_tree(root, write_dir_dentries, &ctx);
 }
@@ -24,6 +24,11 @@
 #include <errno.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#include "wimlib/bitops.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
@@ -201,11 +206,121 @@ utf16le_encode_codepoint(u32 c, u8 *out)
 	return 4;
 }
 
+/*
+ * Most filenames consist entirely or mostly of ASCII characters, so
+ * convert_string() handles runs of ASCII characters in bulk instead of passing
+ * each one through the decode and encode functions.  The functions below scan
+ * for the end of an ASCII run and convert one.  They use SSE2 where available,
+ * and otherwise process a word at a time.  (Filenames are too short for wider
+ * vectors to help much.)
+ */
+
+/* Return the number of ASCII characters at the beginning of the string @in. */
+typedef size_t (*ascii_prefix_len_fn)(const u8 *in, size_t in_nbytes);
+
+/* Convert @n ASCII characters from @in and write them to @out.  */
+typedef void (*convert_ascii_fn)(const u8 *in, size_t n, u8 *out);
+
+static forceinline size_t
+utf8_ascii_prefix_len(const u8 *in, size_t in_nbytes)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= in_nbytes; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+		u32 mask = _mm_movemask_epi8(v);
+
+		if (mask)
+			return i + bsf32(mask);
+	}
+#endif
+	for (; i + 8 <= in_nbytes; i += 8) {
+		u64 v = le64_to_cpu(load_le64_unaligned(&in[i]));
+
+		v &= 0x8080808080808080;
+		if (v)
+			return i + bsf64(v) / 8;
+	}
+	while (i < in_nbytes && in[i] < 0x80)
+		i++;
+	return i;
+}
+
+static forceinline size_t
+utf16le_ascii_prefix_len(const u8 *in, size_t in_nbytes)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i non_ascii_bits = _mm_set1_epi16((short)0xFF80);
+
+	for (; i + 16 <= in_nbytes; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+		u32 mask;
+
+		v = _mm_and_si128(v, non_ascii_bits);
+		v = _mm_cmpeq_epi16(v, _mm_setzero_si128());
+		mask = _mm_movemask_epi8(v) ^ 0xFFFF;
+		if (mask)
+			return (i + bsf32(mask)) / 2;
+	}
+#endif
+	for (; i + 8 <= in_nbytes; i += 8) {
+		u64 v = le64_to_cpu(load_le64_unaligned(&in[i]));
+
+		v &= 0xFF80FF80FF80FF80;
+		if (v)
+			return (i + bsf64(v) / 8) / 2;
+	}
+	while (i + 2 <= in_nbytes && get_unaligned_le16(&in[i]) < 0x80)
+		i += 2;
+	return i / 2;
+}
+
+static forceinline void
+utf8_ascii_to_utf16le(const u8 *in, size_t n, u8 *out)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+
+		_mm_storeu_si128((__m128i *)&out[2 * i],
+				 _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+		_mm_storeu_si128((__m128i *)&out[2 * i + 16],
+				 _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+	}
+#endif
+	for (; i < n; i++)
+		put_unaligned_le16(in[i], &out[2 * i]);
+}
+
+static forceinline void
+utf16le_ascii_to_utf8(const u8 *in, size_t n, u8 *out)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)&in[2 * i]);
+		__m128i v2 = _mm_loadu_si128((const __m128i *)&in[2 * i + 16]);
+
+		_mm_storeu_si128((__m128i *)&out[i], _mm_packus_epi16(v1, v2));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = in[2 * i];
+}
+
 /*
  * Convert the string @in of size @in_nbytes from the encoding given by the
  * @decode_codepoint function to the encoding given by the @encode_codepoint
  * function.  @in does not need to be null-terminated, but a null terminator
- * will be added to the output string.
+ * will be added to the output string.  ASCII characters take
+ * @in_ascii_nbytes and @out_ascii_nbytes bytes in the two encodings, and runs
+ * of them are handled by @ascii_prefix_len and @convert_ascii.
  *
  * On success, write the allocated output string to @out_ret (must not be NULL)
  * and its size excluding the null terminator to @out_nbytes_ret (may be NULL).
@@ -218,9 +333,13 @@ convert_string(const u8 * const in, const size_t in_nbytes,
 	       u8 **out_ret, size_t *out_nbytes_ret,
 	       int ilseq_err,
 	       decode_codepoint_fn decode_codepoint,
-	       encode_codepoint_fn encode_codepoint)
+	       encode_codepoint_fn encode_codepoint,
+	       const size_t in_ascii_nbytes, const size_t out_ascii_nbytes,
+	       ascii_prefix_len_fn ascii_prefix_len,
+	       convert_ascii_fn convert_ascii)
 {
 	size_t i;
+	size_t n;
 	u8 *p_out;
 	size_t out_nbytes = 0;
 	u8 *out;
@@ -228,7 +347,12 @@ convert_string(const u8 * const in, const size_t in_nbytes,
 	u32 c;
 
 	/* Validate the input string and compute the output size. */
-	for (i = 0; i < in_nbytes; ) {
+	for (i = 0; ; ) {
+		n = (*ascii_prefix_len)(&in[i], in_nbytes - i);
+		i += n * in_ascii_nbytes;
+		out_nbytes += n * out_ascii_nbytes;
+		if (i >= in_nbytes)
+			break;
 		i += (*decode_codepoint)(&in[i], in_nbytes - i, true, &c);
 		if (unlikely(c == INVALID_CODEPOINT)) {
 			errno = EILSEQ;
@@ -244,7 +368,13 @@ convert_string(const u8 * const in, const size_t in_nbytes,
 
 	/* Do the conversion. */
 	p_out = out;
-	for (i = 0; i < in_nbytes; ) {
+	for (i = 0; ; ) {
+		n = (*ascii_prefix_len)(&in[i], in_nbytes - i);
+		(*convert_ascii)(&in[i], n, p_out);
+		i += n * in_ascii_nbytes;
+		p_out += n * out_ascii_nbytes;
+		if (i >= in_nbytes)
+			break;
 		i += (*decode_codepoint)(&in[i], in_nbytes - i, false, &c);
 		p_out += (*encode_codepoint)(c, p_out);
 	}
@@ -266,7 +396,9 @@ utf8_to_utf16le(const char *in, size_t in_nbytes,
 	return convert_string((const u8 *)in, in_nbytes,
 			      (u8 **)out_ret, out_nbytes_ret,
 			      WIMLIB_ERR_INVALID_UTF8_STRING,
-			      utf8_decode_codepoint, utf16le_encode_codepoint);
+			      utf8_decode_codepoint, utf16le_encode_codepoint,
+			      1, 2, utf8_ascii_prefix_len,
+			      utf8_ascii_to_utf16le);
 }
 
 int
@@ -276,7 +408,9 @@ utf16le_to_utf8(const utf16lechar *in, size_t in_nbytes,
 	return convert_string((const u8 *)in, in_nbytes,
 			      (u8 **)out_ret, out_nbytes_ret,
 			      WIMLIB_ERR_INVALID_UTF16_STRING,
-			      utf16le_decode_codepoint, utf8_encode_codepoint);
+			      utf16le_decode_codepoint, utf8_encode_codepoint,
+			      2, 1, utf16le_ascii_prefix_len,
+			      utf16le_ascii_to_utf8);
 }
 
 /*
@@ -380,7 +514,46 @@ cmp_utf16le_strings(const utf16lechar *s1, size_t n1,
 	size_t n = min(n1, n2);
 
 	if (ignore_case) {
-		for (size_t i = 0; i < n; i++) {
+		size_t i = 0;
+
+	#ifdef __SSE2__
+		/*
+		 * Compare 8 characters at a time while they are all ASCII,
+		 * which is most of the time for filenames.  For ASCII, upcase[]
+		 * maps just 'a' through 'z' to 'A' through 'Z', which is easy
+		 * to do with vector instructions.  Any other characters go
+		 * through upcase[] in the loop below.
+		 */
+		const __m128i non_ascii_bits = _mm_set1_epi16((short)0xFF80);
+		const __m128i before_a = _mm_set1_epi16('a' - 1);
+		const __m128i after_z = _mm_set1_epi16('z' + 1);
+		const __m128i case_bit = _mm_set1_epi16(0x20);
+
+		for (; i + 8 <= n; i += 8) {
+			__m128i v1 = _mm_loadu_si128((const __m128i *)&s1[i]);
+			__m128i v2 = _mm_loadu_si128((const __m128i *)&s2[i]);
+			__m128i t;
+			u32 mask;
+
+			t = _mm_and_si128(_mm_or_si128(v1, v2), non_ascii_bits);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+					t, _mm_setzero_si128())) != 0xFFFF)
+				break;
+			t = _mm_and_si128(_mm_cmpgt_epi16(v1, before_a),
+					  _mm_cmplt_epi16(v1, after_z));
+			v1 = _mm_sub_epi16(v1, _mm_and_si128(t, case_bit));
+			t = _mm_and_si128(_mm_cmpgt_epi16(v2, before_a),
+					  _mm_cmplt_epi16(v2, after_z));
+			v2 = _mm_sub_epi16(v2, _mm_and_si128(t, case_bit));
+
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v1, v2)) ^ 0xFFFF;
+			if (mask) {
+				i += bsf32(mask) / 2;
+				break;
+			}
+		}
+	#endif
+		for (; i < n; i++) {
 			u16 c1 = upcase[le16_to_cpu(s1[i])];
 			u16 c2 = upcase[le16_to_cpu(s2[i])];
 			if (c1 != c2)
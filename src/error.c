@@ -331,6 +331,10 @@ static const tchar * const error_strings[] = {
 		= T("An extended attribute entry in the WIM image is invalid"),
 	[WIMLIB_ERR_SET_XATTR]
 		= T("Failed to set an extended attribute on an extracted file"),
+	[WIMLIB_ERR_INVALID_ARCHIVE]
+		= T("The tar or cpio archive to capture is invalid"),
+	[WIMLIB_ERR_COMPRESSION_WORKER]
+		= T("Failed to communicate with a compression worker"),
 #ifdef ENABLE_TEST_SUPPORT
 	[WIMLIB_ERR_IMAGES_ARE_DIFFERENT]
 		= T("A difference was detected between the two images being compared"),
@@ -28,6 +28,7 @@
 #include "wimlib/error.h"
 #include "wimlib/inode.h"
 #include "wimlib/metadata.h"
+#include "wimlib/resource.h"
 #include "wimlib/xml.h"
 
 static int
@@ -79,8 +80,8 @@ inode_export_blobs(struct wim_inode *inode, struct blob_table *src_blob_table,
 				return blob_not_found_error(inode, hash);
 
 			if (gift) {
-				dest_blob = src_blob;
 				blob_table_unlink(src_blob_table, src_blob);
+				dest_blob = move_blob_descriptor_out_of_slab(src_blob);
 			} else {
 				dest_blob = clone_blob_descriptor(src_blob);
 				if (!dest_blob)
@@ -199,6 +200,14 @@ wimlib_export_image(WIMStruct *src_wim,
 		}
 	}
 
+	/* All the source images will stay loaded, since the destination WIM
+	 * will reference them, so load them in parallel up front.  */
+	if (all_images) {
+		ret = preload_images(src_wim, start_src_image, end_src_image);
+		if (ret)
+			goto out_rollback;
+	}
+
 	/* Export each requested image.  */
 	for (src_image = start_src_image;
 	     src_image <= end_src_image;
@@ -45,9 +45,16 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__i386__) || defined(__x86_64__)
+#  include <immintrin.h>
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
 #include "wimlib/apply.h"
 #include "wimlib/assert.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/cpu_features.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
@@ -60,6 +67,10 @@
 #include "wimlib/reparse.h"
 #include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/stats.h"
+#include "wimlib/textfile.h"
+#include "wimlib/thread_pool.h"
+#include "wimlib/threads.h"
 #include "wimlib/unix_data.h"
 #include "wimlib/wim.h"
 #include "wimlib/win32.h" /* for realpath() equivalent */
@@ -68,6 +79,7 @@
 
 #define WIMLIB_EXTRACT_FLAG_FROM_PIPE   0x80000000
 #define WIMLIB_EXTRACT_FLAG_IMAGEMODE   0x40000000
+#define WIMLIB_EXTRACT_FLAG_ALL_IMAGES  0x20000000
 
 /* Keep in sync with wimlib.h  */
 #define WIMLIB_EXTRACT_MASK_PUBLIC				\
@@ -89,10 +101,13 @@
 	 WIMLIB_EXTRACT_FLAG_NO_ATTRIBUTES		|	\
 	 WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE  |	\
 	 WIMLIB_EXTRACT_FLAG_WIMBOOT			|	\
+	 WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES		|	\
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS4K		|	\
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS8K		|	\
 	 WIMLIB_EXTRACT_FLAG_COMPACT_XPRESS16K		|	\
-	 WIMLIB_EXTRACT_FLAG_COMPACT_LZX			\
+	 WIMLIB_EXTRACT_FLAG_COMPACT_LZX		|	\
+	 WIMLIB_EXTRACT_FLAG_UPDATE			|	\
+	 WIMLIB_EXTRACT_FLAG_TAR				\
 	 )
 
 /* Send WIMLIB_PROGRESS_MSG_EXTRACT_FILE_STRUCTURE or
@@ -143,12 +158,83 @@ end_file_metadata_phase(struct apply_ctx *ctx)
 	return end_file_phase(ctx, WIMLIB_PROGRESS_MSG_EXTRACT_METADATA);
 }
 
-/* Are all bytes in the specified buffer zero? */
+/*
+ * Vectorized checks for whether @size bytes, a multiple of 128, are all zero.
+ * Rather than testing each vector, 128 bytes are ORed together and tested at
+ * once.  Nonzero data is usually found in the first 128 bytes, while runs of
+ * zeroes, which must be scanned in full, are processed as fast as memory
+ * allows.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_IS_ALL_ZEROES_AVX2
+static bool __attribute__((target("avx2")))
+is_all_zeroes_avx2(const u8 *p, size_t size)
+{
+	const u8 * const end = p + size;
+
+	for (; p != end; p += 4 * sizeof(__m256i)) {
+		__m256i v = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((const void *)p),
+					_mm256_loadu_si256((const void *)(p + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((const void *)(p + 64)),
+					_mm256_loadu_si256((const void *)(p + 96))));
+		if (!_mm256_testz_si256(v, v))
+			return false;
+	}
+	return true;
+}
+#elif defined(__ARM_NEON)
+#define HAVE_IS_ALL_ZEROES_NEON
 static bool
-is_all_zeroes(const u8 *p, const size_t size)
+is_all_zeroes_neon(const u8 *p, size_t size)
 {
 	const u8 * const end = p + size;
 
+	for (; p != end; p += 128) {
+		uint8x16_t v = vorrq_u8(vorrq_u8(vorrq_u8(vld1q_u8(p),
+							  vld1q_u8(p + 16)),
+						 vorrq_u8(vld1q_u8(p + 32),
+							  vld1q_u8(p + 48))),
+					vorrq_u8(vorrq_u8(vld1q_u8(p + 64),
+							  vld1q_u8(p + 80)),
+						 vorrq_u8(vld1q_u8(p + 96),
+							  vld1q_u8(p + 112))));
+		uint64x2_t w = vreinterpretq_u64_u8(v);
+
+		if (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1))
+			return false;
+	}
+	return true;
+}
+#endif
+
+/* Are all bytes in the specified buffer zero? */
+static bool
+is_all_zeroes(const u8 *p, size_t size)
+{
+	const u8 *end;
+
+#ifdef HAVE_IS_ALL_ZEROES_AVX2
+	if (cpu_features & X86_CPU_FEATURE_AVX2) {
+		size_t n = size & ~(size_t)127;
+
+		if (!is_all_zeroes_avx2(p, n))
+			return false;
+		p += n;
+		size -= n;
+	}
+#elif defined(HAVE_IS_ALL_ZEROES_NEON)
+	{
+		size_t n = size & ~(size_t)127;
+
+		if (!is_all_zeroes_neon(p, n))
+			return false;
+		p += n;
+		size -= n;
+	}
+#endif
+	end = p + size;
+
 	for (; (uintptr_t)p % WORDBYTES && p != end; p++)
 		if (*p)
 			return false;
@@ -423,12 +509,23 @@ retry:
 	return 0;
 }
 
+/* Should the blob be extracted to a temporary file first, because it has more
+ * targets than the extraction backend can extract it to at once?  */
+static bool
+needs_tmpfile(const struct blob_descriptor *blob,
+	      const struct apply_operations *ops)
+{
+	if (ops->single_blob_target)
+		return blob->out_refcnt > 1;
+	return blob->out_refcnt > MAX_OPEN_FILES && !ops->unlimited_blob_targets;
+}
+
 static int
 begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
 {
 	struct apply_ctx *ctx = _ctx;
 
-	if (unlikely(blob->out_refcnt > MAX_OPEN_FILES))
+	if (unlikely(needs_tmpfile(blob, ctx->apply_ops)))
 		return create_temporary_file(&ctx->tmpfile_fd, &ctx->tmpfile_name);
 
 	return call_begin_blob(blob, ctx->saved_cbs);
@@ -490,7 +587,8 @@ extract_chunk(const struct blob_descriptor *blob, u64 offset,
 /* Copy the blob's data from the temporary file to each of its targets.
  *
  * This is executed only in the very uncommon case that a blob is being
- * extracted to more than MAX_OPEN_FILES targets!  */
+ * extracted to more than MAX_OPEN_FILES targets, or to more than one target by
+ * a backend that sets 'single_blob_target'.  */
 static int
 extract_from_tmpfile(const tchar *tmpfile_name,
 		     const struct blob_descriptor *orig_blob,
@@ -503,6 +601,7 @@ extract_from_tmpfile(const tchar *tmpfile_name,
 	memcpy(&tmpfile_blob, orig_blob, sizeof(struct blob_descriptor));
 	tmpfile_blob.blob_location = BLOB_IN_FILE_ON_DISK;
 	tmpfile_blob.file_on_disk = (tchar *)tmpfile_name;
+	tmpfile_blob.file_data_offset = 0;
 	tmpfile_blob.out_refcnt = 1;
 
 	for (u32 i = 0; i < orig_blob->out_refcnt; i++) {
@@ -565,10 +664,12 @@ end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
  * This also works if the WIM is being read from a pipe.
  *
  * This also will split up blobs that will need to be extracted to more than
- * MAX_OPEN_FILES locations, as measured by the 'out_refcnt' of each blob.
- * Therefore, the apply_operations implementation need not worry about running
- * out of file descriptors, unless it might open more than one file descriptor
- * per 'blob_extraction_target' (e.g. Win32 currently might because the
+ * MAX_OPEN_FILES locations, as measured by the 'out_refcnt' of each blob,
+ * unless the apply_operations set 'unlimited_blob_targets' (or to more than
+ * one location, if they set 'single_blob_target').  Therefore, the
+ * apply_operations implementation need not worry about running out of file
+ * descriptors, unless it might open more than one file descriptor per
+ * 'blob_extraction_target' (e.g. Win32 currently might because the
  * destination file system might not support hard links).
  */
 int
@@ -725,6 +826,12 @@ dentry_delete_from_list(struct wim_dentry *dentry, void *_ignore)
 	if (will_extract_dentry(dentry)) {
 		list_del(&dentry->d_extraction_list_node);
 		dentry_reset_extraction_list_node(dentry);
+		/* The name may have been computed in advance by
+		 * prepare_dentries_in_parallel().  */
+		if ((void *)dentry->d_extraction_name != (void *)dentry->d_name)
+			FREE(dentry->d_extraction_name);
+		dentry->d_extraction_name = NULL;
+		dentry->d_extraction_name_nchars = 0;
 	}
 	return 0;
 }
@@ -787,6 +894,7 @@ destroy_dentry_list(struct list_head *dentry_list)
 		dentry_reset_extraction_list_node(dentry);
 		inode->i_visited = 0;
 		inode->i_can_externally_back = 0;
+		inode->i_unchanged = 0;
 		if ((void *)dentry->d_extraction_name != (void *)dentry->d_name)
 			FREE(dentry->d_extraction_name);
 		dentry->d_extraction_name = NULL;
@@ -885,6 +993,10 @@ dentry_calculate_extraction_name(struct wim_dentry *dentry,
 		}
 	}
 
+	/* Already done by prepare_dentries_in_parallel()?  */
+	if (dentry->d_extraction_name)
+		return 0;
+
 	if (file_name_valid(dentry->d_name, dentry->d_name_nbytes / 2, false)) {
 		size_t nbytes = 0;
 		ret = utf16le_get_tstr(dentry->d_name,
@@ -910,6 +1022,10 @@ dentry_calculate_extraction_name(struct wim_dentry *dentry,
 	}
 
 out_replace:
+	if (dentry->d_extraction_name) {
+		utf16le_put_tstr(dentry->d_extraction_name);
+		dentry->d_extraction_name = NULL;
+	}
 	{
 		utf16lechar utf16_name_copy[dentry->d_name_nbytes / 2];
 
@@ -1175,6 +1291,9 @@ static int
 dentry_ref_streams(struct wim_dentry *dentry, struct apply_ctx *ctx)
 {
 	struct wim_inode *inode = dentry->d_inode;
+
+	if (inode->i_unchanged)
+		return 0;
 	for (unsigned i = 0; i < inode->i_num_streams; i++) {
 		int ret = ref_stream_if_needed(dentry, inode,
 					       &inode->i_streams[i], ctx);
@@ -1285,20 +1404,251 @@ dentry_tally_features(struct wim_dentry *dentry, struct wim_features *features)
 	}
 }
 
-/* Tally the features necessary to extract the specified dentries.  */
+/* Tally the features necessary to extract the specified dentries.  If
+ * @linked_only, the dentries of inodes with only one link were already tallied
+ * by prepare_dentries_in_parallel().  */
 static void
 dentry_list_get_features(struct list_head *dentry_list,
-			 struct wim_features *features)
+			 struct wim_features *features, bool linked_only)
 {
 	struct wim_dentry *dentry;
 
 	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
-		dentry_tally_features(dentry, features);
+		if (!linked_only || dentry->d_inode->i_nlink != 1)
+			dentry_tally_features(dentry, features);
 
 	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
 		dentry->d_inode->i_visited = 0;
 }
 
+/*
+ * Preparing a large dentry list for extraction is parallelized by doing the
+ * parts of the preparation passes that look at one dentry at a time up front,
+ * on the threads of a thread pool, over batches of consecutive dentries:
+ *
+ * - The features needed by dentries of inodes with only one link are tallied,
+ *   into a separate 'struct wim_features' for each job.  Hard-linked inodes
+ *   are left to dentry_list_get_features(), which tallies each inode once.
+ *
+ * - Names which are valid on this platform are converted to extraction names.
+ *   Everything else dentry_calculate_extraction_name() does (case-insensitive
+ *   conflicts, invalid names, skipping) depends on other dentries and the
+ *   order of the list, so it stays serial and only reuses the result.
+ *
+ * - The streams of inodes with only one link are resolved.  A stream whose
+ *   blob is missing is left unresolved for dentry_list_resolve_streams(),
+ *   which reports the error.
+ *
+ * The serial passes then find most of their work already done.  Nothing the
+ * parallel pass does depends on the order of the dentries, and each job writes
+ * only to the dentries of its batches and their unshared inodes.
+ */
+
+/* Don't bother for fewer dentries than this  */
+#define PREPARE_PARALLEL_MIN_DENTRIES	65536
+
+/* Number of dentries in each batch  */
+#define PREPARE_DENTRIES_PER_BATCH	4096
+
+struct prepare_queue {
+	struct mutex lock;
+	struct condvar done_cond;
+	struct wimlib_thread_pool *pool;
+	unsigned cursor;
+	const struct apply_ctx *ctx;
+
+	/* First dentry of each batch, and the list head ending the last one  */
+	struct list_head **batches;
+	size_t num_batches;
+	size_t next_batch;
+	const struct list_head *end;
+
+	unsigned num_pending;
+};
+
+struct prepare_job {
+	struct thread_pool_work work;
+	struct prepare_queue *queue;
+	struct wim_features features;
+};
+
+/* Resolve the streams of an inode, stopping quietly at a missing blob.  */
+static void
+prepare_inode_streams(struct wim_inode *inode, const struct blob_table *table)
+{
+	for (unsigned i = 0; i < inode->i_num_streams; i++) {
+		struct wim_inode_stream *strm = &inode->i_streams[i];
+		const u8 *hash;
+		struct blob_descriptor *blob = NULL;
+
+		if (strm->stream_resolved)
+			continue;
+		hash = stream_hash(strm);
+		if (!is_zero_hash(hash)) {
+			blob = lookup_blob(table, hash);
+			if (!blob)
+				return;
+		}
+		strm->_stream_blob = blob;
+		strm->stream_resolved = 1;
+	}
+}
+
+static void
+prepare_dentry(struct wim_dentry *dentry, struct wim_features *features,
+	       const struct apply_ctx *ctx)
+{
+	struct wim_inode *inode = dentry->d_inode;
+	const tchar *name;
+	size_t nbytes;
+
+	if (inode->i_nlink == 1) {
+		dentry_tally_features(dentry, features);
+		if (!(ctx->extract_flags & WIMLIB_EXTRACT_FLAG_FROM_PIPE))
+			prepare_inode_streams(inode, ctx->wim->blob_table);
+	}
+
+	if (dentry_is_root(dentry))
+		return;
+#ifdef WITH_NTFS_3G
+	if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_NTFS)
+		return;
+#endif
+	if (file_name_valid(dentry->d_name, dentry->d_name_nbytes / 2, false) &&
+	    !utf16le_get_tstr(dentry->d_name, dentry->d_name_nbytes,
+			      &name, &nbytes))
+	{
+		dentry->d_extraction_name = (tchar *)name;
+		dentry->d_extraction_name_nchars = nbytes / sizeof(tchar);
+	}
+}
+
+static void
+prepare_job_run(struct thread_pool_work *work)
+{
+	struct prepare_job *job = container_of(work, struct prepare_job, work);
+	struct prepare_queue *q = job->queue;
+	struct list_head *cur, *end;
+	size_t i;
+
+	mutex_lock(&q->lock);
+	while (q->next_batch != q->num_batches) {
+		i = q->next_batch++;
+		mutex_unlock(&q->lock);
+
+		cur = q->batches[i];
+		end = (i + 1 < q->num_batches) ? q->batches[i + 1] :
+						 (struct list_head *)q->end;
+		for (; cur != end; cur = cur->next) {
+			prepare_dentry(list_entry(cur, struct wim_dentry,
+						  d_extraction_list_node),
+				       &job->features, q->ctx);
+		}
+
+		mutex_lock(&q->lock);
+	}
+	if (--q->num_pending == 0)
+		condvar_signal(&q->done_cond);
+	mutex_unlock(&q->lock);
+}
+
+static void
+add_features(struct wim_features *dst, const struct wim_features *src)
+{
+	unsigned long *d = (unsigned long *)dst;
+	const unsigned long *s = (const unsigned long *)src;
+
+	STATIC_ASSERT(sizeof(*dst) % sizeof(unsigned long) == 0);
+	for (size_t i = 0; i < sizeof(*dst) / sizeof(unsigned long); i++)
+		d[i] += s[i];
+}
+
+/*
+ * Do the parallelizable parts of preparing the dentries in @dentry_list for
+ * extraction, as described above, adding the tallied features to @features.
+ * Returns true if this was done, or false if the list is too small or the
+ * threads couldn't be set up, in which case nothing was done.
+ */
+static bool
+prepare_dentries_in_parallel(struct list_head *dentry_list,
+			     struct wim_features *features,
+			     struct apply_ctx *ctx)
+{
+	struct prepare_queue q = {
+		.ctx = ctx,
+		.end = dentry_list,
+	};
+	struct prepare_job *jobs;
+	struct list_head *cur;
+	size_t count = 0;
+	size_t alloc = 0;
+	unsigned num_jobs;
+	bool ok = false;
+
+	/* Split the list into batches.  */
+	list_for_each(cur, dentry_list) {
+		if (count % PREPARE_DENTRIES_PER_BATCH == 0) {
+			if (q.num_batches == alloc) {
+				struct list_head **batches;
+
+				alloc = max(2 * alloc, 64);
+				batches = REALLOC(q.batches,
+						  alloc * sizeof(batches[0]));
+				if (!batches)
+					goto out_free_batches;
+				q.batches = batches;
+			}
+			q.batches[q.num_batches++] = cur;
+		}
+		count++;
+	}
+	if (count < PREPARE_PARALLEL_MIN_DENTRIES)
+		goto out_free_batches;
+
+	q.pool = ctx->wim->thread_pool;
+	if (q.pool)
+		thread_pool_get(q.pool);
+	else if (thread_pool_create(0, &q.pool))
+		goto out_free_batches;
+	num_jobs = min(thread_pool_num_threads(q.pool), q.num_batches);
+	if (num_jobs <= 1)
+		goto out_put_pool;
+	jobs = CALLOC(num_jobs, sizeof(jobs[0]));
+	if (!jobs)
+		goto out_put_pool;
+	if (!mutex_init(&q.lock))
+		goto out_free_jobs;
+	if (!condvar_init(&q.done_cond))
+		goto out_destroy_lock;
+
+	q.num_pending = num_jobs;
+	for (unsigned i = 0; i < num_jobs; i++) {
+		jobs[i].work.run = prepare_job_run;
+		jobs[i].work.name = "prepare extraction";
+		jobs[i].queue = &q;
+		thread_pool_submit(q.pool, &jobs[i].work, &q.cursor);
+	}
+	mutex_lock(&q.lock);
+	while (q.num_pending)
+		condvar_wait(&q.done_cond, &q.lock);
+	mutex_unlock(&q.lock);
+
+	for (unsigned i = 0; i < num_jobs; i++)
+		add_features(features, &jobs[i].features);
+	ok = true;
+
+	condvar_destroy(&q.done_cond);
+out_destroy_lock:
+	mutex_destroy(&q.lock);
+out_free_jobs:
+	FREE(jobs);
+out_put_pool:
+	thread_pool_put(q.pool);
+out_free_batches:
+	FREE(q.batches);
+	return ok;
+}
+
 static int
 do_feature_check(const struct wim_features *required_features,
 		 const struct wim_features *supported_features,
@@ -1470,6 +1820,8 @@ select_apply_operations(int extract_flags)
 #ifdef _WIN32
 	return &win32_apply_ops;
 #else
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_TAR)
+		return &tar_apply_ops;
 	return &unix_apply_ops;
 #endif
 }
@@ -1480,9 +1832,13 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 {
 	const struct apply_operations *ops;
 	struct apply_ctx *ctx;
+	struct stats_phase phase;
+	bool prepared;
 	int ret;
 	LIST_HEAD(dentry_list);
 
+	stats_begin_phase(&phase);
+
 	if (extract_flags & WIMLIB_EXTRACT_FLAG_TO_STDOUT) {
 		ret = extract_dentries_to_stdout(trees, num_trees,
 						 wim->blob_table,
@@ -1503,6 +1859,15 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 		goto out;
 	}
 
+	if ((extract_flags & WIMLIB_EXTRACT_FLAG_UPDATE) &&
+	    !ops->find_unchanged_files)
+	{
+		ERROR("Updating an existing directory tree is not supported "
+		      "in %s extraction mode!", ops->name);
+		ret = WIMLIB_ERR_UNSUPPORTED;
+		goto out;
+	}
+
 	ctx = CALLOC(1, ops->context_size);
 	if (!ctx) {
 		ret = WIMLIB_ERR_NOMEM;
@@ -1513,15 +1878,21 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 	ctx->target = target;
 	ctx->target_nchars = tstrlen(target);
 	ctx->extract_flags = extract_flags;
+	ctx->all_images = (extract_flags & WIMLIB_EXTRACT_FLAG_ALL_IMAGES) != 0;
 	if (ctx->wim->progfunc) {
 		ctx->progfunc = ctx->wim->progfunc;
 		ctx->progctx = ctx->wim->progctx;
-		ctx->progress.extract.image = wim->current_image;
 		ctx->progress.extract.extract_flags = (extract_flags &
 						       WIMLIB_EXTRACT_MASK_PUBLIC);
 		ctx->progress.extract.wimfile_name = wim->filename;
-		ctx->progress.extract.image_name = wimlib_get_image_name(wim,
-									 wim->current_image);
+		if (ctx->all_images) {
+			ctx->progress.extract.image = 0;
+			ctx->progress.extract.image_name = T("");
+		} else {
+			ctx->progress.extract.image = wim->current_image;
+			ctx->progress.extract.image_name =
+				wimlib_get_image_name(wim, wim->current_image);
+		}
 		ctx->progress.extract.target = target;
 	}
 	INIT_LIST_HEAD(&ctx->blob_list);
@@ -1536,7 +1907,11 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 			  !(extract_flags &
 			    WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE));
 
-	dentry_list_get_features(&dentry_list, &ctx->required_features);
+	prepared = prepare_dentries_in_parallel(&dentry_list,
+						&ctx->required_features, ctx);
+
+	dentry_list_get_features(&dentry_list, &ctx->required_features,
+				 prepared);
 
 	ret = do_feature_check(&ctx->required_features, &ctx->supported_features,
 			       ctx->extract_flags);
@@ -1558,6 +1933,12 @@ extract_trees(WIMStruct *wim, struct wim_dentry **trees, size_t num_trees,
 
 	dentry_list_build_inode_alias_lists(&dentry_list);
 
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_UPDATE) {
+		ret = (*ops->find_unchanged_files)(&dentry_list, ctx);
+		if (ret)
+			goto out_cleanup;
+	}
+
 	ret = dentry_list_ref_streams(&dentry_list, ctx);
 	if (ret)
 		goto out_cleanup;
@@ -1613,6 +1994,9 @@ out_cleanup:
 	destroy_dentry_list(&dentry_list);
 	FREE(ctx);
 out:
+	stats_end_phase(&phase, extract);
+	if (!ret)
+		ret = report_stats(wim->progfunc, wim->progctx);
 	return ret;
 }
 
@@ -1663,6 +2047,19 @@ check_extract_flags(const WIMStruct *wim, int *extract_flags_p)
 	}
 #endif
 
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_TAR) {
+#ifdef _WIN32
+		ERROR("Extracting to a tar archive is only supported on "
+		      "UNIX-like systems!");
+		return WIMLIB_ERR_UNSUPPORTED;
+#else
+		if (extract_flags & (WIMLIB_EXTRACT_FLAG_NTFS |
+				     WIMLIB_EXTRACT_FLAG_TO_STDOUT |
+				     WIMLIB_EXTRACT_FLAG_UPDATE))
+			return WIMLIB_ERR_INVALID_PARAM;
+#endif
+	}
+
 	if (extract_flags & WIMLIB_EXTRACT_FLAG_WIMBOOT) {
 #ifdef _WIN32
 		if (!wim->filename)
@@ -1745,29 +2142,59 @@ append_dentry_cb(struct wim_dentry *dentry, void *_ctx)
 	return 0;
 }
 
-/* Append dentries matched by a path which can contain wildcard characters.  */
+/* Append the dentries matched by paths which can contain wildcard characters.
+ * All the patterns are matched together in one traversal of the image.  */
 static int
-append_matched_dentries(WIMStruct *wim, const tchar *orig_pattern,
-			int extract_flags, struct append_dentry_ctx *ctx)
+append_matched_dentries(WIMStruct *wim, const tchar * const *orig_patterns,
+			size_t num_patterns, int extract_flags,
+			struct append_dentry_ctx *ctx)
 {
-	const size_t count_before = ctx->num_dentries;
-	tchar *pattern;
+	struct string_list patterns = STRING_LIST_INITIALIZER;
+	struct pattern_set *set = NULL;
+	size_t i;
 	int ret;
 
-	pattern = canonicalize_wim_path(orig_pattern);
-	if (!pattern)
+	patterns.strings = CALLOC(num_patterns, sizeof(patterns.strings[0]));
+	if (!patterns.strings)
 		return WIMLIB_ERR_NOMEM;
-	ret = expand_path_pattern(wim_get_current_root_dentry(wim), pattern,
-				  append_dentry_cb, ctx);
-	FREE(pattern);
-	if (ret || ctx->num_dentries > count_before)
-		return ret;
-	if (extract_flags & WIMLIB_EXTRACT_FLAG_STRICT_GLOB) {
-		ERROR("No matches for path pattern \"%"TS"\"", orig_pattern);
-		return WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+	patterns.num_strings = num_patterns;
+	patterns.num_alloc_strings = num_patterns;
+
+	for (i = 0; i < num_patterns; i++) {
+		patterns.strings[i] = canonicalize_wim_path(orig_patterns[i]);
+		if (!patterns.strings[i]) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out;
+		}
 	}
-	WARNING("No matches for path pattern \"%"TS"\"", orig_pattern);
-	return 0;
+
+	ret = new_pattern_set(&patterns, &set);
+	if (ret)
+		goto out;
+
+	ret = expand_pattern_set(wim_get_current_root_dentry(wim), set,
+				 append_dentry_cb, ctx);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < num_patterns; i++) {
+		if (pattern_set_matched(set, patterns.strings[i]))
+			continue;
+		if (extract_flags & WIMLIB_EXTRACT_FLAG_STRICT_GLOB) {
+			ERROR("No matches for path pattern \"%"TS"\"",
+			      orig_patterns[i]);
+			ret = WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+			goto out;
+		}
+		WARNING("No matches for path pattern \"%"TS"\"",
+			orig_patterns[i]);
+	}
+out:
+	free_pattern_set(set);
+	for (i = 0; i < num_patterns; i++)
+		FREE(patterns.strings[i]);
+	FREE(patterns.strings);
+	return ret;
 }
 
 static int
@@ -1787,7 +2214,13 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 	if (ret)
 		return ret;
 
-	ret = select_wim_image(wim, image);
+	/* When extracting specific paths, only the directories along the paths
+	 * and the trees being extracted need to be loaded.  */
+	if (extract_flags & (WIMLIB_EXTRACT_FLAG_IMAGEMODE |
+			     WIMLIB_EXTRACT_FLAG_GLOB_PATHS))
+		ret = select_wim_image(wim, image);
+	else
+		ret = select_wim_image_lazily(wim, image);
 	if (ret)
 		return ret;
 
@@ -1796,6 +2229,7 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 		return ret;
 
 	if ((extract_flags & (WIMLIB_EXTRACT_FLAG_NTFS |
+			      WIMLIB_EXTRACT_FLAG_TAR |
 			      WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE)) ==
 	    (WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE))
 	{
@@ -1812,16 +2246,12 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 			.num_alloc_dentries = 0,
 		};
 
-		for (size_t i = 0; i < num_paths; i++) {
-			ret = append_matched_dentries(wim, paths[i],
-						      extract_flags,
-						      &append_dentry_ctx);
-			if (ret) {
-				trees = append_dentry_ctx.dentries;
-				goto out_free_trees;
-			}
-		}
+		ret = append_matched_dentries(wim, paths, num_paths,
+					      extract_flags,
+					      &append_dentry_ctx);
 		trees = append_dentry_ctx.dentries;
+		if (ret)
+			goto out_free_trees;
 		num_trees = append_dentry_ctx.num_dentries;
 	} else {
 		trees = MALLOC(num_paths * sizeof(trees[0]));
@@ -1846,6 +2276,10 @@ do_wimlib_extract_paths(WIMStruct *wim, int image, const tchar *target,
 				  ret = WIMLIB_ERR_PATH_DOES_NOT_EXIST;
 				  goto out_free_trees;
 			}
+			ret = load_dentry_tree(wim_get_current_image_metadata(wim),
+					       trees[i]);
+			if (ret)
+				goto out_free_trees;
 		}
 		num_trees = num_paths;
 	}
@@ -1889,6 +2323,124 @@ image_name_ok_as_dir(const tchar *image_name)
 		tstrlen(image_name) <= 128;
 }
 
+/* Get the name of the subdirectory to which @image is extracted when all
+ * images are extracted.  @name must have room for 129 characters.  */
+static void
+get_image_dir_name(WIMStruct *wim, int image, tchar *name)
+{
+	const tchar *image_name = wimlib_get_image_name(wim, image);
+
+	if (image_name_ok_as_dir(image_name)) {
+		tstrcpy(name, image_name);
+	} else {
+		/* Image name is empty or contains forbidden characters.  Use
+		 * image number instead. */
+		tsprintf(name, T("%d"), image);
+	}
+}
+
+static int
+clear_full_path(struct wim_dentry *dentry, void *_ignore)
+{
+	FREE(dentry->d_full_path);
+	dentry->d_full_path = NULL;
+	return 0;
+}
+
+/* Make the root directory of an image the root of the image again, after
+ * extract_images_together() linked it into its placeholder root.  */
+static void
+ungraft_image_root(struct wim_dentry *root)
+{
+	unlink_dentry(root);
+	dentry_set_name(root, NULL);
+
+	/* Cached full paths include the image's directory.  */
+	for_dentry_in_tree(root, clear_full_path, NULL);
+}
+
+/*
+ * Extract all images from the WIM as a single directory tree: a placeholder
+ * root directory, standing for @target, with the root directory of each image
+ * linked into it under the name of the image's subdirectory.
+ *
+ * Compared to extracting the images one by one, this reads and decompresses
+ * each blob shared by several images only once, writing it to the files of all
+ * the images at the same time, and the per-file phases of the extraction
+ * process the files of all the images together.  However, the metadata of all
+ * the images needs to be in memory at once.
+ *
+ * Returns 0 or a WIMLIB_ERR_* code, or -1 if the images can't be extracted
+ * together, in which case nothing has been extracted.
+ */
+static int
+extract_images_together(WIMStruct *wim, const tchar *target, int extract_flags)
+{
+	struct wim_dentry *root;
+	struct wim_dentry *image_root;
+	tchar name[128 + 1];
+	int num_pinned = 0;
+	int num_grafted = 0;
+	int image;
+	int ret;
+
+	extract_flags |= WIMLIB_EXTRACT_FLAG_IMAGEMODE;
+	ret = check_extract_flags(wim, &extract_flags);
+	if (ret)
+		return ret;
+
+	ret = new_filler_directory(&root);
+	if (ret)
+		return ret;
+
+	for (image = 1; image <= wim->hdr.image_count; image++) {
+		ret = select_wim_image(wim, image);
+		if (ret)
+			goto out;
+		pin_current_wim_image(wim);
+		num_pinned++;
+	}
+
+	ret = wim_checksum_unhashed_blobs(wim);
+	if (ret)
+		goto out;
+
+	for (image = 1; image <= wim->hdr.image_count; image++) {
+		image_root = wim->image_metadata[image - 1]->root_dentry;
+		if (!image_root) {
+			/* Empty image  */
+			ret = -1;
+			goto out;
+		}
+		get_image_dir_name(wim, image, name);
+		ret = dentry_set_name(image_root, name);
+		if (ret)
+			goto out;
+		if (dentry_add_child(root, image_root)) {
+			/* Two images would be extracted to the same
+			 * directory.  Leave that to the one-by-one
+			 * extraction, which merges them.  */
+			dentry_set_name(image_root, NULL);
+			ret = -1;
+			goto out;
+		}
+		num_grafted = image;
+	}
+
+	ret = extract_trees(wim, &root, 1, target,
+			    extract_flags | WIMLIB_EXTRACT_FLAG_ALL_IMAGES);
+out:
+	for (image = 1; image <= num_grafted; image++) {
+		image_root = wim->image_metadata[image - 1]->root_dentry;
+		if (image_root)
+			ungraft_image_root(image_root);
+	}
+	for (image = 1; image <= num_pinned; image++)
+		unpin_wim_image(wim, image);
+	free_dentry(root);
+	return ret;
+}
+
 /* Extracts all images from the WIM to the directory @target, with the images
  * placed in subdirectories named by their image names. */
 static int
@@ -1898,27 +2450,36 @@ extract_all_images(WIMStruct *wim, const tchar *target, int extract_flags)
 	tchar buf[output_path_len + 1 + 128 + 1];
 	int ret;
 	int image;
-	const tchar *image_name;
 
 	if (extract_flags & WIMLIB_EXTRACT_FLAG_NTFS) {
 		ERROR("Cannot extract multiple images in NTFS extraction mode.");
 		return WIMLIB_ERR_INVALID_PARAM;
 	}
 
+	if (extract_flags & WIMLIB_EXTRACT_FLAG_TAR) {
+		ERROR("Cannot extract multiple images to a tar archive.");
+		return WIMLIB_ERR_INVALID_PARAM;
+	}
+
 	ret = mkdir_if_needed(target);
 	if (ret)
 		return ret;
+
+#ifndef _WIN32
+	/* The Windows backend applies the security descriptors of the
+	 * currently selected image, so there the images must be extracted one
+	 * by one.  */
+	if (wim->hdr.image_count > 1) {
+		ret = extract_images_together(wim, target, extract_flags);
+		if (ret != -1)
+			return ret;
+	}
+#endif
+
 	tmemcpy(buf, target, output_path_len);
 	buf[output_path_len] = OS_PREFERRED_PATH_SEPARATOR;
 	for (image = 1; image <= wim->hdr.image_count; image++) {
-		image_name = wimlib_get_image_name(wim, image);
-		if (image_name_ok_as_dir(image_name)) {
-			tstrcpy(buf + output_path_len + 1, image_name);
-		} else {
-			/* Image name is empty or contains forbidden characters.
-			 * Use image number instead. */
-			tsprintf(buf + output_path_len + 1, T("%d"), image);
-		}
+		get_image_dir_name(wim, image, buf + output_path_len + 1);
 		ret = extract_single_image(wim, image, buf, extract_flags);
 		if (ret)
 			return ret;
@@ -1982,6 +2543,60 @@ wimlib_extract_pathlist(WIMStruct *wim, int image, const tchar *target,
 	return ret;
 }
 
+/*
+ * If @fd is a regular file positioned at the start of a complete pipable WIM,
+ * then open the WIM with random access, like wimlib_open_wim() would; then only
+ * the data of the image being extracted needs to be read.  Returns 0 and sets
+ * *wim_ret to NULL if the WIM has to be read sequentially instead.
+ */
+static int
+open_pwm_with_random_access(int fd, WIMStruct **wim_ret,
+			    wimlib_progress_func_t progfunc, void *progctx)
+{
+	struct stat stbuf;
+	struct filedes in_fd;
+	le64 magic;
+	WIMStruct *wim;
+	int ret;
+
+	*wim_ret = NULL;
+
+	if (fstat(fd, &stbuf) || !S_ISREG(stbuf.st_mode) ||
+	    stbuf.st_size < 2 * WIM_HEADER_DISK_SIZE ||
+	    lseek(fd, 0, SEEK_CUR) != 0)
+		return 0;
+
+	/* A complete pipable WIM ends with a copy of its header, which was
+	 * written last.  If it's missing, e.g. because the WIM is still being
+	 * written, then read sequentially.  */
+	filedes_init(&in_fd, fd);
+	if (full_pread(&in_fd, &magic, sizeof(magic), 0) ||
+	    le64_to_cpu(magic) != PWM_MAGIC ||
+	    full_pread(&in_fd, &magic, sizeof(magic),
+		       stbuf.st_size - WIM_HEADER_DISK_SIZE) ||
+	    le64_to_cpu(magic) != PWM_MAGIC)
+		return 0;
+
+	ret = open_wim_as_WIMStruct(&fd, WIMLIB_OPEN_FLAG_FROM_FD, &wim,
+				    progfunc, progctx);
+	if (ret)
+		return ret;
+
+	/* Parts of a split WIM other than the first can't be extracted from
+	 * on their own, so they still have to be read in order.  */
+	if (wim->hdr.total_parts != 1) {
+		wimlib_free(wim);
+		if (lseek(fd, 0, SEEK_SET) != 0) {
+			ERROR_WITH_ERRNO("Error rewinding pipable WIM");
+			return WIMLIB_ERR_READ;
+		}
+		return 0;
+	}
+
+	*wim_ret = wim;
+	return 0;
+}
+
 WIMLIBAPI int
 wimlib_extract_image_from_pipe_with_progress(int pipe_fd,
 					     const tchar *image_num_or_name,
@@ -1999,6 +2614,13 @@ wimlib_extract_image_from_pipe_with_progress(int pipe_fd,
 	if (extract_flags & ~WIMLIB_EXTRACT_MASK_PUBLIC)
 		return WIMLIB_ERR_INVALID_PARAM;
 
+	/* A pipable WIM that was saved to a file needn't be read in full.  */
+	ret = open_pwm_with_random_access(pipe_fd, &pwm, progfunc, progctx);
+	if (ret)
+		return ret;
+	if (pwm)
+		goto resolve_image;
+
 	/* Read the WIM header from the pipe and get a WIMStruct to represent
 	 * the pipable WIM.  Caveats:  Unlike getting a WIMStruct with
 	 * wimlib_open_wim(), getting a WIMStruct in this way will result in an
@@ -2060,6 +2682,7 @@ wimlib_extract_image_from_pipe_with_progress(int pipe_fd,
 
 	/* Get image index (this may use the XML data that was just read to
 	 * resolve an image name).  */
+resolve_image:
 	if (image_num_or_name) {
 		image = wimlib_resolve_image(pwm, image_num_or_name);
 		if (image == WIMLIB_NO_IMAGE) {
@@ -2082,14 +2705,16 @@ wimlib_extract_image_from_pipe_with_progress(int pipe_fd,
 		image = 1;
 	}
 
-	/* Load the needed metadata resource.  */
-	for (i = 1; i <= pwm->hdr.image_count; i++) {
-		ret = handle_pwm_metadata_resource(pwm, i, i == image);
-		if (ret)
-			goto out_wimlib_free;
+	if (pwm->in_fd.is_pipe) {
+		/* Load the needed metadata resource.  */
+		for (i = 1; i <= pwm->hdr.image_count; i++) {
+			ret = handle_pwm_metadata_resource(pwm, i, i == image);
+			if (ret)
+				goto out_wimlib_free;
+		}
+		extract_flags |= WIMLIB_EXTRACT_FLAG_FROM_PIPE;
 	}
 	/* Extract the image.  */
-	extract_flags |= WIMLIB_EXTRACT_FLAG_FROM_PIPE;
 	ret = do_wimlib_extract_image(pwm, image, target, extract_flags);
 	/* Clean up and return.  */
 out_wimlib_free:
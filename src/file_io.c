@@ -24,10 +24,20 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
+#ifndef _WIN32
+#  include <poll.h>
+#  include <sys/mman.h>
+#endif
 
+#include "wimlib.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
+#include "wimlib/list.h"
+#include "wimlib/stats.h"
+#include "wimlib/threads.h"
 #include "wimlib/util.h"
 
 #ifdef _WIN32
@@ -38,6 +48,400 @@
 #  define pwrite win32_pwrite
 #endif
 
+#ifndef _WIN32
+
+/* Size of the buffer into which a pipe reader thread reads ahead  */
+#define PIPE_READER_BUFFER_SIZE		((size_t)16 << 20)
+
+/*
+ * A thread which keeps a pipe drained into a ring buffer, so that delays in the
+ * data arriving on the pipe, such as from network jitter when the pipe is fed
+ * by a download, overlap with decompressing and extracting the data that has
+ * already arrived, rather than stalling them.
+ *
+ * The reader thread only writes to the free part of the ring buffer, and the
+ * consumer only reads from the filled part, so the data itself is copied
+ * without holding the lock.
+ */
+struct pipe_reader {
+	struct thread thread;
+	int fd;
+
+	/* Protects the fields below, but not the data in @buf  */
+	struct mutex lock;
+
+	/* Signaled when data is added, or the end of the pipe or an error is
+	 * reached  */
+	struct condvar data_avail_cond;
+
+	/* Signaled when data is consumed, or the thread should exit  */
+	struct condvar space_avail_cond;
+
+	u8 *buf;
+	size_t start;
+	size_t used;
+
+	/* Set when the end of the pipe has been reached; @read_errno is
+	 * nonzero if the end was due to a read error.  */
+	bool eof;
+	int read_errno;
+
+	bool terminating;
+};
+
+static bool
+pipe_reader_terminating(struct pipe_reader *r)
+{
+	bool terminating;
+
+	mutex_lock(&r->lock);
+	terminating = r->terminating;
+	mutex_unlock(&r->lock);
+	return terminating;
+}
+
+static void *
+pipe_reader_thread_proc(void *arg)
+{
+	struct pipe_reader *r = arg;
+
+	for (;;) {
+		struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+		size_t pos, len;
+		ssize_t ret;
+
+		mutex_lock(&r->lock);
+		while (r->used == PIPE_READER_BUFFER_SIZE && !r->terminating)
+			condvar_wait(&r->space_avail_cond, &r->lock);
+		if (r->terminating) {
+			mutex_unlock(&r->lock);
+			break;
+		}
+		pos = (r->start + r->used) % PIPE_READER_BUFFER_SIZE;
+		len = min(PIPE_READER_BUFFER_SIZE - r->used,
+			  PIPE_READER_BUFFER_SIZE - pos);
+		mutex_unlock(&r->lock);
+
+		/* Don't block in read() indefinitely, so that the thread can be
+		 * stopped even if no more data arrives.  */
+		ret = poll(&pfd, 1, 100);
+		if (ret == 0 || (ret < 0 && errno == EINTR)) {
+			if (pipe_reader_terminating(r))
+				break;
+			continue;
+		}
+
+		ret = read(r->fd, &r->buf[pos], len);
+
+		mutex_lock(&r->lock);
+		if (ret > 0) {
+			r->used += ret;
+		} else if (ret == 0) {
+			r->eof = true;
+		} else if (errno != EINTR) {
+			r->eof = true;
+			r->read_errno = errno;
+		}
+		condvar_signal(&r->data_avail_cond);
+		mutex_unlock(&r->lock);
+		if (ret <= 0 && r->eof)
+			break;
+	}
+	return NULL;
+}
+
+/* Read @count bytes from the pipe reader's buffer, waiting for the data to
+ * arrive if needed.  If @buf is NULL, the data is discarded.  Return values
+ * are the same as for full_read().  */
+static int
+pipe_reader_read(struct filedes *fd, void *buf, size_t count)
+{
+	struct pipe_reader *r = fd->pipe_reader;
+
+	while (count) {
+		size_t n;
+
+		mutex_lock(&r->lock);
+		while (r->used == 0 && !r->eof)
+			condvar_wait(&r->data_avail_cond, &r->lock);
+		if (r->used == 0) {
+			int read_errno = r->read_errno;
+
+			mutex_unlock(&r->lock);
+			if (read_errno) {
+				errno = read_errno;
+				return WIMLIB_ERR_READ;
+			}
+			errno = EINVAL;
+			return WIMLIB_ERR_UNEXPECTED_END_OF_FILE;
+		}
+		n = min(min(count, r->used), PIPE_READER_BUFFER_SIZE - r->start);
+		mutex_unlock(&r->lock);
+
+		if (buf) {
+			memcpy(buf, &r->buf[r->start], n);
+			buf += n;
+		}
+
+		mutex_lock(&r->lock);
+		r->start = (r->start + n) % PIPE_READER_BUFFER_SIZE;
+		r->used -= n;
+		condvar_signal(&r->space_avail_cond);
+		mutex_unlock(&r->lock);
+
+		count -= n;
+		fd->offset += n;
+	}
+	return 0;
+}
+
+#endif /* !_WIN32 */
+
+/*
+ * Start a thread which reads ahead from the pipe @fd into memory, so that the
+ * pipe keeps being drained while the data already read is being processed.
+ * This is only done on UNIX-like systems.  Returns true if the thread was
+ * started.  The thread is stopped by filedes_stop_pipe_reader() or
+ * filedes_close().
+ */
+bool
+filedes_start_pipe_reader(struct filedes *fd)
+{
+#ifndef _WIN32
+	struct pipe_reader *r;
+
+	if (!fd->is_pipe || fd->pipe_reader)
+		return false;
+
+	r = CALLOC(1, sizeof(*r));
+	if (!r)
+		return false;
+	r->fd = fd->fd;
+	r->buf = MALLOC(PIPE_READER_BUFFER_SIZE);
+	if (!r->buf)
+		goto err_free_reader;
+	MEM_ALLOCATED(io_buffer, PIPE_READER_BUFFER_SIZE);
+	if (!mutex_init(&r->lock))
+		goto err_free_buf;
+	if (!condvar_init(&r->data_avail_cond))
+		goto err_destroy_lock;
+	if (!condvar_init(&r->space_avail_cond))
+		goto err_destroy_data_avail_cond;
+	if (!thread_create(&r->thread, pipe_reader_thread_proc, r))
+		goto err_destroy_space_avail_cond;
+	fd->pipe_reader = r;
+	return true;
+
+err_destroy_space_avail_cond:
+	condvar_destroy(&r->space_avail_cond);
+err_destroy_data_avail_cond:
+	condvar_destroy(&r->data_avail_cond);
+err_destroy_lock:
+	mutex_destroy(&r->lock);
+err_free_buf:
+	FREE(r->buf);
+	MEM_FREED(io_buffer, PIPE_READER_BUFFER_SIZE);
+err_free_reader:
+	FREE(r);
+#endif
+	return false;
+}
+
+/* Stop the thread started by filedes_start_pipe_reader(), if any.  Any data it
+ * read ahead but which hasn't been consumed yet is lost.  */
+void
+filedes_stop_pipe_reader(struct filedes *fd)
+{
+#ifndef _WIN32
+	struct pipe_reader *r = fd->pipe_reader;
+
+	if (!r)
+		return;
+
+	mutex_lock(&r->lock);
+	r->terminating = true;
+	condvar_signal(&r->space_avail_cond);
+	mutex_unlock(&r->lock);
+	thread_join(&r->thread);
+
+	condvar_destroy(&r->space_avail_cond);
+	condvar_destroy(&r->data_avail_cond);
+	mutex_destroy(&r->lock);
+	FREE(r->buf);
+	MEM_FREED(io_buffer, PIPE_READER_BUFFER_SIZE);
+	FREE(r);
+	fd->pipe_reader = NULL;
+#endif
+}
+
+/* Reads through a caller-supplied reader of less than this size are served
+ * from whole blocks of this size, which are cached.  */
+#define READER_BLOCK_SIZE	((size_t)256 << 10)
+
+/* Number of blocks cached per reader  */
+#define READER_NUM_BLOCKS	64
+
+struct reader_block {
+	struct list_head lru_node;
+	u64 index;
+	size_t size;
+	u8 *data;
+};
+
+/*
+ * A WIM file read through callbacks supplied by the library user; see
+ * wimlib_open_wim_from_reader().  Each call to the callbacks may be expensive,
+ * for example a ranged request to remote storage, so small reads, such as those
+ * of the chunks of a compressed resource, are not passed through one at a time.
+ * Instead, the aligned block containing the requested data is read in full and
+ * kept in a small LRU cache, so that reads of nearby data are coalesced into
+ * one request and rereading recently read data makes no request at all.
+ */
+struct filedes_reader {
+	struct wimlib_wim_reader ops;
+
+	/* Protects the block cache.  This is held while a block is being read,
+	 * so that concurrent reads of the same block, such as from multiple
+	 * decompression threads, don't each request it.  */
+	struct mutex lock;
+
+	/* All blocks, most recently used first.  Blocks whose @size is 0 don't
+	 * contain any data yet.  */
+	struct list_head lru_list;
+	struct reader_block blocks[READER_NUM_BLOCKS];
+	u8 *block_data;
+};
+
+/* Read @count bytes at @offset directly with the reader's callback.  */
+static int
+reader_read_at(struct filedes_reader *r, void *buf, size_t count, u64 offset)
+{
+	errno = 0;
+	if ((*r->ops.read_at)(r->ops.ctx, buf, count, offset)) {
+		if (errno == 0)
+			errno = EIO;
+		return WIMLIB_ERR_READ;
+	}
+	return 0;
+}
+
+/* Return the cached block with index @index, reading it if needed.  */
+static int
+reader_get_block(struct filedes_reader *r, u64 index,
+		 struct reader_block **block_ret)
+{
+	struct reader_block *block;
+	u64 offset = index * READER_BLOCK_SIZE;
+	size_t size;
+	int ret;
+
+	list_for_each_entry(block, &r->lru_list, lru_node) {
+		if (block->size != 0 && block->index == index)
+			goto out;
+	}
+
+	block = list_entry(r->lru_list.prev, struct reader_block, lru_node);
+	block->size = 0;
+	size = min(r->ops.size - offset, (u64)READER_BLOCK_SIZE);
+	ret = reader_read_at(r, block->data, size, offset);
+	if (ret)
+		return ret;
+	block->index = index;
+	block->size = size;
+out:
+	list_move(&block->lru_node, &r->lru_list);
+	*block_ret = block;
+	return 0;
+}
+
+static int
+reader_pread(struct filedes_reader *r, void *buf, size_t count, u64 offset)
+{
+	int ret = 0;
+
+	if (offset > r->ops.size || count > r->ops.size - offset) {
+		errno = EINVAL;
+		return WIMLIB_ERR_UNEXPECTED_END_OF_FILE;
+	}
+
+	/* Large reads are already few enough; don't let them flush the
+	 * cache.  */
+	if (count >= READER_BLOCK_SIZE)
+		return reader_read_at(r, buf, count, offset);
+
+	mutex_lock(&r->lock);
+	while (count) {
+		struct reader_block *block;
+		size_t block_offset = offset % READER_BLOCK_SIZE;
+		size_t n;
+
+		ret = reader_get_block(r, offset / READER_BLOCK_SIZE, &block);
+		if (ret)
+			break;
+		n = min(count, block->size - block_offset);
+		memcpy(buf, &block->data[block_offset], n);
+		buf += n;
+		count -= n;
+		offset += n;
+	}
+	mutex_unlock(&r->lock);
+	return ret;
+}
+
+/*
+ * Make @fd read the file through the callbacks in @ops rather than from a file
+ * descriptor.  The callbacks are copied, and the reader's close callback is
+ * called by filedes_close(), or by this function if it fails.
+ */
+int
+filedes_init_reader(struct filedes *fd, const struct wimlib_wim_reader *ops)
+{
+	struct filedes_reader *r;
+
+	r = CALLOC(1, sizeof(*r));
+	if (!r)
+		goto err;
+	r->block_data = MALLOC(READER_NUM_BLOCKS * READER_BLOCK_SIZE);
+	if (!r->block_data)
+		goto err_free_reader;
+	MEM_ALLOCATED(io_buffer, READER_NUM_BLOCKS * READER_BLOCK_SIZE);
+	if (!mutex_init(&r->lock))
+		goto err_free_block_data;
+	INIT_LIST_HEAD(&r->lru_list);
+	for (size_t i = 0; i < READER_NUM_BLOCKS; i++) {
+		r->blocks[i].data = &r->block_data[i * READER_BLOCK_SIZE];
+		list_add_tail(&r->blocks[i].lru_node, &r->lru_list);
+	}
+	r->ops = *ops;
+	filedes_init(fd, -1);
+	fd->reader = r;
+	return 0;
+
+err_free_block_data:
+	FREE(r->block_data);
+	MEM_FREED(io_buffer, READER_NUM_BLOCKS * READER_BLOCK_SIZE);
+err_free_reader:
+	FREE(r);
+err:
+	if (ops->close)
+		(*ops->close)(ops->ctx);
+	return WIMLIB_ERR_NOMEM;
+}
+
+static void
+filedes_close_reader(struct filedes *fd)
+{
+	struct filedes_reader *r = fd->reader;
+
+	if (r->ops.close)
+		(*r->ops.close)(r->ops.ctx);
+	mutex_destroy(&r->lock);
+	FREE(r->block_data);
+	MEM_FREED(io_buffer, READER_NUM_BLOCKS * READER_BLOCK_SIZE);
+	FREE(r);
+	fd->reader = NULL;
+}
+
 /*
  * Wrapper around read() that checks for errors and keeps retrying until all
  * requested bytes have been read or until end-of file has occurred.
@@ -50,6 +454,17 @@
 int
 full_read(struct filedes *fd, void *buf, size_t count)
 {
+	if (fd->reader) {
+		int ret = reader_pread(fd->reader, buf, count, fd->offset);
+		if (ret)
+			return ret;
+		fd->offset += count;
+		return 0;
+	}
+#ifndef _WIN32
+	if (fd->pipe_reader)
+		return pipe_reader_read(fd, buf, count);
+#endif
 	while (count) {
 		ssize_t ret = read(fd->fd, buf, count);
 		if (unlikely(ret <= 0)) {
@@ -61,6 +476,8 @@ full_read(struct filedes *fd, void *buf, size_t count)
 				continue;
 			return WIMLIB_ERR_READ;
 		}
+		STATS_ADD(read_calls, 1);
+		STATS_ADD(read_bytes, ret);
 		buf += ret;
 		count -= ret;
 		fd->offset += ret;
@@ -84,6 +501,13 @@ pipe_read(struct filedes *fd, void *buf, size_t count, off_t offset)
 	}
 
 	/* Manually seek to the requested position.  */
+#ifndef _WIN32
+	if (fd->pipe_reader) {
+		ret = pipe_reader_read(fd, NULL, offset - fd->offset);
+		if (ret)
+			return ret;
+	}
+#endif
 	while (fd->offset != offset) {
 		size_t bytes_to_read = min(offset - fd->offset, BUFFER_SIZE);
 		u8 dummy[bytes_to_read];
@@ -113,9 +537,25 @@ pipe_read(struct filedes *fd, void *buf, size_t count, off_t offset)
 int
 full_pread(struct filedes *fd, void *buf, size_t count, off_t offset)
 {
+	const void *mapped;
+
+	if (unlikely(fd->write_buf_filled) &&
+	    offset + count > fd->offset - fd->write_buf_used &&
+	    filedes_flush(fd))
+		return WIMLIB_ERR_WRITE;
+
 	if (fd->is_pipe)
 		goto is_pipe;
 
+	if (fd->reader)
+		return reader_pread(fd->reader, buf, count, offset);
+
+	mapped = filedes_mapped_range(fd, offset, count);
+	if (mapped) {
+		memcpy(buf, mapped, count);
+		return 0;
+	}
+
 	while (count) {
 		ssize_t ret = pread(fd->fd, buf, count, offset);
 		if (unlikely(ret <= 0)) {
@@ -131,6 +571,8 @@ full_pread(struct filedes *fd, void *buf, size_t count, off_t offset)
 			}
 			return WIMLIB_ERR_READ;
 		}
+		STATS_ADD(read_calls, 1);
+		STATS_ADD(read_bytes, ret);
 		buf += ret;
 		count -= ret;
 		offset += ret;
@@ -141,16 +583,53 @@ is_pipe:
 	return pipe_read(fd, buf, count, offset);
 }
 
+/* For file descriptors with the uncached flag set, data written with
+ * full_write() is written back and dropped from the page cache in pieces of
+ * this size.  */
+#define WRITEBACK_WINDOW_SIZE	((off_t)8 << 20)
+
+/* Drop @size bytes at @offset from the page cache, after waiting for any
+ * writeback of them to complete.  */
+static void
+drop_cached_range(struct filedes *fd, off_t offset, off_t size)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(fd->fd, offset, size,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+	posix_fadvise(fd->fd, offset, size, POSIX_FADV_DONTNEED);
+#endif
+}
+
 /*
- * Wrapper around write() that checks for errors and keeps retrying until all
- * requested bytes have been written.
- *
- * Return values:
- *	WIMLIB_ERR_SUCCESS			(0)
- *	WIMLIB_ERR_WRITE			(errno set)
+ * Called after data has been written to the end of a file descriptor with the
+ * uncached flag set.  For each full window of new data, start writing it back,
+ * then wait for the writeback of the previous window and drop that from the
+ * page cache.  This way, the device is kept busy while at most a couple of
+ * windows of the output are cached at a time.
  */
-int
-full_write(struct filedes *fd, const void *buf, size_t count)
+static void
+writeback_written_data(struct filedes *fd)
+{
+	while (fd->offset - fd->writeback_offset >= WRITEBACK_WINDOW_SIZE) {
+#ifdef HAVE_SYNC_FILE_RANGE
+		sync_file_range(fd->fd, fd->writeback_offset,
+				WRITEBACK_WINDOW_SIZE, SYNC_FILE_RANGE_WRITE);
+#endif
+		if (fd->writeback_offset >= WRITEBACK_WINDOW_SIZE) {
+			drop_cached_range(fd, fd->writeback_offset -
+					      WRITEBACK_WINDOW_SIZE,
+					  WRITEBACK_WINDOW_SIZE);
+		}
+		fd->writeback_offset += WRITEBACK_WINDOW_SIZE;
+	}
+}
+
+/* Write all of @buf to @fd, bypassing the write buffer.  */
+static int
+write_unbuffered(struct filedes *fd, const void *buf, size_t count)
 {
 	while (count) {
 		ssize_t ret = write(fd->fd, buf, count);
@@ -159,13 +638,52 @@ full_write(struct filedes *fd, const void *buf, size_t count)
 				continue;
 			return WIMLIB_ERR_WRITE;
 		}
+		STATS_ADD(write_calls, 1);
+		STATS_ADD(write_bytes, ret);
+		if (unlikely(fd->write_hook))
+			fd->write_hook(buf, ret, fd->offset, true,
+				       fd->write_hook_ctx);
 		buf += ret;
 		count -= ret;
 		fd->offset += ret;
 	}
+	if (unlikely(fd->uncached))
+		writeback_written_data(fd);
 	return 0;
 }
 
+/*
+ * Wrapper around write() that checks for errors and keeps retrying until all
+ * requested bytes have been written.  If @fd has a write buffer, the data may
+ * instead be copied into the buffer, to be written later.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS			(0)
+ *	WIMLIB_ERR_WRITE			(errno set)
+ */
+int
+full_write(struct filedes *fd, const void *buf, size_t count)
+{
+	int ret;
+
+	if (fd->write_buf) {
+		if (count > fd->write_buf_size - fd->write_buf_used) {
+			ret = filedes_flush(fd);
+			if (ret)
+				return ret;
+		}
+		if (count <= fd->write_buf_size - fd->write_buf_used) {
+			memcpy(&fd->write_buf[fd->write_buf_used], buf, count);
+			fd->write_buf_used += count;
+			fd->write_buf_filled = max(fd->write_buf_filled,
+						   fd->write_buf_used);
+			fd->offset += count;
+			return 0;
+		}
+	}
+	return write_unbuffered(fd, buf, count);
+}
+
 
 /*
  * Wrapper around pwrite() that checks for errors and keeps retrying until all
@@ -178,6 +696,21 @@ full_write(struct filedes *fd, const void *buf, size_t count)
 int
 full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset)
 {
+	if (unlikely(fd->write_buf_filled)) {
+		off_t buf_start = fd->offset - fd->write_buf_used;
+
+		/* Data that is still buffered, such as a chunk table that was
+		 * reserved and is now being filled in, is updated in the
+		 * buffer.  */
+		if (offset >= buf_start &&
+		    offset + count <= buf_start + fd->write_buf_filled) {
+			memcpy(&fd->write_buf[offset - buf_start], buf, count);
+			return 0;
+		}
+		if (offset + count > buf_start && filedes_flush(fd))
+			return WIMLIB_ERR_WRITE;
+	}
+
 	while (count) {
 		ssize_t ret = pwrite(fd->fd, buf, count, offset);
 		if (unlikely(ret < 0)) {
@@ -185,6 +718,11 @@ full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset)
 				continue;
 			return WIMLIB_ERR_WRITE;
 		}
+		STATS_ADD(write_calls, 1);
+		STATS_ADD(write_bytes, ret);
+		if (unlikely(fd->write_hook))
+			fd->write_hook(buf, ret, offset, false,
+				       fd->write_hook_ctx);
 		buf += ret;
 		count -= ret;
 		offset += ret;
@@ -198,8 +736,23 @@ off_t filedes_seek(struct filedes *fd, off_t offset)
 		errno = ESPIPE;
 		return -1;
 	}
+	if (fd->write_buf_filled) {
+		off_t buf_start = fd->offset - fd->write_buf_used;
+
+		/* Moving within the buffered data, as when a blob that was
+		 * just written compressed is rewritten uncompressed, doesn't
+		 * require writing out the buffer.  */
+		if (offset >= buf_start &&
+		    offset <= buf_start + fd->write_buf_filled) {
+			fd->write_buf_used = offset - buf_start;
+			fd->offset = offset;
+			return offset;
+		}
+		if (filedes_flush(fd))
+			return -1;
+	}
 	if (fd->offset != offset) {
-		if (lseek(fd->fd, offset, SEEK_SET) == -1)
+		if (!fd->reader && lseek(fd->fd, offset, SEEK_SET) == -1)
 			return -1;
 		fd->offset = offset;
 	}
@@ -208,5 +761,324 @@ off_t filedes_seek(struct filedes *fd, off_t offset)
 
 bool filedes_is_seekable(struct filedes *fd)
 {
-	return !fd->is_pipe && lseek(fd->fd, 0, SEEK_CUR) != -1;
+	return fd->reader ||
+		(!fd->is_pipe && lseek(fd->fd, 0, SEEK_CUR) != -1);
+}
+
+/*
+ * Map the first @size bytes of the file open for reading on @fd into memory, so
+ * that reads of that part of the file can be served from the mapping.  This is
+ * only done on 64-bit platforms other than Windows, since otherwise a large
+ * file might not fit in the address space.  Returns true if the file was
+ * mapped.  The file must not be truncated or written to while it is mapped,
+ * except through the mapping's own file descriptor by code that calls
+ * filedes_unmap() first.
+ */
+bool
+filedes_map(struct filedes *fd, off_t size)
+{
+#ifndef _WIN32
+	void *map;
+
+	if (sizeof(void *) < 8 || fd->is_pipe || fd->reader || fd->map ||
+	    size <= 0 ||
+	    (u64)size > SIZE_MAX)
+		return false;
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd->fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	fd->map = map;
+	fd->map_size = size;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Undo filedes_map(), if the file is mapped.  */
+void
+filedes_unmap(struct filedes *fd)
+{
+#ifndef _WIN32
+	if (fd->map) {
+		munmap((void *)fd->map, fd->map_size);
+		fd->map = NULL;
+		fd->map_size = 0;
+	}
+#endif
+}
+
+/*
+ * Hint that the specified range of the file will be read soon, so that the
+ * kernel can start reading it in asynchronously.  If the range is mapped into
+ * memory, this is done with madvise(); otherwise with posix_fadvise().  This
+ * lets reads of upcoming data be in flight while the current data is being
+ * decompressed or consumed, rather than being issued one at a time.  This does
+ * nothing for pipes or on Windows.
+ */
+void
+filedes_prefetch(const struct filedes *fd, off_t offset, off_t size)
+{
+#ifndef _WIN32
+	if (size <= 0 || fd->is_pipe || fd->reader)
+		return;
+
+	if (fd->map) {
+#if defined(HAVE_MADVISE) && defined(MADV_WILLNEED)
+		uintptr_t page_size, start, end;
+
+		if (!filedes_mapped_range(fd, offset, size))
+			return;
+		page_size = sysconf(_SC_PAGESIZE);
+		start = ((uintptr_t)fd->map + offset) & ~(page_size - 1);
+		end = (uintptr_t)fd->map + offset + size;
+		madvise((void *)start, end - start, MADV_WILLNEED);
+#endif
+	} else {
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+		posix_fadvise(fd->fd, offset, size, POSIX_FADV_WILLNEED);
+#endif
+	}
+#endif /* !_WIN32 */
+}
+
+/*
+ * Copy @size bytes at @in_offset in the file open on @in_fd to the current
+ * position of @out_fd, without passing the data through user space.  This uses
+ * copy_file_range(), which on filesystems that support it (such as XFS and
+ * Btrfs) shares the underlying extents rather than copying the data.  Returns
+ * the number of bytes copied.  This is less than @size if the kernel can't
+ * copy the data this way, for example because the files are on different
+ * filesystems; the caller must then copy the rest itself.  Nothing is copied
+ * this way if @out_fd has a write hook, since the hook needs to see the data.
+ */
+u64
+filedes_copy_range(struct filedes *in_fd, off_t in_offset,
+		   struct filedes *out_fd, u64 size)
+{
+	u64 copied = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (in_fd->is_pipe || in_fd->reader || out_fd->is_pipe ||
+	    out_fd->write_hook || filedes_flush(out_fd))
+		return 0;
+
+	while (copied < size) {
+		loff_t off_in = in_offset + copied;
+		ssize_t ret = copy_file_range(in_fd->fd, &off_in, out_fd->fd,
+					      NULL, min(size - copied, 1 << 30),
+					      0);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		copied += ret;
+		out_fd->offset += ret;
+	}
+	if (unlikely(out_fd->uncached))
+		writeback_written_data(out_fd);
+#endif
+	return copied;
+}
+
+/*
+ * Like filedes_copy_range(), but copy the data to @out_offset in the file open
+ * on @out_fd rather than to its current position, leaving the position alone.
+ * This is safe to use while another thread is writing elsewhere in the file,
+ * provided that @out_fd has no write buffer or write hook.
+ */
+u64
+filedes_copy_range_at(struct filedes *in_fd, off_t in_offset,
+		      struct filedes *out_fd, off_t out_offset, u64 size)
+{
+	u64 copied = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (in_fd->is_pipe || in_fd->reader || out_fd->is_pipe ||
+	    out_fd->write_hook || out_fd->write_buf)
+		return 0;
+
+	while (copied < size) {
+		loff_t off_in = in_offset + copied;
+		loff_t off_out = out_offset + copied;
+		ssize_t ret = copy_file_range(in_fd->fd, &off_in, out_fd->fd,
+					      &off_out,
+					      min(size - copied, 1 << 30), 0);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		copied += ret;
+	}
+#endif
+	return copied;
+}
+
+/*
+ * Give @fd a write buffer of @size bytes, so that data written with
+ * full_write() is collected and written in pieces of up to @size bytes rather
+ * than with one write() call each.  This greatly reduces the number of system
+ * calls when writing many small pieces of data, such as compressed chunks,
+ * which especially matters on network filesystems.  The buffer is flushed
+ * whenever needed to keep full_pread(), full_pwrite(), and filedes_seek()
+ * consistent with the data written so far, and must be flushed with
+ * filedes_flush() or filedes_free_write_buffer() before the file descriptor is
+ * used in any other way.  Returns true if the buffer was allocated.
+ */
+bool
+filedes_set_write_buffer(struct filedes *fd, size_t size)
+{
+	if (fd->write_buf || size == 0)
+		return false;
+	fd->write_buf = MALLOC(size);
+	if (!fd->write_buf)
+		return false;
+	MEM_ALLOCATED(io_buffer, size);
+	fd->write_buf_size = size;
+	fd->write_buf_used = 0;
+	fd->write_buf_filled = 0;
+	return true;
+}
+
+/*
+ * Have @hook called with each piece of data written to @fd from here on out,
+ * at the time it is actually passed to the operating system.  Data that is
+ * still in the write buffer hasn't been passed to the hook yet, so changes made
+ * to it with full_pwrite() are seen only in their final form.  Pass NULL to
+ * remove the hook.
+ */
+void
+filedes_set_write_hook(struct filedes *fd, filedes_write_hook_t hook,
+		       void *ctx)
+{
+	fd->write_hook = hook;
+	fd->write_hook_ctx = ctx;
+}
+
+/* Write any data in @fd's write buffer to the file.  Returns 0 or
+ * WIMLIB_ERR_WRITE (errno set).  */
+int
+filedes_flush(struct filedes *fd)
+{
+	size_t count = fd->write_buf_filled;
+	size_t used = fd->write_buf_used;
+	int ret;
+
+	if (count == 0)
+		return 0;
+	fd->write_buf_used = 0;
+	fd->write_buf_filled = 0;
+	fd->offset -= used;
+	ret = write_unbuffered(fd, fd->write_buf, count);
+	if (ret)
+		return ret;
+	if (used != count) {
+		/* Return to the position filedes_seek() went back to.  */
+		off_t offset = fd->offset - (count - used);
+
+		if (lseek(fd->fd, offset, SEEK_SET) == -1)
+			return WIMLIB_ERR_WRITE;
+		fd->offset = offset;
+	}
+	return 0;
+}
+
+/* Flush and free @fd's write buffer, if it has one.  Returns 0 or
+ * WIMLIB_ERR_WRITE (errno set).  */
+int
+filedes_free_write_buffer(struct filedes *fd)
+{
+	int ret = filedes_flush(fd);
+
+	FREE(fd->write_buf);
+	MEM_FREED(io_buffer, fd->write_buf_size);
+	fd->write_buf = NULL;
+	fd->write_buf_size = 0;
+	return ret;
+}
+
+/*
+ * Keep the data written to @fd with full_write() from here on out of the page
+ * cache, as far as possible: as the data is written, it is written back to the
+ * device and then dropped from the cache.  This does nothing for pipes or on
+ * Windows.  Call filedes_drop_written_data() when done writing to drop the
+ * rest.
+ */
+void
+filedes_set_uncached(struct filedes *fd)
+{
+#ifndef _WIN32
+	if (!fd->is_pipe) {
+		fd->uncached = 1;
+		fd->writeback_offset = fd->offset;
+	}
+#endif
+}
+
+/*
+ * Reserve space in the file open on @fd for the data about to be written up to
+ * offset @end, so that the filesystem can allocate it contiguously rather than
+ * piece by piece as the file grows by appends.  The file size is set to @end,
+ * so the file must be truncated to the size of the data actually written when
+ * done; @preallocated is set to record this.  Failure is ignored.
+ *
+ * As in unix_preallocate(), fallocate() is preferred over posix_fallocate() on
+ * Linux because it fails rather than writing zeroes when the filesystem can't
+ * preallocate space.  On Windows, the file is simply extended, which reserves
+ * the clusters without writing them.
+ */
+void
+filedes_preallocate(struct filedes *fd, u64 end)
+{
+	if (fd->is_pipe || end <= fd->offset)
+		return;
+#ifdef _WIN32
+	if (win32_set_file_size(fd->fd, end) == 0)
+		fd->preallocated = 1;
+#elif defined(HAVE_FALLOCATE)
+	if (fallocate(fd->fd, 0, fd->offset, end - fd->offset) == 0)
+		fd->preallocated = 1;
+#elif defined(HAVE_POSIX_FALLOCATE) && !defined(__linux__)
+	if (posix_fallocate(fd->fd, fd->offset, end - fd->offset) == 0)
+		fd->preallocated = 1;
+#endif
+}
+
+/* Write back all data written to @fd, if it was made uncached by
+ * filedes_set_uncached(), and drop the whole file from the page cache.  This
+ * includes data that was written other than with full_write(), such as headers
+ * updated in place.  */
+void
+filedes_drop_written_data(struct filedes *fd)
+{
+	if (fd->uncached) {
+		drop_cached_range(fd, 0, 0);
+		fd->writeback_offset = fd->offset;
+	}
+}
+
+/* Close the file descriptor, first flushing its write buffer, stopping its pipe
+ * reader thread, and unmapping the file if needed.  For a file read through a
+ * caller-supplied reader, call the reader's close callback instead.  Returns 0
+ * on success or -1 on failure.  */
+int
+filedes_close(struct filedes *fd)
+{
+	int ret = 0;
+
+	if (fd->reader) {
+		filedes_close_reader(fd);
+		return 0;
+	}
+
+	if (filedes_free_write_buffer(fd))
+		ret = -1;
+	filedes_stop_pipe_reader(fd);
+	filedes_unmap(fd);
+	if (close(fd->fd))
+		ret = -1;
+	return ret;
 }
@@ -36,6 +36,7 @@
 #include "wimlib/encoding.h"
 #include "wimlib/error.h"
 #include "wimlib/inode.h"
+#include "wimlib/stats.h"
 #include "wimlib/timestamp.h"
 
 /*
@@ -44,16 +45,10 @@
  */
 const utf16lechar NO_STREAM_NAME[1];
 
-/* Allocate a new inode and associate the specified dentry with it.  */
-struct wim_inode *
-new_inode(struct wim_dentry *dentry, bool set_timestamps)
+static void
+init_inode(struct wim_inode *inode, struct wim_dentry *dentry,
+	   bool set_timestamps)
 {
-	struct wim_inode *inode;
-
-	inode = CALLOC(1, sizeof(struct wim_inode));
-	if (!inode)
-		return NULL;
-
 	inode->i_security_id = -1;
 	/*inode->i_nlink = 0;*/
 	inode->i_rp_flags = WIM_RP_FLAG_NOT_FIXED;
@@ -66,6 +61,35 @@ new_inode(struct wim_dentry *dentry, bool set_timestamps)
 		inode->i_last_write_time = now;
 	}
 	d_associate(dentry, inode);
+}
+
+/* Allocate a new inode and associate the specified dentry with it.  */
+struct wim_inode *
+new_inode(struct wim_dentry *dentry, bool set_timestamps)
+{
+	struct wim_inode *inode;
+
+	inode = CALLOC(1, sizeof(struct wim_inode));
+	if (!inode)
+		return NULL;
+	MEM_ALLOCATED(metadata, sizeof(struct wim_inode));
+	init_inode(inode, dentry, set_timestamps);
+	return inode;
+}
+
+/* Like new_inode(), but allocate the inode from @arena and leave the
+ * timestamps 0.  */
+struct wim_inode *
+new_inode_in_arena(struct wim_dentry *dentry, struct dentry_arena *arena)
+{
+	struct wim_inode *inode;
+
+	inode = dentry_arena_alloc(arena, sizeof(struct wim_inode));
+	if (!inode)
+		return NULL;
+	memset(inode, 0, sizeof(struct wim_inode));
+	inode->i_in_arena = 1;
+	init_inode(inode, dentry, false);
 	return inode;
 }
 
@@ -85,9 +109,13 @@ free_inode(struct wim_inode *inode)
 		FREE(inode->i_streams);
 	if (inode->i_extra)
 		FREE(inode->i_extra);
+	FREE(inode->i_child_index);
 	if (!hlist_unhashed(&inode->i_hlist_node))
 		hlist_del(&inode->i_hlist_node);
-	FREE(inode);
+	if (!inode->i_in_arena) {
+		FREE(inode);
+		MEM_FREED(metadata, sizeof(struct wim_inode));
+	}
 }
 
 static inline void
@@ -57,60 +57,74 @@ inodes_consistent(const struct wim_inode *inode_1,
 			    inode_get_hash_of_unnamed_data_stream(inode_2));
 }
 
-static int
-inode_table_insert(struct wim_dentry *dentry, void *_params)
+/* Return true iff @dentry, whose preliminary inode has the same hard link group
+ * ID as @inode, can be made another name of @inode.  */
+static bool
+can_link_dentry(struct wim_dentry *dentry, struct wim_inode *inode,
+		unsigned long *num_dir_hard_links,
+		unsigned long *num_inconsistent_inodes)
+{
+	const struct wim_inode *d_inode = dentry->d_inode;
+
+	if (unlikely(!inodes_consistent(inode, d_inode))) {
+		(*num_inconsistent_inodes)++;
+		return false;
+	}
+	if (unlikely((d_inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) ||
+		     (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY)))
+	{
+		(*num_dir_hard_links)++;
+		if (*num_dir_hard_links <= MAX_DIR_HARD_LINK_WARNINGS) {
+			WARNING("Unsupported directory hard link "
+				"\"%"TS"\" <=> \"%"TS"\"",
+				dentry_full_path(dentry),
+				inode_any_full_path(inode));
+		} else if (*num_dir_hard_links ==
+			   MAX_DIR_HARD_LINK_WARNINGS + 1)
+		{
+			WARNING("Suppressing additional warnings about "
+				"directory hard links...");
+		}
+		return false;
+	}
+	return true;
+}
+
+static void
+inode_table_insert(struct wim_dentry *dentry, struct inode_fixup_params *params)
 {
-	struct inode_fixup_params *params = _params;
 	struct wim_inode_table *table = &params->inode_table;
 	struct wim_inode *d_inode = dentry->d_inode;
+	struct wim_inode_table_shard *shard;
+	u64 hash;
 	size_t pos;
 	struct wim_inode *inode;
 
 	if (d_inode->i_ino == 0) {
 		hlist_add_head(&d_inode->i_hlist_node, &table->extra_inodes);
-		return 0;
+		return;
 	}
 
 	/* Try adding this dentry to an existing inode.  */
-	pos = hash_inode(table, d_inode->i_ino, 0);
-	hlist_for_each_entry(inode, &table->array[pos], i_hlist_node) {
-		if (inode->i_ino != d_inode->i_ino) {
-			continue;
-		}
-		if (unlikely(!inodes_consistent(inode, d_inode))) {
-			params->num_inconsistent_inodes++;
+	hash = inode_hash(d_inode->i_ino, 0);
+	shard = inode_table_shard(table, hash);
+	pos = hash_inode(shard, hash);
+	hlist_for_each_entry(inode, &shard->array[pos], i_hlist_node) {
+		if (inode->i_ino != d_inode->i_ino)
 			continue;
-		}
-		if (unlikely((d_inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) ||
-			     (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY)))
-		{
-			params->num_dir_hard_links++;
-			if (params->num_dir_hard_links <=
-			    MAX_DIR_HARD_LINK_WARNINGS)
-			{
-				WARNING("Unsupported directory hard link "
-					"\"%"TS"\" <=> \"%"TS"\"",
-					dentry_full_path(dentry),
-					inode_any_full_path(inode));
-			} else if (params->num_dir_hard_links ==
-				   MAX_DIR_HARD_LINK_WARNINGS + 1)
-			{
-				WARNING("Suppressing additional warnings about "
-					"directory hard links...");
-			}
+		if (!can_link_dentry(dentry, inode,
+				     &params->num_dir_hard_links,
+				     &params->num_inconsistent_inodes))
 			continue;
-		}
 		/* Transfer this dentry to the existing inode.  */
 		d_disassociate(dentry);
 		d_associate(dentry, inode);
-		return 0;
+		return;
 	}
 
 	/* Keep this dentry's inode.  */
-	hlist_add_head(&d_inode->i_hlist_node, &table->array[pos]);
-	if (++table->filled > table->capacity)
-		enlarge_inode_table(table);
-	return 0;
+	hlist_add_head(&d_inode->i_hlist_node, &shard->array[pos]);
+	inode_table_shard_inserted(shard);
 }
 
 static void
@@ -130,8 +144,12 @@ build_inode_list(struct wim_inode_table *inode_table,
 		 struct hlist_head *inode_list)
 {
 	hlist_move_all(&inode_table->extra_inodes, inode_list);
-	for (size_t i = 0; i < inode_table->capacity; i++)
-		hlist_move_all(&inode_table->array[i], inode_list);
+	for (size_t i = 0; i < INODE_TABLE_NUM_SHARDS; i++) {
+		struct wim_inode_table_shard *shard = &inode_table->shards[i];
+
+		for (size_t j = 0; j < shard->capacity; j++)
+			hlist_move_all(&shard->array[j], inode_list);
+	}
 }
 
 /* Re-assign inode numbers to the inodes in the list.  */
@@ -145,8 +163,21 @@ reassign_inode_numbers(struct hlist_head *inode_list)
 		inode->i_ino = cur_ino++;
 }
 
+static void
+report_fixup_results(unsigned long num_dir_hard_links,
+		     unsigned long num_inconsistent_inodes,
+		     struct hlist_head *inode_list)
+{
+	if (unlikely(num_dir_hard_links))
+		WARNING("Ignoring %lu directory hard links", num_dir_hard_links);
+
+	if (unlikely(num_inconsistent_inodes || num_dir_hard_links))
+		reassign_inode_numbers(inode_list);
+}
+
 /*
- * Given a WIM image's tree of dentries such that each dentry initially
+ * Given the inodes of a WIM image's tree of dentries, as linked into the list
+ * @inodes by read_dentry_tree(), such that each dentry initially
  * has a unique inode associated with it, determine the actual
  * dentry/inode information.  Following this, a single inode may be named
  * by more than one dentry (usually called a hard link).
@@ -165,12 +196,15 @@ reassign_inode_numbers(struct hlist_head *inode_list)
  *   install.wim for Windows 7.  I try to work around this in the same way
  *   the Microsoft implementation works around this.
  *
+ * Going through the inodes in the order they were read, rather than walking the
+ * tree, is faster since they are laid out in memory in that order.
+ *
  * Returns 0 or WIMLIB_ERR_NOMEM.  On success, the resulting inodes will be
  * appended to the @inode_list, and they will have consistent numbers in their
  * i_ino fields.
  */
 int
-dentry_tree_fix_inodes(struct wim_dentry *root, struct hlist_head *inode_list)
+dentry_tree_fix_inodes(struct hlist_head *inodes, struct hlist_head *inode_list)
 {
 	struct inode_fixup_params params;
 	int ret;
@@ -184,19 +218,202 @@ dentry_tree_fix_inodes(struct wim_dentry *root, struct hlist_head *inode_list)
 	params.num_dir_hard_links = 0;
 	params.num_inconsistent_inodes = 0;
 
-	for_dentry_in_tree(root, inode_table_insert, &params);
+	while (!hlist_empty(inodes)) {
+		struct hlist_node *node = inodes->first;
+
+		hlist_del(node);
+		inode_table_insert(inode_any_dentry(hlist_entry(node,
+							       struct wim_inode,
+							       i_hlist_node)),
+				   &params);
+	}
 
 	/* Generate the resulting list of inodes, and if needed reassign
 	 * the inode numbers.  */
 	build_inode_list(&params.inode_table, inode_list);
 	destroy_inode_table(&params.inode_table);
 
-	if (unlikely(params.num_dir_hard_links))
-		WARNING("Ignoring %lu directory hard links",
-			params.num_dir_hard_links);
+	report_fixup_results(params.num_dir_hard_links,
+			     params.num_inconsistent_inodes, inode_list);
+	return 0;
+}
+
+/*
+ * The same fixup can also be done incrementally, one directory at a time, for
+ * an image whose directories are read lazily with read_dentry_subdir().  In
+ * that case the inodes go into the image's inode list right away, so a separate
+ * hash table maps the hard link group IDs seen so far to their inodes.  The
+ * table entries for each directory are allocated together, so that adding a
+ * directory can fail only before anything has been changed.
+ */
+struct hard_link_group {
+	struct hlist_node hash_node;
+	u64 id;
+	struct wim_inode *inode;
+};
 
-	if (unlikely(params.num_inconsistent_inodes ||
-		     params.num_dir_hard_links))
-		reassign_inode_numbers(inode_list);
+struct hard_link_group_block {
+	struct hard_link_group_block *next;
+	struct hard_link_group groups[];
+};
+
+struct inode_fixup {
+	struct hlist_head *array;
+	size_t capacity;
+	size_t filled;
+	struct hard_link_group_block *blocks;
+	unsigned long num_dir_hard_links;
+	unsigned long num_inconsistent_inodes;
+};
+
+static struct hlist_head *
+hard_link_group_bucket(const struct inode_fixup *fixup, u64 id)
+{
+	return &fixup->array[hash_u64(id) & (fixup->capacity - 1)];
+}
+
+static void
+enlarge_inode_fixup(struct inode_fixup *fixup)
+{
+	const size_t old_capacity = fixup->capacity;
+	struct hlist_head *old_array = fixup->array;
+	struct hlist_head *new_array;
+	struct hard_link_group *group;
+	struct hlist_node *tmp;
+
+	new_array = CALLOC(old_capacity * 2, sizeof(struct hlist_head));
+	if (!new_array)
+		return;
+	fixup->array = new_array;
+	fixup->capacity = old_capacity * 2;
+	for (size_t i = 0; i < old_capacity; i++) {
+		hlist_for_each_entry_safe(group, tmp, &old_array[i], hash_node) {
+			hlist_add_head(&group->hash_node,
+				       hard_link_group_bucket(fixup,
+							      group->id));
+		}
+	}
+	FREE(old_array);
+}
+
+/* Try adding @dentry to an existing inode with the same hard link group ID.  */
+static bool
+link_to_existing_inode(struct inode_fixup *fixup, struct wim_dentry *dentry)
+{
+	u64 id = dentry->d_inode->i_ino;
+	struct hard_link_group *group;
+
+	hlist_for_each_entry(group, hard_link_group_bucket(fixup, id),
+			     hash_node)
+	{
+		if (group->id != id)
+			continue;
+		if (!can_link_dentry(dentry, group->inode,
+				     &fixup->num_dir_hard_links,
+				     &fixup->num_inconsistent_inodes))
+			continue;
+		/* Transfer this dentry to the existing inode.  */
+		d_disassociate(dentry);
+		d_associate(dentry, group->inode);
+		return true;
+	}
+	return false;
+}
+
+static void
+add_hard_link_group(struct inode_fixup *fixup, struct hard_link_group *group,
+		    struct wim_inode *inode)
+{
+	group->id = inode->i_ino;
+	group->inode = inode;
+	hlist_add_head(&group->hash_node,
+		       hard_link_group_bucket(fixup, group->id));
+	if (++fixup->filled > fixup->capacity)
+		enlarge_inode_fixup(fixup);
+}
+
+int
+new_inode_fixup(struct inode_fixup **fixup_ret)
+{
+	struct inode_fixup *fixup;
+
+	fixup = CALLOC(1, sizeof(*fixup));
+	if (!fixup)
+		return WIMLIB_ERR_NOMEM;
+	fixup->capacity = 64;
+	fixup->array = CALLOC(fixup->capacity, sizeof(struct hlist_head));
+	if (!fixup->array) {
+		FREE(fixup);
+		return WIMLIB_ERR_NOMEM;
+	}
+	*fixup_ret = fixup;
 	return 0;
 }
+
+/*
+ * Fix up the inodes of the children of @dir, which have just been read and
+ * each still have a unique inode, against the inodes of the dentries added
+ * previously.  The resulting new inodes are added to the head of @inode_list.
+ *
+ * Returns 0 or WIMLIB_ERR_NOMEM.  On failure, nothing is changed.
+ */
+int
+inode_fixup_add_children(struct inode_fixup *fixup, struct wim_dentry *dir,
+			 struct hlist_head *inode_list)
+{
+	struct hard_link_group_block *block = NULL;
+	struct wim_dentry *child;
+	size_t num_groups = 0;
+
+	for_dentry_child(child, dir)
+		if (child->d_inode->i_ino != 0)
+			num_groups++;
+
+	if (num_groups) {
+		block = MALLOC(sizeof(*block) +
+			       num_groups * sizeof(block->groups[0]));
+		if (!block)
+			return WIMLIB_ERR_NOMEM;
+		block->next = fixup->blocks;
+		fixup->blocks = block;
+		num_groups = 0;
+	}
+
+	for_dentry_child(child, dir) {
+		struct wim_inode *d_inode = child->d_inode;
+
+		if (d_inode->i_ino != 0) {
+			if (link_to_existing_inode(fixup, child))
+				continue;
+			add_hard_link_group(fixup, &block->groups[num_groups++],
+					    d_inode);
+		}
+		/* Keep this dentry's inode.  */
+		hlist_add_head(&d_inode->i_hlist_node, inode_list);
+	}
+	return 0;
+}
+
+void
+free_inode_fixup(struct inode_fixup *fixup)
+{
+	if (fixup) {
+		while (fixup->blocks) {
+			struct hard_link_group_block *next =
+				fixup->blocks->next;
+			FREE(fixup->blocks);
+			fixup->blocks = next;
+		}
+		FREE(fixup->array);
+		FREE(fixup);
+	}
+}
+
+/* Finish an incremental fixup after all directories have been added.  */
+void
+finish_inode_fixup(struct inode_fixup *fixup, struct hlist_head *inode_list)
+{
+	report_fixup_results(fixup->num_dir_hard_links,
+			     fixup->num_inconsistent_inodes, inode_list);
+	free_inode_fixup(fixup);
+}
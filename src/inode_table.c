@@ -31,34 +31,79 @@
 #include "wimlib/list.h"
 #include "wimlib/util.h"
 
-/* Initialize a hash table for hard link detection.  */
+/* Allocate the bucket array of one shard of an inode table.  */
+static int
+init_inode_table_shard(struct wim_inode_table_shard *shard, size_t capacity)
+{
+	shard->array = CALLOC(capacity, sizeof(shard->array[0]));
+	if (!shard->array)
+		return WIMLIB_ERR_NOMEM;
+	if (!mutex_init(&shard->lock)) {
+		FREE(shard->array);
+		return WIMLIB_ERR_NOMEM;
+	}
+	shard->filled = 0;
+	shard->capacity = capacity;
+	return 0;
+}
+
+static void
+destroy_inode_table_shard(struct wim_inode_table_shard *shard)
+{
+	mutex_destroy(&shard->lock);
+	FREE(shard->array);
+}
+
+/* Initialize a hash table for hard link detection.  @capacity is the total
+ * number of inodes the table should hold before having to grow; it is divided
+ * evenly among the shards.  */
 int
 init_inode_table(struct wim_inode_table *table, size_t capacity)
 {
-	capacity = roundup_pow_of_2(capacity);
-	table->array = CALLOC(capacity, sizeof(table->array[0]));
-	if (!table->array)
-		return WIMLIB_ERR_NOMEM;
-	table->filled = 0;
-	table->capacity = capacity;
+	size_t shard_capacity;
+	size_t i;
+	int ret;
+
+	shard_capacity = roundup_pow_of_2(DIV_ROUND_UP(capacity,
+						       INODE_TABLE_NUM_SHARDS));
+	if (shard_capacity < 4)
+		shard_capacity = 4;
+
+	for (i = 0; i < INODE_TABLE_NUM_SHARDS; i++) {
+		ret = init_inode_table_shard(&table->shards[i], shard_capacity);
+		if (ret)
+			goto err;
+	}
+	if (!mutex_init(&table->extra_lock)) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto err;
+	}
 	INIT_HLIST_HEAD(&table->extra_inodes);
 	return 0;
+
+err:
+	while (i--)
+		destroy_inode_table_shard(&table->shards[i]);
+	return ret;
 }
 
 /* Free the memory allocated by init_inode_table().  */
 void
 destroy_inode_table(struct wim_inode_table *table)
 {
-	FREE(table->array);
+	for (size_t i = 0; i < INODE_TABLE_NUM_SHARDS; i++)
+		destroy_inode_table_shard(&table->shards[i]);
+	mutex_destroy(&table->extra_lock);
 }
 
-/* Double the capacity of the inode hash table.  */
-void
-enlarge_inode_table(struct wim_inode_table *table)
+/* Resize a shard's bucket array to @new_capacity, a power of 2.  On allocation
+ * failure the shard is left as it was; it just gets more crowded.  */
+static void
+resize_inode_table_shard(struct wim_inode_table_shard *shard,
+			 size_t new_capacity)
 {
-	const size_t old_capacity = table->capacity;
-	const size_t new_capacity = old_capacity * 2;
-	struct hlist_head *old_array = table->array;
+	const size_t old_capacity = shard->capacity;
+	struct hlist_head *old_array = shard->array;
 	struct hlist_head *new_array;
 	struct wim_inode *inode;
 	struct hlist_node *tmp;
@@ -66,18 +111,50 @@ enlarge_inode_table(struct wim_inode_table *table)
 	new_array = CALLOC(new_capacity, sizeof(struct hlist_head));
 	if (!new_array)
 		return;
-	table->array = new_array;
-	table->capacity = new_capacity;
+	shard->array = new_array;
+	shard->capacity = new_capacity;
 	for (size_t i = 0; i < old_capacity; i++) {
 		hlist_for_each_entry_safe(inode, tmp, &old_array[i], i_hlist_node) {
+			u64 hash = inode_hash(inode->i_ino, inode->i_devno);
+
 			hlist_add_head(&inode->i_hlist_node,
-				       &new_array[hash_inode(table, inode->i_ino,
-							     inode->i_devno)]);
+				       &new_array[hash_inode(shard, hash)]);
 		}
 	}
 	FREE(old_array);
 }
 
+/* Account for an inode just added to @shard, doubling the shard's capacity if
+ * it has become full.  The caller must hold the shard's lock, if the table is
+ * shared between threads.  */
+void
+inode_table_shard_inserted(struct wim_inode_table_shard *shard)
+{
+	if (++shard->filled > shard->capacity)
+		resize_inode_table_shard(shard, shard->capacity * 2);
+}
+
+/*
+ * Grow the table, if needed, so that it can hold about @count inodes without
+ * rehashing.  Scanning code can call this up front with an estimate of the
+ * number of files to be scanned, such as one obtained from statvfs().
+ */
+void
+inode_table_reserve(struct wim_inode_table *table, size_t count)
+{
+	size_t shard_capacity = roundup_pow_of_2(DIV_ROUND_UP(count,
+						INODE_TABLE_NUM_SHARDS));
+
+	for (size_t i = 0; i < INODE_TABLE_NUM_SHARDS; i++) {
+		struct wim_inode_table_shard *shard = &table->shards[i];
+
+		mutex_lock(&shard->lock);
+		if (shard_capacity > shard->capacity)
+			resize_inode_table_shard(shard, shard_capacity);
+		mutex_unlock(&shard->lock);
+	}
+}
+
 /*
  * Allocate a new dentry, with hard link detection.
  *
@@ -111,6 +188,13 @@ enlarge_inode_table(struct wim_inode_table *table)
  *
  * On success, returns 0.  On failure, returns WIMLIB_ERR_NOMEM or an error code
  * resulting from a failed string conversion.
+ *
+ * This may be called by multiple threads concurrently.  Only the lookup and
+ * insertion are serialized, per shard; the caller fills in the rest of the
+ * inode's metadata after this returns.  The one exception is that a directory
+ * inode must have its FILE_ATTRIBUTE_DIRECTORY set before another thread could
+ * look up the same (ino, devno), or the directory hard link check is racy; in
+ * practice directories are never hard linked, so this costs nothing.
  */
 int
 inode_table_new_dentry(struct wim_inode_table *table, const tchar *name,
@@ -119,44 +203,57 @@ inode_table_new_dentry(struct wim_inode_table *table, const tchar *name,
 {
 	struct wim_dentry *dentry;
 	struct wim_inode *inode;
+	struct wim_inode_table_shard *shard;
 	struct hlist_head *list;
 	int ret;
 
 	if (noshare) {
 		/* No hard link detection  */
-		list = &table->extra_inodes;
-	} else {
-		/* Hard link detection  */
-		list = &table->array[hash_inode(table, ino, devno)];
-		hlist_for_each_entry(inode, list, i_hlist_node) {
-			if (inode->i_ino != ino || inode->i_devno != devno)
-				continue;
-			if (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) {
-				WARNING("Not honoring directory hard link "
-					"of \"%"TS"\"",
-					inode_any_full_path(inode));
-				continue;
-			}
-			/* Inode found; use it.  */
-			return new_dentry_with_existing_inode(name, inode,
-							      dentry_ret);
-		}
+		ret = new_dentry_with_new_inode(name, false, &dentry);
+		if (ret)
+			return ret;
+		inode = dentry->d_inode;
+		inode->i_ino = ino;
+		inode->i_devno = devno;
+		mutex_lock(&table->extra_lock);
+		hlist_add_head(&inode->i_hlist_node, &table->extra_inodes);
+		mutex_unlock(&table->extra_lock);
+		*dentry_ret = dentry;
+		return 0;
+	}
 
-		/* Inode not found; create it.  */
+	/* Hard link detection  */
+	shard = inode_table_shard(table, inode_hash(ino, devno));
+	mutex_lock(&shard->lock);
+	list = &shard->array[hash_inode(shard, inode_hash(ino, devno))];
+	hlist_for_each_entry(inode, list, i_hlist_node) {
+		if (inode->i_ino != ino || inode->i_devno != devno)
+			continue;
+		if (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) {
+			WARNING("Not honoring directory hard link "
+				"of \"%"TS"\"",
+				inode_any_full_path(inode));
+			continue;
+		}
+		/* Inode found; use it.  */
+		ret = new_dentry_with_existing_inode(name, inode, dentry_ret);
+		mutex_unlock(&shard->lock);
+		return ret;
 	}
 
+	/* Inode not found; create it.  */
 	ret = new_dentry_with_new_inode(name, false, &dentry);
 	if (ret)
-		return ret;
+		goto out_unlock;
 	inode = dentry->d_inode;
 	inode->i_ino = ino;
 	inode->i_devno = devno;
 	hlist_add_head(&inode->i_hlist_node, list);
-	if (list != &table->extra_inodes)
-		if (++table->filled > table->capacity)
-			enlarge_inode_table(table);
+	inode_table_shard_inserted(shard);
 	*dentry_ret = dentry;
-	return 0;
+out_unlock:
+	mutex_unlock(&shard->lock);
+	return ret;
 }
 
 /*
@@ -179,10 +276,15 @@ inode_table_prepare_inode_list(struct wim_inode_table *table,
 
 	/* Assign inode numbers to the new inodes and move them to the image's
 	 * inode list. */
-	for (size_t i = 0; i < table->capacity; i++) {
-		hlist_for_each_entry_safe(inode, tmp, &table->array[i], i_hlist_node) {
-			inode->i_ino = cur_ino++;
-			hlist_add_head(&inode->i_hlist_node, head);
+	for (size_t i = 0; i < INODE_TABLE_NUM_SHARDS; i++) {
+		struct wim_inode_table_shard *shard = &table->shards[i];
+
+		for (size_t j = 0; j < shard->capacity; j++) {
+			hlist_for_each_entry_safe(inode, tmp, &shard->array[j],
+						  i_hlist_node) {
+				inode->i_ino = cur_ino++;
+				hlist_add_head(&inode->i_hlist_node, head);
+			}
 		}
 	}
 	hlist_for_each_entry_safe(inode, tmp, &table->extra_inodes, i_hlist_node) {
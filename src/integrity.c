@@ -27,6 +27,8 @@
 #  include "config.h"
 #endif
 
+#include <string.h>
+
 #include "wimlib/assert.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
@@ -35,6 +37,7 @@
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/threads.h"
 #include "wimlib/wim.h"
 #include "wimlib/write.h"
 
@@ -82,6 +85,225 @@ calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
 	return 0;
 }
 
+/*
+ * An integrity hasher computes the SHA-1 message digests of the integrity
+ * chunks of a WIM file while the file is being written, from the data passed to
+ * the write hook of the output file descriptor.  write_integrity_table() then
+ * only needs to read back the chunks whose digest isn't known, instead of the
+ * whole file.
+ *
+ * The data of the chunk most recently written to sequentially (at the file
+ * position) is collected in a buffer, so that changes to it don't matter, such
+ * as chunk tables being filled in with full_pwrite() after the resource data
+ * has left the write buffer.  When the sequential writes move on to another
+ * chunk, the digest of the buffered chunk is computed if its data is complete.
+ * Otherwise, or if something written later changes a chunk whose digest was
+ * already computed, the chunk is read back once the sequential writes have
+ * moved on again: late enough that the chunk is usually in its final form, but
+ * early enough that the data is likely to still be cached by the operating
+ * system.
+ */
+struct integrity_hasher {
+	/* The file being written  */
+	struct filedes *fd;
+
+	/* The chunk whose data is being collected in @buf, or ~0 if none  */
+	u32 cur_chunk;
+
+	/* Number of bytes at the start of @cur_chunk that are in @buf, and
+	 * whether they are actually the data in the file  */
+	u32 cur_size;
+	bool cur_valid;
+	u8 *buf;
+
+	/* A chunk to be read back, or ~0 if none  */
+	u32 pending_chunk;
+
+	/* Digests of the chunks, and for each whether it is known  */
+	u8 (*sha1sums)[SHA1_HASH_SIZE];
+	u8 *known;
+	u32 num_alloc_chunks;
+};
+
+static void
+integrity_hasher_set_chunk(struct integrity_hasher *h, u32 i,
+			   const u8 hash[SHA1_HASH_SIZE])
+{
+	if (i >= h->num_alloc_chunks) {
+		u32 n = max(i + 1, 2 * h->num_alloc_chunks);
+		void *sha1sums, *known;
+
+		sha1sums = REALLOC(h->sha1sums, n * sizeof(h->sha1sums[0]));
+		if (!sha1sums)
+			return;
+		h->sha1sums = sha1sums;
+		known = REALLOC(h->known, n);
+		if (!known)
+			return;
+		memset((u8 *)known + h->num_alloc_chunks, 0,
+		       n - h->num_alloc_chunks);
+		h->known = known;
+		h->num_alloc_chunks = n;
+	}
+	copy_hash(h->sha1sums[i], hash);
+	h->known[i] = 1;
+}
+
+static bool
+integrity_hasher_chunk_known(const struct integrity_hasher *h, u32 i)
+{
+	return i < h->num_alloc_chunks && h->known[i];
+}
+
+/* Compute the digest of a chunk from the data in the file.  This is only done
+ * from sequential writes, when the write buffer of the file is empty.  */
+static void
+integrity_hasher_reread_chunk(struct integrity_hasher *h, u32 i)
+{
+	u8 hash[SHA1_HASH_SIZE];
+
+	if (!calculate_chunk_sha1(h->fd, INTEGRITY_CHUNK_SIZE,
+				  WIM_HEADER_DISK_SIZE +
+				  (u64)i * INTEGRITY_CHUNK_SIZE, hash))
+		integrity_hasher_set_chunk(h, i, hash);
+}
+
+/* A sequential write is about to write to chunk @i at @offset_in_chunk, which
+ * is not the current chunk.  */
+static void
+integrity_hasher_move_to_chunk(struct integrity_hasher *h, u32 i,
+			       u32 offset_in_chunk)
+{
+	u32 incomplete = ~(u32)0;
+
+	if (h->cur_chunk != ~(u32)0) {
+		if (h->cur_valid && h->cur_size == INTEGRITY_CHUNK_SIZE) {
+			u8 hash[SHA1_HASH_SIZE];
+
+			sha1(h->buf, INTEGRITY_CHUNK_SIZE, hash);
+			integrity_hasher_set_chunk(h, h->cur_chunk, hash);
+		} else {
+			incomplete = h->cur_chunk;
+		}
+	}
+
+	/* Read back the pending chunk, unless the sequential writes have gone
+	 * back before it and are likely to write it again.  */
+	if (h->pending_chunk < i &&
+	    !integrity_hasher_chunk_known(h, h->pending_chunk))
+		integrity_hasher_reread_chunk(h, h->pending_chunk);
+	h->pending_chunk = incomplete;
+
+	/* Start the buffer of the new chunk with the data already in the file,
+	 * such as when appending to a WIM file in place.  */
+	h->cur_chunk = i;
+	h->cur_size = offset_in_chunk;
+	h->cur_valid = true;
+	if (offset_in_chunk != 0 &&
+	    full_pread(h->fd, h->buf, offset_in_chunk,
+		       WIM_HEADER_DISK_SIZE + (u64)i * INTEGRITY_CHUNK_SIZE))
+		h->cur_valid = false;
+}
+
+static void
+integrity_hasher_write_hook(const void *buf, size_t count, off_t offset,
+			    bool sequential, void *_h)
+{
+	struct integrity_hasher *h = _h;
+	const u8 *p = buf;
+	u64 pos = offset;
+	u64 end = pos + count;
+
+	/* The header isn't covered by the integrity table.  */
+	if (end <= WIM_HEADER_DISK_SIZE)
+		return;
+	if (pos < WIM_HEADER_DISK_SIZE) {
+		p += WIM_HEADER_DISK_SIZE - pos;
+		pos = WIM_HEADER_DISK_SIZE;
+	}
+
+	while (pos < end) {
+		u32 i = (pos - WIM_HEADER_DISK_SIZE) / INTEGRITY_CHUNK_SIZE;
+		u32 off = (pos - WIM_HEADER_DISK_SIZE) % INTEGRITY_CHUNK_SIZE;
+		u32 n = min(end - pos, INTEGRITY_CHUNK_SIZE - off);
+
+		if (i < h->num_alloc_chunks)
+			h->known[i] = 0;
+
+		if (sequential && i != h->cur_chunk)
+			integrity_hasher_move_to_chunk(h, i, off);
+
+		if (i == h->cur_chunk) {
+			if (h->cur_valid && off <= h->cur_size) {
+				memcpy(&h->buf[off], p, n);
+				h->cur_size = max(h->cur_size, off + n);
+			} else {
+				h->cur_valid = false;
+			}
+		} else if (i < h->cur_chunk &&
+			   h->pending_chunk == ~(u32)0) {
+			h->pending_chunk = i;
+		}
+		p += n;
+		pos += n;
+	}
+}
+
+/* Get the digest of the chunk @i of size @size, if the hasher knows it.  */
+static bool
+integrity_hasher_get_chunk(const struct integrity_hasher *h, u32 i,
+			   size_t size, u8 hash[SHA1_HASH_SIZE])
+{
+	if (i == h->cur_chunk) {
+		if (!h->cur_valid || h->cur_size < size)
+			return false;
+		sha1(h->buf, size, hash);
+		return true;
+	}
+	if (size != INTEGRITY_CHUNK_SIZE || !integrity_hasher_chunk_known(h, i))
+		return false;
+	copy_hash(hash, h->sha1sums[i]);
+	return true;
+}
+
+/* Start computing the integrity table of the WIM file being written to
+ * @wim->out_fd as the data is written.  If this fails due to lack of memory,
+ * write_integrity_table() just reads back the whole file as usual.  */
+void
+start_integrity_hasher(WIMStruct *wim)
+{
+	struct integrity_hasher *h;
+
+	h = CALLOC(1, sizeof(*h));
+	if (!h)
+		return;
+	h->buf = MALLOC(INTEGRITY_CHUNK_SIZE);
+	if (!h->buf) {
+		FREE(h);
+		return;
+	}
+	h->fd = &wim->out_fd;
+	h->cur_chunk = ~(u32)0;
+	h->pending_chunk = ~(u32)0;
+	wim->integrity_hasher = h;
+	filedes_set_write_hook(&wim->out_fd, integrity_hasher_write_hook, h);
+}
+
+void
+stop_integrity_hasher(WIMStruct *wim)
+{
+	struct integrity_hasher *h = wim->integrity_hasher;
+
+	if (h) {
+		filedes_set_write_hook(&wim->out_fd, NULL, NULL);
+		FREE(h->buf);
+		FREE(h->sha1sums);
+		FREE(h->known);
+		FREE(h);
+		wim->integrity_hasher = NULL;
+	}
+}
+
 
 /*
  * read_integrity_table: -  Reads the integrity table from a WIM file.
@@ -160,6 +382,10 @@ read_integrity_table(WIMStruct *wim, u64 num_checked_bytes,
  *	If @old_table is non-NULL, the byte after the last byte that was checked
  *	in the old table.  Must be less than or equal to new_check_end.
  *
+ * @hasher:
+ *	If non-NULL, an integrity hasher that has seen the data written to the
+ *	file, from which the digests of some chunks can be taken.
+ *
  * @integrity_table_ret:
  *	On success, a pointer to the calculated integrity table is written into
  *	this location.
@@ -175,6 +401,7 @@ calculate_integrity_table(struct filedes *in_fd,
 			  off_t new_check_end,
 			  const struct integrity_table *old_table,
 			  off_t old_check_end,
+			  const struct integrity_hasher *hasher,
 			  struct integrity_table **integrity_table_ret,
 			  wimlib_progress_func_t progfunc,
 			  void *progctx)
@@ -240,6 +467,13 @@ calculate_integrity_table(struct filedes *in_fd,
 			/* Can use SHA1 message digest from old integrity table
 			 * */
 			copy_hash(new_table->sha1sums[i], old_table->sha1sums[i]);
+		} else if (hasher && chunk_size == INTEGRITY_CHUNK_SIZE &&
+			   integrity_hasher_get_chunk(hasher, i,
+						      this_chunk_size,
+						      new_table->sha1sums[i]))
+		{
+			/* The SHA1 message digest of this chunk was computed
+			 * from the data as it was written.  */
 		} else {
 			/* Calculate the SHA1 message digest of this chunk */
 			ret = calculate_chunk_sha1(in_fd, this_chunk_size,
@@ -305,8 +539,16 @@ write_integrity_table(WIMStruct *wim,
 
 	wimlib_assert(old_blob_table_end <= new_blob_table_end);
 
+	/* Pass any buffered data through the integrity hasher first.  */
+	ret = filedes_flush(&wim->out_fd);
+	if (ret) {
+		ERROR_WITH_ERRNO("Error writing data to WIM file");
+		return ret;
+	}
+
 	ret = calculate_integrity_table(&wim->out_fd, new_blob_table_end,
 					old_table, old_blob_table_end,
+					wim->integrity_hasher,
 					&new_table, wim->progfunc, wim->progctx);
 	if (ret)
 		return ret;
@@ -330,10 +572,163 @@ write_integrity_table(WIMStruct *wim,
 	return ret;
 }
 
+/* Maximum number of threads used to verify an integrity table  */
+#define MAX_INTEGRITY_THREADS	16
+
+/* The result of a chunk that hasn't been checked yet  */
+#define CHUNK_PENDING		(-100)
+
+/*
+ * State shared by the threads verifying an integrity table in parallel.  Each
+ * thread repeatedly takes the next chunk that nobody has started on, reads and
+ * hashes it, and records whether it matched.  The calling thread collects the
+ * results in order, so that progress is reported the same way as when the
+ * chunks are verified one by one, and stops the other threads at the first
+ * bad chunk or error.
+ */
+struct integrity_verifier {
+	struct filedes *in_fd;
+	const struct integrity_table *table;
+	u64 bytes_to_check;
+
+	struct mutex lock;
+	struct condvar chunk_done_cond;
+	u32 next_chunk;
+	bool terminating;
+
+	/* For each chunk, CHUNK_PENDING, WIM_INTEGRITY_OK,
+	 * WIM_INTEGRITY_NOT_OK, or a positive error code  */
+	int *results;
+};
+
+static size_t
+integrity_chunk_size(const struct integrity_table *table, u64 bytes_to_check,
+		     u32 i)
+{
+	if (i == table->num_entries - 1)
+		return MODULO_NONZERO(bytes_to_check, table->chunk_size);
+	return table->chunk_size;
+}
+
+static int
+verify_chunk(struct filedes *in_fd, const struct integrity_table *table,
+	     u64 bytes_to_check, u32 i)
+{
+	u8 sha1_md[SHA1_HASH_SIZE];
+	int ret;
+
+	ret = calculate_chunk_sha1(in_fd,
+				   integrity_chunk_size(table, bytes_to_check,
+							i),
+				   WIM_HEADER_DISK_SIZE +
+				   (u64)i * table->chunk_size, sha1_md);
+	if (ret)
+		return ret;
+	if (!hashes_equal(sha1_md, table->sha1sums[i]))
+		return WIM_INTEGRITY_NOT_OK;
+	return WIM_INTEGRITY_OK;
+}
+
+static void *
+integrity_verifier_thread_proc(void *arg)
+{
+	struct integrity_verifier *v = arg;
+
+	mutex_lock(&v->lock);
+	while (!v->terminating && v->next_chunk < v->table->num_entries) {
+		u32 i = v->next_chunk++;
+		int result;
+
+		mutex_unlock(&v->lock);
+		result = verify_chunk(v->in_fd, v->table, v->bytes_to_check, i);
+		mutex_lock(&v->lock);
+		v->results[i] = result;
+		condvar_broadcast(&v->chunk_done_cond);
+	}
+	mutex_unlock(&v->lock);
+	return NULL;
+}
+
+/* Start threads to verify the chunks.  Returns the number of threads started,
+ * which is 0 if the chunks should be verified by the calling thread instead.  */
+static unsigned
+start_integrity_verifier(struct integrity_verifier *v,
+			 struct thread threads[MAX_INTEGRITY_THREADS])
+{
+	unsigned num_threads;
+	unsigned num_started = 0;
+
+	/* A file read through a caller-supplied reader, or a pipe, can't be
+	 * read from multiple threads.  */
+	if (v->in_fd->reader || v->in_fd->is_pipe)
+		return 0;
+
+	num_threads = min(get_available_cpus(), MAX_INTEGRITY_THREADS);
+	num_threads = min(num_threads, v->table->num_entries);
+	if (num_threads < 2)
+		return 0;
+
+	v->results = MALLOC(v->table->num_entries * sizeof(v->results[0]));
+	if (!v->results)
+		goto err;
+	for (u32 i = 0; i < v->table->num_entries; i++)
+		v->results[i] = CHUNK_PENDING;
+	if (!mutex_init(&v->lock))
+		goto err_free_results;
+	if (!condvar_init(&v->chunk_done_cond))
+		goto err_destroy_lock;
+	v->next_chunk = 0;
+	v->terminating = false;
+
+	while (num_started < num_threads &&
+	       thread_create(&threads[num_started],
+			     integrity_verifier_thread_proc, v))
+		num_started++;
+	if (num_started)
+		return num_started;
+
+	condvar_destroy(&v->chunk_done_cond);
+err_destroy_lock:
+	mutex_destroy(&v->lock);
+err_free_results:
+	FREE(v->results);
+err:
+	return 0;
+}
+
+static void
+stop_integrity_verifier(struct integrity_verifier *v,
+			struct thread threads[], unsigned num_threads)
+{
+	mutex_lock(&v->lock);
+	v->terminating = true;
+	mutex_unlock(&v->lock);
+	for (unsigned i = 0; i < num_threads; i++)
+		thread_join(&threads[i]);
+	condvar_destroy(&v->chunk_done_cond);
+	mutex_destroy(&v->lock);
+	FREE(v->results);
+}
+
+/* Wait for the result of chunk @i from the verifier threads.  */
+static int
+integrity_verifier_result(struct integrity_verifier *v, u32 i)
+{
+	int result;
+
+	mutex_lock(&v->lock);
+	while ((result = v->results[i]) == CHUNK_PENDING)
+		condvar_wait(&v->chunk_done_cond, &v->lock);
+	mutex_unlock(&v->lock);
+	return result;
+}
+
 /*
  * verify_integrity():
  *
- * Checks a WIM for consistency with the integrity table.
+ * Checks a WIM for consistency with the integrity table.  The chunks are read
+ * and hashed by multiple threads if multiple CPUs are available, but progress
+ * is still reported in order, from the calling thread.
  *
  * @in_fd:
  *	File descriptor to the WIM file, opened for reading.
@@ -358,9 +753,10 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 		 wimlib_progress_func_t progfunc, void *progctx)
 {
 	int ret;
-	u64 offset = WIM_HEADER_DISK_SIZE;
-	u8 sha1_md[SHA1_HASH_SIZE];
 	union wimlib_progress_info progress;
+	struct integrity_verifier v;
+	struct thread threads[MAX_INTEGRITY_THREADS];
+	unsigned num_threads;
 
 	progress.integrity.total_bytes      = bytes_to_check;
 	progress.integrity.total_chunks     = table->num_entries;
@@ -374,31 +770,33 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 	if (ret)
 		return ret;
 
+	v.in_fd = in_fd;
+	v.table = table;
+	v.bytes_to_check = bytes_to_check;
+	num_threads = start_integrity_verifier(&v, threads);
+
+	ret = WIM_INTEGRITY_OK;
 	for (u32 i = 0; i < table->num_entries; i++) {
-		size_t this_chunk_size;
-		if (i == table->num_entries - 1)
-			this_chunk_size = MODULO_NONZERO(bytes_to_check,
-							 table->chunk_size);
+		if (num_threads)
+			ret = integrity_verifier_result(&v, i);
 		else
-			this_chunk_size = table->chunk_size;
-
-		ret = calculate_chunk_sha1(in_fd, this_chunk_size, offset, sha1_md);
+			ret = verify_chunk(in_fd, table, bytes_to_check, i);
 		if (ret)
-			return ret;
-
-		if (!hashes_equal(sha1_md, table->sha1sums[i]))
-			return WIM_INTEGRITY_NOT_OK;
+			break;
 
-		offset += this_chunk_size;
 		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
+		progress.integrity.completed_bytes +=
+			integrity_chunk_size(table, bytes_to_check, i);
 
 		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
 				    &progress, progctx);
 		if (ret)
-			return ret;
+			break;
 	}
-	return WIM_INTEGRITY_OK;
+
+	if (num_threads)
+		stop_integrity_verifier(&v, threads, num_threads);
+	return ret;
 }
 
 
@@ -81,6 +81,49 @@ get_default_stream_type(const struct wim_inode *inode)
 	return STREAM_TYPE_DATA;
 }
 
+struct image_iterate_dir_tree_ctx {
+	const tchar *path;
+	int flags;
+	wimlib_iterate_dir_tree_callback_t cb;
+	void *user_ctx;
+
+	/* Buffer holding the full path of the directory entry being visited,
+	 * which is built up one component at a time as the tree is descended
+	 * rather than computed from scratch for every entry.  */
+	tchar *full_path;
+	size_t full_path_len;
+	size_t full_path_alloc;
+
+	/* Buffer for the wimlib_dir_entry passed to the callback, reused for
+	 * each directory entry  */
+	struct wimlib_dir_entry *wdentry;
+	size_t wdentry_alloc;
+};
+
+/* Append a path separator and @name to the full path in @ctx.  */
+static int
+append_path_component(struct image_iterate_dir_tree_ctx *ctx,
+		      const tchar *name)
+{
+	size_t name_len = tstrlen(name);
+	size_t needed = ctx->full_path_len + 1 + name_len + 1;
+
+	if (needed > ctx->full_path_alloc) {
+		size_t new_alloc = max(needed, 2 * ctx->full_path_alloc);
+		tchar *new_buf = REALLOC(ctx->full_path,
+					 new_alloc * sizeof(tchar));
+
+		if (!new_buf)
+			return WIMLIB_ERR_NOMEM;
+		ctx->full_path = new_buf;
+		ctx->full_path_alloc = new_alloc;
+	}
+	ctx->full_path[ctx->full_path_len++] = WIM_PATH_SEPARATOR;
+	tmemcpy(&ctx->full_path[ctx->full_path_len], name, name_len + 1);
+	ctx->full_path_len += name_len;
+	return 0;
+}
+
 static int
 init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 		   WIMStruct *wim, int flags)
@@ -97,25 +140,22 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 	if (ret)
 		return ret;
 
-	ret = utf16le_get_tstr(dentry->d_short_name, dentry->d_short_name_nbytes,
-			       &wdentry->dos_name, NULL);
-	if (ret)
-		return ret;
-
-	ret = calculate_dentry_full_path(dentry);
-	if (ret)
-		return ret;
-	wdentry->full_path = dentry->d_full_path;
-
-	for (struct wim_dentry *d = dentry; !dentry_is_root(d); d = d->d_parent)
-		wdentry->depth++;
+	if (!(flags & WIMLIB_ITERATE_DIR_TREE_FLAG_NO_EXTRA_METADATA)) {
+		ret = utf16le_get_tstr(dentry->d_short_name,
+				       dentry->d_short_name_nbytes,
+				       &wdentry->dos_name, NULL);
+		if (ret)
+			return ret;
 
-	if (inode_has_security_descriptor(inode)) {
-		struct wim_security_data *sd;
+		if (inode_has_security_descriptor(inode)) {
+			struct wim_security_data *sd;
 
-		sd = wim_get_current_security_data(wim);
-		wdentry->security_descriptor = sd->descriptors[inode->i_security_id];
-		wdentry->security_descriptor_size = sd->sizes[inode->i_security_id];
+			sd = wim_get_current_security_data(wim);
+			wdentry->security_descriptor =
+				sd->descriptors[inode->i_security_id];
+			wdentry->security_descriptor_size =
+				sd->sizes[inode->i_security_id];
+		}
 	}
 	wdentry->reparse_tag = inode->i_reparse_tag;
 	wdentry->num_links = inode->i_nlink;
@@ -134,18 +174,23 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 					 &wdentry->last_access_time,
 					 &wdentry->last_access_time_high);
 
-	if (inode_get_unix_data(inode, &unix_data)) {
-		wdentry->unix_uid = unix_data.uid;
-		wdentry->unix_gid = unix_data.gid;
-		wdentry->unix_mode = unix_data.mode;
-		wdentry->unix_rdev = unix_data.rdev;
-	}
-	object_id = inode_get_object_id(inode, &object_id_len);
-	if (unlikely(object_id != NULL)) {
-		memcpy(&wdentry->object_id, object_id,
-		       min(object_id_len, sizeof(wdentry->object_id)));
+	if (!(flags & WIMLIB_ITERATE_DIR_TREE_FLAG_NO_EXTRA_METADATA)) {
+		if (inode_get_unix_data(inode, &unix_data)) {
+			wdentry->unix_uid = unix_data.uid;
+			wdentry->unix_gid = unix_data.gid;
+			wdentry->unix_mode = unix_data.mode;
+			wdentry->unix_rdev = unix_data.rdev;
+		}
+		object_id = inode_get_object_id(inode, &object_id_len);
+		if (unlikely(object_id != NULL)) {
+			memcpy(&wdentry->object_id, object_id,
+			       min(object_id_len, sizeof(wdentry->object_id)));
+		}
 	}
 
+	if (flags & WIMLIB_ITERATE_DIR_TREE_FLAG_NO_STREAMS)
+		return 0;
+
 	strm = inode_get_unnamed_stream(inode, get_default_stream_type(inode));
 	if (strm) {
 		ret = stream_to_wimlib_stream_entry(inode, strm,
@@ -155,6 +200,9 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 			return ret;
 	}
 
+	if (flags & WIMLIB_ITERATE_DIR_TREE_FLAG_UNNAMED_STREAM_ONLY)
+		return 0;
+
 	for (unsigned i = 0; i < inode->i_num_streams; i++) {
 
 		strm = &inode->i_streams[i];
@@ -174,82 +222,148 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 	return 0;
 }
 
+/* Release the strings of a wimlib_dir_entry initialized by
+ * init_wimlib_dentry(), so that its buffer can be reused.  */
 static void
-free_wimlib_dentry(struct wimlib_dir_entry *wdentry)
+release_wimlib_dentry(struct wimlib_dir_entry *wdentry)
 {
 	utf16le_put_tstr(wdentry->filename);
 	utf16le_put_tstr(wdentry->dos_name);
 	for (unsigned i = 1; i <= wdentry->num_named_streams; i++)
 		utf16le_put_tstr(wdentry->streams[i].stream_name);
-	FREE(wdentry);
 }
 
+/* Get a zeroed wimlib_dir_entry with room for @num_streams stream entries.
+ * The buffer is reused for all directory entries, since each one is only
+ * needed until the callback has been called on it.  */
+static struct wimlib_dir_entry *
+get_wimlib_dentry(struct image_iterate_dir_tree_ctx *ctx, unsigned num_streams)
+{
+	size_t size = sizeof(struct wimlib_dir_entry) +
+		      num_streams * sizeof(struct wimlib_stream_entry);
+
+	if (size > ctx->wdentry_alloc) {
+		size_t new_alloc = max(size, 2 * ctx->wdentry_alloc);
+
+		FREE(ctx->wdentry);
+		ctx->wdentry = MALLOC(new_alloc);
+		ctx->wdentry_alloc = ctx->wdentry ? new_alloc : 0;
+		if (!ctx->wdentry)
+			return NULL;
+	}
+	memset(ctx->wdentry, 0, size);
+	return ctx->wdentry;
+}
+
+/*
+ * Visit @dentry, which is at the given @depth in the tree, and, if requested,
+ * its descendants.  On entry, ctx->full_path must contain the full path of the
+ * parent of @dentry, or an empty string if @dentry's parent is the root
+ * directory or @dentry is the root directory itself.  (The full path isn't
+ * maintained with WIMLIB_ITERATE_DIR_TREE_FLAG_NO_FULL_PATH.)
+ */
 static int
-do_iterate_dir_tree(WIMStruct *wim,
-		    struct wim_dentry *dentry, int flags,
-		    wimlib_iterate_dir_tree_callback_t cb,
-		    void *user_ctx)
+do_iterate_dir_tree(WIMStruct *wim, struct wim_dentry *dentry, int flags,
+		    unsigned depth, struct image_iterate_dir_tree_ctx *ctx)
 {
 	struct wimlib_dir_entry *wdentry;
-	int ret = WIMLIB_ERR_NOMEM;
-
+	size_t parent_path_len = ctx->full_path_len;
+	int ret;
 
-	wdentry = CALLOC(1, sizeof(struct wimlib_dir_entry) +
-				  (1 + dentry->d_inode->i_num_streams) *
-					sizeof(struct wimlib_stream_entry));
-	if (wdentry == NULL)
-		goto out;
+	wdentry = get_wimlib_dentry(ctx, 1 + dentry->d_inode->i_num_streams);
+	if (!wdentry)
+		return WIMLIB_ERR_NOMEM;
 
 	ret = init_wimlib_dentry(wdentry, dentry, wim, flags);
 	if (ret)
-		goto out_free_wimlib_dentry;
+		goto out_release_wimlib_dentry;
 
-	if (!(flags & WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN)) {
-		ret = (*cb)(wdentry, user_ctx);
+	if (!(flags & WIMLIB_ITERATE_DIR_TREE_FLAG_NO_FULL_PATH)) {
+		ret = append_path_component(ctx, wdentry->filename);
 		if (ret)
-			goto out_free_wimlib_dentry;
+			goto out_release_wimlib_dentry;
+		wdentry->full_path = ctx->full_path;
 	}
+	wdentry->depth = depth;
+
+	if (!(flags & WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN))
+		ret = (*ctx->cb)(wdentry, ctx->user_ctx);
+	release_wimlib_dentry(wdentry);
+	if (ret)
+		goto out;
 
 	if (flags & (WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE |
 		     WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN))
 	{
+		struct wim_image_metadata *imd =
+			wim_get_current_image_metadata(wim);
+		struct dentry_arena_mark mark;
+		bool loaded;
 		struct wim_dentry *child;
 
-		ret = 0;
+		/* If the image is being loaded lazily, the children are only
+		 * needed until they've been visited.  */
+		ret = load_dentry_children_temporarily(imd, dentry, &mark,
+						       &loaded);
+		if (ret)
+			goto out;
+		/* The root directory's path is just a separator, which its
+		 * children's paths mustn't repeat.  */
+		if (dentry_is_root(dentry))
+			ctx->full_path_len = 0;
 		for_dentry_child(child, dentry) {
 			ret = do_iterate_dir_tree(wim, child,
 						  flags & ~WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN,
-						  cb, user_ctx);
+						  depth + 1, ctx);
 			if (ret)
 				break;
 		}
+		if (loaded)
+			unload_dentry_children(imd, dentry, &mark);
 	}
-out_free_wimlib_dentry:
-	FREE(dentry->d_full_path);
-	dentry->d_full_path = NULL;
-	free_wimlib_dentry(wdentry);
+	goto out;
+
+out_release_wimlib_dentry:
+	release_wimlib_dentry(wdentry);
 out:
+	ctx->full_path_len = parent_path_len;
 	return ret;
 }
 
-struct image_iterate_dir_tree_ctx {
-	const tchar *path;
-	int flags;
-	wimlib_iterate_dir_tree_callback_t cb;
-	void *user_ctx;
-};
-
-
 static int
 image_do_iterate_dir_tree(WIMStruct *wim)
 {
 	struct image_iterate_dir_tree_ctx *ctx = wim->private;
 	struct wim_dentry *dentry;
+	struct wim_dentry *parent;
+	unsigned depth = 0;
+	int ret;
 
 	dentry = get_dentry(wim, ctx->path, WIMLIB_CASE_PLATFORM_DEFAULT);
 	if (dentry == NULL)
 		return WIMLIB_ERR_PATH_DOES_NOT_EXIST;
-	return do_iterate_dir_tree(wim, dentry, ctx->flags, ctx->cb, ctx->user_ctx);
+
+	for (struct wim_dentry *d = dentry; !dentry_is_root(d); d = d->d_parent)
+		depth++;
+
+	/* Start with the full path of the parent directory.  */
+	ctx->full_path_len = 0;
+	parent = dentry->d_parent;
+	if (!dentry_is_root(dentry) && !dentry_is_root(parent) &&
+	    !(ctx->flags & WIMLIB_ITERATE_DIR_TREE_FLAG_NO_FULL_PATH))
+	{
+		ret = calculate_dentry_full_path(parent);
+		if (ret)
+			return ret;
+		ctx->full_path_len = tstrlen(parent->d_full_path);
+		ctx->full_path_alloc = ctx->full_path_len + 1;
+		FREE(ctx->full_path);
+		ctx->full_path = memdup(parent->d_full_path,
+					ctx->full_path_alloc * sizeof(tchar));
+		if (!ctx->full_path)
+			return WIMLIB_ERR_NOMEM;
+	}
+	return do_iterate_dir_tree(wim, dentry, ctx->flags, depth, ctx);
 }
 
 /* API function documented in wimlib.h  */
@@ -263,7 +377,11 @@ wimlib_iterate_dir_tree(WIMStruct *wim, int image, const tchar *_path,
 
 	if (flags & ~(WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE |
 		      WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN |
-		      WIMLIB_ITERATE_DIR_TREE_FLAG_RESOURCES_NEEDED))
+		      WIMLIB_ITERATE_DIR_TREE_FLAG_RESOURCES_NEEDED |
+		      WIMLIB_ITERATE_DIR_TREE_FLAG_NO_FULL_PATH |
+		      WIMLIB_ITERATE_DIR_TREE_FLAG_NO_EXTRA_METADATA |
+		      WIMLIB_ITERATE_DIR_TREE_FLAG_UNNAMED_STREAM_ONLY |
+		      WIMLIB_ITERATE_DIR_TREE_FLAG_NO_STREAMS))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	path = canonicalize_wim_path(_path);
@@ -276,7 +394,9 @@ wimlib_iterate_dir_tree(WIMStruct *wim, int image, const tchar *_path,
 		.user_ctx = user_ctx,
 	};
 	wim->private = &ctx;
-	ret = for_image(wim, image, image_do_iterate_dir_tree);
+	ret = for_image_lazily(wim, image, image_do_iterate_dir_tree);
+	FREE(ctx.full_path);
+	FREE(ctx.wdentry);
 	FREE(path);
 	return ret;
 }
@@ -28,6 +28,11 @@
 #include <limits.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#include "wimlib/bitops.h"
 #include "wimlib/compress_common.h"
 #include "wimlib/compressor_ops.h"
 #include "wimlib/error.h"
@@ -1193,13 +1198,31 @@ lzms_init_delta_matchfinder(struct lzms_compressor *c)
 		c->next_delta_hashes[i] = 0;
 }
 
+/*
+ * Subtract each byte of @b from the corresponding byte of @a, modulo 256.  This
+ * computes several byte differences at once without letting borrows propagate
+ * from one byte to the next.
+ */
+static forceinline machine_word_t
+lzms_bytewise_sub(machine_word_t a, machine_word_t b)
+{
+	const machine_word_t h = (machine_word_t)0x8080808080808080;
+
+	return ((a | h) - (b & ~h)) ^ ((a ^ ~b) & h);
+}
+
 /*
  * Compute a DELTA_HASH_ORDER-bit hash code for the first
  * NBYTES_HASHED_FOR_DELTA bytes of the sequence beginning at @p when taken in a
  * delta context with the specified @span.
+ *
+ * All NBYTES_HASHED_FOR_DELTA byte differences are computed at once from two
+ * 32-bit loads starting one byte before each sequence.  @p_word must be
+ * get_unaligned_le32(@p - 1); it is the same for all spans, so the caller loads
+ * it just once per position.  @p - @span - 1 must be within the input buffer.
  */
 static forceinline u32
-lzms_delta_hash(const u8 *p, const u32 pos, u32 span)
+lzms_delta_hash(u32 p_word, const u8 *p, const u32 pos, u32 span)
 {
 	/* A delta match has a certain span and an offset that is a multiple of
 	 * that span.  To reduce wasted space we use a single combined hash
@@ -1208,11 +1231,9 @@ lzms_delta_hash(const u8 *p, const u32 pos, u32 span)
 	 * of the current position.  */
 
 	STATIC_ASSERT(NBYTES_HASHED_FOR_DELTA == 3);
-	u8 d0 = *(p + 0) - *(p + 0 - span);
-	u8 d1 = *(p + 1) - *(p + 1 - span);
-	u8 d2 = *(p + 2) - *(p + 2 - span);
-	u32 v = ((span + (pos & (span - 1))) << 24) |
-		((u32)d2 << 16) | ((u32)d1 << 8) | d0;
+	u32 d = (u32)lzms_bytewise_sub(p_word,
+				       get_unaligned_le32(p - 1 - span)) >> 8;
+	u32 v = ((span + (pos & (span - 1))) << 24) | d;
 	return lz_hash(v, DELTA_HASH_ORDER);
 }
 
@@ -1225,6 +1246,36 @@ static forceinline u32
 lzms_extend_delta_match(const u8 *in_next, const u8 *matchptr,
 			u32 len, u32 max_len, u32 span)
 {
+#ifdef __SSE2__
+	/* Compare 16 byte differences at a time.  */
+	while (max_len - len >= 16) {
+		__m128i a = _mm_sub_epi8(
+			_mm_loadu_si128((const void *)(in_next + len)),
+			_mm_loadu_si128((const void *)(in_next + len - span)));
+		__m128i b = _mm_sub_epi8(
+			_mm_loadu_si128((const void *)(matchptr + len)),
+			_mm_loadu_si128((const void *)(matchptr + len - span)));
+		u32 diff = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFF;
+
+		if (diff)
+			return len + bsf32(diff);
+		len += 16;
+	}
+#else
+	/* Compare a word's worth of byte differences at a time.  */
+	if (UNALIGNED_ACCESS_IS_FAST && CPU_IS_LITTLE_ENDIAN()) {
+		while (max_len - len >= WORDBYTES) {
+			machine_word_t diff =
+				lzms_bytewise_sub(load_word_unaligned(in_next + len),
+						  load_word_unaligned(in_next + len - span)) ^
+				lzms_bytewise_sub(load_word_unaligned(matchptr + len),
+						  load_word_unaligned(matchptr + len - span));
+			if (diff)
+				return len + (bsfw(diff) >> 3);
+			len += WORDBYTES;
+		}
+	}
+#endif
 	while (len < max_len &&
 	       (u8)(*(in_next + len) - *(in_next + len - span)) ==
 	       (u8)(*(matchptr + len) - *(matchptr + len - span)))
@@ -1242,12 +1293,14 @@ lzms_delta_matchfinder_skip_bytes(struct lzms_compressor *c,
 	if (unlikely(c->in_nbytes - (pos + count) <= NBYTES_HASHED_FOR_DELTA + 1))
 		return;
 	do {
+		const u32 next_word = get_unaligned_le32(in_next);
 		/* Update the hash table for each power.  */
 		for (u32 power = 0; power < NUM_POWERS_TO_CONSIDER; power++) {
 			const u32 span = (u32)1 << power;
 			if (unlikely(pos < span))
 				continue;
-			const u32 next_hash = lzms_delta_hash(in_next + 1, pos + 1, span);
+			const u32 next_hash = lzms_delta_hash(next_word, in_next + 1,
+							      pos + 1, span);
 			const u32 hash = c->next_delta_hashes[power];
 			c->delta_hash_table[hash] =
 				(power << DELTA_SOURCE_POWER_SHIFT) | pos;
@@ -1297,6 +1350,11 @@ lzms_skip_bytes(struct lzms_compressor *c, u32 count, const u8 *in_next)
  * codes can change over this part of the data.  And of course, there are
  * various other reasons why the result isn't optimal in terms of compression
  * ratio.
+ *
+ * Highly repetitive data, such as runs of zeroes or repeated records, is not a
+ * bad case for this algorithm.  Any match of at least nice_match_len bytes is
+ * taken immediately, extended with lz_extend(), and skipped over, so such data
+ * costs little more than building the suffix array, which then dominates.
  */
 static void
 lzms_near_optimal_parse(struct lzms_compressor *c)
@@ -1714,6 +1772,7 @@ begin:
 		    likely(in_end - in_next >= NBYTES_HASHED_FOR_DELTA + 1))
 		{
 			const u32 pos = in_next - c->in_buffer;
+			const u32 next_word = get_unaligned_le32(in_next);
 
 			/* Consider each possible power (log2 of span)  */
 			STATIC_ASSERT(NUM_POWERS_TO_CONSIDER <= LZMS_NUM_DELTA_POWER_SYMS);
@@ -1724,7 +1783,9 @@ begin:
 				if (unlikely(pos < span))
 					continue;
 
-				const u32 next_hash = lzms_delta_hash(in_next + 1, pos + 1, span);
+				const u32 next_hash = lzms_delta_hash(next_word,
+								      in_next + 1,
+								      pos + 1, span);
 				const u32 hash = c->next_delta_hashes[power];
 				const u32 cur_match = c->delta_hash_table[hash];
 
@@ -2129,7 +2190,7 @@ lzms_create_compressor(size_t max_bufsize, unsigned compression_level,
 	if (max_bufsize > LZMS_MAX_BUFFER_SIZE)
 		return WIMLIB_ERR_INVALID_PARAM;
 
-	c = ALIGNED_MALLOC(sizeof(struct lzms_compressor), 64);
+	c = LARGE_MALLOC(sizeof(struct lzms_compressor));
 	if (!c)
 		goto oom0;
 
@@ -2164,7 +2225,7 @@ oom2:
 	if (!c->destructive)
 		FREE(c->in_buffer);
 oom1:
-	ALIGNED_FREE(c);
+	LARGE_FREE(c);
 oom0:
 	return WIMLIB_ERR_NOMEM;
 }
@@ -2217,7 +2278,7 @@ lzms_free_compressor(void *_c)
 	if (!c->destructive)
 		FREE(c->in_buffer);
 	lcpit_matchfinder_destroy(&c->mf);
-	ALIGNED_FREE(c);
+	LARGE_FREE(c);
 }
 
 const struct compressor_ops lzms_compressor_ops = {
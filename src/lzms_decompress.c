@@ -512,11 +512,13 @@ lzms_decode_bit(struct lzms_range_decoder *rd, u32 *state_p, u32 num_states,
 static void
 lzms_build_huffman_code(struct lzms_huffman_rebuild_info *rebuild_info)
 {
-	make_canonical_huffman_code(rebuild_info->num_syms,
-				    LZMS_MAX_CODEWORD_LENGTH,
-				    rebuild_info->freqs,
-				    (u8 *)rebuild_info->decode_table,
-				    rebuild_info->codewords);
+	/* Only the codeword lengths are needed to build the decode table, so
+	 * don't bother generating the codewords.  */
+	make_canonical_huffman_code_lens(rebuild_info->num_syms,
+					 LZMS_MAX_CODEWORD_LENGTH,
+					 rebuild_info->freqs,
+					 (u8 *)rebuild_info->decode_table,
+					 rebuild_info->codewords);
 
 	make_huffman_decode_table(rebuild_info->decode_table,
 				  rebuild_info->num_syms,
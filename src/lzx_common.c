@@ -25,15 +25,14 @@
 
 #include <string.h>
 
-#ifdef __SSE2__
-#  include <emmintrin.h>
-#endif
-
-#ifdef __AVX2__
+#if defined(__i386__) || defined(__x86_64__)
 #  include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
 #endif
 
 #include "wimlib/bitops.h"
+#include "wimlib/cpu_features.h"
 #include "wimlib/endianness.h"
 #include "wimlib/lzx_common.h"
 #include "wimlib/unaligned.h"
@@ -140,6 +139,119 @@ undo_translate_target(void *target, s32 input_pos)
 	}
 }
 
+/*
+ * Functions to find the next E8 byte, a 32-byte block at a time.  Starting at
+ * the 32-byte aligned pointer @p, each skips the blocks that contain no E8
+ * bytes and returns a pointer to the first one that does, with a bitmask of its
+ * E8 bytes in *e8_mask_ret.  The caller must make sure that an E8 byte is found
+ * before the end of the buffer.
+ */
+#if defined(__SSE2__) || defined(__AVX2__)
+#define HAVE_FIND_E8_BLOCK
+static forceinline u8 *
+find_e8_block(u8 *p, u32 *e8_mask_ret)
+{
+#ifdef __AVX2__
+	const __m256i e8_bytes = _mm256_set1_epi8(0xE8);
+	u32 e8_mask;
+
+	for (;;) {
+		__m256i bytes = *(const __m256i *)p;
+		__m256i cmpresult = _mm256_cmpeq_epi8(bytes, e8_bytes);
+
+		e8_mask = _mm256_movemask_epi8(cmpresult);
+		if (e8_mask)
+			break;
+		p += 32;
+	}
+#else
+	const __m128i e8_bytes = _mm_set1_epi8(0xE8);
+	u32 e8_mask;
+
+	for (;;) {
+		/* Read the next 32 bytes of data and test them for E8 bytes. */
+		__m128i bytes1 = *(const __m128i *)p;
+		__m128i bytes2 = *(const __m128i *)(p + 16);
+		__m128i cmpresult1 = _mm_cmpeq_epi8(bytes1, e8_bytes);
+		__m128i cmpresult2 = _mm_cmpeq_epi8(bytes2, e8_bytes);
+		u32 mask1 = _mm_movemask_epi8(cmpresult1);
+		u32 mask2 = _mm_movemask_epi8(cmpresult2);
+
+		/* The masks have a bit set for each E8 byte.  We stay in this
+		 * fast inner loop as long as there are no E8 bytes.  */
+		if (mask1 | mask2) {
+			e8_mask = mask1 | (mask2 << 16);
+			break;
+		}
+		p += 32;
+	}
+#endif
+	*e8_mask_ret = e8_mask;
+	return p;
+}
+
+#if !defined(__AVX2__) && CPU_FEATURES_ENABLED
+/*
+ * AVX2 version, used when the CPU supports AVX2 even though the compiler wasn't
+ * told to assume it.  It isn't inlined, but a block with an E8 byte always
+ * costs a call to process_target() anyway.
+ */
+#define HAVE_FIND_E8_BLOCK_AVX2
+static u8 * __attribute__((target("avx2")))
+find_e8_block_avx2(u8 *p, u32 *e8_mask_ret)
+{
+	const __m256i e8_bytes = _mm256_set1_epi8(0xE8);
+	u32 e8_mask;
+
+	for (;;) {
+		__m256i bytes = *(const __m256i *)p;
+		__m256i cmpresult = _mm256_cmpeq_epi8(bytes, e8_bytes);
+
+		e8_mask = _mm256_movemask_epi8(cmpresult);
+		if (e8_mask)
+			break;
+		p += 32;
+	}
+	*e8_mask_ret = e8_mask;
+	return p;
+}
+#endif
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define HAVE_FIND_E8_BLOCK
+static forceinline u8 *
+find_e8_block(u8 *p, u32 *e8_mask_ret)
+{
+	const uint8x16_t e8_bytes = vdupq_n_u8(0xE8);
+	static const u8 bit_values[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+	};
+	uint8x16_t cmpresult1;
+	uint8x16_t cmpresult2;
+	uint8x16_t bits1;
+	uint8x16_t bits2;
+	uint8x16_t sums;
+
+	for (;;) {
+		cmpresult1 = vceqq_u8(vld1q_u8(p), e8_bytes);
+		cmpresult2 = vceqq_u8(vld1q_u8(p + 16), e8_bytes);
+		if (vmaxvq_u8(vorrq_u8(cmpresult1, cmpresult2)))
+			break;
+		p += 32;
+	}
+
+	/* NEON has no movemask instruction, so build the mask by giving each
+	 * matching byte its bit value and adding adjacent bytes together.  */
+	bits1 = vandq_u8(cmpresult1, vld1q_u8(bit_values));
+	bits2 = vandq_u8(cmpresult2, vld1q_u8(bit_values));
+	sums = vpaddq_u8(bits1, bits2);
+	sums = vpaddq_u8(sums, sums);
+	sums = vpaddq_u8(sums, sums);
+	*e8_mask_ret = vgetq_lane_u32(vreinterpretq_u32_u8(sums), 0);
+	return p;
+}
+#endif /* __ARM_NEON && __aarch64__ */
+
 /*
  * Do or undo the 'E8' preprocessing used in LZX.  Before compression, the
  * uncompressed data is preprocessed by changing the targets of x86 CALL
@@ -170,7 +282,7 @@ static void
 lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 {
 
-#if !defined(__SSE2__) && !defined(__AVX2__)
+#ifndef HAVE_FIND_E8_BLOCK
 	/*
 	 * A worthwhile optimization is to push the end-of-buffer check into the
 	 * relatively rare E8 case.  This is possible if we replace the last six
@@ -202,21 +314,19 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 	}
 	memcpy(tail, saved_bytes, 6);
 #else
-	/* SSE2 or AVX-2 optimized version for x86_64  */
+	/* Vectorized version for SSE2, AVX2, or NEON  */
 
 	u8 *p = data;
 	u64 valid_mask = ~0;
+#ifdef HAVE_FIND_E8_BLOCK_AVX2
+	const bool use_avx2 = (cpu_features & X86_CPU_FEATURE_AVX2);
+#endif
 
 	if (size <= 10)
 		return;
-#ifdef __AVX2__
-#  define ALIGNMENT_REQUIRED 32
-#else
-#  define ALIGNMENT_REQUIRED 16
-#endif
 
 	/* Process one byte at a time until the pointer is properly aligned.  */
-	while ((uintptr_t)p % ALIGNMENT_REQUIRED != 0) {
+	while ((uintptr_t)p % 32 != 0) {
 		if (p >= data + size - 10)
 			return;
 		if (*p == 0xE8 && (valid_mask & 1)) {
@@ -244,37 +354,13 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 		for (;;) {
 			u32 e8_mask;
 			u8 *orig_p = p;
-		#ifdef __AVX2__
-			const __m256i e8_bytes = _mm256_set1_epi8(0xE8);
-			for (;;) {
-				__m256i bytes = *(const __m256i *)p;
-				__m256i cmpresult = _mm256_cmpeq_epi8(bytes, e8_bytes);
-				e8_mask = _mm256_movemask_epi8(cmpresult);
-				if (e8_mask)
-					break;
-				p += 32;
-			}
-		#else
-			const __m128i e8_bytes = _mm_set1_epi8(0xE8);
-			for (;;) {
-				/* Read the next 32 bytes of data and test them
-				 * for E8 bytes.  */
-				__m128i bytes1 = *(const __m128i *)p;
-				__m128i bytes2 = *(const __m128i *)(p + 16);
-				__m128i cmpresult1 = _mm_cmpeq_epi8(bytes1, e8_bytes);
-				__m128i cmpresult2 = _mm_cmpeq_epi8(bytes2, e8_bytes);
-				u32 mask1 = _mm_movemask_epi8(cmpresult1);
-				u32 mask2 = _mm_movemask_epi8(cmpresult2);
-				/* The masks have a bit set for each E8 byte.
-				 * We stay in this fast inner loop as long as
-				 * there are no E8 bytes.  */
-				if (mask1 | mask2) {
-					e8_mask = mask1 | (mask2 << 16);
-					break;
-				}
-				p += 32;
-			}
+
+		#ifdef HAVE_FIND_E8_BLOCK_AVX2
+			if (use_avx2)
+				p = find_e8_block_avx2(p, &e8_mask);
+			else
 		#endif
+				p = find_e8_block(p, &e8_mask);
 
 			/* Did we pass over data with no E8 bytes?  */
 			if (p != orig_p)
@@ -311,7 +397,7 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 		valid_mask >>= 1;
 		valid_mask |= (u64)1 << 63;
 	}
-#endif /* __SSE2__ || __AVX2__ */
+#endif /* HAVE_FIND_E8_BLOCK */
 }
 
 void
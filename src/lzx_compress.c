@@ -26,10 +26,11 @@
  * This file contains a compressor for the LZX ("Lempel-Ziv eXtended")
  * compression format, as used in the WIM (Windows IMaging) file format.
  *
- * Two different LZX-compatible algorithms are implemented: "near-optimal" and
- * "lazy".  "Near-optimal" is significantly slower than "lazy", but results in a
- * better compression ratio.  The "near-optimal" algorithm is used at the
- * default compression level.
+ * Three different LZX-compatible algorithms are implemented: "near-optimal",
+ * "lazy", and "greedy".  "Near-optimal" is significantly slower than "lazy", but
+ * results in a better compression ratio.  The "near-optimal" algorithm is used
+ * at the default compression level.  "Greedy" is faster still than "lazy" and is
+ * intended for use cases where throughput matters more than compression ratio.
  *
  * This file may need some slight modifications to be used outside of the WIM
  * format.  In particular, in other situations the LZX block header might be
@@ -70,6 +71,12 @@
  */
 #define MAX_FAST_LEVEL				34
 
+/*
+ * At levels <= MAX_GREEDY_LEVEL, the compressor uses the fastest algorithm,
+ * which is greedy parsing with a hash table matchfinder and fixed-size blocks.
+ */
+#define MAX_GREEDY_LEVEL			20
+
 /*
  * The compressor-side limits on the codeword lengths (in bits) for each Huffman
  * code.  To make outputting bits slightly faster, some of these limits are
@@ -194,6 +201,7 @@
 #define MF_SUFFIX	_16
 #include "wimlib/bt_matchfinder.h"
 #include "wimlib/hc_matchfinder.h"
+#include "wimlib/ht_matchfinder.h"
 
 /* Matchfinders with 32-bit positions */
 #undef mf_pos_t
@@ -202,6 +210,7 @@
 #define MF_SUFFIX	_32
 #include "wimlib/bt_matchfinder.h"
 #include "wimlib/hc_matchfinder.h"
+#include "wimlib/ht_matchfinder.h"
 
 /******************************************************************************/
 /*                            Compressor structure                            */
@@ -421,6 +430,15 @@ struct lzx_compressor {
 	u8 offset_slot_tab_2[128]; /* offset slots [30, 49] */
 
 	union {
+		/* Data for lzx_compress_greedy() */
+		struct {
+			/* Hash table matchfinder */
+			union {
+				struct ht_matchfinder_16 ht_mf_16;
+				struct ht_matchfinder_32 ht_mf_32;
+			};
+		};
+
 		/* Data for lzx_compress_lazy() */
 		struct {
 			/* Hash chains matchfinder (MUST BE LAST!!!) */
@@ -547,9 +565,17 @@ lzx_tally_main_and_lensyms(struct lzx_compressor *c, unsigned length,
 /*
  * The following macros call either the 16-bit or the 32-bit version of a
  * matchfinder function based on the value of 'is_16_bit', which will be known
- * at compilation time.
+ * at compilation time.  Each parsing algorithm is a forceinline function taking
+ * 'is_16_bit', and it is instantiated as separate _16 and _32 functions, one of
+ * which lzx_create_compressor() selects as c->impl.  So these macros never
+ * cause a branch at runtime, provided that every function that passes
+ * 'is_16_bit' along is also forceinline.
  */
 
+#define CALL_HT_MF(is_16_bit, c, funcname, ...)				      \
+	((is_16_bit) ? CONCAT(funcname, _16)(&(c)->ht_mf_16, ##__VA_ARGS__) : \
+		       CONCAT(funcname, _32)(&(c)->ht_mf_32, ##__VA_ARGS__));
+
 #define CALL_HC_MF(is_16_bit, c, funcname, ...)				      \
 	((is_16_bit) ? CONCAT(funcname, _16)(&(c)->hc_mf_16, ##__VA_ARGS__) : \
 		       CONCAT(funcname, _32)(&(c)->hc_mf_32, ##__VA_ARGS__));
@@ -1242,6 +1268,13 @@ lzx_flush_block(struct lzx_compressor *c, struct lzx_output_bitstream *os,
  * the actual symbols that will be used are unknown until after the block
  * boundary is chosen and the block has been optimized.  Since the final choices
  * cannot be used, we can use preliminary "greedy" choices instead.
+ *
+ * The statistics are gathered during matchfinding rather than in a separate
+ * pass over the match cache, and that's deliberate: updating them costs a few
+ * instructions per item next to a binary tree search per position, so there
+ * is no measurable time to save.  Nor is there much compression ratio at stake:
+ * with 2 MB chunks, disabling block splitting entirely loses only about 0.1%,
+ * and with 32 KB chunks, the blocks are too small for splitting to matter.
  */
 
 /* Initialize the block split statistics when starting a new block. */
@@ -2106,6 +2139,13 @@ lzx_set_costs_from_codes(struct lzx_compressor *c)
  * algorithm to approximate an optimal solution.  The first optimization pass
  * for the block uses default costs; additional passes use costs derived from
  * the Huffman codes computed in the previous pass.
+ *
+ * Blocks must be optimized one at a time, in order: each block's parse starts
+ * from the repeat offset queue left by the previous block's final parse, and
+ * each block's code lengths are delta-coded against the previous block's.  So
+ * blocks within a chunk can't be optimized on separate threads without changing
+ * the output; parallelism is instead obtained by compressing chunks
+ * concurrently (see compress_parallel.c).
  */
 static forceinline struct lzx_lru_queue
 lzx_optimize_and_flush_block(struct lzx_compressor * const restrict c,
@@ -2372,8 +2412,7 @@ lzx_choose_literal(struct lzx_compressor *c, unsigned literal, u32 *litrunlen_p)
 /*
  * Called when the compressor chooses to use a match.  This tallies the Huffman
  * symbol(s) for a match, saves the match data and the length of the preceding
- * literal run, updates the recent offsets queue, and "observes" the match for
- * the block split statistics.
+ * literal run, and updates the recent offsets queue.
  */
 static forceinline void
 lzx_choose_match(struct lzx_compressor *c, unsigned length, u32 adjusted_offset,
@@ -2383,8 +2422,6 @@ lzx_choose_match(struct lzx_compressor *c, unsigned length, u32 adjusted_offset,
 	struct lzx_sequence *next_seq = *next_seq_p;
 	unsigned mainsym;
 
-	lzx_observe_match(&c->split_stats, length);
-
 	mainsym = lzx_tally_main_and_lensyms(c, length, adjusted_offset,
 					     is_16_bit);
 	next_seq->litrunlen_and_matchlen =
@@ -2527,7 +2564,7 @@ lzx_compress_lazy(struct lzx_compressor * restrict c,
 	u32 next_hashes[2] = {0, 0};
 
 	/* Initialize the matchfinder. */
-	CALL_HC_MF(is_16_bit, c, hc_matchfinder_init);
+	CALL_HC_MF(is_16_bit, c, hc_matchfinder_init, in_nbytes);
 
 	do {
 		/* Starting a new block */
@@ -2703,6 +2740,7 @@ lzx_compress_lazy(struct lzx_compressor * restrict c,
 		choose_cur_match:
 			/* Choose a match and have the matchfinder skip over its
 			 * remaining bytes. */
+			lzx_observe_match(&c->split_stats, cur_len);
 			lzx_choose_match(c, cur_len, cur_adjusted_offset,
 					 recent_offsets, is_16_bit,
 					 &litrunlen, &next_seq);
@@ -2745,6 +2783,142 @@ lzx_compress_lazy_32(struct lzx_compressor *c, const u8 *in, size_t in_nbytes,
 	lzx_compress_lazy(c, in, in_nbytes, os, false);
 }
 
+/******************************************************************************/
+/*                    Fastest ("greedy") compression algorithm                */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * This is the "greedy" LZX compressor.  At each position, it chooses either the
+ * match found by the hash table matchfinder or the longest repeat offset match,
+ * whichever scores better, without looking ahead to the next position.
+ *
+ * For speed, it doesn't gather block split statistics either.  Instead, a new
+ * block is simply started every SOFT_MAX_BLOCK_SIZE bytes.
+ */
+static forceinline void
+lzx_compress_greedy(struct lzx_compressor * restrict c,
+		    const u8 * const restrict in_begin, size_t in_nbytes,
+		    struct lzx_output_bitstream * restrict os, bool is_16_bit)
+{
+	const u8 *	 in_next = in_begin;
+	const u8 * const in_end  = in_begin + in_nbytes;
+	unsigned max_len = LZX_MAX_MATCH_LEN;
+	unsigned nice_len = min(c->nice_match_length, max_len);
+	STATIC_ASSERT(LZX_NUM_RECENT_OFFSETS == 3);
+	u32 recent_offsets[LZX_NUM_RECENT_OFFSETS] = {1, 1, 1};
+	u32 next_hash = 0;
+
+	/* Initialize the matchfinder. */
+	CALL_HT_MF(is_16_bit, c, ht_matchfinder_init);
+
+	do {
+		/* Starting a new block */
+
+		const u8 * const in_block_begin = in_next;
+		const u8 * const in_block_end =
+			in_next + min(SOFT_MAX_BLOCK_SIZE, in_end - in_next);
+		struct lzx_sequence *next_seq = c->chosen_sequences;
+		u32 litrunlen = 0;
+
+		lzx_reset_symbol_frequencies(c);
+
+		do {
+			unsigned cur_len;
+			u32 cur_offset;
+			u32 cur_adjusted_offset;
+			unsigned rep_len;
+			unsigned rep_idx;
+
+			/* Adjust max_len and nice_len if we're nearing the end
+			 * of the input buffer.  Too close to the end, just
+			 * choose literals. */
+			if (unlikely(max_len > in_end - in_next)) {
+				max_len = in_end - in_next;
+				nice_len = min(max_len, nice_len);
+				if (max_len < HT_MATCHFINDER_REQUIRED_NBYTES) {
+					c->freqs.main[*in_next++]++;
+					litrunlen++;
+					continue;
+				}
+			}
+
+			/* Find the longest explicit offset match, then the
+			 * longest repeat offset match.  (The latter requires a
+			 * previous byte, for the initial offsets of 1.) */
+			cur_len = CALL_HT_MF(is_16_bit, c,
+					     ht_matchfinder_longest_match,
+					     in_begin,
+					     in_next,
+					     max_len,
+					     nice_len,
+					     &next_hash,
+					     &cur_offset);
+			rep_len = 0;
+			if (likely(in_next != in_begin))
+				rep_len = lzx_find_longest_repeat_offset_match(
+						in_next, recent_offsets,
+						max_len, &rep_idx);
+
+			if (rep_len != 0 &&
+			    lzx_repeat_offset_match_score(rep_len, rep_idx) >=
+			    lzx_explicit_offset_match_score(cur_len,
+							    cur_offset +
+							    LZX_OFFSET_ADJUSTMENT))
+			{
+				/* Choose the repeat offset match. */
+				cur_len = rep_len;
+				cur_adjusted_offset = rep_idx;
+			} else if (cur_len != 0) {
+				/* Choose the explicit offset match. */
+				cur_adjusted_offset = cur_offset +
+						      LZX_OFFSET_ADJUSTMENT;
+			} else {
+				/* No match found; choose a literal. */
+				c->freqs.main[*in_next++]++;
+				litrunlen++;
+				continue;
+			}
+
+			/* Choose the match and have the matchfinder skip over
+			 * its remaining bytes. */
+			lzx_choose_match(c, cur_len, cur_adjusted_offset,
+					 recent_offsets, is_16_bit,
+					 &litrunlen, &next_seq);
+			in_next++;
+			CALL_HT_MF(is_16_bit, c,
+				   ht_matchfinder_skip_bytes,
+				   in_begin,
+				   in_next,
+				   in_end,
+				   cur_len - 1,
+				   &next_hash);
+			in_next += cur_len - 1;
+
+			/* Keep going until it's time to end the block. */
+		} while (in_next < in_block_end);
+
+		/* Flush the block. */
+		lzx_finish_sequence(next_seq, litrunlen);
+		lzx_flush_block(c, os, in_block_begin, in_next - in_block_begin, 0);
+
+		/* Keep going until we've reached the end of the input buffer. */
+	} while (in_next != in_end);
+}
+
+static void
+lzx_compress_greedy_16(struct lzx_compressor *c, const u8 *in,
+		       size_t in_nbytes, struct lzx_output_bitstream *os)
+{
+	lzx_compress_greedy(c, in, in_nbytes, os, true);
+}
+
+static void
+lzx_compress_greedy_32(struct lzx_compressor *c, const u8 *in,
+		       size_t in_nbytes, struct lzx_output_bitstream *os)
+{
+	lzx_compress_greedy(c, in, in_nbytes, os, false);
+}
+
 /******************************************************************************/
 /*                          Compressor operations                             */
 /*----------------------------------------------------------------------------*/
@@ -2783,7 +2957,14 @@ lzx_init_offset_slot_tabs(struct lzx_compressor *c)
 static size_t
 lzx_get_compressor_size(size_t max_bufsize, unsigned compression_level)
 {
-	if (compression_level <= MAX_FAST_LEVEL) {
+	if (compression_level <= MAX_GREEDY_LEVEL) {
+		if (lzx_is_16_bit(max_bufsize))
+			return offsetof(struct lzx_compressor, ht_mf_16) +
+			       ht_matchfinder_size_16(max_bufsize);
+		else
+			return offsetof(struct lzx_compressor, ht_mf_32) +
+			       ht_matchfinder_size_32(max_bufsize);
+	} else if (compression_level <= MAX_FAST_LEVEL) {
 		if (lzx_is_16_bit(max_bufsize))
 			return offsetof(struct lzx_compressor, hc_mf_16) +
 			       hc_matchfinder_size_16(max_bufsize);
@@ -2830,7 +3011,7 @@ lzx_create_compressor(size_t max_bufsize, unsigned compression_level,
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	/* Allocate the compressor. */
-	c = MALLOC(lzx_get_compressor_size(max_bufsize, compression_level));
+	c = LARGE_MALLOC(lzx_get_compressor_size(max_bufsize, compression_level));
 	if (!c)
 		goto oom0;
 
@@ -2845,7 +3026,18 @@ lzx_create_compressor(size_t max_bufsize, unsigned compression_level,
 			goto oom1;
 	}
 
-	if (compression_level <= MAX_FAST_LEVEL) {
+	if (compression_level <= MAX_GREEDY_LEVEL) {
+
+		/* Fastest compression: Use greedy parsing. */
+		if (lzx_is_16_bit(max_bufsize))
+			c->impl = lzx_compress_greedy_16;
+		else
+			c->impl = lzx_compress_greedy_32;
+
+		/* The hash table matchfinder has a fixed search depth, so only
+		 * scale nice_match_length with the compression level. */
+		c->nice_match_length = max((80 * compression_level) / 20, 8);
+	} else if (compression_level <= MAX_FAST_LEVEL) {
 
 		/* Fast compression: Use lazy parsing. */
 		if (lzx_is_16_bit(max_bufsize))
@@ -2897,7 +3089,7 @@ lzx_create_compressor(size_t max_bufsize, unsigned compression_level,
 	return 0;
 
 oom1:
-	FREE(c);
+	LARGE_FREE(c);
 oom0:
 	return WIMLIB_ERR_NOMEM;
 }
@@ -2958,7 +3150,7 @@ lzx_free_compressor(void *_c)
 
 	if (!c->destructive)
 		FREE(c->in_buffer);
-	FREE(c);
+	LARGE_FREE(c);
 }
 
 const struct compressor_ops lzx_compressor_ops = {
@@ -27,11 +27,57 @@
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
+#include "wimlib/inode.h"
 #include "wimlib/metadata.h"
 #include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/spill.h"
+#include "wimlib/stats.h"
+#include "wimlib/threads.h"
+#include "wimlib/unaligned.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
 #include "wimlib/write.h"
 
+/*
+ * The state of an image being loaded lazily.  The uncompressed metadata
+ * resource is kept in memory, and each directory is parsed from it when it's
+ * first needed.
+ *
+ * For an image captured with WIMLIB_ADD_FLAG_SPILL_METADATA, the directories
+ * are loaded from the spill file instead, which owns the buffer.
+ */
+struct metadata_loader {
+	u8 *buf;
+	size_t buf_len;
+	u32 num_security_entries;
+	unsigned long num_invalid_security_ids;
+	struct inode_fixup *fixup;
+	bool loading_all;
+	struct metadata_spill *spill;
+};
+
+/* Fix the security ID of an inode to be either -1 or in bounds.  Returns true
+ * if it was invalid.  */
+static bool
+fix_security_id(struct wim_inode *inode, const u32 num_entries)
+{
+	if ((u32)inode->i_security_id >= num_entries) {
+		bool invalid = (inode->i_security_id >= 0);
+
+		inode->i_security_id = -1;
+		return invalid;
+	}
+	return false;
+}
+
+static void
+warn_invalid_security_ids(unsigned long invalid_count)
+{
+	if (invalid_count)
+		WARNING("%lu inodes had invalid security IDs", invalid_count);
+}
+
 /* Fix the security ID for every inode to be either -1 or in bounds.  */
 static void
 fix_security_ids(struct wim_image_metadata *imd, const u32 num_entries)
@@ -39,45 +85,374 @@ fix_security_ids(struct wim_image_metadata *imd, const u32 num_entries)
 	struct wim_inode *inode;
 	unsigned long invalid_count = 0;
 
-	image_for_each_inode(inode, imd) {
-		if ((u32)inode->i_security_id >= num_entries) {
-			if (inode->i_security_id >= 0)
-				invalid_count++;
-			inode->i_security_id = -1;
-		}
+	image_for_each_inode(inode, imd)
+		invalid_count += fix_security_id(inode, num_entries);
+	warn_invalid_security_ids(invalid_count);
+}
+
+/* Free a buffer returned by read_metadata_buf().  */
+static void
+free_metadata_buf(void *buf, size_t size)
+{
+	if (buf) {
+		FREE(buf);
+		MEM_FREED(metadata, size);
+	}
+}
+
+static struct metadata_loader *
+new_metadata_loader(u8 *buf, size_t buf_len, u32 num_security_entries)
+{
+	struct metadata_loader *loader;
+
+	loader = MALLOC(sizeof(*loader));
+	if (!loader)
+		return NULL;
+	if (new_inode_fixup(&loader->fixup)) {
+		FREE(loader);
+		return NULL;
 	}
-	if (invalid_count)
-		WARNING("%lu inodes had invalid security IDs", invalid_count);
+	loader->buf = buf;
+	loader->buf_len = buf_len;
+	loader->num_security_entries = num_security_entries;
+	loader->num_invalid_security_ids = 0;
+	loader->loading_all = false;
+	loader->spill = NULL;
+	return loader;
+}
+
+/* Free the buffer of the metadata loader @loader.  */
+static void
+free_loader_buf(struct metadata_loader *loader)
+{
+	if (loader->spill)
+		free_metadata_spill(loader->spill);
+	else
+		free_metadata_buf(loader->buf, loader->buf_len);
+}
+
+/* Start loading an image lazily, given its root dentry whose children haven't
+ * been read yet.  This takes ownership of @buf.  */
+static int
+start_lazy_load(struct wim_image_metadata *imd, u8 *buf, size_t buf_len,
+		u32 num_security_entries, struct wim_dentry *root)
+{
+	struct metadata_loader *loader;
+
+	loader = new_metadata_loader(buf, buf_len, num_security_entries);
+	if (!loader)
+		return WIMLIB_ERR_NOMEM;
+	loader->num_invalid_security_ids =
+		fix_security_id(root->d_inode, num_security_entries);
+
+	/* The root is a directory, so it can't share its inode.  */
+	hlist_add_head(&root->d_inode->i_hlist_node, &imd->inode_list);
+	imd->loader = loader;
+	return 0;
 }
 
 /*
- * Reads and parses a metadata resource for an image in the WIM file.
+ * Make the image @imd, which has just been captured with some of its
+ * directories spilled to @spill, load them from the spill file as needed.  On
+ * success, this takes ownership of @spill.  If nothing was spilled, @spill is
+ * just freed.
+ */
+int
+start_spill_load(struct wim_image_metadata *imd, struct metadata_spill *spill)
+{
+	struct metadata_loader *loader;
+	const u8 *buf;
+	size_t buf_len;
+	int ret;
+
+	wimlib_assert(!imd->loader);
+
+	ret = metadata_spill_finish(spill, &buf, &buf_len);
+	if (ret)
+		return ret;
+	if (buf_len == 0) {
+		free_metadata_spill(spill);
+		return 0;
+	}
+
+	if (!imd->arena) {
+		imd->arena = new_dentry_arena();
+		if (!imd->arena)
+			return WIMLIB_ERR_NOMEM;
+	}
+	loader = new_metadata_loader((u8 *)buf, buf_len,
+				     imd->security_data->num_entries);
+	if (!loader)
+		return WIMLIB_ERR_NOMEM;
+	loader->spill = spill;
+	imd->loader = loader;
+	return 0;
+}
+
+/*
+ * Load the children of the directory @dir in the image @imd, if the image is
+ * being loaded lazily and they haven't been loaded yet.  Subdirectories aren't
+ * loaded.  The new inodes are added to the head of the image's inode list.
  *
- * @imd:
- *	Pointer to the image metadata structure for the image whose metadata
- *	resource we are reading.  Its `metadata_blob' member specifies the blob
- *	table entry for the metadata resource.  The rest of the image metadata
- *	entry will be filled in by this function.
+ * The link count of an inode is only right once all its dentries are loaded,
+ * so if any of the children is part of a hard link group, the rest of the
+ * image is loaded too.
  *
  * Return values:
  *	WIMLIB_ERR_SUCCESS (0)
  *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
  *	WIMLIB_ERR_NOMEM
- *	WIMLIB_ERR_READ
- *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE
- *	WIMLIB_ERR_DECOMPRESSION
  */
 int
-read_metadata_resource(struct wim_image_metadata *imd)
+load_dentry_children(struct wim_image_metadata *imd, struct wim_dentry *dir)
 {
-	const struct blob_descriptor *metadata_blob;
-	void *buf;
+	struct metadata_loader *loader = imd->loader;
+	struct wim_dentry *child;
+	bool has_hard_links = false;
 	int ret;
-	u8 hash[SHA1_HASH_SIZE];
-	struct wim_security_data *sd;
-	struct wim_dentry *root;
 
-	metadata_blob = imd->metadata_blob;
+	if (likely(!dir->d_children_unloaded))
+		return 0;
+
+	ret = read_dentry_subdir(loader->buf, loader->buf_len, imd->arena, dir);
+	if (ret)
+		goto err;
+
+	ret = inode_fixup_add_children(loader->fixup, dir, &imd->inode_list);
+	if (ret) {
+		unread_dentry_subdir(dir);
+		goto err;
+	}
+
+	for_dentry_child(child, dir) {
+		loader->num_invalid_security_ids +=
+			fix_security_id(child->d_inode,
+					loader->num_security_entries);
+		if (child->d_inode->i_ino != 0)
+			has_hard_links = true;
+	}
+
+	if (has_hard_links && !loader->loading_all) {
+		loader->loading_all = true;
+		ret = load_dentry_tree(imd, imd->root_dentry);
+		if (ret)
+			loader->loading_all = false;
+		return ret;
+	}
+	return 0;
+
+err:
+	if (ret == WIMLIB_ERR_INVALID_METADATA_RESOURCE)
+		ERROR("The metadata resource is invalid in directory "
+		      "\"%"TS"\"", dentry_full_path(dir));
+	return ret;
+}
+
+/* Load the whole tree rooted at @root in the image @imd, if the image is being
+ * loaded lazily.  */
+int
+load_dentry_tree(struct wim_image_metadata *imd, struct wim_dentry *root)
+{
+	struct wim_dentry *child;
+	int ret;
+
+	if (likely(!imd->loader) || !root)
+		return 0;
+
+	ret = load_dentry_children(imd, root);
+	if (ret)
+		return ret;
+
+	for_dentry_child(child, root) {
+		ret = load_dentry_tree(imd, child);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Like load_dentry_children(), but for a caller that only needs the children of
+ * @dir while it visits them, such as a recursive iteration.  If this loaded the
+ * children, *@loaded_ret is set to true, and the caller must then call
+ * unload_dentry_children() with the same @mark when done with them.  This way,
+ * visiting a whole lazily loaded image needs memory only for the directories
+ * along the current path.
+ */
+int
+load_dentry_children_temporarily(struct wim_image_metadata *imd,
+				 struct wim_dentry *dir,
+				 struct dentry_arena_mark *mark,
+				 bool *loaded_ret)
+{
+	int ret;
+
+	*loaded_ret = false;
+	if (likely(!dir->d_children_unloaded))
+		return 0;
+
+	dentry_arena_get_mark(imd->arena, mark);
+	ret = load_dentry_children(imd, dir);
+	if (ret)
+		return ret;
+	*loaded_ret = true;
+	return 0;
+}
+
+/*
+ * Unload the children of @dir that were loaded by
+ * load_dentry_children_temporarily(), along with everything else allocated
+ * from the image's arena since then.  All directories loaded in the meantime
+ * must have been unloaded already.
+ *
+ * This does nothing if the rest of the image has been loaded in the meantime,
+ * e.g. because of hard links.
+ */
+void
+unload_dentry_children(struct wim_image_metadata *imd, struct wim_dentry *dir,
+		       const struct dentry_arena_mark *mark)
+{
+	if (!imd->loader || imd->loader->loading_all)
+		return;
+
+	unread_dentry_subdir(dir);
+	dentry_arena_release(imd->arena, mark);
+}
+
+/* If the image @imd is being loaded lazily, load the rest of it.  */
+int
+finish_loading_image(struct wim_image_metadata *imd)
+{
+	struct metadata_loader *loader = imd->loader;
+	int ret;
+
+	if (likely(!loader))
+		return 0;
+
+	ret = load_dentry_tree(imd, imd->root_dentry);
+	if (ret)
+		return ret;
+
+	finish_inode_fixup(loader->fixup, &imd->inode_list);
+	warn_invalid_security_ids(loader->num_invalid_security_ids);
+	free_loader_buf(loader);
+	FREE(loader);
+	imd->loader = NULL;
+	return 0;
+}
+
+/*
+ * Like finish_loading_image(), but leave an image whose directories were
+ * spilled during capture as it is.  Such an image can still be written with
+ * write_dentry_tree(), and its inodes visited with image_for_each_inode() and
+ * visit_unloaded_inodes(), without loading all of it at once.
+ */
+int
+finish_loading_unspilled_image(struct wim_image_metadata *imd)
+{
+	if (imd->loader && imd->loader->spill)
+		return 0;
+	return finish_loading_image(imd);
+}
+
+/*
+ * Return the number of bytes that the subtree of the spilled directory @dir
+ * takes up in the metadata resource of the image @imd, not counting @dir
+ * itself.  See spill.c.
+ */
+u64
+unloaded_subtree_size(const struct wim_image_metadata *imd,
+		      const struct wim_dentry *dir)
+{
+	const struct metadata_loader *loader = imd->loader;
+
+	wimlib_assert(loader->spill && dir->d_subdir_offset >= 8 &&
+		      dir->d_subdir_offset <= loader->buf_len);
+	return le64_to_cpu(load_le64_unaligned(&loader->buf[dir->d_subdir_offset
+							     - 8]));
+}
+
+static int
+visit_unloaded_subtree(struct wim_image_metadata *imd, struct wim_dentry *dir,
+		       int (*visitor)(struct wim_inode *, void *), void *arg)
+{
+	struct dentry_arena_mark mark;
+	struct wim_dentry *child;
+	bool loaded;
+	int ret;
+
+	ret = load_dentry_children_temporarily(imd, dir, &mark, &loaded);
+	if (ret)
+		return ret;
+	for_dentry_child(child, dir) {
+		ret = (*visitor)(child->d_inode, arg);
+		if (!ret && child->d_children_unloaded)
+			ret = visit_unloaded_subtree(imd, child, visitor, arg);
+		if (ret)
+			break;
+	}
+	if (loaded)
+		unload_dentry_children(imd, dir, &mark);
+	return ret;
+}
+
+struct visit_unloaded_ctx {
+	struct wim_image_metadata *imd;
+	int (*visitor)(struct wim_inode *, void *);
+	void *arg;
+};
+
+static int
+visit_if_unloaded(struct wim_dentry *dentry, void *_ctx)
+{
+	const struct visit_unloaded_ctx *ctx = _ctx;
+
+	if (!dentry->d_children_unloaded)
+		return 0;
+	return visit_unloaded_subtree(ctx->imd, dentry, ctx->visitor, ctx->arg);
+}
+
+/*
+ * Call @visitor on the inode of each dentry of the image @imd which is not
+ * loaded, i.e. each one that image_for_each_inode() misses.  Each directory is
+ * loaded only while it's being visited.  The image must have been left spilled
+ * by finish_loading_unspilled_image(); otherwise there is nothing to do.
+ */
+int
+visit_unloaded_inodes(struct wim_image_metadata *imd,
+		      int (*visitor)(struct wim_inode *, void *), void *arg)
+{
+	struct visit_unloaded_ctx ctx = {
+		.imd = imd,
+		.visitor = visitor,
+		.arg = arg,
+	};
+
+	if (likely(!imd->loader))
+		return 0;
+	wimlib_assert(imd->loader->spill);
+	return for_dentry_in_tree(imd->root_dentry, visit_if_unloaded, &ctx);
+}
+
+void
+free_metadata_loader(struct metadata_loader *loader)
+{
+	if (loader) {
+		free_inode_fixup(loader->fixup);
+		free_loader_buf(loader);
+		FREE(loader);
+	}
+}
+
+/* Read the metadata resource of the image @imd into memory and verify its
+ * checksum.  */
+static int
+read_metadata_buf(const struct wim_image_metadata *imd, void **buf_ret)
+{
+	const struct blob_descriptor *metadata_blob = imd->metadata_blob;
+	void *buf;
+	u8 hash[SHA1_HASH_SIZE];
+	int ret;
 
 	/*
 	 * Prevent huge memory allocations when processing fuzzed files.  The
@@ -101,9 +476,28 @@ read_metadata_resource(struct wim_image_metadata *imd)
 	if (!hashes_equal(metadata_blob->hash, hash)) {
 		ERROR("Metadata resource is corrupted "
 		      "(invalid SHA-1 message digest)!");
-		ret = WIMLIB_ERR_INVALID_METADATA_RESOURCE;
-		goto out_free_buf;
+		FREE(buf);
+		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 	}
+	MEM_ALLOCATED(metadata, metadata_blob->size);
+	*buf_ret = buf;
+	return 0;
+}
+
+/*
+ * Parse the metadata resource of the image @imd, which read_metadata_buf() has
+ * read into @buf, and fill in @imd.  This takes ownership of @buf.  Nothing but
+ * @imd is modified, so this can run for different images on different threads.
+ */
+static int
+parse_metadata_resource(struct wim_image_metadata *imd, void *buf, bool lazy)
+{
+	const struct blob_descriptor *metadata_blob = imd->metadata_blob;
+	int ret;
+	struct wim_security_data *sd;
+	struct dentry_arena *arena;
+	struct hlist_head inodes;
+	struct wim_dentry *root;
 
 	/* Parse the metadata resource.
 	 *
@@ -119,37 +513,237 @@ read_metadata_resource(struct wim_image_metadata *imd)
 	if (ret)
 		goto out_free_buf;
 
-	ret = read_dentry_tree(buf, metadata_blob->size, sd->total_length, &root);
-	if (ret)
+	ret = WIMLIB_ERR_NOMEM;
+	arena = new_dentry_arena();
+	if (!arena)
 		goto out_free_security_data;
 
+	INIT_HLIST_HEAD(&inodes);
+	ret = read_dentry_tree(buf, metadata_blob->size, sd->total_length,
+			       lazy, arena, &inodes, &root);
+	if (ret)
+		goto out_free_arena;
+
+	if (lazy && root && root->d_children_unloaded) {
+		ret = start_lazy_load(imd, buf, metadata_blob->size,
+				      sd->num_entries, root);
+		if (ret)
+			goto out_free_dentry_tree;
+		buf = NULL;
+		goto out_success;
+	}
+
 	/* We have everything we need from the buffer now.  */
-	FREE(buf);
+	free_metadata_buf(buf, metadata_blob->size);
 	buf = NULL;
 
 	/* Calculate and validate inodes.  */
 
-	ret = dentry_tree_fix_inodes(root, &imd->inode_list);
+	ret = dentry_tree_fix_inodes(&inodes, &imd->inode_list);
 	if (ret)
 		goto out_free_dentry_tree;
 
 	fix_security_ids(imd, sd->num_entries);
 
+out_success:
 	/* Success; fill in the image_metadata structure.  */
 	imd->root_dentry = root;
+	imd->arena = arena;
 	imd->security_data = sd;
 	INIT_LIST_HEAD(&imd->unhashed_blobs);
 	return 0;
 
 out_free_dentry_tree:
 	free_dentry_tree(root, NULL);
+out_free_arena:
+	free_dentry_arena(arena);
 out_free_security_data:
 	free_wim_security_data(sd);
 out_free_buf:
-	FREE(buf);
+	free_metadata_buf(buf, metadata_blob->size);
 	return ret;
 }
 
+/*
+ * Reads and parses a metadata resource for an image in the WIM file.
+ *
+ * @imd:
+ *	Pointer to the image metadata structure for the image whose metadata
+ *	resource we are reading.  Its `metadata_blob' member specifies the blob
+ *	table entry for the metadata resource.  The rest of the image metadata
+ *	entry will be filled in by this function.
+ *
+ * @lazy:
+ *	If true, only parse the root directory for now, and keep the metadata
+ *	resource in memory so that the other directories can be loaded later
+ *	with load_dentry_children().
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS (0)
+ *	WIMLIB_ERR_INVALID_METADATA_RESOURCE
+ *	WIMLIB_ERR_NOMEM
+ *	WIMLIB_ERR_READ
+ *	WIMLIB_ERR_UNEXPECTED_END_OF_FILE
+ *	WIMLIB_ERR_DECOMPRESSION
+ */
+int
+read_metadata_resource(struct wim_image_metadata *imd, bool lazy)
+{
+	void *buf;
+	int ret;
+
+	ret = read_metadata_buf(imd, &buf);
+	if (ret)
+		return ret;
+	return parse_metadata_resource(imd, buf, lazy);
+}
+
+/* Maximum number of threads used to parse metadata resources  */
+#define MAX_PRELOAD_THREADS	8
+
+/* An image whose metadata resource is to be preloaded  */
+struct preload_job {
+	struct wim_image_metadata *imd;
+	void *buf;
+	int ret;
+};
+
+/*
+ * State shared by the threads preloading images.  The calling thread reads and
+ * decompresses the metadata resources one by one, which is how they're read
+ * from the file anyway, while the other threads parse the ones that have been
+ * read so far.  At most @max_pending resources are read ahead of the parsing,
+ * so that not too many are held in memory at once.
+ */
+struct image_preloader {
+	struct preload_job *jobs;
+	unsigned num_read;
+	unsigned num_taken;
+	unsigned max_pending;
+	bool done_reading;
+	struct mutex lock;
+	struct condvar job_avail_cond;
+	struct condvar space_avail_cond;
+};
+
+static void *
+image_preloader_thread_proc(void *arg)
+{
+	struct image_preloader *p = arg;
+
+	mutex_lock(&p->lock);
+	for (;;) {
+		struct preload_job *job;
+
+		while (p->num_taken == p->num_read && !p->done_reading)
+			condvar_wait(&p->job_avail_cond, &p->lock);
+		if (p->num_taken == p->num_read)
+			break;
+		job = &p->jobs[p->num_taken++];
+		condvar_signal(&p->space_avail_cond);
+		mutex_unlock(&p->lock);
+		job->ret = parse_metadata_resource(job->imd, job->buf, false);
+		mutex_lock(&p->lock);
+	}
+	mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/*
+ * Load the metadata of the images @first_image through @last_image of @wim,
+ * for an operation that will need all of them, such as exporting all images.
+ * The metadata resources are parsed on multiple threads, overlapped with the
+ * reading and decompression of the following ones.  Images that are already
+ * loaded are skipped.  If there are too few images left to load or threads
+ * can't be used, this does nothing, leaving the images to be loaded on demand
+ * by select_wim_image().
+ */
+int
+preload_images(WIMStruct *wim, int first_image, int last_image)
+{
+	struct image_preloader p;
+	struct thread threads[MAX_PRELOAD_THREADS];
+	unsigned num_jobs = 0;
+	unsigned num_threads;
+	unsigned num_started = 0;
+	int ret = 0;
+
+	p.jobs = CALLOC(last_image - first_image + 1, sizeof(p.jobs[0]));
+	if (!p.jobs)
+		return WIMLIB_ERR_NOMEM;
+	for (int i = first_image; i <= last_image; i++) {
+		struct wim_image_metadata *imd = wim->image_metadata[i - 1];
+
+		if (!is_image_loaded(imd))
+			p.jobs[num_jobs++].imd = imd;
+	}
+
+	num_threads = min(get_available_cpus(), MAX_PRELOAD_THREADS);
+	num_threads = min(num_threads, num_jobs);
+	if (num_threads < 2)
+		goto out_free_jobs;
+
+	if (!mutex_init(&p.lock))
+		goto out_free_jobs;
+	if (!condvar_init(&p.job_avail_cond))
+		goto out_destroy_lock;
+	if (!condvar_init(&p.space_avail_cond))
+		goto out_destroy_job_avail_cond;
+	p.num_read = 0;
+	p.num_taken = 0;
+	p.max_pending = num_threads;
+	p.done_reading = false;
+
+	while (num_started < num_threads &&
+	       thread_create(&threads[num_started],
+			     image_preloader_thread_proc, &p))
+		num_started++;
+	if (num_started == 0)
+		goto out_destroy_space_avail_cond;
+
+	for (unsigned i = 0; i < num_jobs; i++) {
+		void *buf;
+
+		ret = read_metadata_buf(p.jobs[i].imd, &buf);
+		if (ret)
+			break;
+		mutex_lock(&p.lock);
+		while (p.num_read - p.num_taken >= p.max_pending)
+			condvar_wait(&p.space_avail_cond, &p.lock);
+		p.jobs[i].buf = buf;
+		p.num_read++;
+		condvar_signal(&p.job_avail_cond);
+		mutex_unlock(&p.lock);
+	}
+
+	mutex_lock(&p.lock);
+	p.done_reading = true;
+	condvar_broadcast(&p.job_avail_cond);
+	mutex_unlock(&p.lock);
+	for (unsigned i = 0; i < num_started; i++)
+		thread_join(&threads[i]);
+
+	for (unsigned i = 0; i < p.num_read && !ret; i++)
+		ret = p.jobs[i].ret;
+
+out_destroy_space_avail_cond:
+	condvar_destroy(&p.space_avail_cond);
+out_destroy_job_avail_cond:
+	condvar_destroy(&p.job_avail_cond);
+out_destroy_lock:
+	mutex_destroy(&p.lock);
+out_free_jobs:
+	FREE(p.jobs);
+	return ret;
+}
+
+static int
+sha1_chunk_cb(const void *chunk, size_t size, void *_ctx)
+{
+	sha1_update(_ctx, chunk, size);
+	return 0;
+}
+
 static void
 recalculate_security_data_length(struct wim_security_data *sd)
 {
@@ -159,25 +753,40 @@ recalculate_security_data_length(struct wim_security_data *sd)
 	sd->total_length = ALIGN(total_length, 8);
 }
 
-static int
+/*
+ * Prepare to write the metadata resource of the specified image: lay out the
+ * dentry tree by computing the subdirectory offsets, then set up @blob as a
+ * blob whose data is the metadata resource, serialized on demand by
+ * serialize_metadata_resource(), and compute its SHA-1 message digest.  The
+ * full uncompressed resource, which can be very large, is therefore never held
+ * in memory at once.  The image must not be modified until @blob is no longer
+ * needed.
+ */
+int
 prepare_metadata_resource(WIMStruct *wim, int image,
-			  u8 **buf_ret, size_t *len_ret)
+			  struct blob_descriptor *blob)
 {
-	u8 *buf;
-	u8 *p;
 	int ret;
 	u64 subdir_offset;
 	struct wim_dentry *root;
-	size_t len;
 	struct wim_security_data *sd;
 	struct wim_image_metadata *imd;
+	struct sha1_ctx sha_ctx;
+	struct consume_chunk_callback cb = {
+		.func	= sha1_chunk_cb,
+		.ctx	= &sha_ctx,
+	};
 
-	ret = select_wim_image(wim, image);
+	ret = select_wim_image_lazily(wim, image);
 	if (ret)
 		return ret;
 
 	imd = wim->image_metadata[image - 1];
 
+	ret = finish_loading_unspilled_image(imd);
+	if (ret)
+		return ret;
+
 	root = imd->root_dentry;
 	sd = imd->security_data;
 
@@ -196,64 +805,103 @@ prepare_metadata_resource(WIMStruct *wim, int image,
 	recalculate_security_data_length(sd);
 	subdir_offset = sd->total_length + dentry_out_total_length(root) + 8;
 
-	/* Calculate the subdirectory offsets for the entire dentry tree.  */
-	calculate_subdir_offsets(root, &subdir_offset);
+	/* Calculate the subdirectory offsets for the entire dentry tree.  After
+	 * this, the total length of the metadata resource (uncompressed) is the
+	 * final subdirectory offset.  */
+	calculate_subdir_offsets(imd, root, &subdir_offset);
 
-	/* Total length of the metadata resource (uncompressed).  */
-	len = subdir_offset;
+	blob_set_is_located_in_dentry_tree(blob, imd, subdir_offset);
 
-	/* Allocate a buffer to contain the uncompressed metadata resource.  */
-	buf = NULL;
-	if (likely(len == subdir_offset))
-		buf = MALLOC(len);
-	if (!buf) {
-		ERROR("Failed to allocate %"PRIu64" bytes for "
-		      "metadata resource", subdir_offset);
-		return WIMLIB_ERR_NOMEM;
-	}
+	sha1_init(&sha_ctx);
+	ret = serialize_metadata_resource(imd, blob->size, &cb);
+	if (ret)
+		return ret;
+	sha1_final(&sha_ctx, blob->hash);
+	return 0;
+}
 
-	/* Write the security data into the resource buffer.  */
-	p = write_wim_security_data(sd, buf);
+/* Size of the buffer used to serialize metadata resources  */
+#define METADATA_OUT_BUFFER_SIZE	((size_t)256 << 10)
 
-	/* Write the dentry tree into the resource buffer.  */
-	p = write_dentry_tree(root, p);
+static int
+metadata_out_flush(struct metadata_out *out)
+{
+	size_t n = min((u64)(out->next - out->begin), out->remaining);
 
-	/* We MUST have exactly filled the buffer; otherwise we calculated its
-	 * size incorrectly or wrote the data incorrectly.  */
-	wimlib_assert(p - buf == len);
+	out->next = out->begin;
+	if (n == 0)
+		return 0;
+	out->remaining -= n;
+	return consume_chunk(out->cb, out->begin, n);
+}
 
-	*buf_ret = buf;
-	*len_ret = len;
+/* Make at least @size bytes available at out->next, first passing the data
+ * written so far to the callback if needed.  */
+int
+metadata_out_reserve(struct metadata_out *out, size_t size)
+{
+	int ret;
+
+	if (likely(out->end - out->next >= size))
+		return 0;
+
+	ret = metadata_out_flush(out);
+	if (ret)
+		return ret;
+
+	if (out->end - out->begin < size) {
+		/* Something (probably the security data) is larger than the
+		 * buffer.  */
+		u8 *begin = REALLOC(out->begin, size);
+
+		if (!begin)
+			return WIMLIB_ERR_NOMEM;
+		out->begin = begin;
+		out->next = begin;
+		out->end = begin + size;
+	}
 	return 0;
 }
 
+/*
+ * Serialize the first @size bytes of the metadata resource of the image @imd,
+ * which must have been laid out by prepare_metadata_resource(), and pass them
+ * to @cb in pieces.
+ */
 int
-write_metadata_resource(WIMStruct *wim, int image, int write_resource_flags)
+serialize_metadata_resource(struct wim_image_metadata *imd, u64 size,
+			    const struct consume_chunk_callback *cb)
 {
+	struct wim_security_data *sd = imd->security_data;
+	struct metadata_out out;
 	int ret;
-	u8 *buf;
-	size_t len;
-	struct wim_image_metadata *imd;
 
-	ret = prepare_metadata_resource(wim, image, &buf, &len);
+	out.begin = MALLOC(METADATA_OUT_BUFFER_SIZE);
+	if (!out.begin)
+		return WIMLIB_ERR_NOMEM;
+	out.next = out.begin;
+	out.end = out.begin + METADATA_OUT_BUFFER_SIZE;
+	out.remaining = size;
+	out.cb = cb;
+
+	/* Write the security data.  */
+	ret = metadata_out_reserve(&out, sd->total_length);
 	if (ret)
-		return ret;
+		goto out;
+	out.next = write_wim_security_data(sd, out.next);
 
-	imd = wim->image_metadata[image - 1];
+	/* Write the dentry tree.  */
+	ret = write_dentry_tree(imd, imd->root_dentry, &out);
+	if (ret)
+		goto out;
 
-	/* Write the metadata resource to the output WIM using the proper
-	 * compression type, in the process updating the blob descriptor for the
-	 * metadata resource.  */
-	ret = write_wim_resource_from_buffer(buf,
-					     len,
-					     true,
-					     &wim->out_fd,
-					     wim->out_compression_type,
-					     wim->out_chunk_size,
-					     &imd->metadata_blob->out_reshdr,
-					     imd->metadata_blob->hash,
-					     write_resource_flags);
-
-	FREE(buf);
+	ret = metadata_out_flush(&out);
+
+	/* We MUST have produced at least @size bytes; otherwise the layout was
+	 * calculated incorrectly or the data was written incorrectly.  */
+	wimlib_assert(ret || out.remaining == 0);
+out:
+	FREE(out.begin);
 	return ret;
 }
+
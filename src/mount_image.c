@@ -60,6 +60,8 @@
 #include "wimlib/paths.h"
 #include "wimlib/progress.h"
 #include "wimlib/reparse.h"
+#include "wimlib/resource.h"
+#include "wimlib/scan.h"
 #include "wimlib/threads.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
@@ -83,6 +85,19 @@
 
 #define WIMFS_MQUEUE_NAME_LEN 32
 
+/* Number of hash buckets in the path cache of a mounted image, and the number
+ * of paths at which the cache is emptied to bound its memory usage  */
+#define WIMFS_PATH_CACHE_ORDER		14
+#define WIMFS_PATH_CACHE_NUM_BUCKETS	(1 << WIMFS_PATH_CACHE_ORDER)
+#define WIMFS_PATH_CACHE_MAX_ENTRIES	(1 << 16)
+
+#define WIMFS_DIR_CACHE_ORDER		10
+#define WIMFS_DIR_CACHE_NUM_BUCKETS	(1 << WIMFS_DIR_CACHE_ORDER)
+#define WIMFS_DIR_CACHE_MAX_SIZE	(16 << 20)
+
+/* Largest write request to accept from the kernel in a read-write mount  */
+#define WIMFS_MAX_WRITE			(1 << 20)
+
 #define WIMLIB_UNMOUNT_FLAG_SEND_PROGRESS 0x80000000
 
 struct wimfs_unmount_info {
@@ -135,10 +150,69 @@ struct wimfs_fd {
 	 * even if the indices of the inode's streams are changed by a deletion.
 	 */
 	u32 f_stream_id;
+
+	/* State for reading ahead of sequential reads of a blob in the WIM.  In
+	 * a multi-threaded mount, 'f_readahead_busy' is set, under the mount
+	 * lock, while one of the reads through this file descriptor is using
+	 * it.  */
+	struct chunk_readahead f_readahead;
+	bool f_readahead_busy;
 };
 
 #define WIMFS_FD(fi) ((struct wimfs_fd *)(uintptr_t)((fi)->fh))
 
+/* A path that was looked up in the mounted WIM image, and the dentry it
+ * resolved to  */
+struct wimfs_path_cache_entry {
+	struct hlist_node hash_node;
+	struct wim_dentry *dentry;
+	u64 hash;
+	size_t path_len;
+	char path[];
+};
+
+/*
+ * A hash table mapping full paths in the mounted WIM image to dentries, so that
+ * the many operations that FUSE identifies by path, such as getattr(), don't
+ * each have to look up every path component from the root.  Only successful
+ * lookups are cached, so that creating files doesn't invalidate anything.
+ * Removing a dentry invalidates its path; renaming invalidates everything,
+ * since it may move a whole subtree.
+ */
+struct wimfs_path_cache {
+	struct hlist_head buckets[WIMFS_PATH_CACHE_NUM_BUCKETS];
+	size_t num_entries;
+};
+
+/* A child of a directory, as listed by wimfs_readdir()  */
+struct wimfs_dir_cache_child {
+	const struct wim_dentry *dentry;
+
+	/* The child's name in the locale's encoding  */
+	char *name;
+};
+
+/* The children of a directory in the mounted WIM image, with their names
+ * already converted from UTF-16LE.  */
+struct wimfs_dir_cache_entry {
+	struct hlist_node hash_node;
+	const struct wim_inode *dir;
+	size_t alloc_size;
+	size_t num_children;
+	struct wimfs_dir_cache_child children[];
+};
+
+/*
+ * A hash table mapping directory inodes to their listings, so that listing a
+ * directory repeatedly doesn't convert every name each time.  Adding or
+ * removing a child invalidates its directory's listing; renaming invalidates
+ * everything, like for the path cache.
+ */
+struct wimfs_dir_cache {
+	struct hlist_head buckets[WIMFS_DIR_CACHE_NUM_BUCKETS];
+	size_t total_size;
+};
+
 /* Context structure for a mounted WIM image.  */
 struct wimfs_context {
 	/* The WIMStruct containing the mounted image.  The mounted image is the
@@ -171,6 +245,11 @@ struct wimfs_context {
 	 * good enough to just generate inode numbers sequentially.  */
 	u64 next_ino;
 
+	/* For read-only mounts, whose image is loaded lazily, the inode that
+	 * was at the head of the image's inode list when inode numbers were
+	 * last assigned.  Inodes loaded since then are in front of it.  */
+	struct hlist_node *numbered_inodes;
+
 	/* Number of file descriptors open to the mounted WIM image.  */
 	unsigned long num_open_fds;
 
@@ -181,6 +260,27 @@ struct wimfs_context {
 	/* Parameters for unmounting the image (can be set via extended
 	 * attribute "wimfs.unmount_info").  */
 	struct wimfs_unmount_info unmount_info;
+
+	/* Cache of path lookups, or NULL if it couldn't be allocated  */
+	struct wimfs_path_cache *path_cache;
+
+	/* Cache of directory listings, or NULL if it couldn't be allocated  */
+	struct wimfs_dir_cache *dir_cache;
+
+	/* For read-write mounts, the hasher which computes the SHA-1 message
+	 * digests of the staging files of closed streams in the background, or
+	 * NULL if it isn't running  */
+	struct scan_hasher *hasher;
+
+	/* True if the kernel caches writes to files and sends them to us in
+	 * large batches, rather than passing each write() on right away  */
+	bool writeback_cache;
+
+	/* For multi-threaded mounts, the lock that serializes all operations
+	 * except the reading and decompressing of file data, and the key for
+	 * each FUSE thread's 'struct thread_decompressor'.  */
+	struct mutex lock;
+	pthread_key_t decompressor_key;
 };
 
 #define WIMFS_CTX(fuse_ctx) ((struct wimfs_context*)(fuse_ctx)->private_data)
@@ -295,6 +395,8 @@ alloc_wimfs_fd(struct wim_inode *inode,
 	filedes_invalidate(&fd->f_staging_fd);
 	fd->f_idx       = i;
 	fd->f_stream_id	= strm->stream_id;
+	memset(&fd->f_readahead, 0, sizeof(fd->f_readahead));
+	fd->f_readahead_busy = false;
 	*fd_ret         = fd;
 	inode->i_fds[i] = fd;
 	inode->i_num_opened_fds++;
@@ -321,6 +423,16 @@ close_wimfs_fd(struct wimfs_fd *fd)
 		 if (filedes_close(&fd->f_staging_fd))
 			 ret = -errno;
 
+	chunk_readahead_destroy(&fd->f_readahead);
+
+	/* When the last file descriptor to a staging file is closed, start
+	 * hashing the file in the background, so that committing the image
+	 * won't have to.  Opening the stream for writing again cancels this.  */
+	if (fd->f_blob && fd->f_blob->num_opened_fds == 1 &&
+	    fd->f_blob->unhashed && fd->f_blob->refcnt &&
+	    fd->f_blob->size && !fd->f_blob->scan_hash_job)
+		scan_hasher_submit(wimfs_get_context()->hasher, fd->f_blob);
+
 	/* Release this file descriptor from its blob descriptor.  */
 	if (fd->f_blob)
 		blob_decrement_num_opened_fds(fd->f_blob);
@@ -337,6 +449,324 @@ close_wimfs_fd(struct wimfs_fd *fd)
 	return ret;
 }
 
+static u64
+hash_path(const char *path, size_t len)
+{
+	u64 hash = 0;
+
+	for (size_t i = 0; i < len; i++)
+		hash = hash_u64(hash + (unsigned char)path[i]);
+	return hash;
+}
+
+static void
+path_cache_clear(struct wimfs_path_cache *cache)
+{
+	for (size_t i = 0; i < WIMFS_PATH_CACHE_NUM_BUCKETS; i++) {
+		struct hlist_head *head = &cache->buckets[i];
+
+		while (!hlist_empty(head)) {
+			struct wimfs_path_cache_entry *ent =
+				hlist_entry(head->first,
+					    struct wimfs_path_cache_entry,
+					    hash_node);
+			hlist_del(&ent->hash_node);
+			FREE(ent);
+		}
+	}
+	cache->num_entries = 0;
+}
+
+static struct wimfs_path_cache *
+new_path_cache(void)
+{
+	struct wimfs_path_cache *cache = MALLOC(sizeof(*cache));
+
+	if (cache) {
+		for (size_t i = 0; i < WIMFS_PATH_CACHE_NUM_BUCKETS; i++)
+			INIT_HLIST_HEAD(&cache->buckets[i]);
+		cache->num_entries = 0;
+	}
+	return cache;
+}
+
+static void
+free_path_cache(struct wimfs_path_cache *cache)
+{
+	if (cache) {
+		path_cache_clear(cache);
+		FREE(cache);
+	}
+}
+
+static void
+path_cache_del(struct wimfs_path_cache *cache,
+	       struct wimfs_path_cache_entry *ent)
+{
+	hlist_del(&ent->hash_node);
+	FREE(ent);
+	cache->num_entries--;
+}
+
+/* Remove @dentry, which is about to be freed, from the path cache of @ctx.
+ * @path is the path by which it was looked up.  */
+static void
+path_cache_remove(const struct wimfs_context *ctx, const char *path,
+		  const struct wim_dentry *dentry)
+{
+	struct wimfs_path_cache *cache = ctx->path_cache;
+	size_t len = strlen(path);
+	u64 hash = hash_path(path, len);
+	struct wimfs_path_cache_entry *ent;
+
+	if (!cache)
+		return;
+	hlist_for_each_entry(ent, &cache->buckets[
+				hash >> (64 - WIMFS_PATH_CACHE_ORDER)],
+			     hash_node)
+	{
+		if (ent->dentry == dentry) {
+			path_cache_del(cache, ent);
+			return;
+		}
+	}
+
+	/* The dentry may have been cached under its path without a stream name
+	 * suffix, so look for it everywhere.  */
+	for (size_t i = 0; i < WIMFS_PATH_CACHE_NUM_BUCKETS; i++) {
+		hlist_for_each_entry(ent, &cache->buckets[i], hash_node) {
+			if (ent->dentry == dentry) {
+				path_cache_del(cache, ent);
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * In a read-only mount, the directories of the image are only loaded as they're
+ * looked up.  Give the inodes loaded since last time their inode numbers.
+ */
+static void
+number_loaded_inodes(struct wimfs_context *ctx)
+{
+	struct wim_image_metadata *imd = wim_get_current_image_metadata(ctx->wim);
+	struct hlist_node *node;
+
+	if (ctx->mount_flags & WIMLIB_MOUNT_FLAG_READWRITE)
+		return;
+
+	for (node = imd->inode_list.first; node != ctx->numbered_inodes;
+	     node = node->next)
+	{
+		hlist_entry(node, struct wim_inode, i_hlist_node)->i_ino =
+			ctx->next_ino++;
+	}
+	ctx->numbered_inodes = imd->inode_list.first;
+}
+
+/*
+ * Translate a path into the corresponding dentry in the mounted WIM image,
+ * using the path cache if possible.
+ *
+ * See get_dentry() for more information.
+ *
+ * Returns a pointer to the resulting dentry, or NULL with errno set.
+ */
+static struct wim_dentry *
+wimfs_get_dentry(struct wimfs_context *ctx, const char *path)
+{
+	struct wimfs_path_cache *cache = ctx->path_cache;
+	size_t len;
+	u64 hash;
+	struct hlist_head *head;
+	struct wimfs_path_cache_entry *ent;
+	struct wim_dentry *dentry;
+
+	if (!cache) {
+		dentry = get_dentry(ctx->wim, path, WIMLIB_CASE_SENSITIVE);
+		number_loaded_inodes(ctx);
+		return dentry;
+	}
+
+	len = strlen(path);
+	hash = hash_path(path, len);
+	head = &cache->buckets[hash >> (64 - WIMFS_PATH_CACHE_ORDER)];
+	hlist_for_each_entry(ent, head, hash_node) {
+		if (ent->hash == hash && ent->path_len == len &&
+		    !memcmp(ent->path, path, len))
+			return ent->dentry;
+	}
+
+	dentry = get_dentry(ctx->wim, path, WIMLIB_CASE_SENSITIVE);
+	number_loaded_inodes(ctx);
+	if (!dentry)
+		return NULL;
+
+	/* Cache the result; this isn't needed for correctness, so just skip it
+	 * if out of memory.  */
+	if (cache->num_entries >= WIMFS_PATH_CACHE_MAX_ENTRIES)
+		path_cache_clear(cache);
+	ent = MALLOC(sizeof(*ent) + len);
+	if (ent) {
+		ent->dentry = dentry;
+		ent->hash = hash;
+		ent->path_len = len;
+		memcpy(ent->path, path, len);
+		hlist_add_head(&ent->hash_node, head);
+		cache->num_entries++;
+	}
+	return dentry;
+}
+
+static struct hlist_head *
+dir_cache_bucket(struct wimfs_dir_cache *cache, const struct wim_inode *dir)
+{
+	u64 hash = hash_u64((uintptr_t)dir);
+
+	return &cache->buckets[hash >> (64 - WIMFS_DIR_CACHE_ORDER)];
+}
+
+static void
+free_dir_cache_entry(struct wimfs_dir_cache_entry *ent)
+{
+	for (size_t i = 0; i < ent->num_children; i++)
+		FREE(ent->children[i].name);
+	FREE(ent);
+}
+
+static void
+dir_cache_clear(struct wimfs_dir_cache *cache)
+{
+	for (size_t i = 0; i < WIMFS_DIR_CACHE_NUM_BUCKETS; i++) {
+		struct hlist_head *head = &cache->buckets[i];
+
+		while (!hlist_empty(head)) {
+			struct wimfs_dir_cache_entry *ent =
+				hlist_entry(head->first,
+					    struct wimfs_dir_cache_entry,
+					    hash_node);
+			hlist_del(&ent->hash_node);
+			free_dir_cache_entry(ent);
+		}
+	}
+	cache->total_size = 0;
+}
+
+static struct wimfs_dir_cache *
+new_dir_cache(void)
+{
+	struct wimfs_dir_cache *cache = MALLOC(sizeof(*cache));
+
+	if (cache) {
+		for (size_t i = 0; i < WIMFS_DIR_CACHE_NUM_BUCKETS; i++)
+			INIT_HLIST_HEAD(&cache->buckets[i]);
+		cache->total_size = 0;
+	}
+	return cache;
+}
+
+static void
+free_dir_cache(struct wimfs_dir_cache *cache)
+{
+	if (cache) {
+		dir_cache_clear(cache);
+		FREE(cache);
+	}
+}
+
+/* Forget the cached listing of the directory @dir, whose children are about to
+ * change or which is about to be freed.  */
+static void
+dir_cache_invalidate(const struct wimfs_context *ctx,
+		     const struct wim_inode *dir)
+{
+	struct wimfs_dir_cache *cache = ctx->dir_cache;
+	struct wimfs_dir_cache_entry *ent;
+
+	if (!cache)
+		return;
+	hlist_for_each_entry(ent, dir_cache_bucket(cache, dir), hash_node) {
+		if (ent->dir == dir) {
+			hlist_del(&ent->hash_node);
+			cache->total_size -= ent->alloc_size;
+			free_dir_cache_entry(ent);
+			return;
+		}
+	}
+}
+
+/*
+ * Get the listing of the directory @dir, from the directory cache if possible.
+ * If @ctx has no directory cache, the caller must free the listing with
+ * free_dir_cache_entry().
+ *
+ * Returns a pointer to the listing, or NULL with errno set.
+ */
+static struct wimfs_dir_cache_entry *
+wimfs_get_dir_listing(struct wimfs_context *ctx,
+		      const struct wim_inode *dir)
+{
+	struct wimfs_dir_cache *cache = ctx->dir_cache;
+	struct wimfs_dir_cache_entry *ent;
+	const struct wim_dentry *child;
+	size_t num_children = 0;
+	size_t alloc_size;
+	int ret;
+
+	if (cache) {
+		hlist_for_each_entry(ent, dir_cache_bucket(cache, dir),
+				     hash_node)
+		{
+			if (ent->dir == dir)
+				return ent;
+		}
+	}
+
+	/* A directory has only one dentry.  */
+	ret = load_dentry_children(wim_get_current_image_metadata(ctx->wim),
+				   inode_any_dentry(dir));
+	number_loaded_inodes(ctx);
+	if (ret) {
+		errno = (ret == WIMLIB_ERR_NOMEM) ? ENOMEM : EIO;
+		return NULL;
+	}
+
+	for_inode_child(child, dir)
+		num_children++;
+
+	alloc_size = sizeof(*ent) + num_children * sizeof(ent->children[0]);
+	ent = MALLOC(alloc_size);
+	if (!ent)
+		return NULL;
+	ent->dir = dir;
+	ent->num_children = 0;
+	for_inode_child(child, dir) {
+		struct wimfs_dir_cache_child *c =
+			&ent->children[ent->num_children];
+		size_t name_nbytes;
+
+		if (utf16le_to_tstr(child->d_name, child->d_name_nbytes,
+				    &c->name, &name_nbytes))
+		{
+			free_dir_cache_entry(ent);
+			return NULL;
+		}
+		c->dentry = child;
+		ent->num_children++;
+		alloc_size += name_nbytes + 1;
+	}
+	ent->alloc_size = alloc_size;
+
+	if (cache) {
+		if (cache->total_size + alloc_size > WIMFS_DIR_CACHE_MAX_SIZE)
+			dir_cache_clear(cache);
+		hlist_add_head(&ent->hash_node, dir_cache_bucket(cache, dir));
+		cache->total_size += alloc_size;
+	}
+	return ent;
+}
+
 /*
  * Translate a path into the corresponding inode in the mounted WIM image.
  *
@@ -345,11 +775,11 @@ close_wimfs_fd(struct wimfs_fd *fd)
  * Returns a pointer to the resulting inode, or NULL with errno set.
  */
 static struct wim_inode *
-wim_pathname_to_inode(WIMStruct *wim, const char *path)
+wim_pathname_to_inode(struct wimfs_context *ctx, const char *path)
 {
 	struct wim_dentry *dentry;
 
-	dentry = get_dentry(wim, path, WIMLIB_CASE_SENSITIVE);
+	dentry = wimfs_get_dentry(ctx, path);
 	if (!dentry)
 		return NULL;
 	return dentry->d_inode;
@@ -391,7 +821,7 @@ inode_get_data_stream_tstr(const struct wim_inode *inode,
  * Returns 0 or a -errno code.  @dentry_ret and @strm_ret are both optional.
  */
 static int
-wim_pathname_to_stream(const struct wimfs_context *ctx,
+wim_pathname_to_stream(struct wimfs_context *ctx,
 		       const char *path,
 		       int lookup_flags,
 		       struct wim_dentry **dentry_ret,
@@ -414,7 +844,7 @@ wim_pathname_to_stream(const struct wimfs_context *ctx,
 		}
 	}
 
-	dentry = get_dentry(wim, path, WIMLIB_CASE_SENSITIVE);
+	dentry = wimfs_get_dentry(ctx, path);
 	if (p)
 		*p = ':';
 	if (!dentry)
@@ -521,6 +951,7 @@ create_file(struct fuse_context *fuse_ctx, const char *path,
 	hlist_add_head(&inode->i_hlist_node,
 		       &wim_get_current_image_metadata(wimfs_ctx->wim)->inode_list);
 
+	dir_cache_invalidate(wimfs_ctx, parent->d_inode);
 	dentry_add_child(parent, dentry);
 
 	*dentry_ret = dentry;
@@ -534,6 +965,13 @@ create_file(struct fuse_context *fuse_ctx, const char *path,
 static void
 remove_dentry(struct wim_dentry *dentry, struct blob_table *blob_table)
 {
+	const struct wimfs_context *ctx = wimfs_get_context();
+
+	/* Forget the listing of the parent directory, and of the dentry itself
+	 * if it's a directory, since the inode's memory may be reused.  */
+	dir_cache_invalidate(ctx, dentry->d_parent->d_inode);
+	dir_cache_invalidate(ctx, dentry->d_inode);
+
 	/* Drop blob references.  */
 	inode_unref_blobs(dentry->d_inode, blob_table);
 
@@ -591,6 +1029,10 @@ blob_stored_size(const struct blob_descriptor *blob)
  * queried, or NULL.  We mostly return the same information for all streams, but
  * st_size and st_blocks may be different for different streams.
  *
+ * With the writeback cache, the kernel keeps its own st_size and st_mtime for a
+ * file it has cached writes to, so these may be ahead of what is returned here
+ * until the writes have been written back.
+ *
  * This always returns 0.
  */
 static int
@@ -712,10 +1154,230 @@ retry:
 	return fd;
 }
 
+/*
+ * Opening a stream for writing doesn't copy its data from the WIM into the
+ * staging file right away, which for a large file could take minutes.
+ * Instead, the staging file starts out sparse, and its 'struct staging_cow'
+ * tracks which blocks still have to be read from the WIM.  A block is copied
+ * into the staging file just before it's first partly written, and any blocks
+ * still clean when the image is committed are copied then.
+ */
+#define STAGING_COW_BLOCK_ORDER	16
+#define STAGING_COW_BLOCK_SIZE	((u64)1 << STAGING_COW_BLOCK_ORDER)
+
+static bool
+staging_block_is_clean(const struct staging_cow *cow, u64 block)
+{
+	return block < cow->num_blocks &&
+		((cow->clean_map[block / WORDBITS] >> (block % WORDBITS)) & 1);
+}
+
+static void
+staging_block_set_dirty(struct staging_cow *cow, u64 block)
+{
+	if (staging_block_is_clean(cow, block)) {
+		cow->clean_map[block / WORDBITS] &=
+			~((machine_word_t)1 << (block % WORDBITS));
+		cow->num_clean--;
+	}
+}
+
+/* Free the blob's copy-on-write state once no blocks are clean anymore.  */
+static void
+staging_cow_check_done(struct blob_descriptor *blob)
+{
+	if (blob->staging_cow && blob->staging_cow->num_clean == 0) {
+		free_staging_cow(blob->staging_cow);
+		blob->staging_cow = NULL;
+	}
+}
+
+/* Read @size bytes at @offset of a blob, all in clean blocks, from the blob it
+ * had before.  Returns 0 or a -errno code.  */
+static int
+read_clean_data(const struct staging_cow *cow, u64 offset, size_t size,
+		void *buf)
+{
+	size_t n = 0;
+
+	if (offset < cow->base_size) {
+		n = min(size, cow->base_size - offset);
+		errno = 0;
+		if (read_partial_wim_blob_into_buf(cow->base, offset, n, buf))
+			return errno ? -errno : -EIO;
+	}
+	memset((u8 *)buf + n, 0, size - n);
+	return 0;
+}
+
+/* Copy a clean block into the staging file open as @staging_fd, and mark it
+ * dirty.  Returns 0 or a -errno code.  */
+static int
+fill_staging_block(struct filedes *staging_fd, struct staging_cow *cow,
+		   u64 block)
+{
+	u64 offset = block << STAGING_COW_BLOCK_ORDER;
+	size_t size;
+	void *buf;
+	int ret;
+
+	if (!staging_block_is_clean(cow, block))
+		return 0;
+	size = 0;
+	if (offset < cow->base_size)
+		size = min(STAGING_COW_BLOCK_SIZE, cow->base_size - offset);
+	buf = MALLOC(max(size, 1));
+	if (!buf)
+		return -ENOMEM;
+	ret = read_clean_data(cow, offset, size, buf);
+	if (!ret && full_pwrite(staging_fd, buf, size, offset))
+		ret = -errno;
+	FREE(buf);
+	if (!ret)
+		staging_block_set_dirty(cow, block);
+	return ret;
+}
+
+/* Read from a blob in a staging file that may have clean blocks.  The range
+ * must be within the blob.  Returns the number of bytes read or a -errno code.
+ */
+static ssize_t
+read_staging_cow_blob(struct wimfs_fd *fd, const struct blob_descriptor *blob,
+		      u64 offset, size_t size, u8 *buf)
+{
+	const struct staging_cow *cow = blob->staging_cow;
+	const u64 end = offset + size;
+	u64 pos = offset;
+
+	while (pos < end) {
+		bool clean = staging_block_is_clean(cow,
+					pos >> STAGING_COW_BLOCK_ORDER);
+		u64 run_end = pos;
+		int ret;
+
+		/* Read a run of blocks that are all clean or all dirty.  */
+		do {
+			run_end = min(end, ((run_end >> STAGING_COW_BLOCK_ORDER) +
+					    1) << STAGING_COW_BLOCK_ORDER);
+		} while (run_end < end &&
+			 staging_block_is_clean(cow, run_end >>
+						STAGING_COW_BLOCK_ORDER) == clean);
+
+		if (clean) {
+			ret = read_clean_data(cow, pos, run_end - pos,
+					      buf + (pos - offset));
+		} else {
+			ret = 0;
+			if (full_pread(&fd->f_staging_fd, buf + (pos - offset),
+				       run_end - pos, pos))
+				ret = -errno;
+		}
+		if (ret)
+			return ret;
+		pos = run_end;
+	}
+	return size;
+}
+
+/* Before writing @size bytes at @offset through @fd, copy the clean blocks that
+ * the write will cover only part of into the staging file.  Returns 0 or a
+ * -errno code.  */
+static int
+prepare_staging_cow_write(struct wimfs_fd *fd, u64 offset, size_t size)
+{
+	struct staging_cow *cow = fd->f_blob->staging_cow;
+	u64 blocks[2] = {
+		offset >> STAGING_COW_BLOCK_ORDER,
+		(offset + size - 1) >> STAGING_COW_BLOCK_ORDER,
+	};
+
+	for (int i = 0; i < 2; i++) {
+		u64 start = blocks[i] << STAGING_COW_BLOCK_ORDER;
+		u64 end = min(start + STAGING_COW_BLOCK_SIZE, cow->base_size);
+		int ret;
+
+		/* Only the part of the block before base_size matters.  */
+		if (offset <= start && offset + size >= end)
+			continue;
+		ret = fill_staging_block(&fd->f_staging_fd, cow, blocks[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* After @size bytes were written at @offset, mark the blocks they covered as
+ * dirty.  Blocks they covered only part of were already filled in.  */
+static void
+staging_cow_written(struct blob_descriptor *blob, u64 offset, size_t size)
+{
+	struct staging_cow *cow = blob->staging_cow;
+	u64 block = offset >> STAGING_COW_BLOCK_ORDER;
+	u64 last = (offset + size - 1) >> STAGING_COW_BLOCK_ORDER;
+
+	for (; block <= last && block < cow->num_blocks; block++) {
+		u64 start = block << STAGING_COW_BLOCK_ORDER;
+		u64 end = min(start + STAGING_COW_BLOCK_SIZE, cow->base_size);
+
+		if (offset <= start && offset + size >= end)
+			staging_block_set_dirty(cow, block);
+	}
+	staging_cow_check_done(blob);
+}
+
+/* After a blob in a staging file was truncated to @size bytes, forget the
+ * clean data beyond that.  */
+static void
+staging_cow_truncated(struct blob_descriptor *blob, u64 size)
+{
+	struct staging_cow *cow = blob->staging_cow;
+
+	if (!cow || size >= cow->base_size)
+		return;
+	cow->base_size = size;
+	for (u64 block = DIV_ROUND_UP(size, STAGING_COW_BLOCK_SIZE);
+	     block < cow->num_blocks; block++)
+		staging_block_set_dirty(cow, block);
+	staging_cow_check_done(blob);
+}
+
+/* Copy all clean blocks of a blob into its staging file, so that the staging
+ * file contains all the data for the image to be committed.  */
+static int
+finish_staging_cow(struct blob_descriptor *blob)
+{
+	struct staging_cow *cow = blob->staging_cow;
+	struct filedes fd;
+	int raw_fd;
+	int ret = 0;
+
+	raw_fd = openat(blob->staging_dir_fd, blob->staging_file_name,
+			O_WRONLY | O_NOFOLLOW);
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("Can't open staging file \"%s\"",
+				 blob->staging_file_name);
+		return WIMLIB_ERR_OPEN;
+	}
+	filedes_init(&fd, raw_fd);
+	for (u64 block = 0; block < cow->num_blocks && !ret; block++)
+		ret = fill_staging_block(&fd, cow, block);
+	if (filedes_close(&fd) && !ret)
+		ret = -errno;
+	if (ret) {
+		errno = -ret;
+		ERROR_WITH_ERRNO("Can't fill in staging file \"%s\"",
+				 blob->staging_file_name);
+		return WIMLIB_ERR_WRITE;
+	}
+	staging_cow_check_done(blob);
+	return 0;
+}
+
 /*
  * Extract a blob to the staging directory.  This is necessary when a stream
  * using the blob is being opened for writing and the blob has not already been
- * extracted to the staging directory.
+ * extracted to the staging directory.  If the blob is in the WIM, the staging
+ * file is only created sparse, and the data is copied into it as needed.
  *
  * @inode
  *	The inode containing the stream being opened for writing.
@@ -737,6 +1399,7 @@ extract_blob_to_staging_dir(struct wim_inode *inode,
 {
 	struct blob_descriptor *old_blob;
 	struct blob_descriptor *new_blob;
+	struct staging_cow *cow = NULL;
 	char *staging_file_name;
 	int staging_fd;
 	off_t extract_size;
@@ -745,13 +1408,27 @@ extract_blob_to_staging_dir(struct wim_inode *inode,
 
 	old_blob = stream_blob_resolved(strm);
 
+	/* Data in the WIM is copied into the staging file lazily; see
+	 * fill_staging_block().  */
+	if (old_blob && old_blob->blob_location == BLOB_IN_WIM &&
+	    min(old_blob->size, size) != 0)
+	{
+		cow = new_staging_cow(old_blob, min(old_blob->size, size),
+				      STAGING_COW_BLOCK_ORDER);
+		if (!cow)
+			return -ENOMEM;
+	}
+
 	/* Create the staging file.  */
 	staging_fd = create_staging_file(ctx, &staging_file_name);
-	if (unlikely(staging_fd < 0))
-		return -errno;
+	if (unlikely(staging_fd < 0)) {
+		ret = -errno;
+		free_staging_cow(cow);
+		return ret;
+	}
 
 	/* Extract the stream to the staging file (possibly truncated).  */
-	if (old_blob) {
+	if (old_blob && !cow) {
 		struct filedes fd;
 
 		filedes_init(&fd, staging_fd);
@@ -822,6 +1499,7 @@ extract_blob_to_staging_dir(struct wim_inode *inode,
 	new_blob->blob_location     = BLOB_IN_STAGING_FILE;
 	new_blob->staging_file_name = staging_file_name;
 	new_blob->staging_dir_fd    = ctx->staging_dir_fd;
+	new_blob->staging_cow       = cow;
 	new_blob->size              = size;
 
 	prepare_unhashed_blob(new_blob, inode, strm->stream_id,
@@ -847,6 +1525,7 @@ out_revert_fd_changes:
 out_delete_staging_file:
 	unlinkat(ctx->staging_dir_fd, staging_file_name, 0);
 	FREE(staging_file_name);
+	free_staging_cow(cow);
 	return ret;
 }
 
@@ -996,6 +1675,7 @@ prepare_inodes(struct wimfs_context *ctx)
 		inode->i_num_allocated_fds = 0;
 		inode->i_fds = NULL;
 	}
+	ctx->numbered_inodes = imd->inode_list.first;
 }
 
 /* Delete the 'struct blob_descriptor' for any stream that was modified
@@ -1017,6 +1697,29 @@ delete_empty_blobs(struct wimfs_context *ctx)
 	}
 }
 
+/* Copy the data still in the WIM into the staging files of any streams that
+ * were opened for writing, so the staging files can be written as blobs.  */
+static int
+finish_staging_cow_blobs(struct wimfs_context *ctx)
+{
+	struct blob_descriptor *blob;
+	struct wim_image_metadata *imd;
+	int ret;
+
+	imd = wim_get_current_image_metadata(ctx->wim);
+
+	image_for_each_unhashed_blob(blob, imd) {
+		if (blob->blob_location == BLOB_IN_STAGING_FILE &&
+		    blob->staging_cow)
+		{
+			ret = finish_staging_cow(blob);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
 /* Close all file descriptors open to the specified inode.
  *
  * Note: closing the last file descriptor might free the inode.  */
@@ -1127,6 +1830,7 @@ static int
 commit_image(struct wimfs_context *ctx, int unmount_flags, mqd_t mq)
 {
 	int write_flags;
+	int ret;
 
 	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_SEND_PROGRESS)
 		wimlib_register_progress_function(ctx->wim,
@@ -1135,12 +1839,24 @@ commit_image(struct wimfs_context *ctx, int unmount_flags, mqd_t mq)
 		wimlib_register_progress_function(ctx->wim, NULL, NULL);
 
 	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_NEW_IMAGE) {
-		int ret = renew_current_image(ctx);
+		ret = renew_current_image(ctx);
 		if (ret)
 			return ret;
 	}
 	delete_empty_blobs(ctx);
 
+	ret = finish_staging_cow_blobs(ctx);
+	if (ret)
+		return ret;
+
+	/* Collect the SHA-1 message digests of the staging files that were
+	 * hashed in the background, which also finds the ones whose data is
+	 * already in the WIM.  */
+	stop_scan_hasher(ctx->hasher,
+			 &wim_get_current_image_metadata(ctx->wim)->unhashed_blobs,
+			 ctx->wim->blob_table);
+	ctx->hasher = NULL;
+
 	write_flags = 0;
 
 	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_CHECK_INTEGRITY)
@@ -1230,6 +1946,8 @@ out:
 static void *
 wimfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
+	struct wimfs_context *ctx;
+
 	/*
 	 * Cache positive name lookups indefinitely, since names can only be
 	 * added, removed, or modified through the mounted filesystem itself.
@@ -1282,13 +2000,58 @@ wimfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 	 */
 	cfg->nullpath_ok = 1;
 
-	return wimfs_get_context();
+	/*
+	 * Let FUSE splice data that wimfs_read_buf() returns as a file
+	 * descriptor straight to the kernel, rather than first reading it into
+	 * a buffer.
+	 */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+	ctx = wimfs_get_context();
+
+	if (ctx->mount_flags & WIMLIB_MOUNT_FLAG_READWRITE) {
+		/*
+		 * Let the kernel cache writes to files and write them back in
+		 * large pieces, rather than sending each write() as a separate
+		 * request.  Programs that modify many files, such as those
+		 * servicing a Windows image, otherwise spend most of their time
+		 * waiting on round trips through FUSE.  This is safe because
+		 * file data can only be changed through the mounted filesystem
+		 * itself.  The kernel then keeps track of the size and last
+		 * write time of files that have cached writes, and sends the
+		 * last write time to wimfs_utimens() when writing them back.
+		 * The cached writes are flushed when the file is closed, and
+		 * the unmount process syncs the filesystem before committing.
+		 */
+		if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+			conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+			ctx->writeback_cache = true;
+		}
+
+		/* Accept writes of up to WIMFS_MAX_WRITE bytes at once, rather
+		 * than the 128 KiB default.  libfuse reduces this to what its
+		 * buffers and the kernel can handle.  */
+		conn->max_write = WIMFS_MAX_WRITE;
+	}
+
+	/*
+	 * Start the hasher for staging files here rather than before calling
+	 * fuse_main(), since the threads wouldn't survive FUSE forking into the
+	 * background.  For the same reason it can't use any thread pool set on
+	 * the WIMStruct.  It's just an optimization, so ignore failure.
+	 */
+	if (ctx->mount_flags & WIMLIB_MOUNT_FLAG_READWRITE) {
+		if (start_scan_hasher(NULL, &ctx->hasher))
+			ctx->hasher = NULL;
+	}
+	return ctx;
 }
 
 static int
 wimfs_chmod(const char *path, mode_t mask, struct fuse_file_info *fi)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	struct wim_inode *inode;
 	struct wimlib_unix_data unix_data;
 
@@ -1298,7 +2061,7 @@ wimfs_chmod(const char *path, mode_t mask, struct fuse_file_info *fi)
 	if (fi) {
 		inode = WIMFS_FD(fi)->f_inode;
 	} else {
-		inode = wim_pathname_to_inode(ctx->wim, path);
+		inode = wim_pathname_to_inode(ctx, path);
 		if (!inode)
 			return -errno;
 	}
@@ -1316,7 +2079,7 @@ wimfs_chmod(const char *path, mode_t mask, struct fuse_file_info *fi)
 static int
 wimfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	struct wim_inode *inode;
 	struct wimlib_unix_data unix_data;
 	int which;
@@ -1327,7 +2090,7 @@ wimfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
 	if (fi) {
 		inode = WIMFS_FD(fi)->f_inode;
 	} else {
-		inode = wim_pathname_to_inode(ctx->wim, path);
+		inode = wim_pathname_to_inode(ctx, path);
 		if (!inode)
 			return -errno;
 	}
@@ -1358,7 +2121,7 @@ wimfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
 static int
 wimfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	const struct wim_inode *inode;
 	const struct blob_descriptor *blob;
 	int ret;
@@ -1399,7 +2162,7 @@ static int
 wimfs_getxattr(const char *path, const char *name, char *value,
 	       size_t size)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	const struct wim_inode *inode;
 	const struct wim_inode_stream *strm;
 	const struct blob_descriptor *blob;
@@ -1456,7 +2219,7 @@ wimfs_getxattr(const char *path, const char *name, char *value,
 
 	/* Querying a named data stream  */
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 
@@ -1490,7 +2253,7 @@ wimfs_link(const char *existing_path, const char *new_path)
 	struct wim_dentry *dir;
 	struct wim_dentry *new_alias;
 
-	inode = wim_pathname_to_inode(wim, existing_path);
+	inode = wim_pathname_to_inode(wimfs_get_context(), existing_path);
 	if (!inode)
 		return -errno;
 
@@ -1513,6 +2276,7 @@ wimfs_link(const char *existing_path, const char *new_path)
 	if (new_dentry_with_existing_inode(new_name, inode, &new_alias))
 		return -ENOMEM;
 
+	dir_cache_invalidate(wimfs_get_context(), dir->d_inode);
 	dentry_add_child(dir, new_alias);
 	touch_inode(dir->d_inode);
 	return 0;
@@ -1521,7 +2285,7 @@ wimfs_link(const char *existing_path, const char *new_path)
 static int
 wimfs_listxattr(const char *path, char *list, size_t size)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	const struct wim_inode *inode;
 	char *p = list;
 	int total_size = 0;
@@ -1532,7 +2296,7 @@ wimfs_listxattr(const char *path, char *list, size_t size)
 	/* List named data streams, or get the list size.  We report each named
 	 * data stream "X" as an extended attribute "user.X".  */
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 
@@ -1610,7 +2374,7 @@ wimfs_mknod(const char *path, mode_t mode, dev_t rdev)
 		p = (char *)stream_name - 1;
 
 		*p = '\0';
-		inode = wim_pathname_to_inode(wimfs_ctx->wim, path);
+		inode = wim_pathname_to_inode(wimfs_ctx, path);
 		*p = ':';
 		if (!inode)
 			return -errno;
@@ -1675,6 +2439,10 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 	 * extract the data to the staging directory if we are opening it
 	 * writable.  */
 
+	if (flags_writable(fi->flags) && blob &&
+	    blob->blob_location == BLOB_IN_STAGING_FILE)
+		blob->scan_hash_job = NULL;
+
 	if (flags_writable(fi->flags) &&
             (!blob || blob->blob_location != BLOB_IN_STAGING_FILE)) {
 		ret = extract_blob_to_staging_dir(inode,
@@ -1691,11 +2459,17 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 		return ret;
 
 	if (blob && blob->blob_location == BLOB_IN_STAGING_FILE) {
+		int open_flags = fi->flags & (O_ACCMODE | O_TRUNC);
 		int raw_fd;
 
+		/* With the writeback cache, the kernel may read from files
+		 * opened write-only, to fill in the rest of partially written
+		 * pages.  */
+		if (ctx->writeback_cache && flags_writable(fi->flags))
+			open_flags = (open_flags & ~O_ACCMODE) | O_RDWR;
+
 		raw_fd = openat(blob->staging_dir_fd, blob->staging_file_name,
-				(fi->flags & (O_ACCMODE | O_TRUNC)) |
-				O_NOFOLLOW);
+				open_flags | O_NOFOLLOW);
 		if (raw_fd < 0) {
 			close_wimfs_fd(fd);
 			return -errno;
@@ -1703,6 +2477,7 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 		filedes_init(&fd->f_staging_fd, raw_fd);
 		if (fi->flags & O_TRUNC) {
 			blob->size = 0;
+			staging_cow_truncated(blob, 0);
 			file_contents_changed(inode);
 		}
 	}
@@ -1713,13 +2488,12 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 static int
 wimfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	WIMStruct *wim = wimfs_get_WIMStruct();
 	struct wim_inode *inode;
 	struct wim_inode_stream *strm;
 	struct wimfs_fd *fd;
 	int ret;
 
-	inode = wim_pathname_to_inode(wim, path);
+	inode = wim_pathname_to_inode(wimfs_get_context(), path);
 	if (!inode)
 		return -errno;
 	if (!inode_is_directory(inode))
@@ -1734,15 +2508,89 @@ wimfs_opendir(const char *path, struct fuse_file_info *fi)
 	return 0;
 }
 
+static void
+free_thread_decompressor(void *td)
+{
+	thread_decompressor_destroy(td);
+	FREE(td);
+}
+
+/* Get the decompressor of the calling FUSE thread in a multi-threaded mount,
+ * allocating it if needed.  Returns NULL if out of memory.  */
+static struct thread_decompressor *
+get_thread_decompressor(struct wimfs_context *ctx)
+{
+	struct thread_decompressor *td;
+
+	td = pthread_getspecific(ctx->decompressor_key);
+	if (!td) {
+		td = CALLOC(1, sizeof(*td));
+		if (td && pthread_setspecific(ctx->decompressor_key, td)) {
+			FREE(td);
+			td = NULL;
+		}
+	}
+	return td;
+}
+
+/* Read data from a blob in the WIM file in a multi-threaded mount.  */
+static int
+wimfs_read_mt(struct wimfs_context *ctx, struct wimfs_fd *fd,
+	      const struct blob_descriptor *blob,
+	      off_t offset, size_t size, char *buf)
+{
+	struct thread_decompressor *td = get_thread_decompressor(ctx);
+	bool readahead;
+
+	if (!td)
+		return -ENOMEM;
+
+	/* Concurrent reads through the same file descriptor aren't sequential
+	 * anyway, so just let the first one read ahead.  */
+	mutex_lock(&ctx->lock);
+	readahead = !fd->f_readahead_busy;
+	fd->f_readahead_busy = true;
+	mutex_unlock(&ctx->lock);
+	if (readahead) {
+		chunk_readahead_update(blob, offset, size, &fd->f_readahead,
+				       &ctx->lock);
+		mutex_lock(&ctx->lock);
+		fd->f_readahead_busy = false;
+		mutex_unlock(&ctx->lock);
+	}
+	if (read_partial_wim_blob_into_buf_mt(blob, offset, size, buf,
+					      &ctx->lock, td))
+		return errno ? -errno : -EIO;
+	return size;
+}
+
+/* Get the blob descriptor of the stream open as @fd, or NULL if it's empty.  */
+static const struct blob_descriptor *
+wimfs_fd_blob(struct wimfs_context *ctx, const struct wimfs_fd *fd)
+{
+	const struct blob_descriptor *blob;
+
+	/* In a multi-threaded mount, fd may be closed concurrently by a forced
+	 * unmount, but the blob stays valid until the image is unmounted.  */
+	if (ctx->mount_flags & WIMLIB_MOUNT_FLAG_MULTITHREADED) {
+		mutex_lock(&ctx->lock);
+		blob = fd->f_blob;
+		mutex_unlock(&ctx->lock);
+	} else {
+		blob = fd->f_blob;
+	}
+	return blob;
+}
+
 static int
 wimfs_read(const char *path, char *buf, size_t size,
 	   off_t offset, struct fuse_file_info *fi)
 {
+	struct wimfs_context *ctx = wimfs_get_context();
 	struct wimfs_fd *fd = WIMFS_FD(fi);
-	const struct blob_descriptor *blob;
+	const struct blob_descriptor *blob = wimfs_fd_blob(ctx, fd);
 	ssize_t ret;
 
-	blob = fd->f_blob;
 	if (!blob)
 		return 0;
 
@@ -1757,12 +2605,29 @@ wimfs_read(const char *path, char *buf, size_t size,
 
 	switch (blob->blob_location) {
 	case BLOB_IN_WIM:
+		if (ctx->mount_flags & WIMLIB_MOUNT_FLAG_MULTITHREADED) {
+			ret = wimfs_read_mt(ctx, fd, blob, offset, size, buf);
+			break;
+		}
+		chunk_readahead_update(blob, offset, size, &fd->f_readahead,
+				       NULL);
 		if (read_partial_wim_blob_into_buf(blob, offset, size, buf))
 			ret = errno ? -errno : -EIO;
 		else
 			ret = size;
 		break;
+	case BLOB_IN_WIM_DELTA:
+		if (read_partial_blob_into_buf(blob, offset, size, buf))
+			ret = errno ? -errno : -EIO;
+		else
+			ret = size;
+		break;
 	case BLOB_IN_STAGING_FILE:
+		if (blob->staging_cow) {
+			ret = read_staging_cow_blob(fd, blob, offset, size,
+						    (u8 *)buf);
+			break;
+		}
 		ret = pread(fd->f_staging_fd.fd, buf, size, offset);
 		if (ret < 0)
 			ret = -errno;
@@ -1778,18 +2643,88 @@ wimfs_read(const char *path, char *buf, size_t size,
 	return ret;
 }
 
+/*
+ * Like wimfs_read(), but when the data is stored as-is in a file, namely for
+ * uncompressed resources in the WIM and for staging files with no data left in
+ * the WIM, return the file descriptor and offset instead of copying the data.
+ * FUSE can then splice the data straight from the file to the kernel.
+ *
+ * The buffers are freed by FUSE, so they must be allocated with malloc().
+ */
+static int
+wimfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+	       off_t offset, struct fuse_file_info *fi)
+{
+	struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_fd *fd = WIMFS_FD(fi);
+	const struct blob_descriptor *blob = wimfs_fd_blob(ctx, fd);
+	struct fuse_bufvec *bufvec;
+	int raw_fd = -1;
+	off_t pos = 0;
+	void *mem;
+	int ret;
+
+	if (blob && offset < blob->size) {
+		size = min(size, blob->size - offset);
+		if (blob->blob_location == BLOB_IN_WIM) {
+			const struct wim_resource_descriptor *rdesc =
+				blob->rdesc;
+			const struct filedes *in_fd = &rdesc->wim->in_fd;
+
+			if (!(rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+					      WIM_RESHDR_FLAG_SOLID)) &&
+			    !in_fd->is_pipe && !in_fd->reader)
+			{
+				raw_fd = in_fd->fd;
+				pos = rdesc->offset_in_wim +
+				      blob->offset_in_res + offset;
+			}
+		} else if (blob->blob_location == BLOB_IN_STAGING_FILE &&
+			   !blob->staging_cow)
+		{
+			raw_fd = fd->f_staging_fd.fd;
+			pos = offset;
+		}
+	}
+
+	bufvec = malloc(sizeof(*bufvec));
+	if (!bufvec)
+		return -ENOMEM;
+
+	if (raw_fd >= 0) {
+		*bufvec = FUSE_BUFVEC_INIT(size);
+		bufvec->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufvec->buf[0].fd = raw_fd;
+		bufvec->buf[0].pos = pos;
+	} else {
+		mem = malloc(max(size, 1));
+		if (!mem) {
+			free(bufvec);
+			return -ENOMEM;
+		}
+		ret = wimfs_read(path, mem, size, offset, fi);
+		if (ret < 0) {
+			free(mem);
+			free(bufvec);
+			return ret;
+		}
+		*bufvec = FUSE_BUFVEC_INIT(ret);
+		bufvec->buf[0].mem = mem;
+	}
+	*bufp = bufvec;
+	return 0;
+}
+
 static int
 wimfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	      off_t offset, struct fuse_file_info *fi,
 	      enum fuse_readdir_flags flags)
 {
+	struct wimfs_context *ctx = wimfs_get_context();
 	struct wimfs_fd *fd = WIMFS_FD(fi);
-	const struct wim_inode *inode;
-	const struct wim_dentry *child;
+	struct wimfs_dir_cache_entry *listing;
 	int ret;
 
-	inode = fd->f_inode;
-
 	ret = filler(buf, ".", NULL, 0, 0);
 	if (ret)
 		return ret;
@@ -1797,20 +2732,39 @@ wimfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	if (ret)
 		return ret;
 
-	for_inode_child(child, inode) {
-		char *name;
-		size_t name_nbytes;
+	listing = wimfs_get_dir_listing(ctx, fd->f_inode);
+	if (!listing)
+		return -errno;
 
-		if (utf16le_to_tstr(child->d_name, child->d_name_nbytes,
-				    &name, &name_nbytes))
-			return -errno;
+	for (size_t i = 0; i < listing->num_children; i++) {
+		const struct wimfs_dir_cache_child *c = &listing->children[i];
 
-		ret = filler(buf, name, NULL, 0, 0);
-		FREE(name);
+		/* For readdirplus, also return the attributes of each child,
+		 * which then needn't be looked up individually.  */
+		if (flags & FUSE_READDIR_PLUS) {
+			struct wim_inode *inode = c->dentry->d_inode;
+			struct stat stbuf;
+
+			if (inode_resolve_streams(inode, ctx->wim->blob_table,
+						  false))
+			{
+				ret = -EIO;
+				break;
+			}
+			inode_to_stbuf(inode,
+				       inode_get_blob_for_unnamed_data_stream_resolved(inode),
+				       &stbuf);
+			ret = filler(buf, c->name, &stbuf, 0,
+				     FUSE_FILL_DIR_PLUS);
+		} else {
+			ret = filler(buf, c->name, NULL, 0, 0);
+		}
 		if (ret)
-			return ret;
+			break;
 	}
-	return 0;
+	if (!ctx->dir_cache)
+		free_dir_cache_entry(listing);
+	return ret;
 }
 
 static int
@@ -1820,7 +2774,7 @@ wimfs_readlink(const char *path, char *buf, size_t bufsize)
 	const struct wim_inode *inode;
 	int ret;
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 	if (bufsize <= 0)
@@ -1861,7 +2815,7 @@ wimfs_removexattr(const char *path, const char *name)
 
 	/* Removing a named data stream.  */
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 
@@ -1876,20 +2830,28 @@ wimfs_removexattr(const char *path, const char *name)
 static int
 wimfs_rename(const char *from, const char *to, unsigned int flags)
 {
+	struct wimfs_context *ctx = wimfs_get_context();
+
 	if (flags & RENAME_EXCHANGE)
 		return -EINVAL;
-	return rename_wim_path(wimfs_get_WIMStruct(), from, to,
-			       WIMLIB_CASE_SENSITIVE,
+
+	/* The renamed dentry may be a directory, and the destination may have
+	 * been replaced, so forget all cached paths and directory listings.  */
+	if (ctx->path_cache)
+		path_cache_clear(ctx->path_cache);
+	if (ctx->dir_cache)
+		dir_cache_clear(ctx->dir_cache);
+	return rename_wim_path(ctx->wim, from, to, WIMLIB_CASE_SENSITIVE,
 			       (flags & RENAME_NOREPLACE), NULL);
 }
 
 static int
 wimfs_rmdir(const char *path)
 {
-	WIMStruct *wim = wimfs_get_WIMStruct();
+	struct wimfs_context *ctx = wimfs_get_context();
 	struct wim_dentry *dentry;
 
-	dentry = get_dentry(wim, path, WIMLIB_CASE_SENSITIVE);
+	dentry = wimfs_get_dentry(ctx, path);
 	if (!dentry)
 		return -errno;
 
@@ -1900,7 +2862,8 @@ wimfs_rmdir(const char *path)
 		return -ENOTEMPTY;
 
 	touch_parent(dentry);
-	remove_dentry(dentry, wim->blob_table);
+	path_cache_remove(ctx, path, dentry);
+	remove_dentry(dentry, ctx->wim->blob_table);
 	return 0;
 }
 
@@ -1944,7 +2907,7 @@ wimfs_setxattr(const char *path, const char *name,
 
 	/* Setting the contents of a named data stream.  */
 
-	inode = wim_pathname_to_inode(ctx->wim, path);
+	inode = wim_pathname_to_inode(ctx, path);
 	if (!inode)
 		return -errno;
 
@@ -2018,13 +2981,15 @@ do_truncate(int staging_fd, off_t size,
 		return -errno;
 	file_contents_changed(inode);
 	blob->size = size;
+	blob->scan_hash_job = NULL;
+	staging_cow_truncated(blob, size);
 	return 0;
 }
 
 static int
 wimfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	struct wim_dentry *dentry;
 	struct wim_inode_stream *strm;
 	struct blob_descriptor *blob;
@@ -2066,7 +3031,7 @@ wimfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 static int
 wimfs_unlink(const char *path)
 {
-	const struct wimfs_context *ctx = wimfs_get_context();
+	struct wimfs_context *ctx = wimfs_get_context();
 	struct wim_dentry *dentry;
 	struct wim_inode_stream *strm;
 	int ret;
@@ -2080,6 +3045,7 @@ wimfs_unlink(const char *path)
 				    ctx->wim->blob_table);
 	} else {
 		touch_parent(dentry);
+		path_cache_remove(ctx, path, dentry);
 		remove_dentry(dentry, ctx->wim->blob_table);
 	}
 	return 0;
@@ -2099,7 +3065,7 @@ wimfs_utimens(const char *path, const struct timespec tv[2],
 	if (fi) {
 		inode = WIMFS_FD(fi)->f_inode;
 	} else {
-		inode = wim_pathname_to_inode(wimfs_get_WIMStruct(), path);
+		inode = wim_pathname_to_inode(wimfs_get_context(), path);
 		if (!inode)
 			return -errno;
 	}
@@ -2126,10 +3092,19 @@ wimfs_write(const char *path, const char *buf, size_t size,
 	struct wimfs_fd *fd = WIMFS_FD(fi);
 	ssize_t ret;
 
+	if (fd->f_blob->staging_cow && size) {
+		ret = prepare_staging_cow_write(fd, offset, size);
+		if (ret)
+			return ret;
+	}
+
 	ret = pwrite(fd->f_staging_fd.fd, buf, size, offset);
 	if (ret < 0)
 		return -errno;
 
+	if (fd->f_blob->staging_cow && ret)
+		staging_cow_written(fd->f_blob, offset, ret);
+
 	if (offset + size > fd->f_blob->size)
 		fd->f_blob->size = offset + size;
 
@@ -2150,6 +3125,7 @@ static const struct fuse_operations wimfs_operations = {
 	.open        = wimfs_open,
 	.opendir     = wimfs_opendir,
 	.read        = wimfs_read,
+	.read_buf    = wimfs_read_buf,
 	.readdir     = wimfs_readdir,
 	.readlink    = wimfs_readlink,
 	.release     = wimfs_release,
@@ -2166,6 +3142,77 @@ static const struct fuse_operations wimfs_operations = {
 
 };
 
+/*
+ * Operations for a multi-threaded read-only mount, in which FUSE calls them
+ * from several threads at once.  The mounted image's inodes and the WIMStruct
+ * aren't thread-safe, so all operations except read() hold the context's lock.
+ * read() uses the lock only to access the WIM's chunk cache, so that file data
+ * is read and decompressed in parallel.  Operations that modify the image
+ * aren't needed, since the kernel refuses them on a read-only mount.
+ */
+
+#define WIMFS_LOCKED_OP(name, params, args)			\
+static int							\
+wimfs_locked_##name params					\
+{								\
+	struct wimfs_context *ctx = wimfs_get_context();	\
+	int ret;						\
+								\
+	mutex_lock(&ctx->lock);					\
+	ret = wimfs_##name args;				\
+	mutex_unlock(&ctx->lock);				\
+	return ret;						\
+}
+
+WIMFS_LOCKED_OP(getattr,
+		(const char *path, struct stat *stbuf,
+		 struct fuse_file_info *fi),
+		(path, stbuf, fi))
+WIMFS_LOCKED_OP(getxattr,
+		(const char *path, const char *name, char *value,
+		 size_t size),
+		(path, name, value, size))
+WIMFS_LOCKED_OP(listxattr,
+		(const char *path, char *list, size_t size),
+		(path, list, size))
+WIMFS_LOCKED_OP(open,
+		(const char *path, struct fuse_file_info *fi),
+		(path, fi))
+WIMFS_LOCKED_OP(opendir,
+		(const char *path, struct fuse_file_info *fi),
+		(path, fi))
+WIMFS_LOCKED_OP(readdir,
+		(const char *path, void *buf, fuse_fill_dir_t filler,
+		 off_t offset, struct fuse_file_info *fi,
+		 enum fuse_readdir_flags flags),
+		(path, buf, filler, offset, fi, flags))
+WIMFS_LOCKED_OP(readlink,
+		(const char *path, char *buf, size_t bufsize),
+		(path, buf, bufsize))
+WIMFS_LOCKED_OP(release,
+		(const char *path, struct fuse_file_info *fi),
+		(path, fi))
+WIMFS_LOCKED_OP(setxattr,
+		(const char *path, const char *name, const char *value,
+		 size_t size, int flags),
+		(path, name, value, size, flags))
+
+static const struct fuse_operations wimfs_mt_operations = {
+	.init	     = wimfs_init,
+	.getattr     = wimfs_locked_getattr,
+	.getxattr    = wimfs_locked_getxattr,
+	.listxattr   = wimfs_locked_listxattr,
+	.open        = wimfs_locked_open,
+	.opendir     = wimfs_locked_opendir,
+	.read        = wimfs_read,
+	.read_buf    = wimfs_read_buf,
+	.readdir     = wimfs_locked_readdir,
+	.readlink    = wimfs_locked_readlink,
+	.release     = wimfs_locked_release,
+	.releasedir  = wimfs_locked_release,
+	.setxattr    = wimfs_locked_setxattr,
+};
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
@@ -2186,7 +3233,13 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 			    WIMLIB_MOUNT_FLAG_STREAM_INTERFACE_XATTR |
 			    WIMLIB_MOUNT_FLAG_STREAM_INTERFACE_WINDOWS |
 			    WIMLIB_MOUNT_FLAG_UNIX_DATA |
-			    WIMLIB_MOUNT_FLAG_ALLOW_OTHER))
+			    WIMLIB_MOUNT_FLAG_ALLOW_OTHER |
+			    WIMLIB_MOUNT_FLAG_MULTITHREADED))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	/* Only read-only mounts can be multi-threaded.  */
+	if ((mount_flags & WIMLIB_MOUNT_FLAG_READWRITE) &&
+	    (mount_flags & WIMLIB_MOUNT_FLAG_MULTITHREADED))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	/* For read-write mount, check for write access to the WIM.  */
@@ -2198,8 +3251,12 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 			return ret;
 	}
 
-	/* Select the image to mount.  */
-	ret = select_wim_image(wim, image);
+	/* Select the image to mount.  A read-only mount only needs to load the
+	 * directories that are actually accessed.  */
+	if (mount_flags & WIMLIB_MOUNT_FLAG_READWRITE)
+		ret = select_wim_image(wim, image);
+	else
+		ret = select_wim_image_lazily(wim, image);
 	if (ret)
 		return ret;
 
@@ -2260,6 +3317,11 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	 * the file descriptor arrays  */
 	prepare_inodes(&ctx);
 
+	/* The path cache only speeds up lookups, so mount anyway if it can't
+	 * be allocated.  */
+	ctx.path_cache = new_path_cache();
+	ctx.dir_cache = new_dir_cache();
+
 	/* Save the absolute path to the mountpoint directory.  */
 	ctx.mountpoint_abspath = realpath(dir, NULL);
 	if (ctx.mountpoint_abspath)
@@ -2271,8 +3333,10 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	fuse_argv[fuse_argc++] = "wimlib";
 	fuse_argv[fuse_argc++] = (char *)dir;
 
-	/* Disable multi-threaded operation.  */
-	fuse_argv[fuse_argc++] = "-s";
+	/* Disable multi-threaded operation, unless requested for a read-only
+	 * mount.  */
+	if (!(mount_flags & WIMLIB_MOUNT_FLAG_MULTITHREADED))
+		fuse_argv[fuse_argc++] = "-s";
 
 	/* Enable FUSE debug mode (don't fork) if requested by the user.  */
 	if (mount_flags & WIMLIB_MOUNT_FLAG_DEBUG)
@@ -2299,12 +3363,34 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	fuse_argv[fuse_argc] = NULL;
 
 	/* Mount our filesystem.  */
-	ret = fuse_main(fuse_argc, fuse_argv, &wimfs_operations, &ctx);
+	if (mount_flags & WIMLIB_MOUNT_FLAG_MULTITHREADED) {
+		ret = WIMLIB_ERR_NOMEM;
+		if (!mutex_init(&ctx.lock))
+			goto out;
+		if (pthread_key_create(&ctx.decompressor_key,
+				       free_thread_decompressor)) {
+			mutex_destroy(&ctx.lock);
+			goto out;
+		}
+		ret = fuse_main(fuse_argc, fuse_argv, &wimfs_mt_operations,
+				&ctx);
+		pthread_key_delete(ctx.decompressor_key);
+		mutex_destroy(&ctx.lock);
+	} else {
+		ret = fuse_main(fuse_argc, fuse_argv, &wimfs_operations, &ctx);
+	}
 
 	/* Cleanup and return.  */
 	if (ret)
 		ret = WIMLIB_ERR_FUSE;
 out:
+	if (ctx.hasher) {
+		stop_scan_hasher(ctx.hasher,
+				 &wim_get_current_image_metadata(wim)->unhashed_blobs,
+				 wim->blob_table);
+	}
+	free_path_cache(ctx.path_cache);
+	free_dir_cache(ctx.dir_cache);
 	FREE(ctx.mountpoint_abspath);
 	free_blob_descriptor(ctx.metadata_resource);
 	if (ctx.staging_dir_name)
@@ -2422,6 +3508,27 @@ do_unmount_discard(const char *dir)
 	return do_unmount(dir);
 }
 
+/* Make the kernel write back any writes to the mounted filesystem that it has
+ * cached, so that they're included when the image is committed.  This is done
+ * from the unmount process, since the mount process needs to be free to serve
+ * the writes.  Failure is ignored, as any writes not written back yet were
+ * made through file descriptors that are still open, which prevent a commit
+ * unless it is forced.  */
+static void
+sync_mounted_image(const char *dir)
+{
+#ifdef HAVE_SYNCFS
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+	if (fd >= 0) {
+		syncfs(fd);
+		close(fd);
+	}
+#else
+	sync();
+#endif
+}
+
 /* Unmount a read-write mounted WIM image, committing the changes.  */
 static int
 do_unmount_commit(const char *dir, int unmount_flags,
@@ -2457,6 +3564,8 @@ do_unmount_commit(const char *dir, int unmount_flags,
 		unmount_info.unmount_flags |= WIMLIB_UNMOUNT_FLAG_SEND_PROGRESS;
 	}
 
+	sync_mounted_image(dir);
+
 	ret = set_unmount_info(dir, &unmount_info);
 	if (!ret)
 		ret = do_unmount(dir);
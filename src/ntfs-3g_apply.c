@@ -50,6 +50,8 @@
 #include "wimlib/object_id.h"
 #include "wimlib/reparse.h"
 #include "wimlib/security.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
 
 static int
 ntfs_3g_get_supported_features(const char *target,
@@ -98,6 +100,10 @@ struct ntfs_3g_apply_ctx {
 	unsigned num_reparse_inodes;
 	ntfs_inode *ntfs_reparse_inodes[MAX_OPEN_FILES];
 	struct wim_inode *wim_reparse_inodes[MAX_OPEN_FILES];
+
+	/* The thread which writes the data of blobs to the open attributes, or
+	 * NULL if the data is written by the extracting thread  */
+	struct ntfs_3g_writer *writer;
 };
 
 static int
@@ -860,12 +866,13 @@ ntfs_3g_full_pwrite(ntfs_attr *na, u64 offset, size_t size, const u8 *data)
 	return true;
 }
 
-static int
-ntfs_3g_extract_chunk(const struct blob_descriptor *blob, u64 offset,
-		      const void *chunk, size_t size, void *_ctx)
+/* Write @size bytes of a blob's data, starting at @offset, to all the open
+ * attributes.  */
+static bool
+ntfs_3g_write_data(struct ntfs_3g_apply_ctx *ctx, u64 offset,
+		   const void *data, size_t size)
 {
-	struct ntfs_3g_apply_ctx *ctx = _ctx;
-	const void * const end = chunk + size;
+	const void * const end = data + size;
 	const void *p;
 	bool zeroes;
 	size_t len;
@@ -875,25 +882,277 @@ ntfs_3g_extract_chunk(const struct blob_descriptor *blob, u64 offset,
 	 * For sparse attributes, only write nonzero regions.  This lets the
 	 * filesystem use holes to represent zero regions.
 	 */
-	for (p = chunk; p != end; p += len, offset += len) {
+	for (p = data; p != end; p += len, offset += len) {
 		zeroes = maybe_detect_sparse_region(p, end - p, &len,
 						    ctx->any_sparse_attrs);
 		for (i = 0; i < ctx->num_open_attrs; i++) {
 			if (!zeroes || !ctx->is_sparse_attr[i]) {
 				if (!ntfs_3g_full_pwrite(ctx->open_attrs[i],
 							 offset, len, p))
-					goto err;
+					return false;
 			}
 		}
 	}
+	return true;
+}
+
+/*
+ * Writes through libntfs-3g are CPU-heavy, since each one has to look up and
+ * update the attribute's runlist.  So, when more than one CPU is available, a
+ * separate thread does them, while the extracting thread goes on reading and
+ * decompressing the following chunks.  The extracting thread collects
+ * contiguous data into buffers of NTFS_3G_WRITER_BUF_SIZE bytes and queues
+ * them to the writer thread, which also means that many small chunks are
+ * written with fewer, larger calls to ntfs_attr_pwrite().
+ *
+ * libntfs-3g isn't thread-safe, so the writer thread is the only thread using
+ * it while any data is queued.  The extracting thread waits for the queue to
+ * drain before doing anything else with the volume, such as opening and
+ * closing attributes in the begin_blob and end_blob callbacks.
+ */
+#define NTFS_3G_WRITER_NUM_BUFS	4
+#define NTFS_3G_WRITER_BUF_SIZE	(1 << 20)
+
+struct ntfs_3g_writer {
+	struct thread thread;
+	struct ntfs_3g_apply_ctx *ctx;
+
+	/* Protects the fields below, but not the data in the buffers  */
+	struct mutex lock;
+
+	/* Signaled when a buffer is queued, or the thread should exit  */
+	struct condvar queued_cond;
+
+	/* Signaled when a buffer has been written  */
+	struct condvar written_cond;
+
+	/* The queued buffers are bufs[start] through bufs[start + used - 1],
+	 * modulo NTFS_3G_WRITER_NUM_BUFS.  */
+	u8 *bufs[NTFS_3G_WRITER_NUM_BUFS];
+	u64 offsets[NTFS_3G_WRITER_NUM_BUFS];
+	size_t sizes[NTFS_3G_WRITER_NUM_BUFS];
+	unsigned start;
+	unsigned used;
+	bool terminating;
+
+	/* Set if a write failed, with the errno value of the failure.  The
+	 * data queued after a failed write is discarded.  */
+	bool failed;
+	int failed_errno;
+
+	/* The buffer following the queued ones, which the extracting thread
+	 * is filling if fill_size is nonzero.  Only accessed by the extracting
+	 * thread.  */
+	unsigned fill_index;
+	u64 fill_offset;
+	size_t fill_size;
+};
+
+static void *
+ntfs_3g_writer_thread_proc(void *arg)
+{
+	struct ntfs_3g_writer *w = arg;
+
+	for (;;) {
+		unsigned i;
+		bool failed;
+		int failed_errno = 0;
+
+		mutex_lock(&w->lock);
+		while (w->used == 0 && !w->terminating)
+			condvar_wait(&w->queued_cond, &w->lock);
+		if (w->used == 0) {
+			mutex_unlock(&w->lock);
+			break;
+		}
+		i = w->start;
+		failed = w->failed;
+		mutex_unlock(&w->lock);
+
+		if (!failed && !ntfs_3g_write_data(w->ctx, w->offsets[i],
+						   w->bufs[i], w->sizes[i]))
+		{
+			failed = true;
+			failed_errno = errno;
+		}
+
+		mutex_lock(&w->lock);
+		if (failed && !w->failed) {
+			w->failed = true;
+			w->failed_errno = failed_errno;
+		}
+		w->start = (w->start + 1) % NTFS_3G_WRITER_NUM_BUFS;
+		w->used--;
+		condvar_signal(&w->written_cond);
+		mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+/* Start the writer thread, if there is more than one CPU.  If it can't be
+ * started, then the data is written by the extracting thread instead.  */
+static void
+ntfs_3g_start_writer(struct ntfs_3g_apply_ctx *ctx)
+{
+	struct ntfs_3g_writer *w;
+
+	if (get_available_cpus() <= 1)
+		return;
+
+	w = CALLOC(1, sizeof(*w));
+	if (!w)
+		return;
+	w->ctx = ctx;
+	w->bufs[0] = MALLOC(NTFS_3G_WRITER_NUM_BUFS * NTFS_3G_WRITER_BUF_SIZE);
+	if (!w->bufs[0])
+		goto err_free_writer;
+	for (unsigned i = 1; i < NTFS_3G_WRITER_NUM_BUFS; i++)
+		w->bufs[i] = w->bufs[i - 1] + NTFS_3G_WRITER_BUF_SIZE;
+	if (!mutex_init(&w->lock))
+		goto err_free_bufs;
+	if (!condvar_init(&w->queued_cond))
+		goto err_destroy_lock;
+	if (!condvar_init(&w->written_cond))
+		goto err_destroy_queued_cond;
+	if (!thread_create(&w->thread, ntfs_3g_writer_thread_proc, w))
+		goto err_destroy_written_cond;
+	ctx->writer = w;
+	return;
+
+err_destroy_written_cond:
+	condvar_destroy(&w->written_cond);
+err_destroy_queued_cond:
+	condvar_destroy(&w->queued_cond);
+err_destroy_lock:
+	mutex_destroy(&w->lock);
+err_free_bufs:
+	FREE(w->bufs[0]);
+err_free_writer:
+	FREE(w);
+}
+
+/* Stop the writer thread, if any.  It must have no data queued.  */
+static void
+ntfs_3g_stop_writer(struct ntfs_3g_apply_ctx *ctx)
+{
+	struct ntfs_3g_writer *w = ctx->writer;
+
+	if (!w)
+		return;
+
+	mutex_lock(&w->lock);
+	w->terminating = true;
+	condvar_signal(&w->queued_cond);
+	mutex_unlock(&w->lock);
+	thread_join(&w->thread);
+
+	condvar_destroy(&w->written_cond);
+	condvar_destroy(&w->queued_cond);
+	mutex_destroy(&w->lock);
+	FREE(w->bufs[0]);
+	FREE(w);
+	ctx->writer = NULL;
+}
+
+/* Queue the buffer being filled to the writer thread.  */
+static void
+ntfs_3g_writer_queue_buf(struct ntfs_3g_writer *w)
+{
+	unsigned i = w->fill_index;
+
+	w->offsets[i] = w->fill_offset;
+	w->sizes[i] = w->fill_size;
+	w->fill_index = (i + 1) % NTFS_3G_WRITER_NUM_BUFS;
+	w->fill_size = 0;
+
+	mutex_lock(&w->lock);
+	w->used++;
+	condvar_signal(&w->queued_cond);
+	mutex_unlock(&w->lock);
+}
+
+/* Wait until at most @max_used buffers are queued to the writer thread.
+ * Returns false if a write has failed, with errno set to the failure.  If
+ * @reset, then the failure is also forgotten, as all data queued after it has
+ * been discarded.  */
+static bool
+ntfs_3g_writer_wait(struct ntfs_3g_writer *w, unsigned max_used, bool reset)
+{
+	bool failed;
+
+	mutex_lock(&w->lock);
+	while (w->used > max_used)
+		condvar_wait(&w->written_cond, &w->lock);
+	failed = w->failed;
+	if (failed)
+		errno = w->failed_errno;
+	if (reset)
+		w->failed = false;
+	mutex_unlock(&w->lock);
+	return !failed;
+}
+
+/* Pass @size bytes of a blob's data, starting at @offset, to the writer
+ * thread.  */
+static bool
+ntfs_3g_writer_add_data(struct ntfs_3g_writer *w, u64 offset,
+			const u8 *data, size_t size)
+{
+	while (size) {
+		size_t n;
+
+		if (w->fill_size != 0 &&
+		    (offset != w->fill_offset + w->fill_size ||
+		     w->fill_size == NTFS_3G_WRITER_BUF_SIZE))
+			ntfs_3g_writer_queue_buf(w);
+
+		if (w->fill_size == 0) {
+			/* Wait for a free buffer.  */
+			if (!ntfs_3g_writer_wait(w, NTFS_3G_WRITER_NUM_BUFS - 1,
+						 false))
+				return false;
+			w->fill_offset = offset;
+		}
+
+		n = min(size, NTFS_3G_WRITER_BUF_SIZE - w->fill_size);
+		memcpy(&w->bufs[w->fill_index][w->fill_size], data, n);
+		w->fill_size += n;
+		offset += n;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+/* Write all data passed to the writer thread, and wait for it to finish.
+ * Returns false if any write since the last flush failed.  */
+static bool
+ntfs_3g_writer_flush(struct ntfs_3g_writer *w)
+{
+	if (w->fill_size != 0)
+		ntfs_3g_writer_queue_buf(w);
+	return ntfs_3g_writer_wait(w, 0, true);
+}
+
+static int
+ntfs_3g_extract_chunk(const struct blob_descriptor *blob, u64 offset,
+		      const void *chunk, size_t size, void *_ctx)
+{
+	struct ntfs_3g_apply_ctx *ctx = _ctx;
+	bool ok;
+
+	if (ctx->writer)
+		ok = ntfs_3g_writer_add_data(ctx->writer, offset, chunk, size);
+	else
+		ok = ntfs_3g_write_data(ctx, offset, chunk, size);
+	if (!ok) {
+		ERROR_WITH_ERRNO("Error writing data to NTFS volume");
+		return WIMLIB_ERR_NTFS_3G;
+	}
 
 	if (ctx->reparse_ptr)
 		ctx->reparse_ptr = mempcpy(ctx->reparse_ptr, chunk, size);
 	return 0;
-
-err:
-	ERROR_WITH_ERRNO("Error writing data to NTFS volume");
-	return WIMLIB_ERR_NTFS_3G;
 }
 
 static int
@@ -902,6 +1161,13 @@ ntfs_3g_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	struct ntfs_3g_apply_ctx *ctx = _ctx;
 	int ret;
 
+	/* Let the writer thread finish writing the data before using the
+	 * volume again.  */
+	if (ctx->writer && !ntfs_3g_writer_flush(ctx->writer) && !status) {
+		ERROR_WITH_ERRNO("Error writing data to NTFS volume");
+		status = WIMLIB_ERR_NTFS_3G;
+	}
+
 	if (status) {
 		ret = status;
 		goto out;
@@ -1015,7 +1281,9 @@ ntfs_3g_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 		.end_blob	= ntfs_3g_end_extract_blob,
 		.ctx		= ctx,
 	};
+	ntfs_3g_start_writer(ctx);
 	ret = extract_blob_list(&ctx->common, &cbs);
+	ntfs_3g_stop_writer(ctx);
 
 	/* We do not need a final pass to set timestamps because libntfs-3g does
 	 * not update timestamps automatically (exception:
@@ -29,6 +29,7 @@
 #ifdef WITH_NTFS_3G
 
 #include <errno.h>
+#include <fcntl.h>
 
 #include <ntfs-3g/attrib.h>
 #include <ntfs-3g/compat.h> /* for ENODATA, if needed */
@@ -44,6 +45,7 @@
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
+#include "wimlib/file_io.h"
 #include "wimlib/ntfs_3g.h"
 #include "wimlib/object_id.h"
 #include "wimlib/paths.h"
@@ -687,7 +689,7 @@ filldir(void *_ctx, const ntfschar *name, const int name_nchars,
 						  name_type, ctx->volume,
 						  params);
 	pathbuf_truncate(params, orig_path_nchars);
-	attach_scanned_tree(ctx->parent, child, params->blob_table);
+	attach_scanned_tree(ctx->parent, child, params);
 out_free_mbs_name:
 	FREE(mbs_name);
 out:
@@ -871,6 +873,40 @@ out:
 	return ret;
 }
 
+/*
+ * Ask the kernel to read the volume's MFT ($MFT) into the page cache, in the
+ * order it is laid out on the device.  The scan opens each inode through
+ * libntfs-3g, which reads that inode's MFT record on its own, in directory
+ * order.  Without this, nearly every one of those reads would be a separate
+ * random read from the device.  This is only a hint, so failures are ignored.
+ */
+static void
+prefetch_mft(ntfs_volume *vol, const char *device)
+{
+	ntfs_attr *na = vol->mft_na;
+	const runlist_element *rl;
+	struct filedes fd;
+	s64 remaining;
+	int raw_fd;
+
+	if (ntfs_attr_map_whole_runlist(na))
+		return;
+	raw_fd = open(device, O_RDONLY);
+	if (raw_fd < 0)
+		return;
+	filedes_init(&fd, raw_fd);
+	remaining = na->initialized_size;
+	for (rl = na->rl; rl && rl->length && remaining > 0; rl++) {
+		s64 len = min(rl->length << vol->cluster_size_bits, remaining);
+
+		if (rl->lcn >= 0)
+			filedes_prefetch(&fd, rl->lcn << vol->cluster_size_bits,
+					 len);
+		remaining -= len;
+	}
+	filedes_close(&fd);
+}
+
 int
 ntfs_3g_build_dentry_tree(struct wim_dentry **root_ret,
 			  const char *device, struct scan_params *params)
@@ -910,6 +946,8 @@ ntfs_3g_build_dentry_tree(struct wim_dentry **root_ret,
 	 * that we do need to capture.  */
 	NVolClearShowSysFiles(vol);
 
+	prefetch_mft(vol, device);
+
 	ret = pathbuf_init(params, "/");
 	if (ret)
 		goto out_close_secure;
@@ -29,8 +29,10 @@
 
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
+#include "wimlib/error.h"
 #include "wimlib/paths.h"
 #include "wimlib/pattern.h"
+#include "wimlib/textfile.h"
 
 static bool
 string_matches_pattern(const tchar *string, const tchar * const string_end,
@@ -136,61 +138,514 @@ match_path(const tchar *path, const tchar *pattern, int match_flags)
 }
 
 /*
- * Expand a path pattern in an in-memory tree of dentries.
- *
- * @root
- *	The root of the directory tree in which to expand the pattern.
- * @pattern
- *	The path pattern to expand, which may contain the '*' and '?' wildcard
- *	characters.  Path separators must be WIM_PATH_SEPARATOR.  Leading and
- *	trailing path separators are ignored.  The default case sensitivity
- *	behavior is used.
- * @consume_dentry
- *	A callback function which will receive each matched directory entry.
- * @ctx
- *	Opaque context argument for @consume_dentry.
+ * A node in a trie of path patterns.  Each node other than a root corresponds
+ * to one path component of one or more patterns, and its children correspond
+ * to the components following it in those patterns.
+ */
+struct pattern_node {
+	/* The pattern component (not null-terminated; points into the pattern
+	 * string)  */
+	const tchar *component;
+	size_t component_len;
+
+	/* For a component containing wildcard characters, the number of
+	 * characters after the last '*', which any matching string must end
+	 * with.  Checking this first quickly rules out most nonmatches.  */
+	size_t tail_len;
+
+	/* true iff some pattern ends at this node  */
+	bool is_end;
+
+	/* true iff expand_pattern_set() has matched a dentry at this node  */
+	bool matched;
+
+	/* Children whose components contain no wildcard characters, sorted by
+	 * cmp_literal_components()  */
+	struct pattern_node **literal_children;
+	size_t num_literal_children;
+
+	/* Children whose components contain wildcard characters  */
+	struct pattern_node **wildcard_children;
+	size_t num_wildcard_children;
+};
+
+/*
+ * A list of path patterns compiled for matching paths against all of them at
+ * once, which is much faster than match_path() on each pattern when there are
+ * many patterns.  Patterns which share leading components share trie nodes,
+ * and components without wildcards are found by binary search.
+ */
+struct pattern_set {
+	/* Trie of the patterns with a leading path separator, which are matched
+	 * against the entire path  */
+	struct pattern_node absolute_root;
+
+	/* Trie of the other patterns, which are matched against the filename
+	 * component of the path only  */
+	struct pattern_node relative_root;
+};
+
+/* Compare two literal path components in an order which puts components that
+ * are equal when ignoring case next to each other.  Components which are equal
+ * when ignoring case are ordered by their exact contents.  If @exact_ret is not
+ * NULL, then the result of comparing the components while ignoring case is
+ * returned, and *@exact_ret is set to the result of the full comparison.  */
+static int
+cmp_literal_components(const tchar *s1, size_t len1,
+		       const tchar *s2, size_t len2, int *exact_ret)
+{
+	size_t len = min(len1, len2);
+	int v;
+
+	for (size_t i = 0; i < len; i++) {
+		tchar c1 = totlower(s1[i]);
+		tchar c2 = totlower(s2[i]);
+
+		if (c1 != c2)
+			return c1 < c2 ? -1 : 1;
+	}
+	v = cmp_u64(len1, len2);
+	if (v)
+		return v;
+	v = tmemcmp(s1, s2, len);
+	if (exact_ret) {
+		*exact_ret = v;
+		return 0;
+	}
+	return v;
+}
+
+static struct pattern_node *
+new_pattern_node(const tchar *component, size_t component_len)
+{
+	struct pattern_node *node = CALLOC(1, sizeof(*node));
+
+	if (node) {
+		node->component = component;
+		node->component_len = component_len;
+	}
+	return node;
+}
+
+static void
+destroy_pattern_node(struct pattern_node *node)
+{
+	for (size_t i = 0; i < node->num_literal_children; i++) {
+		destroy_pattern_node(node->literal_children[i]);
+		FREE(node->literal_children[i]);
+	}
+	FREE(node->literal_children);
+	for (size_t i = 0; i < node->num_wildcard_children; i++) {
+		destroy_pattern_node(node->wildcard_children[i]);
+		FREE(node->wildcard_children[i]);
+	}
+	FREE(node->wildcard_children);
+}
+
+/* Insert a child at index @i of an array of child pointers.  */
+static struct pattern_node *
+insert_pattern_child(struct pattern_node ***children_p, size_t *num_children_p,
+		     size_t i, const tchar *component, size_t component_len)
+{
+	struct pattern_node **children;
+	struct pattern_node *child;
+
+	children = REALLOC(*children_p, (*num_children_p + 1) *
+					sizeof(children[0]));
+	if (!children)
+		return NULL;
+	*children_p = children;
+	child = new_pattern_node(component, component_len);
+	if (!child)
+		return NULL;
+	memmove(&children[i + 1], &children[i],
+		(*num_children_p - i) * sizeof(children[0]));
+	children[i] = child;
+	(*num_children_p)++;
+	return child;
+}
+
+/* Get the child of @node for the given component.  If there is none, create it
+ * if @create is true, otherwise return NULL.  */
+static struct pattern_node *
+get_pattern_child(struct pattern_node *node,
+		  const tchar *component, size_t component_len, bool create)
+{
+	struct pattern_node *child;
+	size_t lo, hi;
+
+	if (tmemchr(component, T('*'), component_len) ||
+	    tmemchr(component, T('?'), component_len))
+	{
+		for (size_t i = 0; i < node->num_wildcard_children; i++) {
+			child = node->wildcard_children[i];
+			if (child->component_len == component_len &&
+			    !tmemcmp(child->component, component, component_len))
+				return child;
+		}
+		if (!create)
+			return NULL;
+		child = insert_pattern_child(&node->wildcard_children,
+					     &node->num_wildcard_children,
+					     node->num_wildcard_children,
+					     component, component_len);
+		if (child) {
+			while (child->tail_len < component_len &&
+			       component[component_len - 1 -
+					 child->tail_len] != T('*'))
+				child->tail_len++;
+		}
+		return child;
+	}
+
+	lo = 0;
+	hi = node->num_literal_children;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int v;
+
+		child = node->literal_children[mid];
+		v = cmp_literal_components(child->component,
+					   child->component_len,
+					   component, component_len, NULL);
+		if (v == 0)
+			return child;
+		if (v < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!create)
+		return NULL;
+	return insert_pattern_child(&node->literal_children,
+				    &node->num_literal_children, lo,
+				    component, component_len);
+}
+
+/* Find the node at which @pattern ends, adding the nodes for it if @create is
+ * true.  Returns NULL if not found or out of memory.  */
+static struct pattern_node *
+get_pattern_end_node(struct pattern_set *set, const tchar *pattern,
+		     bool create)
+{
+	struct pattern_node *node;
+
+	if (*pattern == WIM_PATH_SEPARATOR)
+		node = &set->absolute_root;
+	else
+		node = &set->relative_root;
+
+	for (;;) {
+		const tchar *pattern_component_end;
+
+		pattern = advance_to_next_component(pattern);
+		if (!*pattern)
+			break;
+		pattern_component_end = advance_through_component(pattern);
+		node = get_pattern_child(node, pattern,
+					 pattern_component_end - pattern,
+					 create);
+		if (!node)
+			return NULL;
+		pattern = pattern_component_end;
+	}
+	return node;
+}
+
+static int
+add_pattern(struct pattern_set *set, const tchar *pattern)
+{
+	struct pattern_node *node = get_pattern_end_node(set, pattern, true);
+
+	if (!node)
+		return WIMLIB_ERR_NOMEM;
+	node->is_end = true;
+	return 0;
+}
+
+/*
+ * Compile a list of wildcard patterns, as accepted by match_path(), into a
+ * pattern set for match_pattern_set().  The pattern strings must remain valid
+ * for as long as the pattern set is used.
  *
- * @return 0 on success; a positive error code on failure; or the first nonzero
- * value returned by @consume_dentry.
+ * Returns 0 or WIMLIB_ERR_NOMEM.
  */
 int
-expand_path_pattern(struct wim_dentry *root, const tchar *pattern,
+new_pattern_set(const struct string_list *list, struct pattern_set **set_ret)
+{
+	struct pattern_set *set;
+	int ret;
+
+	set = CALLOC(1, sizeof(*set));
+	if (!set)
+		return WIMLIB_ERR_NOMEM;
+
+	for (size_t i = 0; i < list->num_strings; i++) {
+		ret = add_pattern(set, list->strings[i]);
+		if (ret) {
+			free_pattern_set(set);
+			return ret;
+		}
+	}
+	*set_ret = set;
+	return 0;
+}
+
+void
+free_pattern_set(struct pattern_set *set)
+{
+	if (set) {
+		destroy_pattern_node(&set->absolute_root);
+		destroy_pattern_node(&set->relative_root);
+		FREE(set);
+	}
+}
+
+/* Determine whether @path matches any of the patterns below @node, where the
+ * path components before @path have matched those leading up to @node.  This
+ * follows the same rules as match_path().  */
+static bool
+match_pattern_node(const struct pattern_node *node, const tchar *path,
+		   int match_flags)
+{
+	const tchar *path_component_end;
+	size_t path_component_len;
+	size_t lo, hi;
+
+	path = advance_to_next_component(path);
+
+	/* Is a pattern exhausted?  */
+	if (node->is_end && (!*path || (match_flags & MATCH_RECURSIVELY)))
+		return true;
+
+	/* Is the path exhausted (but not some pattern)?  */
+	if (!*path)
+		return (match_flags & MATCH_ANCESTORS) &&
+		       (node->num_literal_children ||
+			node->num_wildcard_children);
+
+	path_component_end = advance_through_component(path);
+	path_component_len = path_component_end - path;
+
+	/* Find the range of literal children which match the path component
+	 * when ignoring case.  */
+	lo = 0;
+	hi = node->num_literal_children;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct pattern_node *child = node->literal_children[mid];
+		int exact;
+
+		if (cmp_literal_components(child->component,
+					   child->component_len,
+					   path, path_component_len,
+					   &exact) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < node->num_literal_children; lo++) {
+		const struct pattern_node *child = node->literal_children[lo];
+		int exact;
+
+		if (cmp_literal_components(child->component,
+					   child->component_len,
+					   path, path_component_len, &exact))
+			break;
+		if ((exact == 0 || default_ignore_case) &&
+		    match_pattern_node(child, path_component_end, match_flags))
+			return true;
+	}
+
+	for (size_t i = 0; i < node->num_wildcard_children; i++) {
+		const struct pattern_node *child = node->wildcard_children[i];
+		const tchar *component_end =
+			&child->component[child->component_len];
+
+		if (path_component_len < child->tail_len ||
+		    !string_matches_pattern(path_component_end - child->tail_len,
+					    path_component_end,
+					    component_end - child->tail_len,
+					    component_end))
+			continue;
+		if (string_matches_pattern(path, path_component_end,
+					   child->component, component_end) &&
+		    match_pattern_node(child, path_component_end, match_flags))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Determine whether a path matches any of the patterns in a pattern set.  This
+ * gives the same result as calling match_path() with each of the patterns the
+ * set was compiled from, but without going through all the patterns.
+ */
+bool
+match_pattern_set(const tchar *path, const struct pattern_set *set,
+		  int match_flags)
+{
+	if (!set)
+		return false;
+	return match_pattern_node(&set->absolute_root, path, match_flags) ||
+	       match_pattern_node(&set->relative_root, path_basename(path),
+				  match_flags);
+}
+
+static int
+expand_pattern_node(struct wim_dentry *dentry, struct pattern_node *node,
 		    int (*consume_dentry)(struct wim_dentry *, void *),
-		    void *ctx)
+		    void *ctx);
+
+/* Expand the pattern components below @node in the child of @dir named by the
+ * literal component of @node, and in its case-insensitive matches if case is
+ * being ignored.  */
+static int
+expand_literal_child(struct wim_dentry *dir, struct pattern_node *node,
+		     int (*consume_dentry)(struct wim_dentry *, void *),
+		     void *ctx)
 {
-	const tchar *pattern_component_end;
-	struct wim_dentry *child;
+	tchar name[node->component_len + 1];
+	struct wim_dentry *child, *ci_match;
+	int ret;
 
-	if (!root)
+	tmemcpy(name, node->component, node->component_len);
+	name[node->component_len] = T('\0');
+
+	child = get_dentry_child_with_name(dir, name,
+					   WIMLIB_CASE_PLATFORM_DEFAULT);
+	if (!child)
 		return 0;
+	ret = expand_pattern_node(child, node, consume_dentry, ctx);
+	if (ret || !default_ignore_case)
+		return ret;
+	dentry_for_each_ci_match(ci_match, child) {
+		ret = expand_pattern_node(ci_match, node, consume_dentry, ctx);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Expand the pattern components below @node in the tree rooted at @dentry,
+ * where the path to @dentry has matched the components leading up to @node.
+ */
+static int
+expand_pattern_node(struct wim_dentry *dentry, struct pattern_node *node,
+		    int (*consume_dentry)(struct wim_dentry *, void *),
+		    void *ctx)
+{
+	struct wim_dentry *child;
+	int ret;
 
-	pattern = advance_to_next_component(pattern);
+	if (node->is_end) {
+		node->matched = true;
+		ret = (*consume_dentry)(dentry, ctx);
+		if (ret)
+			return ret;
+	}
 
-	/* If there are no more components, then 'root' is matched.  */
-	if (!*pattern)
-		return (*consume_dentry)(root, ctx);
+	/* Components without wildcards are looked up directly.  */
+	for (size_t i = 0; i < node->num_literal_children; i++) {
+		ret = expand_literal_child(dentry, node->literal_children[i],
+					   consume_dentry, ctx);
+		if (ret)
+			return ret;
+	}
 
-	pattern_component_end = advance_through_component(pattern);
+	if (!node->num_wildcard_children)
+		return 0;
 
-	/* For each child dentry that matches the current pattern component,
-	 * recurse with the remainder of the pattern.  */
-	for_dentry_child(child, root) {
+	/* Components with wildcards are matched against each child, all of
+	 * them in one pass over the directory.  */
+	for_dentry_child(child, dentry) {
 		const tchar *name;
+		const tchar *name_end;
 		size_t name_nbytes;
-		int ret;
 
 		ret = utf16le_get_tstr(child->d_name, child->d_name_nbytes,
 				       &name, &name_nbytes);
 		if (ret)
 			return ret;
+		name_end = &name[name_nbytes / sizeof(tchar)];
+
+		for (size_t i = 0; i < node->num_wildcard_children; i++) {
+			struct pattern_node *wc = node->wildcard_children[i];
+			const tchar *component_end =
+				&wc->component[wc->component_len];
 
-		if (string_matches_pattern(name, &name[name_nbytes / sizeof(tchar)],
-					   pattern, pattern_component_end))
-			ret = expand_path_pattern(child, pattern_component_end,
-						  consume_dentry, ctx);
+			if ((size_t)(name_end - name) < wc->tail_len ||
+			    !string_matches_pattern(name_end - wc->tail_len,
+						    name_end,
+						    component_end - wc->tail_len,
+						    component_end) ||
+			    !string_matches_pattern(name, name_end,
+						    wc->component,
+						    component_end))
+				continue;
+			ret = expand_pattern_node(child, wc, consume_dentry,
+						  ctx);
+			if (ret)
+				break;
+		}
 		utf16le_put_tstr(name);
 		if (ret)
 			return ret;
 	}
 	return 0;
 }
+
+/*
+ * Expand the path patterns of a pattern set in an in-memory tree of dentries.
+ *
+ * @root
+ *	The root of the directory tree in which to expand the patterns.
+ * @set
+ *	The pattern set, compiled from patterns which may contain the '*' and '?'
+ *	wildcard characters.  Path separators must be WIM_PATH_SEPARATOR.
+ *	Leading and trailing path separators are ignored, so all patterns are
+ *	matched against the entire path.  The default case sensitivity behavior
+ *	is used.
+ * @consume_dentry
+ *	A callback function which will receive each matched directory entry.
+ * @ctx
+ *	Opaque context argument for @consume_dentry.
+ *
+ * All the patterns are expanded in one traversal of the tree.  Patterns share
+ * the work for the leading components they have in common, components without
+ * wildcards are looked up in the directory index rather than compared with
+ * every child, and each directory is read at most once for all the wildcard
+ * components that apply to it.
+ *
+ * A dentry matched by several patterns is passed to @consume_dentry once per
+ * pattern.  Afterwards, pattern_set_matched() tells which patterns matched.
+ *
+ * @return 0 on success; a positive error code on failure; or the first nonzero
+ * value returned by @consume_dentry.
+ */
+int
+expand_pattern_set(struct wim_dentry *root, struct pattern_set *set,
+		   int (*consume_dentry)(struct wim_dentry *, void *),
+		   void *ctx)
+{
+	int ret;
+
+	if (!root)
+		return 0;
+	ret = expand_pattern_node(root, &set->absolute_root,
+				  consume_dentry, ctx);
+	if (ret)
+		return ret;
+	return expand_pattern_node(root, &set->relative_root,
+				   consume_dentry, ctx);
+}
+
+/* Return true iff expand_pattern_set() matched at least one dentry with
+ * @pattern, which must be one of the patterns of @set.  */
+bool
+pattern_set_matched(struct pattern_set *set, const tchar *pattern)
+{
+	struct pattern_node *node = get_pattern_end_node(set, pattern, false);
+
+	return node && node->matched;
+}
@@ -0,0 +1,169 @@
+/*
+ * read_blobs.c
+ *
+ * Read the data of blobs from a WIMStruct into user callbacks.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/error.h"
+#include "wimlib/resource.h"
+#include "wimlib/sha1.h"
+#include "wimlib/wim.h"
+
+struct read_blobs_ctx {
+	const struct wimlib_read_blob_callbacks *cbs;
+
+	/* The blob being read, and its description for the user  */
+	const struct blob_descriptor *cur_blob;
+	struct wimlib_resource_entry entry;
+
+	/* The nonzero value returned by a user callback, if any  */
+	int user_ret;
+};
+
+static const struct wimlib_resource_entry *
+get_entry(struct read_blobs_ctx *ctx, const struct blob_descriptor *blob)
+{
+	if (blob != ctx->cur_blob) {
+		blob_to_wimlib_resource_entry(blob, &ctx->entry);
+		ctx->cur_blob = blob;
+	}
+	return &ctx->entry;
+}
+
+/* Remember a nonzero return value of a user callback, so that it can be
+ * returned from wimlib_read_blobs() in place of the error code with which the
+ * read is aborted.  */
+static int
+user_status(struct read_blobs_ctx *ctx, int ret)
+{
+	if (ret == 0)
+		return 0;
+	if (ctx->user_ret == 0)
+		ctx->user_ret = ret;
+	return WIMLIB_ERR_ABORTED_BY_PROGRESS;
+}
+
+static int
+read_blobs_begin_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct read_blobs_ctx *ctx = _ctx;
+
+	if (!ctx->cbs->begin_blob)
+		return 0;
+	return user_status(ctx, (*ctx->cbs->begin_blob)(get_entry(ctx, blob),
+							ctx->cbs->user_ctx));
+}
+
+static int
+read_blobs_continue_blob(const struct blob_descriptor *blob, u64 offset,
+			 const void *chunk, size_t size, void *_ctx)
+{
+	struct read_blobs_ctx *ctx = _ctx;
+
+	if (!ctx->cbs->blob_data)
+		return 0;
+	return user_status(ctx, (*ctx->cbs->blob_data)(get_entry(ctx, blob),
+						       offset, chunk, size,
+						       ctx->cbs->user_ctx));
+}
+
+static int
+read_blobs_end_blob(struct blob_descriptor *blob, int status, void *_ctx)
+{
+	struct read_blobs_ctx *ctx = _ctx;
+	int ret;
+
+	if (ctx->cbs->end_blob) {
+		ret = (*ctx->cbs->end_blob)(get_entry(ctx, blob),
+					    ctx->user_ret ? ctx->user_ret : status,
+					    ctx->cbs->user_ctx);
+		/* A failure status must be passed on regardless.  */
+		if (!status)
+			status = user_status(ctx, ret);
+	}
+	return status;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_read_blobs(WIMStruct *wim, const uint8_t (*hashes)[20],
+		  size_t num_hashes, int flags,
+		  const struct wimlib_read_blob_callbacks *cbs)
+{
+	LIST_HEAD(blob_list);
+	struct blob_descriptor *blob, *tmp;
+	struct read_blobs_ctx ctx = {
+		.cbs = cbs,
+	};
+	struct read_blob_callbacks read_cbs = {
+		.begin_blob	= read_blobs_begin_blob,
+		.continue_blob	= read_blobs_continue_blob,
+		.end_blob	= read_blobs_end_blob,
+		.ctx		= &ctx,
+	};
+	int read_flags;
+	int ret;
+
+	if (!wim || (num_hashes && !hashes) || !cbs || flags)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	/* Look up the blobs, reading each one only once even if its hash was
+	 * given multiple times.  out_refcnt marks the blobs already in the
+	 * list, like during extraction.  */
+	ret = 0;
+	for (size_t i = 0; i < num_hashes; i++) {
+		if (is_zero_hash(hashes[i]))
+			continue;
+		blob = lookup_blob(wim->blob_table, hashes[i]);
+		if (!blob) {
+			if (wimlib_print_errors) {
+				tchar hashstr[SHA1_HASH_STRING_LEN];
+
+				sprint_hash(hashes[i], hashstr);
+				ERROR("Blob %"TS" not found", hashstr);
+			}
+			ret = WIMLIB_ERR_RESOURCE_NOT_FOUND;
+			goto out;
+		}
+		if (!blob->out_refcnt) {
+			blob->out_refcnt = 1;
+			list_add_tail(&blob->extraction_list, &blob_list);
+		}
+	}
+
+	/* Read the blobs in the order of their data in the WIM file(s), and
+	 * with each solid resource decompressed only once.  */
+	read_flags = VERIFY_BLOB_HASHES;
+	if (wim->num_decompression_threads != 1)
+		read_flags |= HASH_BLOBS_ASYNC;
+	ret = read_blob_list(&blob_list,
+			     offsetof(struct blob_descriptor, extraction_list),
+			     &read_cbs, read_flags);
+	if (ctx.user_ret)
+		ret = ctx.user_ret;
+out:
+	list_for_each_entry_safe(blob, tmp, &blob_list, extraction_list)
+		blob->out_refcnt = 0;
+	return ret;
+}
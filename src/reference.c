@@ -26,6 +26,7 @@
 #endif
 
 #include "wimlib.h"
+#include "wimlib/blob_store.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/error.h"
 #include "wimlib/glob.h"
@@ -38,7 +39,9 @@ struct reference_info {
 	WIMStruct *dest_wim;
 	struct list_head new_blobs;
 	int ref_flags;
+	bool blob_store;
 	struct blob_table *src_table;
+	struct blob_slab *slab;
 };
 
 static void
@@ -48,6 +51,8 @@ init_reference_info(struct reference_info *info, WIMStruct *dest_wim,
 	info->dest_wim = dest_wim;
 	INIT_LIST_HEAD(&info->new_blobs);
 	info->ref_flags = ref_flags;
+	info->blob_store = false;
+	info->slab = NULL;
 }
 
 static void
@@ -83,7 +88,7 @@ blob_clone_if_new(struct blob_descriptor *blob, void *_info)
 	struct reference_info *info = _info;
 
 	if (need_blob(info, blob)) {
-		blob = clone_blob_descriptor(blob);
+		blob = clone_blob_descriptor_from_slab(blob, &info->slab);
 		if (unlikely(!blob))
 			return WIMLIB_ERR_NOMEM;
 		reference_blob(info, blob);
@@ -116,6 +121,8 @@ wimlib_reference_resources(WIMStruct *wim, WIMStruct **resource_wims,
 	init_reference_info(&info, wim, ref_flags);
 
 	for (i = 0; i < num_resource_wims; i++) {
+		blob_table_reserve_for(wim->blob_table,
+				       resource_wims[i]->blob_table);
 		ret = for_blob_in_table(resource_wims[i]->blob_table,
 					blob_clone_if_new, &info);
 		if (ret)
@@ -124,6 +131,7 @@ wimlib_reference_resources(WIMStruct *wim, WIMStruct **resource_wims,
 
 	if (unlikely(ret))
 		rollback_reference_info(&info);
+	put_blob_slab(info.slab);
 	return ret;
 }
 
@@ -131,12 +139,20 @@ static int
 blob_gift(struct blob_descriptor *blob, void *_info)
 {
 	struct reference_info *info = _info;
+	struct blob_descriptor *existing;
 
 	blob_table_unlink(info->src_table, blob);
-	if (need_blob(info, blob))
+	existing = lookup_blob(info->dest_wim->blob_table, blob->hash);
+	if (!existing) {
+		blob->in_blob_store = info->blob_store;
 		reference_blob(info, blob);
-	else
+	} else {
+		/* A blob we already have, e.g. in a file being captured, can
+		 * still be known to be in the blob store.  */
+		if (info->blob_store)
+			existing->in_blob_store = 1;
 		free_blob_descriptor(blob);
+	}
 	return 0;
 }
 
@@ -153,7 +169,14 @@ reference_resource_path(struct reference_info *info, const tchar *path,
 	if (ret)
 		return ret;
 
+	/* The data of the referenced WIM will be read through its own
+	 * WIMStruct, which the caller never sees; so have it decompress data
+	 * with as many threads as the WIMStruct referencing it.  */
+	wimlib_set_decompression_threads(src_wim,
+					 info->dest_wim->num_decompression_threads);
+
 	info->src_table = src_wim->blob_table;
+	blob_table_reserve_for(info->dest_wim->blob_table, info->src_table);
 	for_blob_in_table(src_wim->blob_table, blob_gift, info);
 	wimlib_free(src_wim);
 	return 0;
@@ -220,6 +243,27 @@ reference_resource_globs(struct reference_info *info,
 	return 0;
 }
 
+/*
+ * Reference the blobs in the given pack files of a blob store, marking them
+ * (as well as any blobs @wim already has that the packs also contain) with
+ * @in_blob_store.
+ */
+int
+reference_blob_store_packs(WIMStruct *wim, const tchar * const *paths,
+			   unsigned num_paths)
+{
+	struct reference_info info;
+	int ret;
+
+	init_reference_info(&info, wim, 0);
+	info.blob_store = true;
+
+	ret = reference_resource_paths(&info, paths, num_paths, 0);
+	if (unlikely(ret))
+		rollback_reference_info(&info);
+	return ret;
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_reference_resource_files(WIMStruct *wim,
@@ -48,6 +48,34 @@ struct regf {
 	u8 hbin_area[0];		/* Start of hbin area  */
 } __attribute__((packed));
 
+/* Granularity in which the hive file is read  */
+#define HIVE_BLOCK_SIZE		65536
+
+/*
+ * An open registry hive.  The hive file is read into @mem on demand, one
+ * HIVE_BLOCK_SIZE block at a time, as cells are looked up.  Looking up a few
+ * values in a large hive (such as SOFTWARE, which can exceed 100 MB) touches
+ * only a small fraction of it, so most of the file is never read, and on
+ * systems which allocate memory lazily most of @mem is never committed.
+ */
+struct hive {
+	/* Buffer for the contents of the hive file.  Only the blocks for which
+	 * @loaded is set contain valid data.  */
+	u8 *mem;
+	size_t size;
+
+	/* Function which reads the hive file, or NULL if @mem was supplied with
+	 * the full contents of the file  */
+	hive_read_func_t read_func;
+	void *read_ctx;
+
+	/* One flag for each block of the file: whether it has been read  */
+	u8 *loaded;
+
+	/* Error code from @read_func, if it failed  */
+	int read_error;
+};
+
 
 /* Cell header  */
 struct cell {
@@ -184,12 +212,57 @@ names_equal(const utf16lechar *name, size_t name_nchars,
 	}
 }
 
+/* Make sure that the given range of the hive file has been read into memory.
+ * Returns false on read error.  */
+static bool
+hive_load(struct hive *hive, size_t offset, size_t size)
+{
+	size_t first, last, i, j;
+	int ret;
+
+	if (!hive->read_func || size == 0)
+		return true;
+	if (hive->read_error)
+		return false;
+
+	first = offset / HIVE_BLOCK_SIZE;
+	last = (offset + size - 1) / HIVE_BLOCK_SIZE;
+	for (i = first; i <= last; i = j) {
+		size_t start, end;
+
+		if (hive->loaded[i]) {
+			j = i + 1;
+			continue;
+		}
+		/* Read each run of missing blocks with a single call.  */
+		for (j = i + 1; j <= last && !hive->loaded[j]; j++)
+			;
+		start = i * HIVE_BLOCK_SIZE;
+		end = min(j * HIVE_BLOCK_SIZE, hive->size);
+		ret = (*hive->read_func)(hive->read_ctx, start, end - start,
+					 &hive->mem[start]);
+		if (ret) {
+			hive->read_error = ret;
+			return false;
+		}
+		memset(&hive->loaded[i], 1, j - i);
+	}
+	return true;
+}
+
+static inline const struct regf *
+hive_regf(const struct hive *hive)
+{
+	return (const struct regf *)hive->mem;
+}
+
 /* Get a pointer to a cell, with alignment and bounds checking.  Returns NULL if
  * the requested information does not specify a properly aligned, sized, and
- * in-use cell.  */
+ * in-use cell, or if it could not be read.  */
 static const void *
-get_cell_pointer(const struct regf *regf, le32 offset, size_t wanted_size)
+get_cell_pointer(struct hive *hive, le32 offset, size_t wanted_size)
 {
+	const struct regf *regf = hive_regf(hive);
 	u32 total = le32_to_cpu(regf->total_hbin_size);
 	u32 offs = le32_to_cpu(offset);
 	const struct cell *cell;
@@ -198,6 +271,9 @@ get_cell_pointer(const struct regf *regf, le32 offset, size_t wanted_size)
 	if ((offs > total) || (offs & 7) || (wanted_size > total - offs))
 		return NULL;
 
+	if (!hive_load(hive, sizeof(struct regf) + offs, wanted_size))
+		return NULL;
+
 	cell = (const struct cell *)&regf->hbin_area[offs];
 	actual_size = -le32_to_cpu(cell->size);
 	if (actual_size > INT32_MAX) /* Cell unused, or size was INT32_MIN?  */
@@ -210,9 +286,9 @@ get_cell_pointer(const struct regf *regf, le32 offset, size_t wanted_size)
 /* Revalidate the cell with its full length.  Returns true iff the cell is
  * valid.  */
 static bool
-revalidate_cell(const struct regf *regf, le32 offset, size_t wanted_size)
+revalidate_cell(struct hive *hive, le32 offset, size_t wanted_size)
 {
-	return get_cell_pointer(regf, offset, wanted_size) != NULL;
+	return get_cell_pointer(hive, offset, wanted_size) != NULL;
 }
 
 struct subkey_iteration_stats {
@@ -235,7 +311,7 @@ struct subkey_iteration_stats {
 typedef enum hive_status (*subkey_cb_t)(const struct nk *, void *);
 
 static enum hive_status
-iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
+iterate_subkeys_recursive(struct hive *hive, le32 subkey_list_offset,
 			  subkey_cb_t cb, void *cb_ctx,
 			  struct subkey_iteration_stats *stats)
 {
@@ -251,7 +327,7 @@ iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
 
 	stats->subkey_lists_remaining--;
 
-	list = get_cell_pointer(regf, subkey_list_offset,
+	list = get_cell_pointer(hive, subkey_list_offset,
 				sizeof(struct subkey_list));
 	if (!list)
 		return HIVE_CORRUPT;
@@ -266,7 +342,7 @@ iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
 		increment = 2;
 	}
 
-	if (!revalidate_cell(regf, subkey_list_offset,
+	if (!revalidate_cell(hive, subkey_list_offset,
 			     sizeof(struct subkey_list) + extra_size))
 		return HIVE_CORRUPT;
 
@@ -281,12 +357,12 @@ iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
 		while (num_offsets--) {
 			const struct nk *sub_nk;
 
-			sub_nk = get_cell_pointer(regf, list->elements[i],
+			sub_nk = get_cell_pointer(hive, list->elements[i],
 						  sizeof(struct nk));
 			if (!sub_nk || sub_nk->base.magic != NK_MAGIC)
 				return HIVE_CORRUPT;
 
-			if (!revalidate_cell(regf, list->elements[i],
+			if (!revalidate_cell(hive, list->elements[i],
 					     sizeof(struct nk) +
 						le16_to_cpu(sub_nk->name_size)))
 				return HIVE_CORRUPT;
@@ -302,7 +378,7 @@ iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
 		status = HIVE_OK;
 		stats->levels_remaining--;
 		while (num_offsets--) {
-			status = iterate_subkeys_recursive(regf,
+			status = iterate_subkeys_recursive(hive,
 						list->elements[i++],
 						cb, cb_ctx, stats);
 			if (status != HIVE_OK)
@@ -317,7 +393,7 @@ iterate_subkeys_recursive(const struct regf *regf, le32 subkey_list_offset,
 
 /* Call @cb on each subkey cell of the key @nk.  */
 static enum hive_status
-iterate_subkeys(const struct regf *regf, const struct nk *nk,
+iterate_subkeys(struct hive *hive, const struct nk *nk,
 		subkey_cb_t cb, void *cb_ctx)
 {
 	u32 num_subkeys = le32_to_cpu(nk->num_subkeys);
@@ -334,7 +410,7 @@ iterate_subkeys(const struct regf *regf, const struct nk *nk,
 	stats.subkey_lists_remaining = MAX_SUBKEY_LISTS;
 	stats.subkeys_remaining = num_subkeys;
 
-	status = iterate_subkeys_recursive(regf, nk->subkey_list_offset,
+	status = iterate_subkeys_recursive(hive, nk->subkey_list_offset,
 					   cb, cb_ctx, &stats);
 	if (stats.subkeys_remaining != 0 && status == HIVE_OK)
 		status = HIVE_CORRUPT;
@@ -370,7 +446,7 @@ lookup_subkey_cb(const struct nk *sub_nk, void *_ctx)
  * another HIVE_* error code.
  */
 static enum hive_status
-lookup_subkey(const struct regf *regf, const utf16lechar **key_namep,
+lookup_subkey(struct hive *hive, const utf16lechar **key_namep,
 	      const struct nk *nk, const struct nk **sub_nk_ret)
 {
 	const utf16lechar *key_name = *key_namep;
@@ -386,7 +462,7 @@ lookup_subkey(const struct regf *regf, const utf16lechar **key_namep,
 	ctx.key_name_nchars = key_name_nchars;
 	ctx.result = NULL;
 
-	status = iterate_subkeys(regf, nk, lookup_subkey_cb, &ctx);
+	status = iterate_subkeys(hive, nk, lookup_subkey_cb, &ctx);
 	if (!ctx.result) {
 		if (status == HIVE_OK)
 			status = HIVE_KEY_NOT_FOUND;
@@ -401,16 +477,17 @@ lookup_subkey(const struct regf *regf, const utf16lechar **key_namep,
 	return HIVE_OK;
 }
 
-/* Find the nk cell for the key named @key_name in the registry hive @regf.  */
+/* Find the nk cell for the key named @key_name in the registry hive @hive.  */
 static enum hive_status
-lookup_key(const struct regf *regf, const tchar *key_name,
+lookup_key(struct hive *hive, const tchar *key_name,
 	   const struct nk **nk_ret)
 {
 	const struct nk *nk;
 	enum hive_status status;
 	const utf16lechar *key_uname, *key_unamep;
 
-	nk = get_cell_pointer(regf, regf->root_key_offset, sizeof(struct nk));
+	nk = get_cell_pointer(hive, hive_regf(hive)->root_key_offset,
+			      sizeof(struct nk));
 	if (!nk || nk->base.magic != NK_MAGIC)
 		return HIVE_CORRUPT;
 
@@ -419,7 +496,7 @@ lookup_key(const struct regf *regf, const tchar *key_name,
 		return status;
 	key_unamep = key_uname;
 	while (*key_unamep) {
-		status = lookup_subkey(regf, &key_unamep, nk, &nk);
+		status = lookup_subkey(hive, &key_unamep, nk, &nk);
 		if (status != HIVE_OK)
 			goto out;
 	}
@@ -431,9 +508,9 @@ out:
 }
 
 /* Find the vk cell for the value named @value_name of the key named @key_name
- * in the registry hive @regf.  */
+ * in the registry hive @hive.  */
 static enum hive_status
-lookup_value(const struct regf *regf, const tchar *key_name,
+lookup_value(struct hive *hive, const tchar *key_name,
 	     const tchar *value_name, const struct vk **vk_ret)
 {
 	enum hive_status status;
@@ -444,7 +521,7 @@ lookup_value(const struct regf *regf, const tchar *key_name,
 	size_t value_uname_nchars;
 
 	/* Look up the nk cell for the key.  */
-	status = lookup_key(regf, key_name, &nk);
+	status = lookup_key(hive, key_name, &nk);
 	if (status != HIVE_OK)
 		return status;
 
@@ -456,7 +533,7 @@ lookup_value(const struct regf *regf, const tchar *key_name,
 	if (num_values > MAX_VALUES)
 		return HIVE_CORRUPT;
 
-	value_list = get_cell_pointer(regf, nk->value_list_offset,
+	value_list = get_cell_pointer(hive, nk->value_list_offset,
 				      sizeof(struct value_list) +
 				      (num_values *
 				       sizeof(value_list->vk_offsets[0])));
@@ -477,14 +554,14 @@ lookup_value(const struct regf *regf, const tchar *key_name,
 		size_t name_size;
 
 		status = HIVE_CORRUPT;
-		vk = get_cell_pointer(regf, value_list->vk_offsets[i],
+		vk = get_cell_pointer(hive, value_list->vk_offsets[i],
 				      sizeof(struct vk));
 		if (!vk || vk->base.magic != VK_MAGIC)
 			goto out;
 
 		name_size = le16_to_cpu(vk->name_size);
 
-		if (!revalidate_cell(regf, value_list->vk_offsets[i],
+		if (!revalidate_cell(hive, value_list->vk_offsets[i],
 				     sizeof(struct vk) + name_size))
 			goto out;
 
@@ -506,12 +583,12 @@ out:
 
 /*
  * Retrieve the data of the value named @value_name of the key named @key_name
- * in the registry hive @regf.  If the value was found, return HIVE_OK and
+ * in the registry hive @hive.  If the value was found, return HIVE_OK and
  * return the data, its size, and its type in @data_ret, @data_size_ret, and
  * @data_type_ret.  Otherwise, return another HIVE_* error code.
  */
 static enum hive_status
-retrieve_value(const struct regf *regf, const tchar *key_name,
+retrieve_value(struct hive *hive, const tchar *key_name,
 	       const tchar *value_name, void **data_ret,
 	       size_t *data_size_ret, le32 *data_type_ret)
 {
@@ -522,7 +599,7 @@ retrieve_value(const struct regf *regf, const tchar *key_name,
 	const void *data;
 
 	/* Find the vk cell.  */
-	status = lookup_value(regf, key_name, value_name, &vk);
+	status = lookup_value(hive, key_name, value_name, &vk);
 	if (status != HIVE_OK)
 		return status;
 
@@ -544,12 +621,12 @@ retrieve_value(const struct regf *regf, const tchar *key_name,
 	} else {
 		const struct data_cell *data_cell;
 
-		data_cell = get_cell_pointer(regf, vk->data_offset,
+		data_cell = get_cell_pointer(hive, vk->data_offset,
 					     sizeof(struct data_cell));
 		if (!data_cell)
 			return HIVE_CORRUPT;
 
-		if (!revalidate_cell(regf, vk->data_offset,
+		if (!revalidate_cell(hive, vk->data_offset,
 				     sizeof(struct data_cell) + data_size))
 			return HIVE_UNSUPPORTED; /* Possibly a big data cell  */
 
@@ -564,30 +641,114 @@ retrieve_value(const struct regf *regf, const tchar *key_name,
 	return HIVE_OK;
 }
 
-/* Validate the registry hive file given in memory as @hive_mem and @hive_size.
- * If valid, return HIVE_OK.  If invalid, return another HIVE_* error code.  */
-enum hive_status
-hive_validate(const void *hive_mem, size_t hive_size)
+/* Validate the header of the registry hive file.  */
+static enum hive_status
+hive_validate(struct hive *hive)
 {
-	const struct regf *regf = hive_mem;
+	const struct regf *regf = hive_regf(hive);
 
 	STATIC_ASSERT(sizeof(struct regf) == 4096);
 
-	if (hive_size < sizeof(struct regf))
+	if (hive->size < sizeof(struct regf))
 		return HIVE_CORRUPT;
 
+	if (!hive_load(hive, 0, sizeof(struct regf)))
+		return HIVE_READ_ERROR;
+
 	if (regf->magic != REGF_MAGIC || regf->major_version != REGF_MAJOR)
 		return HIVE_UNSUPPORTED;
 
-	if (le32_to_cpu(regf->total_hbin_size) > hive_size - sizeof(struct regf))
+	if (le32_to_cpu(regf->total_hbin_size) > hive->size - sizeof(struct regf))
 		return HIVE_CORRUPT;
 
 	return HIVE_OK;
 }
 
+/* Close a registry hive opened with hive_open() or hive_open_buffer().  */
+void
+hive_close(struct hive *hive)
+{
+	if (!hive)
+		return;
+	if (hive->read_func)
+		FREE(hive->mem);
+	FREE(hive->loaded);
+	FREE(hive);
+}
+
+/*
+ * Open the registry hive file of @size bytes which can be read with
+ * @read_func, which will be called to read parts of the file as they are
+ * needed.  Only the header is read immediately, to validate it.  On success,
+ * return HIVE_OK and a handle to the hive in @hive_ret; the handle must be
+ * freed with hive_close().  Otherwise return another HIVE_* status code.
+ */
+enum hive_status
+hive_open(size_t size, hive_read_func_t read_func, void *read_ctx,
+	  struct hive **hive_ret)
+{
+	struct hive *hive;
+	enum hive_status status;
+
+	hive = CALLOC(1, sizeof(*hive));
+	if (!hive)
+		return HIVE_OUT_OF_MEMORY;
+	hive->size = size;
+	hive->read_func = read_func;
+	hive->read_ctx = read_ctx;
+	hive->mem = CALLOC(1, max(size, sizeof(struct regf)));
+	hive->loaded = CALLOC(1, DIV_ROUND_UP(size, HIVE_BLOCK_SIZE) + 1);
+	if (!hive->mem || !hive->loaded) {
+		status = HIVE_OUT_OF_MEMORY;
+		goto err;
+	}
+	status = hive_validate(hive);
+	if (status != HIVE_OK)
+		goto err;
+	*hive_ret = hive;
+	return HIVE_OK;
+
+err:
+	hive_close(hive);
+	return status;
+}
+
+/* Like hive_open(), but for a hive file which has already been read into
+ * memory in full.  The memory is borrowed, not copied, and must remain valid
+ * until hive_close().  */
+enum hive_status
+hive_open_buffer(const void *mem, size_t size, struct hive **hive_ret)
+{
+	struct hive *hive;
+	enum hive_status status;
+
+	hive = CALLOC(1, sizeof(*hive));
+	if (!hive)
+		return HIVE_OUT_OF_MEMORY;
+	hive->mem = (u8 *)mem;
+	hive->size = size;
+	status = hive_validate(hive);
+	if (status != HIVE_OK) {
+		FREE(hive);
+		return status;
+	}
+	*hive_ret = hive;
+	return HIVE_OK;
+}
+
+/* A lookup which failed because part of the hive couldn't be read looks the
+ * same as one that found a corrupt cell; tell the two apart.  */
+static enum hive_status
+hive_final_status(const struct hive *hive, enum hive_status status)
+{
+	if (status != HIVE_OK && hive->read_error)
+		return HIVE_READ_ERROR;
+	return status;
+}
+
 /* Get a string value from the registry hive file.  */
 enum hive_status
-hive_get_string(const struct regf *regf, const tchar *key_name,
+hive_get_string(struct hive *hive, const tchar *key_name,
 		const tchar *value_name, tchar **value_ret)
 {
 	void *data;
@@ -596,10 +757,10 @@ hive_get_string(const struct regf *regf, const tchar *key_name,
 	enum hive_status status;
 
 	/* Retrieve the raw value data.  */
-	status = retrieve_value(regf, key_name, value_name,
+	status = retrieve_value(hive, key_name, value_name,
 				&data, &data_size, &data_type);
 	if (status != HIVE_OK)
-		return status;
+		return hive_final_status(hive, status);
 
 	/* Interpret the data as a string, when possible.  */
 	switch (data_type) {
@@ -618,7 +779,7 @@ hive_get_string(const struct regf *regf, const tchar *key_name,
 
 /* Get a number value from the registry hive file.  */
 enum hive_status
-hive_get_number(const struct regf *regf, const tchar *key_name,
+hive_get_number(struct hive *hive, const tchar *key_name,
 		const tchar *value_name, s64 *value_ret)
 {
 	void *data;
@@ -627,10 +788,10 @@ hive_get_number(const struct regf *regf, const tchar *key_name,
 	enum hive_status status;
 
 	/* Retrieve the raw value data.  */
-	status = retrieve_value(regf, key_name, value_name,
+	status = retrieve_value(hive, key_name, value_name,
 				&data, &data_size, &data_type);
 	if (status != HIVE_OK)
-		return status;
+		return hive_final_status(hive, status);
 
 	/* Interpret the data as a number, when possible.  */
 	switch (data_type) {
@@ -698,7 +859,7 @@ append_subkey_name(const struct nk *sub_nk, void *_next_subkey_p)
 
 /* List the subkeys of the specified registry key.  */
 enum hive_status
-hive_list_subkeys(const struct regf *regf, const tchar *key_name,
+hive_list_subkeys(struct hive *hive, const tchar *key_name,
 		  tchar ***subkeys_ret)
 {
 	enum hive_status status;
@@ -706,9 +867,9 @@ hive_list_subkeys(const struct regf *regf, const tchar *key_name,
 	tchar **subkeys;
 	tchar **next_subkey;
 
-	status = lookup_key(regf, key_name, &nk);
+	status = lookup_key(hive, key_name, &nk);
 	if (status != HIVE_OK)
-		return status;
+		return hive_final_status(hive, status);
 
 	if (le32_to_cpu(nk->num_subkeys) > MAX_SUBKEYS)
 		return HIVE_CORRUPT;
@@ -718,12 +879,12 @@ hive_list_subkeys(const struct regf *regf, const tchar *key_name,
 		return HIVE_OUT_OF_MEMORY;
 
 	next_subkey = subkeys;
-	status = iterate_subkeys(regf, nk, append_subkey_name, &next_subkey);
+	status = iterate_subkeys(hive, nk, append_subkey_name, &next_subkey);
 	if (status == HIVE_OK)
 		*subkeys_ret = subkeys;
 	else
 		hive_free_subkeys_list(subkeys);
-	return status;
+	return hive_final_status(hive, status);
 }
 
 void
@@ -754,6 +915,8 @@ hive_status_to_string(enum hive_status status)
 		return "HIVE_OUT_OF_MEMORY";
 	case HIVE_ITERATION_STOPPED:
 		return "HIVE_ITERATION_STOPPED";
+	case HIVE_READ_ERROR:
+		return "HIVE_READ_ERROR";
 	}
 	return NULL;
 }
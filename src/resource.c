@@ -33,12 +33,18 @@
 #include "wimlib/assert.h"
 #include "wimlib/bitops.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/chunk_decompressor.h"
+#include "wimlib/delta.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
 #include "wimlib/ntfs_3g.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/shared_chunk_cache.h"
+#include "wimlib/stats.h"
+#include "wimlib/threads.h"
 #include "wimlib/wim.h"
 #include "wimlib/win32.h"
 
@@ -83,7 +89,17 @@ struct data_range {
 	u64 size;
 };
 
-static int
+/* When reading more than half this much data from a file, each time half of
+ * the read-ahead distance has been read, the kernel is asked to read in the
+ * data up to the read-ahead distance beyond the current position, so that the
+ * reads stay ahead of the decompression and the callbacks.  The read-ahead
+ * distance is also how far ahead read_blob_list() asks the kernel to read the
+ * resources of upcoming blobs.  For WIM files, the distance is set with
+ * wimlib_set_read_ahead_size(); for other files, it is this.  See
+ * filedes_prefetch().  */
+#define READ_AHEAD_SIZE		((u64)8 << 20)
+
+int
 decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
 		 struct wimlib_decompressor *decompressor, bool recover_data)
 {
@@ -111,6 +127,292 @@ decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
 	return WIMLIB_ERR_DECOMPRESSION;
 }
 
+/* State for feeding uncompressed chunks into the ranges being read  */
+struct range_feeder {
+	const struct data_range *cur_range;
+	const struct data_range *end_range;
+	u64 cur_range_pos;
+	u64 cur_range_end;
+	u32 chunk_order;
+	const struct consume_chunk_callback *cb;
+};
+
+/*
+ * Feed the uncompressed data of the next needed chunk to the consume_chunk
+ * callback, splitting it at range boundaries.  The chunk is the one containing
+ * the current position in the current range; it is assumed that at least one
+ * range requires data in it.
+ */
+static int
+feed_chunk_to_ranges(struct range_feeder *f, const u8 *ubuf, u32 chunk_usize)
+{
+	const u64 chunk_start_offset =
+		(f->cur_range_pos >> f->chunk_order) << f->chunk_order;
+	const u64 chunk_end_offset = chunk_start_offset + chunk_usize;
+	int ret;
+
+	do {
+		size_t start, end, size;
+
+		/* Calculate how many bytes of data should be sent to the
+		 * callback function, taking into account that data sent to the
+		 * callback function must not overlap range boundaries.  */
+		start = f->cur_range_pos - chunk_start_offset;
+		end = min(f->cur_range_end, chunk_end_offset) - chunk_start_offset;
+		size = end - start;
+
+		ret = consume_chunk(f->cb, &ubuf[start], size);
+		if (unlikely(ret))
+			return ret;
+
+		f->cur_range_pos += size;
+		if (f->cur_range_pos == f->cur_range_end) {
+			/* Advance to next range.  */
+			if (++f->cur_range == f->end_range) {
+				f->cur_range_pos = ~0ULL;
+			} else {
+				f->cur_range_pos = f->cur_range->offset;
+				f->cur_range_end = f->cur_range->offset +
+						   f->cur_range->size;
+			}
+		}
+	} while (f->cur_range_pos < chunk_end_offset);
+	return 0;
+}
+
+/* Insert a chunk that was just decompressed into the chunk cache of @wim, if
+ * one was allocated for it.  The cache then owns the chunk.  */
+static void
+cache_new_chunk(WIMStruct *wim, struct cached_chunk **chunk_p)
+{
+	if (*chunk_p) {
+		chunk_cache_insert(wim->chunk_cache, *chunk_p,
+				   wim->max_chunk_cache_size);
+		*chunk_p = NULL;
+	}
+}
+
+/* Return true if the ranges starting at @range need only part of the chunk
+ * spanning [@chunk_start_offset, @chunk_end_offset) of the uncompressed
+ * resource.  */
+static bool
+chunk_partly_needed(const struct data_range *range,
+		    const struct data_range *end_range,
+		    u64 chunk_start_offset, u64 chunk_end_offset)
+{
+	u64 needed = 0;
+
+	for (; range != end_range && range->offset < chunk_end_offset; range++) {
+		needed += min(range->offset + range->size, chunk_end_offset) -
+			  max(range->offset, chunk_start_offset);
+	}
+	return needed < chunk_end_offset - chunk_start_offset;
+}
+
+/* Retrieve the oldest chunk that was submitted to the parallel chunk
+ * decompressor and feed its data to the ranges being read.  */
+static int
+feed_decompressed_chunk(struct chunk_decompressor *d, struct range_feeder *f)
+{
+	const void *ubuf;
+	u32 usize;
+	int status;
+	bool ok;
+
+	ok = (*d->get_decompression_result)(d, &ubuf, &usize, &status);
+	wimlib_assert(ok);
+	if (unlikely(status))
+		return status;
+	return feed_chunk_to_ranges(f, ubuf, usize);
+}
+
+/* Get a parallel chunk decompressor for the specified compression type and
+ * chunk size, reusing the one cached in @wim if possible.  Returns NULL if
+ * multi-threaded decompression isn't possible, in which case the caller should
+ * fall back to decompressing on the calling thread.  */
+static struct chunk_decompressor *
+get_parallel_decompressor(WIMStruct *wim, int ctype, u32 chunk_size,
+			  bool recover_data)
+{
+	struct chunk_decompressor *d = wim->parallel_decompressor;
+	int ret;
+
+	if (d && d->in_ctype == ctype && d->in_chunk_size == chunk_size) {
+		wim->parallel_decompressor = NULL;
+	} else {
+		ret = new_parallel_chunk_decompressor(ctype, chunk_size,
+						      wim->num_decompression_threads,
+						      0, &d);
+		if (ret) {
+			if (ret > 0) {
+				WARNING("Couldn't create parallel chunk decompressor: %"TS".\n"
+					"          Falling back to single-threaded decompression.",
+					wimlib_get_error_string(ret));
+			}
+			/* Don't keep retrying, unless the failure was only
+			 * due to the memory limit for this chunk size.  */
+			if (ret != -2)
+				wim->num_decompression_threads = 1;
+			return NULL;
+		}
+	}
+	d->recover_data = recover_data;
+	return d;
+}
+
+/* Return a parallel chunk decompressor to @wim's cache.  */
+static void
+put_parallel_decompressor(WIMStruct *wim, struct chunk_decompressor *d)
+{
+	if (wim->parallel_decompressor)
+		(*wim->parallel_decompressor->destroy)(wim->parallel_decompressor);
+	wim->parallel_decompressor = d;
+}
+
+/* Return the chunk cache of @wim, allocating it if needed; or NULL if the cache
+ * is disabled or can't be allocated.  */
+static struct chunk_cache *
+get_chunk_cache(WIMStruct *wim)
+{
+	if (!wim->chunk_cache && wim->max_chunk_cache_size != 0)
+		new_chunk_cache(&wim->chunk_cache);
+	return wim->chunk_cache;
+}
+
+/*
+ * Get the chunk table of a compressed, non-pipable resource, reading and parsing
+ * it first if needed.  The chunk table is returned as an array containing the
+ * offset, relative to the start of the resource in the WIM file, of each of the
+ * resource's @num_chunks chunks, followed by the size of the resource.
+ *
+ * The chunk tables of non-solid resources are kept in the WIM's chunk cache,
+ * and the array stays valid until the next item is inserted into the cache.
+ * The chunk table of a solid resource is instead kept with the resource
+ * descriptor for as long as it exists, since locating any chunk of a solid
+ * resource otherwise requires reading the chunk table from the beginning, and
+ * a WIM has few solid resources.  This way blobs in solid resources can be
+ * mapped to their chunks once, however the cache is used.
+ *
+ * Returns 0, a positive wimlib error code with errno set, or -1 if the chunk
+ * table is too large to cache or the chunk cache is disabled.
+ */
+static int
+get_cached_chunk_table(const struct wim_resource_descriptor *rdesc,
+		       u64 num_chunks, const u64 **chunk_offsets_ret)
+{
+	WIMStruct *wim = rdesc->wim;
+	const bool alt_chunk_table = (rdesc->flags & WIM_RESHDR_FLAG_SOLID);
+	const u64 num_chunk_entries = (alt_chunk_table ? num_chunks : num_chunks - 1);
+	const u64 chunk_entry_size = get_chunk_entry_size(rdesc->uncompressed_size,
+							  alt_chunk_table);
+	const u64 chunk_table_size = num_chunk_entries * chunk_entry_size;
+	const u64 chunk_table_offset =
+		(alt_chunk_table ? sizeof(struct alt_chunk_table_header_disk) : 0);
+	const u64 alloc_size = (num_chunks + 1) * sizeof(u64);
+	struct cached_chunk *chunk = NULL;
+	u64 *chunk_offsets;
+	u64 cur_offset;
+	int ret;
+
+	if (alt_chunk_table && rdesc->chunk_offsets) {
+		*chunk_offsets_ret = rdesc->chunk_offsets;
+		return 0;
+	}
+
+	if (!get_chunk_cache(wim))
+		return -1;
+
+	if (!alt_chunk_table) {
+		chunk = chunk_cache_lookup(wim->chunk_cache,
+					   rdesc->offset_in_wim,
+					   CHUNK_CACHE_CHUNK_TABLE_INDEX);
+		if (chunk) {
+			*chunk_offsets_ret = (const u64 *)chunk->data;
+			return 0;
+		}
+
+		/* Don't let one resource's chunk table take over the cache.  */
+		if (alloc_size > wim->max_chunk_cache_size / 2)
+			return -1;
+	} else if (unlikely((size_t)alloc_size != alloc_size)) {
+		return -1;
+	}
+
+	if (unlikely(chunk_table_offset + chunk_table_size > rdesc->size_in_wim))
+	{
+		ERROR("Invalid compressed resource: chunk table is too large");
+		errno = EINVAL;
+		return WIMLIB_ERR_DECOMPRESSION;
+	}
+
+	if (alt_chunk_table) {
+		chunk_offsets = MALLOC(alloc_size);
+	} else {
+		chunk = new_cached_chunk(rdesc->offset_in_wim,
+					 CHUNK_CACHE_CHUNK_TABLE_INDEX,
+					 alloc_size);
+		chunk_offsets = chunk ? (u64 *)chunk->data : NULL;
+	}
+	if (unlikely(!chunk_offsets)) {
+		errno = ENOMEM;
+		return WIMLIB_ERR_NOMEM;
+	}
+
+	/* Read the raw entries into the end of the array, then convert them
+	 * to offsets in place, as read_compressed_wim_resource() does.  */
+	typedef le64 __attribute__((may_alias)) aliased_le64_t;
+	typedef le32 __attribute__((may_alias)) aliased_le32_t;
+	void * const chunk_table_data =
+		(u8 *)chunk_offsets + alloc_size - chunk_table_size;
+
+	ret = full_pread(&wim->in_fd, chunk_table_data, chunk_table_size,
+			 rdesc->offset_in_wim + chunk_table_offset);
+	if (unlikely(ret)) {
+		ERROR_WITH_ERRNO("Error reading data from WIM file");
+		if (chunk)
+			FREE(chunk);
+		else
+			FREE(chunk_offsets);
+		return ret;
+	}
+
+	cur_offset = chunk_table_offset + chunk_table_size;
+	if (alt_chunk_table) {
+		aliased_le32_t *raw_entries = chunk_table_data;
+
+		for (u64 i = 0; i < num_chunks; i++) {
+			u32 entry = le32_to_cpu(raw_entries[i]);
+
+			chunk_offsets[i] = cur_offset;
+			cur_offset += entry;
+		}
+	} else {
+		chunk_offsets[0] = cur_offset;
+		for (u64 i = 1; i < num_chunks; i++) {
+			u64 entry;
+
+			if (chunk_entry_size == 4)
+				entry = le32_to_cpu(((aliased_le32_t *)chunk_table_data)[i - 1]);
+			else
+				entry = le64_to_cpu(((aliased_le64_t *)chunk_table_data)[i - 1]);
+			chunk_offsets[i] = cur_offset + entry;
+		}
+	}
+	chunk_offsets[num_chunks] = rdesc->size_in_wim;
+
+	if (alt_chunk_table) {
+		/* The chunk table is part of the state of the resource
+		 * descriptor that is filled in on demand, like a cache.  */
+		((struct wim_resource_descriptor *)rdesc)->chunk_offsets =
+			chunk_offsets;
+	} else {
+		chunk_cache_insert(wim->chunk_cache, chunk,
+				   wim->max_chunk_cache_size);
+	}
+	*chunk_offsets_ret = chunk_offsets;
+	return 0;
+}
+
 /*
  * Read data from a compressed WIM resource.
  *
@@ -130,6 +432,13 @@ decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
  *	If a chunk can't be fully decompressed due to being corrupted, continue
  *	with whatever data can be recovered rather than return an error.
  *
+ * If multiple chunks need to be read and the WIMStruct has multi-threaded
+ * decompression enabled (see wimlib_set_decompression_threads()), then the
+ * compressed chunks are read ahead and decompressed concurrently by a parallel
+ * chunk decompressor.  The reads are done by the worker threads too, except
+ * when reading from a pipe.  The callback is still invoked on the calling
+ * thread, with the data in order.
+ *
  * Possible return values:
  *
  *	WIMLIB_ERR_SUCCESS (0)
@@ -156,6 +465,11 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	bool ubuf_malloced = false;
 	bool cbuf_malloced = false;
 	struct wimlib_decompressor *decompressor = NULL;
+	struct chunk_decompressor *pdecompressor = NULL;
+	struct chunk_cache *cache = NULL;
+	struct shared_chunk_cache *shared = NULL;
+	struct cached_chunk *new_chunk = NULL;
+	struct range_feeder feeder;
 
 	/* Sanity checks  */
 	wimlib_assert(num_ranges != 0);
@@ -202,24 +516,6 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		goto out_cleanup;
 	}
 
-	/* Get valid decompressor.  */
-	if (likely(ctype == rdesc->wim->decompressor_ctype &&
-		   chunk_size == rdesc->wim->decompressor_max_block_size))
-	{
-		/* Cached decompressor.  */
-		decompressor = rdesc->wim->decompressor;
-		rdesc->wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
-		rdesc->wim->decompressor = NULL;
-	} else {
-		ret = wimlib_create_decompressor(ctype, chunk_size,
-						 &decompressor);
-		if (unlikely(ret)) {
-			if (ret != WIMLIB_ERR_NOMEM)
-				errno = EINVAL;
-			goto out_cleanup;
-		}
-	}
-
 	const u32 chunk_order = bsr32(chunk_size);
 
 	/* Calculate the total number of chunks the resource is divided into.  */
@@ -235,6 +531,35 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	 * must always start from the 0th chunk.  */
 	const u64 read_start_chunk = (is_pipe_read ? 0 : first_needed_chunk);
 
+	/* Get valid decompressor.  If more than one chunk needs to be read and
+	 * multi-threaded decompression is enabled for this WIM, use a parallel
+	 * chunk decompressor; otherwise decompress on the calling thread.  */
+	if (rdesc->wim->num_decompression_threads != 1 &&
+	    last_needed_chunk != read_start_chunk)
+		pdecompressor = get_parallel_decompressor(rdesc->wim, ctype,
+							  chunk_size,
+							  recover_data);
+
+	if (pdecompressor) {
+		/* Chunks are decompressed into the parallel chunk
+		 * decompressor's own buffers.  */
+	} else if (likely(ctype == rdesc->wim->decompressor_ctype &&
+			  chunk_size == rdesc->wim->decompressor_max_block_size))
+	{
+		/* Cached decompressor.  */
+		decompressor = rdesc->wim->decompressor;
+		rdesc->wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
+		rdesc->wim->decompressor = NULL;
+	} else {
+		ret = wimlib_create_decompressor(ctype, chunk_size,
+						 &decompressor);
+		if (unlikely(ret)) {
+			if (ret != WIMLIB_ERR_NOMEM)
+				errno = EINVAL;
+			goto out_cleanup;
+		}
+	}
+
 	/* Calculate the number of chunk offsets that are needed for the chunks
 	 * being read.  */
 	const u64 num_needed_chunk_offsets =
@@ -312,55 +637,75 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 			chunk_offsets_malloced = true;
 		}
 
-		const size_t chunk_table_size_to_read =
-			num_chunk_entries_to_read * chunk_entry_size;
-
-		const u64 file_offset_of_needed_chunk_entries =
-			cur_read_offset
-			+ (first_chunk_entry_to_read * chunk_entry_size)
-			+ (rdesc->is_pipable ? (rdesc->size_in_wim - chunk_table_size) : 0);
+		/* If the resource's chunk table has been parsed before and is
+		 * still cached, take the needed offsets from it.  Otherwise,
+		 * the chunk table is normally read in full and cached, so that
+		 * later reads of the same resource needn't read it again.  */
+		const u64 *cached_chunk_offsets;
+
+		ret = -1;
+		if (!rdesc->is_pipable)
+			ret = get_cached_chunk_table(rdesc, num_chunks,
+						     &cached_chunk_offsets);
+		if (unlikely(ret > 0))
+			goto out_cleanup;
+		if (ret == 0) {
+			for (u64 i = 0; i < num_needed_chunk_offsets; i++) {
+				chunk_offsets[i] =
+					cached_chunk_offsets[read_start_chunk + i] -
+					cached_chunk_offsets[0];
+			}
+		} else {
+			const size_t chunk_table_size_to_read =
+				num_chunk_entries_to_read * chunk_entry_size;
 
-		void * const chunk_table_data =
-			(u8*)chunk_offsets +
-			chunk_offsets_alloc_size -
-			chunk_table_size_to_read;
+			const u64 file_offset_of_needed_chunk_entries =
+				cur_read_offset
+				+ (first_chunk_entry_to_read * chunk_entry_size)
+				+ (rdesc->is_pipable ? (rdesc->size_in_wim - chunk_table_size) : 0);
 
-		ret = full_pread(in_fd, chunk_table_data, chunk_table_size_to_read,
-				 file_offset_of_needed_chunk_entries);
-		if (unlikely(ret))
-			goto read_error;
+			void * const chunk_table_data =
+				(u8*)chunk_offsets +
+				chunk_offsets_alloc_size -
+				chunk_table_size_to_read;
 
-		/* Now fill in chunk_offsets from the entries we have read in
-		 * chunk_tab_data.  We break aliasing rules here to avoid having
-		 * to allocate yet another array.  */
-		typedef le64 __attribute__((may_alias)) aliased_le64_t;
-		typedef le32 __attribute__((may_alias)) aliased_le32_t;
-		u64 * chunk_offsets_p = chunk_offsets;
+			ret = full_pread(in_fd, chunk_table_data, chunk_table_size_to_read,
+					 file_offset_of_needed_chunk_entries);
+			if (unlikely(ret))
+				goto read_error;
 
-		if (alt_chunk_table) {
-			u64 cur_offset = 0;
-			aliased_le32_t *raw_entries = chunk_table_data;
-
-			for (size_t i = 0; i < num_chunk_entries_to_read; i++) {
-				u32 entry = le32_to_cpu(raw_entries[i]);
-				if (i >= read_start_chunk)
-					*chunk_offsets_p++ = cur_offset;
-				cur_offset += entry;
-			}
-			if (last_needed_chunk < num_chunks - 1)
-				*chunk_offsets_p = cur_offset;
-		} else {
-			if (read_start_chunk == 0)
-				*chunk_offsets_p++ = 0;
+			/* Now fill in chunk_offsets from the entries we have
+			 * read in chunk_tab_data.  We break aliasing rules here
+			 * to avoid having to allocate yet another array.  */
+			typedef le64 __attribute__((may_alias)) aliased_le64_t;
+			typedef le32 __attribute__((may_alias)) aliased_le32_t;
+			u64 * chunk_offsets_p = chunk_offsets;
 
-			if (chunk_entry_size == 4) {
+			if (alt_chunk_table) {
+				u64 cur_offset = 0;
 				aliased_le32_t *raw_entries = chunk_table_data;
-				for (size_t i = 0; i < num_chunk_entries_to_read; i++)
-					*chunk_offsets_p++ = le32_to_cpu(raw_entries[i]);
+
+				for (size_t i = 0; i < num_chunk_entries_to_read; i++) {
+					u32 entry = le32_to_cpu(raw_entries[i]);
+					if (i >= read_start_chunk)
+						*chunk_offsets_p++ = cur_offset;
+					cur_offset += entry;
+				}
+				if (last_needed_chunk < num_chunks - 1)
+					*chunk_offsets_p = cur_offset;
 			} else {
-				aliased_le64_t *raw_entries = chunk_table_data;
-				for (size_t i = 0; i < num_chunk_entries_to_read; i++)
-					*chunk_offsets_p++ = le64_to_cpu(raw_entries[i]);
+				if (read_start_chunk == 0)
+					*chunk_offsets_p++ = 0;
+
+				if (chunk_entry_size == 4) {
+					aliased_le32_t *raw_entries = chunk_table_data;
+					for (size_t i = 0; i < num_chunk_entries_to_read; i++)
+						*chunk_offsets_p++ = le32_to_cpu(raw_entries[i]);
+				} else {
+					aliased_le64_t *raw_entries = chunk_table_data;
+					for (size_t i = 0; i < num_chunk_entries_to_read; i++)
+						*chunk_offsets_p++ = le64_to_cpu(raw_entries[i]);
+				}
 			}
 		}
 
@@ -372,37 +717,76 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 			cur_read_offset += chunk_table_size;
 	}
 
-	/* Allocate buffer for holding the uncompressed data of each chunk.  */
-	if (chunk_size <= STACK_MAX) {
+	/* Allocate buffer for holding the uncompressed data of each chunk.
+	 * This is not needed when decompressing in parallel, since the chunk
+	 * decompressor has its own buffers.  */
+	if (pdecompressor) {
+		/* No buffers needed.  */
+	} else if (chunk_size <= STACK_MAX) {
 		ubuf = alloca(chunk_size);
 	} else {
 		ubuf = MALLOC(chunk_size);
 		if (unlikely(!ubuf))
 			goto oom;
 		ubuf_malloced = true;
+		MEM_ALLOCATED(io_buffer, chunk_size);
 	}
 
 	/* Allocate a temporary buffer for reading compressed chunks, each of
 	 * which can be at most @chunk_size - 1 bytes.  This excludes compressed
 	 * chunks that are a full @chunk_size bytes, which are actually stored
 	 * uncompressed.  */
-	if (chunk_size - 1 <= STACK_MAX) {
+	if (pdecompressor) {
+		/* No buffers needed.  */
+	} else if (chunk_size - 1 <= STACK_MAX) {
 		cbuf = alloca(chunk_size - 1);
 	} else {
 		cbuf = MALLOC(chunk_size - 1);
 		if (unlikely(!cbuf))
 			goto oom;
 		cbuf_malloced = true;
+		MEM_ALLOCATED(io_buffer, chunk_size - 1);
 	}
 
-	/* Set current data range.  */
-	const struct data_range *cur_range = ranges;
+	/* Set current data range, i.e. the range into which the next chunk of
+	 * uncompressed data will be fed.  */
+	feeder.cur_range = ranges;
+	feeder.end_range = &ranges[num_ranges];
+	feeder.cur_range_pos = ranges[0].offset;
+	feeder.cur_range_end = ranges[0].offset + ranges[0].size;
+	feeder.chunk_order = chunk_order;
+	feeder.cb = cb;
+
+	/* Set the first range which may need data from the next chunk read.
+	 * When decompressing in parallel, this runs ahead of the current data
+	 * range.  */
+	const struct data_range *read_range = ranges;
 	const struct data_range * const end_range = &ranges[num_ranges];
-	u64 cur_range_pos = cur_range->offset;
-	u64 cur_range_end = cur_range->offset + cur_range->size;
+
+	/* The position after which the kernel is next asked to read in the
+	 * data ahead of time  */
+	const u64 read_ahead = rdesc->wim->read_ahead_size;
+	u64 prefetch_end = 0;
+
+	/* When decompressing on this thread, keep each chunk of which only part
+	 * is needed in the WIM's chunk cache.  Extracting some of the files of
+	 * a solid resource then decompresses each chunk at most once, even when
+	 * the files are extracted by separate reads.  Chunks already in the
+	 * cache don't need to be read at all.  Like chunk tables, chunks larger
+	 * than half the memory budget aren't cached, since caching them would
+	 * evict the chunk table that is needed to find them again.  */
+	if (!pdecompressor && !is_pipe_read && !rdesc->is_pipable &&
+	    !recover_data)
+	{
+		cache = get_chunk_cache(rdesc->wim);
+		shared = rdesc->wim->shared_chunk_cache;
+	}
 
 	/* Read and process each needed chunk.  */
 	for (u64 i = read_start_chunk; i <= last_needed_chunk; i++) {
+		const u8 *mapped_chunk;
+		const u8 *cached = NULL;
+		u8 *out_buf = ubuf;
 
 		/* Calculate uncompressed size of next chunk.  */
 		u32 chunk_usize;
@@ -447,7 +831,72 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		const u64 chunk_start_offset = i << chunk_order;
 		const u64 chunk_end_offset = chunk_start_offset + chunk_usize;
 
-		if (chunk_end_offset <= cur_range_pos) {
+		/* Skip past any ranges that end before this chunk.  */
+		while (read_range != end_range &&
+		       read_range->offset + read_range->size <= chunk_start_offset)
+			read_range++;
+
+		/* If a lot of data remains to be read, keep the kernel reading
+		 * ahead of it.  The compressed size of the remaining needed
+		 * chunks is at most their uncompressed size, which bounds the
+		 * read-ahead for reads of only part of the resource.  */
+		if (!is_pipe_read && read_ahead != 0 &&
+		    cur_read_offset >= prefetch_end &&
+		    ((last_needed_chunk - i) << chunk_order) > READ_AHEAD_SIZE / 2)
+		{
+			filedes_prefetch(in_fd, cur_read_offset,
+					 min(min(read_ahead,
+						 (last_needed_chunk + 1 - i) <<
+							chunk_order),
+					     rdesc->offset_in_wim +
+					     rdesc->size_in_wim -
+					     cur_read_offset));
+			prefetch_end = cur_read_offset + read_ahead / 2;
+		}
+
+		if (cache && read_range != end_range &&
+		    read_range->offset < chunk_end_offset)
+		{
+			struct cached_chunk *chunk;
+
+			chunk = chunk_cache_lookup(cache, rdesc->offset_in_wim, i);
+			if (chunk)
+				cached = chunk->data;
+			else if (chunk_csize != chunk_usize &&
+			    chunk_usize <= rdesc->wim->max_chunk_cache_size / 2 &&
+			    chunk_partly_needed(read_range, end_range,
+						chunk_start_offset,
+						chunk_end_offset))
+			{
+				new_chunk = new_cached_chunk(rdesc->offset_in_wim,
+							     i, chunk_usize);
+				if (new_chunk)
+					out_buf = new_chunk->data;
+			}
+		}
+
+		/* If all of this chunk goes into the consumer's buffer,
+		 * decompress or read it there rather than into @ubuf, which
+		 * saves copying it.  */
+		if (cb->dest && !pdecompressor && out_buf == ubuf &&
+		    feeder.cur_range_pos == chunk_start_offset &&
+		    chunk_end_offset <= feeder.cur_range_end)
+			out_buf = *cb->dest;
+
+		/* Another process sharing a chunk cache with this one may have
+		 * decompressed the chunk already.  */
+		if (shared && !cached && chunk_csize != chunk_usize &&
+		    read_range != end_range &&
+		    read_range->offset < chunk_end_offset &&
+		    shared_chunk_cache_lookup(shared, rdesc->offset_in_wim, i,
+					      out_buf, chunk_usize))
+		{
+			cached = out_buf;
+			cache_new_chunk(rdesc->wim, &new_chunk);
+		}
+
+		if (read_range == end_range ||
+		    read_range->offset >= chunk_end_offset) {
 
 			/* The next range does not require data in this chunk,
 			 * so skip it.  */
@@ -459,6 +908,94 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 				if (unlikely(ret))
 					goto read_error;
 			}
+		} else if (pdecompressor && !is_pipe_read) {
+
+			/* Submit the chunk to the parallel chunk decompressor,
+			 * which will also read it.  Letting the worker threads
+			 * do the reads keeps this thread free to feed data to
+			 * the callback function, which is what limits
+			 * throughput for large resources such as solid
+			 * resources.  If all the chunk decompressor's buffers
+			 * are in use, first feed the data of the oldest
+			 * submitted chunk to the callback function to free one
+			 * up.  */
+			while (!(*pdecompressor->submit_chunk_read)(pdecompressor,
+								    in_fd,
+								    cur_read_offset,
+								    chunk_csize,
+								    chunk_usize))
+			{
+				ret = feed_decompressed_chunk(pdecompressor,
+							      &feeder);
+				if (unlikely(ret))
+					goto out_cleanup;
+			}
+			cur_read_offset += chunk_csize;
+		} else if (pdecompressor) {
+
+			/* Read the chunk from the pipe and submit it to the
+			 * parallel chunk decompressor.  If all its buffers are
+			 * in use, first feed the data of the oldest submitted
+			 * chunk to the callback function to free one up.  */
+			void *read_buf;
+
+			while (!(read_buf = (*pdecompressor->get_chunk_buffer)(
+							pdecompressor)))
+			{
+				ret = feed_decompressed_chunk(pdecompressor,
+							      &feeder);
+				if (unlikely(ret))
+					goto out_cleanup;
+			}
+
+			ret = full_pread(in_fd,
+					 read_buf,
+					 chunk_csize,
+					 cur_read_offset);
+			if (unlikely(ret))
+				goto read_error;
+
+			(*pdecompressor->signal_chunk_filled)(pdecompressor,
+							      chunk_csize,
+							      chunk_usize);
+			cur_read_offset += chunk_csize;
+		} else if (cached) {
+
+			/* The chunk was decompressed by an earlier read.  */
+			cur_read_offset += chunk_csize;
+
+			ret = feed_chunk_to_ranges(&feeder, cached,
+						   chunk_usize);
+			if (unlikely(ret))
+				goto out_cleanup;
+		} else if ((mapped_chunk = filedes_mapped_range(in_fd,
+								cur_read_offset,
+								chunk_csize))) {
+
+			/* The WIM file is mapped into memory, so decompress
+			 * the chunk directly from the mapping, or if it is
+			 * stored uncompressed, feed it to the callback function
+			 * directly from the mapping.  */
+			if (chunk_csize != chunk_usize) {
+				ret = decompress_chunk(mapped_chunk, chunk_csize,
+						       out_buf, chunk_usize,
+						       decompressor,
+						       recover_data);
+				if (unlikely(ret))
+					goto out_cleanup;
+				mapped_chunk = out_buf;
+				shared_chunk_cache_insert(shared,
+							  rdesc->offset_in_wim,
+							  i, out_buf,
+							  chunk_usize);
+				cache_new_chunk(rdesc->wim, &new_chunk);
+			}
+			cur_read_offset += chunk_csize;
+
+			ret = feed_chunk_to_ranges(&feeder, mapped_chunk,
+						   chunk_usize);
+			if (unlikely(ret))
+				goto out_cleanup;
 		} else {
 
 			/* Read the chunk and feed data to the callback
@@ -466,7 +1003,7 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 			u8 *read_buf;
 
 			if (chunk_csize == chunk_usize)
-				read_buf = ubuf;
+				read_buf = out_buf;
 			else
 				read_buf = cbuf;
 
@@ -479,42 +1016,31 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 
 			if (read_buf == cbuf) {
 				ret = decompress_chunk(cbuf, chunk_csize,
-						       ubuf, chunk_usize,
+						       out_buf, chunk_usize,
 						       decompressor,
 						       recover_data);
 				if (unlikely(ret))
 					goto out_cleanup;
+				shared_chunk_cache_insert(shared,
+							  rdesc->offset_in_wim,
+							  i, out_buf,
+							  chunk_usize);
+				cache_new_chunk(rdesc->wim, &new_chunk);
 			}
 			cur_read_offset += chunk_csize;
 
-			/* At least one range requires data in this chunk.  */
-			do {
-				size_t start, end, size;
-
-				/* Calculate how many bytes of data should be
-				 * sent to the callback function, taking into
-				 * account that data sent to the callback
-				 * function must not overlap range boundaries.
-				 */
-				start = cur_range_pos - chunk_start_offset;
-				end = min(cur_range_end, chunk_end_offset) - chunk_start_offset;
-				size = end - start;
-
-				ret = consume_chunk(cb, &ubuf[start], size);
-				if (unlikely(ret))
-					goto out_cleanup;
+			ret = feed_chunk_to_ranges(&feeder, out_buf, chunk_usize);
+			if (unlikely(ret))
+				goto out_cleanup;
+		}
+	}
 
-				cur_range_pos += size;
-				if (cur_range_pos == cur_range_end) {
-					/* Advance to next range.  */
-					if (++cur_range == end_range) {
-						cur_range_pos = ~0ULL;
-					} else {
-						cur_range_pos = cur_range->offset;
-						cur_range_end = cur_range->offset + cur_range->size;
-					}
-				}
-			} while (cur_range_pos < chunk_end_offset);
+	/* Feed the data of any chunks still being decompressed.  */
+	if (pdecompressor) {
+		while (feeder.cur_range != feeder.end_range) {
+			ret = feed_decompressed_chunk(pdecompressor, &feeder);
+			if (unlikely(ret))
+				goto out_cleanup;
 		}
 	}
 
@@ -535,18 +1061,30 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	ret = 0;
 
 out_cleanup:
+	if (pdecompressor) {
+		/* On error, discard any chunks that are still being
+		 * decompressed so that the parallel chunk decompressor can be
+		 * reused.  */
+		chunk_decompressor_drain(pdecompressor);
+		put_parallel_decompressor(rdesc->wim, pdecompressor);
+	}
 	if (decompressor) {
 		wimlib_free_decompressor(rdesc->wim->decompressor);
 		rdesc->wim->decompressor = decompressor;
 		rdesc->wim->decompressor_ctype = ctype;
 		rdesc->wim->decompressor_max_block_size = chunk_size;
 	}
+	FREE(new_chunk);
 	if (chunk_offsets_malloced)
 		FREE(chunk_offsets);
-	if (ubuf_malloced)
+	if (ubuf_malloced) {
 		FREE(ubuf);
-	if (cbuf_malloced)
+		MEM_FREED(io_buffer, chunk_size);
+	}
+	if (cbuf_malloced) {
 		FREE(cbuf);
+		MEM_FREED(io_buffer, chunk_size - 1);
+	}
 	return ret;
 
 oom:
@@ -560,22 +1098,54 @@ read_error:
 }
 
 /* Read raw data from a file descriptor at the specified offset, feeding the
- * data in nonempty chunks into the specified callback function.  */
+ * data in nonempty chunks into the specified callback function.  If the file
+ * is mapped into memory, the chunks are passed directly from the mapping.
+ * @read_ahead is the read-ahead distance, or 0 to not request read-ahead.  */
 static int
 read_raw_file_data(struct filedes *in_fd, u64 offset, u64 size,
 		   const struct consume_chunk_callback *cb,
-		   const tchar *filename)
+		   const tchar *filename, u64 read_ahead)
 {
 	u8 buf[BUFFER_SIZE];
 	size_t bytes_to_read;
+	const u8 *mapped;
+	u64 prefetch_end = 0;
 	int ret;
 
+	mapped = filedes_mapped_range(in_fd, offset, size);
+	if (mapped) {
+		const u64 step = max(read_ahead / 2, (u64)BUFFER_SIZE);
+
+		while (size) {
+			bytes_to_read = min(step, size);
+			filedes_prefetch(in_fd, offset, min(read_ahead, size));
+			ret = consume_chunk(cb, mapped, bytes_to_read);
+			if (unlikely(ret))
+				return ret;
+			mapped += bytes_to_read;
+			size -= bytes_to_read;
+			offset += bytes_to_read;
+		}
+		return 0;
+	}
+
 	while (size) {
+		if (read_ahead != 0 && offset >= prefetch_end &&
+		    size > READ_AHEAD_SIZE / 2) {
+			filedes_prefetch(in_fd, offset, min(read_ahead, size));
+			prefetch_end = offset + read_ahead / 2;
+		}
+		u64 start = filename ? syscall_profile_begin() : 0;
+
+		/* Read straight into the consumer's buffer if it has one.  */
+		u8 *read_buf = cb->dest ? *cb->dest : buf;
+
 		bytes_to_read = min(sizeof(buf), size);
-		ret = full_pread(in_fd, buf, bytes_to_read, offset);
+		ret = full_pread(in_fd, read_buf, bytes_to_read, offset);
+		syscall_profile_end(WIMLIB_SYSCALL_READ, start);
 		if (unlikely(ret))
 			goto read_error;
-		ret = consume_chunk(cb, buf, bytes_to_read);
+		ret = consume_chunk(cb, read_buf, bytes_to_read);
 		if (unlikely(ret))
 			return ret;
 		size -= bytes_to_read;
@@ -596,13 +1166,17 @@ read_error:
 }
 
 /* A consume_chunk implementation which simply concatenates all chunks into an
- * in-memory buffer.  */
+ * in-memory buffer.  It is used with 'dest' set, so the data may already be in
+ * place.  */
 static int
 bufferer_cb(const void *chunk, size_t size, void *_ctx)
 {
 	void **buf_p = _ctx;
 
-	*buf_p = mempcpy(*buf_p, chunk, size);
+	if (chunk == *buf_p)
+		*buf_p = (u8 *)*buf_p + size;
+	else
+		*buf_p = mempcpy(*buf_p, chunk, size);
 	return 0;
 }
 
@@ -639,25 +1213,504 @@ read_partial_wim_resource(const struct wim_resource_descriptor *rdesc,
 	/* Uncompressed resource  */
 	return read_raw_file_data(&rdesc->wim->in_fd,
 				  rdesc->offset_in_wim + offset,
-				  size, cb, NULL);
+				  size, cb, NULL, rdesc->wim->read_ahead_size);
+}
+
+/*
+ * Read and decompress chunk @index of a compressed, non-pipable resource, and
+ * insert its uncompressed data into the WIM's chunk cache.  Returns 0, a
+ * positive wimlib error code with errno set, or -1 if the chunk table is too
+ * large to cache.
+ *
+ * If @lock is not NULL, it is held by the caller and protects the chunk cache.
+ * It is then released while the chunk is read and decompressed with @td, so
+ * that other threads can read other chunks at the same time; it is held again
+ * when this returns.  Otherwise the WIM's own decompressor is used.
+ */
+static int
+read_and_cache_chunk(const struct wim_resource_descriptor *rdesc,
+		     u64 num_chunks, u64 index, struct mutex *lock,
+		     struct thread_decompressor *td,
+		     struct cached_chunk **chunk_ret)
+{
+	WIMStruct *wim = rdesc->wim;
+	const int ctype = rdesc->compression_type;
+	const u32 chunk_size = rdesc->chunk_size;
+	struct wimlib_decompressor **decompressor_p = &wim->decompressor;
+	u8 *decompressor_ctype_p = &wim->decompressor_ctype;
+	u32 *decompressor_max_block_size_p = &wim->decompressor_max_block_size;
+	const u64 *chunk_offsets;
+	struct cached_chunk *chunk;
+	struct cached_chunk *other;
+	u64 chunk_offset;
+	u32 chunk_csize;
+	u32 chunk_usize;
+	void *cbuf;
+	bool cbuf_malloced = false;
+	int ret;
+
+	if (td) {
+		decompressor_p = &td->decompressor;
+		decompressor_ctype_p = &td->ctype;
+		decompressor_max_block_size_p = &td->max_block_size;
+	}
+
+	ret = get_cached_chunk_table(rdesc, num_chunks, &chunk_offsets);
+	if (ret)
+		return ret;
+
+	if (index == num_chunks - 1 &&
+	    (rdesc->uncompressed_size & (chunk_size - 1)))
+		chunk_usize = rdesc->uncompressed_size & (chunk_size - 1);
+	else
+		chunk_usize = chunk_size;
+
+	if (unlikely(chunk_offsets[index + 1] <= chunk_offsets[index] ||
+		     chunk_offsets[index + 1] - chunk_offsets[index] > chunk_usize))
+	{
+		ERROR("Invalid chunk size in compressed resource!");
+		errno = EINVAL;
+		return WIMLIB_ERR_DECOMPRESSION;
+	}
+	chunk_csize = chunk_offsets[index + 1] - chunk_offsets[index];
+	chunk_offset = rdesc->offset_in_wim + chunk_offsets[index];
+
+	if (lock)
+		mutex_unlock(lock);
+
+	if (chunk_csize != chunk_usize &&
+	    !(*decompressor_p && ctype == *decompressor_ctype_p &&
+	      chunk_size == *decompressor_max_block_size_p))
+	{
+		struct wimlib_decompressor *decompressor;
+
+		ret = wimlib_create_decompressor(ctype, chunk_size,
+						 &decompressor);
+		if (unlikely(ret)) {
+			errno = (ret == WIMLIB_ERR_NOMEM) ? ENOMEM : EINVAL;
+			goto out_lock;
+		}
+		wimlib_free_decompressor(*decompressor_p);
+		*decompressor_p = decompressor;
+		*decompressor_ctype_p = ctype;
+		*decompressor_max_block_size_p = chunk_size;
+	}
+
+	chunk = new_cached_chunk(rdesc->offset_in_wim, index, chunk_usize);
+	if (unlikely(!chunk))
+		goto oom;
+
+	/* Another process sharing a chunk cache with this one may have
+	 * decompressed the chunk already.  */
+	if (chunk_csize != chunk_usize &&
+	    shared_chunk_cache_lookup(wim->shared_chunk_cache,
+				      rdesc->offset_in_wim, index,
+				      chunk->data, chunk_usize))
+		goto cache_chunk;
+
+	if (chunk_csize == chunk_usize) {
+		cbuf = chunk->data;
+	} else if (chunk_csize <= STACK_MAX) {
+		cbuf = alloca(chunk_csize);
+	} else {
+		cbuf = MALLOC(chunk_csize);
+		if (unlikely(!cbuf)) {
+			FREE(chunk);
+			goto oom;
+		}
+		cbuf_malloced = true;
+	}
+
+	ret = full_pread(&wim->in_fd, cbuf, chunk_csize, chunk_offset);
+	if (unlikely(ret)) {
+		ERROR_WITH_ERRNO("Error reading data from WIM file");
+		goto out_error;
+	}
+
+	if (cbuf != chunk->data) {
+		ret = decompress_chunk(cbuf, chunk_csize, chunk->data,
+				       chunk_usize, *decompressor_p, false);
+		if (unlikely(ret))
+			goto out_error;
+		shared_chunk_cache_insert(wim->shared_chunk_cache,
+					  rdesc->offset_in_wim, index,
+					  chunk->data, chunk_usize);
+	}
+
+cache_chunk:
+	if (lock) {
+		mutex_lock(lock);
+		/* Another thread may have cached the chunk in the meantime.  */
+		other = chunk_cache_lookup(wim->chunk_cache,
+					   rdesc->offset_in_wim, index);
+		if (other) {
+			*chunk_ret = other;
+			goto out_free;
+		}
+	}
+	chunk_cache_insert(wim->chunk_cache, chunk, wim->max_chunk_cache_size);
+	*chunk_ret = chunk;
+	chunk = NULL;
+out_free:
+	FREE(chunk);
+	if (cbuf_malloced)
+		FREE(cbuf);
+	return ret;
+
+out_error:
+	if (lock)
+		mutex_lock(lock);
+	goto out_free;
+
+oom:
+	ERROR("Out of memory while reading compressed WIM resource");
+	errno = ENOMEM;
+	ret = WIMLIB_ERR_NOMEM;
+out_lock:
+	if (lock)
+		mutex_lock(lock);
+	return ret;
+}
+
+/*
+ * Read @size bytes at @offset in a compressed, non-pipable resource into @buf,
+ * using the WIM's chunk cache.  This makes small random-access reads, such as
+ * those made by a mounted WIM image, much faster than reading the resource with
+ * read_compressed_wim_resource(): each chunk is decompressed only once while it
+ * stays in the cache, rather than once per read; and the chunk table, which for
+ * a solid resource must otherwise be read from the beginning, is parsed only
+ * once.  Returns 0, a positive wimlib error code with errno set, or -1 if the
+ * cache can't be used for this resource.  @lock and @td are as for
+ * read_and_cache_chunk(), except that @lock isn't held by the caller.
+ */
+static int
+read_partial_wim_resource_cached(const struct wim_resource_descriptor *rdesc,
+				 u64 offset, size_t size, u8 *buf,
+				 struct mutex *lock,
+				 struct thread_decompressor *td)
+{
+	const u32 chunk_size = rdesc->chunk_size;
+	u32 chunk_order;
+	u64 num_chunks;
+	int ret = 0;
+
+	if (unlikely(!is_power_of_2(chunk_size)))
+		return -1;
+	chunk_order = bsr32(chunk_size);
+	num_chunks = (rdesc->uncompressed_size + chunk_size - 1) >> chunk_order;
+
+	if (lock)
+		mutex_lock(lock);
+
+	if (!get_chunk_cache(rdesc->wim)) {
+		ret = -1;
+		goto out;
+	}
+
+	for (u64 i = offset >> chunk_order; size != 0; i++) {
+		struct cached_chunk *chunk;
+		size_t start, n;
+
+		chunk = chunk_cache_lookup(rdesc->wim->chunk_cache,
+					   rdesc->offset_in_wim, i);
+		if (!chunk) {
+			ret = read_and_cache_chunk(rdesc, num_chunks, i,
+						   lock, td, &chunk);
+			if (ret)
+				goto out;
+		}
+		start = offset - (i << chunk_order);
+		n = min(size, chunk->size - start);
+		buf = mempcpy(buf, &chunk->data[start], n);
+		offset += n;
+		size -= n;
+	}
+out:
+	if (lock)
+		mutex_unlock(lock);
+	return ret;
 }
 
 /* Read the specified range of uncompressed data from the specified blob, which
- * must be located in a WIM file, into the specified buffer.  */
+ * must be located in a WIM file, into the specified buffer.  Data in
+ * compressed resources is read through the WIM's chunk cache, if enabled.  */
 int
 read_partial_wim_blob_into_buf(const struct blob_descriptor *blob,
 			       u64 offset, size_t size, void *buf)
 {
+	const struct wim_resource_descriptor *rdesc = blob->rdesc;
 	struct consume_chunk_callback cb = {
 		.func	= bufferer_cb,
 		.ctx	= &buf,
+		.dest	= &buf,
 	};
-	return read_partial_wim_resource(blob->rdesc,
+
+	if ((rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+			     WIM_RESHDR_FLAG_SOLID)) &&
+	    !rdesc->is_pipable && rdesc->wim->max_chunk_cache_size != 0 &&
+	    size != 0)
+	{
+		int ret = read_partial_wim_resource_cached(rdesc,
+							   blob->offset_in_res +
+								offset,
+							   size, buf,
+							   NULL, NULL);
+		if (ret >= 0)
+			return ret;
+	}
+
+	return read_partial_wim_resource(rdesc,
 					 blob->offset_in_res + offset,
 					 size,
 					 &cb, false);
 }
 
+/*
+ * Like read_partial_wim_blob_into_buf(), but may be called by several threads at
+ * the same time for blobs in the same WIM file, provided that everything else
+ * using the WIMStruct holds @lock.  @lock is held only while the WIM's chunk
+ * cache is accessed, so each thread reads and decompresses chunks on its own,
+ * with its own decompressor @td.  Reads that can't be made this way, such as
+ * reads of pipable resources, are made with @lock held throughout.
+ */
+int
+read_partial_wim_blob_into_buf_mt(const struct blob_descriptor *blob,
+				  u64 offset, size_t size, void *buf,
+				  struct mutex *lock,
+				  struct thread_decompressor *td)
+{
+	const struct wim_resource_descriptor *rdesc = blob->rdesc;
+	struct filedes *in_fd = &rdesc->wim->in_fd;
+	int ret;
+
+	if (!in_fd->is_pipe && !in_fd->reader && size != 0) {
+		if (!(rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+				      WIM_RESHDR_FLAG_SOLID)))
+		{
+			/* Uncompressed resource: pread() is thread-safe.  */
+			ret = full_pread(in_fd, buf, size,
+					 rdesc->offset_in_wim +
+						blob->offset_in_res + offset);
+			if (unlikely(ret))
+				ERROR_WITH_ERRNO("Error reading data from WIM file");
+			return ret;
+		}
+		if (!rdesc->is_pipable) {
+			ret = read_partial_wim_resource_cached(rdesc,
+							       blob->offset_in_res +
+									offset,
+							       size, buf,
+							       lock, td);
+			if (ret >= 0)
+				return ret;
+		}
+	}
+
+	mutex_lock(lock);
+	ret = read_partial_wim_blob_into_buf(blob, offset, size, buf);
+	mutex_unlock(lock);
+	return ret;
+}
+
+/* Free the decompressor of a thread that called
+ * read_partial_wim_blob_into_buf_mt().  */
+void
+thread_decompressor_destroy(struct thread_decompressor *td)
+{
+	wimlib_free_decompressor(td->decompressor);
+	td->decompressor = NULL;
+}
+
+/* Number of consecutive sequential reads of a blob after which
+ * chunk_readahead_update() starts reading ahead  */
+#define CHUNK_READAHEAD_MIN_SEQUENTIAL_READS	2
+
+/* Maximum number of threads reading ahead for each blob  */
+#define CHUNK_READAHEAD_MAX_THREADS		4
+
+static void
+chunk_readahead_stop(struct chunk_readahead *ra)
+{
+	if (ra->decompressor)
+		chunk_decompressor_drain(ra->decompressor);
+	ra->next_submit = ra->next_result;
+}
+
+/* Submit the chunks following those already submitted for reading ahead, until
+ * the end of the blob or until the chunk decompressor has no more buffers.  */
+static void
+chunk_readahead_submit(const struct blob_descriptor *blob,
+		       struct chunk_readahead *ra, u64 last_chunk,
+		       u32 chunk_order)
+{
+	const struct wim_resource_descriptor *rdesc = blob->rdesc;
+	const u64 num_chunks = (rdesc->uncompressed_size +
+				rdesc->chunk_size - 1) >> chunk_order;
+	const u64 *chunk_offsets;
+
+	if (ra->next_submit > last_chunk)
+		return;
+	if (get_cached_chunk_table(rdesc, num_chunks, &chunk_offsets) != 0) {
+		ra->disabled = true;
+		return;
+	}
+	for (; ra->next_submit <= last_chunk; ra->next_submit++) {
+		const u64 i = ra->next_submit;
+		const u64 offset = rdesc->offset_in_wim + chunk_offsets[i];
+		const u64 csize = chunk_offsets[i + 1] - chunk_offsets[i];
+		u32 usize = rdesc->chunk_size;
+
+		if (i == num_chunks - 1 &&
+		    (rdesc->uncompressed_size & (rdesc->chunk_size - 1)))
+			usize = rdesc->uncompressed_size &
+				(rdesc->chunk_size - 1);
+		if (unlikely(chunk_offsets[i + 1] <= chunk_offsets[i] ||
+			     csize > usize))
+		{
+			/* Leave the error to be reported by the read itself. */
+			ra->disabled = true;
+			return;
+		}
+		if (!(*ra->decompressor->submit_chunk_read)(
+					ra->decompressor, &rdesc->wim->in_fd,
+					offset, csize, usize))
+			return;
+	}
+}
+
+/*
+ * Detect sequential reads of a blob through @ra, and when a read of a blob in a
+ * compressed resource follows enough others, have worker threads read and
+ * decompress the following chunks in the background.  The chunks that this
+ * read needs are moved into the WIM's chunk cache, so the read itself should be
+ * made right afterwards.  @lock is as for read_partial_wim_blob_into_buf_mt(),
+ * or NULL if the caller is the only user of the WIMStruct.  Any problem just
+ * disables reading ahead, leaving errors to be reported by the read.
+ */
+void
+chunk_readahead_update(const struct blob_descriptor *blob, u64 offset,
+		       size_t size, struct chunk_readahead *ra,
+		       struct mutex *lock)
+{
+	const struct wim_resource_descriptor *rdesc = blob->rdesc;
+	WIMStruct *wim = rdesc->wim;
+	const u32 chunk_size = rdesc->chunk_size;
+	u32 chunk_order;
+	u64 first_chunk, last_chunk, blob_last_chunk;
+
+	if (offset == ra->next_offset) {
+		if (ra->num_sequential < CHUNK_READAHEAD_MIN_SEQUENTIAL_READS)
+			ra->num_sequential++;
+	} else {
+		ra->num_sequential = 0;
+		chunk_readahead_stop(ra);
+	}
+	ra->next_offset = offset + size;
+
+	if (ra->num_sequential < CHUNK_READAHEAD_MIN_SEQUENTIAL_READS ||
+	    ra->disabled || size == 0)
+		return;
+
+	if (!(rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+			      WIM_RESHDR_FLAG_SOLID)) ||
+	    rdesc->is_pipable || wim->in_fd.is_pipe || wim->in_fd.reader ||
+	    chunk_size > wim->max_chunk_cache_size / 2 ||
+	    !is_power_of_2(chunk_size))
+	{
+		/* Chunks too large for the cache would just evict each other
+		 * and the chunk table.  */
+		ra->disabled = true;
+		return;
+	}
+	chunk_order = bsr32(chunk_size);
+	first_chunk = (blob->offset_in_res + offset) >> chunk_order;
+	last_chunk = (blob->offset_in_res + offset + size - 1) >> chunk_order;
+	blob_last_chunk = (blob->offset_in_res + blob->size - 1) >> chunk_order;
+
+	if (!ra->decompressor) {
+		if (new_parallel_chunk_decompressor(rdesc->compression_type,
+						    chunk_size,
+						    min(get_available_cpus(),
+							CHUNK_READAHEAD_MAX_THREADS),
+						    0, &ra->decompressor))
+		{
+			ra->decompressor = NULL;
+			ra->disabled = true;
+			return;
+		}
+	}
+
+	if (lock)
+		mutex_lock(lock);
+	if (!get_chunk_cache(wim)) {
+		ra->disabled = true;
+		goto out_unlock;
+	}
+
+	/* Start at the chunks of this read if nothing is outstanding.  */
+	if (ra->next_result == ra->next_submit)
+		ra->next_result = ra->next_submit = first_chunk;
+	chunk_readahead_submit(blob, ra, blob_last_chunk, chunk_order);
+
+	/* Wait for the chunks this read needs and cache them.  */
+	while (ra->next_result <= last_chunk &&
+	       ra->next_result < ra->next_submit)
+	{
+		const void *udata;
+		u32 usize;
+		int status;
+		struct cached_chunk *chunk;
+
+		if (lock)
+			mutex_unlock(lock);
+		(*ra->decompressor->get_decompression_result)(ra->decompressor,
+							       &udata, &usize,
+							       &status);
+		if (lock)
+			mutex_lock(lock);
+		if (status) {
+			ra->next_result++;
+			chunk_readahead_stop(ra);
+			ra->disabled = true;
+			goto out_unlock;
+		}
+		if (!chunk_cache_lookup(wim->chunk_cache, rdesc->offset_in_wim,
+					ra->next_result))
+		{
+			chunk = new_cached_chunk(rdesc->offset_in_wim,
+						 ra->next_result, usize);
+			if (chunk) {
+				memcpy(chunk->data, udata, usize);
+				chunk_cache_insert(wim->chunk_cache, chunk,
+						   wim->max_chunk_cache_size);
+			}
+			shared_chunk_cache_insert(wim->shared_chunk_cache,
+						  rdesc->offset_in_wim,
+						  ra->next_result, udata,
+						  usize);
+		}
+		ra->next_result++;
+	}
+
+	/* Keep the worker threads busy until the next read.  */
+	chunk_readahead_submit(blob, ra, blob_last_chunk, chunk_order);
+out_unlock:
+	if (lock)
+		mutex_unlock(lock);
+}
+
+/* Free the read-ahead state of a blob, waiting for any chunks still being
+ * read.  */
+void
+chunk_readahead_destroy(struct chunk_readahead *ra)
+{
+	if (ra->decompressor) {
+		chunk_decompressor_drain(ra->decompressor);
+		(*ra->decompressor->destroy)(ra->decompressor);
+		ra->decompressor = NULL;
+	}
+}
+
 static int
 noop_cb(const void *chunk, size_t size, void *_ctx)
 {
@@ -675,6 +1728,22 @@ skip_wim_resource(const struct wim_resource_descriptor *rdesc)
 					 rdesc->uncompressed_size, &cb, false);
 }
 
+/* Read the full uncompressed data of the specified WIM resource into the
+ * specified buffer, which must have space for rdesc->uncompressed_size bytes.
+ */
+int
+read_wim_resource_into_buf(const struct wim_resource_descriptor *rdesc,
+			   void *buf, bool recover_data)
+{
+	struct consume_chunk_callback cb = {
+		.func	= bufferer_cb,
+		.ctx	= &buf,
+		.dest	= &buf,
+	};
+	return read_partial_wim_resource(rdesc, 0, rdesc->uncompressed_size,
+					 &cb, recover_data);
+}
+
 static int
 read_wim_blob_prefix(const struct blob_descriptor *blob, u64 size,
 		     const struct consume_chunk_callback *cb, bool recover_data)
@@ -683,6 +1752,25 @@ read_wim_blob_prefix(const struct blob_descriptor *blob, u64 size,
 					 size, cb, recover_data);
 }
 
+static int
+read_wim_delta_blob_prefix(const struct blob_descriptor *blob, u64 size,
+			   const struct consume_chunk_callback *cb,
+			   bool recover_data)
+{
+	return read_delta_blob_range(blob, 0, size, cb, recover_data);
+}
+
+/* Open a file being captured for reading.  */
+static int
+open_file_on_disk(const tchar *path)
+{
+	u64 start = syscall_profile_begin();
+	int raw_fd = topen(path, O_BINARY | O_RDONLY);
+
+	syscall_profile_end(WIMLIB_SYSCALL_OPEN, start);
+	return raw_fd;
+}
+
 /* This function handles reading blob data that is located in an external file,
  * such as a file that has been added to the WIM image through execution of a
  * wimlib_add_command.
@@ -700,17 +1788,93 @@ read_file_on_disk_prefix(const struct blob_descriptor *blob, u64 size,
 	int raw_fd;
 	struct filedes fd;
 
-	raw_fd = topen(blob->file_on_disk, O_BINARY | O_RDONLY);
+	raw_fd = open_file_on_disk(blob->file_on_disk);
 	if (unlikely(raw_fd < 0)) {
 		ERROR_WITH_ERRNO("Can't open \"%"TS"\"", blob->file_on_disk);
 		return WIMLIB_ERR_OPEN;
 	}
 	filedes_init(&fd, raw_fd);
-	ret = read_raw_file_data(&fd, 0, size, cb, blob->file_on_disk);
+	ret = read_raw_file_data(&fd, blob->file_data_offset, size, cb,
+				 blob->file_on_disk, READ_AHEAD_SIZE);
+	filedes_close(&fd);
+	return ret;
+}
+
+/* Compute a SHA-1 message digest of only the first and last @sample_size bytes
+ * of a blob located in a file on disk, which must be at least twice that size.
+ * No error message is printed on failure, since the caller falls back to
+ * reading the whole blob, which will report the problem.  */
+int
+sha1_file_on_disk_ends(const struct blob_descriptor *blob, size_t sample_size,
+		       u8 hash[SHA1_HASH_SIZE])
+{
+	struct sha1_ctx sha_ctx;
+	struct filedes fd;
+	int raw_fd;
+	void *buf;
+	int ret;
+
+	wimlib_assert(blob->blob_location == BLOB_IN_FILE_ON_DISK);
+	wimlib_assert(blob->size >= 2 * (u64)sample_size);
+
+	buf = MALLOC(sample_size);
+	if (!buf)
+		return WIMLIB_ERR_NOMEM;
+
+	raw_fd = open_file_on_disk(blob->file_on_disk);
+	if (unlikely(raw_fd < 0)) {
+		ret = WIMLIB_ERR_OPEN;
+		goto out_free_buf;
+	}
+	filedes_init(&fd, raw_fd);
+
+	sha1_init(&sha_ctx);
+	ret = full_pread(&fd, buf, sample_size, blob->file_data_offset);
+	if (ret)
+		goto out_close;
+	sha1_update(&sha_ctx, buf, sample_size);
+	ret = full_pread(&fd, buf, sample_size,
+			 blob->file_data_offset + blob->size - sample_size);
+	if (ret)
+		goto out_close;
+	sha1_update(&sha_ctx, buf, sample_size);
+	sha1_final(&sha_ctx, hash);
+out_close:
 	filedes_close(&fd);
+out_free_buf:
+	FREE(buf);
 	return ret;
 }
 
+/* Copy the data of a blob located in a file on disk to the current position of
+ * @out_fd using filedes_copy_range(), so that it doesn't pass through user
+ * space.  Returns the number of bytes copied, which is less than the blob's
+ * size if the data couldn't be copied that way (in full).  No error message is
+ * printed, since the caller falls back to reading the blob normally.  */
+u64
+copy_file_on_disk_range(const struct blob_descriptor *blob,
+			struct filedes *out_fd)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	struct filedes fd;
+	int raw_fd;
+	u64 copied;
+
+	wimlib_assert(blob->blob_location == BLOB_IN_FILE_ON_DISK);
+
+	raw_fd = open_file_on_disk(blob->file_on_disk);
+	if (unlikely(raw_fd < 0))
+		return 0;
+	filedes_init(&fd, raw_fd);
+	copied = filedes_copy_range(&fd, blob->file_data_offset, out_fd,
+				    blob->size);
+	filedes_close(&fd);
+	return copied;
+#else
+	return 0;
+#endif
+}
+
 #ifdef WITH_FUSE
 static int
 read_staging_file_prefix(const struct blob_descriptor *blob, u64 size,
@@ -721,6 +1885,10 @@ read_staging_file_prefix(const struct blob_descriptor *blob, u64 size,
 	struct filedes fd;
 	int ret;
 
+	/* A mounted image fills in the blocks still in the WIM before it's
+	 * committed.  */
+	wimlib_assert(!blob->staging_cow);
+
 	raw_fd = openat(blob->staging_dir_fd, blob->staging_file_name,
 			O_RDONLY | O_NOFOLLOW);
 	if (unlikely(raw_fd < 0)) {
@@ -729,7 +1897,8 @@ read_staging_file_prefix(const struct blob_descriptor *blob, u64 size,
 		return WIMLIB_ERR_OPEN;
 	}
 	filedes_init(&fd, raw_fd);
-	ret = read_raw_file_data(&fd, 0, size, cb, blob->staging_file_name);
+	ret = read_raw_file_data(&fd, 0, size, cb, blob->staging_file_name,
+				 READ_AHEAD_SIZE);
 	filedes_close(&fd);
 	return ret;
 }
@@ -747,6 +1916,18 @@ read_buffer_prefix(const struct blob_descriptor *blob,
 	return consume_chunk(cb, blob->attached_buffer, size);
 }
 
+/* This function handles reading a metadata resource that is serialized from
+ * an image's dentry tree on the fly.  */
+static int
+read_dentry_tree_prefix(const struct blob_descriptor *blob,
+			u64 size, const struct consume_chunk_callback *cb,
+			bool recover_data)
+{
+	if (unlikely(!size))
+		return 0;
+	return serialize_metadata_resource(blob->dentry_tree_imd, size, cb);
+}
+
 typedef int (*read_blob_prefix_handler_t)(const struct blob_descriptor *blob,
 					  u64 size,
 					  const struct consume_chunk_callback *cb,
@@ -772,6 +1953,8 @@ read_blob_prefix(const struct blob_descriptor *blob, u64 size,
 		[BLOB_IN_WIM] = read_wim_blob_prefix,
 		[BLOB_IN_FILE_ON_DISK] = read_file_on_disk_prefix,
 		[BLOB_IN_ATTACHED_BUFFER] = read_buffer_prefix,
+		[BLOB_IN_DENTRY_TREE] = read_dentry_tree_prefix,
+		[BLOB_IN_WIM_DELTA] = read_wim_delta_blob_prefix,
 	#ifdef WITH_FUSE
 		[BLOB_IN_STAGING_FILE] = read_staging_file_prefix,
 	#endif
@@ -840,10 +2023,93 @@ read_blob_into_buf(const struct blob_descriptor *blob, void *buf)
 	struct consume_chunk_callback cb = {
 		.func	= bufferer_cb,
 		.ctx	= &buf,
+		.dest	= &buf,
 	};
 	return read_blob_prefix(blob, blob->size, &cb, false);
 }
 
+/* Read the first @size bytes of the uncompressed data of the specified blob
+ * into the specified buffer.  The SHA-1 message digest is *not* checked.  */
+int
+read_blob_prefix_into_buf(const struct blob_descriptor *blob, u64 size,
+			  void *buf)
+{
+	struct consume_chunk_callback cb = {
+		.func	= bufferer_cb,
+		.ctx	= &buf,
+		.dest	= &buf,
+	};
+	return read_blob_prefix(blob, size, &cb, false);
+}
+
+/* Return true iff read_partial_blob_into_buf() can be used on the blob.  */
+bool
+can_read_partial_blob(const struct blob_descriptor *blob)
+{
+	return blob->blob_location == BLOB_IN_WIM ||
+	       blob->blob_location == BLOB_IN_WIM_DELTA ||
+	       blob->blob_location == BLOB_IN_FILE_ON_DISK ||
+	       blob->blob_location == BLOB_IN_ATTACHED_BUFFER;
+}
+
+/*
+ * Read the specified range of the uncompressed data of the specified blob into
+ * the specified buffer, without reading the data before it.  The SHA-1 message
+ * digest is *not* checked.  This is supported only for the blob locations for
+ * which can_read_partial_blob() returns true; for others, WIMLIB_ERR_UNSUPPORTED
+ * is returned and the caller must read the whole blob instead.
+ */
+int
+read_partial_blob_into_buf(const struct blob_descriptor *blob, u64 offset,
+			   size_t size, void *buf)
+{
+	struct filedes fd;
+	int raw_fd;
+	int ret;
+
+	wimlib_assert(offset <= blob->size && size <= blob->size - offset);
+
+	switch (blob->blob_location) {
+	case BLOB_IN_WIM:
+		return read_partial_wim_blob_into_buf(blob, offset, size, buf);
+	case BLOB_IN_WIM_DELTA: {
+		struct consume_chunk_callback cb = {
+			.func	= bufferer_cb,
+			.ctx	= &buf,
+			.dest	= &buf,
+		};
+		return read_delta_blob_range(blob, offset, size, &cb, false);
+	}
+	case BLOB_IN_ATTACHED_BUFFER:
+		memcpy(buf, (const u8 *)blob->attached_buffer + offset, size);
+		return 0;
+	case BLOB_IN_FILE_ON_DISK:
+		raw_fd = open_file_on_disk(blob->file_on_disk);
+		if (unlikely(raw_fd < 0)) {
+			ERROR_WITH_ERRNO("Can't open \"%"TS"\"",
+					 blob->file_on_disk);
+			return WIMLIB_ERR_OPEN;
+		}
+		filedes_init(&fd, raw_fd);
+		ret = full_pread(&fd, buf, size,
+				 blob->file_data_offset + offset);
+		if (unlikely(ret)) {
+			if (ret == WIMLIB_ERR_UNEXPECTED_END_OF_FILE) {
+				ERROR("\"%"TS"\": File was concurrently "
+				      "truncated", blob->file_on_disk);
+				ret = WIMLIB_ERR_CONCURRENT_MODIFICATION_DETECTED;
+			} else {
+				ERROR_WITH_ERRNO("\"%"TS"\": Error reading data",
+						 blob->file_on_disk);
+			}
+		}
+		filedes_close(&fd);
+		return ret;
+	default:
+		return WIMLIB_ERR_UNSUPPORTED;
+	}
+}
+
 /* Retrieve the full uncompressed data of the specified blob.  A buffer large
  * enough hold the data is allocated and returned in @buf_ret.  The SHA-1
  * message digest is *not* checked.  */
@@ -975,10 +2241,191 @@ blobifier_cb(const void *chunk, size_t size, void *_ctx)
 	return 0;
 }
 
+/*
+ * An async_hasher computes SHA-1 message digests on a separate thread, so that
+ * hashing a blob overlaps with reading it and with whatever the caller does
+ * with the data, such as compressing and writing it.  The data is copied into
+ * a ring buffer, from which the hasher thread consumes it.  Still, only one
+ * blob is hashed at a time: finishing a blob waits for its digest.
+ */
+#define ASYNC_HASHER_BUFSIZE	(1 << 22)
+
+/* Smaller blobs are hashed by the calling thread, since for them the cost of
+ * waiting for the hasher thread would outweigh the benefit.  */
+#define ASYNC_HASHER_MIN_BLOB_SIZE	(1 << 20)
+
+struct async_hasher {
+	struct thread thread;
+	struct mutex lock;
+	struct condvar data_avail_cond;
+	struct condvar space_avail_cond;
+	u8 *buf;
+	u64 write_pos;
+	u64 read_pos;
+	bool finishing;
+	bool terminating;
+	struct sha1_ctx sha_ctx;
+	u8 hash[SHA1_HASH_SIZE];
+};
+
+static void *
+async_hasher_thread_proc(void *arg)
+{
+	struct async_hasher *h = arg;
+
+	mutex_lock(&h->lock);
+	for (;;) {
+		size_t n;
+
+		while (h->read_pos == h->write_pos && !h->finishing &&
+		       !h->terminating)
+			condvar_wait(&h->data_avail_cond, &h->lock);
+
+		if (h->read_pos != h->write_pos) {
+			/* Hash the longest contiguous run of pending data.  The
+			 * producer never writes to this part of the buffer
+			 * until read_pos has been advanced past it.  */
+			n = min(h->write_pos - h->read_pos,
+				ASYNC_HASHER_BUFSIZE -
+					(h->read_pos % ASYNC_HASHER_BUFSIZE));
+			mutex_unlock(&h->lock);
+			sha1_update(&h->sha_ctx,
+				    &h->buf[h->read_pos % ASYNC_HASHER_BUFSIZE], n);
+			mutex_lock(&h->lock);
+			h->read_pos += n;
+			condvar_signal(&h->space_avail_cond);
+		} else if (h->finishing) {
+			sha1_final(&h->sha_ctx, h->hash);
+			h->finishing = false;
+			condvar_signal(&h->space_avail_cond);
+		} else {
+			break;
+		}
+	}
+	mutex_unlock(&h->lock);
+	return NULL;
+}
+
+/* Start a thread for hashing blobs.  Returns NULL if this is not possible, in
+ * which case the caller should just hash the blobs itself.  */
+static struct async_hasher *
+async_hasher_create(void)
+{
+	struct async_hasher *h;
+
+	h = CALLOC(1, sizeof(*h));
+	if (!h)
+		return NULL;
+	h->buf = MALLOC(ASYNC_HASHER_BUFSIZE);
+	if (!h->buf)
+		goto err_free_hasher;
+	MEM_ALLOCATED(io_buffer, ASYNC_HASHER_BUFSIZE);
+	if (!mutex_init(&h->lock))
+		goto err_free_buf;
+	if (!condvar_init(&h->data_avail_cond))
+		goto err_destroy_lock;
+	if (!condvar_init(&h->space_avail_cond))
+		goto err_destroy_data_avail_cond;
+	if (!thread_create(&h->thread, async_hasher_thread_proc, h))
+		goto err_destroy_space_avail_cond;
+	return h;
+
+err_destroy_space_avail_cond:
+	condvar_destroy(&h->space_avail_cond);
+err_destroy_data_avail_cond:
+	condvar_destroy(&h->data_avail_cond);
+err_destroy_lock:
+	mutex_destroy(&h->lock);
+err_free_buf:
+	FREE(h->buf);
+	MEM_FREED(io_buffer, ASYNC_HASHER_BUFSIZE);
+err_free_hasher:
+	FREE(h);
+	return NULL;
+}
+
+static void
+async_hasher_destroy(struct async_hasher *h)
+{
+	if (!h)
+		return;
+	mutex_lock(&h->lock);
+	h->terminating = true;
+	condvar_signal(&h->data_avail_cond);
+	mutex_unlock(&h->lock);
+	thread_join(&h->thread);
+	condvar_destroy(&h->space_avail_cond);
+	condvar_destroy(&h->data_avail_cond);
+	mutex_destroy(&h->lock);
+	FREE(h->buf);
+	MEM_FREED(io_buffer, ASYNC_HASHER_BUFSIZE);
+	FREE(h);
+}
+
+/* Begin hashing a new blob.  The previous blob, if any, must have been
+ * finished with async_hasher_final().  */
+static void
+async_hasher_init(struct async_hasher *h)
+{
+	mutex_lock(&h->lock);
+	sha1_init(&h->sha_ctx);
+	mutex_unlock(&h->lock);
+}
+
+/* Queue data of the current blob to be hashed.  This only waits if the ring
+ * buffer is full.  */
+static void
+async_hasher_update(struct async_hasher *h, const void *data, size_t len)
+{
+	const u8 *p = data;
+
+	while (len) {
+		size_t n;
+
+		mutex_lock(&h->lock);
+		while (h->write_pos - h->read_pos == ASYNC_HASHER_BUFSIZE)
+			condvar_wait(&h->space_avail_cond, &h->lock);
+		n = min(len, min(ASYNC_HASHER_BUFSIZE -
+					(h->write_pos - h->read_pos),
+				 ASYNC_HASHER_BUFSIZE -
+					(h->write_pos % ASYNC_HASHER_BUFSIZE)));
+		mutex_unlock(&h->lock);
+
+		memcpy(&h->buf[h->write_pos % ASYNC_HASHER_BUFSIZE], p, n);
+
+		mutex_lock(&h->lock);
+		h->write_pos += n;
+		condvar_signal(&h->data_avail_cond);
+		mutex_unlock(&h->lock);
+
+		p += n;
+		len -= n;
+	}
+}
+
+/* Wait for the current blob to be fully hashed and return its digest.  */
+static void
+async_hasher_final(struct async_hasher *h, u8 hash[SHA1_HASH_SIZE])
+{
+	mutex_lock(&h->lock);
+	h->finishing = true;
+	condvar_signal(&h->data_avail_cond);
+	while (h->finishing)
+		condvar_wait(&h->space_avail_cond, &h->lock);
+	copy_hash(hash, h->hash);
+	mutex_unlock(&h->lock);
+}
+
 struct hasher_context {
 	struct sha1_ctx sha_ctx;
 	int flags;
 	struct read_blob_callbacks cbs;
+
+	/* If not NULL, then large blobs are hashed on a separate thread.  */
+	struct async_hasher *async_hasher;
+
+	/* Whether the current blob is being hashed by @async_hasher  */
+	bool cur_blob_async;
 };
 
 /* Callback for starting to read a blob while calculating its SHA-1 message
@@ -988,7 +2435,12 @@ hasher_begin_blob(struct blob_descriptor *blob, void *_ctx)
 {
 	struct hasher_context *ctx = _ctx;
 
-	sha1_init(&ctx->sha_ctx);
+	ctx->cur_blob_async = (ctx->async_hasher != NULL &&
+			       blob->size >= ASYNC_HASHER_MIN_BLOB_SIZE);
+	if (ctx->cur_blob_async)
+		async_hasher_init(ctx->async_hasher);
+	else
+		sha1_init(&ctx->sha_ctx);
 	blob->corrupted = 0;
 
 	return call_begin_blob(blob, &ctx->cbs);
@@ -1006,7 +2458,10 @@ hasher_continue_blob(const struct blob_descriptor *blob, u64 offset,
 {
 	struct hasher_context *ctx = _ctx;
 
-	sha1_update(&ctx->sha_ctx, chunk, size);
+	if (ctx->cur_blob_async)
+		async_hasher_update(ctx->async_hasher, chunk, size);
+	else
+		sha1_update(&ctx->sha_ctx, chunk, size);
 
 	return call_continue_blob(blob, offset, chunk, size, &ctx->cbs);
 }
@@ -1020,6 +2475,7 @@ report_sha1_mismatch(struct blob_descriptor *blob,
 
 	wimlib_assert(blob->blob_location != BLOB_NONEXISTENT);
 	wimlib_assert(blob->blob_location != BLOB_IN_ATTACHED_BUFFER);
+	wimlib_assert(blob->blob_location != BLOB_IN_DENTRY_TREE);
 
 	sprint_hash(blob->hash, expected_hashstr);
 	sprint_hash(actual_hash, actual_hashstr);
@@ -1083,13 +2539,20 @@ hasher_end_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	int ret;
 
 	if (unlikely(status)) {
-		/* Error occurred; the full blob may not have been read.  */
+		/* Error occurred; the full blob may not have been read.  The
+		 * hasher thread must still be waited for, so that it is idle
+		 * before the next blob begins.  */
+		if (ctx->cur_blob_async)
+			async_hasher_final(ctx->async_hasher, hash);
 		ret = status;
 		goto out_next_cb;
 	}
 
 	/* Retrieve the final SHA-1 message digest.  */
-	sha1_final(&ctx->sha_ctx, hash);
+	if (ctx->cur_blob_async)
+		async_hasher_final(ctx->async_hasher, hash);
+	else
+		sha1_final(&ctx->sha_ctx, hash);
 
 	/* Set the SHA-1 message digest of the blob, or compare the calculated
 	 * value with stored value.  */
@@ -1201,6 +2664,278 @@ oom:
 	return WIMLIB_ERR_NOMEM;
 }
 
+#if !defined(_WIN32) && defined(HAVE_POSIX_FADVISE)
+/*
+ * When many small files on disk are read one after another, e.g. when writing
+ * the data of a capture, the reader would otherwise wait for the disk once per
+ * file.  Instead, threads open the upcoming files ahead of the reader and ask
+ * the kernel to start reading them in, then close them again.  Only the page
+ * cache is shared with the reader, so the reader still opens and reads each
+ * file itself, as without read-ahead, and errors are reported by the reader.
+ */
+#define FILE_READ_AHEAD_THREADS		4
+
+/* Maximum number of upcoming blobs considered for file read-ahead; this is
+ * also the capacity of the queue of files to open  */
+#define FILE_READ_AHEAD_FILES		64
+
+struct file_read_ahead {
+	struct mutex lock;
+	struct condvar avail_cond;
+
+	/* Queue of files to open, as a ring buffer  */
+	struct {
+		tchar *path;
+		u64 offset;
+		u64 size;
+	} queue[FILE_READ_AHEAD_FILES];
+	size_t queue_head;
+	size_t queue_len;
+
+	bool terminating;
+	unsigned num_threads;
+	struct thread threads[FILE_READ_AHEAD_THREADS];
+};
+
+static void *
+file_read_ahead_thread_proc(void *arg)
+{
+	struct file_read_ahead *fra = arg;
+
+	mutex_lock(&fra->lock);
+	for (;;) {
+		tchar *path;
+		u64 offset;
+		u64 size;
+		int raw_fd;
+
+		while (!fra->terminating && fra->queue_len == 0)
+			condvar_wait(&fra->avail_cond, &fra->lock);
+		if (fra->terminating)
+			break;
+		path = fra->queue[fra->queue_head].path;
+		offset = fra->queue[fra->queue_head].offset;
+		size = fra->queue[fra->queue_head].size;
+		fra->queue_head = (fra->queue_head + 1) % FILE_READ_AHEAD_FILES;
+		fra->queue_len--;
+		mutex_unlock(&fra->lock);
+
+		raw_fd = open_file_on_disk(path);
+		if (raw_fd >= 0) {
+			struct filedes fd;
+
+			filedes_init(&fd, raw_fd);
+			filedes_prefetch(&fd, offset,
+					 min(size, READ_AHEAD_SIZE));
+			filedes_close(&fd);
+		}
+		FREE(path);
+
+		mutex_lock(&fra->lock);
+	}
+	mutex_unlock(&fra->lock);
+	return NULL;
+}
+
+/* Start the file read-ahead threads.  Returns NULL if this is not possible, in
+ * which case the files are just read without read-ahead.  */
+static struct file_read_ahead *
+file_read_ahead_create(void)
+{
+	struct file_read_ahead *fra;
+
+	fra = CALLOC(1, sizeof(*fra));
+	if (!fra)
+		return NULL;
+	if (!mutex_init(&fra->lock))
+		goto err_free;
+	if (!condvar_init(&fra->avail_cond))
+		goto err_destroy_lock;
+	while (fra->num_threads < FILE_READ_AHEAD_THREADS &&
+	       thread_create(&fra->threads[fra->num_threads],
+			     file_read_ahead_thread_proc, fra))
+		fra->num_threads++;
+	if (fra->num_threads)
+		return fra;
+
+	condvar_destroy(&fra->avail_cond);
+err_destroy_lock:
+	mutex_destroy(&fra->lock);
+err_free:
+	FREE(fra);
+	return NULL;
+}
+
+static void
+file_read_ahead_destroy(struct file_read_ahead *fra)
+{
+	if (!fra)
+		return;
+	mutex_lock(&fra->lock);
+	fra->terminating = true;
+	condvar_broadcast(&fra->avail_cond);
+	mutex_unlock(&fra->lock);
+	for (unsigned i = 0; i < fra->num_threads; i++)
+		thread_join(&fra->threads[i]);
+	for (; fra->queue_len; fra->queue_len--) {
+		FREE(fra->queue[fra->queue_head].path);
+		fra->queue_head = (fra->queue_head + 1) % FILE_READ_AHEAD_FILES;
+	}
+	condvar_destroy(&fra->avail_cond);
+	mutex_destroy(&fra->lock);
+	FREE(fra);
+}
+
+/* Queue the file of a blob to be read ahead.  If the threads are too far
+ * behind, the file is just not read ahead.  */
+static void
+file_read_ahead_submit(struct file_read_ahead *fra,
+		       const struct blob_descriptor *blob)
+{
+	tchar *path;
+
+	path = TSTRDUP(blob->file_on_disk);
+	if (!path)
+		return;
+	mutex_lock(&fra->lock);
+	if (fra->queue_len < FILE_READ_AHEAD_FILES) {
+		size_t i = (fra->queue_head + fra->queue_len++) %
+			   FILE_READ_AHEAD_FILES;
+
+		fra->queue[i].path = path;
+		fra->queue[i].offset = blob->file_data_offset;
+		fra->queue[i].size = blob->size;
+		path = NULL;
+		condvar_signal(&fra->avail_cond);
+	}
+	mutex_unlock(&fra->lock);
+	FREE(path);
+}
+#endif /* !_WIN32 && HAVE_POSIX_FADVISE */
+
+/*
+ * State for asking the kernel to read in the data of upcoming blobs while
+ * read_blob_list() reads earlier ones, so that several reads are in flight at
+ * once rather than each blob's data being read only when it is reached.
+ */
+struct blob_read_ahead {
+	/* The first blob in the list for which read-ahead hasn't been
+	 * considered yet  */
+	struct list_head *pos;
+
+	/* The number of blobs from the one being read up to @pos  */
+	size_t num_ahead;
+
+	/* The resource for which read-ahead was last requested  */
+	const struct wim_resource_descriptor *rdesc;
+
+#if !defined(_WIN32) && defined(HAVE_POSIX_FADVISE)
+	/* Like @pos and @num_ahead, but for read-ahead of files on disk  */
+	struct list_head *file_pos;
+	size_t files_ahead;
+
+	/* The file read-ahead threads, started once the first file on disk
+	 * is reached; or NULL  */
+	struct file_read_ahead *fra;
+	bool fra_failed;
+#endif
+};
+
+#if !defined(_WIN32) && defined(HAVE_POSIX_FADVISE)
+/* Called by blob_read_ahead(): queue the files on disk among the next
+ * FILE_READ_AHEAD_FILES blobs to be read ahead.  */
+static void
+file_read_ahead(struct blob_read_ahead *ra, size_t count,
+		struct list_head *next, const struct list_head *blob_list,
+		size_t list_head_offset)
+{
+	if (ra->files_ahead > count) {
+		ra->files_ahead -= count;
+	} else {
+		ra->file_pos = next;
+		ra->files_ahead = 0;
+	}
+
+	for (; ra->file_pos != blob_list &&
+	       ra->files_ahead < FILE_READ_AHEAD_FILES;
+	     ra->file_pos = ra->file_pos->next, ra->files_ahead++)
+	{
+		const struct blob_descriptor *ahead =
+			(const struct blob_descriptor *)((const u8 *)ra->file_pos -
+							 list_head_offset);
+
+		if (ahead->blob_location != BLOB_IN_FILE_ON_DISK)
+			continue;
+		if (!ra->fra) {
+			if (ra->fra_failed)
+				return;
+			ra->fra = file_read_ahead_create();
+			if (!ra->fra) {
+				ra->fra_failed = true;
+				return;
+			}
+		}
+		file_read_ahead_submit(ra->fra, ahead);
+	}
+}
+#endif /* !_WIN32 && HAVE_POSIX_FADVISE */
+
+/*
+ * Called by read_blob_list() before reading @count blobs starting at @blob,
+ * where @next is the blob following them.  If @blob is located in a WIM file,
+ * request read-ahead of the resources of the following blobs in the same WIM
+ * file that start less than the WIM's read-ahead distance after @blob's
+ * resource.
+ * Since the blob list is sorted in the order the data is laid out, this keeps
+ * several megabytes of reads in flight even when there are many small blobs.
+ * Reads from further ahead in large resources are then requested by
+ * read_compressed_wim_resource() and read_raw_file_data() themselves.
+ */
+static void
+blob_read_ahead(struct blob_read_ahead *ra, const struct blob_descriptor *blob,
+		size_t count, struct list_head *next,
+		const struct list_head *blob_list, size_t list_head_offset)
+{
+	const struct wim_resource_descriptor *rdesc;
+	u64 limit;
+
+#if !defined(_WIN32) && defined(HAVE_POSIX_FADVISE)
+	file_read_ahead(ra, count, next, blob_list, list_head_offset);
+#endif
+
+	if (ra->num_ahead > count) {
+		ra->num_ahead -= count;
+	} else {
+		ra->pos = next;
+		ra->num_ahead = 0;
+	}
+
+	if (blob->blob_location != BLOB_IN_WIM ||
+	    blob->rdesc->wim->read_ahead_size == 0)
+		return;
+	limit = blob->rdesc->offset_in_wim + blob->rdesc->wim->read_ahead_size;
+
+	for (; ra->pos != blob_list; ra->pos = ra->pos->next, ra->num_ahead++) {
+		const struct blob_descriptor *ahead =
+			(const struct blob_descriptor *)((const u8 *)ra->pos -
+							 list_head_offset);
+
+		if (ahead->blob_location != BLOB_IN_WIM)
+			continue;
+		rdesc = ahead->rdesc;
+		if (rdesc->wim != blob->rdesc->wim ||
+		    rdesc->offset_in_wim >= limit)
+			break;
+		if (rdesc != ra->rdesc && rdesc != blob->rdesc) {
+			filedes_prefetch(&rdesc->wim->in_fd,
+					 rdesc->offset_in_wim,
+					 min(rdesc->size_in_wim,
+					     limit - rdesc->offset_in_wim));
+			ra->rdesc = rdesc;
+		}
+	}
+}
+
 /*
  * Read a list of blobs, each of which may be in any supported location (e.g.
  * in a WIM or in an external file).  This function optimizes the case where
@@ -1236,6 +2971,11 @@ oom:
  *	RECOVER_DATA
  *		Don't consider corrupted blob data to be an error.
  *
+ *	HASH_BLOBS_ASYNC
+ *		Calculate the SHA-1 message digests of large blobs on a separate
+ *		thread, overlapping with the callbacks.  This only helps if the
+ *		callbacks are expensive and another processor is available.
+ *
  * The callback functions are allowed to delete the current blob from the list
  * if necessary.
  *
@@ -1252,6 +2992,7 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 	struct blob_descriptor *blob;
 	struct hasher_context *hasher_ctx;
 	struct read_blob_callbacks *sink_cbs;
+	struct blob_read_ahead ra;
 
 	if (!(flags & BLOB_LIST_ALREADY_SORTED)) {
 		ret = sort_blob_list_by_sequential_order(blob_list,
@@ -1260,12 +3001,15 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 			return ret;
 	}
 
+	hasher_ctx = NULL;
 	if (flags & (VERIFY_BLOB_HASHES | COMPUTE_MISSING_BLOB_HASHES)) {
 		hasher_ctx = alloca(sizeof(*hasher_ctx));
 		*hasher_ctx = (struct hasher_context) {
 			.flags	= flags,
 			.cbs	= *cbs,
 		};
+		if (flags & HASH_BLOBS_ASYNC)
+			hasher_ctx->async_hasher = async_hasher_create();
 		sink_cbs = alloca(sizeof(*sink_cbs));
 		*sink_cbs = (struct read_blob_callbacks) {
 			.begin_blob	= hasher_begin_blob,
@@ -1277,6 +3021,12 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 		sink_cbs = (struct read_blob_callbacks *)cbs;
 	}
 
+	memset(&ra, 0, sizeof(ra));
+	ra.pos = blob_list->next;
+#if !defined(_WIN32) && defined(HAVE_POSIX_FADVISE)
+	ra.file_pos = blob_list->next;
+#endif
+
 	for (cur = blob_list->next, next = cur->next;
 	     cur != blob_list;
 	     cur = next, next = cur->next)
@@ -1318,22 +3068,32 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 				 * and @blob_last specifies the last blob in the
 				 * resource that needs to be read.  */
 				next = next2;
+				blob_read_ahead(&ra, blob, blob_count, next,
+						blob_list, list_head_offset);
 				ret = read_blobs_in_solid_resource(blob, blob_last,
 								   blob_count,
 								   list_head_offset,
 								   sink_cbs,
 								   flags & RECOVER_DATA);
 				if (ret)
-					return ret;
+					goto out;
 				continue;
 			}
 		}
 
+		blob_read_ahead(&ra, blob, 1, next, blob_list, list_head_offset);
 		ret = read_blob_with_cbs(blob, sink_cbs, flags & RECOVER_DATA);
 		if (unlikely(ret && ret != BEGIN_BLOB_STATUS_SKIP_BLOB))
-			return ret;
+			goto out;
 	}
-	return 0;
+	ret = 0;
+out:
+#if !defined(_WIN32) && defined(HAVE_POSIX_FADVISE)
+	file_read_ahead_destroy(ra.fra);
+#endif
+	if (hasher_ctx)
+		async_hasher_destroy(hasher_ctx->async_hasher);
+	return ret;
 }
 
 static int
@@ -1404,6 +3164,7 @@ wim_reshdr_to_desc(const struct wim_reshdr *reshdr, WIMStruct *wim,
 	INIT_LIST_HEAD(&rdesc->blob_list);
 	rdesc->flags = reshdr->flags;
 	rdesc->is_pipable = wim_is_pipable(wim);
+	rdesc->chunk_offsets = NULL;
 	if (rdesc->flags & WIM_RESHDR_FLAG_COMPRESSED) {
 		rdesc->compression_type = wim->compression_type;
 		rdesc->chunk_size = wim->chunk_size;
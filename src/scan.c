@@ -31,8 +31,14 @@
 #include "wimlib/paths.h"
 #include "wimlib/pattern.h"
 #include "wimlib/progress.h"
+#include "wimlib/resource.h"
 #include "wimlib/scan.h"
+#include "wimlib/sha1.h"
+#include "wimlib/spill.h"
 #include "wimlib/textfile.h"
+#include "wimlib/thread_pool.h"
+#include "wimlib/threads.h"
+#include "wimlib/wim.h"
 
 /*
  * Tally a file (or directory) that has been scanned for a capture operation,
@@ -242,12 +248,28 @@ read_capture_config(const tchar *config_file, const void *buf,
 	FREE(compression_folder_pats.strings);
 
 	config->buf = mem;
+
+	/* Configuration files can have thousands of patterns, and every file
+	 * scanned is matched against them, so compile them for matching.  */
+	ret = new_pattern_set(&config->exclusion_pats, &config->exclusion_set);
+	if (ret)
+		goto err_destroy_config;
+	ret = new_pattern_set(&config->exclusion_exception_pats,
+			      &config->exclusion_exception_set);
+	if (ret)
+		goto err_destroy_config;
 	return 0;
+
+err_destroy_config:
+	destroy_capture_config(config);
+	return ret;
 }
 
 void
 destroy_capture_config(struct capture_config *config)
 {
+	free_pattern_set(config->exclusion_set);
+	free_pattern_set(config->exclusion_exception_set);
 	FREE(config->exclusion_pats.strings);
 	FREE(config->exclusion_exception_pats.strings);
 	FREE(config->buf);
@@ -293,10 +315,11 @@ try_exclude(const struct scan_params *params)
 
 	if (params->config) {
 		const tchar *path = params->cur_path + params->root_path_nchars;
-		if (match_pattern_list(path, &params->config->exclusion_pats,
-				       MATCH_RECURSIVELY) &&
-		    !match_pattern_list(path, &params->config->exclusion_exception_pats,
-					MATCH_RECURSIVELY | MATCH_ANCESTORS))
+		if (match_pattern_set(path, params->config->exclusion_set,
+				      MATCH_RECURSIVELY) &&
+		    !match_pattern_set(path,
+				       params->config->exclusion_exception_set,
+				       MATCH_RECURSIVELY | MATCH_ANCESTORS))
 			return -1;
 	}
 
@@ -361,17 +384,32 @@ should_ignore_filename(const tchar *name, const int name_nchars)
  * handling.  */
 void
 attach_scanned_tree(struct wim_dentry *parent, struct wim_dentry *child,
-		    struct blob_table *blob_table)
+		    struct scan_params *params)
 {
 	struct wim_dentry *duplicate;
 
-	if (child && (duplicate = dentry_add_child(parent, child))) {
+	if (!child)
+		return;
+	duplicate = dentry_add_child(parent, child);
+	if (duplicate) {
 		WARNING("Duplicate file path: \"%"TS"\".  Only capturing "
 			"the first version.", dentry_full_path(duplicate));
-		free_dentry_tree(child, blob_table);
+		free_scanned_tree(params, child);
+	} else if (params->spill) {
+		metadata_spill_attached(params->spill, child);
 	}
 }
 
+/* Free a tree, or part of one, which was scanned but won't be used.  */
+void
+free_scanned_tree(struct scan_params *params, struct wim_dentry *tree)
+{
+	if (params->spill)
+		metadata_spill_free_tree(params->spill, tree);
+	else
+		free_dentry_tree(tree, params->blob_table);
+}
+
 /* Set the path at which the directory tree scan is beginning. */
 int
 pathbuf_init(struct scan_params *params, const tchar *root_path)
@@ -437,3 +475,192 @@ pathbuf_truncate(struct scan_params *params, size_t nchars)
 	params->cur_path[nchars] = T('\0');
 	params->cur_path_nchars = nchars;
 }
+
+/*
+ * With WIMLIB_ADD_FLAG_HASH_DURING_SCAN, the SHA-1 message digests of the blobs
+ * discovered by a scan are computed by the threads of a thread pool while the
+ * scan continues, rather than being left for the write.  When the scan ends,
+ * the scanned blobs that were hashed are joined with their duplicates in the
+ * blob table, so the write starts with a deduplicated blob list.
+ *
+ * The threads read from a private copy of each blob descriptor, since the
+ * scanned blob can be freed by the scan at any time (e.g. when an error is
+ * ignored or a file is replaced), and they never touch the blob table.  Only
+ * the scanning thread links a scanned blob to its job, via
+ * blob->scan_hash_job, and looks at the results.
+ */
+struct scan_hasher {
+	struct wimlib_thread_pool *pool;
+	unsigned cursor;
+
+	/* Number of jobs submitted but not yet finished  */
+	unsigned long num_pending;
+	struct mutex lock;
+	struct condvar done_cond;
+
+	/* All jobs submitted, in submission order  */
+	struct list_head jobs;
+};
+
+struct scan_hash_job {
+	struct thread_pool_work work;
+	struct list_head hasher_node;
+	struct scan_hasher *hasher;
+
+	/* Private copy of the blob descriptor to read the data from; freed
+	 * by the thread once the data has been read  */
+	struct blob_descriptor *copy;
+
+	u8 hash[SHA1_HASH_SIZE];
+	int status;
+};
+
+static void
+scan_hash_job_run(struct thread_pool_work *work)
+{
+	struct scan_hash_job *job = container_of(work, struct scan_hash_job,
+						 work);
+	struct scan_hasher *hasher = job->hasher;
+
+	job->status = sha1_blob(job->copy);
+	if (job->status == 0)
+		copy_hash(job->hash, job->copy->hash);
+	free_blob_descriptor(job->copy);
+	job->copy = NULL;
+
+	mutex_lock(&hasher->lock);
+	if (--hasher->num_pending == 0)
+		condvar_signal(&hasher->done_cond);
+	mutex_unlock(&hasher->lock);
+}
+
+/* Start hashing the blobs of a scan on @pool, e.g. the thread pool set on the
+ * WIMStruct with wimlib_set_thread_pool(), or on a new thread pool if @pool is
+ * NULL.  */
+int
+start_scan_hasher(struct wimlib_thread_pool *pool,
+		  struct scan_hasher **hasher_ret)
+{
+	struct scan_hasher *hasher;
+	int ret;
+
+	hasher = CALLOC(1, sizeof(*hasher));
+	if (!hasher)
+		return WIMLIB_ERR_NOMEM;
+	ret = WIMLIB_ERR_NOMEM;
+	if (!mutex_init(&hasher->lock))
+		goto err_free_hasher;
+	if (!condvar_init(&hasher->done_cond))
+		goto err_destroy_lock;
+	INIT_LIST_HEAD(&hasher->jobs);
+
+	if (pool) {
+		thread_pool_get(pool);
+	} else {
+		ret = thread_pool_create(0, &pool);
+		if (ret)
+			goto err_destroy_cond;
+	}
+	hasher->pool = pool;
+	*hasher_ret = hasher;
+	return 0;
+
+err_destroy_cond:
+	condvar_destroy(&hasher->done_cond);
+err_destroy_lock:
+	mutex_destroy(&hasher->lock);
+err_free_hasher:
+	FREE(hasher);
+	return ret;
+}
+
+/* Start hashing a blob which was just passed to prepare_unhashed_blob(), or
+ * whose staging file in a read-write mounted image was just closed.  Failure
+ * isn't fatal, since the blob can still be hashed later.  */
+void
+scan_hasher_submit(struct scan_hasher *hasher, struct blob_descriptor *blob)
+{
+	struct scan_hash_job *job;
+
+	if (!hasher || !blob)
+		return;
+	if (blob->blob_location != BLOB_IN_FILE_ON_DISK
+#ifdef _WIN32
+	    && blob->blob_location != BLOB_IN_WINDOWS_FILE
+#endif
+#ifdef WITH_FUSE
+	    && !(blob->blob_location == BLOB_IN_STAGING_FILE &&
+		 !blob->staging_cow)
+#endif
+	   )
+		return;
+
+	job = MALLOC(sizeof(*job));
+	if (!job)
+		return;
+	job->copy = clone_blob_descriptor(blob);
+	if (!job->copy) {
+		FREE(job);
+		return;
+	}
+	job->work.run = scan_hash_job_run;
+	job->work.name = "hash";
+	job->hasher = hasher;
+	list_add_tail(&job->hasher_node, &hasher->jobs);
+	blob->scan_hash_job = job;
+
+	mutex_lock(&hasher->lock);
+	hasher->num_pending++;
+	mutex_unlock(&hasher->lock);
+	thread_pool_submit(hasher->pool, &job->work, &hasher->cursor);
+}
+
+/*
+ * Wait for all blobs submitted to @hasher to be hashed, then free it.  Each blob
+ * on @unhashed_blobs that was successfully hashed gets its SHA-1 message digest
+ * and is moved to @blob_table, possibly joining it with an identical blob.
+ * Blobs which couldn't be hashed (e.g. because the file couldn't be read) are
+ * left unhashed; the error will be reported when the blob is read again.
+ *
+ * @unhashed_blobs must contain only blobs discovered while the hasher was
+ * running, plus possibly blobs never submitted to any hasher.
+ */
+void
+stop_scan_hasher(struct scan_hasher *hasher, struct list_head *unhashed_blobs,
+		 struct blob_table *blob_table)
+{
+	struct blob_descriptor *blob, *tmp;
+	struct scan_hash_job *job, *tmp_job;
+
+	if (!hasher)
+		return;
+
+	mutex_lock(&hasher->lock);
+	while (hasher->num_pending)
+		condvar_wait(&hasher->done_cond, &hasher->lock);
+	mutex_unlock(&hasher->lock);
+
+	list_for_each_entry_safe(blob, tmp, unhashed_blobs, unhashed_list) {
+		struct blob_descriptor **back_ptr;
+		struct wim_inode *inode;
+
+		job = blob->scan_hash_job;
+		if (!job)
+			continue;
+		blob->scan_hash_job = NULL;
+		if (job->status)
+			continue;
+		back_ptr = retrieve_pointer_to_unhashed_blob(blob);
+		inode = blob->back_inode;
+		copy_hash(blob->hash, job->hash);
+		if (after_blob_hashed(blob, back_ptr, blob_table, inode) != blob)
+			free_blob_descriptor(blob);
+	}
+
+	list_for_each_entry_safe(job, tmp_job, &hasher->jobs, hasher_node)
+		FREE(job);
+	thread_pool_put(hasher->pool);
+	condvar_destroy(&hasher->done_cond);
+	mutex_destroy(&hasher->lock);
+	FREE(hasher);
+}
@@ -30,7 +30,10 @@
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/security.h"
+#include "wimlib/list.h"
 #include "wimlib/sha1.h"
+#include "wimlib/threads.h"
+#include "wimlib/unaligned.h"
 #include "wimlib/util.h"
 
 struct wim_security_data_disk {
@@ -45,6 +48,124 @@ new_wim_security_data(void)
 	return CALLOC(1, sizeof(struct wim_security_data));
 }
 
+/*
+ * The security descriptors of all loaded images are kept in a single pool
+ * shared by the whole process, so that a descriptor used by several images,
+ * e.g. the images of an install.wim, which typically share most of theirs, is
+ * stored only once.  The descriptors are immutable and reference counted, and
+ * the pool is protected by a mutex since images may be loaded by multiple
+ * threads.  The pointers in 'struct wim_security_data' point to the @data of
+ * pooled descriptors.
+ */
+struct pooled_sd {
+	struct hlist_node hash_node;
+	u32 refcnt;
+	u32 hash;
+	u32 size;
+	u8 data[];
+};
+
+static struct mutex sd_pool_lock = MUTEX_INITIALIZER;
+static struct hlist_head *sd_pool_array;
+static size_t sd_pool_capacity;
+static size_t sd_pool_filled;
+
+static u32
+hash_sd(const u8 *p, size_t size)
+{
+	u64 hash = size;
+
+	for (; size >= 8; p += 8, size -= 8)
+		hash = hash_u64(hash ^ load_u64_unaligned(p));
+	for (; size; p++, size--)
+		hash = hash_u64(hash ^ *p);
+	return hash >> 32;
+}
+
+static void
+enlarge_sd_pool(void)
+{
+	size_t new_capacity = sd_pool_capacity ? sd_pool_capacity * 2 : 256;
+	struct hlist_head *new_array;
+	struct pooled_sd *psd;
+	struct hlist_node *tmp;
+
+	new_array = CALLOC(new_capacity, sizeof(new_array[0]));
+	if (!new_array)
+		return;
+	for (size_t i = 0; i < sd_pool_capacity; i++) {
+		hlist_for_each_entry_safe(psd, tmp, &sd_pool_array[i],
+					  hash_node) {
+			hlist_add_head(&psd->hash_node,
+				       &new_array[psd->hash &
+						  (new_capacity - 1)]);
+		}
+	}
+	FREE(sd_pool_array);
+	sd_pool_array = new_array;
+	sd_pool_capacity = new_capacity;
+}
+
+/* Return a reference to a pooled copy of the given security descriptor, or NULL
+ * if out of memory.  sd_pool_lock must be held.  */
+static u8 *
+sd_pool_get(const u8 *descriptor, u32 size)
+{
+	u32 hash = hash_sd(descriptor, size);
+	struct pooled_sd *psd;
+
+	if (sd_pool_capacity != 0) {
+		hlist_for_each_entry(psd,
+				     &sd_pool_array[hash &
+						    (sd_pool_capacity - 1)],
+				     hash_node) {
+			if (psd->hash == hash && psd->size == size &&
+			    !memcmp(psd->data, descriptor, size)) {
+				psd->refcnt++;
+				return psd->data;
+			}
+		}
+	}
+
+	if (sd_pool_filled >= sd_pool_capacity) {
+		enlarge_sd_pool();
+		if (sd_pool_capacity == 0)
+			return NULL;
+	}
+	psd = MALLOC(sizeof(*psd) + size);
+	if (!psd)
+		return NULL;
+	psd->refcnt = 1;
+	psd->hash = hash;
+	psd->size = size;
+	memcpy(psd->data, descriptor, size);
+	hlist_add_head(&psd->hash_node,
+		       &sd_pool_array[hash & (sd_pool_capacity - 1)]);
+	sd_pool_filled++;
+	return psd->data;
+}
+
+/* Release a reference to a pooled security descriptor.  sd_pool_lock must be
+ * held.  */
+static void
+sd_pool_put(u8 *descriptor)
+{
+	struct pooled_sd *psd;
+
+	if (!descriptor)
+		return;
+	psd = container_of(descriptor, struct pooled_sd, data);
+	if (--psd->refcnt != 0)
+		return;
+	hlist_del(&psd->hash_node);
+	FREE(psd);
+	if (--sd_pool_filled == 0) {
+		FREE(sd_pool_array);
+		sd_pool_array = NULL;
+		sd_pool_capacity = 0;
+	}
+}
+
 /*
  * Reads the security data from the metadata resource of a WIM image.
  *
@@ -136,8 +257,8 @@ read_wim_security_data(const u8 *buf, size_t buf_len,
 
 	p = (const u8*)sd_disk + size_no_descriptors;
 
-	/* Allocate the array of pointers to the security descriptors, then read
-	 * them into separate buffers. */
+	/* Allocate the array of pointers to the security descriptors, then
+	 * point them to copies in the pool, which may already exist. */
 	sd->descriptors = CALLOC(sd->num_entries, sizeof(sd->descriptors[0]));
 	if (!sd->descriptors)
 		goto out_of_memory;
@@ -148,11 +269,19 @@ read_wim_security_data(const u8 *buf, size_t buf_len,
 		total_len += sd->sizes[i];
 		if (total_len > (u64)sd->total_length)
 			goto out_invalid_sd;
-		sd->descriptors[i] = memdup(p, sd->sizes[i]);
-		if (!sd->descriptors[i])
+	}
+	mutex_lock(&sd_pool_lock);
+	for (u32 i = 0; i < sd->num_entries; i++) {
+		if (sd->sizes[i] == 0)
+			continue;
+		sd->descriptors[i] = sd_pool_get(p, sd->sizes[i]);
+		if (!sd->descriptors[i]) {
+			mutex_unlock(&sd_pool_lock);
 			goto out_of_memory;
+		}
 		p += sd->sizes[i];
 	}
+	mutex_unlock(&sd_pool_lock);
 out_descriptors_ready:
 	if (ALIGN(total_len, 8) != sd->total_length) {
 		WARNING("Stored WIM security data total length was "
@@ -210,9 +339,12 @@ free_wim_security_data(struct wim_security_data *sd)
 	if (sd) {
 		u8 **descriptors = sd->descriptors;
 		u32 num_entries  = sd->num_entries;
-		if (descriptors)
+		if (descriptors) {
+			mutex_lock(&sd_pool_lock);
 			while (num_entries--)
-				FREE(*descriptors++);
+				sd_pool_put(*descriptors++);
+			mutex_unlock(&sd_pool_lock);
+		}
 		FREE(sd->sizes);
 		FREE(sd->descriptors);
 		FREE(sd);
@@ -244,8 +376,10 @@ rollback_new_security_descriptors(struct wim_sd_set *sd_set)
 	struct wim_security_data *sd = sd_set->sd;
 	u32 i;
 
+	mutex_lock(&sd_pool_lock);
 	for (i = sd_set->orig_num_entries; i < sd->num_entries; i++)
-		FREE(sd->descriptors[i]);
+		sd_pool_put(sd->descriptors[i]);
+	mutex_unlock(&sd_pool_lock);
 	sd->num_entries = sd_set->orig_num_entries;
 }
 
@@ -288,6 +422,39 @@ lookup_sd(struct wim_sd_set *set, const u8 hash[SHA1_HASH_SIZE])
 	return SD_NODE(res)->security_id;
 }
 
+/* Returns the index of a recently used security descriptor identical to
+ * @descriptor, moving it to the front of the recently used list; or -1 if there
+ * is none.  */
+static s32
+lookup_recent_sd(struct wim_sd_set *set, const char *descriptor, size_t size)
+{
+	const struct wim_security_data *sd = set->sd;
+
+	for (int i = 0; i < SD_SET_NUM_RECENT; i++) {
+		s32 security_id = set->recent_ids[i];
+
+		if (security_id < 0)
+			break;
+		if (sd->sizes[security_id] == size &&
+		    !memcmp(sd->descriptors[security_id], descriptor, size)) {
+			memmove(&set->recent_ids[1], &set->recent_ids[0],
+				i * sizeof(set->recent_ids[0]));
+			set->recent_ids[0] = security_id;
+			return security_id;
+		}
+	}
+	return -1;
+}
+
+/* Make @security_id the most recently used security descriptor.  */
+static void
+add_recent_sd(struct wim_sd_set *set, s32 security_id)
+{
+	memmove(&set->recent_ids[1], &set->recent_ids[0],
+		(SD_SET_NUM_RECENT - 1) * sizeof(set->recent_ids[0]));
+	set->recent_ids[0] = security_id;
+}
+
 /*
  * Adds a security descriptor to the indexed security descriptor set as well as
  * the corresponding `struct wim_security_data', and returns the new security
@@ -307,11 +474,15 @@ sd_set_add_sd(struct wim_sd_set *sd_set, const char *descriptor, size_t size)
 	struct wim_security_data *sd;
 	bool bret;
 
+	security_id = lookup_recent_sd(sd_set, descriptor, size);
+	if (security_id >= 0) /* Same descriptor as a recent file */
+		return security_id;
+
 	sha1(descriptor, size, hash);
 
 	security_id = lookup_sd(sd_set, hash);
 	if (security_id >= 0) /* Identical descriptor already exists */
-		goto out;
+		goto out_add_recent;
 
 	/* Need to add a new security descriptor */
 	security_id = -1;
@@ -320,7 +491,9 @@ sd_set_add_sd(struct wim_sd_set *sd_set, const char *descriptor, size_t size)
 	if (!new)
 		goto out;
 
-	descr_copy = memdup(descriptor, size);
+	mutex_lock(&sd_pool_lock);
+	descr_copy = sd_pool_get((const u8 *)descriptor, size);
+	mutex_unlock(&sd_pool_lock);
 	if (!descr_copy)
 		goto out_free_node;
 
@@ -347,9 +520,13 @@ sd_set_add_sd(struct wim_sd_set *sd_set, const char *descriptor, size_t size)
 	bret = insert_sd_node(sd_set, new);
 	wimlib_assert(bret);
 	security_id = new->security_id;
+out_add_recent:
+	add_recent_sd(sd_set, security_id);
 	goto out;
 out_free_descr:
-	FREE(descr_copy);
+	mutex_lock(&sd_pool_lock);
+	sd_pool_put(descr_copy);
+	mutex_unlock(&sd_pool_lock);
 out_free_node:
 	FREE(new);
 out:
@@ -366,6 +543,8 @@ init_sd_set(struct wim_sd_set *sd_set, struct wim_security_data *sd)
 
 	sd_set->sd = sd;
 	sd_set->root = NULL;
+	for (int i = 0; i < SD_SET_NUM_RECENT; i++)
+		sd_set->recent_ids[i] = -1;
 
 	/* Remember the original number of security descriptors so that newly
 	 * added ones can be rolled back if needed. */
@@ -0,0 +1,479 @@
+/*
+ * shared_chunk_cache.c
+ *
+ * A cache of decompressed chunks in shared memory, for sharing decompressed
+ * data between processes that read the same WIM file.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * The cache is a file, normally on a memory file system such as /dev/shm, that
+ * every process using the cache maps into memory with MAP_SHARED.  It holds a
+ * header followed by fixed-size slots, each of which holds the data of one
+ * chunk.  The slots are grouped into sets of SCC_WAYS; a chunk can only be
+ * stored in the set selected by the hash of its key, and replaces the least
+ * recently used chunk of that set.  Chunks larger than the slot size, such as
+ * the chunks of solid resources, aren't cached.
+ *
+ * A chunk is identified by the GUID of the WIM file, the identity of the file
+ * on disk (device, inode number, size, and modification time), the offset of
+ * its resource in the file, and its index in the resource.  The file identity
+ * keeps processes from sharing chunks of WIM files that have the same GUID but
+ * different contents, as after a WIM file was rebuilt or modified in place.
+ *
+ * There are no locks, as a process may die at any time.  Instead, each slot is
+ * protected by a sequence count, which is odd while the slot is being written.
+ * A writer claims a slot by atomically incrementing the count from an even
+ * value, and skips the slot if the count is odd or if it loses the race.  A
+ * reader copies the key and data out of the slot, then checks that the count
+ * was even and didn't change in the meantime; otherwise it treats the lookup as
+ * a miss.  A process that dies while writing a slot leaves its count odd, which
+ * merely makes the slot unusable until the cache file is recreated.
+ *
+ * The cache is in the native byte order and layout of the machine, since it is
+ * shared only between processes running on the same machine.  Since processes
+ * trust the data in the cache, anyone who can write to the cache file can alter
+ * the data read from WIM files through it.  The file is therefore created
+ * readable and writable by its owner only.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/error.h"
+#include "wimlib/shared_chunk_cache.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wimlib/file_io.h"
+#include "wimlib/guid.h"
+#include "wimlib/util.h"
+
+#define SCC_MAGIC	0x434343534d4957ULL	/* "WIMSCCC" */
+#define SCC_VERSION	1
+
+/* Number of slots in each set  */
+#define SCC_WAYS	4
+
+struct scc_header {
+	u64 magic;
+	u32 version;
+
+	/* Maximum size of the data of each slot  */
+	u32 slot_size;
+
+	/* Number of sets of SCC_WAYS slots  */
+	u64 num_sets;
+
+	/* Incremented on each insertion; used to find the least recently used
+	 * slot of a set  */
+	u32 clock;
+} __attribute__((aligned(64)));
+
+struct scc_slot {
+	/* Sequence count; odd while the slot is being written  */
+	u32 seq;
+
+	/* Size of the chunk in the slot, or 0 if the slot is empty  */
+	u32 size;
+
+	/* Value of the header's clock when the slot was last used  */
+	u32 stamp;
+
+	u8 guid[GUID_SIZE];
+	u64 file_id;
+	u64 res_offset;
+	u64 index;
+
+	/* Followed by the chunk data  */
+} __attribute__((aligned(64)));
+
+struct shared_chunk_cache {
+	struct scc_header *hdr;
+	size_t map_size;
+	u32 slot_size;
+	size_t slot_stride;
+	u64 num_sets;
+
+	/* The key prefix of the chunks of this WIM file.  @file_id is 0 if the
+	 * file can't be identified, in which case the cache isn't used.  */
+	u8 guid[GUID_SIZE];
+	u64 file_id;
+};
+
+/* Mix the bits of @v well.  hash_u64() alone is too weak for selecting sets of
+ * slots by a modulus that isn't a power of 2, since consecutive chunk indices
+ * then map to just a few sets.  */
+static u64
+scc_mix(u64 v)
+{
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	v *= 0xc4ceb9fe1a85ec53ULL;
+	v ^= v >> 33;
+	return v;
+}
+
+static struct scc_slot *
+scc_get_set(const struct shared_chunk_cache *cache, u64 res_offset, u64 index)
+{
+	u64 hash = scc_mix(scc_mix(cache->file_id ^ res_offset) + index);
+	u64 set = hash % cache->num_sets;
+
+	return (void *)((u8 *)(cache->hdr + 1) +
+			set * SCC_WAYS * cache->slot_stride);
+}
+
+static struct scc_slot *
+scc_next_slot(const struct shared_chunk_cache *cache, struct scc_slot *slot)
+{
+	return (void *)((u8 *)slot + cache->slot_stride);
+}
+
+static bool
+scc_slot_matches(const struct shared_chunk_cache *cache,
+		 const struct scc_slot *slot, u64 res_offset, u64 index)
+{
+	return slot->res_offset == res_offset &&
+	       slot->index == index &&
+	       slot->file_id == cache->file_id &&
+	       guids_equal(slot->guid, cache->guid);
+}
+
+/* Compute a number that identifies the file open on @in_fd and its current
+ * contents, or 0 if that isn't possible.  */
+static u64
+get_file_id(const struct filedes *in_fd)
+{
+	struct stat stbuf;
+	u64 id;
+
+	if (!filedes_valid(in_fd) || in_fd->is_pipe ||
+	    fstat(in_fd->fd, &stbuf) != 0)
+		return 0;
+	id = hash_u64(stbuf.st_dev);
+	id = hash_u64(id ^ stbuf.st_ino);
+	id = hash_u64(id ^ stbuf.st_size);
+	id = hash_u64(id ^ stbuf.st_mtime);
+#ifdef HAVE_STAT_NANOSECOND_PRECISION
+	id = hash_u64(id ^ stbuf.st_mtim.tv_nsec);
+#endif
+	return id ? id : 1;
+}
+
+static size_t
+scc_slot_stride(u32 slot_size)
+{
+	return ALIGN(sizeof(struct scc_slot) + slot_size, 64);
+}
+
+/* Create a cache file at @path, unless another process beats us to it.  The
+ * file is set up under a temporary name, then linked to @path, so that other
+ * processes never see a partially set up cache.  */
+static int
+create_cache_file(const char *path, u64 size, u32 slot_size)
+{
+	size_t path_len = strlen(path);
+	char tmpfile[path_len + 10];
+	struct scc_header *hdr;
+	u64 num_sets;
+	int fd;
+	int ret;
+
+	num_sets = (size - sizeof(struct scc_header)) /
+		   (SCC_WAYS * scc_slot_stride(slot_size));
+	if (size < sizeof(struct scc_header) || num_sets == 0) {
+		ERROR("Shared chunk cache size %"PRIu64" is too small; "
+		      "it must be at least %zu bytes", size,
+		      sizeof(struct scc_header) +
+		      SCC_WAYS * scc_slot_stride(slot_size));
+		return WIMLIB_ERR_INVALID_PARAM;
+	}
+	size = sizeof(struct scc_header) +
+	       num_sets * SCC_WAYS * scc_slot_stride(slot_size);
+
+	memcpy(tmpfile, path, path_len);
+	get_random_alnum_chars(tmpfile + path_len, 9);
+	tmpfile[path_len + 9] = '\0';
+
+	fd = open(tmpfile, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ERROR_WITH_ERRNO("Can't create \"%s\"", tmpfile);
+		return WIMLIB_ERR_OPEN;
+	}
+
+	/* The slots are all zeroes, which makes them empty.  */
+	if (ftruncate(fd, size) != 0) {
+		ERROR_WITH_ERRNO("Can't set the size of \"%s\"", tmpfile);
+		ret = WIMLIB_ERR_WRITE;
+		goto out_unlink;
+	}
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (hdr == MAP_FAILED) {
+		ERROR_WITH_ERRNO("Can't map \"%s\" into memory", tmpfile);
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_unlink;
+	}
+	hdr->magic = SCC_MAGIC;
+	hdr->version = SCC_VERSION;
+	hdr->slot_size = slot_size;
+	hdr->num_sets = num_sets;
+	munmap(hdr, sizeof(*hdr));
+
+	if (link(tmpfile, path) != 0 && errno != EEXIST) {
+		ERROR_WITH_ERRNO("Can't create \"%s\"", path);
+		ret = WIMLIB_ERR_LINK;
+		goto out_unlink;
+	}
+	ret = 0;
+out_unlink:
+	unlink(tmpfile);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Open the shared chunk cache at @path, creating it with a size of @size bytes
+ * and slots of @slot_size bytes if it doesn't exist yet.  Chunks are looked up
+ * and inserted under the key prefix made from @guid and the WIM file open on
+ * @in_fd.
+ */
+int
+shared_chunk_cache_open(const tchar *path, u64 size, u32 slot_size,
+			const u8 *guid, const struct filedes *in_fd,
+			struct shared_chunk_cache **cache_ret)
+{
+	struct shared_chunk_cache *cache;
+	struct scc_header hdr;
+	struct stat stbuf;
+	void *map;
+	int fd;
+	int ret;
+
+	for (;;) {
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd >= 0 || errno != ENOENT)
+			break;
+		ret = create_cache_file(path, size, slot_size);
+		if (ret)
+			return ret;
+	}
+	if (fd < 0) {
+		ERROR_WITH_ERRNO("Can't open \"%s\"", path);
+		return WIMLIB_ERR_OPEN;
+	}
+
+	if (fstat(fd, &stbuf) != 0) {
+		ERROR_WITH_ERRNO("Can't stat \"%s\"", path);
+		ret = WIMLIB_ERR_STAT;
+		goto out_close;
+	}
+	if (stbuf.st_size < sizeof(hdr) ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != SCC_MAGIC || hdr.version != SCC_VERSION ||
+	    hdr.slot_size == 0 || hdr.num_sets == 0 ||
+	    hdr.num_sets > (stbuf.st_size - sizeof(hdr)) /
+			   (SCC_WAYS * scc_slot_stride(hdr.slot_size)))
+	{
+		ERROR("\"%s\" is not a shared chunk cache", path);
+		ret = WIMLIB_ERR_INVALID_PARAM;
+		goto out_close;
+	}
+
+	cache = MALLOC(sizeof(*cache));
+	if (!cache) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_close;
+	}
+	cache->slot_size = hdr.slot_size;
+	cache->slot_stride = scc_slot_stride(hdr.slot_size);
+	cache->num_sets = hdr.num_sets;
+	cache->map_size = sizeof(hdr) +
+			  hdr.num_sets * SCC_WAYS * cache->slot_stride;
+	map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		ERROR_WITH_ERRNO("Can't map \"%s\" into memory", path);
+		FREE(cache);
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_close;
+	}
+	cache->hdr = map;
+	copy_guid(cache->guid, guid);
+	cache->file_id = get_file_id(in_fd);
+	*cache_ret = cache;
+	ret = 0;
+out_close:
+	/* The mapping stays valid after the file is closed.  */
+	close(fd);
+	return ret;
+}
+
+void
+shared_chunk_cache_close(struct shared_chunk_cache *cache)
+{
+	if (cache) {
+		munmap(cache->hdr, cache->map_size);
+		FREE(cache);
+	}
+}
+
+/* Update the key prefix after the WIM file open on @in_fd was modified, or
+ * after it was closed, in which case the cache is no longer used.  */
+void
+shared_chunk_cache_set_file(struct shared_chunk_cache *cache,
+			    const struct filedes *in_fd)
+{
+	if (cache)
+		cache->file_id = get_file_id(in_fd);
+}
+
+/*
+ * Copy the data of the chunk with index @index in the resource at @res_offset
+ * into @buf, which has room for its @size bytes, if the chunk is in the cache.
+ * Return true on a hit; otherwise @buf may have been overwritten.  @cache may be
+ * NULL, in which case nothing is ever found.
+ */
+bool
+shared_chunk_cache_lookup(struct shared_chunk_cache *cache, u64 res_offset,
+			  u64 index, void *buf, u32 size)
+{
+	struct scc_slot *slot;
+
+	if (!cache || !cache->file_id || size > cache->slot_size)
+		return false;
+
+	slot = scc_get_set(cache, res_offset, index);
+	for (int i = 0; i < SCC_WAYS; i++, slot = scc_next_slot(cache, slot)) {
+		u32 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if ((seq & 1) || slot->size != size ||
+		    !scc_slot_matches(cache, slot, res_offset, index))
+			continue;
+		memcpy(buf, slot + 1, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			return false;
+		__atomic_store_n(&slot->stamp,
+				 __atomic_load_n(&cache->hdr->clock,
+						 __ATOMIC_RELAXED),
+				 __ATOMIC_RELAXED);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Offer the @size bytes of data of the chunk with index @index in the resource
+ * at @res_offset to the cache.  The chunk isn't inserted if it is too large, if
+ * it is already cached, or if other processes are writing the slots it could go
+ * in.  @cache may be NULL, in which case nothing is done.
+ */
+void
+shared_chunk_cache_insert(struct shared_chunk_cache *cache, u64 res_offset,
+			  u64 index, const void *data, u32 size)
+{
+	struct scc_slot *set, *slot, *victim = NULL;
+	u32 victim_age = 0;
+	u32 now;
+	u32 seq;
+
+	if (!cache || !cache->file_id || size > cache->slot_size || size == 0)
+		return;
+
+	now = __atomic_add_fetch(&cache->hdr->clock, 1, __ATOMIC_RELAXED);
+	set = scc_get_set(cache, res_offset, index);
+	slot = set;
+	for (int i = 0; i < SCC_WAYS; i++, slot = scc_next_slot(cache, slot)) {
+		u32 age;
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		if (slot->size == size &&
+		    scc_slot_matches(cache, slot, res_offset, index))
+			return;
+		age = (slot->size == 0) ? UINT32_MAX : now - slot->stamp;
+		if (!victim || age > victim_age) {
+			victim = slot;
+			victim_age = age;
+		}
+	}
+	if (!victim)
+		return;
+
+	seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) ||
+	    !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	victim->size = size;
+	victim->stamp = now;
+	copy_guid(victim->guid, cache->guid);
+	victim->file_id = cache->file_id;
+	victim->res_offset = res_offset;
+	victim->index = index;
+	memcpy(victim + 1, data, size);
+	__atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#else /* !_WIN32 */
+
+int
+shared_chunk_cache_open(const tchar *path, u64 size, u32 slot_size,
+			const u8 *guid, const struct filedes *in_fd,
+			struct shared_chunk_cache **cache_ret)
+{
+	return WIMLIB_ERR_UNSUPPORTED;
+}
+
+void
+shared_chunk_cache_close(struct shared_chunk_cache *cache)
+{
+}
+
+void
+shared_chunk_cache_set_file(struct shared_chunk_cache *cache,
+			    const struct filedes *in_fd)
+{
+}
+
+bool
+shared_chunk_cache_lookup(struct shared_chunk_cache *cache, u64 res_offset,
+			  u64 index, void *buf, u32 size)
+{
+	return false;
+}
+
+void
+shared_chunk_cache_insert(struct shared_chunk_cache *cache, u64 res_offset,
+			  u64 index, const void *data, u32 size)
+{
+}
+
+#endif /* _WIN32 */
@@ -25,12 +25,15 @@
 #  include "config.h"
 #endif
 
+#include <stdlib.h>
+
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
 #include "wimlib/metadata.h"
 #include "wimlib/paths.h"
+#include "wimlib/resource.h"
 #include "wimlib/solid.h"
 #include "wimlib/unaligned.h"
 
@@ -160,8 +163,216 @@ image_fill_in_solid_sort_names(WIMStruct *wim)
 				  wim->private);
 }
 
+/*
+ * Grouping blobs by content similarity
+ *
+ * Each blob gets a MinHash sketch: for each of several hash functions, the
+ * minimum hash value over all 4-byte sequences in the first part of the blob.
+ * Two blobs have the same minimum for a given hash function with probability
+ * equal to the Jaccard similarity of their sets of 4-byte sequences.  The
+ * sketch is divided into bands, and any two blobs whose sketches are identical
+ * in any band are placed in the same cluster.  Requiring a whole band to match
+ * makes it unlikely for merely somewhat similar blobs (e.g. any two text files)
+ * to be clustered, which could otherwise chain most blobs into one cluster.
+ * Each cluster is moved to the position of its first member in the name-based
+ * order.  Blobs that aren't clustered with anything keep their name-based
+ * order.
+ */
+
+/* The number of bytes at the start of each blob that the sketch covers  */
+#define SKETCH_SAMPLE_SIZE	65536
+
+/* Blobs smaller than this are not worth clustering  */
+#define SKETCH_MIN_BLOB_SIZE	64
+
+/* The number of bands in each sketch, and the number of hash functions in each
+ * band  */
+#define SKETCH_NUM_BANDS	2
+#define SKETCH_BAND_SIZE	4
+#define SKETCH_NUM_HASHES	(SKETCH_NUM_BANDS * SKETCH_BAND_SIZE)
+
+struct content_sort_entry {
+	struct blob_descriptor *blob;
+	size_t parent;
+	bool have_sketch;
+	u32 sketch[SKETCH_NUM_HASHES];
+};
+
+struct content_sort_key {
+	u64 key;
+	size_t idx;
+};
+
+static const u32 sketch_multipliers[SKETCH_NUM_HASHES] = {
+	0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F,
+	0x165667B1, 0xD3A2646D, 0xFD7046C5, 0xB55A4F09,
+};
+
+static void
+compute_sketch(const u8 *data, size_t size, u32 sketch[SKETCH_NUM_HASHES])
+{
+	for (int k = 0; k < SKETCH_NUM_HASHES; k++)
+		sketch[k] = UINT32_MAX;
+
+	for (size_t i = 0; i + 4 <= size; i++) {
+		u32 seq = get_unaligned_le32(&data[i]);
+
+		for (int k = 0; k < SKETCH_NUM_HASHES; k++) {
+			u32 h = seq * sketch_multipliers[k];
+
+			h ^= h >> 16;
+			sketch[k] = min(sketch[k], h);
+		}
+	}
+}
+
+/* Combine the minimum hash values of one band into a single key.  */
+static u64
+hash_sketch_band(const u32 band[SKETCH_BAND_SIZE])
+{
+	u64 key = 0;
+
+	for (int k = 0; k < SKETCH_BAND_SIZE; k++)
+		key = (key + band[k]) * 0x9E3779B97F4A7C15;
+	return key;
+}
+
+static bool
+blob_can_be_sketched(const struct blob_descriptor *blob)
+{
+	if (blob->size < SKETCH_MIN_BLOB_SIZE)
+		return false;
+
+	/* Reading just part of a blob in a solid resource would require
+	 * decompressing everything before it in its chunk.  */
+	if (blob->blob_location == BLOB_IN_WIM &&
+	    blob->size != blob->rdesc->uncompressed_size)
+		return false;
+
+	return true;
+}
+
+static size_t
+find_cluster(struct content_sort_entry *entries, size_t i)
+{
+	while (entries[i].parent != i) {
+		entries[i].parent = entries[entries[i].parent].parent;
+		i = entries[i].parent;
+	}
+	return i;
+}
+
+/* Merge the clusters of two entries.  The root of each cluster is its member
+ * that comes first in the name-based order.  */
+static void
+merge_clusters(struct content_sort_entry *entries, size_t i, size_t j)
+{
+	i = find_cluster(entries, i);
+	j = find_cluster(entries, j);
+	if (i < j)
+		entries[j].parent = i;
+	else
+		entries[i].parent = j;
+}
+
+static int
+cmp_content_sort_keys(const void *p1, const void *p2)
+{
+	const struct content_sort_key *k1 = p1;
+	const struct content_sort_key *k2 = p2;
+
+	if (k1->key != k2->key)
+		return (k1->key < k2->key) ? -1 : 1;
+	return (k1->idx < k2->idx) ? -1 : (k1->idx > k2->idx);
+}
+
+/* Reorder the blob list, which is already in name-based order, so that blobs
+ * with similar contents are next to each other.  */
+static int
+cluster_blobs_by_content(struct list_head *blob_list, size_t num_blobs)
+{
+	struct content_sort_entry *entries;
+	struct content_sort_key *keys;
+	struct blob_descriptor *blob;
+	u8 *buf;
+	size_t i, n;
+	int ret;
+
+	if (num_blobs <= 1)
+		return 0;
+
+	entries = MALLOC(num_blobs * sizeof(entries[0]));
+	keys = MALLOC(num_blobs * sizeof(keys[0]));
+	buf = MALLOC(SKETCH_SAMPLE_SIZE);
+	if (!entries || !keys || !buf) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+
+	i = 0;
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		struct content_sort_entry *e = &entries[i];
+
+		e->blob = blob;
+		e->parent = i++;
+		e->have_sketch = false;
+		if (blob_can_be_sketched(blob)) {
+			size_t size = min(blob->size, SKETCH_SAMPLE_SIZE);
+
+			ret = read_blob_prefix_into_buf(blob, size, buf);
+			if (ret)
+				goto out;
+			compute_sketch(buf, size, e->sketch);
+			e->have_sketch = true;
+		}
+	}
+
+	/* For each band, merge the clusters of blobs that have the same
+	 * minimum hash values in that band.  */
+	for (int b = 0; b < SKETCH_NUM_BANDS; b++) {
+		n = 0;
+		for (i = 0; i < num_blobs; i++) {
+			if (entries[i].have_sketch) {
+				keys[n].key = hash_sketch_band(
+					&entries[i].sketch[b * SKETCH_BAND_SIZE]);
+				keys[n].idx = i;
+				n++;
+			}
+		}
+		qsort(keys, n, sizeof(keys[0]), cmp_content_sort_keys);
+		for (i = 1; i < n; i++)
+			if (keys[i].key == keys[i - 1].key)
+				merge_clusters(entries, keys[i - 1].idx,
+					       keys[i].idx);
+	}
+
+	/* Sort primarily by the position of the cluster, secondarily by the
+	 * position in the name-based order.  */
+	for (i = 0; i < num_blobs; i++) {
+		keys[i].key = find_cluster(entries, i);
+		keys[i].idx = i;
+	}
+	qsort(keys, num_blobs, sizeof(keys[0]), cmp_content_sort_keys);
+
+	INIT_LIST_HEAD(blob_list);
+	for (i = 0; i < num_blobs; i++)
+		list_add_tail(&entries[keys[i].idx].blob->write_blobs_list,
+			      blob_list);
+	ret = 0;
+out:
+	FREE(buf);
+	FREE(keys);
+	FREE(entries);
+	return ret;
+}
+
+/*
+ * Sort the blobs to be written for solid compression.  If @by_content is true,
+ * then blobs whose contents look similar are additionally grouped together.
+ */
 int
-sort_blob_list_for_solid_compression(struct list_head *blob_list)
+sort_blob_list_for_solid_compression(struct list_head *blob_list,
+				     bool by_content)
 {
 	size_t num_blobs = 0;
 	struct temp_blob_table blob_table;
@@ -209,7 +420,10 @@ sort_blob_list_for_solid_compression(struct list_head *blob_list)
 	#ifdef _WIN32
 		case BLOB_IN_WINDOWS_FILE:
 	#endif
-			blob_set_solid_sort_name_from_inode(blob, blob->file_inode);
+			/* The inode is gone if it was spilled during capture. */
+			if (blob->file_inode)
+				blob_set_solid_sort_name_from_inode(blob,
+								    blob->file_inode);
 			break;
 		default:
 			break;
@@ -233,6 +447,8 @@ sort_blob_list_for_solid_compression(struct list_head *blob_list)
 	ret = sort_blob_list(blob_list,
 			     offsetof(struct blob_descriptor, write_blobs_list),
 			     cmp_blobs_by_solid_sort_name);
+	if (ret == 0 && by_content)
+		ret = cluster_blobs_by_content(blob_list, num_blobs);
 
 out:
 	list_for_each_entry(blob, blob_list, write_blobs_list)
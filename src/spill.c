@@ -0,0 +1,544 @@
+/*
+ * spill.c
+ *
+ * Out-of-core capture: writing the directories completed by a scan to a
+ * temporary file, so that the dentry tree of a huge image never has to be held
+ * in memory at once.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * The spill file consists of one record per spilled directory, each of which
+ * is an 8-byte little endian "subtree size" followed by the directory's child
+ * dentries and an end-of-directory entry, exactly as they appear in a metadata
+ * resource.  The subdir offset of each spilled directory is the offset of its
+ * child dentries in the spill file, so that read_dentry_subdir() can load them
+ * from it like from an uncompressed metadata resource.  The subtree size is the
+ * total size of the child dentry lists of the directory and all directories
+ * below it, which is the space that its subtree will take up in the metadata
+ * resource; this is what allows calculate_subdir_offsets() to lay out the
+ * resource without loading the spilled directories.
+ *
+ * A directory is spilled in postorder, after all its subdirectories, so that
+ * their subdir offsets are known.  A directory can only be spilled once the
+ * scan has completed it, i.e. when it's attached to its parent, and only if
+ * each file in its subtree has no names other than the one found by the scan:
+ * the scan must still be able to find a file that has other links, and all the
+ * dentries of an inode have to be written with its final link count.  This is
+ * what the scan records in i_single_link.  Every file that has hard links keeps
+ * its ancestor directories in memory, but their other subdirectories can still
+ * be spilled.
+ *
+ * Spilling also computes the SHA-1 message digests of the blobs of the spilled
+ * files, since unhashed blobs point back to their inodes, and releases the
+ * blobs' pointers to their inodes, which are freed.  The blob descriptors
+ * themselves stay in memory in the blob table.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "wimlib/blob_table.h"
+#include "wimlib/dentry.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/inode.h"
+#include "wimlib/spill.h"
+#include "wimlib/unaligned.h"
+#include "wimlib/util.h"
+
+/* Number of dentries that the scan attaches between spills.  This bounds the
+ * number of completed dentries held in memory, apart from unspillable ones.  */
+#define SPILL_INTERVAL		4096
+
+/* Initial size of the buffer for writing the spill file  */
+#define SPILL_BUFFER_SIZE	((size_t)1 << 20)
+
+struct metadata_spill {
+
+	/* The spill file, which has already been unlinked  */
+	struct filedes fd;
+
+	/* Buffered data which hasn't been written to the file yet  */
+	u8 *buf;
+	size_t buf_size;
+	size_t buf_used;
+
+	/* Number of bytes written to the file so far  */
+	u64 flushed_size;
+
+	/* After metadata_spill_get_data(): the contents of the spill file,
+	 * either mapped into memory or read into an allocated buffer  */
+	const u8 *data;
+	size_t data_len;
+	bool data_allocated;
+
+	/* List of directories, linked by d_tmp_list, which the scan has
+	 * completed but which haven't been spilled yet.  A directory that is
+	 * not on this list has its d_tmp_list zeroed.  */
+	struct list_head completed;
+
+	/* Number of dentries attached since the last spill  */
+	size_t num_attached;
+
+	struct blob_table *blob_table;
+
+	/* The first error that occurred while spilling, after which spilling
+	 * stops.  It is returned by metadata_spill_finish().  */
+	int error;
+};
+
+/* Create a new spill file for a scan whose blobs are deduplicated in
+ * @blob_table.  */
+int
+new_metadata_spill(struct blob_table *blob_table,
+		   struct metadata_spill **spill_ret)
+{
+#ifdef _WIN32
+	return WIMLIB_ERR_UNSUPPORTED;
+#else
+	struct metadata_spill *spill;
+	const char *tmpdir;
+	char *name;
+	int raw_fd;
+
+	spill = CALLOC(1, sizeof(*spill));
+	if (!spill)
+		return WIMLIB_ERR_NOMEM;
+	spill->buf = MALLOC(SPILL_BUFFER_SIZE);
+	if (!spill->buf)
+		goto err_nomem;
+	spill->buf_size = SPILL_BUFFER_SIZE;
+
+	tmpdir = getenv("TMPDIR");
+	if (!tmpdir)
+		tmpdir = P_tmpdir;
+	name = MALLOC(strlen(tmpdir) + 1 + 6 + 6 + 1);
+	if (!name)
+		goto err_nomem;
+	sprintf(name, "%s/wimlibXXXXXX", tmpdir);
+	raw_fd = mkstemp(name);
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("Failed to create temporary file \"%s\"",
+				 name);
+		FREE(name);
+		FREE(spill->buf);
+		FREE(spill);
+		return WIMLIB_ERR_OPEN;
+	}
+	/* Nothing else needs the file's name.  */
+	unlink(name);
+	FREE(name);
+
+	filedes_init(&spill->fd, raw_fd);
+	INIT_LIST_HEAD(&spill->completed);
+	spill->blob_table = blob_table;
+	*spill_ret = spill;
+	return 0;
+
+err_nomem:
+	FREE(spill->buf);
+	FREE(spill);
+	return WIMLIB_ERR_NOMEM;
+#endif
+}
+
+static void
+metadata_spill_put_data(struct metadata_spill *spill)
+{
+	if (spill->data_allocated)
+		FREE((void *)spill->data);
+	else
+		filedes_unmap(&spill->fd);
+	spill->data = NULL;
+	spill->data_len = 0;
+	spill->data_allocated = false;
+}
+
+void
+free_metadata_spill(struct metadata_spill *spill)
+{
+	if (spill) {
+		metadata_spill_put_data(spill);
+		filedes_close(&spill->fd);
+		FREE(spill->buf);
+		FREE(spill);
+	}
+}
+
+static int
+metadata_spill_flush(struct metadata_spill *spill)
+{
+	if (spill->buf_used == 0)
+		return 0;
+	if (full_write(&spill->fd, spill->buf, spill->buf_used)) {
+		ERROR_WITH_ERRNO("Error writing to temporary file");
+		return WIMLIB_ERR_WRITE;
+	}
+	spill->flushed_size += spill->buf_used;
+	spill->buf_used = 0;
+	return 0;
+}
+
+/* Make @size bytes available at the end of the write buffer.  */
+static int
+metadata_spill_reserve(struct metadata_spill *spill, size_t size, u8 **p_ret)
+{
+	int ret;
+
+	if (spill->buf_size - spill->buf_used < size) {
+		ret = metadata_spill_flush(spill);
+		if (ret)
+			return ret;
+		if (spill->buf_size < size) {
+			/* A dentry larger than the buffer  */
+			u8 *buf = REALLOC(spill->buf, size);
+
+			if (!buf)
+				return WIMLIB_ERR_NOMEM;
+			spill->buf = buf;
+			spill->buf_size = size;
+		}
+	}
+	*p_ret = &spill->buf[spill->buf_used];
+	return 0;
+}
+
+/* Get the contents of the spill file written so far into spill->data.  */
+static int
+metadata_spill_get_data(struct metadata_spill *spill)
+{
+	u8 *data;
+	int ret;
+
+	if (spill->data)
+		return 0;
+	ret = metadata_spill_flush(spill);
+	if (ret)
+		return ret;
+	if (spill->flushed_size == 0 || spill->flushed_size > SIZE_MAX)
+		return spill->flushed_size ? WIMLIB_ERR_NOMEM : 0;
+
+	if (filedes_map(&spill->fd, spill->flushed_size)) {
+		spill->data = spill->fd.map;
+	} else {
+		data = MALLOC(spill->flushed_size);
+		if (!data)
+			return WIMLIB_ERR_NOMEM;
+		if (full_pread(&spill->fd, data, spill->flushed_size, 0)) {
+			ERROR_WITH_ERRNO("Error reading temporary file");
+			FREE(data);
+			return WIMLIB_ERR_READ;
+		}
+		spill->data = data;
+		spill->data_allocated = true;
+	}
+	spill->data_len = spill->flushed_size;
+	return 0;
+}
+
+/* Get the subtree size of the spilled directory @dir from its record.  */
+static int
+spilled_subtree_size(struct metadata_spill *spill, const struct wim_dentry *dir,
+		     u64 *size_ret)
+{
+	u64 offset = dir->d_subdir_offset - 8;
+	le64 v;
+
+	if (offset >= spill->flushed_size) {
+		/* Still in the write buffer  */
+		v = load_le64_unaligned(&spill->buf[offset - spill->flushed_size]);
+	} else if (full_pread(&spill->fd, &v, sizeof(v), offset)) {
+		ERROR_WITH_ERRNO("Error reading temporary file");
+		return WIMLIB_ERR_READ;
+	}
+	*size_ret = le64_to_cpu(v);
+	return 0;
+}
+
+static void
+unlist_dir(struct wim_dentry *dir)
+{
+	if (dir->d_tmp_list.next) {
+		list_del(&dir->d_tmp_list);
+		memset(&dir->d_tmp_list, 0, sizeof(dir->d_tmp_list));
+	}
+}
+
+/* Hash the unhashed blobs of @inode, which is about to be spilled and freed,
+ * and make sure that no blob still points to it.  */
+static int
+spill_inode_blobs(struct metadata_spill *spill, struct wim_inode *inode)
+{
+	for (unsigned i = 0; i < inode->i_num_streams; i++) {
+		struct blob_descriptor *blob, *new_blob;
+		int ret;
+
+		blob = stream_blob_resolved(&inode->i_streams[i]);
+		if (!blob)
+			continue;
+		if (blob->unhashed) {
+			ret = hash_unhashed_blob(blob, spill->blob_table,
+						 &new_blob);
+			if (ret)
+				return ret;
+			if (new_blob != blob)
+				free_blob_descriptor(blob);
+			blob = new_blob;
+		}
+		if (blob_is_in_file(blob) && blob->file_inode == inode)
+			blob->file_inode = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Write the children of the resident directory @dir to the spill file and free
+ * them, after doing the same for its subdirectories.  The whole subtree must be
+ * spillable.  On failure, the tree is still consistent, but @dir may not have
+ * been spilled.
+ */
+static int
+spill_dir(struct metadata_spill *spill, struct wim_dentry *dir)
+{
+	struct wim_dentry *child;
+	u64 subtree_size = 8;
+	u64 record_offset;
+	u8 *p;
+	int ret;
+
+	unlist_dir(dir);
+
+	for_dentry_child(child, dir) {
+		if (dentry_is_directory(child) && !child->d_children_unloaded) {
+			ret = spill_dir(spill, child);
+			if (ret)
+				return ret;
+		}
+	}
+
+	for_dentry_child(child, dir) {
+		if (child->d_children_unloaded) {
+			u64 size;
+
+			ret = spilled_subtree_size(spill, child, &size);
+			if (ret)
+				return ret;
+			subtree_size += size;
+		}
+		ret = spill_inode_blobs(spill, child->d_inode);
+		if (ret)
+			return ret;
+		subtree_size += dentry_out_total_length(child);
+	}
+
+	record_offset = spill->flushed_size + spill->buf_used;
+	ret = metadata_spill_reserve(spill, 8, &p);
+	if (ret)
+		return ret;
+	store_le64_unaligned(cpu_to_le64(subtree_size), p);
+	spill->buf_used += 8;
+
+	for_dentry_child(child, dir) {
+		size_t len = dentry_out_total_length(child);
+
+		ret = metadata_spill_reserve(spill, len, &p);
+		if (ret)
+			return ret;
+		write_dentry(child, p);
+		spill->buf_used += len;
+	}
+
+	ret = metadata_spill_reserve(spill, 8, &p);
+	if (ret)
+		return ret;
+	memset(p, 0, 8);
+	spill->buf_used += 8;
+
+	unread_dentry_subdir(dir);
+	dir->d_subdir_offset = record_offset + 8;
+	return 0;
+}
+
+/*
+ * Return true if the subtree of the resident directory @dir is spillable.
+ * Otherwise, mark @dir as unspillable and spill whichever subtrees below it are
+ * spillable.  Either way, remove the directories in the subtree from the list
+ * of completed directories.
+ */
+static bool
+prepare_to_spill(struct metadata_spill *spill, struct wim_dentry *dir)
+{
+	struct wim_dentry *child;
+	bool spillable = true;
+
+	unlist_dir(dir);
+
+	/* Check all the children, so that the unspillable subdirectories are
+	 * marked and processed now.  */
+	for_dentry_child(child, dir) {
+		const struct wim_inode *inode = child->d_inode;
+
+		if (!inode->i_single_link || inode->i_nlink != 1)
+			spillable = false;
+		if (dentry_is_directory(child) && !child->d_children_unloaded &&
+		    (child->d_unspillable || !prepare_to_spill(spill, child)))
+			spillable = false;
+	}
+	if (spillable)
+		return true;
+
+	dir->d_unspillable = 1;
+	for_dentry_child(child, dir) {
+		if (dentry_is_directory(child) &&
+		    !child->d_children_unloaded && !child->d_unspillable &&
+		    !spill->error)
+			spill->error = spill_dir(spill, child);
+	}
+	return false;
+}
+
+static void
+spill_completed_dirs(struct metadata_spill *spill)
+{
+	while (!list_empty(&spill->completed) && !spill->error) {
+		struct wim_dentry *dir = list_last_entry(&spill->completed,
+							 struct wim_dentry,
+							 d_tmp_list);
+
+		/* This is the most recently completed directory, so its
+		 * completed subdirectories are spilled along with it.  */
+		if (prepare_to_spill(spill, dir))
+			spill->error = spill_dir(spill, dir);
+	}
+}
+
+/*
+ * Note that the scan has attached the newly scanned tree @child, which is not
+ * NULL, to its parent directory.  Every so often, this spills the directories
+ * that have been completed since the last time.
+ */
+void
+metadata_spill_attached(struct metadata_spill *spill, struct wim_dentry *child)
+{
+	if (dentry_is_directory(child) && dentry_has_children(child))
+		list_add_tail(&child->d_tmp_list, &spill->completed);
+
+	if (++spill->num_attached >= SPILL_INTERVAL) {
+		spill_completed_dirs(spill);
+		spill->num_attached = 0;
+	}
+}
+
+static int
+unlist_resident_dir(struct wim_dentry *dentry, void *_ignore)
+{
+	if (dentry_is_directory(dentry) && !dentry->d_children_unloaded)
+		unlist_dir(dentry);
+	return 0;
+}
+
+struct load_spilled_ctx {
+	const u8 *data;
+	size_t data_len;
+	struct dentry_arena *arena;
+};
+
+static int
+load_spilled_dir(struct wim_dentry *dentry, void *_ctx)
+{
+	const struct load_spilled_ctx *ctx = _ctx;
+
+	if (!dentry->d_children_unloaded)
+		return 0;
+	return read_dentry_subdir(ctx->data, ctx->data_len, ctx->arena,
+				  dentry);
+}
+
+/*
+ * Free @tree, a tree that was scanned with @spill but won't be used, and
+ * release the blobs that it references.  The spilled directories in it have to
+ * be loaded back for the latter.
+ */
+void
+metadata_spill_free_tree(struct metadata_spill *spill, struct wim_dentry *tree)
+{
+	struct load_spilled_ctx ctx = {};
+	int ret;
+
+	if (!tree)
+		return;
+
+	for_dentry_in_tree(tree, unlist_resident_dir, NULL);
+
+	if (spill->flushed_size + spill->buf_used != 0) {
+		ret = metadata_spill_get_data(spill);
+		if (!ret) {
+			ctx.arena = new_dentry_arena();
+			if (!ctx.arena)
+				ret = WIMLIB_ERR_NOMEM;
+		}
+		if (!ret) {
+			ctx.data = spill->data;
+			ctx.data_len = spill->data_len;
+			ret = for_dentry_in_tree(tree, load_spilled_dir, &ctx);
+		}
+		if (ret)
+			WARNING("Failed to reload spilled directories; some "
+				"blob reference counts may be too high");
+	}
+
+	free_dentry_tree(tree, spill->blob_table);
+	free_dentry_arena(ctx.arena);
+	metadata_spill_put_data(spill);
+}
+
+/*
+ * Finish spilling after a successful scan.  The directories that haven't been
+ * spilled yet stay in memory.  On success, the contents of the spill file are
+ * returned in *@buf_ret and *@buf_len_ret, which is 0 if nothing was spilled.
+ * They remain valid until the spill is freed.
+ */
+int
+metadata_spill_finish(struct metadata_spill *spill, const u8 **buf_ret,
+		      size_t *buf_len_ret)
+{
+	int ret;
+
+	while (!list_empty(&spill->completed))
+		unlist_dir(list_first_entry(&spill->completed,
+					    struct wim_dentry, d_tmp_list));
+	if (spill->error)
+		return spill->error;
+
+	ret = metadata_spill_get_data(spill);
+	if (ret)
+		return ret;
+	FREE(spill->buf);
+	spill->buf = NULL;
+	spill->buf_size = 0;
+	*buf_ret = spill->data;
+	*buf_len_ret = spill->data_len;
+	return 0;
+}
@@ -55,6 +55,11 @@ struct swm_info {
 	unsigned num_alloc_parts;
 	u64 total_bytes;
 	u64 max_part_size;
+
+	/* The solid resource whose blobs are currently being added, if any.
+	 * All blobs of a solid resource are placed in the same part so that
+	 * the resource can be copied as-is, without recompression.  */
+	const struct wim_resource_descriptor *cur_solid_rdesc;
 };
 
 static int
@@ -173,10 +178,24 @@ add_blob_to_swm(struct blob_descriptor *blob, void *_swm_info)
 	u64 blob_stored_size;
 	int ret;
 
-	if (blob->blob_location == BLOB_IN_WIM)
+	if (blob->blob_location == BLOB_IN_WIM &&
+	    (blob->rdesc->flags & WIM_RESHDR_FLAG_SOLID))
+	{
+		/* Blobs are visited in sequential order, so the blobs of a
+		 * solid resource are visited consecutively.  The first blob
+		 * accounts for the whole resource; the rest just join it.  */
+		if (blob->rdesc == swm_info->cur_solid_rdesc) {
+			list_add_tail(&blob->write_blobs_list,
+				      &swm_info->parts[swm_info->num_parts - 1].blob_list);
+			return 0;
+		}
+		swm_info->cur_solid_rdesc = blob->rdesc;
 		blob_stored_size = blob->rdesc->size_in_wim;
-	else
+	} else if (blob->blob_location == BLOB_IN_WIM) {
+		blob_stored_size = blob->rdesc->size_in_wim;
+	} else {
 		blob_stored_size = blob->size;
+	}
 
 	/* Start the next part if adding this blob exceeds the maximum part
 	 * size, UNLESS the blob is metadata or if no blobs at all have been
@@ -217,12 +236,6 @@ wimlib_split(WIMStruct *wim, const tchar *swm_name,
 	if (!wim_has_metadata(wim))
 		return WIMLIB_ERR_METADATA_NOT_FOUND;
 
-	if (wim_has_solid_resources(wim)) {
-		ERROR("Splitting of WIM containing solid resources is not supported.\n"
-		      "        Export it in non-solid format first.");
-		return WIMLIB_ERR_UNSUPPORTED;
-	}
-
 	for (i = 0; i < wim->hdr.image_count; i++) {
 		if (!is_image_unchanged_from_wim(wim->image_metadata[i], wim)) {
 			ERROR("Only an unmodified, on-disk WIM file can be split.");
@@ -250,6 +263,14 @@ wimlib_split(WIMStruct *wim, const tchar *swm_name,
 	if (ret)
 		goto out_free_swm_info;
 
+	/* Keep solid resources solid, so that each one is copied into its part
+	 * without being decompressed and recompressed.  Solid resources can't
+	 * be stored in pipable WIMs, though; if a pipable split WIM was
+	 * requested, they'll be recompressed as non-solid resources.  */
+	if (wim_has_solid_resources(wim) &&
+	    !(write_flags & WIMLIB_WRITE_FLAG_PIPABLE))
+		write_flags |= WIMLIB_WRITE_FLAG_SOLID;
+
 	ret = write_split_wim(wim, swm_name, &swm_info, write_flags);
 out_free_swm_info:
 	FREE(swm_info.parts);
@@ -0,0 +1,277 @@
+/*
+ * stats.c
+ *
+ * Performance counters, as returned by wimlib_get_stats().
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#  include <windows.h>
+#endif
+
+#include "wimlib/bitops.h"
+#include "wimlib/error.h"
+#include "wimlib/progress.h"
+#include "wimlib/stats.h"
+#include "wimlib/threads.h"
+
+struct wimlib_stats global_stats;
+
+u64
+stats_now_ns(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (u64)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+u64
+stats_cpu_ns(void)
+{
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit,
+			     &kernel, &user))
+		return 0;
+	/* FILETIMEs are in units of 100 nanoseconds.  */
+	return ((((u64)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+		(((u64)user.dwHighDateTime << 32) | user.dwLowDateTime)) * 100;
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts))
+		return 0;
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Send the current counters to the progress function, if any.  */
+int
+report_stats(wimlib_progress_func_t progfunc, void *progctx)
+{
+	union wimlib_progress_info progress;
+	struct wimlib_stats stats;
+
+	if (!progfunc)
+		return 0;
+	wimlib_get_stats(&stats);
+	progress.stats.stats = &stats;
+	return call_progress(progfunc, WIMLIB_PROGRESS_MSG_STATS,
+			     &progress, progctx);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_get_stats(struct wimlib_stats *stats)
+{
+	const u64 *src = (const u64 *)&global_stats;
+	u64 *dst = (u64 *)stats;
+
+	/* Read each counter atomically, though not all at the same time.  */
+	for (size_t i = 0; i < sizeof(*stats) / sizeof(u64); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_reset_stats(void)
+{
+	struct wimlib_stats mem = global_stats;
+
+	/* The memory counters track allocations that are still live.  */
+	memset(&global_stats, 0, sizeof(global_stats));
+	global_stats.metadata_mem = mem.metadata_mem;
+	global_stats.metadata_mem_peak = mem.metadata_mem;
+	global_stats.blob_table_mem = mem.blob_table_mem;
+	global_stats.blob_table_mem_peak = mem.blob_table_mem;
+	global_stats.compressor_mem = mem.compressor_mem;
+	global_stats.compressor_mem_peak = mem.compressor_mem;
+	global_stats.io_buffer_mem = mem.io_buffer_mem;
+	global_stats.io_buffer_mem_peak = mem.io_buffer_mem;
+}
+
+bool syscall_profiling_enabled;
+
+/* Add a system call that started at @start, as returned by stats_now_ns(), and
+ * has just returned, to the histogram for its type.  */
+void
+record_syscall_latency(enum wimlib_syscall_type type, u64 start)
+{
+	u64 ns = stats_now_ns() - start;
+	u64 us = ns / 1000;
+	unsigned bucket = 0;
+
+	if (us)
+		bucket = min(bsr64(us) + 1, WIMLIB_LATENCY_HISTOGRAM_BUCKETS - 1);
+	STATS_ADD(syscall_latency[type].calls, 1);
+	STATS_ADD(syscall_latency[type].total_ns, ns);
+	STATS_ADD(syscall_latency[type].buckets[bucket], 1);
+	stats_update_max(&global_stats.syscall_latency[type].max_ns, ns);
+}
+
+bool trace_enabled;
+static FILE *trace_file;
+static struct mutex trace_lock = MUTEX_INITIALIZER;
+static u64 trace_start_ns;
+static unsigned trace_next_tid = 1;
+static bool trace_need_comma;
+
+/* Start a new event in the trace file.  Must hold trace_lock.  */
+static void
+trace_begin_event(void)
+{
+	fputs(trace_need_comma ? ",\n" : "[\n", trace_file);
+	trace_need_comma = true;
+}
+
+static void
+trace_print_time(const char *key, u64 ns)
+{
+	/* Timestamps are in microseconds.  */
+	fprintf(trace_file, "\"%s\":%"PRIu64".%03u", key, ns / 1000,
+		(unsigned)(ns % 1000));
+}
+
+static void
+trace_name_thread(unsigned tid, const char *name, unsigned idx)
+{
+	trace_begin_event();
+	fprintf(trace_file, "{\"ph\":\"M\",\"name\":\"thread_name\","
+		"\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s", tid, name);
+	if (tid != 0)
+		fprintf(trace_file, " %u", idx);
+	fputs("\"}}", trace_file);
+}
+
+/* Start tracing if WIMLIB_TRACE_FILE is set.  Called by wimlib_global_init(),
+ * before any threads are created.  */
+void
+init_trace(void)
+{
+	const char *path = getenv("WIMLIB_TRACE_FILE");
+
+	if (!path || !*path || trace_file)
+		return;
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		WARNING_WITH_ERRNO("Can't open trace file \"%s\"", path);
+		return;
+	}
+	trace_start_ns = stats_now_ns();
+	trace_name_thread(0, "caller", 0);
+	trace_enabled = true;
+}
+
+void
+flush_trace(void)
+{
+	if (!trace_enabled)
+		return;
+	mutex_lock(&trace_lock);
+	if (trace_file)
+		fflush(trace_file);
+	mutex_unlock(&trace_lock);
+}
+
+void
+cleanup_trace(void)
+{
+	if (!trace_enabled)
+		return;
+	mutex_lock(&trace_lock);
+	trace_enabled = false;
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	trace_file = NULL;
+	trace_need_comma = false;
+	mutex_unlock(&trace_lock);
+}
+
+/* Assign a trace thread number to a new thread, and name the thread in the
+ * trace "@name @idx".  */
+unsigned
+trace_register_thread(const char *name, unsigned idx)
+{
+	unsigned tid;
+
+	if (!trace_enabled)
+		return 0;
+	mutex_lock(&trace_lock);
+	tid = trace_next_tid++;
+	if (trace_file)
+		trace_name_thread(tid, name, idx);
+	mutex_unlock(&trace_lock);
+	return tid;
+}
+
+void
+trace_span(unsigned tid, const char *name, u64 start_ns, u64 end_ns)
+{
+	if (!trace_enabled)
+		return;
+	mutex_lock(&trace_lock);
+	if (!trace_file)
+		goto out_unlock;
+	trace_begin_event();
+	fprintf(trace_file, "{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,"
+		"\"tid\":%u,", name, tid);
+	trace_print_time("ts", start_ns - trace_start_ns);
+	fputc(',', trace_file);
+	trace_print_time("dur", end_ns - start_ns);
+	fputc('}', trace_file);
+out_unlock:
+	mutex_unlock(&trace_lock);
+}
+
+void
+trace_counter(const char *name, u64 value)
+{
+	if (!trace_enabled)
+		return;
+	mutex_lock(&trace_lock);
+	if (!trace_file)
+		goto out_unlock;
+	trace_begin_event();
+	fprintf(trace_file, "{\"ph\":\"C\",\"name\":\"%s\",\"pid\":1,",
+		name);
+	trace_print_time("ts", stats_now_ns() - trace_start_ns);
+	fprintf(trace_file, ",\"args\":{\"value\":%"PRIu64"}}", value);
+out_unlock:
+	mutex_unlock(&trace_lock);
+}
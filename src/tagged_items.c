@@ -50,26 +50,43 @@ struct tagged_item_header {
 	/* then zero-padded to an 8-byte boundary */
 } __attribute__((aligned(8)));
 
+#define NO_ITEM		UINT32_MAX
+
 /*
- * Retrieve from @inode the first metadata item that is tagged with @tag and
- * contains at least @min_len bytes of data.  If found, return a pointer to the
- * item's data and write its actual length to @actual_len_ret if not NULL.  If
- * not found, return NULL.
+ * Map a tag to its slot in the item_offsets[] of struct wim_inode_extra, or
+ * return -1 if items with the tag aren't indexed.  All the tags defined in
+ * tagged_items.h are indexed; they form two runs of consecutive values.
  */
-void *
-inode_get_tagged_item(const struct wim_inode *inode, u32 tag, u32 min_len,
-		      u32 *actual_len_ret)
+static inline int
+tag_to_index(u32 tag)
 {
-	struct tagged_item_header *hdr;
-	size_t len_remaining;
+	STATIC_ASSERT(TAG_XATTRS == TAG_OBJECT_ID + 1);
+	STATIC_ASSERT(TAG_WIMLIB_NTFS_USN_INFO == TAG_WIMLIB_UNIX_DATA + 3);
+	STATIC_ASSERT(NUM_INDEXED_TAGS == 6);
 
-	STATIC_ASSERT(sizeof(*hdr) == 8);
+	if (tag - TAG_OBJECT_ID <= TAG_XATTRS - TAG_OBJECT_ID)
+		return tag - TAG_OBJECT_ID;
+	if (tag - TAG_WIMLIB_UNIX_DATA <=
+	    TAG_WIMLIB_NTFS_USN_INFO - TAG_WIMLIB_UNIX_DATA)
+		return 2 + (tag - TAG_WIMLIB_UNIX_DATA);
+	return -1;
+}
 
-	if (!inode->i_extra)
-		return NULL;
+/*
+ * Search @extra for the first tagged item that is tagged with @tag and contains
+ * at least @min_len bytes of data, starting at @offset, which must be the
+ * offset of an item or the end of the data.  Returns the item's header, or NULL
+ * if not found or if a corrupted item was reached first.
+ */
+static struct tagged_item_header *
+search_tagged_items(const struct wim_inode_extra *extra, size_t offset,
+		    u32 tag, u32 min_len)
+{
+	struct tagged_item_header *hdr;
+	size_t len_remaining;
 
-	hdr = (struct tagged_item_header *)inode->i_extra->data;
-	len_remaining = inode->i_extra->size;
+	hdr = (struct tagged_item_header *)&extra->data[offset];
+	len_remaining = extra->size - offset;
 
 	/* Iterate through the tagged items. */
 	while (len_remaining >= sizeof(*hdr) + min_len) {
@@ -81,11 +98,8 @@ inode_get_tagged_item(const struct wim_inode *inode, u32 tag, u32 min_len,
 			return NULL;
 
 		/* Matches the item we wanted? */
-		if (le32_to_cpu(hdr->tag) == tag && len >= min_len) {
-			if (actual_len_ret)
-				*actual_len_ret = len;
-			return hdr->data;
-		}
+		if (le32_to_cpu(hdr->tag) == tag && len >= min_len)
+			return hdr;
 
 		len_remaining -= full_len;
 		hdr = (struct tagged_item_header *)((u8 *)hdr + full_len);
@@ -93,6 +107,81 @@ inode_get_tagged_item(const struct wim_inode *inode, u32 tag, u32 min_len,
 	return NULL;
 }
 
+/*
+ * (Re)build the index of the tagged items in @extra: the offset of the first
+ * item with each indexed tag.  Items after a corrupted item aren't indexed,
+ * since searching the items stops there too.
+ */
+void
+index_tagged_items(struct wim_inode_extra *extra)
+{
+	size_t offset = 0;
+
+	for (int i = 0; i < NUM_INDEXED_TAGS; i++)
+		extra->item_offsets[i] = NO_ITEM;
+
+	while (extra->size - offset >= sizeof(struct tagged_item_header)) {
+		const struct tagged_item_header *hdr =
+			(const struct tagged_item_header *)&extra->data[offset];
+		u32 len = le32_to_cpu(hdr->length);
+		u32 full_len = sizeof(*hdr) + ALIGN(len, 8);
+		int idx;
+
+		if (unlikely(full_len < len || full_len > extra->size - offset))
+			break;
+
+		idx = tag_to_index(le32_to_cpu(hdr->tag));
+		if (idx >= 0 && extra->item_offsets[idx] == NO_ITEM)
+			extra->item_offsets[idx] = offset;
+		offset += full_len;
+	}
+}
+
+/*
+ * Retrieve from @inode the first metadata item that is tagged with @tag and
+ * contains at least @min_len bytes of data.  If found, return a pointer to the
+ * item's data and write its actual length to @actual_len_ret if not NULL.  If
+ * not found, return NULL.
+ *
+ * For an indexed tag this usually takes no searching at all: the first item
+ * with the tag is known, and only if it is too short are the following items
+ * searched.
+ */
+void *
+inode_get_tagged_item(const struct wim_inode *inode, u32 tag, u32 min_len,
+		      u32 *actual_len_ret)
+{
+	const struct wim_inode_extra *extra = inode->i_extra;
+	struct tagged_item_header *hdr;
+	size_t offset = 0;
+	int idx;
+
+	STATIC_ASSERT(sizeof(*hdr) == 8);
+
+	if (!extra)
+		return NULL;
+
+	idx = tag_to_index(tag);
+	if (idx >= 0) {
+		if (extra->item_offsets[idx] == NO_ITEM)
+			return NULL;
+		offset = extra->item_offsets[idx];
+		hdr = (struct tagged_item_header *)&extra->data[offset];
+		if (le32_to_cpu(hdr->length) < min_len) {
+			offset += sizeof(*hdr) +
+				  ALIGN(le32_to_cpu(hdr->length), 8);
+			hdr = search_tagged_items(extra, offset, tag, min_len);
+		}
+	} else {
+		hdr = search_tagged_items(extra, offset, tag, min_len);
+	}
+	if (!hdr)
+		return NULL;
+	if (actual_len_ret)
+		*actual_len_ret = le32_to_cpu(hdr->length);
+	return hdr->data;
+}
+
 /*
  * Add a tagged item to the specified inode and return a pointer to its
  * uninitialized data, which the caller must initialize.  No check is made for
@@ -105,18 +194,27 @@ inode_add_tagged_item(struct wim_inode *inode, u32 tag, u32 len)
 	struct tagged_item_header *hdr;
 	size_t oldsize = (inode->i_extra ? inode->i_extra->size : 0);
 	size_t newsize = oldsize + sizeof(*hdr) + ALIGN(len, 8);
+	int idx;
 
 	wimlib_assert(oldsize % 8 == 0);
 
 	extra = REALLOC(inode->i_extra, sizeof(*extra) + newsize);
 	if (!extra)
 		return NULL;
+	if (!inode->i_extra) {
+		for (int i = 0; i < NUM_INDEXED_TAGS; i++)
+			extra->item_offsets[i] = NO_ITEM;
+	}
 	inode->i_extra = extra;
 	extra->size = newsize;
 	hdr = (struct tagged_item_header *)&extra->data[oldsize];
 	hdr->tag = cpu_to_le32(tag);
 	hdr->length = cpu_to_le32(len);
 	memset(hdr->data + len, 0, -len & 7); /* pad to next 8-byte boundary */
+
+	idx = tag_to_index(tag);
+	if (idx >= 0 && extra->item_offsets[idx] == NO_ITEM)
+		extra->item_offsets[idx] = oldsize;
 	return hdr->data;
 }
 
@@ -140,6 +238,9 @@ inode_set_tagged_item(struct wim_inode *inode, u32 tag,
 		memmove(p, p + old_len, (inode->i_extra->data +
 					 inode->i_extra->size) - (p + old_len));
 		inode->i_extra->size -= old_len;
+
+		/* The items after the removed one have moved.  */
+		index_tagged_items(inode->i_extra);
 	}
 
 	/* Add the new item */
@@ -228,3 +329,41 @@ inode_set_unix_data(struct wim_inode *inode, struct wimlib_unix_data *unix_data,
 		p->rdev = cpu_to_le32(unix_data->rdev);
 	return true;
 }
+
+struct wimlib_unix_change_info_disk {
+	le64 ino;
+	le64 ctime;
+};
+
+/* Get the inode number and status change time that were recorded for an inode
+ * when it was captured.  Returns %false if none were recorded.  */
+bool
+inode_get_unix_change_info(const struct wim_inode *inode,
+			   struct wimlib_unix_change_info *info)
+{
+	const struct wimlib_unix_change_info_disk *p;
+
+	p = inode_get_tagged_item(inode, TAG_WIMLIB_UNIX_CHANGE_INFO,
+				  sizeof(*p), NULL);
+	if (!p)
+		return false;
+
+	info->ino = le64_to_cpu(p->ino);
+	info->ctime = le64_to_cpu(p->ctime);
+	return true;
+}
+
+/* Record an inode's inode number and status change time.  Returns %true if
+ * successful, %false if failed (out of memory).  */
+bool
+inode_set_unix_change_info(struct wim_inode *inode,
+			   const struct wimlib_unix_change_info *info)
+{
+	struct wimlib_unix_change_info_disk p = {
+		.ino = cpu_to_le64(info->ino),
+		.ctime = cpu_to_le64(info->ctime),
+	};
+
+	return inode_set_tagged_item(inode, TAG_WIMLIB_UNIX_CHANGE_INFO,
+				     &p, sizeof(p));
+}
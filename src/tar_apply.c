@@ -0,0 +1,818 @@
+/*
+ * tar_apply.c
+ *
+ * Write a WIM image as a tar archive, rather than extracting it to a directory
+ * (WIMLIB_EXTRACT_FLAG_TAR).
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * The archive is in the POSIX pax format: each entry has a ustar header, which
+ * is preceded by a pax extended header only when something doesn't fit in the
+ * ustar header (a long path or link target, or a large size, ID, or timestamp)
+ * or when there are extended attributes to store.
+ *
+ * In a tar archive, the data of each file directly follows its header, so the
+ * directories, empty files, and special files are written first, and then the
+ * other files as their data is read from the WIM, i.e. in the order in which
+ * it's laid out in the WIM.  Each further link to a file is written as a hard
+ * link entry right after the file.  A blob shared by several files that aren't
+ * hard links is extracted to a temporary file by the common extraction code and
+ * replayed for each of them (see 'single_blob_target').
+ */
+
+#ifndef _WIN32
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#  include <sys/sysmacros.h>
+#endif
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "wimlib/apply.h"
+#include "wimlib/assert.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/dentry.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/reparse.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/unix_data.h"
+#include "wimlib/xattr.h"
+
+#define TAR_BLOCK_SIZE		512
+
+/* Size of the buffer in which the archive is accumulated before being written
+ */
+#define TAR_BUFFER_SIZE		65536
+
+/* Name of the pseudo-file of a pax extended header, as written by star and
+ * GNU tar  */
+#define PAX_HEADER_NAME		"././@PaxHeader"
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+#define TAR_TYPE_REGULAR	'0'
+#define TAR_TYPE_HARD_LINK	'1'
+#define TAR_TYPE_SYMLINK	'2'
+#define TAR_TYPE_CHAR_DEVICE	'3'
+#define TAR_TYPE_BLOCK_DEVICE	'4'
+#define TAR_TYPE_DIRECTORY	'5'
+#define TAR_TYPE_FIFO		'6'
+#define TAR_TYPE_PAX_HEADER	'x'
+
+static const u8 zero_block[TAR_BLOCK_SIZE];
+
+struct tar_apply_ctx {
+	/* Extraction context: must be first  */
+	struct apply_ctx common;
+
+	/* The archive being written, and whether it's standard output  */
+	struct filedes out_fd;
+	bool to_stdout;
+
+	/* Data not yet written to the archive  */
+	u8 *buf;
+	size_t buf_used;
+
+	/* Buffers for the path of the current entry and for the path of the
+	 * first link to a file, each of 'path_max' bytes  */
+	char *pathbuf;
+	char *linkbuf;
+	size_t path_max;
+
+	/* pax extended header records of the current entry  */
+	char *pax;
+	size_t pax_len;
+	size_t pax_alloc;
+
+	/* Reparse data of the symbolic link being extracted  */
+	u8 reparse_data[REPARSE_DATA_MAX_SIZE];
+	u8 *reparse_ptr;
+
+	unsigned long num_sockets_ignored;
+};
+
+static int
+tar_get_supported_features(const char *target,
+			   struct wim_features *supported_features)
+{
+	supported_features->hard_links = 1;
+	supported_features->symlink_reparse_points = 1;
+	supported_features->unix_data = 1;
+	supported_features->timestamps = 1;
+	supported_features->case_sensitive_filenames = 1;
+	supported_features->xattrs = 1;
+	return 0;
+}
+
+static int
+tar_flush(struct tar_apply_ctx *ctx)
+{
+	if (full_write(&ctx->out_fd, ctx->buf, ctx->buf_used)) {
+		ERROR_WITH_ERRNO("Error writing tar archive \"%s\"",
+				 ctx->common.target);
+		return WIMLIB_ERR_WRITE;
+	}
+	ctx->buf_used = 0;
+	return 0;
+}
+
+static int
+tar_write(struct tar_apply_ctx *ctx, const void *data, size_t size)
+{
+	int ret;
+
+	if (size > TAR_BUFFER_SIZE - ctx->buf_used) {
+		ret = tar_flush(ctx);
+		if (ret)
+			return ret;
+		/* Write large chunks of file data directly.  */
+		if (size >= TAR_BUFFER_SIZE) {
+			if (full_write(&ctx->out_fd, data, size)) {
+				ERROR_WITH_ERRNO("Error writing tar archive "
+						 "\"%s\"", ctx->common.target);
+				return WIMLIB_ERR_WRITE;
+			}
+			return 0;
+		}
+	}
+	memcpy(&ctx->buf[ctx->buf_used], data, size);
+	ctx->buf_used += size;
+	return 0;
+}
+
+/* Pad data of @size bytes with zeroes to a whole number of blocks.  */
+static int
+tar_pad(struct tar_apply_ctx *ctx, u64 size)
+{
+	size_t rem = size % TAR_BLOCK_SIZE;
+
+	if (rem == 0)
+		return 0;
+	return tar_write(ctx, zero_block, TAR_BLOCK_SIZE - rem);
+}
+
+/* Returns the number of characters needed to represent the path to @dentry in
+ * the archive, with a separator after each component but not counting the
+ * null terminator.  */
+static size_t
+tar_dentry_path_length(const struct wim_dentry *dentry)
+{
+	size_t len = 0;
+	const struct wim_dentry *d = dentry;
+
+	if (dentry_is_root(dentry))
+		return 2;
+	do {
+		len += d->d_extraction_name_nchars + 1;
+		d = d->d_parent;
+	} while (!dentry_is_root(d) && will_extract_dentry(d));
+	return len;
+}
+
+/* Builds the path to @dentry in the archive in @buf, and returns its length.
+ * Paths are relative, and the paths of directories end with a slash.  */
+static size_t
+tar_build_path(const struct wim_dentry *dentry, char *buf)
+{
+	size_t len = tar_dentry_path_length(dentry);
+	const struct wim_dentry *d = dentry;
+	char *p;
+
+	if (dentry_is_root(dentry)) {
+		strcpy(buf, "./");
+		return len;
+	}
+
+	/* Start with the trailing separator, which is kept only for
+	 * directories.  */
+	p = &buf[len];
+	*p = '\0';
+	*--p = '/';
+	for (;;) {
+		p -= d->d_extraction_name_nchars;
+		memcpy(p, d->d_extraction_name, d->d_extraction_name_nchars);
+		d = d->d_parent;
+		if (dentry_is_root(d) || !will_extract_dentry(d))
+			break;
+		*--p = '/';
+	}
+	if (!should_extract_as_directory(dentry->d_inode))
+		buf[--len] = '\0';
+	return len;
+}
+
+/* Set a numeric field of a ustar header, as octal digits and a null terminator.
+ * Returns false if the value is too large for the field.  */
+static bool
+tar_set_number(char *field, size_t size, u64 value)
+{
+	size_t i = size - 1;
+
+	if (value >> (3 * i))
+		return false;
+	field[i] = '\0';
+	while (i--) {
+		field[i] = '0' + (value & 7);
+		value >>= 3;
+	}
+	return true;
+}
+
+/* Append a record to the pax extended header of the current entry.  Each
+ * record is "LENGTH KEY=VALUE\n", where LENGTH is the decimal length of the
+ * whole record, including LENGTH itself.  */
+static int
+pax_add_record(struct tar_apply_ctx *ctx, const char *key,
+	       const void *value, size_t value_len)
+{
+	size_t len = 1 + strlen(key) + 1 + value_len + 1;
+	int ndigits = 1;
+	char *p;
+
+	while (snprintf(NULL, 0, "%zu", len + ndigits) != ndigits)
+		ndigits++;
+	len += ndigits;
+
+	if (ctx->pax_len + len > ctx->pax_alloc) {
+		size_t new_alloc = max(ctx->pax_len + len, ctx->pax_alloc * 2);
+		char *new_pax = REALLOC(ctx->pax, new_alloc);
+
+		if (!new_pax)
+			return WIMLIB_ERR_NOMEM;
+		ctx->pax = new_pax;
+		ctx->pax_alloc = new_alloc;
+	}
+	p = &ctx->pax[ctx->pax_len];
+	p += sprintf(p, "%zu %s=", len, key);
+	p = mempcpy(p, value, value_len);
+	*p = '\n';
+	ctx->pax_len += len;
+	return 0;
+}
+
+static int
+pax_add_number(struct tar_apply_ctx *ctx, const char *key, s64 value)
+{
+	char buf[32];
+
+	return pax_add_record(ctx, key, buf,
+			      sprintf(buf, "%"PRId64, value));
+}
+
+/* Add the Linux extended attributes of @inode to the pax extended header, with
+ * the "SCHILY.xattr." prefix used by star, GNU tar, and bsdtar.  */
+static int
+pax_add_xattrs(struct tar_apply_ctx *ctx, const struct wim_inode *inode,
+	       const char *path)
+{
+	const void *entries;
+	const void *entries_end;
+	u32 entries_size;
+	bool is_old_format;
+	char key[13 + WIM_XATTR_NAME_MAX + 1];
+
+	entries = inode_get_linux_xattrs(inode, &entries_size, &is_old_format);
+	if (!entries)
+		return 0;
+	entries_end = entries + entries_size;
+
+	memcpy(key, "SCHILY.xattr.", 13);
+	for (const void *entry = entries;
+	     entry < entries_end;
+	     entry = is_old_format ? (const void *)old_xattr_entry_next(entry) :
+				     (const void *)xattr_entry_next(entry))
+	{
+		bool valid;
+		u16 name_len;
+		const void *value;
+		u32 value_len;
+		int ret;
+
+		if (is_old_format) {
+			valid = old_valid_xattr_entry(entry,
+						      entries_end - entry);
+		} else {
+			valid = valid_xattr_entry(entry, entries_end - entry);
+		}
+		if (!valid) {
+			ERROR("\"%s\": extended attribute is corrupt or unsupported",
+			      path);
+			return WIMLIB_ERR_INVALID_XATTR;
+		}
+		if (is_old_format) {
+			const struct wimlib_xattr_entry_old *e = entry;
+
+			name_len = le16_to_cpu(e->name_len);
+			memcpy(&key[13], e->name, name_len);
+			value = e->name + name_len;
+			value_len = le32_to_cpu(e->value_len);
+		} else {
+			const struct wim_xattr_entry *e = entry;
+
+			name_len = e->name_len;
+			memcpy(&key[13], e->name, name_len);
+			value = e->name + name_len + 1;
+			value_len = le16_to_cpu(e->value_len);
+		}
+		key[13 + name_len] = '\0';
+
+		ret = pax_add_record(ctx, key, value, value_len);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void
+tar_set_checksum(struct tar_header *hdr)
+{
+	const u8 *p = (const u8 *)hdr;
+	u32 sum = 0;
+
+	memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+	for (size_t i = 0; i < sizeof(*hdr); i++)
+		sum += p[i];
+	tar_set_number(hdr->chksum, 7, sum);
+}
+
+static void
+tar_init_header(struct tar_header *hdr, char typeflag)
+{
+	STATIC_ASSERT(sizeof(*hdr) == TAR_BLOCK_SIZE);
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->typeflag = typeflag;
+	memcpy(hdr->magic, "ustar", 6);
+	memcpy(hdr->version, "00", 2);
+}
+
+/* Write the pax extended header of the current entry, if it has any records. */
+static int
+tar_write_pax_header(struct tar_apply_ctx *ctx)
+{
+	struct tar_header hdr;
+	int ret;
+
+	if (!ctx->pax_len)
+		return 0;
+
+	tar_init_header(&hdr, TAR_TYPE_PAX_HEADER);
+	memcpy(hdr.name, PAX_HEADER_NAME, sizeof(PAX_HEADER_NAME) - 1);
+	tar_set_number(hdr.mode, sizeof(hdr.mode), 0644);
+	tar_set_number(hdr.uid, sizeof(hdr.uid), 0);
+	tar_set_number(hdr.gid, sizeof(hdr.gid), 0);
+	tar_set_number(hdr.mtime, sizeof(hdr.mtime), 0);
+	tar_set_number(hdr.size, sizeof(hdr.size), ctx->pax_len);
+	tar_set_checksum(&hdr);
+
+	ret = tar_write(ctx, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = tar_write(ctx, ctx->pax, ctx->pax_len);
+	if (!ret)
+		ret = tar_pad(ctx, ctx->pax_len);
+	ctx->pax_len = 0;
+	return ret;
+}
+
+/*
+ * Write the header of an entry of the archive, preceded by a pax extended
+ * header if needed.
+ *
+ * @inode is the file, @path is its path in the archive, and @typeflag is the
+ * type of the entry.  @linkname is the target of a symbolic link or hard link,
+ * or NULL.  @size is the size of the data that will follow the header.
+ */
+static int
+tar_write_entry(struct tar_apply_ctx *ctx, const struct wim_inode *inode,
+		const char *path, size_t path_len, char typeflag,
+		const char *linkname, size_t linkname_len, u64 size)
+{
+	struct tar_header hdr;
+	struct wimlib_unix_data dat;
+	bool have_dat = false;
+	u32 mode = 0644;
+	u32 uid = 0;
+	u32 gid = 0;
+	s64 mtime;
+	int ret;
+
+	tar_init_header(&hdr, typeflag);
+
+	if (ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA)
+		have_dat = inode_get_unix_data(inode, &dat);
+	if (have_dat) {
+		mode = dat.mode & 07777;
+		uid = dat.uid;
+		gid = dat.gid;
+	} else if (typeflag == TAR_TYPE_DIRECTORY) {
+		mode = 0755;
+	} else if (typeflag == TAR_TYPE_SYMLINK) {
+		mode = 0777;
+	}
+
+	memcpy(hdr.name, path, min(path_len, sizeof(hdr.name)));
+	if (path_len > sizeof(hdr.name)) {
+		ret = pax_add_record(ctx, "path", path, path_len);
+		if (ret)
+			return ret;
+	}
+
+	if (linkname) {
+		memcpy(hdr.linkname, linkname,
+		       min(linkname_len, sizeof(hdr.linkname)));
+		if (linkname_len > sizeof(hdr.linkname)) {
+			ret = pax_add_record(ctx, "linkpath", linkname,
+					     linkname_len);
+			if (ret)
+				return ret;
+		}
+	}
+
+	tar_set_number(hdr.mode, sizeof(hdr.mode), mode);
+	if (!tar_set_number(hdr.uid, sizeof(hdr.uid), uid)) {
+		ret = pax_add_number(ctx, "uid", uid);
+		if (ret)
+			return ret;
+	}
+	if (!tar_set_number(hdr.gid, sizeof(hdr.gid), gid)) {
+		ret = pax_add_number(ctx, "gid", gid);
+		if (ret)
+			return ret;
+	}
+	if (!tar_set_number(hdr.size, sizeof(hdr.size), size)) {
+		ret = pax_add_number(ctx, "size", size);
+		if (ret)
+			return ret;
+	}
+	mtime = wim_timestamp_to_time_t(inode->i_last_write_time);
+	if (mtime < 0 || !tar_set_number(hdr.mtime, sizeof(hdr.mtime), mtime)) {
+		tar_set_number(hdr.mtime, sizeof(hdr.mtime), 0);
+		ret = pax_add_number(ctx, "mtime", mtime);
+		if (ret)
+			return ret;
+	}
+
+	if (typeflag == TAR_TYPE_CHAR_DEVICE ||
+	    typeflag == TAR_TYPE_BLOCK_DEVICE)
+	{
+		tar_set_number(hdr.devmajor, sizeof(hdr.devmajor),
+			       major(dat.rdev));
+		tar_set_number(hdr.devminor, sizeof(hdr.devminor),
+			       minor(dat.rdev));
+	}
+
+	/* A hard link shares the extended attributes of the file.  */
+	if (have_dat && typeflag != TAR_TYPE_HARD_LINK) {
+		ret = pax_add_xattrs(ctx, inode, path);
+		if (ret)
+			return ret;
+	}
+
+	ret = tar_write_pax_header(ctx);
+	if (ret)
+		return ret;
+
+	tar_set_checksum(&hdr);
+	return tar_write(ctx, &hdr, sizeof(hdr));
+}
+
+/* Write hard link entries for the aliases of @inode other than the first one,
+ * whose entry has just been written.  */
+static int
+tar_write_hard_links(struct tar_apply_ctx *ctx, const struct wim_inode *inode)
+{
+	const struct wim_dentry *first = inode_first_extraction_dentry(inode);
+	const struct wim_dentry *dentry;
+	size_t first_len;
+	size_t len;
+	int ret;
+
+	if (!first->d_next_extraction_alias)
+		return 0;
+
+	first_len = tar_build_path(first, ctx->linkbuf);
+	inode_for_each_extraction_alias(dentry, inode) {
+		if (dentry == first)
+			continue;
+		len = tar_build_path(dentry, ctx->pathbuf);
+		ret = tar_write_entry(ctx, inode, ctx->pathbuf, len,
+				      TAR_TYPE_HARD_LINK, ctx->linkbuf,
+				      first_len, 0);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* If @dentry is a directory, an empty regular file, or a special file, write
+ * its entry, along with entries for any other links to it.  */
+static int
+tar_write_if_no_data(const struct wim_dentry *dentry,
+		     struct tar_apply_ctx *ctx)
+{
+	const struct wim_inode *inode = dentry->d_inode;
+	struct wimlib_unix_data dat;
+	char typeflag = TAR_TYPE_REGULAR;
+	size_t len;
+	int ret;
+
+	if (should_extract_as_directory(inode)) {
+		len = tar_build_path(dentry, ctx->pathbuf);
+		return tar_write_entry(ctx, inode, ctx->pathbuf, len,
+				       TAR_TYPE_DIRECTORY, NULL, 0, 0);
+	}
+
+	/* Write all the links only when the first comes up.  */
+	if (dentry != inode_first_extraction_dentry(inode) ||
+	    inode_is_symlink(inode) ||
+	    inode_get_blob_for_unnamed_data_stream_resolved(inode))
+		return 0;
+
+	/* Recognize special files in UNIX_DATA mode  */
+	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
+	    inode_get_unix_data(inode, &dat) && !S_ISREG(dat.mode))
+	{
+		if (S_ISCHR(dat.mode)) {
+			typeflag = TAR_TYPE_CHAR_DEVICE;
+		} else if (S_ISBLK(dat.mode)) {
+			typeflag = TAR_TYPE_BLOCK_DEVICE;
+		} else if (S_ISFIFO(dat.mode)) {
+			typeflag = TAR_TYPE_FIFO;
+		} else {
+			/* Sockets can't be archived.  */
+			ctx->num_sockets_ignored++;
+			return 0;
+		}
+	}
+
+	len = tar_build_path(dentry, ctx->pathbuf);
+	ret = tar_write_entry(ctx, inode, ctx->pathbuf, len, typeflag,
+			      NULL, 0, 0);
+	if (ret)
+		return ret;
+	return tar_write_hard_links(ctx, inode);
+}
+
+/* Called when starting to read a blob for extraction  */
+static int
+tar_begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
+{
+	struct tar_apply_ctx *ctx = _ctx;
+	const struct blob_extraction_target *target =
+		blob_extraction_targets(blob);
+	const struct wim_inode *inode = target->inode;
+	size_t len;
+
+	wimlib_assert(blob->out_refcnt == 1);
+
+	if (unlikely(target->stream->stream_type == STREAM_TYPE_REPARSE_POINT)) {
+		/* The entry of a symbolic link contains the link target, so it
+		 * can be written only once all the reparse data is here.  */
+		if (blob->size > REPARSE_DATA_MAX_SIZE) {
+			ERROR("Reparse data of \"%s\" has size "
+			      "%"PRIu64" bytes (exceeds %u bytes)",
+			      inode_any_full_path(inode),
+			      blob->size, REPARSE_DATA_MAX_SIZE);
+			return WIMLIB_ERR_INVALID_REPARSE_DATA;
+		}
+		ctx->reparse_ptr = ctx->reparse_data;
+		return 0;
+	}
+
+	wimlib_assert(stream_is_unnamed_data_stream(target->stream));
+
+	len = tar_build_path(inode_first_extraction_dentry(inode),
+			     ctx->pathbuf);
+	return tar_write_entry(ctx, inode, ctx->pathbuf, len,
+			       TAR_TYPE_REGULAR, NULL, 0, blob->size);
+}
+
+/* Called when the next chunk of a blob has been read for extraction  */
+static int
+tar_extract_chunk(const struct blob_descriptor *blob, u64 offset,
+		  const void *chunk, size_t size, void *_ctx)
+{
+	struct tar_apply_ctx *ctx = _ctx;
+
+	if (ctx->reparse_ptr) {
+		ctx->reparse_ptr = mempcpy(ctx->reparse_ptr, chunk, size);
+		return 0;
+	}
+	return tar_write(ctx, chunk, size);
+}
+
+/* Called when a blob has been fully read for extraction  */
+static int
+tar_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
+{
+	struct tar_apply_ctx *ctx = _ctx;
+	const struct wim_inode *inode = blob_extraction_targets(blob)->inode;
+	int ret;
+
+	if (status) {
+		ctx->reparse_ptr = NULL;
+		return status;
+	}
+
+	if (ctx->reparse_ptr) {
+		char target[REPARSE_POINT_MAX_SIZE];
+		struct blob_descriptor blob_override;
+		size_t len;
+		int res;
+
+		ctx->reparse_ptr = NULL;
+		blob_set_is_located_in_attached_buffer(&blob_override,
+						       ctx->reparse_data,
+						       blob->size);
+		res = wim_inode_readlink(inode, target, sizeof(target) - 1,
+					 &blob_override, NULL, 0);
+		if (unlikely(res < 0)) {
+			errno = -res;
+			ERROR_WITH_ERRNO("Can't read symbolic link \"%s\"",
+					 inode_any_full_path(inode));
+			return WIMLIB_ERR_READLINK;
+		}
+		len = tar_build_path(inode_first_extraction_dentry(inode),
+				     ctx->pathbuf);
+		ret = tar_write_entry(ctx, inode, ctx->pathbuf, len,
+				      TAR_TYPE_SYMLINK, target, res, 0);
+	} else {
+		ret = tar_pad(ctx, blob->size);
+	}
+	if (ret)
+		return ret;
+	return tar_write_hard_links(ctx, inode);
+}
+
+static int
+tar_open_archive(struct tar_apply_ctx *ctx)
+{
+	int raw_fd;
+
+	if (!strcmp(ctx->common.target, "-")) {
+		ctx->to_stdout = true;
+		filedes_init(&ctx->out_fd, STDOUT_FILENO);
+		return 0;
+	}
+	raw_fd = open(ctx->common.target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("Can't create tar archive \"%s\"",
+				 ctx->common.target);
+		return WIMLIB_ERR_OPEN;
+	}
+	filedes_init(&ctx->out_fd, raw_fd);
+	return 0;
+}
+
+static int
+tar_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
+{
+	struct tar_apply_ctx *ctx = (struct tar_apply_ctx *)_ctx;
+	const struct wim_dentry *dentry;
+	u64 num_files = 0;
+	int ret;
+
+	filedes_invalidate(&ctx->out_fd);
+
+	/* Allocate the buffers.  Each path needs room for its trailing slash
+	 * and null terminator.  */
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		ctx->path_max = max(ctx->path_max,
+				    tar_dentry_path_length(dentry) + 1);
+		if (should_extract_as_directory(dentry->d_inode) ||
+		    (!inode_is_symlink(dentry->d_inode) &&
+		     !inode_get_blob_for_unnamed_data_stream_resolved(
+							dentry->d_inode)))
+			num_files++;
+	}
+	ctx->buf = MALLOC(TAR_BUFFER_SIZE);
+	ctx->pathbuf = MALLOC(ctx->path_max);
+	ctx->linkbuf = MALLOC(ctx->path_max);
+	if (!ctx->buf || !ctx->pathbuf || !ctx->linkbuf) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+
+	ret = tar_open_archive(ctx);
+	if (ret)
+		goto out;
+
+	/* Write the directories, empty files, and special files.  */
+
+	ret = start_file_structure_phase(&ctx->common, num_files);
+	if (ret)
+		goto out;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (!should_extract_as_directory(dentry->d_inode) &&
+		    (inode_is_symlink(dentry->d_inode) ||
+		     inode_get_blob_for_unnamed_data_stream_resolved(
+							dentry->d_inode)))
+			continue;
+		ret = tar_write_if_no_data(dentry, ctx);
+		if (ret)
+			goto out;
+		ret = report_file_created(&ctx->common);
+		if (ret)
+			goto out;
+	}
+
+	ret = end_file_structure_phase(&ctx->common);
+	if (ret)
+		goto out;
+
+	/* Write the files that have data, and the symbolic links.  */
+
+	struct read_blob_callbacks cbs = {
+		.begin_blob	= tar_begin_extract_blob,
+		.continue_blob	= tar_extract_chunk,
+		.end_blob	= tar_end_extract_blob,
+		.ctx		= ctx,
+	};
+	ret = extract_blob_list(&ctx->common, &cbs);
+	if (ret)
+		goto out;
+
+	/* The archive ends with two blocks of zeroes.  */
+	ret = tar_write(ctx, zero_block, TAR_BLOCK_SIZE);
+	if (!ret)
+		ret = tar_write(ctx, zero_block, TAR_BLOCK_SIZE);
+	if (!ret)
+		ret = tar_flush(ctx);
+	if (ret)
+		goto out;
+
+	if (!ctx->to_stdout && filedes_close(&ctx->out_fd)) {
+		ERROR_WITH_ERRNO("Error closing tar archive \"%s\"",
+				 ctx->common.target);
+		ret = WIMLIB_ERR_WRITE;
+		goto out;
+	}
+	filedes_invalidate(&ctx->out_fd);
+
+	if (ctx->num_sockets_ignored) {
+		WARNING("%lu sockets were not archived, since tar archives "
+			"can't contain them", ctx->num_sockets_ignored);
+	}
+out:
+	if (!ctx->to_stdout && filedes_valid(&ctx->out_fd))
+		filedes_close(&ctx->out_fd);
+	FREE(ctx->buf);
+	FREE(ctx->pathbuf);
+	FREE(ctx->linkbuf);
+	FREE(ctx->pax);
+	return ret;
+}
+
+const struct apply_operations tar_apply_ops = {
+	.name			= "tar",
+	.get_supported_features = tar_get_supported_features,
+	.extract                = tar_extract,
+	.context_size           = sizeof(struct tar_apply_ctx),
+	.single_blob_target	= true,
+};
+
+#endif /* !_WIN32 */
@@ -0,0 +1,1385 @@
+/*
+ * tar_capture.c
+ *
+ * Capture a directory tree from a tar or cpio archive, without extracting the
+ * archive first.  The file data stays in the archive until the image is
+ * written, when it is read directly from the archive at its offset.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * Supported are POSIX ustar and pax archives, GNU tar archives (including long
+ * names, but not sparse files), and "newc" cpio archives, as written by
+ * 'cpio -H newc' and used for Linux initramfs images.  The archive must be a
+ * regular file, since the data of its files is read from it again when the
+ * image is written; a compressed archive must be decompressed first.
+ *
+ * As in extracting the archive, entries may be in any order and the directories
+ * they are in need not have entries of their own.  If the same path occurs
+ * more than once, only the first version is captured, as with duplicate paths
+ * in other kinds of capture.
+ */
+
+#ifndef _WIN32
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#  include <sys/sysmacros.h>
+#endif
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "wimlib/avl_tree.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/dentry.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/inode_table.h"
+#include "wimlib/reparse.h"
+#include "wimlib/scan.h"
+#include "wimlib/timestamp.h"
+#include "wimlib/unix_data.h"
+
+#define TAR_BLOCK_SIZE		512
+#define CPIO_HEADER_SIZE	110
+
+/* Limit on the size of the strings read from an archive: names, link targets,
+ * and pax extended headers  */
+#define ARCHIVE_MAX_STRING_SIZE	(1 << 20)
+
+enum archive_format {
+	ARCHIVE_FORMAT_TAR,
+	ARCHIVE_FORMAT_CPIO,
+};
+
+/* An entry of an archive, in the same form for all archive formats  */
+struct archive_entry {
+	/* Path in the archive, and for symbolic links and hard links the link
+	 * target; both are allocated  */
+	char *path;
+	char *link_target;
+
+	/* File type and permissions, as in st_mode  */
+	u32 mode;
+	u32 uid;
+	u32 gid;
+	u32 rdev_major;
+	u32 rdev_minor;
+	struct timespec mtime;
+
+	/* Size of the file's data, and its offset in the archive  */
+	u64 size;
+	u64 data_offset;
+
+	/* tar only: the entry is a hard link to an earlier entry  */
+	bool is_hard_link;
+
+	/* cpio only: the identity of the file for hard link detection  */
+	u64 dev;
+	u64 ino;
+	u32 nlink;
+};
+
+/* Values from a pax extended header which apply to the next entry  */
+struct pax_overrides {
+	char *path;
+	char *link_target;
+	u64 size;
+	struct timespec mtime;
+	u32 uid;
+	u32 gid;
+	bool has_size;
+	bool has_mtime;
+	bool has_uid;
+	bool has_gid;
+};
+
+/* A file in a cpio archive with more than one link  */
+struct cpio_link {
+	struct avl_tree_node index_node;
+	u64 dev;
+	u64 ino;
+	struct wim_inode *inode;
+};
+
+#define CPIO_LINK(node) avl_tree_entry(node, struct cpio_link, index_node)
+
+struct archive_capture_ctx {
+	struct scan_params *params;
+	struct filedes fd;
+	const char *archive_path;
+	u64 archive_size;
+	struct timespec archive_mtime;
+	enum archive_format format;
+
+	/* Offset of the next header to read  */
+	u64 offset;
+
+	struct wim_dentry *root;
+
+	/* The number given to the next explicitly archived file.  The
+	 * directories created only because files are in them keep inode number
+	 * 0, which tells them apart.  */
+	u64 next_ino;
+
+	/* cpio: files with more than one link, indexed by device and inode  */
+	struct avl_tree_node *cpio_links;
+
+	/* The directory of the previous entry, since consecutive entries
+	 * are usually in the same directory  */
+	struct wim_dentry *last_dir;
+	char *last_dir_path;
+	size_t last_dir_path_len;
+};
+
+static int
+archive_truncated(const struct archive_capture_ctx *ctx)
+{
+	ERROR("\"%s\": Archive is truncated", ctx->archive_path);
+	return WIMLIB_ERR_INVALID_ARCHIVE;
+}
+
+/* Read @size bytes at @offset of the archive, which must not extend past its
+ * end.  */
+static int
+read_archive_data(struct archive_capture_ctx *ctx, void *buf, size_t size,
+		  u64 offset)
+{
+	int ret;
+
+	if (offset > ctx->archive_size || size > ctx->archive_size - offset)
+		return archive_truncated(ctx);
+	ret = full_pread(&ctx->fd, buf, size, offset);
+	if (ret)
+		ERROR_WITH_ERRNO("\"%s\": Error reading archive",
+				 ctx->archive_path);
+	return ret;
+}
+
+/* Read a string of @size bytes at @offset of the archive into a new buffer,
+ * adding a null terminator.  The string ends at the first null byte, if any.  */
+static int
+read_archive_string(struct archive_capture_ctx *ctx, u64 size, u64 offset,
+		    char **str_ret)
+{
+	char *str;
+	int ret;
+
+	if (size > ARCHIVE_MAX_STRING_SIZE) {
+		ERROR("\"%s\": Name or header at offset %"PRIu64" is too long",
+		      ctx->archive_path, offset);
+		return WIMLIB_ERR_INVALID_ARCHIVE;
+	}
+	str = MALLOC(size + 1);
+	if (!str)
+		return WIMLIB_ERR_NOMEM;
+	ret = read_archive_data(ctx, str, size, offset);
+	if (ret) {
+		FREE(str);
+		return ret;
+	}
+	str[size] = '\0';
+	*str_ret = str;
+	return 0;
+}
+
+/* Copy a string field of a tar header, which is null-terminated unless it fills
+ * the field.  */
+static char *
+tar_field_strdup(const u8 *field, size_t len)
+{
+	size_t n = strnlen((const char *)field, len);
+	char *str = MALLOC(n + 1);
+
+	if (str) {
+		memcpy(str, field, n);
+		str[n] = '\0';
+	}
+	return str;
+}
+
+/* Parse a numeric field of a tar header: either octal digits, optionally with
+ * leading spaces and terminated by a space or null, or the GNU base-256
+ * encoding for large values, which sets the high bit of the first byte.  */
+static bool
+tar_parse_number(const u8 *field, size_t len, u64 *value_ret)
+{
+	u64 v = 0;
+	size_t i = 0;
+
+	if (field[0] & 0x80) {
+		/* Negative numbers are never valid here.  */
+		if (field[0] & 0x40)
+			return false;
+		v = field[0] & 0x3F;
+		for (i = 1; i < len; i++) {
+			if (v >> 56)
+				return false;
+			v = (v << 8) | field[i];
+		}
+		*value_ret = v;
+		return true;
+	}
+
+	while (i < len && field[i] == ' ')
+		i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+		if (v >> 61)
+			return false;
+		v = (v << 3) | (field[i] - '0');
+	}
+	if (i < len && field[i] != ' ' && field[i] != '\0')
+		return false;
+	*value_ret = v;
+	return true;
+}
+
+/* Check the checksum of a tar header.  It is the sum of the header's bytes with
+ * the checksum field itself taken as spaces; old versions of some programs
+ * summed them as signed chars.  */
+static bool
+tar_checksum_ok(const u8 hdr[TAR_BLOCK_SIZE])
+{
+	u64 stored;
+	u32 usum = 0;
+	s32 ssum = 0;
+
+	if (!tar_parse_number(&hdr[148], 8, &stored))
+		return false;
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+		u8 b = (i >= 148 && i < 156) ? ' ' : hdr[i];
+
+		usum += b;
+		ssum += (s8)b;
+	}
+	return stored == usum || stored == (u32)ssum;
+}
+
+static bool
+parse_decimal(const char *str, const char *end, u64 *value_ret)
+{
+	u64 v = 0;
+
+	if (str == end)
+		return false;
+	for (; str != end; str++) {
+		if (*str < '0' || *str > '9' || v > (UINT64_MAX - 9) / 10)
+			return false;
+		v = v * 10 + (*str - '0');
+	}
+	*value_ret = v;
+	return true;
+}
+
+/* Parse a pax timestamp: decimal seconds, optionally with a fraction.  */
+static bool
+parse_pax_time(const char *str, const char *end, struct timespec *ts)
+{
+	const char *dot = memchr(str, '.', end - str);
+	u64 sec, nsec = 0;
+
+	if (!parse_decimal(str, dot ? dot : end, &sec))
+		return false;
+	if (dot) {
+		u32 scale = 100000000;
+
+		for (const char *p = dot + 1; p != end; p++) {
+			if (*p < '0' || *p > '9')
+				return false;
+			nsec += (*p - '0') * scale;
+			scale /= 10;
+		}
+	}
+	ts->tv_sec = sec;
+	ts->tv_nsec = nsec;
+	return true;
+}
+
+static int
+pax_set_string(char **str_ret, const char *value, size_t len)
+{
+	char *str = MALLOC(len + 1);
+
+	if (!str)
+		return WIMLIB_ERR_NOMEM;
+	memcpy(str, value, len);
+	str[len] = '\0';
+	FREE(*str_ret);
+	*str_ret = str;
+	return 0;
+}
+
+/* Parse the records of a pax extended header, each of the form
+ * "<length> <key>=<value>\n".  Keys that don't matter here are ignored.  */
+static int
+parse_pax_header(struct archive_capture_ctx *ctx, const char *buf, size_t size,
+		 struct pax_overrides *pax)
+{
+	const char *p = buf;
+	const char *end = buf + size;
+
+	while (p != end && *p != '\0') {
+		const char *space, *eq, *value, *rec_end;
+		size_t key_len, value_len;
+		u64 len, n;
+		int ret;
+
+		space = memchr(p, ' ', end - p);
+		if (!space || !parse_decimal(p, space, &len) ||
+		    len > (u64)(end - p) || p[len - 1] != '\n')
+			goto invalid;
+		rec_end = p + len - 1;
+		eq = memchr(space + 1, '=', rec_end - (space + 1));
+		if (!eq)
+			goto invalid;
+		key_len = eq - (space + 1);
+		value = eq + 1;
+		value_len = rec_end - value;
+
+	#define KEY_IS(k) (key_len == sizeof(k) - 1 && \
+			   !memcmp(space + 1, k, key_len))
+		ret = 0;
+		if (KEY_IS("path")) {
+			ret = pax_set_string(&pax->path, value, value_len);
+		} else if (KEY_IS("linkpath")) {
+			ret = pax_set_string(&pax->link_target, value,
+					     value_len);
+		} else if (KEY_IS("size")) {
+			if (!parse_decimal(value, rec_end, &pax->size))
+				goto invalid;
+			pax->has_size = true;
+		} else if (KEY_IS("mtime")) {
+			if (!parse_pax_time(value, rec_end, &pax->mtime))
+				goto invalid;
+			pax->has_mtime = true;
+		} else if (KEY_IS("uid")) {
+			if (!parse_decimal(value, rec_end, &n) || n > UINT32_MAX)
+				goto invalid;
+			pax->uid = n;
+			pax->has_uid = true;
+		} else if (KEY_IS("gid")) {
+			if (!parse_decimal(value, rec_end, &n) || n > UINT32_MAX)
+				goto invalid;
+			pax->gid = n;
+			pax->has_gid = true;
+		} else if (key_len >= 11 && !memcmp(space + 1, "GNU.sparse.", 11)) {
+			ERROR("\"%s\": Sparse files in tar archives are not "
+			      "supported", ctx->archive_path);
+			return WIMLIB_ERR_UNSUPPORTED;
+		}
+	#undef KEY_IS
+		if (ret)
+			return ret;
+		p += len;
+	}
+	return 0;
+
+invalid:
+	ERROR("\"%s\": Invalid pax extended header", ctx->archive_path);
+	return WIMLIB_ERR_INVALID_ARCHIVE;
+}
+
+static void
+clear_pax_overrides(struct pax_overrides *pax)
+{
+	FREE(pax->path);
+	FREE(pax->link_target);
+	memset(pax, 0, sizeof(*pax));
+}
+
+static bool
+is_zero_block(const u8 *block)
+{
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+		if (block[i])
+			return false;
+	return true;
+}
+
+/* Read the next entry of a tar archive.  At the end of the archive, returns 0
+ * with entry->path set to NULL.  */
+static int
+tar_read_entry(struct archive_capture_ctx *ctx, struct archive_entry *entry)
+{
+	struct pax_overrides pax = {};
+	char *long_name = NULL;
+	char *long_link = NULL;
+	u8 hdr[TAR_BLOCK_SIZE];
+	u8 type;
+	u64 hdr_offset, size, v;
+	int ret;
+
+	for (;;) {
+		/* Tolerate a missing end-of-archive marker.  */
+		if (ctx->offset == ctx->archive_size)
+			goto out_eof;
+		hdr_offset = ctx->offset;
+		ret = read_archive_data(ctx, hdr, sizeof(hdr), hdr_offset);
+		if (ret)
+			goto out;
+		if (is_zero_block(hdr))
+			goto out_eof;
+		if (!tar_checksum_ok(hdr)) {
+			ERROR("\"%s\": Invalid tar header at offset %"PRIu64,
+			      ctx->archive_path, hdr_offset);
+			ret = WIMLIB_ERR_INVALID_ARCHIVE;
+			goto out;
+		}
+		type = hdr[156];
+		if (!tar_parse_number(&hdr[124], 12, &size))
+			goto invalid;
+		if (pax.has_size && type != 'x' && type != 'g' &&
+		    type != 'L' && type != 'K')
+			size = pax.size;
+		if (size > ctx->archive_size) {
+			ret = archive_truncated(ctx);
+			goto out;
+		}
+		entry->data_offset = hdr_offset + TAR_BLOCK_SIZE;
+		ctx->offset = entry->data_offset + ALIGN(size, TAR_BLOCK_SIZE);
+
+		switch (type) {
+		case 'L': /* GNU long name for the next entry */
+			FREE(long_name);
+			long_name = NULL;
+			ret = read_archive_string(ctx, size, entry->data_offset,
+						  &long_name);
+			if (ret)
+				goto out;
+			continue;
+		case 'K': /* GNU long link target for the next entry */
+			FREE(long_link);
+			long_link = NULL;
+			ret = read_archive_string(ctx, size, entry->data_offset,
+						  &long_link);
+			if (ret)
+				goto out;
+			continue;
+		case 'x': { /* pax extended header for the next entry */
+			char *buf;
+
+			ret = read_archive_string(ctx, size, entry->data_offset,
+						  &buf);
+			if (ret)
+				goto out;
+			ret = parse_pax_header(ctx, buf, size, &pax);
+			FREE(buf);
+			if (ret)
+				goto out;
+			continue;
+		}
+		case 'g': /* pax global header */
+		case 'V': /* GNU volume label */
+			continue;
+		}
+		break;
+	}
+
+	entry->size = 0;
+	entry->is_hard_link = false;
+	switch (type) {
+	case '0':
+	case '\0':
+	case '7':
+		entry->mode = S_IFREG;
+		entry->size = size;
+		break;
+	case '1':
+		entry->mode = S_IFREG;
+		entry->is_hard_link = true;
+		break;
+	case '2':
+		entry->mode = S_IFLNK;
+		break;
+	case '3':
+		entry->mode = S_IFCHR;
+		break;
+	case '4':
+		entry->mode = S_IFBLK;
+		break;
+	case '5':
+		entry->mode = S_IFDIR;
+		break;
+	case '6':
+		entry->mode = S_IFIFO;
+		break;
+	case 'S':
+		ERROR("\"%s\": Sparse files in tar archives are not supported",
+		      ctx->archive_path);
+		ret = WIMLIB_ERR_UNSUPPORTED;
+		goto out;
+	default:
+		/* POSIX says to treat unknown types as regular files.  */
+		WARNING("\"%s\": Unknown tar entry type '%c' at offset "
+			"%"PRIu64"; capturing it as a regular file",
+			ctx->archive_path, type, hdr_offset);
+		entry->mode = S_IFREG;
+		entry->size = size;
+		break;
+	}
+
+	if (!tar_parse_number(&hdr[100], 8, &v))
+		goto invalid;
+	entry->mode |= v & 07777;
+
+	if (pax.has_uid)
+		entry->uid = pax.uid;
+	else if (tar_parse_number(&hdr[108], 8, &v))
+		entry->uid = v;
+	else
+		goto invalid;
+
+	if (pax.has_gid)
+		entry->gid = pax.gid;
+	else if (tar_parse_number(&hdr[116], 8, &v))
+		entry->gid = v;
+	else
+		goto invalid;
+
+	if (pax.has_mtime) {
+		entry->mtime = pax.mtime;
+	} else {
+		if (!tar_parse_number(&hdr[136], 12, &v))
+			goto invalid;
+		entry->mtime.tv_sec = v;
+		entry->mtime.tv_nsec = 0;
+	}
+
+	entry->rdev_major = 0;
+	entry->rdev_minor = 0;
+	if (type == '3' || type == '4') {
+		if (!tar_parse_number(&hdr[329], 8, &v))
+			goto invalid;
+		entry->rdev_major = v;
+		if (!tar_parse_number(&hdr[337], 8, &v))
+			goto invalid;
+		entry->rdev_minor = v;
+	}
+
+	/* The path comes from a pax header, a GNU long name, or the header
+	 * itself, where a POSIX ustar header may split it into a prefix and a
+	 * name.  (GNU tar uses the prefix field for other things.)  */
+	if (pax.path) {
+		entry->path = pax.path;
+		pax.path = NULL;
+	} else if (long_name) {
+		entry->path = long_name;
+		long_name = NULL;
+	} else if (!memcmp(&hdr[257], "ustar", 6) && hdr[345] != '\0') {
+		size_t prefix_len = strnlen((const char *)&hdr[345], 155);
+		size_t name_len = strnlen((const char *)&hdr[0], 100);
+
+		entry->path = MALLOC(prefix_len + 1 + name_len + 1);
+		if (entry->path) {
+			memcpy(entry->path, &hdr[345], prefix_len);
+			entry->path[prefix_len] = '/';
+			memcpy(&entry->path[prefix_len + 1], &hdr[0], name_len);
+			entry->path[prefix_len + 1 + name_len] = '\0';
+		}
+	} else {
+		entry->path = tar_field_strdup(&hdr[0], 100);
+	}
+	if (!entry->path) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+
+	/* Old tar archives mark directories only with a trailing slash.  */
+	if (type == '\0' && entry->path[0] &&
+	    entry->path[strlen(entry->path) - 1] == '/')
+	{
+		entry->mode = S_IFDIR | (entry->mode & 07777);
+		entry->size = 0;
+	}
+
+	entry->link_target = NULL;
+	if (type == '1' || type == '2') {
+		if (pax.link_target) {
+			entry->link_target = pax.link_target;
+			pax.link_target = NULL;
+		} else if (long_link) {
+			entry->link_target = long_link;
+			long_link = NULL;
+		} else {
+			entry->link_target = tar_field_strdup(&hdr[157], 100);
+			if (!entry->link_target) {
+				ret = WIMLIB_ERR_NOMEM;
+				goto out;
+			}
+		}
+	}
+	ret = 0;
+	goto out;
+
+invalid:
+	ERROR("\"%s\": Invalid tar header at offset %"PRIu64,
+	      ctx->archive_path, hdr_offset);
+	ret = WIMLIB_ERR_INVALID_ARCHIVE;
+	goto out;
+out_eof:
+	entry->path = NULL;
+	ret = 0;
+out:
+	clear_pax_overrides(&pax);
+	FREE(long_name);
+	FREE(long_link);
+	return ret;
+}
+
+/* Parse one of the 8-digit hexadecimal fields of a cpio "newc" header.  */
+static bool
+cpio_parse_hex(const u8 *field, u32 *value_ret)
+{
+	u32 v = 0;
+
+	for (int i = 0; i < 8; i++) {
+		u8 c = field[i];
+
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else if (c >= 'A' && c <= 'F')
+			c -= 'A' - 10;
+		else
+			return false;
+		v = (v << 4) | c;
+	}
+	*value_ret = v;
+	return true;
+}
+
+/* Read the next entry of a cpio "newc" archive.  At the end of the archive,
+ * returns 0 with entry->path set to NULL.  */
+static int
+cpio_read_entry(struct archive_capture_ctx *ctx, struct archive_entry *entry)
+{
+	enum {
+		F_INO, F_MODE, F_UID, F_GID, F_NLINK, F_MTIME, F_FILESIZE,
+		F_DEVMAJOR, F_DEVMINOR, F_RDEVMAJOR, F_RDEVMINOR, F_NAMESIZE,
+		F_CHECK, NUM_FIELDS
+	};
+	u8 hdr[CPIO_HEADER_SIZE];
+	u32 f[NUM_FIELDS];
+	u64 hdr_offset = ctx->offset;
+	char *name;
+	int ret;
+
+	ret = read_archive_data(ctx, hdr, sizeof(hdr), hdr_offset);
+	if (ret)
+		return ret;
+	if (memcmp(hdr, "070701", 6) && memcmp(hdr, "070702", 6))
+		goto invalid;
+	for (int i = 0; i < NUM_FIELDS; i++)
+		if (!cpio_parse_hex(&hdr[6 + 8 * i], &f[i]))
+			goto invalid;
+	if (f[F_NAMESIZE] == 0)
+		goto invalid;
+
+	ret = read_archive_string(ctx, f[F_NAMESIZE],
+				  hdr_offset + CPIO_HEADER_SIZE, &name);
+	if (ret)
+		return ret;
+
+	entry->data_offset = ALIGN(hdr_offset + CPIO_HEADER_SIZE +
+				   f[F_NAMESIZE], 4);
+	ctx->offset = ALIGN(entry->data_offset + f[F_FILESIZE], 4);
+
+	if (!strcmp(name, "TRAILER!!!")) {
+		FREE(name);
+		entry->path = NULL;
+		return 0;
+	}
+
+	entry->path = name;
+	entry->link_target = NULL;
+	entry->mode = f[F_MODE];
+	entry->uid = f[F_UID];
+	entry->gid = f[F_GID];
+	entry->rdev_major = f[F_RDEVMAJOR];
+	entry->rdev_minor = f[F_RDEVMINOR];
+	entry->mtime.tv_sec = f[F_MTIME];
+	entry->mtime.tv_nsec = 0;
+	entry->size = 0;
+	entry->is_hard_link = false;
+	entry->dev = ((u64)f[F_DEVMAJOR] << 32) | f[F_DEVMINOR];
+	entry->ino = f[F_INO];
+	entry->nlink = f[F_NLINK];
+
+	if (S_ISLNK(entry->mode)) {
+		/* The data of a symbolic link is its target.  */
+		ret = read_archive_string(ctx, f[F_FILESIZE],
+					  entry->data_offset,
+					  &entry->link_target);
+		if (ret) {
+			FREE(name);
+			return ret;
+		}
+	} else if (S_ISREG(entry->mode)) {
+		entry->size = f[F_FILESIZE];
+		if (entry->data_offset > ctx->archive_size ||
+		    entry->size > ctx->archive_size - entry->data_offset)
+		{
+			FREE(name);
+			return archive_truncated(ctx);
+		}
+	}
+	return 0;
+
+invalid:
+	ERROR("\"%s\": Invalid cpio header at offset %"PRIu64,
+	      ctx->archive_path, hdr_offset);
+	return WIMLIB_ERR_INVALID_ARCHIVE;
+}
+
+static int
+read_archive_entry(struct archive_capture_ctx *ctx, struct archive_entry *entry)
+{
+	if (ctx->format == ARCHIVE_FORMAT_CPIO)
+		return cpio_read_entry(ctx, entry);
+	return tar_read_entry(ctx, entry);
+}
+
+/* Tell the format of the archive from its first bytes.  */
+static int
+detect_archive_format(struct archive_capture_ctx *ctx)
+{
+	u8 buf[TAR_BLOCK_SIZE];
+	int ret;
+
+	if (ctx->archive_size >= 6) {
+		ret = read_archive_data(ctx, buf, 6, 0);
+		if (ret)
+			return ret;
+		if (!memcmp(buf, "070701", 6) || !memcmp(buf, "070702", 6)) {
+			ctx->format = ARCHIVE_FORMAT_CPIO;
+			return 0;
+		}
+		if (!memcmp(buf, "070707", 6)) {
+			ERROR("\"%s\": Old-style cpio archives are not "
+			      "supported; use the \"newc\" format",
+			      ctx->archive_path);
+			return WIMLIB_ERR_UNSUPPORTED;
+		}
+	}
+	if (ctx->archive_size >= TAR_BLOCK_SIZE) {
+		ret = read_archive_data(ctx, buf, TAR_BLOCK_SIZE, 0);
+		if (ret)
+			return ret;
+		if (tar_checksum_ok(buf) && !is_zero_block(buf)) {
+			ctx->format = ARCHIVE_FORMAT_TAR;
+			return 0;
+		}
+	}
+	ERROR("\"%s\": Not a tar or cpio archive.  Note that compressed "
+	      "archives must be decompressed first.", ctx->archive_path);
+	return WIMLIB_ERR_INVALID_ARCHIVE;
+}
+
+/*
+ * Put a path from an archive into canonical form in place: no leading or
+ * trailing slashes, no empty or "." components.  An empty result means the
+ * root directory.  Returns false if the path has a ".." component, which is
+ * never followed, as in extracting the archive safely.
+ */
+static bool
+canonicalize_archive_path(char *path)
+{
+	char *out = path;
+	const char *p;
+
+	for (p = path; (p = strstr(p, "..")) != NULL; p += 2)
+		if ((p == path || p[-1] == '/') && (p[2] == '/' || p[2] == '\0'))
+			return false;
+
+	p = path;
+	while (*p) {
+		const char *comp;
+		size_t len;
+
+		while (*p == '/')
+			p++;
+		comp = p;
+		while (*p && *p != '/')
+			p++;
+		len = p - comp;
+		if (len == 0 || (len == 1 && comp[0] == '.'))
+			continue;
+		if (out != path)
+			*out++ = '/';
+		memmove(out, comp, len);
+		out += len;
+	}
+	*out = '\0';
+	return true;
+}
+
+static int
+new_archive_dentry(struct archive_capture_ctx *ctx, const char *name, u64 ino,
+		   struct wim_dentry **dentry_ret)
+{
+	int ret;
+
+	ret = inode_table_new_dentry(ctx->params->inode_table, name, ino, 0,
+				     true, dentry_ret);
+	if (ret == WIMLIB_ERR_INVALID_UTF8_STRING)
+		ERROR("\"%s\": filename is not valid UTF-8.  "
+		      "This is not supported.", ctx->params->cur_path);
+	return ret;
+}
+
+/* Give a directory which has no entry of its own in the archive the archive
+ * file's timestamps.  */
+static void
+set_implicit_directory_metadata(struct archive_capture_ctx *ctx,
+				struct wim_inode *inode)
+{
+	u64 t = timespec_to_wim_timestamp(&ctx->archive_mtime);
+
+	inode->i_attributes = FILE_ATTRIBUTE_DIRECTORY;
+	inode->i_creation_time = t;
+	inode->i_last_write_time = t;
+	inode->i_last_access_time = t;
+}
+
+/*
+ * Look up the directory at the canonical path @path, which has @len
+ * characters.  If @create, create any missing directories; otherwise return
+ * NULL if the directory doesn't exist.  Also returns NULL if a component of the
+ * path is not a directory.
+ */
+static int
+lookup_archive_dir(struct archive_capture_ctx *ctx, const char *path,
+		   size_t len, bool create, struct wim_dentry **dir_ret)
+{
+	struct wim_dentry *dir = ctx->root;
+	char *name;
+	int ret;
+
+	if (len == 0) {
+		*dir_ret = dir;
+		return 0;
+	}
+	if (create && len == ctx->last_dir_path_len &&
+	    !memcmp(path, ctx->last_dir_path, len))
+	{
+		*dir_ret = ctx->last_dir;
+		return 0;
+	}
+
+	name = MALLOC(len + 1);
+	if (!name)
+		return WIMLIB_ERR_NOMEM;
+
+	*dir_ret = NULL;
+	for (const char *p = path, *end = path + len; p < end; ) {
+		const char *slash = memchr(p, '/', end - p);
+		size_t name_len = (slash ? slash : end) - p;
+		struct wim_dentry *child;
+
+		memcpy(name, p, name_len);
+		name[name_len] = '\0';
+		p += name_len + 1;
+
+		child = get_dentry_child_with_name(dir, name,
+						   WIMLIB_CASE_SENSITIVE);
+		if (!child) {
+			if (!create) {
+				ret = 0;
+				goto out;
+			}
+			ret = new_archive_dentry(ctx, name, 0, &child);
+			if (ret)
+				goto out;
+			set_implicit_directory_metadata(ctx, child->d_inode);
+			dentry_add_child(dir, child);
+		} else if (!dentry_is_directory(child)) {
+			ret = 0;
+			goto out;
+		}
+		dir = child;
+	}
+	*dir_ret = dir;
+
+	if (create) {
+		FREE(ctx->last_dir_path);
+		ctx->last_dir_path = name;
+		memcpy(name, path, len);
+		ctx->last_dir_path_len = len;
+		ctx->last_dir = dir;
+		return 0;
+	}
+	ret = 0;
+out:
+	FREE(name);
+	return ret;
+}
+
+static int
+set_archive_metadata(struct archive_capture_ctx *ctx, struct wim_inode *inode,
+		     const struct archive_entry *entry)
+{
+	u64 t = timespec_to_wim_timestamp(&entry->mtime);
+
+	inode->i_creation_time = t;
+	inode->i_last_write_time = t;
+	inode->i_last_access_time = t;
+
+	if (S_ISDIR(entry->mode))
+		inode->i_attributes = FILE_ATTRIBUTE_DIRECTORY;
+	else if (S_ISREG(entry->mode))
+		inode->i_attributes = FILE_ATTRIBUTE_NORMAL;
+
+	if (ctx->params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA) {
+		struct wimlib_unix_data unix_data;
+
+		unix_data.uid = entry->uid;
+		unix_data.gid = entry->gid;
+		unix_data.mode = entry->mode;
+		unix_data.rdev = makedev(entry->rdev_major, entry->rdev_minor);
+		if (!inode_set_unix_data(inode, &unix_data, UNIX_DATA_ALL))
+			return WIMLIB_ERR_NOMEM;
+	}
+	return 0;
+}
+
+/* Make a regular file's data stream refer to its data in the archive.  */
+static int
+set_archive_file_data(struct archive_capture_ctx *ctx, struct wim_inode *inode,
+		      struct wim_inode_stream *strm,
+		      const struct archive_entry *entry)
+{
+	struct scan_params *params = ctx->params;
+	struct blob_descriptor *blob;
+
+	blob = new_blob_descriptor();
+	if (!blob)
+		return WIMLIB_ERR_NOMEM;
+	blob->file_on_disk = STRDUP(ctx->archive_path);
+	if (!blob->file_on_disk) {
+		free_blob_descriptor(blob);
+		return WIMLIB_ERR_NOMEM;
+	}
+	blob->blob_location = BLOB_IN_FILE_ON_DISK;
+	blob->size = entry->size;
+	blob->file_inode = inode;
+	blob->file_data_offset = entry->data_offset;
+
+	/* Read the data in the order it is in the archive.  */
+	blob->file_physical_offset = entry->data_offset;
+
+	if (strm) {
+		inode_replace_stream_blob(inode, strm, blob,
+					  params->blob_table);
+	} else {
+		strm = inode_add_stream(inode, STREAM_TYPE_DATA,
+					NO_STREAM_NAME, blob);
+		if (!strm) {
+			free_blob_descriptor(blob);
+			return WIMLIB_ERR_NOMEM;
+		}
+	}
+	prepare_unhashed_blob(blob, inode, strm->stream_id,
+			      params->unhashed_blobs);
+	scan_hasher_submit(params->hasher, blob);
+	return 0;
+}
+
+static int
+set_archive_symlink(struct archive_capture_ctx *ctx, struct wim_inode *inode,
+		    const struct archive_entry *entry)
+{
+	struct scan_params *params = ctx->params;
+	int ret;
+
+	/* An absolute target in an archive, such as of a root filesystem,
+	 * refers to the archive's own root, which is what reparse point fixups
+	 * would otherwise have to work out.  */
+	if (entry->link_target[0] == '/' &&
+	    (params->add_flags & WIMLIB_ADD_FLAG_RPFIX))
+	{
+		inode->i_rp_flags &= ~WIM_RP_FLAG_NOT_FIXED;
+		params->progress.scan.symlink_target = entry->link_target;
+		ret = do_scan_progress(params, WIMLIB_SCAN_DENTRY_FIXED_SYMLINK,
+				       NULL);
+		if (ret)
+			return ret;
+	}
+
+	ret = wim_inode_set_symlink(inode, entry->link_target,
+				    params->blob_table);
+	if (ret == WIMLIB_ERR_INVALID_UTF8_STRING)
+		ERROR("\"%s\": target of symbolic link is not valid UTF-8.  "
+		      "This is not supported.", params->cur_path);
+	return ret;
+}
+
+static int
+_avl_cmp_cpio_links(const struct avl_tree_node *n1,
+		    const struct avl_tree_node *n2)
+{
+	const struct cpio_link *l1 = CPIO_LINK(n1);
+	const struct cpio_link *l2 = CPIO_LINK(n2);
+	int v = cmp_u64(l1->dev, l2->dev);
+
+	return v ? v : cmp_u64(l1->ino, l2->ino);
+}
+
+static struct cpio_link *
+lookup_cpio_link(struct archive_capture_ctx *ctx,
+		 const struct archive_entry *entry)
+{
+	struct cpio_link dummy;
+	struct avl_tree_node *res;
+
+	dummy.dev = entry->dev;
+	dummy.ino = entry->ino;
+	res = avl_tree_lookup_node(ctx->cpio_links, &dummy.index_node,
+				   _avl_cmp_cpio_links);
+	return res ? CPIO_LINK(res) : NULL;
+}
+
+/* Add a hard link to a file already captured.  In a cpio archive, the data of
+ * a file with several links is with the last of them.  */
+static int
+add_archive_hard_link(struct archive_capture_ctx *ctx, struct wim_dentry *dir,
+		      const char *name, struct wim_inode *inode,
+		      const struct archive_entry *entry,
+		      struct wim_inode **inode_ret)
+{
+	struct wim_dentry *dentry;
+	struct wim_inode_stream *strm;
+	int ret;
+
+	*inode_ret = NULL;
+	ret = new_dentry_with_existing_inode(name, inode, &dentry);
+	if (ret)
+		return ret;
+	if (dentry_add_child(dir, dentry)) {
+		WARNING("Duplicate file path: \"%s\".  Only capturing the "
+			"first version.", ctx->params->cur_path);
+		free_dentry_tree(dentry, ctx->params->blob_table);
+		return 0;
+	}
+	*inode_ret = inode;
+
+	if (entry->size) {
+		strm = inode_get_unnamed_data_stream(inode);
+		if (strm && !stream_blob_resolved(strm)) {
+			/* The scan progress counts the data of a file when it
+			 * is first seen, so count it here instead.  */
+			ctx->params->progress.scan.num_bytes_scanned +=
+				entry->size;
+			return set_archive_file_data(ctx, inode, strm, entry);
+		}
+	}
+	return 0;
+}
+
+/* Capture one entry of the archive, whose path has been canonicalized.
+ * params->cur_path is its full path.  */
+static int
+capture_archive_entry(struct archive_capture_ctx *ctx,
+		      struct archive_entry *entry)
+{
+	struct scan_params *params = ctx->params;
+	struct wim_dentry *dir, *dentry;
+	struct wim_inode *inode = NULL;
+	const char *name;
+	char *slash;
+	int ret;
+
+	/* An entry for the root directory itself, such as "./"  */
+	if (entry->path[0] == '\0') {
+		if (!S_ISDIR(entry->mode))
+			return 0;
+		ctx->root->d_inode->i_ino = ++ctx->next_ino;
+		ret = set_archive_metadata(ctx, ctx->root->d_inode, entry);
+		if (ret)
+			return ret;
+		return do_scan_progress(params, WIMLIB_SCAN_DENTRY_OK,
+					ctx->root->d_inode);
+	}
+
+	ret = try_exclude(params);
+	if (ret < 0)	/* Excluded? */
+		return do_scan_progress(params, WIMLIB_SCAN_DENTRY_EXCLUDED,
+					NULL);
+	if (ret > 0)	/* Error? */
+		return ret;
+
+	if (!(params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA) &&
+	    !S_ISREG(entry->mode) && !S_ISDIR(entry->mode) &&
+	    !S_ISLNK(entry->mode))
+	{
+		if (params->add_flags & WIMLIB_ADD_FLAG_NO_UNSUPPORTED_EXCLUDE) {
+			ERROR("\"%s\": File type is unsupported",
+			      params->cur_path);
+			return WIMLIB_ERR_UNSUPPORTED_FILE;
+		}
+		return do_scan_progress(params, WIMLIB_SCAN_DENTRY_UNSUPPORTED,
+					NULL);
+	}
+
+	slash = strrchr(entry->path, '/');
+	if (slash) {
+		ret = lookup_archive_dir(ctx, entry->path, slash - entry->path,
+					 true, &dir);
+		name = slash + 1;
+	} else {
+		ret = lookup_archive_dir(ctx, entry->path, 0, true, &dir);
+		name = entry->path;
+	}
+	if (ret)
+		return ret;
+	if (!dir) {
+		WARNING("\"%s\": Not capturing file in a path which is not a "
+			"directory", params->cur_path);
+		return 0;
+	}
+
+	/* Hard link to an earlier entry  */
+	if (entry->is_hard_link) {
+		struct wim_dentry *target_dir, *target = NULL;
+
+		if (canonicalize_archive_path(entry->link_target) &&
+		    entry->link_target[0] != '\0')
+		{
+			const char *target_name;
+
+			slash = strrchr(entry->link_target, '/');
+			target_name = slash ? slash + 1 : entry->link_target;
+			ret = lookup_archive_dir(ctx, entry->link_target,
+						 slash ? slash - entry->link_target : 0,
+						 false, &target_dir);
+			if (ret)
+				return ret;
+			if (target_dir)
+				target = get_dentry_child_with_name(
+						target_dir, target_name,
+						WIMLIB_CASE_SENSITIVE);
+		}
+		if (!target || dentry_is_directory(target)) {
+			WARNING("\"%s\": Not capturing hard link to \"%s\", "
+				"which is not a file earlier in the archive",
+				params->cur_path, entry->link_target);
+			return 0;
+		}
+		ret = add_archive_hard_link(ctx, dir, name, target->d_inode,
+					    entry, &inode);
+		goto out_progress;
+	}
+
+	/* File with several links in a cpio archive  */
+	if (ctx->format == ARCHIVE_FORMAT_CPIO && entry->nlink > 1 &&
+	    !S_ISDIR(entry->mode))
+	{
+		struct cpio_link *link = lookup_cpio_link(ctx, entry);
+
+		if (link) {
+			ret = add_archive_hard_link(ctx, dir, name,
+						    link->inode, entry, &inode);
+			goto out_progress;
+		}
+	}
+
+	dentry = get_dentry_child_with_name(dir, name, WIMLIB_CASE_SENSITIVE);
+	if (dentry) {
+		/* A directory that was created because of the files in it
+		 * gets the metadata of its entry when it comes.  */
+		if (S_ISDIR(entry->mode) && dentry_is_directory(dentry) &&
+		    dentry->d_inode->i_ino == 0)
+		{
+			inode = dentry->d_inode;
+			inode->i_ino = ++ctx->next_ino;
+			ret = set_archive_metadata(ctx, inode, entry);
+			goto out_progress;
+		}
+		WARNING("Duplicate file path: \"%s\".  Only capturing the "
+			"first version.", params->cur_path);
+		return 0;
+	}
+
+	ret = new_archive_dentry(ctx, name, ++ctx->next_ino, &dentry);
+	if (ret)
+		return ret;
+	inode = dentry->d_inode;
+
+	ret = set_archive_metadata(ctx, inode, entry);
+	if (!ret) {
+		if (S_ISREG(entry->mode)) {
+			if (entry->size)
+				ret = set_archive_file_data(ctx, inode, NULL,
+							    entry);
+			else if (!inode_add_stream(inode, STREAM_TYPE_DATA,
+						   NO_STREAM_NAME, NULL))
+				ret = WIMLIB_ERR_NOMEM;
+		} else if (S_ISLNK(entry->mode)) {
+			ret = set_archive_symlink(ctx, inode, entry);
+		}
+	}
+	if (ret) {
+		free_dentry_tree(dentry, params->blob_table);
+		return ret;
+	}
+	dentry_add_child(dir, dentry);
+
+	if (ctx->format == ARCHIVE_FORMAT_CPIO && entry->nlink > 1 &&
+	    !S_ISDIR(entry->mode))
+	{
+		struct cpio_link *link = MALLOC(sizeof(*link));
+
+		if (!link)
+			return WIMLIB_ERR_NOMEM;
+		link->dev = entry->dev;
+		link->ino = entry->ino;
+		link->inode = inode;
+		avl_tree_insert(&ctx->cpio_links, &link->index_node,
+				_avl_cmp_cpio_links);
+	}
+
+out_progress:
+	if (ret || !inode)
+		return ret;
+	return do_scan_progress(params, WIMLIB_SCAN_DENTRY_OK, inode);
+}
+
+static int
+capture_archive(struct archive_capture_ctx *ctx)
+{
+	struct scan_params *params = ctx->params;
+	int ret;
+
+	ret = detect_archive_format(ctx);
+	if (ret)
+		return ret;
+
+	ret = new_archive_dentry(ctx, ctx->archive_path, 0, &ctx->root);
+	if (ret)
+		return ret;
+	set_implicit_directory_metadata(ctx, ctx->root->d_inode);
+
+	for (;;) {
+		struct archive_entry entry;
+		size_t orig_path_nchars;
+
+		ret = read_archive_entry(ctx, &entry);
+		if (ret || !entry.path)
+			return ret;
+
+		orig_path_nchars = params->cur_path_nchars;
+		if (!canonicalize_archive_path(entry.path)) {
+			WARNING("\"%s\": Not capturing \"%s\", whose path "
+				"contains \"..\"", ctx->archive_path, entry.path);
+			ret = 0;
+		} else if (entry.path[0] != '\0' &&
+			   !pathbuf_append_name(params, entry.path,
+						strlen(entry.path),
+						&orig_path_nchars)) {
+			ret = WIMLIB_ERR_NOMEM;
+		} else {
+			ret = capture_archive_entry(ctx, &entry);
+		}
+		pathbuf_truncate(params, orig_path_nchars);
+		FREE(entry.path);
+		FREE(entry.link_target);
+		if (ret)
+			return ret;
+	}
+}
+
+/*
+ * tar_build_dentry_tree():
+ *	Build a dentry tree from the contents of a tar or cpio archive.
+ *
+ * @root_ret:	Place to return a pointer to the root of the dentry tree.
+ * @archive_path:
+ *	Path to the archive, which must be a regular file.
+ * @params:	See doc for `struct scan_params'.
+ *
+ * The data of the files is not read here, except to hash it during the scan
+ * if requested, but by the code that writes the image, from the archive at
+ * the offsets recorded in the blob descriptors.
+ */
+int
+tar_build_dentry_tree(struct wim_dentry **root_ret, const char *archive_path,
+		      struct scan_params *params)
+{
+	struct archive_capture_ctx ctx = {
+		.params = params,
+		.archive_path = archive_path,
+	};
+	struct cpio_link *link;
+	struct stat stbuf;
+	int raw_fd;
+	int ret;
+
+	*root_ret = NULL;
+
+	ret = pathbuf_init(params, archive_path);
+	if (ret)
+		return ret;
+
+	raw_fd = open(archive_path, O_RDONLY);
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("\"%s\": Can't open archive", archive_path);
+		return WIMLIB_ERR_OPEN;
+	}
+	filedes_init(&ctx.fd, raw_fd);
+
+	if (fstat(raw_fd, &stbuf)) {
+		ERROR_WITH_ERRNO("\"%s\": Can't read metadata", archive_path);
+		ret = WIMLIB_ERR_STAT;
+		goto out;
+	}
+	if (!S_ISREG(stbuf.st_mode)) {
+		ERROR("\"%s\": The archive must be a regular file, since its "
+		      "data is read when the image is written", archive_path);
+		ret = WIMLIB_ERR_NOT_A_REGULAR_FILE;
+		goto out;
+	}
+	ctx.archive_size = stbuf.st_size;
+#ifdef HAVE_STAT_NANOSECOND_PRECISION
+	ctx.archive_mtime = stbuf.st_mtim;
+#else
+	ctx.archive_mtime.tv_sec = stbuf.st_mtime;
+	ctx.archive_mtime.tv_nsec = 0;
+#endif
+
+	params->add_flags &= ~WIMLIB_ADD_FLAG_ROOT;
+
+	ret = capture_archive(&ctx);
+	if (ret)
+		free_dentry_tree(ctx.root, params->blob_table);
+	else
+		*root_ret = ctx.root;
+out:
+	avl_tree_for_each_in_postorder(link, ctx.cpio_links, struct cpio_link,
+				       index_node)
+		FREE(link);
+	FREE(ctx.last_dir_path);
+	filedes_close(&ctx.fd);
+	return ret;
+}
+
+#endif /* !_WIN32 */
@@ -31,6 +31,8 @@
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/metadata.h"
+#include "wimlib/unix_data.h"
+#include "wimlib/usn_info.h"
 #include "wimlib/util.h"
 
 static u64
@@ -53,6 +55,9 @@ inode_metadata_consistent(const struct wim_inode *inode,
 			  const struct blob_table *blob_table,
 			  const struct blob_table *template_blob_table)
 {
+	struct wimlib_unix_change_info info, template_info;
+	struct wimlib_usn_info usn_info, template_usn_info;
+
 	/* Must have exact same creation time and last write time.  */
 	if (inode->i_creation_time != template_inode->i_creation_time ||
 	    inode->i_last_write_time != template_inode->i_last_write_time)
@@ -63,6 +68,24 @@ inode_metadata_consistent(const struct wim_inode *inode,
 	if (inode->i_last_access_time < template_inode->i_last_access_time)
 		return false;
 
+	/* If both files were captured from the same NTFS change journal, they
+	 * must be the same file with the same USN.  */
+	if (inode_get_usn_info(inode, &usn_info) &&
+	    inode_get_usn_info(template_inode, &template_usn_info) &&
+	    usn_info.journal_id == template_usn_info.journal_id &&
+	    (usn_info.file_id != template_usn_info.file_id ||
+	     usn_info.usn != template_usn_info.usn))
+		return false;
+
+	/* If both files were captured with UNIX data, they must also be the
+	 * same UNIX inode and have the same status change time.  The change
+	 * time is updated even when the last write time is set back.  */
+	if (inode_get_unix_change_info(inode, &info) &&
+	    inode_get_unix_change_info(template_inode, &template_info) &&
+	    (info.ino != template_info.ino ||
+	     info.ctime != template_info.ctime))
+		return false;
+
 	/* All stream sizes must match.  */
 	for (unsigned i = 0; i < inode->i_num_streams; i++) {
 		const struct wim_inode_stream *strm, *template_strm;
@@ -120,6 +143,42 @@ inode_copy_checksums(struct wim_inode *inode,
 	}
 }
 
+/**
+ * Given an inode @inode that has been determined to be a modified version of
+ * another inode @template_inode, remember for each stream of @inode that is
+ * still to be read from a file the corresponding blob of @template_inode, if
+ * the blob is in a WIM referenced by @blob_table's WIM.  This is the base
+ * against which WIMLIB_WRITE_FLAG_BINARY_DELTA may delta-encode the stream.
+ */
+static void
+inode_set_delta_bases(struct wim_inode *inode,
+		      const struct wim_inode *template_inode,
+		      const struct blob_table *blob_table,
+		      const struct blob_table *template_blob_table)
+{
+	for (unsigned i = 0; i < inode->i_num_streams; i++) {
+		const struct wim_inode_stream *strm, *template_strm;
+		struct blob_descriptor *blob, *template_blob, *base;
+
+		strm = &inode->i_streams[i];
+		template_strm = inode_get_stream(template_inode,
+						 strm->stream_type,
+						 strm->stream_name);
+		if (!template_strm)
+			continue;
+
+		blob = stream_blob(strm, blob_table);
+		template_blob = stream_blob(template_strm, template_blob_table);
+		if (!blob || !template_blob || !blob_is_in_file(blob) ||
+		    template_blob->unhashed)
+			continue;
+
+		base = lookup_blob(blob_table, template_blob->hash);
+		if (base && base->blob_location == BLOB_IN_WIM)
+			blob->delta_base = base;
+	}
+}
+
 static int
 reference_template_file(struct wim_inode *inode, WIMStruct *wim,
 			WIMStruct *template_wim)
@@ -140,6 +199,9 @@ reference_template_file(struct wim_inode *inode, WIMStruct *wim,
 	{
 		inode_copy_checksums(inode, template_dentry->d_inode,
 				     wim->blob_table, template_wim->blob_table);
+	} else if (template_dentry != NULL) {
+		inode_set_delta_bases(inode, template_dentry->d_inode,
+				      wim->blob_table, template_wim->blob_table);
 	}
 
 	FREE(dentry->d_full_path);
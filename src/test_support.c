@@ -833,10 +833,12 @@ static u64
 select_inode_number(struct generation_context *ctx)
 {
 	const struct wim_inode_table *table = ctx->params->inode_table;
+	const struct wim_inode_table_shard *shard;
 	const struct hlist_head *head;
 	const struct wim_inode *inode;
 
-	head = &table->array[rand32() % table->capacity];
+	shard = &table->shards[rand32() % INODE_TABLE_NUM_SHARDS];
+	head = &shard->array[rand32() % shard->capacity];
 	hlist_for_each_entry(inode, head, i_hlist_node)
 		if (randbool())
 			return inode->i_ino;
@@ -0,0 +1,423 @@
+/*
+ * thread_pool.c
+ *
+ * A pool of compression threads that can be shared by multiple operations and
+ * multiple WIMStructs.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/assert.h"
+#include "wimlib/error.h"
+#include "wimlib/stats.h"
+#include "wimlib/thread_pool.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+/*
+ * Each thread has its own queue of work waiting to be run.  Submitters hand out
+ * work to the queues in round-robin order, and a thread whose own queue is
+ * empty steals the oldest work from another thread's queue.  This way, the
+ * threads rarely contend for the same lock, even when there are many of them
+ * and each item of work is run quickly.
+ */
+struct work_queue {
+	struct list_head list;
+	struct mutex lock;
+};
+
+struct pool_thread {
+	struct thread thread;
+	struct wimlib_thread_pool *pool;
+	unsigned idx;
+	struct work_queue queue;
+};
+
+/* A compressor which is not currently in use by any operation.  It is kept so
+ * that a later operation using the same compression parameters can reuse it
+ * rather than allocating and initializing a new one.  */
+struct cached_compressor {
+	struct list_head list;
+	int ctype;
+	u32 max_block_size;
+	unsigned level;
+	struct wimlib_compressor *compressor;
+};
+
+struct wimlib_thread_pool {
+
+	/* Protects @refcnt and the compressor cache  */
+	struct mutex lock;
+	unsigned long refcnt;
+
+	/* Idle compressors, most recently used first  */
+	struct list_head cached_compressors;
+	unsigned num_cached_compressors;
+
+	struct pool_thread *threads;
+	unsigned num_threads;
+	unsigned num_started_threads;
+
+	/* Lets the threads sleep when there is no work to do  */
+	struct mutex idle_lock;
+	struct condvar work_avail_cond;
+	unsigned num_idle_threads;
+	bool terminating;
+};
+
+/* Remove and return the oldest work in a work queue, or return NULL if the work
+ * queue is empty.  */
+static struct thread_pool_work *
+work_queue_take(struct work_queue *q)
+{
+	struct thread_pool_work *work = NULL;
+
+	mutex_lock(&q->lock);
+	if (!list_empty(&q->list)) {
+		work = list_entry(q->list.next, struct thread_pool_work, list);
+		list_del(&work->list);
+	}
+	mutex_unlock(&q->lock);
+	return work;
+}
+
+/* Find work for a thread: preferably from its own queue, or else stolen from
+ * another thread's queue.  */
+static struct thread_pool_work *
+find_work(struct pool_thread *t)
+{
+	struct wimlib_thread_pool *pool = t->pool;
+	unsigned n = pool->num_threads;
+	struct thread_pool_work *work;
+
+	for (unsigned i = 0; i < n; i++) {
+		work = work_queue_take(&pool->threads[(t->idx + i) % n].queue);
+		if (work)
+			return work;
+	}
+	return NULL;
+}
+
+/* Get the next work for a thread to run, waiting if needed.  Returns NULL if
+ * the thread should exit.  */
+static struct thread_pool_work *
+get_work(struct pool_thread *t)
+{
+	struct wimlib_thread_pool *pool = t->pool;
+	struct thread_pool_work *work;
+
+	work = find_work(t);
+	if (work)
+		return work;
+
+	/* Nothing to do.  Go to sleep, but first check the queues again while
+	 * holding idle_lock so that no wakeup can be missed.  */
+	mutex_lock(&pool->idle_lock);
+	pool->num_idle_threads++;
+	while (!pool->terminating && !(work = find_work(t)))
+		condvar_wait(&pool->work_avail_cond, &pool->idle_lock);
+	pool->num_idle_threads--;
+	mutex_unlock(&pool->idle_lock);
+	return work;
+}
+
+static void *
+pool_thread_proc(void *arg)
+{
+	struct pool_thread *t = arg;
+	struct thread_pool_work *work;
+	unsigned tid;
+	u64 idle_start, busy_start;
+	const char *name;
+
+	if (!trace_enabled) {
+		while ((work = get_work(t)) != NULL)
+			(*work->run)(work);
+		return NULL;
+	}
+
+	/* Tracing is enabled: record how long the thread spends waiting for
+	 * work and running each work.  The work may be reused by its submitter
+	 * as soon as it has run, so get its name beforehand.  */
+	tid = trace_register_thread("pool thread", t->idx);
+	for (;;) {
+		idle_start = stats_now_ns();
+		work = get_work(t);
+		busy_start = stats_now_ns();
+		trace_span(tid, "idle", idle_start, busy_start);
+		if (!work)
+			break;
+		name = work->name ? work->name : "work";
+		(*work->run)(work);
+		trace_span(tid, name, busy_start, stats_now_ns());
+	}
+	return NULL;
+}
+
+static void
+free_cached_compressor(struct cached_compressor *cc)
+{
+	wimlib_free_compressor(cc->compressor);
+	FREE(cc);
+}
+
+static void
+thread_pool_destroy(struct wimlib_thread_pool *pool)
+{
+	struct cached_compressor *cc, *tmp;
+
+	if (pool->num_started_threads != 0) {
+		mutex_lock(&pool->idle_lock);
+		pool->terminating = true;
+		condvar_broadcast(&pool->work_avail_cond);
+		mutex_unlock(&pool->idle_lock);
+
+		for (unsigned i = 0; i < pool->num_started_threads; i++)
+			thread_join(&pool->threads[i].thread);
+	}
+
+	if (pool->threads != NULL) {
+		for (unsigned i = 0; i < pool->num_threads; i++)
+			if (pool->threads[i].queue.list.next != NULL)
+				mutex_destroy(&pool->threads[i].queue.lock);
+		FREE(pool->threads);
+	}
+
+	if (pool->cached_compressors.next != NULL) {
+		list_for_each_entry_safe(cc, tmp, &pool->cached_compressors, list)
+			free_cached_compressor(cc);
+		mutex_destroy(&pool->lock);
+		mutex_destroy(&pool->idle_lock);
+		condvar_destroy(&pool->work_avail_cond);
+	}
+
+	FREE(pool);
+}
+
+/*
+ * Create a thread pool with the specified number of threads, or one thread per
+ * processor if @num_threads is 0.  The caller holds the only reference to the
+ * new pool.  Fewer threads than requested may be started if thread creation
+ * fails; use thread_pool_num_threads() to get the actual number.
+ */
+int
+thread_pool_create(unsigned num_threads, struct wimlib_thread_pool **pool_ret)
+{
+	struct wimlib_thread_pool *pool;
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+
+	pool = CALLOC(1, sizeof(*pool));
+	if (!pool)
+		return WIMLIB_ERR_NOMEM;
+
+	if (!mutex_init(&pool->lock))
+		goto err;
+	if (!mutex_init(&pool->idle_lock)) {
+		mutex_destroy(&pool->lock);
+		goto err;
+	}
+	if (!condvar_init(&pool->work_avail_cond)) {
+		mutex_destroy(&pool->idle_lock);
+		mutex_destroy(&pool->lock);
+		goto err;
+	}
+	INIT_LIST_HEAD(&pool->cached_compressors);
+	pool->refcnt = 1;
+
+	pool->threads = CALLOC(num_threads, sizeof(pool->threads[0]));
+	if (!pool->threads)
+		goto err;
+	pool->num_threads = num_threads;
+
+	for (unsigned i = 0; i < num_threads; i++) {
+		struct pool_thread *t = &pool->threads[i];
+
+		t->pool = pool;
+		t->idx = i;
+		if (!mutex_init(&t->queue.lock))
+			goto err;
+		INIT_LIST_HEAD(&t->queue.list);
+	}
+
+	/* If not every thread can be started, the work submitted to the queues
+	 * of the missing threads is still run, since the other threads steal
+	 * it.  */
+	while (pool->num_started_threads < num_threads &&
+	       thread_create(&pool->threads[pool->num_started_threads].thread,
+			     pool_thread_proc,
+			     &pool->threads[pool->num_started_threads]))
+		pool->num_started_threads++;
+	if (pool->num_started_threads == 0)
+		goto err;
+
+	*pool_ret = pool;
+	return 0;
+
+err:
+	thread_pool_destroy(pool);
+	return WIMLIB_ERR_NOMEM;
+}
+
+/* Take a reference to a thread pool.  */
+void
+thread_pool_get(struct wimlib_thread_pool *pool)
+{
+	mutex_lock(&pool->lock);
+	pool->refcnt++;
+	mutex_unlock(&pool->lock);
+}
+
+/* Release a reference to a thread pool.  If the reference count reaches 0, the
+ * threads are stopped and the pool is freed.  */
+void
+thread_pool_put(struct wimlib_thread_pool *pool)
+{
+	unsigned long refcnt;
+
+	mutex_lock(&pool->lock);
+	wimlib_assert(pool->refcnt > 0);
+	refcnt = --pool->refcnt;
+	mutex_unlock(&pool->lock);
+
+	if (refcnt == 0)
+		thread_pool_destroy(pool);
+}
+
+unsigned
+thread_pool_num_threads(const struct wimlib_thread_pool *pool)
+{
+	return pool->num_started_threads;
+}
+
+/*
+ * Submit work to be run asynchronously by one of the pool's threads.  @cursor
+ * is the submitter's position in the round-robin order of the work queues; it
+ * should start at 0 and be passed to every call by the same submitter.
+ */
+void
+thread_pool_submit(struct wimlib_thread_pool *pool,
+		   struct thread_pool_work *work, unsigned *cursor)
+{
+	struct work_queue *q;
+
+	if (*cursor >= pool->num_threads)
+		*cursor = 0;
+	q = &pool->threads[(*cursor)++].queue;
+
+	mutex_lock(&q->lock);
+	list_add_tail(&work->list, &q->list);
+	mutex_unlock(&q->lock);
+
+	mutex_lock(&pool->idle_lock);
+	if (pool->num_idle_threads)
+		condvar_signal(&pool->work_avail_cond);
+	mutex_unlock(&pool->idle_lock);
+}
+
+/*
+ * Get a compressor with the specified parameters, reusing one from the pool's
+ * cache if possible.  @level is passed to wimlib_create_compressor(), so it may
+ * include WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE.  The compressor must be given
+ * back with thread_pool_put_compressor() when the caller is done with it.
+ */
+int
+thread_pool_get_compressor(struct wimlib_thread_pool *pool, int ctype,
+			   u32 max_block_size, unsigned level,
+			   struct wimlib_compressor **compressor_ret)
+{
+	struct cached_compressor *cc;
+
+	mutex_lock(&pool->lock);
+	list_for_each_entry(cc, &pool->cached_compressors, list) {
+		if (cc->ctype == ctype && cc->max_block_size == max_block_size &&
+		    cc->level == level)
+		{
+			list_del(&cc->list);
+			pool->num_cached_compressors--;
+			mutex_unlock(&pool->lock);
+			*compressor_ret = cc->compressor;
+			FREE(cc);
+			return 0;
+		}
+	}
+	mutex_unlock(&pool->lock);
+
+	return wimlib_create_compressor(ctype, max_block_size, level,
+					compressor_ret);
+}
+
+/*
+ * Give back a compressor that was obtained from thread_pool_get_compressor().
+ * Up to two idle compressors per thread are kept; beyond that, the least
+ * recently used ones are freed.
+ */
+void
+thread_pool_put_compressor(struct wimlib_thread_pool *pool, int ctype,
+			   u32 max_block_size, unsigned level,
+			   struct wimlib_compressor *compressor)
+{
+	struct cached_compressor *cc;
+	struct cached_compressor *evicted = NULL;
+
+	cc = MALLOC(sizeof(*cc));
+	if (!cc) {
+		wimlib_free_compressor(compressor);
+		return;
+	}
+	cc->ctype = ctype;
+	cc->max_block_size = max_block_size;
+	cc->level = level;
+	cc->compressor = compressor;
+
+	mutex_lock(&pool->lock);
+	list_add(&cc->list, &pool->cached_compressors);
+	if (++pool->num_cached_compressors > 2 * pool->num_started_threads) {
+		evicted = list_entry(pool->cached_compressors.prev,
+				     struct cached_compressor, list);
+		list_del(&evicted->list);
+		pool->num_cached_compressors--;
+	}
+	mutex_unlock(&pool->lock);
+
+	if (evicted)
+		free_cached_compressor(evicted);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_create_thread_pool(unsigned num_threads,
+			  struct wimlib_thread_pool **pool_ret)
+{
+	if (!pool_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	return thread_pool_create(num_threads, pool_ret);
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_free_thread_pool(struct wimlib_thread_pool *pool)
+{
+	if (pool)
+		thread_pool_put(pool);
+}
@@ -23,6 +23,7 @@
 #  include "config.h"
 #endif
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -33,6 +34,10 @@
 #  include <sys/xattr.h>
 #endif
 #include <unistd.h>
+#ifdef __linux__
+#  include <linux/fs.h>
+#  include <sys/ioctl.h>
+#endif
 
 #include "wimlib/apply.h"
 #include "wimlib/assert.h"
@@ -41,8 +46,12 @@
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
 #include "wimlib/reparse.h"
+#include "wimlib/sha1.h"
+#include "wimlib/thread_pool.h"
+#include "wimlib/threads.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
+#include "wimlib/wim.h"
 #include "wimlib/xattr.h"
 
 /* We don't require O_NOFOLLOW, but the advantage of having it is that if we
@@ -54,6 +63,30 @@
 #  define O_NOFOLLOW 0
 #endif
 
+#ifndef O_DIRECTORY
+#  define O_DIRECTORY 0
+#endif
+
+/* Without the *at() system calls, unix_build_at_path() always gives full paths
+ * with AT_FDCWD, so the directory file descriptors can just be ignored.  */
+#ifndef HAVE_OPENAT
+#  ifndef AT_FDCWD
+#    define AT_FDCWD	-100
+#  endif
+#  ifndef AT_SYMLINK_NOFOLLOW
+#    define AT_SYMLINK_NOFOLLOW	0x100
+#  endif
+#  define openat(dirfd, path, ...)	open((path), __VA_ARGS__)
+#  define mkdirat(dirfd, path, mode)	mkdir((path), (mode))
+#  define unlinkat(dirfd, path, flags)	unlink(path)
+#  define linkat(olddirfd, oldpath, newdirfd, newpath, flags) \
+	link((oldpath), (newpath))
+#  define symlinkat(target, dirfd, path)	symlink((target), (path))
+#  define fstatat(dirfd, path, stbuf, flags)	lstat((path), (stbuf))
+#  define fchownat(dirfd, path, uid, gid, flags) lchown((path), (uid), (gid))
+#  define fchmodat(dirfd, path, mode, flags)	chmod((path), (mode))
+#endif
+
 static int
 unix_get_supported_features(const char *target,
 			    struct wim_features *supported_features)
@@ -72,16 +105,40 @@ unix_get_supported_features(const char *target,
 
 #define NUM_PATHBUFS 2  /* We need 2 when creating hard links  */
 
-struct unix_apply_ctx {
-	/* Extract flags, the pointer to the WIMStruct, etc.  */
-	struct apply_ctx common;
-
+/* State of a thread making filesystem calls on the files being extracted.
+ * Besides the main extraction thread, each job that creates files or sets
+ * their metadata on a thread pool has one.  */
+struct unix_thread_ctx {
 	/* Buffers for building extraction paths (allocated).  */
 	char *pathbufs[NUM_PATHBUFS];
 
 	/* Index of next pathbuf to use  */
 	unsigned which_pathbuf;
 
+	/* Number of special files we couldn't create due to EPERM  */
+	unsigned long num_special_files_ignored;
+
+	/* An open file descriptor to the directory for @dir_dentry, or -1.
+	 * See unix_build_at_path().  */
+	int dir_fd;
+	const struct wim_dentry *dir_dentry;
+
+	/* The parent of the last dentry passed to unix_build_at_path() which
+	 * wasn't in @dir_dentry  */
+	const struct wim_dentry *prev_parent;
+
+	/* Index of the file being processed by unix_process_files() in the
+	 * array of files it was given  */
+	size_t file_index;
+};
+
+struct unix_apply_ctx {
+	/* Extract flags, the pointer to the WIMStruct, etc.  */
+	struct apply_ctx common;
+
+	/* State of the main extraction thread  */
+	struct unix_thread_ctx tctx;
+
 	/* Currently open file descriptors for extraction  */
 	struct filedes open_fds[MAX_OPEN_FILES];
 
@@ -96,6 +153,15 @@ struct unix_apply_ctx {
 	/* Whether is_sparse_file[] is true for any currently open file  */
 	bool any_sparse_files;
 
+	/* Number of regular files the current blob is being extracted to
+	 * beyond those in open_fds, which will be copied from open_fds[0]
+	 * when the blob ends  */
+	u32 num_deferred_files;
+
+	/* Whether to clone the deferred files from the first target rather
+	 * than copying them (WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES)  */
+	bool clone_files;
+
 	/* Buffer for reading reparse point data into memory  */
 	u8 reparse_data[REPARSE_DATA_MAX_SIZE];
 
@@ -109,8 +175,12 @@ struct unix_apply_ctx {
 	/* Number of characters in target_abspath.  */
 	size_t target_abspath_nchars;
 
-	/* Number of special files we couldn't create due to EPERM  */
-	unsigned long num_special_files_ignored;
+	/* The symbolic links whose targets have been read, which are created
+	 * once all blobs have been extracted: the first extracted alias of
+	 * each, and its target (allocated)  */
+	const struct wim_dentry **symlinks;
+	char **symlink_targets;
+	size_t num_symlinks;
 };
 
 /* Returns the number of characters needed to represent the path to the
@@ -156,14 +226,15 @@ unix_compute_path_max(const struct list_head *dentry_list,
  * This cycles through NUM_PATHBUFS different buffers.  */
 static const char *
 unix_build_extraction_path(const struct wim_dentry *dentry,
-			   struct unix_apply_ctx *ctx)
+			   struct unix_thread_ctx *tctx,
+			   const struct unix_apply_ctx *ctx)
 {
 	char *pathbuf;
 	char *p;
 	const struct wim_dentry *d;
 
-	pathbuf = ctx->pathbufs[ctx->which_pathbuf];
-	ctx->which_pathbuf = (ctx->which_pathbuf + 1) % NUM_PATHBUFS;
+	pathbuf = tctx->pathbufs[tctx->which_pathbuf];
+	tctx->which_pathbuf = (tctx->which_pathbuf + 1) % NUM_PATHBUFS;
 
 	p = &pathbuf[ctx->common.target_nchars +
 		     unix_dentry_path_length(dentry)];
@@ -184,37 +255,90 @@ unix_build_extraction_path(const struct wim_dentry *dentry,
 /* This causes the next call to unix_build_extraction_path() to use the same
  * path buffer as the previous call.  */
 static void
-unix_reuse_pathbuf(struct unix_apply_ctx *ctx)
+unix_reuse_pathbuf(struct unix_thread_ctx *tctx)
 {
-	ctx->which_pathbuf = (ctx->which_pathbuf - 1) % NUM_PATHBUFS;
+	tctx->which_pathbuf = (tctx->which_pathbuf - 1) % NUM_PATHBUFS;
 }
 
 /* Builds and returns the filesystem path to which to extract an unspecified
  * alias of the @inode.  This cycles through NUM_PATHBUFS different buffers.  */
 static const char *
 unix_build_inode_extraction_path(const struct wim_inode *inode,
-				 struct unix_apply_ctx *ctx)
+				 struct unix_thread_ctx *tctx,
+				 const struct unix_apply_ctx *ctx)
 {
-	return unix_build_extraction_path(inode_first_extraction_dentry(inode), ctx);
+	return unix_build_extraction_path(inode_first_extraction_dentry(inode),
+					  tctx, ctx);
 }
 
-/* Should the specified file be extracted as a directory on UNIX?  We extract
- * the file as a directory if FILE_ATTRIBUTE_DIRECTORY is set and the file does
- * not have a symlink or junction reparse point.  It *may* have a different type
- * of reparse point.  */
-static inline bool
-should_extract_as_directory(const struct wim_inode *inode)
+/*
+ * Builds and returns a path to which to extract @dentry, relative to the
+ * directory file descriptor returned in *dirfd_ret, for use with the *at()
+ * system calls.
+ *
+ * When two files in the same directory come up in a row, the thread opens that
+ * directory and keeps it open, and the files in it are referred to by just
+ * their names until the same happens for another directory.  This saves
+ * building the full path and having the kernel look it up for each file, e.g.
+ * when creating many files in the same directory.  Otherwise, the full path is
+ * returned with AT_FDCWD, so that files in ever changing directories don't cost
+ * any extra system calls.
+ *
+ * The result is valid until the next call to this function with the same
+ * @tctx, or until NUM_PATHBUFS further paths are built.  A full path uses one
+ * path buffer, like unix_build_extraction_path(); a name uses none.
+ */
+static const char *
+unix_build_at_path(const struct wim_dentry *dentry, int *dirfd_ret,
+		   struct unix_thread_ctx *tctx,
+		   const struct unix_apply_ctx *ctx)
 {
-	return (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) &&
-		!inode_is_symlink(inode);
+#if defined(HAVE_OPENAT) && defined(HAVE_UTIMENSAT)
+	const struct wim_dentry *parent = dentry->d_parent;
+
+	if (dentry_is_root(dentry))
+		goto full_path;
+
+	if (parent == tctx->dir_dentry) {
+		*dirfd_ret = tctx->dir_fd;
+		return dentry->d_extraction_name;
+	}
+
+	if (parent == tctx->prev_parent) {
+		const char *dir_path;
+		int fd;
+
+		if (dentry_is_root(parent) || !will_extract_dentry(parent)) {
+			dir_path = ctx->common.target;
+		} else {
+			dir_path = unix_build_extraction_path(parent, tctx,
+							      ctx);
+			unix_reuse_pathbuf(tctx);
+		}
+		fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+		if (fd >= 0) {
+			if (tctx->dir_fd >= 0)
+				close(tctx->dir_fd);
+			tctx->dir_fd = fd;
+			tctx->dir_dentry = parent;
+			*dirfd_ret = fd;
+			return dentry->d_extraction_name;
+		}
+	}
+	tctx->prev_parent = parent;
+full_path:
+#endif
+	*dirfd_ret = AT_FDCWD;
+	return unix_build_extraction_path(dentry, tctx, ctx);
 }
 
 /* Sets the timestamps on a file being extracted.
  *
- * Either @fd or @path must be specified (not -1 and not NULL, respectively).
+ * Either @fd or @path, relative to @dirfd, must be specified (not -1 and not
+ * NULL, respectively).
  */
 static int
-unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
+unix_set_timestamps(int fd, int dirfd, const char *path, u64 atime, u64 mtime)
 {
 	{
 		struct timespec times[2];
@@ -228,7 +352,7 @@ unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
 			return 0;
 #endif
 #ifdef HAVE_UTIMENSAT
-		if (fd < 0 && !utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW))
+		if (fd < 0 && !utimensat(dirfd, path, times, AT_SYMLINK_NOFOLLOW))
 			return 0;
 #endif
 		if (errno != ENOSYS)
@@ -242,28 +366,29 @@ unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
 
 		if (fd >= 0 && !futimes(fd, times))
 			return 0;
-		if (fd < 0 && !lutimes(path, times))
+		if (fd < 0 && dirfd == AT_FDCWD && !lutimes(path, times))
 			return 0;
 		return WIMLIB_ERR_SET_TIMESTAMPS;
 	}
 }
 
 static int
-unix_set_owner_and_group(int fd, const char *path, uid_t uid, gid_t gid)
+unix_set_owner_and_group(int fd, int dirfd, const char *path,
+			 uid_t uid, gid_t gid)
 {
 	if (fd >= 0 && !fchown(fd, uid, gid))
 		return 0;
-	if (fd < 0 && !lchown(path, uid, gid))
+	if (fd < 0 && !fchownat(dirfd, path, uid, gid, AT_SYMLINK_NOFOLLOW))
 		return 0;
 	return WIMLIB_ERR_SET_SECURITY;
 }
 
 static int
-unix_set_mode(int fd, const char *path, mode_t mode)
+unix_set_mode(int fd, int dirfd, const char *path, mode_t mode)
 {
 	if (fd >= 0 && !fchmod(fd, mode))
 		return 0;
-	if (fd < 0 && !chmod(path, mode))
+	if (fd < 0 && !fchmodat(dirfd, path, mode, 0))
 		return 0;
 	return WIMLIB_ERR_SET_SECURITY;
 }
@@ -271,8 +396,9 @@ unix_set_mode(int fd, const char *path, mode_t mode)
 #ifdef HAVE_LINUX_XATTR_SUPPORT
 /* Apply extended attributes to a file */
 static int
-apply_linux_xattrs(int fd, const struct wim_inode *inode,
-		   const char *path, struct unix_apply_ctx *ctx,
+apply_linux_xattrs(int fd, const struct wim_inode *inode, const char *path,
+		   struct unix_thread_ctx *tctx,
+		   const struct unix_apply_ctx *ctx,
 		   const void *entries, size_t entries_size, bool is_old_format)
 {
 	const void * const entries_end = entries + entries_size;
@@ -298,6 +424,7 @@ apply_linux_xattrs(int fd, const struct wim_inode *inode,
 		if (!valid) {
 			if (!path) {
 				path = unix_build_inode_extraction_path(inode,
+									tctx,
 									ctx);
 			}
 			ERROR("\"%s\": extended attribute is corrupt or unsupported",
@@ -329,6 +456,7 @@ apply_linux_xattrs(int fd, const struct wim_inode *inode,
 		if (unlikely(res != 0)) {
 			if (!path) {
 				path = unix_build_inode_extraction_path(inode,
+									tctx,
 									ctx);
 			}
 			if (is_linux_security_xattr(name) &&
@@ -358,13 +486,15 @@ apply_linux_xattrs(int fd, const struct wim_inode *inode,
  * restrictions result in the following ordering which we follow: chown(),
  * setxattr(), then chmod().
  *
- * N.B. the file may be specified by either 'fd' (for regular files) or 'path',
- * and it may be a symlink.  For symlinks we need lchown() and lsetxattr() but
- * need to skip the chmod(), since mode bits are not meaningful for symlinks.
+ * N.B. the file may be specified by either 'fd' (for regular files) or 'path'
+ * relative to 'dirfd', and it may be a symlink.  For symlinks we need lchown()
+ * and lsetxattr() but need to skip the chmod(), since mode bits are not
+ * meaningful for symlinks.
  */
 static int
-apply_unix_metadata(int fd, const struct wim_inode *inode,
-		    const char *path, struct unix_apply_ctx *ctx)
+apply_unix_metadata(int fd, const struct wim_inode *inode, int dirfd,
+		    const char *path, struct unix_thread_ctx *tctx,
+		    const struct unix_apply_ctx *ctx)
 {
 	bool have_dat;
 	struct wimlib_unix_data dat;
@@ -378,26 +508,36 @@ apply_unix_metadata(int fd, const struct wim_inode *inode,
 	have_dat = inode_get_unix_data(inode, &dat);
 
 	if (have_dat) {
-		ret = unix_set_owner_and_group(fd, path, dat.uid, dat.gid);
+		ret = unix_set_owner_and_group(fd, dirfd, path,
+					       dat.uid, dat.gid);
 		if (ret) {
-			if (!path)
-				path = unix_build_inode_extraction_path(inode, ctx);
+			const char *full_path =
+				unix_build_inode_extraction_path(inode, tctx,
+								 ctx);
 			if (ctx->common.extract_flags &
 			    WIMLIB_EXTRACT_FLAG_STRICT_ACLS)
 			{
 				ERROR_WITH_ERRNO("\"%s\": unable to set uid=%"PRIu32" and gid=%"PRIu32,
-						 path, dat.uid, dat.gid);
+						 full_path, dat.uid, dat.gid);
 				return ret;
 			}
 			WARNING_WITH_ERRNO("\"%s\": unable to set uid=%"PRIu32" and gid=%"PRIu32,
-					   path, dat.uid, dat.gid);
+					   full_path, dat.uid, dat.gid);
 		}
 	}
 
 #ifdef HAVE_LINUX_XATTR_SUPPORT
 	entries = inode_get_linux_xattrs(inode, &entries_size, &is_old_format);
 	if (entries) {
-		ret = apply_linux_xattrs(fd, inode, path, ctx,
+		/* lsetxattr() has no *at() variant.  */
+		const char *xattr_path = path;
+
+		if (fd < 0 && dirfd != AT_FDCWD) {
+			xattr_path = unix_build_inode_extraction_path(inode,
+								      tctx,
+								      ctx);
+		}
+		ret = apply_linux_xattrs(fd, inode, xattr_path, tctx, ctx,
 					 entries, entries_size, is_old_format);
 		if (ret)
 			return ret;
@@ -405,19 +545,20 @@ apply_unix_metadata(int fd, const struct wim_inode *inode,
 #endif
 
 	if (have_dat && !inode_is_symlink(inode)) {
-		ret = unix_set_mode(fd, path, dat.mode);
+		ret = unix_set_mode(fd, dirfd, path, dat.mode);
 		if (ret) {
-			if (!path)
-				path = unix_build_inode_extraction_path(inode, ctx);
+			const char *full_path =
+				unix_build_inode_extraction_path(inode, tctx,
+								 ctx);
 			if (ctx->common.extract_flags &
 			    WIMLIB_EXTRACT_FLAG_STRICT_ACLS)
 			{
 				ERROR_WITH_ERRNO("\"%s\": unable to set mode=0%"PRIo32,
-						 path, dat.mode);
+						 full_path, dat.mode);
 				return ret;
 			}
 			WARNING_WITH_ERRNO("\"%s\": unable to set mode=0%"PRIo32,
-					   path, dat.mode);
+					   full_path, dat.mode);
 		}
 	}
 
@@ -428,99 +569,251 @@ apply_unix_metadata(int fd, const struct wim_inode *inode,
  * Set metadata on an extracted file.
  *
  * @fd is an open file descriptor to the extracted file, or -1.  @path is the
- * path to the extracted file, or NULL.  If valid, this function uses @fd.
- * Otherwise, if valid, it uses @path.  Otherwise, it calculates the path to one
- * alias of the extracted file and uses it.
+ * path to the extracted file relative to the directory @dirfd, or NULL.  If
+ * valid, this function uses @fd.  Otherwise, if valid, it uses @path.
+ * Otherwise, it calculates the path to one alias of the extracted file and uses
+ * it.
  */
 static int
-unix_set_metadata(int fd, const struct wim_inode *inode,
-		  const char *path, struct unix_apply_ctx *ctx)
+unix_set_metadata(int fd, const struct wim_inode *inode, int dirfd,
+		  const char *path, struct unix_thread_ctx *tctx,
+		  const struct unix_apply_ctx *ctx)
 {
 	int ret;
 
-	if (fd < 0 && !path)
-		path = unix_build_inode_extraction_path(inode, ctx);
+	if (fd < 0 && !path) {
+		path = unix_build_at_path(inode_first_extraction_dentry(inode),
+					  &dirfd, tctx, ctx);
+	}
 
 	if (ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) {
-		ret = apply_unix_metadata(fd, inode, path, ctx);
+		ret = apply_unix_metadata(fd, inode, dirfd, path, tctx, ctx);
 		if (ret)
 			return ret;
 	}
 
-	ret = unix_set_timestamps(fd, path, inode->i_last_access_time,
+	ret = unix_set_timestamps(fd, dirfd, path, inode->i_last_access_time,
 				  inode->i_last_write_time);
 	if (ret) {
-		if (!path)
-			path = unix_build_inode_extraction_path(inode, ctx);
+		const char *full_path =
+			unix_build_inode_extraction_path(inode, tctx, ctx);
+
 		if (ctx->common.extract_flags &
 		    WIMLIB_EXTRACT_FLAG_STRICT_TIMESTAMPS)
 		{
-			ERROR_WITH_ERRNO("\"%s\": unable to set timestamps", path);
+			ERROR_WITH_ERRNO("\"%s\": unable to set timestamps",
+					 full_path);
 			return ret;
 		}
-		WARNING_WITH_ERRNO("\"%s\": unable to set timestamps", path);
+		WARNING_WITH_ERRNO("\"%s\": unable to set timestamps",
+				   full_path);
 	}
 
 	return 0;
 }
 
 /* Extract all needed aliases of the @inode, where one alias, corresponding to
- * @first_dentry, has already been extracted to @first_path.  */
+ * @first_dentry, has already been extracted.  */
 static int
 unix_create_hardlinks(const struct wim_inode *inode,
 		      const struct wim_dentry *first_dentry,
-		      const char *first_path, struct unix_apply_ctx *ctx)
+		      struct unix_thread_ctx *tctx,
+		      const struct unix_apply_ctx *ctx)
 {
 	const struct wim_dentry *dentry;
+	const char *first_path;
 	const char *newpath;
+	int dirfd;
+
+	if (!inode_first_extraction_dentry(inode)->d_next_extraction_alias)
+		return 0;
 
+	first_path = unix_build_extraction_path(first_dentry, tctx, ctx);
 	inode_for_each_extraction_alias(dentry, inode) {
 		if (dentry == first_dentry)
 			continue;
 
-		newpath = unix_build_extraction_path(dentry, ctx);
+		newpath = unix_build_at_path(dentry, &dirfd, tctx, ctx);
 	retry_link:
-		if (link(first_path, newpath)) {
-			if (errno == EEXIST && !unlink(newpath))
+		if (linkat(AT_FDCWD, first_path, dirfd, newpath, 0)) {
+			if (errno == EEXIST && !unlinkat(dirfd, newpath, 0))
 				goto retry_link;
+			if (dirfd != AT_FDCWD) {
+				newpath = unix_build_extraction_path(dentry,
+								     tctx, ctx);
+			}
 			ERROR_WITH_ERRNO("Can't create hard link "
 					 "\"%s\" => \"%s\"", newpath, first_path);
 			return WIMLIB_ERR_LINK;
 		}
-		unix_reuse_pathbuf(ctx);
+		if (dirfd == AT_FDCWD)
+			unix_reuse_pathbuf(tctx);
 	}
 	return 0;
 }
 
+/* Updating an existing directory tree (WIMLIB_EXTRACT_FLAG_UPDATE) needs the
+ * *at() system calls to delete what's no longer in the image.  */
+#ifdef HAVE_OPENAT
+/* Delete the file or directory tree @name in the directory @parent_fd.  */
+static int
+unix_remove_tree(int parent_fd, const char *name)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int fd;
+	int ret;
+
+	if (!unlinkat(parent_fd, name, 0) || errno == ENOENT)
+		return 0;
+	if (errno != EISDIR && errno != EPERM)
+		return WIMLIB_ERR_WRITE;
+
+	fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0)
+		return WIMLIB_ERR_OPENDIR;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return WIMLIB_ERR_OPENDIR;
+	}
+	ret = 0;
+	while (!ret && (ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		ret = unix_remove_tree(dirfd(dir), ent->d_name);
+	}
+	closedir(dir);
+	if (!ret && unlinkat(parent_fd, name, AT_REMOVEDIR) && errno != ENOENT)
+		ret = WIMLIB_ERR_WRITE;
+	return ret;
+}
+
+static int
+cmp_dentries_by_extraction_name(const void *p1, const void *p2)
+{
+	const struct wim_dentry *d1 = *(const struct wim_dentry **)p1;
+	const struct wim_dentry *d2 = *(const struct wim_dentry **)p2;
+
+	return strcmp(d1->d_extraction_name, d2->d_extraction_name);
+}
+
+static int
+cmp_name_to_dentry(const void *name, const void *p)
+{
+	const struct wim_dentry *dentry = *(const struct wim_dentry **)p;
+
+	return strcmp(name, dentry->d_extraction_name);
+}
+
+/*
+ * For WIMLIB_EXTRACT_FLAG_UPDATE: delete everything in the existing directory
+ * @dentry that isn't being extracted to it.  An entry whose name is being
+ * extracted is deleted too if it's a directory and the file being extracted
+ * isn't, or vice versa, since the one can't simply replace the other.
+ */
+static int
+unix_remove_stale_entries(const struct wim_dentry *dentry,
+			  struct unix_thread_ctx *tctx,
+			  const struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *child;
+	const struct wim_dentry **children;
+	const struct wim_dentry **match;
+	size_t num_children = 0;
+	DIR *dir;
+	struct dirent *ent;
+	struct stat stbuf;
+	const char *path;
+	int fd;
+	int ret;
+
+	for_dentry_child(child, dentry)
+		if (will_extract_dentry(child))
+			num_children++;
+	children = MALLOC(num_children * sizeof(children[0]) + 1);
+	if (!children)
+		return WIMLIB_ERR_NOMEM;
+	num_children = 0;
+	for_dentry_child(child, dentry)
+		if (will_extract_dentry(child))
+			children[num_children++] = child;
+	qsort(children, num_children, sizeof(children[0]),
+	      cmp_dentries_by_extraction_name);
+
+	path = unix_build_extraction_path(dentry, tctx, ctx);
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	dir = (fd >= 0) ? fdopendir(fd) : NULL;
+	if (!dir) {
+		ERROR_WITH_ERRNO("Can't open directory \"%s\"", path);
+		if (fd >= 0)
+			close(fd);
+		FREE(children);
+		return WIMLIB_ERR_OPENDIR;
+	}
+	ret = 0;
+	while (!ret && (ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		match = bsearch(ent->d_name, children, num_children,
+				sizeof(children[0]), cmp_name_to_dentry);
+		if (match && !fstatat(dirfd(dir), ent->d_name, &stbuf,
+				      AT_SYMLINK_NOFOLLOW) &&
+		    S_ISDIR(stbuf.st_mode) ==
+		    should_extract_as_directory((*match)->d_inode))
+			continue;
+		ret = unix_remove_tree(dirfd(dir), ent->d_name);
+		if (ret) {
+			ERROR_WITH_ERRNO("Can't delete \"%s/%s\"",
+					 path, ent->d_name);
+		}
+	}
+	closedir(dir);
+	FREE(children);
+	return ret;
+}
+#endif /* HAVE_OPENAT */
+
 /* If @dentry represents a directory, create it.  */
 static int
 unix_create_if_directory(const struct wim_dentry *dentry,
-			 struct unix_apply_ctx *ctx)
+			 struct unix_thread_ctx *tctx,
+			 const struct unix_apply_ctx *ctx)
 {
 	const char *path;
+	int dirfd;
 	struct stat stbuf;
 
 	if (!should_extract_as_directory(dentry->d_inode))
 		return 0;
 
-	path = unix_build_extraction_path(dentry, ctx);
-	if (mkdir(path, 0755) &&
-	    /* It's okay if the path already exists, as long as it's a
-	     * directory.  */
-	    !(errno == EEXIST && !lstat(path, &stbuf) && S_ISDIR(stbuf.st_mode)))
+	path = unix_build_at_path(dentry, &dirfd, tctx, ctx);
+	if (!mkdirat(dirfd, path, 0755))
+		return 0;
+
+	/* It's okay if the path already exists, as long as it's a directory.
+	 */
+	if (!(errno == EEXIST &&
+	      !fstatat(dirfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) &&
+	      S_ISDIR(stbuf.st_mode)))
 	{
-		ERROR_WITH_ERRNO("Can't create directory \"%s\"", path);
+		ERROR_WITH_ERRNO("Can't create directory \"%s\"",
+				 unix_build_extraction_path(dentry, tctx, ctx));
 		return WIMLIB_ERR_MKDIR;
 	}
-
-	return report_file_created(&ctx->common);
+#ifdef HAVE_OPENAT
+	if (ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UPDATE)
+		return unix_remove_stale_entries(dentry, tctx, ctx);
+#endif
+	return 0;
 }
 
 /* If @dentry represents an empty regular file or a special file, create it, set
  * its metadata, and create any needed hard links.  */
 static int
 unix_extract_if_empty_file(const struct wim_dentry *dentry,
-			   struct unix_apply_ctx *ctx)
+			   struct unix_thread_ctx *tctx,
+			   const struct unix_apply_ctx *ctx)
 {
 	const struct wim_inode *inode;
 	struct wimlib_unix_data unix_data;
@@ -530,7 +823,8 @@ unix_extract_if_empty_file(const struct wim_dentry *dentry,
 	inode = dentry->d_inode;
 
 	/* Extract all aliases only when the "first" comes up.  */
-	if (dentry != inode_first_extraction_dentry(inode))
+	if (dentry != inode_first_extraction_dentry(inode) ||
+	    inode->i_unchanged)
 		return 0;
 
 	/* Is this a directory, a symbolic link, or any type of nonempty file?
@@ -544,13 +838,13 @@ unix_extract_if_empty_file(const struct wim_dentry *dentry,
 	    inode_get_unix_data(inode, &unix_data) &&
 	    !S_ISREG(unix_data.mode))
 	{
-		path = unix_build_extraction_path(dentry, ctx);
+		path = unix_build_extraction_path(dentry, tctx, ctx);
 	retry_mknod:
 		if (mknod(path, unix_data.mode, unix_data.rdev)) {
 			if (errno == EPERM) {
 				WARNING_WITH_ERRNO("Can't create special "
 						   "file \"%s\"", path);
-				ctx->num_special_files_ignored++;
+				tctx->num_special_files_ignored++;
 				return 0;
 			}
 			if (errno == EEXIST && !unlink(path))
@@ -561,108 +855,481 @@ unix_extract_if_empty_file(const struct wim_dentry *dentry,
 		}
 		/* On special files, we can set timestamps immediately because
 		 * we don't need to write any data to them.  */
-		ret = unix_set_metadata(-1, inode, path, ctx);
+		ret = unix_set_metadata(-1, inode, AT_FDCWD, path, tctx, ctx);
 	} else {
+		int dirfd;
 		int fd;
 
-		path = unix_build_extraction_path(dentry, ctx);
+		path = unix_build_at_path(dentry, &dirfd, tctx, ctx);
 	retry_create:
-		fd = open(path, O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0644);
+		fd = openat(dirfd, path, O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW,
+			    0644);
 		if (fd < 0) {
-			if (errno == EEXIST && !unlink(path))
+			if (errno == EEXIST && !unlinkat(dirfd, path, 0))
 				goto retry_create;
-			ERROR_WITH_ERRNO("Can't create regular file \"%s\"", path);
+			ERROR_WITH_ERRNO("Can't create regular file \"%s\"",
+					 unix_build_extraction_path(dentry, tctx,
+								    ctx));
 			return WIMLIB_ERR_OPEN;
 		}
 		/* On empty files, we can set timestamps immediately because we
 		 * don't need to write any data to them.  */
-		ret = unix_set_metadata(fd, inode, path, ctx);
+		ret = unix_set_metadata(fd, inode, dirfd, path, tctx, ctx);
 		if (close(fd) && !ret) {
-			ERROR_WITH_ERRNO("Error closing \"%s\"", path);
+			ERROR_WITH_ERRNO("Error closing \"%s\"",
+					 unix_build_extraction_path(dentry, tctx,
+								    ctx));
 			ret = WIMLIB_ERR_WRITE;
 		}
 	}
 	if (ret)
 		return ret;
 
-	ret = unix_create_hardlinks(inode, dentry, path, ctx);
-	if (ret)
-		return ret;
+	return unix_create_hardlinks(inode, dentry, tctx, ctx);
+}
 
-	return report_file_created(&ctx->common);
+/*
+ * On filesystems where each call has a high latency, such as network
+ * filesystems, creating the directories and empty files and setting the
+ * metadata of the directories can take longer than extracting the file data.
+ * So these phases are run by jobs on a thread pool, which take the files from
+ * a shared array in batches.  Directories are processed one level at a time:
+ * from the top down when creating them, so that each directory exists before
+ * its children are created in it, and from the bottom up when setting their
+ * metadata, so that a directory whose new permissions deny access to it
+ * doesn't prevent setting the metadata of its children.  Empty files are
+ * created in a single pass once all directories exist.  The hard links to
+ * nonempty files and the symbolic links are created in two more passes once
+ * all file data has been extracted, since that's when their targets exist.
+ *
+ * Only the main thread reports progress, after each pass.
+ */
+#define UNIX_FILES_PER_BATCH	32
+
+struct unix_file_job;
+
+typedef int (*unix_file_fn)(const struct wim_dentry *dentry,
+			    struct unix_thread_ctx *tctx,
+			    const struct unix_apply_ctx *ctx);
+
+struct unix_file_queue {
+	struct wimlib_thread_pool *pool;
+	unsigned cursor;
+	const struct unix_apply_ctx *ctx;
+
+	/* One job per thread, each with its own path buffers  */
+	struct unix_file_job *jobs;
+	unsigned num_jobs;
+
+	/* The remaining fields describe the current pass and are protected by
+	 * @lock.  */
+	struct mutex lock;
+	struct condvar done_cond;
+	unix_file_fn fn;
+	const struct wim_dentry * const *dentries;
+	size_t num_dentries;
+	size_t next_dentry;
+	unsigned num_pending;
+	int status;
+};
+
+struct unix_file_job {
+	struct thread_pool_work work;
+	struct unix_file_queue *queue;
+	struct unix_thread_ctx tctx;
+};
+
+static void
+unix_file_job_run(struct thread_pool_work *work)
+{
+	struct unix_file_job *job = container_of(work, struct unix_file_job,
+						 work);
+	struct unix_file_queue *q = job->queue;
+	size_t i = 0, end = 0;
+	int ret = 0;
+
+	mutex_lock(&q->lock);
+	for (;;) {
+		if (ret && !q->status)
+			q->status = ret;
+		if (q->status || q->next_dentry == q->num_dentries)
+			break;
+		i = q->next_dentry;
+		end = min(i + UNIX_FILES_PER_BATCH, q->num_dentries);
+		q->next_dentry = end;
+		mutex_unlock(&q->lock);
+
+		for (; i < end && !ret; i++) {
+			job->tctx.file_index = i;
+			ret = (*q->fn)(q->dentries[i], &job->tctx, q->ctx);
+		}
+
+		mutex_lock(&q->lock);
+	}
+	if (--q->num_pending == 0)
+		condvar_signal(&q->done_cond);
+	mutex_unlock(&q->lock);
+}
+
+/* Initialize the state of a thread, allocating its path buffers.  */
+static bool
+unix_init_thread_ctx(struct unix_thread_ctx *tctx,
+		     const struct unix_apply_ctx *ctx, size_t path_max)
+{
+	tctx->dir_fd = -1;
+	for (unsigned i = 0; i < NUM_PATHBUFS; i++) {
+		tctx->pathbufs[i] = MALLOC(path_max);
+		if (!tctx->pathbufs[i])
+			return false;
+		/* Pre-fill the target in each path buffer.  We'll just append
+		 * the rest of the paths after this.  */
+		memcpy(tctx->pathbufs[i],
+		       ctx->common.target, ctx->common.target_nchars);
+	}
+	return true;
+}
+
+static void
+unix_destroy_thread_ctx(struct unix_thread_ctx *tctx)
+{
+	for (unsigned i = 0; i < NUM_PATHBUFS; i++)
+		FREE(tctx->pathbufs[i]);
+	if (tctx->dir_fd >= 0)
+		close(tctx->dir_fd);
+}
+
+/* Start a queue for processing files on the thread pool set on the WIMStruct
+ * with wimlib_set_thread_pool(), or on a new thread pool if none is set.
+ * Returns NULL on failure, which isn't fatal, since the main thread can still
+ * process the files itself.  */
+static struct unix_file_queue *
+unix_start_file_queue(struct unix_apply_ctx *ctx, size_t path_max)
+{
+	struct unix_file_queue *q;
+	struct wimlib_thread_pool *pool = ctx->common.wim->thread_pool;
+
+	q = CALLOC(1, sizeof(*q));
+	if (!q)
+		return NULL;
+	if (!mutex_init(&q->lock))
+		goto err_free_queue;
+	if (!condvar_init(&q->done_cond))
+		goto err_destroy_lock;
+
+	if (pool)
+		thread_pool_get(pool);
+	else if (thread_pool_create(0, &pool))
+		goto err_destroy_cond;
+	q->pool = pool;
+	q->ctx = ctx;
+
+	q->jobs = CALLOC(thread_pool_num_threads(pool), sizeof(q->jobs[0]));
+	if (!q->jobs)
+		goto err_put_pool;
+	for (; q->num_jobs < thread_pool_num_threads(pool); q->num_jobs++) {
+		struct unix_file_job *job = &q->jobs[q->num_jobs];
+
+		job->work.run = unix_file_job_run;
+		job->work.name = "extract files";
+		job->queue = q;
+		if (!unix_init_thread_ctx(&job->tctx, ctx, path_max)) {
+			unix_destroy_thread_ctx(&job->tctx);
+			break;
+		}
+	}
+	if (q->num_jobs == 0)
+		goto err_free_jobs;
+	return q;
+
+err_free_jobs:
+	FREE(q->jobs);
+err_put_pool:
+	thread_pool_put(pool);
+err_destroy_cond:
+	condvar_destroy(&q->done_cond);
+err_destroy_lock:
+	mutex_destroy(&q->lock);
+err_free_queue:
+	FREE(q);
+	return NULL;
 }
 
+/* Free a queue started with unix_start_file_queue(), adding the counts of
+ * special files the jobs ignored to those of the main thread.  */
+static void
+unix_end_file_queue(struct unix_file_queue *q, struct unix_apply_ctx *ctx)
+{
+	if (!q)
+		return;
+	for (unsigned i = 0; i < q->num_jobs; i++) {
+		ctx->tctx.num_special_files_ignored +=
+			q->jobs[i].tctx.num_special_files_ignored;
+		unix_destroy_thread_ctx(&q->jobs[i].tctx);
+	}
+	FREE(q->jobs);
+	thread_pool_put(q->pool);
+	condvar_destroy(&q->done_cond);
+	mutex_destroy(&q->lock);
+	FREE(q);
+}
+
+/*
+ * Call @fn on each of the @count dentries in @dentries, in no particular order,
+ * using the jobs of @q if it is not NULL or else the main thread.  Then report
+ * progress for each file with @report, unless it is NULL.  The dentries must be
+ * independent of each other.  Returns 0 or the first error encountered.
+ */
 static int
-unix_create_dirs_and_empty_files(const struct list_head *dentry_list,
-				 struct unix_apply_ctx *ctx)
+unix_process_files(const struct wim_dentry * const *dentries, size_t count,
+		   unix_file_fn fn, int (*report)(struct apply_ctx *),
+		   struct unix_file_queue *q, struct unix_apply_ctx *ctx)
+{
+	int ret = 0;
+
+	if (count == 0)
+		return 0;
+
+	if (q) {
+		unsigned num_jobs = min(q->num_jobs,
+					DIV_ROUND_UP(count,
+						     UNIX_FILES_PER_BATCH));
+
+		q->fn = fn;
+		q->dentries = dentries;
+		q->num_dentries = count;
+		q->next_dentry = 0;
+		q->num_pending = num_jobs;
+		q->status = 0;
+		for (unsigned i = 0; i < num_jobs; i++)
+			thread_pool_submit(q->pool, &q->jobs[i].work,
+					   &q->cursor);
+
+		mutex_lock(&q->lock);
+		while (q->num_pending)
+			condvar_wait(&q->done_cond, &q->lock);
+		ret = q->status;
+		mutex_unlock(&q->lock);
+	} else {
+		for (size_t i = 0; i < count && !ret; i++) {
+			ctx->tctx.file_index = i;
+			ret = (*fn)(dentries[i], &ctx->tctx, ctx);
+		}
+	}
+
+	for (size_t i = 0; i < count && !ret && report; i++)
+		ret = (*report)(&ctx->common);
+	return ret;
+}
+
+/* The files to create, in the order they are processed in parallel  */
+struct unix_file_lists {
+	/* The directories, sorted by depth.  The directories at depth d, where
+	 * the topmost extracted directories have depth 0, are
+	 * dirs[dir_depth_start[d]] through dirs[dir_depth_start[d + 1] - 1].  */
+	const struct wim_dentry **dirs;
+	size_t *dir_depth_start;
+	size_t num_dirs;
+	unsigned num_depths;
+
+	/* The first extracted alias of each empty regular file or special
+	 * file  */
+	const struct wim_dentry **empty_files;
+	size_t num_empty_files;
+
+	/* The first extracted alias of each nonempty regular file that has
+	 * other aliases to extract  */
+	const struct wim_dentry **linked_files;
+	size_t num_linked_files;
+
+	/* The number of symbolic links  */
+	size_t num_symlinks;
+};
+
+/* Returns the depth of @dentry among the files being extracted, where the
+ * topmost extracted files have depth 0.  */
+static unsigned
+unix_dentry_depth(const struct wim_dentry *dentry)
+{
+	unsigned depth = 0;
+	const struct wim_dentry *d = dentry->d_parent;
+
+	while (!dentry_is_root(d) && will_extract_dentry(d)) {
+		depth++;
+		d = d->d_parent;
+	}
+	return depth;
+}
+
+static int
+unix_build_file_lists(const struct list_head *dentry_list,
+		      struct unix_file_lists *lists)
 {
 	const struct wim_dentry *dentry;
-	int ret;
+	unsigned *depths;
+	size_t num_dirs = 0;
+	size_t num_empty_files = 0;
+	size_t num_linked_files = 0;
+	unsigned max_depth = 0;
+	size_t i;
 
 	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
-		ret = unix_create_if_directory(dentry, ctx);
-		if (ret)
-			return ret;
+		const struct wim_inode *inode = dentry->d_inode;
+
+		if (should_extract_as_directory(inode))
+			num_dirs++;
+		else if (dentry != inode_first_extraction_dentry(inode))
+			continue;
+		else if (inode_is_symlink(inode))
+			lists->num_symlinks++;
+		else if (!inode_get_blob_for_unnamed_data_stream_resolved(inode))
+			num_empty_files++;
+		else if (dentry->d_next_extraction_alias)
+			num_linked_files++;
 	}
+
+	lists->dirs = MALLOC(num_dirs * sizeof(lists->dirs[0]));
+	lists->empty_files = MALLOC(num_empty_files *
+				    sizeof(lists->empty_files[0]));
+	lists->linked_files = MALLOC(num_linked_files *
+				     sizeof(lists->linked_files[0]));
+	depths = MALLOC(num_dirs * sizeof(depths[0]));
+	if ((num_dirs && (!lists->dirs || !depths)) ||
+	    (num_empty_files && !lists->empty_files) ||
+	    (num_linked_files && !lists->linked_files))
+		goto oom;
+
+	i = 0;
 	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
-		ret = unix_extract_if_empty_file(dentry, ctx);
-		if (ret)
-			return ret;
+		const struct wim_inode *inode = dentry->d_inode;
+
+		if (should_extract_as_directory(inode)) {
+			depths[i] = unix_dentry_depth(dentry);
+			max_depth = max(max_depth, depths[i]);
+			i++;
+		} else if (dentry != inode_first_extraction_dentry(inode) ||
+			   inode_is_symlink(inode)) {
+			continue;
+		} else if (!inode_get_blob_for_unnamed_data_stream_resolved(inode)) {
+			lists->empty_files[lists->num_empty_files++] = dentry;
+		} else if (dentry->d_next_extraction_alias) {
+			lists->linked_files[lists->num_linked_files++] = dentry;
+		}
 	}
+
+	/* Counting sort of the directories by depth  */
+	lists->num_depths = num_dirs ? max_depth + 1 : 0;
+	lists->dir_depth_start = CALLOC(lists->num_depths + 1,
+					sizeof(lists->dir_depth_start[0]));
+	if (!lists->dir_depth_start)
+		goto oom;
+	for (i = 0; i < num_dirs; i++)
+		lists->dir_depth_start[depths[i] + 1]++;
+	for (unsigned d = 0; d < lists->num_depths; d++)
+		lists->dir_depth_start[d + 1] += lists->dir_depth_start[d];
+	i = 0;
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (should_extract_as_directory(dentry->d_inode)) {
+			lists->dirs[lists->dir_depth_start[depths[i]]++] =
+				dentry;
+			i++;
+		}
+	}
+	/* Each start index was advanced to the next depth's start; shift them
+	 * back.  */
+	for (unsigned d = lists->num_depths; d > 0; d--)
+		lists->dir_depth_start[d] = lists->dir_depth_start[d - 1];
+	lists->dir_depth_start[0] = 0;
+	lists->num_dirs = num_dirs;
+	FREE(depths);
 	return 0;
+
+oom:
+	FREE(depths);
+	return WIMLIB_ERR_NOMEM;
 }
 
 static void
-unix_count_dentries(const struct list_head *dentry_list,
-		    u64 *dir_count_ret, u64 *empty_file_count_ret)
+unix_free_file_lists(struct unix_file_lists *lists)
 {
-	const struct wim_dentry *dentry;
-	u64 dir_count = 0;
-	u64 empty_file_count = 0;
+	FREE(lists->dirs);
+	FREE(lists->dir_depth_start);
+	FREE(lists->empty_files);
+	FREE(lists->linked_files);
+}
 
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+static int
+unix_create_dirs_and_empty_files(const struct unix_file_lists *lists,
+				 struct unix_file_queue *q,
+				 struct unix_apply_ctx *ctx)
+{
+	int ret;
 
-		const struct wim_inode *inode = dentry->d_inode;
+	for (unsigned d = 0; d < lists->num_depths; d++) {
+		size_t start = lists->dir_depth_start[d];
 
-		if (should_extract_as_directory(inode))
-			dir_count++;
-		else if ((dentry == inode_first_extraction_dentry(inode)) &&
-			 !inode_is_symlink(inode) &&
-			 !inode_get_blob_for_unnamed_data_stream_resolved(inode))
-			empty_file_count++;
+		ret = unix_process_files(&lists->dirs[start],
+					 lists->dir_depth_start[d + 1] - start,
+					 unix_create_if_directory,
+					 report_file_created, q, ctx);
+		if (ret)
+			return ret;
 	}
-
-	*dir_count_ret = dir_count;
-	*empty_file_count_ret = empty_file_count;
+	return unix_process_files(lists->empty_files, lists->num_empty_files,
+				  unix_extract_if_empty_file,
+				  report_file_created, q, ctx);
 }
 
+/* Read the target of the symbolic link @inode from its reparse data, which is
+ * in ctx->reparse_data, into an allocated buffer.  */
 static int
-unix_create_symlink(const struct wim_inode *inode, const char *path,
-		    size_t rpdatalen, struct unix_apply_ctx *ctx)
+unix_read_symlink_target(const struct wim_inode *inode, size_t rpdatalen,
+			 struct unix_apply_ctx *ctx, char **target_ret)
 {
 	char target[REPARSE_POINT_MAX_SIZE];
 	struct blob_descriptor blob_override;
+	const struct wim_dentry *image_root = NULL;
+	size_t altroot_nchars = ctx->target_abspath_nchars;
 	int ret;
 
+	/* When extracting all images, absolute links are fixed up to point into
+	 * the directory of the link's own image.  */
+	if (ctx->target_abspath && ctx->common.all_images) {
+		image_root = inode_first_extraction_dentry(inode);
+		while (!dentry_is_root(image_root->d_parent))
+			image_root = image_root->d_parent;
+		altroot_nchars += 1 + image_root->d_extraction_name_nchars;
+	}
+
+	char altroot[altroot_nchars + 1];
+
+	if (ctx->target_abspath) {
+		memcpy(altroot, ctx->target_abspath, ctx->target_abspath_nchars);
+		if (image_root) {
+			altroot[ctx->target_abspath_nchars] = '/';
+			memcpy(&altroot[ctx->target_abspath_nchars + 1],
+			       image_root->d_extraction_name,
+			       image_root->d_extraction_name_nchars);
+		}
+		altroot[altroot_nchars] = '\0';
+	}
+
 	blob_set_is_located_in_attached_buffer(&blob_override,
 					       ctx->reparse_data, rpdatalen);
 
 	ret = wim_inode_readlink(inode, target, sizeof(target) - 1,
 				 &blob_override,
-				 ctx->target_abspath,
-				 ctx->target_abspath_nchars);
+				 ctx->target_abspath ? altroot : NULL,
+				 altroot_nchars);
 	if (unlikely(ret < 0)) {
 		errno = -ret;
 		return WIMLIB_ERR_READLINK;
 	}
 	target[ret] = '\0';
 
-retry_symlink:
-	if (symlink(target, path)) {
-		if (errno == EEXIST && !unlink(path))
-			goto retry_symlink;
-		return WIMLIB_ERR_LINK;
-	}
+	*target_ret = MALLOC(ret + 1);
+	if (!*target_ret)
+		return WIMLIB_ERR_NOMEM;
+	memcpy(*target_ret, target, ret + 1);
 	return 0;
 }
 
@@ -672,18 +1339,68 @@ unix_cleanup_open_fds(struct unix_apply_ctx *ctx, unsigned offset)
 	for (unsigned i = offset; i < ctx->num_open_fds; i++)
 		filedes_close(&ctx->open_fds[i]);
 	ctx->num_open_fds = 0;
+	ctx->num_deferred_files = 0;
 	ctx->any_sparse_files = false;
 }
 
+/* Create the regular file for @inode, opened with the access mode @access
+ * (O_WRONLY or O_RDWR).  Its other aliases (hard links) are created later, by
+ * unix_create_links().  */
+static int
+unix_create_regular_file(const struct wim_inode *inode, int access,
+			 struct unix_apply_ctx *ctx, int *fd_ret)
+{
+	const struct wim_dentry *first_dentry;
+	const char *first_path;
+	int dirfd;
+	int fd;
+
+	first_dentry = inode_first_extraction_dentry(inode);
+	first_path = unix_build_at_path(first_dentry, &dirfd, &ctx->tctx, ctx);
+retry_create:
+	fd = openat(dirfd, first_path, O_EXCL | O_CREAT | access | O_NOFOLLOW,
+		    0644);
+	if (fd < 0) {
+		if (errno == EEXIST && !unlinkat(dirfd, first_path, 0))
+			goto retry_create;
+		ERROR_WITH_ERRNO("Can't create regular file \"%s\"",
+				 unix_build_extraction_path(first_dentry,
+							    &ctx->tctx, ctx));
+		return WIMLIB_ERR_OPEN;
+	}
+	*fd_ret = fd;
+	return 0;
+}
+
+/*
+ * Reserve space for the @size bytes of data about to be written to the new
+ * file @fd, so that the filesystem can allocate it contiguously rather than
+ * piece by piece as the file grows.  This isn't done for sparse files, whose
+ * holes are only known as the data is written.
+ *
+ * On Linux, fallocate() with FALLOC_FL_KEEP_SIZE is used, so that the file size
+ * still follows the data actually written.  Unlike posix_fallocate(), it fails
+ * rather than writing zeroes when the filesystem can't preallocate space, which
+ * would double the amount of data written.  Failure is ignored either way.
+ */
+static void
+unix_preallocate(int fd, u64 size)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#elif defined(HAVE_POSIX_FALLOCATE) && !defined(__linux__)
+	posix_fallocate(fd, 0, size);
+#endif
+}
+
 static int
 unix_begin_extract_blob_instance(const struct blob_descriptor *blob,
 				 const struct wim_inode *inode,
 				 const struct wim_inode_stream *strm,
 				 struct unix_apply_ctx *ctx)
 {
-	const struct wim_dentry *first_dentry;
-	const char *first_path;
 	int fd;
+	int ret;
 
 	if (unlikely(strm->stream_type == STREAM_TYPE_REPARSE_POINT)) {
 		/* On UNIX, symbolic links must be created with symlink(), which
@@ -703,30 +1420,32 @@ unix_begin_extract_blob_instance(const struct blob_descriptor *blob,
 
 	/* Unnamed data stream of "regular" file  */
 
-	/* This should be ensured by extract_blob_list()  */
-	wimlib_assert(ctx->num_open_fds < MAX_OPEN_FILES);
-
-	first_dentry = inode_first_extraction_dentry(inode);
-	first_path = unix_build_extraction_path(first_dentry, ctx);
-retry_create:
-	fd = open(first_path, O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0644);
-	if (fd < 0) {
-		if (errno == EEXIST && !unlink(first_path))
-			goto retry_create;
-		ERROR_WITH_ERRNO("Can't create regular file \"%s\"", first_path);
-		return WIMLIB_ERR_OPEN;
+	/* If there are more targets than can be open at once, or if they are
+	 * to be cloned, the rest are copied from the first one when the blob
+	 * ends.  */
+	if (ctx->num_open_fds == MAX_OPEN_FILES ||
+	    (ctx->clone_files && ctx->num_open_fds)) {
+		ctx->num_deferred_files++;
+		return 0;
 	}
+
+	/* The first target is also read back from if the others are copied
+	 * from it, so open it for reading too rather than reopening it later.
+	 */
+	ret = unix_create_regular_file(inode,
+				       ctx->num_open_fds ? O_WRONLY : O_RDWR,
+				       ctx, &fd);
+	if (ret)
+		return ret;
 	if (inode->i_attributes & FILE_ATTRIBUTE_SPARSE_FILE) {
 		ctx->is_sparse_file[ctx->num_open_fds] = true;
 		ctx->any_sparse_files = true;
 	} else {
 		ctx->is_sparse_file[ctx->num_open_fds] = false;
-#ifdef HAVE_POSIX_FALLOCATE
-		posix_fallocate(fd, 0, blob->size);
-#endif
+		unix_preallocate(fd, blob->size);
 	}
 	filedes_init(&ctx->open_fds[ctx->num_open_fds++], fd);
-	return unix_create_hardlinks(inode, first_dentry, first_path, ctx);
+	return 0;
 }
 
 /* Called when starting to read a blob for extraction  */
@@ -789,6 +1508,133 @@ err:
 	return ret;
 }
 
+/* Copy the first @size bytes of the file open on @in_fd, which has been fully
+ * extracted, to the new file @out_fd.  If @sparse, then only the nonzero
+ * regions are written, and @out_fd is extended to its final size.  */
+static int
+unix_copy_extracted_data(struct filedes *in_fd, struct filedes *out_fd,
+			 u64 size, bool sparse)
+{
+	u64 offset = 0;
+	u8 *buf;
+	int ret = 0;
+
+	/* If possible, have the kernel copy the data, which on filesystems
+	 * such as XFS and Btrfs shares the extents instead.  */
+	if (!sparse)
+		offset = filedes_copy_range(in_fd, 0, out_fd, size);
+	if (offset == size)
+		return 0;
+
+	buf = MALLOC(BUFFER_SIZE);
+	if (!buf)
+		return WIMLIB_ERR_NOMEM;
+	while (offset < size) {
+		size_t n = min(size - offset, BUFFER_SIZE);
+		const u8 *p, *end = buf + n;
+		size_t len;
+
+		ret = full_pread(in_fd, buf, n, offset);
+		if (ret)
+			break;
+		for (p = buf; p != end; p += len, offset += len) {
+			if (maybe_detect_sparse_region(p, end - p, &len, sparse))
+				continue;
+			ret = full_pwrite(out_fd, p, len, offset);
+			if (ret)
+				goto out;
+		}
+	}
+	if (!ret && sparse && ftruncate(out_fd->fd, size))
+		ret = WIMLIB_ERR_WRITE;
+out:
+	FREE(buf);
+	return ret;
+}
+
+/* Try to make the new file @out_fd a clone of the fully extracted file @in_fd,
+ * sharing its extents.  If the filesystem doesn't support this, then give up on
+ * cloning for the rest of the extraction.  */
+static bool
+unix_clone_file(struct filedes *in_fd, struct filedes *out_fd,
+		struct unix_apply_ctx *ctx)
+{
+#ifdef FICLONE
+	if (!ioctl(out_fd->fd, FICLONE, in_fd->fd))
+		return true;
+	if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV ||
+	    errno == EINVAL)
+	{
+		WARNING_WITH_ERRNO("The target filesystem can't clone files; "
+				   "copying duplicate files instead");
+		ctx->clone_files = false;
+	}
+#endif
+	return false;
+}
+
+/* Extract the data of a blob to the files for which it had no open file
+ * descriptor, by cloning or copying it from the first target.  */
+static int
+unix_extract_deferred_files(struct blob_descriptor *blob,
+			    struct unix_apply_ctx *ctx)
+{
+	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+	struct filedes *in_fd = &ctx->open_fds[0];
+	unsigned num_regular = 0;
+	int ret;
+
+	/* The first target, which was opened for reading and writing, must
+	 * have its final size to be copied from.  */
+	if (ctx->is_sparse_file[0] && ftruncate(in_fd->fd, blob->size)) {
+		const struct wim_inode *first_inode = NULL;
+
+		for (u32 i = 0; !first_inode; i++)
+			if (!inode_is_symlink(targets[i].inode))
+				first_inode = targets[i].inode;
+		ERROR_WITH_ERRNO("Error extending \"%s\" to final size",
+				 unix_build_inode_extraction_path(first_inode,
+								  &ctx->tctx,
+								  ctx));
+		return WIMLIB_ERR_WRITE;
+	}
+
+	ret = 0;
+	for (u32 i = 0; i < blob->out_refcnt; i++) {
+		struct wim_inode *inode = targets[i].inode;
+		struct filedes out_fd;
+		int fd;
+
+		if (inode_is_symlink(inode) ||
+		    num_regular++ < ctx->num_open_fds)
+			continue;
+
+		ret = unix_create_regular_file(inode, O_WRONLY, ctx, &fd);
+		if (ret)
+			break;
+		filedes_init(&out_fd, fd);
+		if (!ctx->clone_files ||
+		    !unix_clone_file(in_fd, &out_fd, ctx))
+			ret = unix_copy_extracted_data(in_fd, &out_fd,
+						       blob->size,
+						       inode->i_attributes &
+						       FILE_ATTRIBUTE_SPARSE_FILE);
+		if (!ret)
+			ret = unix_set_metadata(fd, inode, AT_FDCWD, NULL,
+						&ctx->tctx, ctx);
+		if (filedes_close(&out_fd) && !ret)
+			ret = WIMLIB_ERR_WRITE;
+		if (ret) {
+			if (ret == WIMLIB_ERR_WRITE || ret == WIMLIB_ERR_READ)
+				ERROR_WITH_ERRNO("Error writing data to \"%s\"",
+						 unix_build_inode_extraction_path(
+							inode, &ctx->tctx, ctx));
+			break;
+		}
+	}
+	return ret;
+}
+
 /* Called when a blob has been fully read for extraction  */
 static int
 unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
@@ -805,45 +1651,63 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 		return status;
 	}
 
+	if (unlikely(ctx->num_deferred_files)) {
+		ret = unix_extract_deferred_files(blob, ctx);
+		if (ret) {
+			unix_cleanup_open_fds(ctx, 0);
+			return ret;
+		}
+	}
+
 	j = 0;
 	ret = 0;
 	for (u32 i = 0; i < blob->out_refcnt; i++) {
 		struct wim_inode *inode = targets[i].inode;
 
 		if (inode_is_symlink(inode)) {
-			/* We finally have the symlink data, so we can create
-			 * the symlink.  */
-			const char *path;
+			/* We finally have the symlink data, so we can get the
+			 * target of the symlink.  The symlink is created later,
+			 * by unix_create_links().  */
+			size_t n = ctx->num_symlinks;
 
-			path = unix_build_inode_extraction_path(inode, ctx);
-			ret = unix_create_symlink(inode, path, blob->size, ctx);
+			ret = unix_read_symlink_target(inode, blob->size, ctx,
+						       &ctx->symlink_targets[n]);
 			if (ret) {
 				ERROR_WITH_ERRNO("Can't create symbolic link "
-						 "\"%s\"", path);
+						 "\"%s\"",
+						 unix_build_inode_extraction_path(
+							inode, &ctx->tctx, ctx));
 				break;
 			}
-			ret = unix_set_metadata(-1, inode, path, ctx);
-			if (ret)
-				break;
+			ctx->symlinks[n] = inode_first_extraction_dentry(inode);
+			ctx->num_symlinks++;
 		} else {
-			struct filedes *fd = &ctx->open_fds[j];
+			struct filedes *fd;
+
+			/* Already copied by unix_extract_deferred_files()?  */
+			if (j == ctx->num_open_fds)
+				continue;
+			fd = &ctx->open_fds[j];
 
 			/* If the file is sparse, extend it to its final size. */
 			if (ctx->is_sparse_file[j] && ftruncate(fd->fd, blob->size)) {
 				ERROR_WITH_ERRNO("Error extending \"%s\" to final size",
-						 unix_build_inode_extraction_path(inode, ctx));
+						 unix_build_inode_extraction_path(
+							inode, &ctx->tctx, ctx));
 				ret = WIMLIB_ERR_WRITE;
 				break;
 			}
 
 			/* Set metadata on regular file just before closing.  */
-			ret = unix_set_metadata(fd->fd, inode, NULL, ctx);
+			ret = unix_set_metadata(fd->fd, inode, AT_FDCWD, NULL,
+						&ctx->tctx, ctx);
 			if (ret)
 				break;
 
 			if (filedes_close(fd)) {
 				ERROR_WITH_ERRNO("Error closing \"%s\"",
-						 unix_build_inode_extraction_path(inode, ctx));
+						 unix_build_inode_extraction_path(
+							inode, &ctx->tctx, ctx));
 				ret = WIMLIB_ERR_WRITE;
 				break;
 			}
@@ -854,24 +1718,237 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	return ret;
 }
 
+/* Create the other aliases of the nonempty regular file @dentry.  */
+static int
+unix_link_file(const struct wim_dentry *dentry, struct unix_thread_ctx *tctx,
+	       const struct unix_apply_ctx *ctx)
+{
+	if (dentry->d_inode->i_unchanged)
+		return 0;
+	return unix_create_hardlinks(dentry->d_inode, dentry, tctx, ctx);
+}
+
+/* Create the symbolic link @dentry, whose target was read by
+ * unix_end_extract_blob(), and set its metadata.  */
+static int
+unix_create_symlink(const struct wim_dentry *dentry,
+		    struct unix_thread_ctx *tctx,
+		    const struct unix_apply_ctx *ctx)
+{
+	const char *target = ctx->symlink_targets[tctx->file_index];
+	const char *path;
+	int dirfd;
+
+	path = unix_build_at_path(dentry, &dirfd, tctx, ctx);
+retry_symlink:
+	if (symlinkat(target, dirfd, path)) {
+		if (errno == EEXIST && !unlinkat(dirfd, path, 0))
+			goto retry_symlink;
+		ERROR_WITH_ERRNO("Can't create symbolic link \"%s\"",
+				 unix_build_extraction_path(dentry, tctx, ctx));
+		return WIMLIB_ERR_LINK;
+	}
+	return unix_set_metadata(-1, dentry->d_inode, dirfd, path, tctx, ctx);
+}
+
+/* Create the hard links to the nonempty regular files and the symbolic links,
+ * now that their targets exist.  Each link can take a round trip to a network
+ * filesystem, and some images have millions of them, so this is done on the
+ * thread pool too.  */
+static int
+unix_create_links(const struct unix_file_lists *lists,
+		  struct unix_file_queue *q, struct unix_apply_ctx *ctx)
+{
+	int ret;
+
+	ret = unix_process_files(lists->linked_files, lists->num_linked_files,
+				 unix_link_file, NULL, q, ctx);
+	if (ret)
+		return ret;
+	return unix_process_files(ctx->symlinks, ctx->num_symlinks,
+				  unix_create_symlink, NULL, q, ctx);
+}
+
+static int
+unix_set_dir_metadata_fn(const struct wim_dentry *dentry,
+			 struct unix_thread_ctx *tctx,
+			 const struct unix_apply_ctx *ctx)
+{
+	return unix_set_metadata(-1, dentry->d_inode, AT_FDCWD, NULL, tctx,
+				 ctx);
+}
+
+static int
+unix_set_dir_metadata(const struct unix_file_lists *lists,
+		      struct unix_file_queue *q, struct unix_apply_ctx *ctx)
+{
+	int ret;
+
+	for (unsigned d = lists->num_depths; d-- > 0; ) {
+		size_t start = lists->dir_depth_start[d];
+
+		ret = unix_process_files(&lists->dirs[start],
+					 lists->dir_depth_start[d + 1] - start,
+					 unix_set_dir_metadata_fn,
+					 report_file_metadata_applied, q, ctx);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+#ifdef HAVE_OPENAT
+/* Does the regular file @fd have the contents of @blob?  */
+static int
+unix_file_has_blob_contents(int fd, const struct blob_descriptor *blob,
+			    void *buf, size_t bufsize, bool *matches_ret)
+{
+	struct filedes fdes;
+	struct sha1_ctx sha_ctx;
+	u8 hash[SHA1_HASH_SIZE];
+	u64 remaining = blob->size;
+	int ret;
+
+	filedes_init(&fdes, fd);
+	sha1_init(&sha_ctx);
+	while (remaining) {
+		size_t n = min(remaining, bufsize);
+
+		ret = full_read(&fdes, buf, n);
+		if (ret)
+			return ret;
+		sha1_update(&sha_ctx, buf, n);
+		remaining -= n;
+	}
+	sha1_final(&sha_ctx, hash);
+	*matches_ret = hashes_equal(hash, blob->hash);
+	return 0;
+}
+
+/*
+ * Set i_unchanged on @inode if it's a regular file which already exists at the
+ * target with its contents from the image.  The file must have exactly the
+ * aliases in the extraction and the right size.  If its last modification time
+ * (and with UNIX_DATA, its mode and owner) is also right, it's assumed to be
+ * unchanged without reading it.  Otherwise it's checksummed, and if its
+ * contents are right, its metadata is set right away.
+ */
 static int
-unix_set_dir_metadata(struct list_head *dentry_list, struct unix_apply_ctx *ctx)
+unix_check_if_unchanged(struct wim_inode *inode, struct unix_thread_ctx *tctx,
+			const struct unix_apply_ctx *ctx, void *buf,
+			size_t bufsize)
 {
+	const struct blob_descriptor *blob;
 	const struct wim_dentry *dentry;
+	struct wimlib_unix_data unix_data;
+	struct stat stbuf, alias_stbuf;
+	unsigned long num_aliases = 0;
+	const char *path;
+	int dirfd;
+	int fd;
+	bool matches;
 	int ret;
 
-	list_for_each_entry_reverse(dentry, dentry_list, d_extraction_list_node) {
-		if (should_extract_as_directory(dentry->d_inode)) {
-			ret = unix_set_metadata(-1, dentry->d_inode, NULL, ctx);
-			if (ret)
-				return ret;
-			ret = report_file_metadata_applied(&ctx->common);
-			if (ret)
-				return ret;
+	if (should_extract_as_directory(inode) || inode_is_symlink(inode))
+		return 0;
+	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
+	    inode_get_unix_data(inode, &unix_data) &&
+	    !S_ISREG(unix_data.mode))
+		return 0;
+	blob = inode_get_blob_for_unnamed_data_stream_resolved(inode);
+
+	inode_for_each_extraction_alias(dentry, inode) {
+		path = unix_build_at_path(dentry, &dirfd, tctx, ctx);
+		if (fstatat(dirfd, path, &alias_stbuf, AT_SYMLINK_NOFOLLOW))
+			return 0;
+		if (num_aliases++ == 0)
+			stbuf = alias_stbuf;
+		else if (alias_stbuf.st_ino != stbuf.st_ino ||
+			 alias_stbuf.st_dev != stbuf.st_dev)
+			return 0;
+	}
+	if (!S_ISREG(stbuf.st_mode) || stbuf.st_nlink != num_aliases ||
+	    stbuf.st_size != (blob ? blob->size : 0))
+		return 0;
+
+#ifdef HAVE_STAT_NANOSECOND_PRECISION
+	matches = (timespec_to_wim_timestamp(&stbuf.st_mtim) ==
+		   inode->i_last_write_time);
+#else
+	matches = (time_t_to_wim_timestamp(stbuf.st_mtime) ==
+		   inode->i_last_write_time);
+#endif
+	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
+	    inode_get_unix_data(inode, &unix_data) &&
+	    (unix_data.mode != stbuf.st_mode || unix_data.uid != stbuf.st_uid ||
+	     unix_data.gid != stbuf.st_gid))
+		matches = false;
+	if (matches) {
+		inode->i_unchanged = 1;
+		return 0;
+	}
+
+	path = unix_build_at_path(inode_first_extraction_dentry(inode), &dirfd,
+				  tctx, ctx);
+	fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return 0;
+	matches = true;
+	if (blob) {
+		ret = unix_file_has_blob_contents(fd, blob, buf, bufsize,
+						  &matches);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error reading \"%s\"",
+					 unix_build_inode_extraction_path(
+							inode, tctx, ctx));
+			close(fd);
+			return ret;
 		}
 	}
-	return 0;
+	ret = 0;
+	if (matches) {
+		ret = unix_set_metadata(fd, inode, -1, NULL, tctx, ctx);
+		if (!ret)
+			inode->i_unchanged = 1;
+	}
+	close(fd);
+	return ret;
+}
+
+static int
+unix_find_unchanged_files(struct list_head *dentry_list,
+			  struct apply_ctx *_ctx)
+{
+	struct unix_apply_ctx *ctx = (struct unix_apply_ctx *)_ctx;
+	struct unix_thread_ctx tctx = { .dir_fd = -1 };
+	const size_t bufsize = 65536;
+	struct wim_dentry *dentry;
+	void *buf;
+	int ret;
+
+	buf = MALLOC(bufsize);
+	if (!buf ||
+	    !unix_init_thread_ctx(&tctx, ctx,
+				  unix_compute_path_max(dentry_list, ctx)))
+	{
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+	ret = 0;
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (dentry != inode_first_extraction_dentry(dentry->d_inode))
+			continue;
+		ret = unix_check_if_unchanged(dentry->d_inode, &tctx, ctx,
+					      buf, bufsize);
+		if (ret)
+			break;
+	}
+out:
+	unix_destroy_thread_ctx(&tctx);
+	FREE(buf);
+	return ret;
 }
+#endif /* HAVE_OPENAT */
 
 static int
 unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
@@ -879,23 +1956,16 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	int ret;
 	struct unix_apply_ctx *ctx = (struct unix_apply_ctx *)_ctx;
 	size_t path_max;
-	u64 dir_count;
-	u64 empty_file_count;
+	struct unix_file_lists lists = {};
+	struct unix_file_queue *file_queue = NULL;
 
 	/* Compute the maximum path length that will be needed, then allocate
 	 * some path buffers.  */
 	path_max = unix_compute_path_max(dentry_list, ctx);
 
-	for (unsigned i = 0; i < NUM_PATHBUFS; i++) {
-		ctx->pathbufs[i] = MALLOC(path_max);
-		if (!ctx->pathbufs[i]) {
-			ret = WIMLIB_ERR_NOMEM;
-			goto out;
-		}
-		/* Pre-fill the target in each path buffer.  We'll just append
-		 * the rest of the paths after this.  */
-		memcpy(ctx->pathbufs[i],
-		       ctx->common.target, ctx->common.target_nchars);
+	if (!unix_init_thread_ctx(&ctx->tctx, ctx, path_max)) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
 	}
 
 	/* Extract directories and empty regular files.  Directories are needed
@@ -903,16 +1973,30 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	 * exist.  Empty files are needed because they don't have
 	 * representatives in the blob list.  */
 
-	unix_count_dentries(dentry_list, &dir_count, &empty_file_count);
+	ret = unix_build_file_lists(dentry_list, &lists);
+	if (ret)
+		goto out;
 
-	ret = start_file_structure_phase(&ctx->common, dir_count + empty_file_count);
+	ret = start_file_structure_phase(&ctx->common,
+					 lists.num_dirs + lists.num_empty_files);
 	if (ret)
 		goto out;
 
-	ret = unix_create_dirs_and_empty_files(dentry_list, ctx);
+	if (lists.num_dirs + lists.num_empty_files > UNIX_FILES_PER_BATCH)
+		file_queue = unix_start_file_queue(ctx, path_max);
+
+	ret = unix_create_dirs_and_empty_files(&lists, file_queue, ctx);
 	if (ret)
 		goto out;
 
+	ctx->symlinks = MALLOC(lists.num_symlinks * sizeof(ctx->symlinks[0]));
+	ctx->symlink_targets = MALLOC(lists.num_symlinks *
+				      sizeof(ctx->symlink_targets[0]));
+	if (lists.num_symlinks && (!ctx->symlinks || !ctx->symlink_targets)) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+
 	ret = end_file_structure_phase(&ctx->common);
 	if (ret)
 		goto out;
@@ -931,6 +2015,11 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 
 	/* Extract nonempty regular files and symbolic links.  */
 
+#ifdef FICLONE
+	ctx->clone_files = (ctx->common.extract_flags &
+			    WIMLIB_EXTRACT_FLAG_CLONE_DUPLICATES);
+#endif
+
 	struct read_blob_callbacks cbs = {
 		.begin_blob	= unix_begin_extract_blob,
 		.continue_blob	= unix_extract_chunk,
@@ -941,14 +2030,22 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	if (ret)
 		goto out;
 
+	/* Create hard links and symbolic links.  */
+	if (!file_queue && lists.num_linked_files + ctx->num_symlinks >
+			   UNIX_FILES_PER_BATCH)
+		file_queue = unix_start_file_queue(ctx, path_max);
+
+	ret = unix_create_links(&lists, file_queue, ctx);
+	if (ret)
+		goto out;
 
 	/* Set directory metadata.  We do this last so that we get the right
 	 * directory timestamps.  */
-	ret = start_file_metadata_phase(&ctx->common, dir_count);
+	ret = start_file_metadata_phase(&ctx->common, lists.num_dirs);
 	if (ret)
 		goto out;
 
-	ret = unix_set_dir_metadata(dentry_list, ctx);
+	ret = unix_set_dir_metadata(&lists, file_queue, ctx);
 	if (ret)
 		goto out;
 
@@ -956,14 +2053,22 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	if (ret)
 		goto out;
 
-	if (ctx->num_special_files_ignored) {
+	unix_end_file_queue(file_queue, ctx);
+	file_queue = NULL;
+
+	if (ctx->tctx.num_special_files_ignored) {
 		WARNING("%lu special files were not extracted due to EPERM!",
-			ctx->num_special_files_ignored);
+			ctx->tctx.num_special_files_ignored);
 	}
 out:
-	for (unsigned i = 0; i < NUM_PATHBUFS; i++)
-		FREE(ctx->pathbufs[i]);
+	unix_end_file_queue(file_queue, ctx);
+	unix_free_file_lists(&lists);
+	unix_destroy_thread_ctx(&ctx->tctx);
 	FREE(ctx->target_abspath);
+	for (size_t i = 0; i < ctx->num_symlinks; i++)
+		FREE(ctx->symlink_targets[i]);
+	FREE(ctx->symlink_targets);
+	FREE(ctx->symlinks);
 	return ret;
 }
 
@@ -971,5 +2076,9 @@ const struct apply_operations unix_apply_ops = {
 	.name			= "UNIX",
 	.get_supported_features = unix_get_supported_features,
 	.extract                = unix_extract,
+#ifdef HAVE_OPENAT
+	.find_unchanged_files	= unix_find_unchanged_files,
+#endif
 	.context_size           = sizeof(struct unix_apply_ctx),
+	.unlimited_blob_targets	= true,
 };
@@ -29,7 +29,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#ifdef HAVE_STATX
+#  include <sys/sysmacros.h>
+#endif
 #include <sys/types.h>
+#ifdef __linux__
+#  include <linux/fiemap.h>
+#  include <linux/fs.h>
+#  include <sys/ioctl.h>
+#  include <sys/vfs.h>
+#endif
 #ifdef HAVE_SYS_XATTR_H
 #  include <sys/xattr.h>
 #endif
@@ -40,6 +50,8 @@
 #include "wimlib/error.h"
 #include "wimlib/reparse.h"
 #include "wimlib/scan.h"
+#include "wimlib/stats.h"
+#include "wimlib/threads.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
 #include "wimlib/xattr.h"
@@ -103,7 +115,143 @@ my_fdopendir(int *dirfd_p)
 #  define AT_SYMLINK_NOFOLLOW	0x100
 #endif
 
+/*
+ * stat() a file being scanned.  @full_path is only used if fstatat() is
+ * unavailable.
+ *
+ * Where statx() is available, only the fields which the scan will use with
+ * @add_flags are requested, and with WIMLIB_ADD_FLAG_CACHED_METADATA the
+ * filesystem may answer from its cache (AT_STATX_DONT_SYNC) rather than
+ * revalidating the attributes with the server.  Fields which weren't requested
+ * are zeroed in @stbuf.
+ */
+static int
+do_scan_stat(const char *full_path, int dirfd, const char *relpath,
+	     struct stat *stbuf, int flags, int add_flags)
+{
+#ifdef HAVE_STATX
+	unsigned mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO |
+			STATX_SIZE | STATX_BLOCKS | STATX_ATIME | STATX_MTIME;
+	int statx_flags = flags;
+	struct statx stx;
+
+	if (add_flags & WIMLIB_ADD_FLAG_UNIX_DATA)
+		mask |= STATX_UID | STATX_GID | STATX_CTIME;
+	if (add_flags & WIMLIB_ADD_FLAG_CACHED_METADATA)
+		statx_flags |= AT_STATX_DONT_SYNC;
+
+	if (statx(dirfd, relpath, statx_flags, mask, &stx) == 0) {
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+		stbuf->st_ino = stx.stx_ino;
+		stbuf->st_mode = stx.stx_mode;
+		if (stx.stx_mask & STATX_NLINK)
+			stbuf->st_nlink = stx.stx_nlink;
+		stbuf->st_uid = stx.stx_uid;
+		stbuf->st_gid = stx.stx_gid;
+		stbuf->st_rdev = makedev(stx.stx_rdev_major,
+					 stx.stx_rdev_minor);
+		stbuf->st_size = stx.stx_size;
+		/* Don't make the file look sparse if its allocated size is
+		 * unknown.  */
+		if (stx.stx_mask & STATX_BLOCKS)
+			stbuf->st_blocks = stx.stx_blocks;
+		else
+			stbuf->st_blocks = DIV_ROUND_UP(stx.stx_size, 512);
+		stbuf->st_atim.tv_sec = stx.stx_atime.tv_sec;
+		stbuf->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+		stbuf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+		stbuf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+		stbuf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+		stbuf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+		return 0;
+	}
+
+	/* statx() may be blocked by a seccomp filter that predates it.  */
+	if (errno != ENOSYS && errno != EPERM)
+		return -1;
+#endif
+	return my_fstatat(full_path, dirfd, relpath, stbuf, flags);
+}
+
+static int
+scan_stat(const char *full_path, int dirfd, const char *relpath,
+	  struct stat *stbuf, int flags, int add_flags)
+{
+	u64 start = syscall_profile_begin();
+	int ret = do_scan_stat(full_path, dirfd, relpath, stbuf, flags,
+			       add_flags);
+
+	syscall_profile_end(WIMLIB_SYSCALL_STAT, start);
+	return ret;
+}
+
+static struct dirent *
+scan_readdir(DIR *dir)
+{
+	u64 start = syscall_profile_begin();
+	struct dirent *entry = readdir(dir);
+
+	syscall_profile_end(WIMLIB_SYSCALL_READDIR, start);
+	return entry;
+}
+
+/*
+ * With WIMLIB_ADD_FLAG_HASH_CACHE, the SHA-1 message digest of each regular file
+ * is cached in an xattr of the file, together with the size, last modification
+ * time, and inode number the file had when it was scanned.  A later scan uses
+ * the cached digest as long as these still match, so the file isn't read again
+ * just to find out that its data is already in the WIM.  The inode number
+ * keeps the cache from applying to copies of the file which kept its xattrs
+ * and timestamp.  The status change time can't be used, since setting the xattr
+ * changes it.  Instead, like git does with its index, the digest isn't cached
+ * if the file was modified so recently that it could be modified again without
+ * its last modification time changing.
+ */
+#define HASH_CACHE_XATTR_NAME	"user.wimlib.sha1"
+
+/* Minimum age of a file's last modification time for its digest to be cached,
+ * in 100-nanosecond intervals  */
+#define HASH_CACHE_MIN_AGE	(2 * 10000000)
+
+struct hash_cache_xattr {
+	le64 size;
+	le64 mtime;
+	le64 ino;
+	u8 hash[SHA1_HASH_SIZE];
+} __attribute__((packed));
+
+static u64
+stat_mtime(const struct stat *stbuf)
+{
+#ifdef HAVE_STAT_NANOSECOND_PRECISION
+	return timespec_to_wim_timestamp(&stbuf->st_mtim);
+#else
+	return time_t_to_wim_timestamp(stbuf->st_mtime);
+#endif
+}
+
 #ifdef HAVE_LINUX_XATTR_SUPPORT
+static ssize_t
+scan_llistxattr(const char *path, char *list, size_t size)
+{
+	u64 start = syscall_profile_begin();
+	ssize_t ret = llistxattr(path, list, size);
+
+	syscall_profile_end(WIMLIB_SYSCALL_XATTR, start);
+	return ret;
+}
+
+static ssize_t
+scan_lgetxattr(const char *path, const char *name, void *value, size_t size)
+{
+	u64 start = syscall_profile_begin();
+	ssize_t ret = lgetxattr(path, name, value, size);
+
+	syscall_profile_end(WIMLIB_SYSCALL_XATTR, start);
+	return ret;
+}
+
 /*
  * Retrieves the values of the xattrs named by the null-terminated @names of the
  * file at @path and serializes the xattr names and values into @entries.  If
@@ -131,6 +279,10 @@ gather_xattr_entries(const char *path, const char *names, size_t names_size,
 			return -1;
 		}
 
+		/* Don't capture wimlib's own cache of the file's hash.  */
+		if (!strcmp(name, HASH_CACHE_XATTR_NAME))
+			goto next_name;
+
 		if (name_len > WIM_XATTR_NAME_MAX) {
 			WARNING("\"%s\": name of extended attribute \"%s\" is too long to store",
 				path, name);
@@ -151,7 +303,8 @@ gather_xattr_entries(const char *path, const char *names, size_t names_size,
 		entry->flags = 0;
 		value = mempcpy(entry->name, name, name_len + 1);
 
-		value_len = lgetxattr(path, name, value, entries_end - value);
+		value_len = scan_lgetxattr(path, name, value,
+					   entries_end - value);
 		if (value_len < 0) {
 			if (errno != ERANGE) {
 				ERROR_WITH_ERRNO("\"%s\": unable to read extended attribute \"%s\"",
@@ -202,6 +355,11 @@ retry:
 		goto retry;
 	}
 
+	/* Were all the xattrs skipped?  */
+	ret = 0;
+	if (entries_size == 0)
+		goto out;
+
 	/* Copy @entries into an xattr item associated with @inode */
 	if ((u32)entries_size != entries_size) {
 		ERROR("\"%s\": too much xattr data!", path);
@@ -233,7 +391,7 @@ scan_linux_xattrs(const char *path, struct wim_inode *inode)
 
 retry:
 	/* Gather the names of the xattrs of the file at @path */
-	names_size = llistxattr(path, names, names_size);
+	names_size = scan_llistxattr(path, names, names_size);
 	if (names_size == 0) /* No xattrs? */
 		goto out;
 	if (names_size < 0) {
@@ -245,7 +403,7 @@ retry:
 			 * Not enough space in @names.  Ask for how much space
 			 * we need, then try again.
 			 */
-			names_size = llistxattr(path, NULL, 0);
+			names_size = scan_llistxattr(path, NULL, 0);
 			if (names_size == 0)
 				goto out;
 			if (names_size > 0) {
@@ -278,13 +436,101 @@ out:
 }
 #endif /* HAVE_LINUX_XATTR_SUPPORT */
 
+#ifdef HAVE_LINUX_XATTR_SUPPORT
+/* Get the cached SHA-1 message digest of the regular file @path, which has the
+ * status @stbuf.  Returns %false if there is none or it's out of date.  */
+static bool
+get_cached_hash(const char *path, const struct stat *stbuf,
+		u8 hash[SHA1_HASH_SIZE])
+{
+	struct hash_cache_xattr x;
+
+	if (scan_lgetxattr(path, HASH_CACHE_XATTR_NAME, &x, sizeof(x)) !=
+	    sizeof(x))
+		return false;
+	if (le64_to_cpu(x.size) != stbuf->st_size ||
+	    le64_to_cpu(x.mtime) != stat_mtime(stbuf) ||
+	    le64_to_cpu(x.ino) != stbuf->st_ino)
+		return false;
+	copy_hash(hash, x.hash);
+	return true;
+}
+#endif /* HAVE_LINUX_XATTR_SUPPORT */
+
+/* Cache the SHA-1 message digest which was just computed for @blob, a regular
+ * file scanned with WIMLIB_ADD_FLAG_HASH_CACHE.  The file is checked to still
+ * have the size and last modification time it had when it was scanned.
+ * Failure is ignored, since the cache is only an optimization.  */
+void
+save_blob_hash_in_file(struct blob_descriptor *blob)
+{
+#ifdef HAVE_LINUX_XATTR_SUPPORT
+	struct hash_cache_xattr x;
+	struct stat stbuf;
+	u64 mtime;
+
+	blob->save_hash_in_file = 0;
+	if (blob->blob_location != BLOB_IN_FILE_ON_DISK ||
+	    lstat(blob->file_on_disk, &stbuf) || !S_ISREG(stbuf.st_mode))
+		return;
+	mtime = stat_mtime(&stbuf);
+	if (stbuf.st_size != blob->size ||
+	    mtime != blob->file_inode->i_last_write_time ||
+	    now_as_wim_timestamp() - mtime < HASH_CACHE_MIN_AGE)
+		return;
+	x.size = cpu_to_le64(stbuf.st_size);
+	x.mtime = cpu_to_le64(mtime);
+	x.ino = cpu_to_le64(stbuf.st_ino);
+	copy_hash(x.hash, blob->hash);
+	lsetxattr(blob->file_on_disk, HASH_CACHE_XATTR_NAME, &x, sizeof(x), 0);
+#else
+	blob->save_hash_in_file = 0;
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Get the physical location on its device of the start of the data of the
+ * regular file @relpath, or 0 if it can't be determined, e.g. because the
+ * filesystem doesn't support FIEMAP or the data hasn't been allocated yet.
+ * Sorting the files by this before reading them, like the Windows capture code
+ * does with the starting LCN of each file, avoids seeking back and forth on
+ * hard disks.
+ */
+static u64
+get_physical_offset(const char *full_path, int dirfd, const char *relpath)
+{
+	u64 buf[DIV_ROUND_UP(sizeof(struct fiemap) +
+			     sizeof(struct fiemap_extent), sizeof(u64))];
+	struct fiemap *fm = (struct fiemap *)buf;
+	u64 offset = 0;
+	u64 start = syscall_profile_begin();
+	int fd;
+
+	fd = my_openat(full_path, dirfd, relpath, O_RDONLY | O_NOFOLLOW);
+	syscall_profile_end(WIMLIB_SYSCALL_OPEN, start);
+	if (fd < 0)
+		return 0;
+	memset(buf, 0, sizeof(buf));
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents &&
+	    !(fm->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+		offset = fm->fm_extents[0].fe_physical;
+	close(fd);
+	return offset;
+}
+#endif /* __linux__ */
+
 static int
-unix_scan_regular_file(const char *path, u64 blocks, u64 size,
-		       struct wim_inode *inode,
-		       struct list_head *unhashed_blobs)
+unix_scan_regular_file(const char *path, int dirfd, const char *relpath,
+		       const struct stat *stbuf, struct wim_inode *inode,
+		       struct scan_params *params)
 {
 	struct blob_descriptor *blob = NULL;
 	struct wim_inode_stream *strm;
+	const u64 blocks = stbuf->st_blocks;
+	const u64 size = stbuf->st_size;
 
 	/*
 	 * Set FILE_ATTRIBUTE_SPARSE_FILE if the file uses less disk space than
@@ -305,13 +551,39 @@ unix_scan_regular_file(const char *path, u64 blocks, u64 size,
 		blob->blob_location = BLOB_IN_FILE_ON_DISK;
 		blob->size = size;
 		blob->file_inode = inode;
+	#ifdef __linux__
+		if (params->add_flags & WIMLIB_ADD_FLAG_PHYSICAL_ORDER)
+			blob->file_physical_offset =
+				get_physical_offset(path, dirfd, relpath);
+	#endif
 	}
 
 	strm = inode_add_stream(inode, STREAM_TYPE_DATA, NO_STREAM_NAME, blob);
 	if (unlikely(!strm))
 		goto err_nomem;
 
-	prepare_unhashed_blob(blob, inode, strm->stream_id, unhashed_blobs);
+	prepare_unhashed_blob(blob, inode, strm->stream_id,
+			      params->unhashed_blobs);
+
+	if (blob && (params->add_flags & WIMLIB_ADD_FLAG_HASH_CACHE)) {
+	#ifdef HAVE_LINUX_XATTR_SUPPORT
+		u8 hash[SHA1_HASH_SIZE];
+
+		if (get_cached_hash(path, stbuf, hash)) {
+			/* The hash replaces the back pointer in @blob.  */
+			struct blob_descriptor **back_ptr =
+				retrieve_pointer_to_unhashed_blob(blob);
+
+			copy_hash(blob->hash, hash);
+			if (after_blob_hashed(blob, back_ptr, params->blob_table,
+					      inode) != blob)
+				free_blob_descriptor(blob);
+			return 0;
+		}
+	#endif
+		blob->save_hash_in_file = 1;
+	}
+	scan_hasher_submit(params->hasher, blob);
 	return 0;
 
 err_nomem:
@@ -319,23 +591,380 @@ err_nomem:
 	return WIMLIB_ERR_NOMEM;
 }
 
+struct stat_prefetch_job;
+
+#ifdef HAVE_FSTATAT
+/*
+ * A stat prefetcher has threads which call fstatat() on the entries of the
+ * directories being scanned ahead of the scan itself.  On network filesystems
+ * such as NFS, each fstatat() is a round trip to the server, so scanning large
+ * directory trees is bound by latency unless several are in flight at once.
+ * The scan still visits the files one by one in the same order, on the calling
+ * thread, so the resulting dentry tree is the same as without prefetching.
+ *
+ * The entries of each directory are read in batches.  Each batch is a job on a
+ * stack of jobs, one per directory being scanned, innermost last.  The threads
+ * take entries from the innermost job that has any left, and otherwise from the
+ * batches of the enclosing directories, which the scan will return to later.
+ */
+#define STAT_PREFETCH_THREADS		8
+
+/* Maximum number of directory entries read at once  */
+#define STAT_PREFETCH_BATCH_SIZE	256
+
+enum {
+	SCAN_ENTRY_UNCLAIMED,
+	SCAN_ENTRY_CLAIMED,
+	SCAN_ENTRY_STATTED,
+};
+
+struct scan_entry {
+	size_t name_offset;
+	size_t name_len;
+	int state;
+	int stat_errno;
+	struct stat stbuf;
+};
+
+struct stat_prefetch_job {
+	int dirfd;
+	const char *names;
+	struct scan_entry *entries;
+	size_t num_entries;
+	size_t next_entry;
+	size_t num_in_progress;
+	struct stat_prefetch_job *prev;
+};
+
+struct stat_prefetcher {
+	struct mutex lock;
+	struct condvar work_avail_cond;
+	struct condvar entry_done_cond;
+	struct stat_prefetch_job *cur_job;
+	int stat_flags;
+	int add_flags;
+	bool terminating;
+	unsigned num_threads;
+	struct thread threads[STAT_PREFETCH_THREADS];
+};
+
+static struct stat_prefetch_job *
+find_stat_prefetch_job(struct stat_prefetcher *p)
+{
+	struct stat_prefetch_job *job;
+
+	for (job = p->cur_job; job; job = job->prev)
+		if (job->next_entry < job->num_entries)
+			return job;
+	return NULL;
+}
+
+static void *
+stat_prefetch_thread_proc(void *arg)
+{
+	struct stat_prefetcher *p = arg;
+
+	mutex_lock(&p->lock);
+	for (;;) {
+		struct stat_prefetch_job *job;
+		struct scan_entry *entry;
+		int err;
+
+		while (!p->terminating && !(job = find_stat_prefetch_job(p)))
+			condvar_wait(&p->work_avail_cond, &p->lock);
+		if (p->terminating)
+			break;
+
+		entry = &job->entries[job->next_entry++];
+		entry->state = SCAN_ENTRY_CLAIMED;
+		job->num_in_progress++;
+		mutex_unlock(&p->lock);
+
+		err = 0;
+		if (scan_stat(NULL, job->dirfd,
+			      &job->names[entry->name_offset], &entry->stbuf,
+			      p->stat_flags, p->add_flags))
+			err = errno;
+
+		mutex_lock(&p->lock);
+		entry->stat_errno = err;
+		entry->state = SCAN_ENTRY_STATTED;
+		job->num_in_progress--;
+		condvar_broadcast(&p->entry_done_cond);
+	}
+	mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* Returns true if the file at @path is on a filesystem whose metadata accesses
+ * are likely to involve network round trips.  */
+static bool
+is_on_network_filesystem(const char *path)
+{
+#ifdef __linux__
+	struct statfs stfs;
+
+	if (statfs(path, &stfs))
+		return false;
+	switch ((u32)stfs.f_type) {
+	case 0x6969:		/* NFS */
+	case 0x517B:		/* SMB */
+	case 0xFF534D42:	/* CIFS */
+	case 0xFE534D42:	/* SMB2 */
+	case 0x0BD00BD0:	/* Lustre */
+	case 0x00C36400:	/* Ceph */
+	case 0x01021997:	/* 9P */
+	case 0x65735546:	/* FUSE */
+		return true;
+	}
+#endif
+	return false;
+}
+
+/* Upper limit on the number of inodes to presize the inode table for, since
+ * the capture root may be only a small part of the filesystem.  */
+#define MAX_INODE_TABLE_RESERVE		(1 << 18)
+
+/* Presize the inode table from the number of inodes in use on the filesystem
+ * containing @path, so that it doesn't have to be rehashed repeatedly while
+ * scanning a large tree.  This is only a hint; errors are ignored.  */
+static void
+reserve_inode_table(struct wim_inode_table *table, const char *path)
+{
+	struct statvfs stvfs;
+	u64 used;
+
+	if (statvfs(path, &stvfs) || stvfs.f_files <= stvfs.f_ffree)
+		return;
+	used = stvfs.f_files - stvfs.f_ffree;
+	inode_table_reserve(table, min(used, MAX_INODE_TABLE_RESERVE));
+}
+
+static struct stat_prefetcher *
+stat_prefetcher_create(int stat_flags, int add_flags)
+{
+	struct stat_prefetcher *p;
+
+	p = CALLOC(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	if (!mutex_init(&p->lock))
+		goto err_free;
+	if (!condvar_init(&p->work_avail_cond))
+		goto err_destroy_lock;
+	if (!condvar_init(&p->entry_done_cond))
+		goto err_destroy_work_avail_cond;
+	p->stat_flags = stat_flags;
+	p->add_flags = add_flags;
+	while (p->num_threads < STAT_PREFETCH_THREADS &&
+	       thread_create(&p->threads[p->num_threads],
+			     stat_prefetch_thread_proc, p))
+		p->num_threads++;
+	if (p->num_threads)
+		return p;
+
+	condvar_destroy(&p->entry_done_cond);
+err_destroy_work_avail_cond:
+	condvar_destroy(&p->work_avail_cond);
+err_destroy_lock:
+	mutex_destroy(&p->lock);
+err_free:
+	FREE(p);
+	return NULL;
+}
+
+static void
+stat_prefetcher_destroy(struct stat_prefetcher *p)
+{
+	if (!p)
+		return;
+	mutex_lock(&p->lock);
+	p->terminating = true;
+	condvar_broadcast(&p->work_avail_cond);
+	mutex_unlock(&p->lock);
+	for (unsigned i = 0; i < p->num_threads; i++)
+		thread_join(&p->threads[i]);
+	condvar_destroy(&p->entry_done_cond);
+	condvar_destroy(&p->work_avail_cond);
+	mutex_destroy(&p->lock);
+	FREE(p);
+}
+
+static void
+stat_prefetcher_push_job(struct stat_prefetcher *p,
+			 struct stat_prefetch_job *job)
+{
+	mutex_lock(&p->lock);
+	job->prev = p->cur_job;
+	p->cur_job = job;
+	condvar_broadcast(&p->work_avail_cond);
+	mutex_unlock(&p->lock);
+}
+
+/* Stop prefetching the entries of the innermost job and remove it, once no
+ * thread is using it anymore.  */
+static void
+stat_prefetcher_pop_job(struct stat_prefetcher *p,
+			struct stat_prefetch_job *job)
+{
+	mutex_lock(&p->lock);
+	job->next_entry = job->num_entries;
+	while (job->num_in_progress)
+		condvar_wait(&p->entry_done_cond, &p->lock);
+	p->cur_job = job->prev;
+	mutex_unlock(&p->lock);
+}
+
+/* Get the result of stat()ing entry @i of @job, either from a prefetch thread
+ * or by doing it now.  Returns 0 or an errno value.  */
+static int
+stat_prefetched_entry(struct stat_prefetcher *p, struct stat_prefetch_job *job,
+		      size_t i, struct stat *stbuf)
+{
+	struct scan_entry *entry = &job->entries[i];
+
+	mutex_lock(&p->lock);
+	if (entry->state == SCAN_ENTRY_UNCLAIMED) {
+		/* The entries are claimed in order, so none of the later ones
+		 * have been claimed either.  */
+		job->next_entry = i + 1;
+		mutex_unlock(&p->lock);
+		if (scan_stat(NULL, job->dirfd,
+			      &job->names[entry->name_offset], stbuf,
+			      p->stat_flags, p->add_flags))
+			return errno;
+		return 0;
+	}
+	while (entry->state != SCAN_ENTRY_STATTED)
+		condvar_wait(&p->entry_done_cond, &p->lock);
+	mutex_unlock(&p->lock);
+	*stbuf = entry->stbuf;
+	return entry->stat_errno;
+}
+#endif /* HAVE_FSTATAT */
+
 static int
 unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 				 int dirfd, const char *relpath,
+				 struct stat_prefetch_job *job, size_t job_idx,
 				 struct scan_params *params);
 
+#ifdef HAVE_FSTATAT
+/* Scan the entries of the directory @dir, open on @dirfd, with their metadata
+ * being prefetched by params->stat_prefetcher.  */
+static int
+unix_scan_directory_prefetched(struct wim_dentry *dir_dentry, int dirfd,
+			       DIR *dir, struct scan_params *params)
+{
+	struct stat_prefetcher *p = params->stat_prefetcher;
+	struct scan_entry *entries;
+	char *names = NULL;
+	size_t names_alloc = 0;
+	int read_errno = 0;
+	bool eof = false;
+	int ret = 0;
+
+	entries = MALLOC(STAT_PREFETCH_BATCH_SIZE * sizeof(entries[0]));
+	if (!entries)
+		return WIMLIB_ERR_NOMEM;
+
+	while (!eof && !ret) {
+		struct stat_prefetch_job job = {
+			.dirfd = dirfd,
+			.entries = entries,
+		};
+		size_t names_size = 0;
+
+		/* Read the next batch of entries.  */
+		while (job.num_entries < STAT_PREFETCH_BATCH_SIZE) {
+			struct dirent *entry;
+			size_t name_len;
+
+			errno = 0;
+			entry = scan_readdir(dir);
+			if (!entry) {
+				read_errno = errno;
+				eof = true;
+				break;
+			}
+
+			name_len = strlen(entry->d_name);
+
+			if (should_ignore_filename(entry->d_name, name_len))
+				continue;
+
+			if (names_size + name_len + 1 > names_alloc) {
+				size_t new_alloc = max(max(2 * names_alloc,
+							   (size_t)4096),
+						       names_size + name_len + 1);
+				char *new_names = REALLOC(names, new_alloc);
+
+				if (!new_names) {
+					ret = WIMLIB_ERR_NOMEM;
+					goto out;
+				}
+				names = new_names;
+				names_alloc = new_alloc;
+			}
+			memcpy(&names[names_size], entry->d_name, name_len + 1);
+			entries[job.num_entries++] = (struct scan_entry) {
+				.name_offset = names_size,
+				.name_len = name_len,
+				.state = SCAN_ENTRY_UNCLAIMED,
+			};
+			names_size += name_len + 1;
+		}
+
+		job.names = names;
+		stat_prefetcher_push_job(p, &job);
+		for (size_t i = 0; i < job.num_entries; i++) {
+			const char *name = &names[entries[i].name_offset];
+			struct wim_dentry *child;
+			size_t orig_path_len;
+
+			ret = WIMLIB_ERR_NOMEM;
+			if (!pathbuf_append_name(params, name,
+						 entries[i].name_len,
+						 &orig_path_len))
+				break;
+			ret = unix_build_dentry_tree_recursive(&child, dirfd,
+							       name, &job, i,
+							       params);
+			pathbuf_truncate(params, orig_path_len);
+			if (ret)
+				break;
+			attach_scanned_tree(dir_dentry, child, params);
+		}
+		stat_prefetcher_pop_job(p, &job);
+	}
+
+	if (!ret && read_errno) {
+		errno = read_errno;
+		ret = WIMLIB_ERR_READ;
+		ERROR_WITH_ERRNO("\"%s\": Error reading directory",
+				 params->cur_path);
+	}
+out:
+	FREE(names);
+	FREE(entries);
+	return ret;
+}
+#endif /* HAVE_FSTATAT */
+
 static int
 unix_scan_directory(struct wim_dentry *dir_dentry,
 		    int parent_dirfd, const char *dir_relpath,
 		    struct scan_params *params)
 {
 
+	u64 start = syscall_profile_begin();
 	int dirfd;
 	DIR *dir;
 	int ret;
 
 	dirfd = my_openat(params->cur_path, parent_dirfd, dir_relpath, O_RDONLY);
 	if (dirfd < 0) {
+		syscall_profile_end(WIMLIB_SYSCALL_OPENDIR, start);
 		ERROR_WITH_ERRNO("\"%s\": Can't open directory",
 				 params->cur_path);
 		return WIMLIB_ERR_OPENDIR;
@@ -343,6 +972,7 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 
 	dir_dentry->d_inode->i_attributes = FILE_ATTRIBUTE_DIRECTORY;
 	dir = my_fdopendir(&dirfd);
+	syscall_profile_end(WIMLIB_SYSCALL_OPENDIR, start);
 	if (!dir) {
 		ERROR_WITH_ERRNO("\"%s\": Can't open directory",
 				 params->cur_path);
@@ -350,6 +980,15 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 		return WIMLIB_ERR_OPENDIR;
 	}
 
+#ifdef HAVE_FSTATAT
+	if (params->stat_prefetcher) {
+		ret = unix_scan_directory_prefetched(dir_dentry, dirfd, dir,
+						     params);
+		closedir(dir);
+		return ret;
+	}
+#endif
+
 	ret = 0;
 	for (;;) {
 		struct dirent *entry;
@@ -358,7 +997,7 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 		size_t orig_path_len;
 
 		errno = 0;
-		entry = readdir(dir);
+		entry = scan_readdir(dir);
 		if (!entry) {
 			if (errno) {
 				ret = WIMLIB_ERR_READ;
@@ -378,16 +1017,164 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 					 &orig_path_len))
 			break;
 		ret = unix_build_dentry_tree_recursive(&child, dirfd,
-						       entry->d_name, params);
+						       entry->d_name, NULL, 0,
+						       params);
 		pathbuf_truncate(params, orig_path_len);
 		if (ret)
 			break;
-		attach_scanned_tree(dir_dentry, child, params->blob_table);
+		attach_scanned_tree(dir_dentry, child, params);
 	}
 	closedir(dir);
 	return ret;
 }
 
+/*
+ * Cache of the results of stat() on the ancestors of absolute symbolic link
+ * targets, for WIMLIB_ADD_FLAG_RPFIX.  The links in a tree usually point to
+ * places with most of their ancestors in common, such as the directories
+ * leading to the root of the tree, so with the cache each of those is stat()ed
+ * once per scan rather than once per link.
+ */
+struct rpfix_cache_entry {
+	struct hlist_node hash_node;
+	u64 ino;
+	u64 dev;
+	bool exists;
+	size_t len;
+	char path[];
+};
+
+struct rpfix_cache {
+	struct hlist_head *buckets;
+	size_t num_buckets;
+	size_t num_entries;
+};
+
+#define RPFIX_CACHE_INITIAL_BUCKETS	256
+
+static u64
+hash_path_prefix(const char *path, size_t len)
+{
+	u64 hash = 0xcbf29ce484222325;	/* FNV-1a */
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ (u8)path[i]) * 0x100000001b3;
+	return hash;
+}
+
+static void
+rpfix_cache_destroy(struct rpfix_cache *cache)
+{
+	struct rpfix_cache_entry *entry;
+	struct hlist_node *tmp;
+
+	if (!cache)
+		return;
+	for (size_t i = 0; i < cache->num_buckets; i++) {
+		hlist_for_each_entry_safe(entry, tmp, &cache->buckets[i],
+					  hash_node)
+			FREE(entry);
+	}
+	FREE(cache->buckets);
+	FREE(cache);
+}
+
+/* Double the number of hash buckets of @cache, if possible.  */
+static void
+rpfix_cache_grow(struct rpfix_cache *cache)
+{
+	size_t new_num_buckets = cache->num_buckets * 2;
+	struct hlist_head *new_buckets;
+	struct rpfix_cache_entry *entry;
+	struct hlist_node *tmp;
+
+	new_buckets = CALLOC(new_num_buckets, sizeof(new_buckets[0]));
+	if (!new_buckets)
+		return;
+	for (size_t i = 0; i < cache->num_buckets; i++) {
+		hlist_for_each_entry_safe(entry, tmp, &cache->buckets[i],
+					  hash_node) {
+			u64 hash = hash_path_prefix(entry->path, entry->len);
+
+			hlist_add_head(&entry->hash_node,
+				       &new_buckets[hash & (new_num_buckets - 1)]);
+		}
+	}
+	FREE(cache->buckets);
+	cache->buckets = new_buckets;
+	cache->num_buckets = new_num_buckets;
+}
+
+/*
+ * Get the inode and device numbers of the first @len bytes of @path, which must
+ * be followed by a null terminator or a slash.  Returns true if the file
+ * exists, or false if stat() failed.  The result is looked up in, or added to,
+ * the cache of @params, which is allocated when first needed.  Without a
+ * cache, due to lack of memory, stat() is just called every time.
+ */
+static bool
+rpfix_stat_prefix(struct scan_params *params, char *path, size_t len,
+		  u64 *ino_ret, u64 *dev_ret)
+{
+	struct rpfix_cache *cache = params->rpfix_cache;
+	struct rpfix_cache_entry *entry = NULL;
+	struct stat stbuf;
+	u64 hash = hash_path_prefix(path, len);
+	char save;
+	bool exists;
+
+	if (!cache) {
+		cache = CALLOC(1, sizeof(*cache));
+		if (cache) {
+			cache->buckets = CALLOC(RPFIX_CACHE_INITIAL_BUCKETS,
+						sizeof(cache->buckets[0]));
+			cache->num_buckets = RPFIX_CACHE_INITIAL_BUCKETS;
+			if (!cache->buckets) {
+				FREE(cache);
+				cache = NULL;
+			}
+		}
+		params->rpfix_cache = cache;
+	}
+
+	if (cache) {
+		hlist_for_each_entry(entry,
+				     &cache->buckets[hash & (cache->num_buckets - 1)],
+				     hash_node)
+		{
+			if (entry->len == len && !memcmp(entry->path, path, len)) {
+				*ino_ret = entry->ino;
+				*dev_ret = entry->dev;
+				return entry->exists;
+			}
+		}
+	}
+
+	save = path[len];
+	path[len] = '\0';
+	exists = (stat(path, &stbuf) == 0);
+	path[len] = save;
+
+	*ino_ret = exists ? stbuf.st_ino : 0;
+	*dev_ret = exists ? stbuf.st_dev : 0;
+
+	if (cache) {
+		entry = MALLOC(sizeof(*entry) + len);
+		if (entry) {
+			entry->ino = *ino_ret;
+			entry->dev = *dev_ret;
+			entry->exists = exists;
+			entry->len = len;
+			memcpy(entry->path, path, len);
+			if (++cache->num_entries > 2 * cache->num_buckets)
+				rpfix_cache_grow(cache);
+			hlist_add_head(&entry->hash_node,
+				       &cache->buckets[hash & (cache->num_buckets - 1)]);
+		}
+	}
+	return exists;
+}
+
 /*
  * Given an absolute symbolic link target (UNIX-style, beginning with '/'),
  * determine whether it points into the directory identified by @ino and @dev.
@@ -415,14 +1202,14 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
  * is intended to be de-relativized when the link is extracted.
  */
 static char *
-unix_relativize_link_target(char *target, u64 ino, u64 dev)
+unix_relativize_link_target(char *target, u64 ino, u64 dev,
+			    struct scan_params *params)
 {
 	char *p = target;
 
 	do {
-		char save;
-		struct stat stbuf;
-		int ret;
+		u64 prefix_ino;
+		u64 prefix_dev;
 
 		/* Skip slashes (guaranteed to be at least one here)  */
 		do {
@@ -439,18 +1226,14 @@ unix_relativize_link_target(char *target, u64 ino, u64 dev)
 		} while (*p && *p != '/');
 
 		/* Get the inode and device numbers for this prefix.  */
-		save = *p;
-		*p = '\0';
-		ret = stat(target, &stbuf);
-		*p = save;
-
-		if (ret) {
+		if (!rpfix_stat_prefix(params, target, p - target,
+				       &prefix_ino, &prefix_dev)) {
 			/* stat() failed.  Assume the link points outside the
 			 * directory tree being captured.  */
 			break;
 		}
 
-		if (stbuf.st_ino == ino && stbuf.st_dev == dev) {
+		if (prefix_ino == ino && prefix_dev == dev) {
 			/* Link points inside directory tree being captured.
 			 * Return abbreviated path.  */
 			return p;
@@ -493,7 +1276,8 @@ unix_scan_symlink(int dirfd, const char *relpath,
 
 		target = unix_relativize_link_target(target,
 						     params->capture_root_ino,
-						     params->capture_root_dev);
+						     params->capture_root_dev,
+						     params);
 		if (target != orig_target) {
 			/* Link target was fixed.  */
 			inode->i_rp_flags &= ~WIM_RP_FLAG_NOT_FIXED;
@@ -529,6 +1313,7 @@ unix_scan_symlink(int dirfd, const char *relpath,
 static int
 unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 				 int dirfd, const char *relpath,
+				 struct stat_prefetch_job *job, size_t job_idx,
 				 struct scan_params *params)
 {
 	struct wim_dentry *tree = NULL;
@@ -536,6 +1321,7 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 	int ret;
 	struct stat stbuf;
 	int stat_flags;
+	bool single_link;
 
 	ret = try_exclude(params);
 	if (unlikely(ret < 0)) /* Excluded? */
@@ -549,7 +1335,20 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 	else
 		stat_flags = AT_SYMLINK_NOFOLLOW;
 
-	ret = my_fstatat(params->cur_path, dirfd, relpath, &stbuf, stat_flags);
+#ifdef HAVE_FSTATAT
+	if (job) {
+		int err = stat_prefetched_entry(params->stat_prefetcher, job,
+						job_idx, &stbuf);
+		if (err) {
+			errno = err;
+			ret = -1;
+		}
+	} else
+#endif
+	{
+		ret = scan_stat(params->cur_path, dirfd, relpath, &stbuf,
+				stat_flags, params->add_flags);
+	}
 
 	if (ret) {
 		ERROR_WITH_ERRNO("\"%s\": Can't read metadata",
@@ -578,8 +1377,18 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 		}
 	}
 
+	/* When spilling, note the files that the scan can't find again under
+	 * another name.  Such a file needn't be indexed for hard link
+	 * detection, which keeps the inode table from growing with the number
+	 * of files.  */
+	single_link = params->spill &&
+		      !(params->add_flags & WIMLIB_ADD_FLAG_DEREFERENCE) &&
+		      (S_ISDIR(stbuf.st_mode) || stbuf.st_nlink == 1);
+
 	ret = inode_table_new_dentry(params->inode_table, relpath,
-				     stbuf.st_ino, stbuf.st_dev, false, &tree);
+				     stbuf.st_ino, stbuf.st_dev,
+				     single_link && !S_ISDIR(stbuf.st_mode),
+				     &tree);
 	if (unlikely(ret)) {
 		if (ret == WIMLIB_ERR_INVALID_UTF8_STRING) {
 			ERROR("\"%s\": filename is not valid UTF-8.  "
@@ -594,6 +1403,8 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 	if (inode->i_nlink > 1)
 		goto out_progress;
 
+	inode->i_single_link = single_link;
+
 #ifdef HAVE_STAT_NANOSECOND_PRECISION
 	inode->i_creation_time = timespec_to_wim_timestamp(&stbuf.st_mtim);
 	inode->i_last_write_time = timespec_to_wim_timestamp(&stbuf.st_mtim);
@@ -605,6 +1416,7 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 #endif
 	if (params->add_flags & WIMLIB_ADD_FLAG_UNIX_DATA) {
 		struct wimlib_unix_data unix_data;
+		struct wimlib_unix_change_info change_info;
 
 		unix_data.uid = stbuf.st_uid;
 		unix_data.gid = stbuf.st_gid;
@@ -614,6 +1426,20 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 			ret = WIMLIB_ERR_NOMEM;
 			goto out;
 		}
+
+		/* Also record what wimlib_reference_template_image() needs to
+		 * tell whether the file was changed without its mtime being
+		 * updated, e.g. by 'touch -r' or by being replaced.  */
+		change_info.ino = stbuf.st_ino;
+#ifdef HAVE_STAT_NANOSECOND_PRECISION
+		change_info.ctime = timespec_to_wim_timestamp(&stbuf.st_ctim);
+#else
+		change_info.ctime = time_t_to_wim_timestamp(stbuf.st_ctime);
+#endif
+		if (!inode_set_unix_change_info(inode, &change_info)) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out;
+		}
 #ifdef HAVE_LINUX_XATTR_SUPPORT
 		ret = scan_linux_xattrs(params->cur_path, inode);
 		if (ret)
@@ -628,9 +1454,8 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 	}
 
 	if (S_ISREG(stbuf.st_mode)) {
-		ret = unix_scan_regular_file(params->cur_path, stbuf.st_blocks,
-					     stbuf.st_size, inode,
-					     params->unhashed_blobs);
+		ret = unix_scan_regular_file(params->cur_path, dirfd, relpath,
+					     &stbuf, inode, params);
 	} else if (S_ISDIR(stbuf.st_mode)) {
 		ret = unix_scan_directory(tree, dirfd, relpath, params);
 	} else if (S_ISLNK(stbuf.st_mode)) {
@@ -647,7 +1472,7 @@ out_progress:
 		ret = do_scan_progress(params, WIMLIB_SCAN_DENTRY_EXCLUDED, NULL);
 out:
 	if (unlikely(ret)) {
-		free_dentry_tree(tree, params->blob_table);
+		free_scanned_tree(params, tree);
 		tree = NULL;
 		ret = report_scan_error(params, ret);
 	}
@@ -684,8 +1509,28 @@ unix_build_dentry_tree(struct wim_dentry **root_ret,
 	if (ret)
 		return ret;
 
-	return unix_build_dentry_tree_recursive(root_ret, AT_FDCWD,
-						root_disk_path, params);
+	params->stat_prefetcher = NULL;
+	params->rpfix_cache = NULL;
+#ifdef HAVE_FSTATAT
+	if (is_on_network_filesystem(root_disk_path)) {
+		params->stat_prefetcher = stat_prefetcher_create(
+			(params->add_flags & WIMLIB_ADD_FLAG_DEREFERENCE) ?
+				0 : AT_SYMLINK_NOFOLLOW,
+			params->add_flags);
+	}
+#endif
+
+	reserve_inode_table(params->inode_table, root_disk_path);
+
+	ret = unix_build_dentry_tree_recursive(root_ret, AT_FDCWD,
+					       root_disk_path, NULL, 0, params);
+#ifdef HAVE_FSTATAT
+	stat_prefetcher_destroy(params->stat_prefetcher);
+	params->stat_prefetcher = NULL;
+#endif
+	rpfix_cache_destroy(params->rpfix_cache);
+	params->rpfix_cache = NULL;
+	return ret;
 }
 
 #endif /* !_WIN32 */
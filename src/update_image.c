@@ -64,8 +64,13 @@
 #include "wimlib/paths.h"
 #include "wimlib/progress.h"
 #include "wimlib/scan.h"
+#include "wimlib/spill.h"
+#include "wimlib/stats.h"
 #include "wimlib/test_support.h"
 #include "wimlib/xml_windows.h"
+#ifdef _WIN32
+#  include "wimlib/win32_vss.h"
+#endif
 
 /* Saved specification of a "primitive" update operation that was performed.  */
 struct update_primitive {
@@ -106,6 +111,10 @@ struct update_primitive {
 
 			/* The old name.  */
 			utf16lechar *old_name;
+
+			/* Whether the old names were in the dentry arena,
+			 * i.e. the old value of d_names_in_arena.  */
+			bool old_names_in_arena;
 		} name;
 	};
 };
@@ -286,11 +295,14 @@ rollback_unlink(struct wim_dentry *subject, struct wim_dentry *parent,
 
 /* Rollback a name change operation.  */
 static void
-rollback_name_change(utf16lechar *old_name,
+rollback_name_change(const struct update_primitive *prim,
 		     utf16lechar **name_ptr, u16 *name_nbytes_ptr)
 {
+	utf16lechar *old_name = prim->name.old_name;
+
 	/* Free the new name, then replace it with the old name.  */
 	FREE(*name_ptr);
+	prim->name.subject->d_names_in_arena = prim->name.old_names_in_arena;
 	if (old_name) {
 		*name_ptr = old_name;
 		*name_nbytes_ptr = utf16le_len_bytes(old_name);
@@ -315,13 +327,11 @@ rollback_update_primitive(const struct update_primitive *prim,
 		rollback_unlink(prim->link.subject, prim->link.parent, root_p);
 		break;
 	case CHANGE_FILE_NAME:
-		rollback_name_change(prim->name.old_name,
-				     &prim->name.subject->d_name,
+		rollback_name_change(prim, &prim->name.subject->d_name,
 				     &prim->name.subject->d_name_nbytes);
 		break;
 	case CHANGE_SHORT_NAME:
-		rollback_name_change(prim->name.old_name,
-				     &prim->name.subject->d_short_name,
+		rollback_name_change(prim, &prim->name.subject->d_short_name,
 				     &prim->name.subject->d_short_name_nbytes);
 		break;
 	}
@@ -422,6 +432,7 @@ journaled_change_name(struct update_command_journal *j,
 	prim.type = CHANGE_FILE_NAME;
 	prim.name.subject = dentry;
 	prim.name.old_name = dentry->d_name;
+	prim.name.old_names_in_arena = dentry->d_names_in_arena;
 	ret = record_update_primitive(j, prim);
 	if (ret) {
 		FREE(new_name);
@@ -430,6 +441,7 @@ journaled_change_name(struct update_command_journal *j,
 
 	dentry->d_name = new_name;
 	dentry->d_name_nbytes = new_name_nbytes;
+	dentry->d_names_in_arena = 0;
 
 	/* Clear the short name.  */
 	prim.type = CHANGE_SHORT_NAME;
@@ -457,10 +469,14 @@ commit_update(struct update_command_journal *j)
 	{
 		for (size_t k = 0; k < j->cmd_prims[i].num_entries; k++)
 		{
-			if (j->cmd_prims[i].entries[k].type == CHANGE_FILE_NAME ||
-			    j->cmd_prims[i].entries[k].type == CHANGE_SHORT_NAME)
+			const struct update_primitive *prim =
+				&j->cmd_prims[i].entries[k];
+
+			if ((prim->type == CHANGE_FILE_NAME ||
+			     prim->type == CHANGE_SHORT_NAME) &&
+			    !prim->name.old_names_in_arena)
 			{
-				FREE(j->cmd_prims[i].entries[k].name.old_name);
+				FREE(prim->name.old_name);
 			}
 		}
 	}
@@ -669,7 +685,7 @@ do_attach_branch(struct wim_dentry *branch, const utf16lechar *target,
  * WIM_PATH_SEPARATOR.
  *
  * On success, @branch is committed to the journal @j.
- * Otherwise @branch is freed.
+ * Otherwise the caller must free @branch.
  *
  * The relevant @add_flags are WIMLIB_ADD_FLAG_NO_REPLACE and
  * WIMLIB_ADD_FLAG_VERBOSE.
@@ -682,32 +698,34 @@ attach_branch(struct wim_dentry *branch, const tchar *target_tstr,
 	int ret;
 	const utf16lechar *target;
 
-	ret = 0;
 	if (unlikely(!branch))
-		goto out;
+		return 0;
 
 	ret = tstr_get_utf16le(target_tstr, &target);
 	if (ret)
-		goto out_free_branch;
+		return ret;
 
 	STATIC_ASSERT(WIM_PATH_SEPARATOR == OS_PREFERRED_PATH_SEPARATOR);
 	ret = dentry_set_name(branch, path_basename(target_tstr));
-	if (ret)
-		goto out_free_target;
-
-	ret = do_attach_branch(branch, target, j, add_flags, progfunc, progctx);
-	if (ret)
-		goto out_free_target;
-	/* branch was successfully committed to the journal  */
-	branch = NULL;
-out_free_target:
+	if (!ret)
+		ret = do_attach_branch(branch, target, j, add_flags, progfunc,
+				       progctx);
 	tstr_put_utf16le(target);
-out_free_branch:
-	free_dentry_tree(branch, j->blob_table);
-out:
 	return ret;
 }
 
+/* Free a branch which was scanned but not attached to the image @imd.  If its
+ * directories were spilled, they have to be loaded to release their blobs.  */
+static void
+free_branch(struct wim_image_metadata *imd, struct wim_dentry *branch,
+	    struct blob_table *blob_table)
+{
+	if (load_dentry_tree(imd, branch))
+		WARNING("Failed to reload spilled directories; some blob "
+			"reference counts may be too high");
+	free_dentry_tree(branch, blob_table);
+}
+
 static const char wincfg[] =
 "[ExclusionList]\n"
 "/$ntfs.log\n"
@@ -785,7 +803,9 @@ execute_add_command(struct update_command_journal *j,
 		    const struct wimlib_update_command *add_cmd,
 		    struct wim_inode_table *inode_table,
 		    struct wim_sd_set *sd_set,
-		    struct list_head *unhashed_blobs)
+		    struct list_head *unhashed_blobs,
+		    struct scan_hasher *hasher,
+		    struct vss_snapshot *snapshot_set)
 {
 	int ret;
 	int add_flags;
@@ -796,6 +816,7 @@ execute_add_command(struct update_command_journal *j,
 	struct capture_config config;
 	scan_tree_t scan_tree = platform_default_scan_tree;
 	struct wim_dentry *branch;
+	struct stats_phase phase;
 
 	add_flags = add_cmd->add.add_flags;
 	fs_source_path = add_cmd->add.fs_source_path;
@@ -809,6 +830,11 @@ execute_add_command(struct update_command_journal *j,
 		scan_tree = ntfs_3g_build_dentry_tree;
 #endif
 
+#ifndef _WIN32
+	if (add_flags & WIMLIB_ADD_FLAG_ARCHIVE)
+		scan_tree = tar_build_dentry_tree;
+#endif
+
 #ifdef ENABLE_TEST_SUPPORT
 	if (add_flags & WIMLIB_ADD_FLAG_GENERATE_TEST_DATA)
 		scan_tree = generate_dentry_tree;
@@ -825,6 +851,7 @@ execute_add_command(struct update_command_journal *j,
 	params.sd_set = sd_set;
 	params.config = &config;
 	params.add_flags = add_flags;
+	params.snapshot_set = snapshot_set;
 
 	params.progfunc = wim->progfunc;
 	params.progctx = wim->progctx;
@@ -837,30 +864,65 @@ execute_add_command(struct update_command_journal *j,
 
 	if (WIMLIB_IS_WIM_ROOT_PATH(wim_target_path))
 		params.add_flags |= WIMLIB_ADD_FLAG_ROOT;
+
+#ifndef _WIN32
+	/* Spilling is only supported when the scan builds the whole image
+	 * from a UNIX directory tree.  Otherwise the flag is ignored.  */
+	if ((add_flags & WIMLIB_ADD_FLAG_SPILL_METADATA) &&
+	    scan_tree == platform_default_scan_tree &&
+	    WIMLIB_IS_WIM_ROOT_PATH(wim_target_path) &&
+	    !wim_get_current_root_dentry(wim) && j->num_cmds == 1 &&
+	    !(add_flags & (WIMLIB_ADD_FLAG_WIMBOOT |
+			   WIMLIB_ADD_FLAG_DEREFERENCE)))
+	{
+		ret = new_metadata_spill(wim->blob_table, &params.spill);
+		if (ret)
+			goto out_destroy_config;
+	}
+#endif
+
+	/* The hasher is shared by all the commands, so the blobs found by this
+	 * scan are still being hashed while the next command runs.  When
+	 * spilling, blobs are hashed as their directories are spilled
+	 * instead.  */
+	if ((add_flags & WIMLIB_ADD_FLAG_HASH_DURING_SCAN) && !params.spill)
+		params.hasher = hasher;
+	stats_begin_phase(&phase);
 	ret = (*scan_tree)(&branch, fs_source_path, &params);
+	stats_end_phase(&phase, scan);
+	params.hasher = NULL;
+	if (!ret && params.spill) {
+		/* The spill file becomes the image's loader.  */
+		ret = start_spill_load(wim_get_current_image_metadata(wim),
+				       params.spill);
+		if (ret)
+			metadata_spill_free_tree(params.spill, branch);
+		else
+			params.spill = NULL;
+	}
+	free_metadata_spill(params.spill);
 	if (ret)
 		goto out_destroy_config;
 
 	ret = call_progress(params.progfunc, WIMLIB_PROGRESS_MSG_SCAN_END,
 			    &params.progress, params.progctx);
-	if (ret) {
-		free_dentry_tree(branch, wim->blob_table);
-		goto out_destroy_config;
-	}
+	if (!ret && syscall_profiling_enabled)
+		ret = report_stats(params.progfunc, params.progctx);
+	if (ret)
+		goto out_free_branch;
 
 	if (WIMLIB_IS_WIM_ROOT_PATH(wim_target_path) &&
 	    branch && !dentry_is_directory(branch))
 	{
 		ERROR("\"%"TS"\" is not a directory!", fs_source_path);
 		ret = WIMLIB_ERR_NOTDIR;
-		free_dentry_tree(branch, wim->blob_table);
-		goto out_destroy_config;
+		goto out_free_branch;
 	}
 
 	ret = attach_branch(branch, wim_target_path, j,
 			    add_flags, params.progfunc, params.progctx);
 	if (ret)
-		goto out_destroy_config;
+		goto out_free_branch;
 
 	if (config_file && (add_flags & WIMLIB_ADD_FLAG_WIMBOOT) &&
 	    WIMLIB_IS_WIM_ROOT_PATH(wim_target_path))
@@ -878,7 +940,7 @@ execute_add_command(struct update_command_journal *j,
 
 		ret = attach_branch(branch, wimboot_cfgfile, j, 0, NULL, NULL);
 		if (ret)
-			goto out_destroy_config;
+			goto out_free_branch;
 	}
 
 	if (WIMLIB_IS_WIM_ROOT_PATH(wim_target_path)) {
@@ -888,6 +950,11 @@ execute_add_command(struct update_command_journal *j,
 	}
 
 	ret = 0;
+	goto out_destroy_config;
+
+out_free_branch:
+	free_branch(wim_get_current_image_metadata(wim), branch,
+		    wim->blob_table);
 out_destroy_config:
 	destroy_capture_config(&config);
 out:
@@ -1099,6 +1166,8 @@ execute_update_commands(WIMStruct *wim,
 	struct wim_inode_table *inode_table;
 	struct wim_sd_set *sd_set;
 	struct list_head unhashed_blobs;
+	struct scan_hasher *hasher = NULL;
+	struct vss_snapshot *snapshot_set = NULL;
 	struct update_command_journal *j;
 	union wimlib_progress_info info;
 	int ret;
@@ -1119,6 +1188,29 @@ execute_update_commands(WIMStruct *wim,
 			goto out_destroy_inode_table;
 
 		INIT_LIST_HEAD(&unhashed_blobs);
+
+	#ifdef _WIN32
+		/* Snapshot all the volumes to be captured from at once.  */
+		ret = vss_create_snapshot_set(cmds, num_cmds, &snapshot_set);
+		if (ret)
+			goto out_destroy_sd_set;
+	#endif
+
+		/* Hash the blobs of all "add" commands that request hashing
+		 * during the scan with one hasher, so that there is no need to
+		 * wait for the hashing after each command.  */
+		for (size_t i = 0; i < num_cmds; i++) {
+			if (cmds[i].op == WIMLIB_UPDATE_OP_ADD &&
+			    (cmds[i].add.add_flags &
+			     WIMLIB_ADD_FLAG_HASH_DURING_SCAN))
+			{
+				ret = start_scan_hasher(wim->thread_pool,
+							&hasher);
+				if (ret)
+					goto out_destroy_sd_set;
+				break;
+			}
+		}
 	} else {
 		inode_table = NULL;
 		sd_set = NULL;
@@ -1130,6 +1222,7 @@ execute_update_commands(WIMStruct *wim,
 				       &wim_get_current_image_metadata(wim)->root_dentry,
 				       wim->blob_table);
 	if (!j) {
+		stop_scan_hasher(hasher, &unhashed_blobs, wim->blob_table);
 		ret = WIMLIB_ERR_NOMEM;
 		goto out_destroy_sd_set;
 	}
@@ -1150,7 +1243,8 @@ execute_update_commands(WIMStruct *wim,
 		switch (cmds[i].op) {
 		case WIMLIB_UPDATE_OP_ADD:
 			ret = execute_add_command(j, wim, &cmds[i], inode_table,
-						  sd_set, &unhashed_blobs);
+						  sd_set, &unhashed_blobs,
+						  hasher, snapshot_set);
 			break;
 		case WIMLIB_UPDATE_OP_DELETE:
 			ret = execute_delete_command(j, wim, &cmds[i]);
@@ -1172,6 +1266,7 @@ execute_update_commands(WIMStruct *wim,
 		next_command(j);
 	}
 
+	stop_scan_hasher(hasher, &unhashed_blobs, wim->blob_table);
 	commit_update(j);
 	if (inode_table) {
 		struct wim_image_metadata *imd;
@@ -1184,10 +1279,19 @@ execute_update_commands(WIMStruct *wim,
 	goto out_destroy_sd_set;
 
 rollback:
+	stop_scan_hasher(hasher, &unhashed_blobs, wim->blob_table);
 	if (sd_set)
 		rollback_new_security_descriptors(sd_set);
+	/* Rolling back frees the new dentries, so any spilled directories must
+	 * be loaded first to release their blobs.  */
+	if (finish_loading_image(wim_get_current_image_metadata(wim)))
+		WARNING("Failed to reload spilled directories; some blob "
+			"reference counts may be too high");
 	rollback_update(j);
 out_destroy_sd_set:
+#ifdef _WIN32
+	vss_put_snapshot(snapshot_set);
+#endif
 	if (sd_set)
 		destroy_sd_set(sd_set);
 out_destroy_inode_table:
@@ -1224,7 +1328,13 @@ check_add_command(struct wimlib_update_command *cmd,
 		#ifdef ENABLE_TEST_SUPPORT
 			  WIMLIB_ADD_FLAG_GENERATE_TEST_DATA |
 		#endif
-			  WIMLIB_ADD_FLAG_FILE_PATHS_UNNEEDED))
+			  WIMLIB_ADD_FLAG_FILE_PATHS_UNNEEDED |
+			  WIMLIB_ADD_FLAG_HASH_DURING_SCAN |
+			  WIMLIB_ADD_FLAG_CACHED_METADATA |
+			  WIMLIB_ADD_FLAG_PHYSICAL_ORDER |
+			  WIMLIB_ADD_FLAG_ARCHIVE |
+			  WIMLIB_ADD_FLAG_HASH_CACHE |
+			  WIMLIB_ADD_FLAG_SPILL_METADATA))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	bool is_entire_image = WIMLIB_IS_WIM_ROOT_PATH(cmd->add.wim_target_path);
@@ -1247,6 +1357,10 @@ check_add_command(struct wimlib_update_command *cmd,
 		ERROR("Dereferencing symbolic links is not supported on Windows");
 		return WIMLIB_ERR_UNSUPPORTED;
 	}
+	if (add_flags & WIMLIB_ADD_FLAG_ARCHIVE) {
+		ERROR("Capturing from an archive is not supported on Windows");
+		return WIMLIB_ERR_UNSUPPORTED;
+	}
 #else
 	/* Check for flags only supported on Windows.  */
 
@@ -1258,6 +1372,14 @@ check_add_command(struct wimlib_update_command *cmd,
 	}
 #endif
 
+	if ((add_flags & (WIMLIB_ADD_FLAG_ARCHIVE | WIMLIB_ADD_FLAG_NTFS)) ==
+	    (WIMLIB_ADD_FLAG_ARCHIVE | WIMLIB_ADD_FLAG_NTFS))
+	{
+		ERROR("Cannot capture from an archive and an NTFS volume at "
+		      "the same time!");
+		return WIMLIB_ERR_INVALID_PARAM;
+	}
+
 	/* VERBOSE implies EXCLUDE_VERBOSE */
 	if (add_flags & WIMLIB_ADD_FLAG_VERBOSE)
 		add_flags |= WIMLIB_ADD_FLAG_EXCLUDE_VERBOSE;
@@ -36,6 +36,9 @@
 #ifdef HAVE_SYS_SYSCALL_H
 #  include <sys/syscall.h>
 #endif
+#ifndef _WIN32
+#  include <sys/mman.h>
+#endif
 #include <unistd.h>
 
 #include "wimlib.h"
@@ -134,6 +137,84 @@ wimlib_aligned_free(void *ptr)
 		FREE(((void **)ptr)[-1]);
 }
 
+/*
+ * Large allocations, e.g. the working sets of the compressors, are mapped
+ * directly from the OS and aligned to huge page boundaries, with transparent
+ * huge pages requested where supported.  This cuts TLB misses considerably
+ * during matchfinding.  The memory isn't touched here, so on NUMA systems each
+ * page is placed on the node of the thread that first writes to it, which for
+ * a compressor is the thread that uses it.
+ *
+ * A header just before the returned pointer records how the memory was
+ * obtained.  If a custom allocator was installed with
+ * wimlib_set_memory_allocator(), or on Windows, the memory simply comes from
+ * MALLOC() instead.
+ */
+#define LARGE_ALLOC_MIN_SIZE	(4UL << 20)
+#define HUGE_PAGE_SIZE		(2UL << 20)
+#define LARGE_ALLOC_HDR_SIZE	64
+
+struct large_alloc_hdr {
+	void *base;
+	size_t map_size; /* 0 if 'base' came from MALLOC() */
+};
+
+void *
+wimlib_large_malloc(size_t size)
+{
+	struct large_alloc_hdr *hdr;
+	u8 *ptr;
+
+	STATIC_ASSERT(sizeof(struct large_alloc_hdr) <= LARGE_ALLOC_HDR_SIZE);
+
+	if (size > SIZE_MAX - 3 * HUGE_PAGE_SIZE)
+		return NULL;
+#ifndef _WIN32
+	if (size >= LARGE_ALLOC_MIN_SIZE && wimlib_malloc_func == malloc) {
+		size_t map_size = ALIGN(size + LARGE_ALLOC_HDR_SIZE,
+					HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+		void *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base != MAP_FAILED) {
+			ptr = (u8 *)ALIGN((uintptr_t)base, HUGE_PAGE_SIZE);
+		#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+			madvise(ptr, map_size - (ptr - (u8 *)base),
+				MADV_HUGEPAGE);
+		#endif
+			hdr = (struct large_alloc_hdr *)ptr;
+			hdr->base = base;
+			hdr->map_size = map_size;
+			return ptr + LARGE_ALLOC_HDR_SIZE;
+		}
+	}
+#endif
+	ptr = MALLOC(size + LARGE_ALLOC_HDR_SIZE + LARGE_ALLOC_HDR_SIZE - 1);
+	if (!ptr)
+		return NULL;
+	hdr = (struct large_alloc_hdr *)ALIGN((uintptr_t)ptr,
+					      LARGE_ALLOC_HDR_SIZE);
+	hdr->base = ptr;
+	hdr->map_size = 0;
+	return (u8 *)hdr + LARGE_ALLOC_HDR_SIZE;
+}
+
+void
+wimlib_large_free(void *ptr)
+{
+	struct large_alloc_hdr *hdr;
+
+	if (!ptr)
+		return;
+	hdr = (struct large_alloc_hdr *)((u8 *)ptr - LARGE_ALLOC_HDR_SIZE);
+#ifndef _WIN32
+	if (hdr->map_size) {
+		munmap(hdr->base, hdr->map_size);
+		return;
+	}
+#endif
+	FREE(hdr->base);
+}
+
 void *
 memdup(const void *mem, size_t size)
 {
@@ -285,8 +366,8 @@ get_available_cpus(void)
 #endif /* !_WIN32 */
 
 #ifndef _WIN32
-u64
-get_available_memory(void)
+static u64
+get_physical_memory(void)
 {
 #if defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
 	long page_size = sysconf(_SC_PAGESIZE);
@@ -307,4 +388,160 @@ default_size:
 	WARNING("Failed to determine available memory; assuming 1 GiB");
 	return (u64)1 << 30;
 }
+
+#ifdef __linux__
+/* Read a small file into @buf as a null-terminated string.  Returns false if
+ * the file could not be read.  */
+static bool
+read_small_file(const char *path, char *buf, size_t bufsize)
+{
+	int fd = open(path, O_RDONLY);
+	ssize_t n;
+
+	if (fd < 0)
+		return false;
+	n = read(fd, buf, bufsize - 1);
+	close(fd);
+	if (n < 0)
+		return false;
+	buf[n] = '\0';
+	return true;
+}
+
+/*
+ * Return the lowest value of the file @filename in the cgroup directory
+ * @base/@cgpath and its ancestors up to @base, or UINT64_MAX if none of them
+ * has a numeric value (e.g. because the value is "max").
+ */
+static u64
+get_cgroup_hierarchy_limit(const char *base, const char *cgpath,
+			   const char *filename)
+{
+	char path[4096];
+	char value[32];
+	size_t base_len = strlen(base);
+	size_t len;
+	char *p;
+	u64 limit = UINT64_MAX;
+
+	if (base_len + strlen(cgpath) + 1 + strlen(filename) >= sizeof(path))
+		return limit;
+	sprintf(path, "%s%s", base, cgpath);
+	len = strlen(path);
+	while (len > base_len && path[len - 1] == '/')
+		path[--len] = '\0';
+
+	for (;;) {
+		sprintf(&path[len], "/%s", filename);
+		if (read_small_file(path, value, sizeof(value)) &&
+		    value[0] >= '0' && value[0] <= '9')
+			limit = min(limit, strtoull(value, NULL, 10));
+		path[len] = '\0';
+
+		if (len <= base_len)
+			break;
+		p = strrchr(path, '/');
+		len = p - path;
+		*p = '\0';
+	}
+	return limit;
+}
+
+/*
+ * Find the path of this process's cgroup in the hierarchy that has exactly the
+ * specified controllers, given the contents of /proc/self/cgroup.  Its lines
+ * look like "4:memory:/path" for cgroup v1, or "0::/path" for cgroup v2 (which
+ * has no controller list).  The string is modified.  Returns NULL if there is
+ * no such hierarchy.
+ */
+static const char *
+find_cgroup_path(char *cgroups, const char *controllers)
+{
+	size_t controllers_len = strlen(controllers);
+	char *line = cgroups;
+
+	while (*line) {
+		char *end = line + strcspn(line, "\n");
+		char *p = line + strspn(line, "0123456789");
+
+		if (p != line && *p == ':' &&
+		    !strncmp(p + 1, controllers, controllers_len) &&
+		    p[1 + controllers_len] == ':')
+		{
+			*end = '\0';
+			return p + 1 + controllers_len + 1;
+		}
+		if (!*end)
+			break;
+		line = end + 1;
+	}
+	return NULL;
+}
+
+/*
+ * Return the memory limit that applies to this process due to the cgroup it is
+ * in, or UINT64_MAX if there is no such limit.  The limit of a cgroup is the
+ * lowest limit of it and its ancestors.  In a container, this is often much
+ * lower than the amount of physical memory.  cgroup v2 is supported, as is the
+ * cgroup v1 memory controller when mounted by itself.
+ */
+static u64
+get_cgroup_memory_limit(void)
+{
+	char cgroups[4096];
+	char buf[4096];
+	const char *cgpath;
+	u64 limit = UINT64_MAX;
+
+	if (!read_small_file("/proc/self/cgroup", cgroups, sizeof(cgroups)))
+		return limit;
+
+	memcpy(buf, cgroups, sizeof(buf));
+	cgpath = find_cgroup_path(buf, "");
+	if (cgpath)
+		limit = min(limit, get_cgroup_hierarchy_limit("/sys/fs/cgroup",
+							      cgpath,
+							      "memory.max"));
+
+	cgpath = find_cgroup_path(cgroups, "memory");
+	if (cgpath)
+		limit = min(limit,
+			    get_cgroup_hierarchy_limit("/sys/fs/cgroup/memory",
+						       cgpath,
+						       "memory.limit_in_bytes"));
+	return limit;
+}
+#endif /* __linux__ */
+
+u64
+get_available_memory(void)
+{
+	u64 mem = get_physical_memory();
+
+#ifdef __linux__
+	mem = min(mem, get_cgroup_memory_limit());
+#endif
+	return mem;
+}
 #endif /* !_WIN32 */
+
+static u64 memory_limit;
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_memory_limit(uint64_t limit)
+{
+	memory_limit = limit;
+	return 0;
+}
+
+/* Return the amount of memory that the library should aim to stay within when
+ * choosing the sizes of large buffers, such as those of the parallel chunk
+ * compressor and decompressor.  */
+u64
+get_memory_limit(void)
+{
+	if (memory_limit != 0)
+		return memory_limit;
+	return get_available_memory();
+}
@@ -31,6 +31,7 @@
 #include "wimlib/metadata.h"
 #include "wimlib/progress.h"
 #include "wimlib/security.h"
+#include "wimlib/stats.h"
 
 static int
 append_blob_to_list(struct blob_descriptor *blob, void *_list)
@@ -89,14 +90,15 @@ verify_file_data_present(struct wim_image_metadata *imd,
 }
 
 /* API function documented in wimlib.h  */
-WIMLIBAPI int
-wimlib_verify_wim(WIMStruct *wim, int verify_flags)
+static int
+verify_wim(WIMStruct *wim, int verify_flags)
 {
 	int ret;
 	LIST_HEAD(blob_list);
 	union wimlib_progress_info progress;
 	struct verify_blob_list_ctx ctx;
 	struct blob_descriptor *blob;
+	int read_flags;
 	struct read_blob_callbacks cbs = {
 		.continue_blob	= verify_continue_blob,
 		.ctx		= &ctx,
@@ -168,7 +170,26 @@ wimlib_verify_wim(WIMStruct *wim, int verify_flags)
 	if (ret)
 		return ret;
 
+	/* With parallel decompression, this thread just hands decompressed
+	 * data to the hasher, which would then be the bottleneck; so hash
+	 * large blobs on a thread of their own.  */
+	read_flags = VERIFY_BLOB_HASHES;
+	if (wim->num_decompression_threads != 1)
+		read_flags |= HASH_BLOBS_ASYNC;
+
 	return read_blob_list(&blob_list,
 			      offsetof(struct blob_descriptor, extraction_list),
-			      &cbs, VERIFY_BLOB_HASHES);
+			      &cbs, read_flags);
+}
+
+WIMLIBAPI int
+wimlib_verify_wim(WIMStruct *wim, int verify_flags)
+{
+	struct stats_phase phase;
+	int ret;
+
+	stats_begin_phase(&phase);
+	ret = verify_wim(wim, verify_flags);
+	stats_end_phase(&phase, verify);
+	return ret;
 }
@@ -31,17 +31,25 @@
 
 #include "wimlib.h"
 #include "wimlib/assert.h"
+#include "wimlib/async.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/chunk_decompressor.h"
 #include "wimlib/cpu_features.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/file_io.h"
 #include "wimlib/integrity.h"
 #include "wimlib/metadata.h"
+#include "wimlib/scan.h"
 #include "wimlib/security.h"
+#include "wimlib/shared_chunk_cache.h"
+#include "wimlib/stats.h"
+#include "wimlib/thread_pool.h"
 #include "wimlib/threads.h"
 #include "wimlib/wim.h"
 #include "wimlib/xml.h"
+#include "wimlib/xml_windows.h"
 #include "wimlib/win32.h"
 
 /* Information about the available compression types for the WIM format.  */
@@ -83,7 +91,7 @@ static const struct {
 };
 
 /* Is the specified compression type valid?  */
-static bool
+bool
 wim_compression_type_valid(enum wimlib_compression_type ctype)
 {
 	return (unsigned)ctype < ARRAY_LEN(wim_ctype_info) &&
@@ -91,7 +99,7 @@ wim_compression_type_valid(enum wimlib_compression_type ctype)
 }
 
 /* Is the specified chunk size valid for the compression type?  */
-static bool
+bool
 wim_chunk_size_valid(u32 chunk_size, enum wimlib_compression_type ctype)
 {
 	if (!(chunk_size == 0 || is_power_of_2(chunk_size)))
@@ -117,6 +125,13 @@ wim_default_solid_chunk_size(enum wimlib_compression_type ctype)
 	return wim_ctype_info[(unsigned)ctype].default_solid_chunk_size;
 }
 
+/* Return the largest chunk size allowed for the specified compression type.  */
+u32
+wim_max_chunk_size(enum wimlib_compression_type ctype)
+{
+	return wim_ctype_info[(unsigned)ctype].max_chunk_size;
+}
+
 /* Return the default compression type to use in solid resources.  */
 static enum wimlib_compression_type
 wim_default_solid_compression_type(void)
@@ -137,14 +152,32 @@ wim_has_solid_resources(const WIMStruct *wim)
 	return for_blob_in_table(wim->blob_table, is_blob_in_solid_resource, NULL);
 }
 
+/* Default memory budget for the cache of decompressed chunks used for
+ * random-access reads, such as those made by a mounted WIM image.  */
+#define DEFAULT_CHUNK_CACHE_SIZE	(32ULL << 20)
+
+/* Default size of the buffer for data written to the output WIM file  */
+#define DEFAULT_OUTPUT_BUFFER_SIZE	((size_t)8 << 20)
+
+/* Default read-ahead distance in the WIM file  */
+#define DEFAULT_READ_AHEAD_SIZE		((u64)8 << 20)
+
 static WIMStruct *
 new_wim_struct(void)
 {
 	WIMStruct *wim = CALLOC(1, sizeof(WIMStruct));
 	if (!wim)
 		return NULL;
+	if (!mutex_init(&wim->add_image_lock)) {
+		FREE(wim);
+		return NULL;
+	}
 
 	wim->refcnt = 1;
+	wim->num_decompression_threads = 1;
+	wim->max_chunk_cache_size = DEFAULT_CHUNK_CACHE_SIZE;
+	wim->out_buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE;
+	wim->read_ahead_size = DEFAULT_READ_AHEAD_SIZE;
 	filedes_invalidate(&wim->in_fd);
 	filedes_invalidate(&wim->out_fd);
 	wim->out_solid_compression_type = wim_default_solid_compression_type();
@@ -200,8 +233,12 @@ wimlib_create_new_wim(enum wimlib_compression_type ctype, WIMStruct **wim_ret)
 static void
 unload_image_metadata(struct wim_image_metadata *imd)
 {
+	free_metadata_loader(imd->loader);
+	imd->loader = NULL;
 	free_dentry_tree(imd->root_dentry, NULL);
 	imd->root_dentry = NULL;
+	free_dentry_arena(imd->arena);
+	imd->arena = NULL;
 	free_wim_security_data(imd->security_data);
 	imd->security_data = NULL;
 	INIT_HLIST_HEAD(&imd->inode_list);
@@ -318,8 +355,8 @@ new_unloaded_image_metadata(struct blob_descriptor *metadata_blob)
  * On failure, WIMLIB_ERR_INVALID_IMAGE, WIMLIB_ERR_METADATA_NOT_FOUND,
  * or another error code will be returned.
  */
-int
-select_wim_image(WIMStruct *wim, int image)
+static int
+do_select_wim_image(WIMStruct *wim, int image, bool lazy)
 {
 	struct wim_image_metadata *imd;
 	int ret;
@@ -327,28 +364,49 @@ select_wim_image(WIMStruct *wim, int image)
 	if (image == WIMLIB_NO_IMAGE)
 		return WIMLIB_ERR_INVALID_IMAGE;
 
-	if (image == wim->current_image)
-		return 0;
+	if (image != wim->current_image) {
+		if (image < 1 || image > wim->hdr.image_count)
+			return WIMLIB_ERR_INVALID_IMAGE;
 
-	if (image < 1 || image > wim->hdr.image_count)
-		return WIMLIB_ERR_INVALID_IMAGE;
+		if (!wim_has_metadata(wim))
+			return WIMLIB_ERR_METADATA_NOT_FOUND;
 
-	if (!wim_has_metadata(wim))
-		return WIMLIB_ERR_METADATA_NOT_FOUND;
-
-	deselect_current_wim_image(wim);
+		deselect_current_wim_image(wim);
 
-	imd = wim->image_metadata[image - 1];
-	if (!is_image_loaded(imd)) {
-		ret = read_metadata_resource(imd);
-		if (ret)
-			return ret;
+		imd = wim->image_metadata[image - 1];
+		if (!is_image_loaded(imd)) {
+			ret = read_metadata_resource(imd, lazy);
+			if (ret)
+				return ret;
+		}
+		wim->current_image = image;
+		imd->selected_refcnt++;
 	}
-	wim->current_image = image;
-	imd->selected_refcnt++;
+
+	/* The image may have been loaded lazily before.  */
+	if (!lazy)
+		return finish_loading_image(wim_get_current_image_metadata(wim));
 	return 0;
 }
 
+int
+select_wim_image(WIMStruct *wim, int image)
+{
+	return do_select_wim_image(wim, image, false);
+}
+
+/*
+ * Like select_wim_image(), but if the image isn't already loaded, only load its
+ * root directory.  The caller must load the other directories it needs with
+ * load_dentry_children() or load_dentry_tree(), and it must not modify the
+ * image.
+ */
+int
+select_wim_image_lazily(WIMStruct *wim, int image)
+{
+	return do_select_wim_image(wim, image, true);
+}
+
 /*
  * Deselect the WIMStruct's currently selected image, if any.  To reduce memory
  * usage, possibly unload the newly deselected image's metadata from memory.
@@ -371,14 +429,44 @@ deselect_current_wim_image(WIMStruct *wim)
 	}
 }
 
+/*
+ * Keep the WIMStruct's currently selected image loaded even after it is
+ * deselected, so that several images can be worked on at once.  The caller must
+ * call unpin_wim_image() on the image when done with it.
+ */
+void
+pin_current_wim_image(WIMStruct *wim)
+{
+	wim_get_current_image_metadata(wim)->selected_refcnt++;
+}
+
+/*
+ * Release an image pinned with pin_current_wim_image().  If the image is no
+ * longer selected, possibly unload its metadata from memory.
+ */
+void
+unpin_wim_image(WIMStruct *wim, int image)
+{
+	struct wim_image_metadata *imd = wim->image_metadata[image - 1];
+
+	wimlib_assert(imd->selected_refcnt > 0);
+	imd->selected_refcnt--;
+
+	if (can_unload_image(imd)) {
+		wimlib_assert(list_empty(&imd->unhashed_blobs));
+		unload_image_metadata(imd);
+	}
+}
+
 /*
  * Calls a function on images in the WIM.  If @image is WIMLIB_ALL_IMAGES,
  * @visitor is called on the WIM once for each image, with each image selected
  * as the current image in turn.  If @image is a certain image, @visitor is
  * called on the WIM only once, with that image selected.
  */
-int
-for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
+static int
+do_for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *),
+	     bool lazy)
 {
 	int ret;
 	int start;
@@ -395,7 +483,7 @@ for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
 		return WIMLIB_ERR_INVALID_IMAGE;
 	}
 	for (i = start; i <= end; i++) {
-		ret = select_wim_image(wim, i);
+		ret = do_select_wim_image(wim, i, lazy);
 		if (ret != 0)
 			return ret;
 		ret = visitor(wim);
@@ -405,6 +493,19 @@ for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
 	return 0;
 }
 
+int
+for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
+{
+	return do_for_image(wim, image, visitor, false);
+}
+
+/* Like for_image(), but select the images with select_wim_image_lazily().  */
+int
+for_image_lazily(WIMStruct *wim, int image, int (*visitor)(WIMStruct *))
+{
+	return do_for_image(wim, image, visitor, true);
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_resolve_image(WIMStruct *wim, const tchar *image_name_or_num)
@@ -597,6 +698,120 @@ wimlib_set_output_pack_chunk_size(WIMStruct *wim, u32 chunk_size)
 	return 0;
 }
 
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_output_solid_resource_count(WIMStruct *wim, unsigned count)
+{
+	wim->out_num_solid_resources = count;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_output_buffer_size(WIMStruct *wim, size_t size)
+{
+	wim->out_buffer_size = size;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_output_compression_target(WIMStruct *wim, unsigned mb_per_sec)
+{
+	wim->out_compression_target = mb_per_sec;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_output_compression_workers(WIMStruct *wim, const tchar *workers)
+{
+#ifdef _WIN32
+	return WIMLIB_ERR_UNSUPPORTED;
+#else
+	tchar *copy = NULL;
+
+	if (workers && *workers) {
+		copy = TSTRDUP(workers);
+		if (!copy)
+			return WIMLIB_ERR_NOMEM;
+	}
+	FREE(wim->out_compression_workers);
+	wim->out_compression_workers = copy;
+	return 0;
+#endif
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_read_ahead_size(WIMStruct *wim, uint64_t size)
+{
+	wim->read_ahead_size = size;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_decompression_threads(WIMStruct *wim, unsigned num_threads)
+{
+	if (wim->num_decompression_threads != num_threads &&
+	    wim->parallel_decompressor)
+	{
+		(*wim->parallel_decompressor->destroy)(wim->parallel_decompressor);
+		wim->parallel_decompressor = NULL;
+	}
+	wim->num_decompression_threads = num_threads;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_chunk_cache_size(WIMStruct *wim, u64 max_size)
+{
+	if (max_size == 0) {
+		free_chunk_cache(wim->chunk_cache);
+		wim->chunk_cache = NULL;
+	} else if (wim->chunk_cache) {
+		chunk_cache_shrink(wim->chunk_cache, max_size);
+	}
+	wim->max_chunk_cache_size = max_size;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_shared_chunk_cache(WIMStruct *wim, const tchar *path, u64 size)
+{
+	struct shared_chunk_cache *cache = NULL;
+
+	/* If the cache is created, size its slots for the chunks of this WIM
+	 * file's non-solid resources, but for no less than the most common
+	 * chunk size, since other WIM files may use the cache too.  */
+	if (path) {
+		int ret = shared_chunk_cache_open(path, size,
+						  max(wim->chunk_size, 32768),
+						  wim->hdr.guid, &wim->in_fd,
+						  &cache);
+		if (ret)
+			return ret;
+	}
+	shared_chunk_cache_close(wim->shared_chunk_cache);
+	wim->shared_chunk_cache = cache;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_thread_pool(WIMStruct *wim, struct wimlib_thread_pool *pool)
+{
+	if (pool)
+		thread_pool_get(pool);
+	if (wim->thread_pool)
+		thread_pool_put(wim->thread_pool);
+	wim->thread_pool = pool;
+	return 0;
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI const tchar *
 wimlib_get_compression_type_string(enum wimlib_compression_type ctype)
@@ -644,6 +859,31 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 		wimfile = NULL;
 		filedes_init(&wim->in_fd, *(const int*)wim_filename_or_fd);
 		wim->in_fd.is_pipe = 1;
+		filedes_start_pipe_reader(&wim->in_fd);
+	} else if (open_flags & WIMLIB_OPEN_FLAG_FROM_READER) {
+		const struct wimlib_wim_reader *reader = wim_filename_or_fd;
+
+		wimfile = NULL;
+		ret = filedes_init_reader(&wim->in_fd, reader);
+		if (ret)
+			return ret;
+		wim->file_size = reader->size;
+	} else if (open_flags & WIMLIB_OPEN_FLAG_FROM_FD) {
+		struct stat stbuf;
+		int fd;
+
+		/* A seekable file descriptor.  Use a duplicate, so that the
+		 * caller's descriptor stays open after wimlib_free().  */
+		wimfile = NULL;
+		fd = dup(*(const int *)wim_filename_or_fd);
+		if (fd < 0) {
+			ERROR_WITH_ERRNO("Can't duplicate file descriptor");
+			return WIMLIB_ERR_OPEN;
+		}
+		filedes_init(&wim->in_fd, fd);
+		wim->opened_from_fd = 1;
+		if (fstat(fd, &stbuf) == 0)
+			wim->file_size = stbuf.st_size;
 	} else {
 		struct stat stbuf;
 
@@ -656,6 +896,9 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 		if (fstat(wim->in_fd.fd, &stbuf) == 0)
 			wim->file_size = stbuf.st_size;
 
+		if (open_flags & WIMLIB_OPEN_FLAG_MMAP)
+			filedes_map(&wim->in_fd, wim->file_size);
+
 		/* The absolute path to the WIM is requested so that
 		 * wimlib_overwrite() still works even if the process changes
 		 * its working directory.  This actually happens if a WIM is
@@ -790,15 +1033,19 @@ open_wim_as_WIMStruct(const void *wim_filename_or_fd, int open_flags,
 
 	ret = wimlib_global_init(0);
 	if (ret)
-		return ret;
+		goto out_close_reader;
 
 	wim = new_wim_struct();
-	if (!wim)
-		return WIMLIB_ERR_NOMEM;
+	if (!wim) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_close_reader;
+	}
 
 	wim->progfunc = progfunc;
 	wim->progctx = progctx;
 
+	/* From here on, a caller-supplied reader is closed by begin_read() or
+	 * wimlib_free().  */
 	ret = begin_read(wim, wim_filename_or_fd, open_flags);
 	if (ret) {
 		wimlib_free(wim);
@@ -807,6 +1054,15 @@ open_wim_as_WIMStruct(const void *wim_filename_or_fd, int open_flags,
 
 	*wim_ret = wim;
 	return 0;
+
+out_close_reader:
+	if (open_flags & WIMLIB_OPEN_FLAG_FROM_READER) {
+		const struct wimlib_wim_reader *reader = wim_filename_or_fd;
+
+		if (reader->close)
+			(*reader->close)(reader->ctx);
+	}
+	return ret;
 }
 
 /* API function documented in wimlib.h  */
@@ -817,7 +1073,8 @@ wimlib_open_wim_with_progress(const tchar *wimfile, int open_flags,
 {
 	if (open_flags & ~(WIMLIB_OPEN_FLAG_CHECK_INTEGRITY |
 			   WIMLIB_OPEN_FLAG_ERROR_IF_SPLIT |
-			   WIMLIB_OPEN_FLAG_WRITE_ACCESS))
+			   WIMLIB_OPEN_FLAG_WRITE_ACCESS |
+			   WIMLIB_OPEN_FLAG_MMAP))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	if (!wimfile || !*wimfile || !wim_ret)
@@ -835,6 +1092,54 @@ wimlib_open_wim(const tchar *wimfile, int open_flags, WIMStruct **wim_ret)
 					     NULL, NULL);
 }
 
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_open_wim_from_reader(const struct wimlib_wim_reader *reader,
+			    int open_flags, WIMStruct **wim_ret,
+			    wimlib_progress_func_t progfunc, void *progctx)
+{
+	if (!reader || !reader->read_at)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if ((open_flags & ~(WIMLIB_OPEN_FLAG_CHECK_INTEGRITY |
+			    WIMLIB_OPEN_FLAG_ERROR_IF_SPLIT)) || !wim_ret)
+	{
+		if (reader->close)
+			(*reader->close)(reader->ctx);
+		return WIMLIB_ERR_INVALID_PARAM;
+	}
+
+	return open_wim_as_WIMStruct(reader,
+				     open_flags | WIMLIB_OPEN_FLAG_FROM_READER,
+				     wim_ret, progfunc, progctx);
+}
+
+/*
+ * Hash the unhashed blobs of @imd that are in files on the threads of the
+ * WIMStruct's thread pool, or of a temporary one, and merge them into the blob
+ * table.  Any blobs that aren't hashed this way are left on the list.
+ */
+static void
+checksum_unhashed_blobs_in_parallel(WIMStruct *wim,
+				    struct wim_image_metadata *imd)
+{
+	struct scan_hasher *hasher;
+	struct blob_descriptor *blob;
+
+	/* Not worth starting threads for one blob.  */
+	if (list_empty(&imd->unhashed_blobs) ||
+	    imd->unhashed_blobs.next->next == &imd->unhashed_blobs)
+		return;
+
+	if (start_scan_hasher(wim->thread_pool, &hasher))
+		return;
+	image_for_each_unhashed_blob(blob, imd) {
+		blob->scan_hash_job = NULL;
+		scan_hasher_submit(hasher, blob);
+	}
+	stop_scan_hasher(hasher, &imd->unhashed_blobs, wim->blob_table);
+}
+
 /* Checksum all blobs that are unhashed (other than the metadata blobs), merging
  * them into the blob table as needed.  This is a no-op unless files have been
  * added to an image in the same WIMStruct.  */
@@ -848,6 +1153,10 @@ wim_checksum_unhashed_blobs(WIMStruct *wim)
 	for (int i = 0; i < wim->hdr.image_count; i++) {
 		struct blob_descriptor *blob, *tmp;
 		struct wim_image_metadata *imd = wim->image_metadata[i];
+
+		checksum_unhashed_blobs_in_parallel(wim, imd);
+
+		/* Hash any remaining blobs, which also reports any errors.  */
 		image_for_each_unhashed_blob_safe(blob, tmp, imd) {
 			struct blob_descriptor *new_blob;
 			ret = hash_unhashed_blob(blob, wim->blob_table, &new_blob);
@@ -905,8 +1214,16 @@ wim_decrement_refcnt(WIMStruct *wim)
 	if (filedes_valid(&wim->out_fd))
 		filedes_close(&wim->out_fd);
 	wimlib_free_decompressor(wim->decompressor);
+	if (wim->parallel_decompressor)
+		(*wim->parallel_decompressor->destroy)(wim->parallel_decompressor);
+	free_chunk_cache(wim->chunk_cache);
+	shared_chunk_cache_close(wim->shared_chunk_cache);
+	if (wim->thread_pool)
+		thread_pool_put(wim->thread_pool);
 	xml_free_info_struct(wim->xml_info);
+	FREE(wim->out_compression_workers);
 	FREE(wim->filename);
+	mutex_destroy(&wim->add_image_lock);
 	FREE(wim);
 }
 
@@ -930,6 +1247,7 @@ wimlib_free(WIMStruct *wim)
 		FREE(wim->image_metadata);
 		wim->image_metadata = NULL;
 	}
+	free_windows_info_cache(wim);
 
 	wim_decrement_refcnt(wim);
 }
@@ -975,7 +1293,8 @@ wimlib_global_init(int init_flags)
 			   WIMLIB_INIT_FLAG_STRICT_CAPTURE_PRIVILEGES |
 			   WIMLIB_INIT_FLAG_STRICT_APPLY_PRIVILEGES |
 			   WIMLIB_INIT_FLAG_DEFAULT_CASE_SENSITIVE |
-			   WIMLIB_INIT_FLAG_DEFAULT_CASE_INSENSITIVE))
+			   WIMLIB_INIT_FLAG_DEFAULT_CASE_INSENSITIVE |
+			   WIMLIB_INIT_FLAG_PROFILE_SYSCALLS))
 		goto out_unlock;
 
 	ret = WIMLIB_ERR_INVALID_PARAM;
@@ -986,6 +1305,7 @@ wimlib_global_init(int init_flags)
 		goto out_unlock;
 
 	init_cpu_features();
+	init_trace();
 #ifdef _WIN32
 	ret = win32_global_init(init_flags);
 	if (ret)
@@ -996,6 +1316,8 @@ wimlib_global_init(int init_flags)
 		default_ignore_case = false;
 	else if (init_flags & WIMLIB_INIT_FLAG_DEFAULT_CASE_INSENSITIVE)
 		default_ignore_case = true;
+	syscall_profiling_enabled =
+		(init_flags & WIMLIB_INIT_FLAG_PROFILE_SYSCALLS) != 0;
 	lib_initialized = true;
 	ret = 0;
 out_unlock:
@@ -1016,10 +1338,13 @@ wimlib_global_cleanup(void)
 	if (!lib_initialized)
 		goto out_unlock;
 
+	cleanup_async_jobs();
+
 #ifdef _WIN32
 	win32_global_cleanup();
 #endif
 
+	cleanup_trace();
 	wimlib_set_error_file(NULL);
 	lib_initialized = false;
 
@@ -40,6 +40,9 @@
 #include "wimlib/reparse.h"
 #include "wimlib/scan.h" /* for mangle_pat() and match_pattern_list()  */
 #include "wimlib/textfile.h"
+#include "wimlib/thread_pool.h"
+#include "wimlib/threads.h"
+#include "wimlib/wim.h"
 #include "wimlib/wimboot.h"
 #include "wimlib/wof.h"
 #include "wimlib/xattr.h"
@@ -151,6 +154,29 @@ struct win32_apply_ctx {
 	 * of the security descriptor.  */
 	unsigned long no_security_descriptors;
 
+	/* The image's security descriptors, indexed by security ID, each
+	 * converted into the form passed to NtSetSecurityObject() the first
+	 * time a file using it is reached  */
+	struct prepared_security_descriptor {
+		SECURITY_DESCRIPTOR_RELATIVE *desc;
+
+		/* Number of files with this security ID whose existing security
+		 * descriptor was found to be the same, or different, such that
+		 * setting it could be skipped, or not  */
+		u32 num_already_set;
+		u32 num_not_already_set;
+	} *prepared_descs;
+	u32 num_prepared_descs;
+
+	/* Buffer for reading a file's existing security descriptor  */
+	void *existing_desc_buf;
+	size_t existing_desc_buf_size;
+
+	/* Set once setting a SACL has failed because the needed privilege isn't
+	 * held.  This doesn't vary from file to file, so after that SACLs are
+	 * no longer attempted.  */
+	bool sacl_privilege_not_held;
+
 	/* Number of files for which we couldn't set the short name.  */
 	unsigned long num_set_short_name_failures;
 
@@ -167,6 +193,17 @@ struct win32_apply_ctx {
 	 * [PrepopulateList].  */
 	unsigned long num_system_compression_exclusions;
 
+	/* If not NULL, files are compressed using System Compression by the
+	 * threads of a thread pool, while extraction continues.  */
+	struct system_compression_queue *system_compression_queue;
+
+	/* Has a file been successfully compressed using System Compression
+	 * yet?  */
+	bool system_compression_works;
+
+	/* Have we tried to start compressing files asynchronously yet?  */
+	bool tried_system_compression_queue;
+
 	/* Number of files for which we couldn't set the object ID.  */
 	unsigned long num_object_id_failures;
 
@@ -624,34 +661,26 @@ find_wimboot_wim(WIMStruct *wim_to_find, struct win32_apply_ctx *ctx)
 	return NULL;
 }
 
+/*
+ * Set the external backing of a file created in WIMBoot mode, if it is to be
+ * externally backed.  This may be called on the threads that create
+ * nondirectory files in parallel: start_wimboot_extraction() already evaluated
+ * every file on the extracting thread, so here the shared state is only read.
+ * Files excluded from external backing are reported separately by
+ * report_wimboot_exclusion().
+ */
 static int
 set_backed_from_wim(HANDLE h, struct wim_inode *inode, struct win32_apply_ctx *ctx)
 {
 	int ret;
-	const struct wim_dentry *excluded_dentry;
 	const struct blob_descriptor *blob;
 	const struct wimboot_wim *wimboot_wim;
 
-	ret = will_externally_back_inode(inode, ctx, &excluded_dentry, true);
+	ret = will_externally_back_inode(inode, ctx, NULL, true);
 	if (ret > 0) /* Error.  */
 		return ret;
-
-	if (ret < 0 && ret != EXTERNAL_BACKING_EXCLUDED)
-		return 0; /* Not externally backing, other than due to exclusion.  */
-
-	if (unlikely(ret == EXTERNAL_BACKING_EXCLUDED)) {
-		/* Not externally backing due to exclusion.  */
-		union wimlib_progress_info info;
-
-		build_extraction_path(excluded_dentry, ctx);
-
-		info.wimboot_exclude.path_in_wim = excluded_dentry->d_full_path;
-		info.wimboot_exclude.extraction_path = current_path(ctx);
-
-		return call_progress(ctx->common.progfunc,
-				     WIMLIB_PROGRESS_MSG_WIMBOOT_EXCLUDE,
-				     &info, ctx->common.progctx);
-	}
+	if (ret < 0)
+		return 0; /* Not externally backing.  */
 
 	/* Externally backing.  */
 
@@ -674,6 +703,32 @@ set_backed_from_wim(HANDLE h, struct wim_inode *inode, struct win32_apply_ctx *c
 	return 0;
 }
 
+/* If the file was not externally backed in WIMBoot mode only because its path
+ * was excluded, report this to the progress function.  This must be called on
+ * the extracting thread.  */
+static int
+report_wimboot_exclusion(struct wim_inode *inode, struct win32_apply_ctx *ctx)
+{
+	const struct wim_dentry *excluded_dentry;
+	union wimlib_progress_info info;
+	int ret;
+
+	ret = will_externally_back_inode(inode, ctx, &excluded_dentry, true);
+	if (ret > 0) /* Error.  */
+		return ret;
+	if (likely(ret != EXTERNAL_BACKING_EXCLUDED))
+		return 0;
+
+	build_extraction_path(excluded_dentry, ctx);
+
+	info.wimboot_exclude.path_in_wim = excluded_dentry->d_full_path;
+	info.wimboot_exclude.extraction_path = current_path(ctx);
+
+	return call_progress(ctx->common.progfunc,
+			     WIMLIB_PROGRESS_MSG_WIMBOOT_EXCLUDE,
+			     &info, ctx->common.progctx);
+}
+
 /* Calculates the SHA-1 message digest of the WIM's blob table.  */
 static int
 hash_blob_table(WIMStruct *wim, u8 hash[SHA1_HASH_SIZE])
@@ -1943,13 +1998,199 @@ create_nondirectory(struct wim_inode *inode, struct win32_apply_ctx *ctx)
 	return ret;
 }
 
-/* Create all the nondirectory files being extracted, including all aliases
- * (hard links).  */
+/*
+ * Creating a file on Windows is slow, mostly because of the filter drivers
+ * (such as antivirus software) which get to inspect each file as it is opened
+ * and closed.  Since this cost is paid per file rather than per byte, it
+ * dominates when extracting many small files.  So, when there are enough
+ * nondirectory files, they are created by the threads of a thread pool, which
+ * spreads the cost across the CPUs.  The thread pool is the one set on the
+ * WIMStruct with wimlib_set_thread_pool(), if any.
+ *
+ * Each thread works on its own copy of the extraction context, with its own
+ * path buffers, object attributes, and I/O status block, and takes the files in
+ * batches of WIN32_FILES_PER_BATCH.  The status of each file is saved, and the
+ * extracting thread reports errors and progress in the usual order once all
+ * files have been created.  The directories all exist already, so the files
+ * are independent of each other.
+ *
+ * This includes WIMBoot mode, where each file also gets its external backing
+ * set, which takes one more call into the WOF driver per file.  The driver
+ * has no way to set the backing of several files at once, so running these
+ * calls on several threads is the only way to speed them up.
+ */
+#define WIN32_FILES_PER_BATCH	32
+
+struct nondirectory_job;
+
+struct nondirectory_queue {
+	struct wimlib_thread_pool *pool;
+	unsigned cursor;
+
+	/* One job per thread, each with its own copy of the context  */
+	struct nondirectory_job *jobs;
+	unsigned num_jobs;
+
+	/* The inodes to create, and the status of creating each  */
+	struct wim_inode **inodes;
+	int *results;
+	size_t num_inodes;
+
+	/* Protects the fields below  */
+	struct mutex lock;
+	struct condvar done_cond;
+	size_t next_inode;
+	unsigned num_pending;
+};
+
+struct nondirectory_job {
+	struct thread_pool_work work;
+	struct nondirectory_queue *queue;
+	struct win32_apply_ctx ctx;
+};
+
+static void
+nondirectory_job_run(struct thread_pool_work *work)
+{
+	struct nondirectory_job *job = container_of(work, struct nondirectory_job,
+						    work);
+	struct nondirectory_queue *q = job->queue;
+	size_t i, end;
+
+	mutex_lock(&q->lock);
+	while (q->next_inode != q->num_inodes) {
+		i = q->next_inode;
+		end = min(i + WIN32_FILES_PER_BATCH, q->num_inodes);
+		q->next_inode = end;
+		mutex_unlock(&q->lock);
+
+		for (; i < end; i++)
+			q->results[i] = create_nondirectory(q->inodes[i],
+							    &job->ctx);
+
+		mutex_lock(&q->lock);
+	}
+	if (--q->num_pending == 0)
+		condvar_signal(&q->done_cond);
+	mutex_unlock(&q->lock);
+}
+
+/* Make @job_ctx a copy of @ctx with its own path buffers, for use by another
+ * thread while creating nondirectory files.  */
+static bool
+init_job_ctx(struct win32_apply_ctx *job_ctx,
+	     const struct win32_apply_ctx *ctx)
+{
+	size_t path_max = ctx->pathbuf.MaximumLength / sizeof(wchar_t);
+
+	*job_ctx = *ctx;
+	job_ctx->attr.ObjectName = &job_ctx->pathbuf;
+	job_ctx->pathbuf.Length = 0;
+	job_ctx->pathbuf.Buffer = MALLOC(ctx->pathbuf.MaximumLength);
+	job_ctx->print_buffer = MALLOC((ctx->common.target_nchars + 1 +
+					path_max + 1) * sizeof(wchar_t));
+	job_ctx->data_buffer = NULL;
+	job_ctx->system_compression_queue = NULL;
+	INIT_LIST_HEAD(&job_ctx->reparse_dentries);
+	INIT_LIST_HEAD(&job_ctx->encrypted_dentries);
+	job_ctx->num_set_short_name_failures = 0;
+	job_ctx->num_remove_short_name_failures = 0;
+	return job_ctx->pathbuf.Buffer && job_ctx->print_buffer;
+}
+
+/* Free the path buffers of @job_ctx, and add what it counted to @ctx.  */
+static void
+destroy_job_ctx(struct win32_apply_ctx *job_ctx, struct win32_apply_ctx *ctx)
+{
+	ctx->num_set_short_name_failures +=
+		job_ctx->num_set_short_name_failures;
+	ctx->num_remove_short_name_failures +=
+		job_ctx->num_remove_short_name_failures;
+	if (job_ctx->tried_to_enable_short_names)
+		ctx->tried_to_enable_short_names = true;
+	FREE(job_ctx->pathbuf.Buffer);
+	FREE(job_ctx->print_buffer);
+}
+
+/* Create the @num_inodes nondirectory files @inodes on the threads of a thread
+ * pool, saving the status of each in @results.  Returns false if the threads
+ * couldn't be set up, in which case nothing was done.  */
+static bool
+create_nondirectories_in_parallel(struct wim_inode **inodes, int *results,
+				  size_t num_inodes,
+				  struct win32_apply_ctx *ctx)
+{
+	struct nondirectory_queue q = {
+		.inodes = inodes,
+		.results = results,
+		.num_inodes = num_inodes,
+	};
+	struct wimlib_thread_pool *pool = ctx->common.wim->thread_pool;
+	unsigned max_jobs;
+	bool ok = false;
+
+	if (!mutex_init(&q.lock))
+		return false;
+	if (!condvar_init(&q.done_cond))
+		goto out_destroy_lock;
+	if (pool)
+		thread_pool_get(pool);
+	else if (thread_pool_create(0, &pool))
+		goto out_destroy_cond;
+	q.pool = pool;
+
+	max_jobs = min(thread_pool_num_threads(pool),
+		       DIV_ROUND_UP(num_inodes, WIN32_FILES_PER_BATCH));
+	q.jobs = CALLOC(max_jobs, sizeof(q.jobs[0]));
+	if (!q.jobs)
+		goto out_put_pool;
+	for (; q.num_jobs < max_jobs; q.num_jobs++) {
+		struct nondirectory_job *job = &q.jobs[q.num_jobs];
+
+		job->work.run = nondirectory_job_run;
+		job->work.name = "extract files";
+		job->queue = &q;
+		if (!init_job_ctx(&job->ctx, ctx)) {
+			destroy_job_ctx(&job->ctx, ctx);
+			break;
+		}
+	}
+	if (q.num_jobs == 0)
+		goto out_free_jobs;
+
+	q.num_pending = q.num_jobs;
+	for (unsigned i = 0; i < q.num_jobs; i++)
+		thread_pool_submit(pool, &q.jobs[i].work, &q.cursor);
+	mutex_lock(&q.lock);
+	while (q.num_pending)
+		condvar_wait(&q.done_cond, &q.lock);
+	mutex_unlock(&q.lock);
+	ok = true;
+
+	for (unsigned i = 0; i < q.num_jobs; i++)
+		destroy_job_ctx(&q.jobs[i].ctx, ctx);
+out_free_jobs:
+	FREE(q.jobs);
+out_put_pool:
+	thread_pool_put(pool);
+out_destroy_cond:
+	condvar_destroy(&q.done_cond);
+out_destroy_lock:
+	mutex_destroy(&q.lock);
+	return ok;
+}
+
+/* Create the nondirectory files, other than the first @num_done, on the
+ * extracting thread, and report progress for all of them.  The first
+ * @num_done were already created, with the statuses saved in @results.  */
 static int
-create_nondirectories(struct list_head *dentry_list, struct win32_apply_ctx *ctx)
+create_remaining_nondirectories(struct list_head *dentry_list,
+				const int *results, size_t num_done,
+				struct win32_apply_ctx *ctx)
 {
 	struct wim_dentry *dentry;
 	struct wim_inode *inode;
+	size_t i = 0;
 	int ret;
 
 	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
@@ -1958,7 +2199,13 @@ create_nondirectories(struct list_head *dentry_list, struct win32_apply_ctx *ctx
 			continue;
 		/* Call create_nondirectory() only once per inode  */
 		if (dentry == inode_first_extraction_dentry(inode)) {
-			ret = create_nondirectory(inode, ctx);
+			if (i < num_done)
+				ret = results[i++];
+			else
+				ret = create_nondirectory(inode, ctx);
+			if (!ret && unlikely(ctx->common.extract_flags &
+					     WIMLIB_EXTRACT_FLAG_WIMBOOT))
+				ret = report_wimboot_exclusion(inode, ctx);
 			ret = check_apply_error(dentry, ctx, ret);
 			if (ret)
 				return ret;
@@ -1970,6 +2217,56 @@ create_nondirectories(struct list_head *dentry_list, struct win32_apply_ctx *ctx
 	return 0;
 }
 
+/* Create all the nondirectory files being extracted, including all aliases
+ * (hard links).  */
+static int
+create_nondirectories(struct list_head *dentry_list, struct win32_apply_ctx *ctx)
+{
+	struct wim_dentry *dentry;
+	struct wim_inode *inode;
+	struct wim_inode **inodes;
+	int *results;
+	size_t num_inodes = 0;
+	size_t num_done = 0;
+	int ret;
+
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		inode = dentry->d_inode;
+		if (!(inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+		    dentry == inode_first_extraction_dentry(inode))
+			num_inodes++;
+	}
+
+	/* Failing to allocate the arrays isn't fatal, since the files can
+	 * still be created one at a time.  */
+	inodes = NULL;
+	results = NULL;
+	if (num_inodes > WIN32_FILES_PER_BATCH) {
+		inodes = MALLOC(num_inodes * sizeof(inodes[0]));
+		results = MALLOC(num_inodes * sizeof(results[0]));
+	}
+	if (inodes && results) {
+		size_t i = 0;
+
+		list_for_each_entry(dentry, dentry_list,
+				    d_extraction_list_node) {
+			inode = dentry->d_inode;
+			if (!(inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			    dentry == inode_first_extraction_dentry(inode))
+				inodes[i++] = inode;
+		}
+		if (create_nondirectories_in_parallel(inodes, results,
+						      num_inodes, ctx))
+			num_done = num_inodes;
+	}
+
+	ret = create_remaining_nondirectories(dentry_list, results, num_done,
+					      ctx);
+	FREE(inodes);
+	FREE(results);
+	return ret;
+}
+
 static void
 close_handles(struct win32_apply_ctx *ctx)
 {
@@ -2547,13 +2844,19 @@ bootloader_supports_compression_format(struct win32_apply_ctx *ctx, int format)
 	return ctx->windows_build_number >= 18362;
 }
 
+/*
+ * Open an extracted file so that it can be compressed using System Compression.
+ * The format to use is returned in *format_p, which may be changed from the
+ * requested format for compatibility with the Windows bootloader.  If the file
+ * should not be compressed at all, *h_ret is set to NULL.
+ */
 static NTSTATUS
-set_system_compression_on_inode(struct wim_inode *inode, int format,
-				struct win32_apply_ctx *ctx)
+open_file_for_system_compression(struct wim_inode *inode, int *format_p,
+				 HANDLE *h_ret, struct win32_apply_ctx *ctx)
 {
-	bool retried = false;
-	NTSTATUS status;
-	HANDLE h;
+	int format = *format_p;
+
+	*h_ret = NULL;
 
 	/* If it may be needed for compatibility with the Windows bootloader,
 	 * force this file to XPRESS4K or uncompressed format.  */
@@ -2614,11 +2917,22 @@ set_system_compression_on_inode(struct wim_inode *inode, int format,
 	}
 
 	/* Open the extracted file.  */
-	status = create_file(&h, GENERIC_READ | GENERIC_WRITE, NULL,
-			     0, FILE_OPEN, 0,
-			     inode_first_extraction_dentry(inode), ctx);
+	*format_p = format;
+	return create_file(h_ret, GENERIC_READ | GENERIC_WRITE, NULL,
+			   0, FILE_OPEN, 0,
+			   inode_first_extraction_dentry(inode), ctx);
+}
 
-	if (!NT_SUCCESS(status))
+static NTSTATUS
+set_system_compression_on_inode(struct wim_inode *inode, int format,
+				struct win32_apply_ctx *ctx)
+{
+	bool retried = false;
+	NTSTATUS status;
+	HANDLE h;
+
+	status = open_file_for_system_compression(inode, &format, &h, ctx);
+	if (!NT_SUCCESS(status) || h == NULL)
 		return status;
 retry:
 	/* Compress the file.  If the attempt fails with "invalid device
@@ -2632,11 +2946,212 @@ retry:
 			goto retry;
 		}
 	}
+	if (NT_SUCCESS(status))
+		ctx->system_compression_works = true;
 
 	NtClose(h);
 	return status;
 }
 
+/*
+ * Handle the result of compressing a file using System Compression.  Returns
+ * %false if System Compression turned out to be unsupported, in which case it
+ * has been disabled for the rest of the extraction.
+ */
+static bool
+report_system_compression_status(struct wim_inode *inode, NTSTATUS status,
+				 struct win32_apply_ctx *ctx)
+{
+	if (likely(NT_SUCCESS(status)))
+		return true;
+
+	if (status == STATUS_INVALID_DEVICE_REQUEST) {
+		if (ctx->common.extract_flags & COMPACT_FLAGS) {
+			WARNING(
+	  "The request to compress the extracted files using System Compression\n"
+"          will not be honored because the operating system or target volume\n"
+"          does not support it.  System Compression is only supported on\n"
+"          Windows 10 and later, and only on NTFS volumes.");
+			ctx->common.extract_flags &= ~COMPACT_FLAGS;
+		}
+		return false;
+	}
+
+	ctx->num_system_compression_failures++;
+	if (ctx->num_system_compression_failures < 10) {
+		build_extraction_path(inode_first_extraction_dentry(inode), ctx);
+		winnt_warning(status, L"\"%ls\": Failed to compress "
+			      "extracted file using System Compression",
+			      current_path(ctx));
+	} else if (ctx->num_system_compression_failures == 10) {
+		WARNING("Suppressing further warnings about "
+			"System Compression failures.");
+	}
+	return true;
+}
+
+/*
+ * Compressing a file using System Compression is slow, since the operating
+ * system compresses the file's data synchronously in FSCTL_SET_EXTERNAL_BACKING.
+ * So once it has been shown to work on the target volume, the files are handed
+ * off to the threads of a thread pool, which compress multiple files
+ * concurrently while the extraction continues.  The thread pool is the one set
+ * on the WIMStruct with wimlib_set_thread_pool(), if any.
+ */
+struct system_compression_queue {
+	struct wimlib_thread_pool *pool;
+	unsigned cursor;
+
+	/* Number of files submitted but not yet reaped.  Only accessed by the
+	 * extracting thread.  */
+	unsigned long num_pending;
+
+	/* Maximum number of files to have pending at once (and therefore, the
+	 * maximum number of extra open handles)  */
+	unsigned long max_pending;
+
+	/* Files which the threads finished compressing, not yet reaped  */
+	struct mutex lock;
+	struct condvar done_cond;
+	struct list_head done_list;
+};
+
+struct system_compression_item {
+	struct thread_pool_work work;
+	struct system_compression_queue *queue;
+	struct wim_inode *inode;
+	HANDLE h;
+	int format;
+	NTSTATUS status;
+};
+
+static void
+system_compression_item_run(struct thread_pool_work *work)
+{
+	struct system_compression_item *item =
+		container_of(work, struct system_compression_item, work);
+	struct system_compression_queue *q = item->queue;
+
+	item->status = set_system_compression(item->h, item->format);
+	NtClose(item->h);
+
+	mutex_lock(&q->lock);
+	list_add_tail(&item->work.list, &q->done_list);
+	condvar_signal(&q->done_cond);
+	mutex_unlock(&q->lock);
+}
+
+/* Start compressing files asynchronously.  Failure isn't fatal, since the files
+ * can still be compressed synchronously.  */
+static void
+start_system_compression_queue(struct win32_apply_ctx *ctx)
+{
+	struct system_compression_queue *q;
+	struct wimlib_thread_pool *pool = ctx->common.wim->thread_pool;
+
+	q = CALLOC(1, sizeof(*q));
+	if (!q)
+		return;
+	if (!mutex_init(&q->lock))
+		goto err_free_queue;
+	if (!condvar_init(&q->done_cond))
+		goto err_destroy_lock;
+	INIT_LIST_HEAD(&q->done_list);
+
+	if (pool)
+		thread_pool_get(pool);
+	else if (thread_pool_create(0, &pool))
+		goto err_destroy_cond;
+	q->pool = pool;
+	q->max_pending = 2 * thread_pool_num_threads(pool);
+	ctx->system_compression_queue = q;
+	return;
+
+err_destroy_cond:
+	condvar_destroy(&q->done_cond);
+err_destroy_lock:
+	mutex_destroy(&q->lock);
+err_free_queue:
+	FREE(q);
+}
+
+/* Wait until at most @max_pending files are pending, and report the status of
+ * the files which have finished.  */
+static void
+reap_system_compression_queue(struct win32_apply_ctx *ctx,
+			      unsigned long max_pending)
+{
+	struct system_compression_queue *q = ctx->system_compression_queue;
+	struct system_compression_item *item;
+
+	while (q->num_pending > max_pending) {
+		mutex_lock(&q->lock);
+		while (list_empty(&q->done_list))
+			condvar_wait(&q->done_cond, &q->lock);
+		item = list_first_entry(&q->done_list,
+					struct system_compression_item,
+					work.list);
+		list_del(&item->work.list);
+		mutex_unlock(&q->lock);
+
+		q->num_pending--;
+		report_system_compression_status(item->inode, item->status,
+						 ctx);
+		FREE(item);
+	}
+}
+
+/* Wait for all pending files to be compressed, then free the queue.  */
+static void
+end_system_compression_queue(struct win32_apply_ctx *ctx)
+{
+	struct system_compression_queue *q = ctx->system_compression_queue;
+
+	if (!q)
+		return;
+	reap_system_compression_queue(ctx, 0);
+	thread_pool_put(q->pool);
+	condvar_destroy(&q->done_cond);
+	mutex_destroy(&q->lock);
+	FREE(q);
+	ctx->system_compression_queue = NULL;
+}
+
+/* Queue a file to be compressed using System Compression.  Returns %false if
+ * the file was not queued, in which case the caller should compress it
+ * synchronously.  */
+static bool
+queue_system_compression(struct wim_inode *inode, int format,
+			 struct win32_apply_ctx *ctx)
+{
+	struct system_compression_queue *q = ctx->system_compression_queue;
+	struct system_compression_item *item;
+	NTSTATUS status;
+
+	item = MALLOC(sizeof(*item));
+	if (!item)
+		return false;
+
+	status = open_file_for_system_compression(inode, &format, &item->h,
+						  ctx);
+	if (!NT_SUCCESS(status) || item->h == NULL) {
+		FREE(item);
+		report_system_compression_status(inode, status, ctx);
+		return true;
+	}
+
+	reap_system_compression_queue(ctx, q->max_pending - 1);
+
+	item->work.run = system_compression_item_run;
+	item->work.name = "system compression";
+	item->queue = q;
+	item->inode = inode;
+	item->format = format;
+	q->num_pending++;
+	thread_pool_submit(q->pool, &item->work, &q->cursor);
+	return true;
+}
+
 /*
  * This function is called when doing a "compact-mode" extraction and we just
  * finished extracting a blob to one or more locations.  For each location that
@@ -2671,28 +3186,21 @@ handle_system_compression(struct blob_descriptor *blob, struct win32_apply_ctx *
 		if (will_externally_back_inode(inode, ctx, NULL, false) != 0)
 			continue;
 
-		status = set_system_compression_on_inode(inode, format, ctx);
-		if (likely(NT_SUCCESS(status)))
+		if (ctx->system_compression_queue &&
+		    queue_system_compression(inode, format, ctx))
 			continue;
 
-		if (status == STATUS_INVALID_DEVICE_REQUEST) {
-			WARNING(
-	  "The request to compress the extracted files using System Compression\n"
-"          will not be honored because the operating system or target volume\n"
-"          does not support it.  System Compression is only supported on\n"
-"          Windows 10 and later, and only on NTFS volumes.");
-			ctx->common.extract_flags &= ~COMPACT_FLAGS;
+		status = set_system_compression_on_inode(inode, format, ctx);
+		if (!report_system_compression_status(inode, status, ctx))
 			return;
-		}
 
-		ctx->num_system_compression_failures++;
-		if (ctx->num_system_compression_failures < 10) {
-			winnt_warning(status, L"\"%ls\": Failed to compress "
-				      "extracted file using System Compression",
-				      current_path(ctx));
-		} else if (ctx->num_system_compression_failures == 10) {
-			WARNING("Suppressing further warnings about "
-				"System Compression failures.");
+		/* Once System Compression is known to work on the target
+		 * volume, compress the remaining files asynchronously.  */
+		if (ctx->system_compression_works &&
+		    !ctx->tried_system_compression_queue)
+		{
+			ctx->tried_system_compression_queue = true;
+			start_system_compression_queue(ctx);
 		}
 	}
 }
@@ -2933,15 +3441,37 @@ out:
 	return ret;
 }
 
-/* Set the security descriptor @desc, of @desc_size bytes, on the file with open
- * handle @h.  */
-static NTSTATUS
-set_security_descriptor(HANDLE h, const void *_desc,
-			size_t desc_size, struct win32_apply_ctx *ctx)
+/*
+ * Get the security descriptor with the given security ID in the form in which
+ * it is passed to NtSetSecurityObject(), converting it on first use.  Images
+ * usually have far fewer distinct security descriptors than files, so each is
+ * converted only once.  Returns NULL if out of memory.
+ */
+static struct prepared_security_descriptor *
+get_prepared_security_descriptor(s32 security_id, struct win32_apply_ctx *ctx)
 {
-	SECURITY_INFORMATION info;
-	NTSTATUS status;
+	const struct wim_security_data *sd;
+	struct prepared_security_descriptor *prepared;
 	SECURITY_DESCRIPTOR_RELATIVE *desc;
+	size_t desc_size;
+
+	sd = wim_get_current_security_data(ctx->common.wim);
+
+	if (unlikely(!ctx->prepared_descs)) {
+		ctx->prepared_descs = CALLOC(sd->num_entries,
+					     sizeof(ctx->prepared_descs[0]));
+		if (!ctx->prepared_descs)
+			return NULL;
+		ctx->num_prepared_descs = sd->num_entries;
+	}
+	prepared = &ctx->prepared_descs[security_id];
+	if (prepared->desc)
+		return prepared;
+
+	desc_size = sd->sizes[security_id];
+	desc = memdup(sd->descriptors[security_id], desc_size);
+	if (!desc)
+		return NULL;
 
 	/*
 	 * Ideally, we would just pass in the security descriptor buffer as-is.
@@ -2972,16 +3502,6 @@ set_security_descriptor(HANDLE h, const void *_desc,
 	 *   SE_SACL_PRESENT.  Again, it's seemingly unavoidable but "harmless"
 	 *   that Windows changes the representation of a "null SACL".
 	 */
-	if (likely(desc_size <= STACK_MAX)) {
-		desc = alloca(desc_size);
-	} else {
-		desc = MALLOC(desc_size);
-		if (!desc)
-			return STATUS_NO_MEMORY;
-	}
-
-	memcpy(desc, _desc, desc_size);
-
 	if (likely(desc_size >= 4)) {
 
 		if (desc->Control & SE_DACL_AUTO_INHERITED)
@@ -2990,6 +3510,97 @@ set_security_descriptor(HANDLE h, const void *_desc,
 		if (desc->Control & SE_SACL_AUTO_INHERITED)
 			desc->Control |= SE_SACL_AUTO_INHERIT_REQ;
 	}
+	prepared->desc = desc;
+	return prepared;
+}
+
+static void
+free_prepared_security_descriptors(struct win32_apply_ctx *ctx)
+{
+	for (u32 i = 0; i < ctx->num_prepared_descs; i++)
+		FREE(ctx->prepared_descs[i].desc);
+	FREE(ctx->prepared_descs);
+	FREE(ctx->existing_desc_buf);
+}
+
+/*
+ * Return true if the file with open handle @h already has exactly the security
+ * descriptor @desc, of @desc_size bytes, as is often the case when the
+ * descriptor was originally inherited and the extracted file inherited the
+ * same one when it was created.  Setting it then would be a no-op, except
+ * that for a directory Windows would propagate the inheritable ACEs to all
+ * the files below it again, which is what makes setting security descriptors
+ * slow.
+ *
+ * This needs the file to have been opened with READ_CONTROL and
+ * ACCESS_SYSTEM_SECURITY, since unless the SACL is checked too it can't be
+ * known that nothing would change.  The check is abandoned for a security
+ * descriptor once it has failed repeatedly without ever succeeding.
+ */
+static bool
+security_descriptor_already_set(HANDLE h, ACCESS_MASK perms,
+				const void *desc, size_t desc_size,
+				struct prepared_security_descriptor *prepared,
+				struct win32_apply_ctx *ctx)
+{
+	const SECURITY_INFORMATION info =
+		OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION |
+		DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION |
+		LABEL_SECURITY_INFORMATION;
+	ULONG len;
+	NTSTATUS status;
+
+	if ((perms & (READ_CONTROL | ACCESS_SYSTEM_SECURITY)) !=
+	    (READ_CONTROL | ACCESS_SYSTEM_SECURITY))
+		return false;
+
+	if (prepared->num_already_set == 0 &&
+	    prepared->num_not_already_set >= 4)
+		return false;
+
+	if (ctx->existing_desc_buf_size < desc_size) {
+		void *buf = REALLOC(ctx->existing_desc_buf, desc_size);
+		if (!buf)
+			return false;
+		ctx->existing_desc_buf = buf;
+		ctx->existing_desc_buf_size = desc_size;
+	}
+
+	/* If the existing descriptor is larger than the one wanted, the query
+	 * fails with STATUS_BUFFER_TOO_SMALL; the two differ either way.  */
+	status = NtQuerySecurityObject(h, info, ctx->existing_desc_buf,
+				       desc_size, &len);
+	if (NT_SUCCESS(status) && len == desc_size &&
+	    !memcmp(ctx->existing_desc_buf, desc, desc_size))
+	{
+		prepared->num_already_set++;
+		return true;
+	}
+	prepared->num_not_already_set++;
+	return false;
+}
+
+/* Set the security descriptor with ID @security_id on the file with open
+ * handle @h, which was opened with access rights @perms.  */
+static NTSTATUS
+set_security_descriptor(HANDLE h, ACCESS_MASK perms, s32 security_id,
+			struct win32_apply_ctx *ctx)
+{
+	const struct wim_security_data *sd;
+	struct prepared_security_descriptor *prepared;
+	SECURITY_INFORMATION info;
+	NTSTATUS status;
+
+	prepared = get_prepared_security_descriptor(security_id, ctx);
+	if (!prepared)
+		return STATUS_NO_MEMORY;
+
+	sd = wim_get_current_security_data(ctx->common.wim);
+	if (security_descriptor_already_set(h, perms,
+					    sd->descriptors[security_id],
+					    sd->sizes[security_id],
+					    prepared, ctx))
+		return STATUS_SUCCESS;
 
 	/*
 	 * More API insanity.  We want to set the entire security descriptor
@@ -3014,6 +3625,14 @@ set_security_descriptor(HANDLE h, const void *_desc,
 	       DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION |
 	       LABEL_SECURITY_INFORMATION | BACKUP_SECURITY_INFORMATION;
 
+	if (ctx->sacl_privilege_not_held &&
+	    !(ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_STRICT_ACLS))
+	{
+		info &= ~(SACL_SECURITY_INFORMATION |
+			  LABEL_SECURITY_INFORMATION |
+			  BACKUP_SECURITY_INFORMATION);
+		ctx->partial_security_descriptors++;
+	}
 
 	/*
 	 * It's also worth noting that SetFileSecurity() is unusable because it
@@ -3026,9 +3645,9 @@ set_security_descriptor(HANDLE h, const void *_desc,
 	 */
 
 retry:
-	status = NtSetSecurityObject(h, info, desc);
+	status = NtSetSecurityObject(h, info, prepared->desc);
 	if (NT_SUCCESS(status))
-		goto out_maybe_free_desc;
+		return status;
 
 	/* Failed to set the requested parts of the security descriptor.  If the
 	 * error was permissions-related, try to set fewer parts of the security
@@ -3038,6 +3657,8 @@ retry:
 	    !(ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_STRICT_ACLS))
 	{
 		if (info & SACL_SECURITY_INFORMATION) {
+			if (status == STATUS_PRIVILEGE_NOT_HELD)
+				ctx->sacl_privilege_not_held = true;
 			info &= ~(SACL_SECURITY_INFORMATION |
 				  LABEL_SECURITY_INFORMATION |
 				  BACKUP_SECURITY_INFORMATION);
@@ -3062,16 +3683,14 @@ retry:
 	if (!(info & SACL_SECURITY_INFORMATION))
 		ctx->partial_security_descriptors--;
 	ctx->no_security_descriptors++;
-
-out_maybe_free_desc:
-	if (unlikely(desc_size > STACK_MAX))
-		FREE(desc);
 	return status;
 }
 
-/* Set metadata on the open file @h from the WIM inode @inode.  */
+/* Set metadata on the open file @h, opened with access rights @perms, from the
+ * WIM inode @inode.  */
 static int
-do_apply_metadata_to_file(HANDLE h, const struct wim_inode *inode,
+do_apply_metadata_to_file(HANDLE h, ACCESS_MASK perms,
+			  const struct wim_inode *inode,
 			  struct win32_apply_ctx *ctx)
 {
 	FILE_BASIC_INFORMATION info;
@@ -3093,15 +3712,8 @@ do_apply_metadata_to_file(HANDLE h, const struct wim_inode *inode,
 	if (inode_has_security_descriptor(inode) &&
 	    !(ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_NO_ACLS))
 	{
-		const struct wim_security_data *sd;
-		const void *desc;
-		size_t desc_size;
-
-		sd = wim_get_current_security_data(ctx->common.wim);
-		desc = sd->descriptors[inode->i_security_id];
-		desc_size = sd->sizes[inode->i_security_id];
-
-		status = set_security_descriptor(h, desc, desc_size, ctx);
+		status = set_security_descriptor(h, perms, inode->i_security_id,
+						 ctx);
 		if (!NT_SUCCESS(status) &&
 		    (ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_STRICT_ACLS))
 		{
@@ -3152,8 +3764,10 @@ apply_metadata_to_file(const struct wim_dentry *dentry,
 	NTSTATUS status;
 	int ret;
 
+	/* READ_CONTROL is only needed to check whether the security descriptor
+	 * is already set.  */
 	perms = FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA | WRITE_DAC |
-		WRITE_OWNER | ACCESS_SYSTEM_SECURITY;
+		WRITE_OWNER | ACCESS_SYSTEM_SECURITY | READ_CONTROL;
 
 	build_extraction_path(dentry, ctx);
 
@@ -3168,6 +3782,10 @@ apply_metadata_to_file(const struct wim_dentry *dentry,
 				perms &= ~ACCESS_SYSTEM_SECURITY;
 				continue;
 			}
+			if (perms & READ_CONTROL) {
+				perms &= ~READ_CONTROL;
+				continue;
+			}
 			if (perms & WRITE_DAC) {
 				perms &= ~WRITE_DAC;
 				continue;
@@ -3182,7 +3800,7 @@ apply_metadata_to_file(const struct wim_dentry *dentry,
 		return WIMLIB_ERR_OPEN;
 	}
 
-	ret = do_apply_metadata_to_file(h, inode, ctx);
+	ret = do_apply_metadata_to_file(h, perms, inode, ctx);
 
 	NtClose(h);
 
@@ -3313,6 +3931,7 @@ win32_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 		.ctx		= ctx,
 	};
 	ret = extract_blob_list(&ctx->common, &cbs);
+	end_system_compression_queue(ctx);
 	if (ret)
 		goto out;
 
@@ -3348,6 +3967,7 @@ out:
 	}
 	FREE(ctx->mem_prepopulate_pats);
 	FREE(ctx->data_buffer);
+	free_prepared_security_descriptors(ctx);
 	return ret;
 }
 
@@ -39,6 +39,8 @@
 #include "wimlib/paths.h"
 #include "wimlib/reparse.h"
 #include "wimlib/scan.h"
+#include "wimlib/stats.h"
+#include "wimlib/usn_info.h"
 #include "wimlib/win32_vss.h"
 #include "wimlib/wof.h"
 #include "wimlib/xattr.h"
@@ -56,6 +58,13 @@ struct winnt_scan_ctx {
 
 	/* A reference to the VSS snapshot being used, or NULL if none  */
 	struct vss_snapshot *snapshot;
+
+	/* ID of the volume's NTFS change journal, or 0 if the USNs of the
+	 * files aren't known  */
+	u64 usn_journal_id;
+
+	/* Number of bytes of EFSRPC raw data kept in memory so far  */
+	size_t efsrpc_bytes_buffered;
 };
 
 static inline const wchar_t *
@@ -161,7 +170,7 @@ alloc_windows_file_for_file_id(u64 file_id, const wchar_t *root_path,
 static int
 add_stream(struct wim_inode *inode, struct windows_file *windows_file,
 	   u64 stream_size, int stream_type, const utf16lechar *stream_name,
-	   struct list_head *unhashed_blobs)
+	   struct scan_params *params)
 {
 	struct blob_descriptor *blob = NULL;
 	struct wim_inode_stream *strm;
@@ -186,7 +195,11 @@ add_stream(struct wim_inode *inode, struct windows_file *windows_file,
 	if (!strm)
 		goto err_nomem;
 
-	prepare_unhashed_blob(blob, inode, strm->stream_id, unhashed_blobs);
+	prepare_unhashed_blob(blob, inode, strm->stream_id,
+			      params->unhashed_blobs);
+	/* Raw encrypted data is read differently; leave it until the write.  */
+	if (stream_type == STREAM_TYPE_DATA)
+		scan_hasher_submit(params->hasher, blob);
 	ret = 0;
 out:
 	if (windows_file)
@@ -264,6 +277,7 @@ winnt_openat(HANDLE cur_dir, const wchar_t *path, size_t path_nchars,
 	IO_STATUS_BLOCK iosb;
 	NTSTATUS status;
 	ULONG options = FILE_OPEN_REPARSE_POINT | FILE_OPEN_FOR_BACKUP_INTENT;
+	u64 start = syscall_profile_begin();
 
 	perms |= SYNCHRONIZE;
 	if (perms & (FILE_READ_DATA | FILE_LIST_DIRECTORY)) {
@@ -287,6 +301,7 @@ retry:
 			}
 		}
 	}
+	syscall_profile_end(WIMLIB_SYSCALL_OPEN, start);
 	return status;
 }
 
@@ -332,8 +347,10 @@ read_winnt_stream_prefix(const struct windows_file *file,
 	NTSTATUS status;
 	u8 buf[BUFFER_SIZE] __attribute__((aligned(8)));
 	u64 bytes_remaining;
+	u64 start;
 	int ret;
 
+	start = syscall_profile_begin();
 	status = NtOpenFile(&h, FILE_READ_DATA | SYNCHRONIZE,
 			    &attr, &iosb,
 			    FILE_SHARE_VALID_FLAGS,
@@ -342,6 +359,7 @@ read_winnt_stream_prefix(const struct windows_file *file,
 				FILE_SYNCHRONOUS_IO_NONALERT |
 				FILE_SEQUENTIAL_ONLY |
 				(file->is_file_id ? FILE_OPEN_BY_FILE_ID : 0));
+	syscall_profile_end(WIMLIB_SYSCALL_OPEN, start);
 	if (unlikely(!NT_SUCCESS(status))) {
 		if (status == STATUS_SHARING_VIOLATION) {
 			ERROR("Can't open %ls for reading:\n"
@@ -367,8 +385,10 @@ read_winnt_stream_prefix(const struct windows_file *file,
 		count = min(sizeof(buf), bytes_remaining);
 
 	retry_read:
+		start = syscall_profile_begin();
 		status = NtReadFile(h, NULL, NULL, NULL,
 				    &iosb, buf, count, NULL, NULL);
+		syscall_profile_end(WIMLIB_SYSCALL_READ, start);
 		if (unlikely(!NT_SUCCESS(status))) {
 			if (status == STATUS_END_OF_FILE) {
 				ERROR("%ls: File was concurrently truncated",
@@ -501,6 +521,20 @@ read_windows_file_prefix(const struct blob_descriptor *blob, u64 size,
 	return read_winnt_stream_prefix(file, size, cb);
 }
 
+static NTSTATUS
+winnt_set_short_name(struct wim_dentry *dentry, const wchar_t *short_name,
+		     size_t short_name_nbytes)
+{
+	if (short_name_nbytes != 0) {
+		dentry->d_short_name = utf16le_dupz(short_name,
+						    short_name_nbytes);
+		if (!dentry->d_short_name)
+			return STATUS_NO_MEMORY;
+		dentry->d_short_name_nbytes = short_name_nbytes;
+	}
+	return STATUS_SUCCESS;
+}
+
 /*
  * Load the short name of a file into a WIM dentry.
  */
@@ -518,13 +552,9 @@ winnt_get_short_name(HANDLE h, struct wim_dentry *dentry)
 	status = NtQueryInformationFile(h, &iosb, buf, sizeof(buf),
 					FileAlternateNameInformation);
 	info = (const FILE_NAME_INFORMATION *)buf;
-	if (NT_SUCCESS(status) && info->FileNameLength != 0) {
-		dentry->d_short_name = utf16le_dupz(info->FileName,
-						    info->FileNameLength);
-		if (!dentry->d_short_name)
-			return STATUS_NO_MEMORY;
-		dentry->d_short_name_nbytes = info->FileNameLength;
-	}
+	if (NT_SUCCESS(status))
+		status = winnt_set_short_name(dentry, info->FileName,
+					      info->FileNameLength);
 	return status;
 }
 
@@ -709,6 +739,7 @@ winnt_load_xattrs(HANDLE h, struct wim_inode *inode,
 	u8 *buf = _buf;
 	const FILE_FULL_EA_INFORMATION *ea;
 	struct wim_xattr_entry *entry;
+	u64 start;
 	int ret;
 
 
@@ -736,8 +767,10 @@ retry:
 		}
 	}
 
+	start = syscall_profile_begin();
 	status = NtQueryEaFile(h, &iosb, buf, ea_size,
 			       FALSE, NULL, 0, NULL, TRUE);
+	syscall_profile_end(WIMLIB_SYSCALL_XATTR, start);
 
 	if (unlikely(!NT_SUCCESS(status))) {
 		if (status == STATUS_BUFFER_OVERFLOW) {
@@ -809,16 +842,34 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 			const wchar_t *relative_path,
 			size_t relative_path_nchars,
 			const wchar_t *filename,
+			const FILE_BOTH_DIR_INFORMATION *dir_info,
 			struct winnt_scan_ctx *ctx,
 			bool recursive);
 
+static NTSTATUS
+winnt_query_directory(HANDLE h, IO_STATUS_BLOCK *iosb, void *buf,
+		      size_t bufsize)
+{
+	u64 start = syscall_profile_begin();
+	NTSTATUS status = NtQueryDirectoryFile(h, NULL, NULL, NULL, iosb,
+					       buf, bufsize,
+					       FileBothDirectoryInformation,
+					       FALSE, NULL, FALSE);
+
+	syscall_profile_end(WIMLIB_SYSCALL_READDIR, start);
+	return status;
+}
+
 static int
 winnt_recurse_directory(HANDLE h,
 			struct wim_dentry *parent,
 			struct winnt_scan_ctx *ctx)
 {
 	void *buf;
-	const size_t bufsize = 8192;
+	/* Ask for many directory entries at a time.  This matters most on
+	 * network shares, where each request is a round trip; 64 KiB is the
+	 * largest query that SMB servers will generally honor.  */
+	const size_t bufsize = 65536;
 	IO_STATUS_BLOCK iosb;
 	NTSTATUS status;
 	int ret;
@@ -830,12 +881,10 @@ winnt_recurse_directory(HANDLE h,
 	/* Using NtQueryDirectoryFile() we can re-use the same open handle,
 	 * which we opened with FILE_FLAG_BACKUP_SEMANTICS.  */
 
-	while (NT_SUCCESS(status = NtQueryDirectoryFile(h, NULL, NULL, NULL,
-							&iosb, buf, bufsize,
-							FileNamesInformation,
-							FALSE, NULL, FALSE)))
+	while (NT_SUCCESS(status = winnt_query_directory(h, &iosb, buf,
+							 bufsize)))
 	{
-		const FILE_NAMES_INFORMATION *info = buf;
+		const FILE_BOTH_DIR_INFORMATION *info = buf;
 		for (;;) {
 			if (!should_ignore_filename(info->FileName,
 						    info->FileNameLength / 2))
@@ -858,6 +907,7 @@ winnt_recurse_directory(HANDLE h,
 							filename,
 							info->FileNameLength / 2,
 							filename,
+							info,
 							ctx,
 							true);
 
@@ -865,12 +915,11 @@ winnt_recurse_directory(HANDLE h,
 
 				if (ret)
 					goto out_free_buf;
-				attach_scanned_tree(parent, child,
-						    ctx->params->blob_table);
+				attach_scanned_tree(parent, child, ctx->params);
 			}
 			if (info->NextEntryOffset == 0)
 				break;
-			info = (const FILE_NAMES_INFORMATION *)
+			info = (const FILE_BOTH_DIR_INFORMATION *)
 					((const u8 *)info + info->NextEntryOffset);
 		}
 	}
@@ -1185,16 +1234,63 @@ winnt_load_reparse_data(HANDLE h, struct wim_inode *inode,
 	return 0;
 }
 
+/* The largest EFSRPC raw data that will be kept in memory from the scan, per
+ * file and in total, so that it doesn't have to be exported again when it's
+ * written.  */
+#define EFSRPC_MAX_BUFFERED_FILE_SIZE	(1 << 20)
+#define EFSRPC_MAX_BUFFERED_TOTAL_SIZE	(256 << 20)
+
+struct win32_encrypted_scan_ctx {
+	u64 size;
+
+	/* The data read so far, or NULL if it isn't being kept  */
+	u8 *buf;
+	size_t buf_alloc;
+	size_t max_buffered;
+};
+
 static DWORD WINAPI
-win32_tally_encrypted_size_cb(unsigned char *_data, void *_size_ret,
+win32_tally_encrypted_size_cb(unsigned char *data, void *_ctx,
 			      unsigned long len)
 {
-	*(u64*)_size_ret += len;
+	struct win32_encrypted_scan_ctx *ctx = _ctx;
+
+	if (ctx->buf) {
+		if (ctx->size + len > ctx->max_buffered) {
+			FREE(ctx->buf);
+			ctx->buf = NULL;
+		} else {
+			if (ctx->size + len > ctx->buf_alloc) {
+				size_t new_alloc = max(ctx->size + len,
+						       (u64)ctx->buf_alloc * 2);
+				u8 *new_buf;
+
+				new_alloc = min(new_alloc, ctx->max_buffered);
+				new_buf = REALLOC(ctx->buf, new_alloc);
+				if (!new_buf) {
+					FREE(ctx->buf);
+					ctx->buf = NULL;
+					goto out;
+				}
+				ctx->buf = new_buf;
+				ctx->buf_alloc = new_alloc;
+			}
+			memcpy(&ctx->buf[ctx->size], data, len);
+		}
+	}
+out:
+	ctx->size += len;
 	return ERROR_SUCCESS;
 }
 
+/*
+ * Get the size of the raw encrypted data of the file @path by exporting it.
+ * The data itself is also returned in @ctx->buf, if it fits within
+ * @ctx->max_buffered bytes; otherwise @ctx->buf is set to NULL.
+ */
 static int
-win32_get_encrypted_file_size(const wchar_t *path, bool is_dir, u64 *size_ret)
+win32_get_encrypted_file_size(const wchar_t *path, bool is_dir,
+			      struct win32_encrypted_scan_ctx *ctx)
 {
 	DWORD err;
 	void *file_ctx;
@@ -1211,13 +1307,17 @@ win32_get_encrypted_file_size(const wchar_t *path, bool is_dir, u64 *size_ret)
 			    path);
 		return WIMLIB_ERR_OPEN;
 	}
-	*size_ret = 0;
+	ctx->size = 0;
+	ctx->buf_alloc = min(4096, ctx->max_buffered);
+	ctx->buf = ctx->buf_alloc ? MALLOC(ctx->buf_alloc) : NULL;
 	err = ReadEncryptedFileRaw(win32_tally_encrypted_size_cb,
-				   size_ret, file_ctx);
+				   ctx, file_ctx);
 	if (err != ERROR_SUCCESS) {
 		win32_error(err,
 			    L"Failed to read raw encrypted data from \"%ls\"",
 			    path);
+		FREE(ctx->buf);
+		ctx->buf = NULL;
 		ret = WIMLIB_ERR_READ;
 	} else {
 		ret = 0;
@@ -1233,25 +1333,46 @@ winnt_scan_efsrpc_raw_data(struct wim_inode *inode,
 	wchar_t *path = ctx->params->cur_path;
 	size_t path_nchars = ctx->params->cur_path_nchars;
 	const bool is_dir = (inode->i_attributes & FILE_ATTRIBUTE_DIRECTORY);
+	struct win32_encrypted_scan_ctx scan_ctx;
 	struct windows_file *windows_file;
-	u64 size;
 	int ret;
 
 	/* OpenEncryptedFileRaw() expects a Win32 name.  */
 	wimlib_assert(!wmemcmp(path, L"\\??\\", 4));
 	path[1] = L'\\';
 
-	ret = win32_get_encrypted_file_size(path, is_dir, &size);
+	/* Exporting the raw data is the only way to learn its size, and EFS
+	 * exports are slow; so if the data is small, keep it rather than
+	 * exporting it a second time when the blob is read.  */
+	scan_ctx.max_buffered = min(EFSRPC_MAX_BUFFERED_FILE_SIZE,
+				    EFSRPC_MAX_BUFFERED_TOTAL_SIZE -
+					ctx->efsrpc_bytes_buffered);
+	ret = win32_get_encrypted_file_size(path, is_dir, &scan_ctx);
 	if (ret)
 		goto out;
 
 	/* Empty EFSRPC data does not make sense  */
-	wimlib_assert(size != 0);
+	wimlib_assert(scan_ctx.size != 0);
+
+	if (scan_ctx.buf) {
+		ret = 0;
+		if (!inode_add_stream_with_data(inode,
+						STREAM_TYPE_EFSRPC_RAW_DATA,
+						NO_STREAM_NAME,
+						scan_ctx.buf, scan_ctx.size,
+						ctx->params->blob_table))
+			ret = WIMLIB_ERR_NOMEM;
+		else
+			ctx->efsrpc_bytes_buffered += scan_ctx.size;
+		FREE(scan_ctx.buf);
+		goto out;
+	}
 
 	windows_file = alloc_windows_file(path, path_nchars, NULL, 0,
 					  ctx->snapshot, true);
-	ret = add_stream(inode, windows_file, size, STREAM_TYPE_EFSRPC_RAW_DATA,
-			 NO_STREAM_NAME, ctx->params->unhashed_blobs);
+	ret = add_stream(inode, windows_file, scan_ctx.size,
+			 STREAM_TYPE_EFSRPC_RAW_DATA, NO_STREAM_NAME,
+			 ctx->params);
 out:
 	path[1] = L'?';
 	return ret;
@@ -1314,7 +1435,7 @@ winnt_scan_data_stream(wchar_t *raw_stream_name, size_t raw_stream_name_nchars,
 					  stream_name, stream_name_nchars,
 					  ctx->snapshot, false);
 	return add_stream(inode, windows_file, stream_size, STREAM_TYPE_DATA,
-			  stream_name, ctx->params->unhashed_blobs);
+			  stream_name, ctx->params);
 }
 
 /*
@@ -1480,6 +1601,13 @@ should_try_to_use_wimboot_hash(const struct wim_inode *inode,
 	if (inode->i_attributes & FILE_ATTRIBUTE_REPARSE_POINT)
 		return (inode->i_reparse_tag == WIM_IO_REPARSE_TAG_WOF) &&
 			(ctx->params->add_flags & WIMLIB_ADD_FLAG_WIMBOOT);
+
+	/* Without a reparse point, the only thing the fixup can do is fill in
+	 * the hash of the unnamed data stream, so don't spend an
+	 * FSCTL_GET_EXTERNAL_BACKING on a file whose unnamed data stream is
+	 * empty.  */
+	if (!inode_get_blob_for_unnamed_data_stream_resolved(inode))
+		return false;
 	return !ctx->wof_not_attached;
 }
 
@@ -1633,9 +1761,11 @@ get_file_info(HANDLE h, struct file_info *info)
 	IO_STATUS_BLOCK iosb;
 	NTSTATUS status;
 	FILE_ALL_INFORMATION all_info;
+	u64 start = syscall_profile_begin();
 
 	status = NtQueryInformationFile(h, &iosb, &all_info, sizeof(all_info),
 					FileAllInformation);
+	syscall_profile_end(WIMLIB_SYSCALL_STAT, start);
 
 	if (unlikely(!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW))
 		return status;
@@ -1706,6 +1836,7 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 			const wchar_t *relative_path,
 			size_t relative_path_nchars,
 			const wchar_t *filename,
+			const FILE_BOTH_DIR_INFORMATION *dir_info,
 			struct winnt_scan_ctx *ctx,
 			bool recursive)
 {
@@ -1787,8 +1918,14 @@ winnt_build_dentry_tree(struct wim_dentry **root_ret,
 	if (ret)
 		goto out;
 
-	/* Get the short (DOS) name of the file.  */
-	status = winnt_get_short_name(h, root);
+	/* Get the short (DOS) name of the file.  If the file was found by
+	 * enumerating its parent directory, the name came with the directory
+	 * entry, so there's no need to ask for it again.  */
+	if (dir_info)
+		status = winnt_set_short_name(root, dir_info->ShortName,
+					      dir_info->ShortNameLength);
+	else
+		status = winnt_get_short_name(h, root);
 
 	/* If we can't read the short filename for any reason other than
 	 * out-of-memory, just ignore the error and assume the file has no short
@@ -2097,6 +2234,7 @@ struct ntfs_inode {
 	u64 last_access_time;
 	u64 last_write_time;
 	u64 starting_lcn;
+	u64 usn;
 	u32 attributes;
 	u32 security_id;
 	u32 num_aliases;
@@ -2488,6 +2626,7 @@ load_one_file(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode_map *inode_map)
 	ni->creation_time = info->BasicInformation.CreationTime;
 	ni->last_write_time = info->BasicInformation.LastWriteTime;
 	ni->last_access_time = info->BasicInformation.LastAccessTime;
+	ni->usn = info->Usn;
 	ni->security_id = info->SecurityId;
 	ni->special_streams = special_streams;
 
@@ -2511,10 +2650,16 @@ load_one_file(const FILE_LAYOUT_ENTRY *file, struct ntfs_inode_map *inode_map)
  * For each file, allocate an 'ntfs_inode' structure for each file and add it to
  * 'inode_map' keyed by inode number.  Include NTFS special files such as
  * $Bitmap (they will be removed later).
+ *
+ * Also set *usn_journal_id_ret to the ID of the volume's change journal, or to
+ * 0 if it is inactive; the USNs returned by the MFT scan are only meaningful
+ * together with this ID.
  */
 static int
-load_files_from_mft(const wchar_t *path, struct ntfs_inode_map *inode_map)
+load_files_from_mft(const wchar_t *path, struct ntfs_inode_map *inode_map,
+		    u64 *usn_journal_id_ret)
 {
+	USN_JOURNAL_DATA journal_data;
 	HANDLE h = NULL;
 	QUERY_FILE_LAYOUT_INPUT in = (QUERY_FILE_LAYOUT_INPUT) {
 		.NumberOfPairs = 0,
@@ -2538,6 +2683,13 @@ load_files_from_mft(const wchar_t *path, struct ntfs_inode_map *inode_map)
 		goto out;
 	}
 
+	/* Query the journal before the MFT, so that a journal recreated during
+	 * the scan can't be mistaken for this one.  */
+	*usn_journal_id_ret = 0;
+	if (NT_SUCCESS(winnt_fsctl(h, FSCTL_QUERY_USN_JOURNAL, NULL, 0,
+				   &journal_data, sizeof(journal_data), NULL)))
+		*usn_journal_id_ret = journal_data.UsnJournalID;
+
 	for (;;) {
 		/* Allocate a buffer for the output of the ioctl.  */
 		out = MALLOC(outsize);
@@ -2750,7 +2902,7 @@ generate_wim_structures_recursive(struct wim_dentry **root_ret,
 		ret = winnt_build_dentry_tree(&root, NULL,
 					      ctx->params->cur_path,
 					      ctx->params->cur_path_nchars,
-					      filename, ctx, false);
+					      filename, NULL, ctx, false);
 		if (ret) /* Error? */
 			goto out;
 		if (!root) /* Excluded? */
@@ -2798,6 +2950,21 @@ generate_wim_structures_recursive(struct wim_dentry **root_ret,
 	inode->i_last_write_time = ni->last_write_time;
 	inode->i_last_access_time = ni->last_access_time;
 
+	/* Record the USN, to allow detecting whether the file has changed
+	 * when this image is used as the template of a later capture.  */
+	if (ctx->usn_journal_id) {
+		struct wimlib_usn_info usn_info = {
+			.journal_id = ctx->usn_journal_id,
+			.file_id = ni->ino,
+			.usn = ni->usn,
+		};
+
+		if (!inode_set_usn_info(inode, &usn_info)) {
+			ret = WIMLIB_ERR_NOMEM;
+			goto out;
+		}
+	}
+
 	/* Set the security descriptor if needed.  */
 	if (!(ctx->params->add_flags & WIMLIB_ADD_FLAG_NO_ACLS)) {
 		/* Look up the WIM security ID that corresponds to the on-disk
@@ -2864,8 +3031,7 @@ generate_wim_structures_recursive(struct wim_dentry **root_ret,
 		}
 
 		ret = add_stream(inode, windows_file, ns->size,
-				 STREAM_TYPE_DATA, ns->name,
-				 ctx->params->unhashed_blobs);
+				 STREAM_TYPE_DATA, ns->name, ctx->params);
 		if (ret)
 			goto out;
 		ns = NEXT_STREAM(ns);
@@ -2905,7 +3071,7 @@ process_children:
 			if (ret)
 				goto out;
 
-			attach_scanned_tree(root, child, ctx->params->blob_table);
+			attach_scanned_tree(root, child, ctx->params);
 			nd = next;
 		}
 	}
@@ -2945,7 +3111,7 @@ winnt_build_dentry_tree_fast(struct wim_dentry **root_ret,
 	if (adjust_path)
 		path[path_nchars - 1] = L'\0';
 
-	ret = load_files_from_mft(path, &inode_map);
+	ret = load_files_from_mft(path, &inode_map, &ctx->usn_journal_id);
 
 	if (adjust_path)
 		path[path_nchars - 1] = L'\\';
@@ -2992,7 +3158,8 @@ win32_build_dentry_tree(struct wim_dentry **root_ret,
 	int ret;
 
 	if (params->add_flags & WIMLIB_ADD_FLAG_SNAPSHOT)
-		ret = vss_create_snapshot(root_disk_path, &ntpath, &ctx.snapshot);
+		ret = vss_create_snapshot(root_disk_path, params->snapshot_set,
+					  &ntpath, &ctx.snapshot);
 	else
 		ret = win32_path_to_nt_path(root_disk_path, &ntpath);
 
@@ -3039,7 +3206,8 @@ win32_build_dentry_tree(struct wim_dentry **root_ret,
 	}
 #endif
 	ret = winnt_build_dentry_tree(root_ret, NULL, params->cur_path,
-				      params->cur_path_nchars, L"", &ctx, true);
+				      params->cur_path_nchars, L"", NULL, &ctx,
+				      true);
 out:
 	vss_put_snapshot(ctx.snapshot);
 	if (ret == 0)
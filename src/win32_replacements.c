@@ -337,6 +337,28 @@ err:
 	return -1;
 }
 
+/* Set the size of the file open on @fd with SetFileInformationByHandle(), the
+ * equivalent of SetEndOfFile() that leaves the file pointer alone.  Unlike
+ * _chsize_s(), this doesn't write zeroes when extending the file.  */
+int
+win32_set_file_size(int fd, u64 size)
+{
+	HANDLE h;
+	FILE_END_OF_FILE_INFO info = { .EndOfFile = { .QuadPart = size } };
+
+	h = (HANDLE)_get_osfhandle(fd);
+	if (h == INVALID_HANDLE_VALUE)
+		goto err;
+	if (!SetFileInformationByHandle(h, FileEndOfFileInfo,
+					&info, sizeof(info)))
+		goto err_set_errno;
+	return 0;
+err_set_errno:
+	set_errno_from_GetLastError();
+err:
+	return -1;
+}
+
 /* Use the Win32 API to get the number of processors.  */
 unsigned
 get_available_cpus(void)
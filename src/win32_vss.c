@@ -317,10 +317,17 @@ vss_global_cleanup(void)
  *                             VSS implementation                             *
  *----------------------------------------------------------------------------*/
 
+/* A VSS snapshot set, covering one or more volumes.  */
 struct vss_snapshot_internal {
 	struct vss_snapshot base;
 	IVssBackupComponents *vss;
-	VSS_SNAPSHOT_PROP props;
+
+	/* Bitmask of the drive letters whose volumes are in the set  */
+	u32 volumes;
+
+	/* Properties of the snapshot of each volume in the set, indexed by
+	 * drive letter  */
+	VSS_SNAPSHOT_PROP props[26];
 };
 
 /* Delete the specified VSS snapshot.  */
@@ -331,8 +338,9 @@ vss_delete_snapshot(struct vss_snapshot *snapshot)
 
 	internal = container_of(snapshot, struct vss_snapshot_internal, base);
 
-	if (internal->props.m_pwszSnapshotDeviceObject)
-		(*func_VssFreeSnapshotPropertiesInternal)(&internal->props);
+	for (size_t i = 0; i < ARRAY_LEN(internal->props); i++)
+		if (internal->props[i].m_pwszSnapshotDeviceObject)
+			(*func_VssFreeSnapshotPropertiesInternal)(&internal->props[i]);
 	if (internal->vss)
 		internal->vss->vtable->Release(internal->vss);
 	FREE(internal);
@@ -348,11 +356,12 @@ wait_and_release(IVssAsync *async)
 }
 
 static bool
-request_vss_snapshot(IVssBackupComponents *vss, wchar_t *volume,
-		     VSS_ID *snapshot_id)
+request_vss_snapshot(IVssBackupComponents *vss, u32 volumes,
+		     VSS_ID snapshot_ids[26])
 {
 	HRESULT res;
 	IVssAsync *async;
+	VSS_ID snapshot_set_id;
 
 	res = vss->vtable->InitializeForBackup(vss, NULL);
 	if (FAILED(res)) {
@@ -368,18 +377,26 @@ request_vss_snapshot(IVssBackupComponents *vss, wchar_t *volume,
 		return false;
 	}
 
-	res = vss->vtable->StartSnapshotSet(vss, snapshot_id);
+	res = vss->vtable->StartSnapshotSet(vss, &snapshot_set_id);
 	if (FAILED(res)) {
 		ERROR("IVssBackupComponents.StartSnapshotSet() error: %x",
 		      (u32)res);
 		return false;
 	}
 
-	res = vss->vtable->AddToSnapshotSet(vss, volume, (GUID){}, snapshot_id);
-	if (FAILED(res)) {
-		ERROR("IVssBackupComponents.AddToSnapshotSet() error: %x",
-		      (u32)res);
-		return false;
+	for (int i = 0; i < 26; i++) {
+		wchar_t volume[4];
+
+		if (!(volumes & (1U << i)))
+			continue;
+		wsprintf(volume, L"%lc:\\", L'A' + i);
+		res = vss->vtable->AddToSnapshotSet(vss, volume, (GUID){},
+						    &snapshot_ids[i]);
+		if (FAILED(res)) {
+			ERROR("IVssBackupComponents.AddToSnapshotSet() "
+			      "error for %ls: %x", volume, (u32)res);
+			return false;
+		}
 	}
 
 	res = vss->vtable->PrepareForBackup(vss, &async);
@@ -421,43 +438,48 @@ is_wow64(void)
 }
 
 /*
- * Create a VSS snapshot of the specified @volume.  Return the NT namespace path
- * to the snapshot root directory in @vss_path_ret and a handle to the snapshot
- * in @snapshot_ret.
+ * Resolve @source to an absolute path and return it in @abspath_ret, along with
+ * the index of its drive letter (0 for A:, 1 for B:, etc.) in @drive_ret.  The
+ * caller must FREE() the path.
  */
-int
-vss_create_snapshot(const wchar_t *source, UNICODE_STRING *vss_path_ret,
-		    struct vss_snapshot **snapshot_ret)
+static int
+get_source_volume(const wchar_t *source, wchar_t **abspath_ret, int *drive_ret)
 {
-	wchar_t *source_abspath;
-	wchar_t volume[4];
-	VSS_ID snapshot_id;
-	struct vss_snapshot_internal *snapshot = NULL;
-	IVssBackupComponents *vss;
-	HRESULT res;
-	int ret;
-
-	source_abspath = realpath(source, NULL);
-	if (!source_abspath) {
-		ret = WIMLIB_ERR_NOMEM;
-		goto err;
-	}
-
-	if (source_abspath[0] == L'\0' || source_abspath[1] != L':' ||
-	    source_abspath[2] != L'\\') {
+	wchar_t *abspath;
+	wchar_t letter;
+
+	abspath = realpath(source, NULL);
+	if (!abspath)
+		return WIMLIB_ERR_NOMEM;
+
+	letter = abspath[0];
+	if (letter >= L'a' && letter <= L'z')
+		letter -= L'a' - L'A';
+	if (letter < L'A' || letter > L'Z' || abspath[1] != L':' ||
+	    abspath[2] != L'\\') {
 		ERROR("\"%ls\" (full path \"%ls\"): Path format not recognized",
-		      source, source_abspath);
-		ret = WIMLIB_ERR_UNSUPPORTED;
-		goto err;
+		      source, abspath);
+		FREE(abspath);
+		return WIMLIB_ERR_UNSUPPORTED;
 	}
+	*abspath_ret = abspath;
+	*drive_ret = letter - L'A';
+	return 0;
+}
 
-	wsprintf(volume, L"%lc:\\", source_abspath[0]);
+/* Create a single VSS snapshot set containing the volumes in @volumes, a bitmask
+ * of drive letters.  */
+static int
+create_snapshot_set(u32 volumes, struct vss_snapshot_internal **snapshot_ret)
+{
+	struct vss_snapshot_internal *snapshot;
+	VSS_ID snapshot_ids[26];
+	IVssBackupComponents *vss;
+	HRESULT res;
 
 	snapshot = CALLOC(1, sizeof(*snapshot));
-	if (!snapshot) {
-		ret = WIMLIB_ERR_NOMEM;
-		goto err;
-	}
+	if (!snapshot)
+		return WIMLIB_ERR_NOMEM;
 
 	if (!vss_global_init())
 		goto vss_err;
@@ -470,56 +492,162 @@ vss_create_snapshot(const wchar_t *source, UNICODE_STRING *vss_path_ret,
 
 	snapshot->vss = vss;
 
-	if (!request_vss_snapshot(vss, volume, &snapshot_id))
+	if (!request_vss_snapshot(vss, volumes, snapshot_ids))
 		goto vss_err;
 
-	res = vss->vtable->GetSnapshotProperties(vss, snapshot_id, &snapshot->props);
-	if (FAILED(res)) {
-		ERROR("IVssBackupComponents.GetSnapshotProperties() error: %x",
-		      (u32)res);
-		goto vss_err;
+	for (int i = 0; i < 26; i++) {
+		VSS_SNAPSHOT_PROP *props = &snapshot->props[i];
+
+		if (!(volumes & (1U << i)))
+			continue;
+
+		res = vss->vtable->GetSnapshotProperties(vss, snapshot_ids[i],
+							 props);
+		if (FAILED(res)) {
+			ERROR("IVssBackupComponents.GetSnapshotProperties() "
+			      "error: %x", (u32)res);
+			goto vss_err;
+		}
+
+		if (wcsncmp(props->m_pwszSnapshotDeviceObject, L"\\\\?\\", 4)) {
+			ERROR("Unexpected volume shadow device path: %ls",
+			      props->m_pwszSnapshotDeviceObject);
+			goto vss_err;
+		}
 	}
 
-	if (wcsncmp(snapshot->props.m_pwszSnapshotDeviceObject, L"\\\\?\\", 4)) {
-		ERROR("Unexpected volume shadow device path: %ls",
-		      snapshot->props.m_pwszSnapshotDeviceObject);
-		goto vss_err;
+	snapshot->volumes = volumes;
+	snapshot->base.refcnt = 1;
+	*snapshot_ret = snapshot;
+	return 0;
+
+vss_err:
+	if (is_wow64()) {
+		ERROR("64-bit Windows doesn't allow 32-bit applications to "
+		      "create VSS snapshots.\n"
+		      "        Run the 64-bit version of this application "
+		      "instead.");
+	} else {
+		wchar_t letters[26 * 3 + 1];
+		wchar_t *p = letters;
+
+		for (int i = 0; i < 26; i++) {
+			if (volumes & (1U << i)) {
+				if (p != letters)
+					*p++ = L' ';
+				*p++ = L'A' + i;
+				*p++ = L':';
+			}
+		}
+		*p = L'\0';
+		ERROR("A problem occurred while creating a VSS snapshot of "
+		      "%ls\n"
+		      "        Aborting the operation.", letters);
 	}
+	vss_delete_snapshot(&snapshot->base);
+	return WIMLIB_ERR_SNAPSHOT_FAILURE;
+}
+
+/*
+ * Create one VSS snapshot set covering the volumes of all the sources of @cmds
+ * that are to be captured from a snapshot.  This lets the sources be captured
+ * consistently with each other, and it's much faster than snapshotting each
+ * source separately, since every snapshot set makes VSS freeze and thaw the
+ * writers.  The set is returned in @snapshot_ret, to be passed to
+ * vss_create_snapshot(); if fewer than two sources want a snapshot, no set is
+ * created and NULL is returned instead.
+ */
+int
+vss_create_snapshot_set(const struct wimlib_update_command *cmds,
+			size_t num_cmds, struct vss_snapshot **snapshot_ret)
+{
+	struct vss_snapshot_internal *snapshot;
+	size_t num_sources = 0;
+	u32 volumes = 0;
+	int ret;
+
+	*snapshot_ret = NULL;
+
+	for (size_t i = 0; i < num_cmds; i++) {
+		wchar_t *abspath;
+		int drive;
+
+		if (cmds[i].op != WIMLIB_UPDATE_OP_ADD ||
+		    !(cmds[i].add.add_flags & WIMLIB_ADD_FLAG_SNAPSHOT))
+			continue;
+		ret = get_source_volume(cmds[i].add.fs_source_path,
+					&abspath, &drive);
+		if (ret)
+			return ret;
+		FREE(abspath);
+		volumes |= 1U << drive;
+		num_sources++;
+	}
+
+	if (num_sources < 2)
+		return 0;
 
+	ret = create_snapshot_set(volumes, &snapshot);
+	if (ret)
+		return ret;
+	*snapshot_ret = &snapshot->base;
+	return 0;
+}
+
+/*
+ * Create a VSS snapshot of the volume containing @source.  Return the NT
+ * namespace path to @source within the snapshot in @vss_path_ret and a handle
+ * to the snapshot in @snapshot_ret.
+ *
+ * If @snapshot_set is not NULL and covers the volume, then no new snapshot is
+ * created; instead a new reference to @snapshot_set is returned.
+ */
+int
+vss_create_snapshot(const wchar_t *source, struct vss_snapshot *snapshot_set,
+		    UNICODE_STRING *vss_path_ret,
+		    struct vss_snapshot **snapshot_ret)
+{
+	wchar_t *source_abspath;
+	int drive;
+	struct vss_snapshot_internal *snapshot;
+	const wchar_t *device;
+	int ret;
+
+	ret = get_source_volume(source, &source_abspath, &drive);
+	if (ret)
+		return ret;
+
+	snapshot = NULL;
+	if (snapshot_set) {
+		snapshot = container_of(snapshot_set,
+					struct vss_snapshot_internal, base);
+		if (snapshot->volumes & (1U << drive))
+			vss_get_snapshot(&snapshot->base);
+		else
+			snapshot = NULL;
+	}
+	if (!snapshot) {
+		ret = create_snapshot_set(1U << drive, &snapshot);
+		if (ret)
+			goto out;
+	}
+
+	device = snapshot->props[drive].m_pwszSnapshotDeviceObject;
 	vss_path_ret->MaximumLength = sizeof(wchar_t) *
-		(wcslen(snapshot->props.m_pwszSnapshotDeviceObject) +
-		 1 + wcslen(&source_abspath[3]) + 1);
+		(wcslen(device) + 1 + wcslen(&source_abspath[3]) + 1);
 	vss_path_ret->Length = vss_path_ret->MaximumLength - sizeof(wchar_t);
 	vss_path_ret->Buffer = HeapAlloc(GetProcessHeap(), 0,
 					 vss_path_ret->MaximumLength);
 	if (!vss_path_ret->Buffer) {
+		vss_put_snapshot(&snapshot->base);
 		ret = WIMLIB_ERR_NOMEM;
-		goto err;
+		goto out;
 	}
 
 	wsprintf(vss_path_ret->Buffer, L"\\??\\%ls\\%ls",
-		 &snapshot->props.m_pwszSnapshotDeviceObject[4],
-		 &source_abspath[3]);
+		 &device[4], &source_abspath[3]);
 	*snapshot_ret = &snapshot->base;
-	snapshot->base.refcnt = 1;
 	ret = 0;
-	goto out;
-
-vss_err:
-	ret = WIMLIB_ERR_SNAPSHOT_FAILURE;
-	if (is_wow64()) {
-		ERROR("64-bit Windows doesn't allow 32-bit applications to "
-		      "create VSS snapshots.\n"
-		      "        Run the 64-bit version of this application "
-		      "instead.");
-	} else {
-		ERROR("A problem occurred while creating a VSS snapshot of "
-		      "\"%ls\".\n"
-		      "        Aborting the operation.", volume);
-	}
-err:
-	if (snapshot)
-		vss_delete_snapshot(&snapshot->base);
 out:
 	FREE(source_abspath);
 	return ret;
@@ -39,8 +39,11 @@
 
 #include "wimlib/alloca.h"
 #include "wimlib/assert.h"
+#include "wimlib/bitops.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
 #include "wimlib/chunk_compressor.h"
+#include "wimlib/delta.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
@@ -51,9 +54,14 @@
 #include "wimlib/paths.h"
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
+#include "wimlib/shared_chunk_cache.h"
 #include "wimlib/solid.h"
+#include "wimlib/stats.h"
+#include "wimlib/thread_pool.h"
+#include "wimlib/threads.h"
 #include "wimlib/win32.h" /* win32_rename_replacement() */
 #include "wimlib/write.h"
+#include "wimlib/write_checkpoint.h"
 #include "wimlib/xml.h"
 
 
@@ -63,6 +71,9 @@
 #define WRITE_RESOURCE_FLAG_SOLID		0x00000004
 #define WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE	0x00000008
 #define WRITE_RESOURCE_FLAG_SOLID_SORT		0x00000010
+#define WRITE_RESOURCE_FLAG_MULTI_CANDIDATE	0x00000020
+#define WRITE_RESOURCE_FLAG_SOLID_SORT_BY_CONTENT	0x00000040
+#define WRITE_RESOURCE_FLAG_SOLID_PER_BLOB	0x00000080
 
 static int
 write_flags_to_resource_flags(int write_flags)
@@ -84,7 +95,15 @@ write_flags_to_resource_flags(int write_flags)
 	if ((write_flags & (WIMLIB_WRITE_FLAG_SOLID |
 			    WIMLIB_WRITE_FLAG_NO_SOLID_SORT)) ==
 	    WIMLIB_WRITE_FLAG_SOLID)
+	{
 		write_resource_flags |= WRITE_RESOURCE_FLAG_SOLID_SORT;
+		if (write_flags & WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT)
+			write_resource_flags |=
+				WRITE_RESOURCE_FLAG_SOLID_SORT_BY_CONTENT;
+	}
+
+	if (write_flags & WIMLIB_WRITE_FLAG_MULTI_CANDIDATE)
+		write_resource_flags |= WRITE_RESOURCE_FLAG_MULTI_CANDIDATE;
 
 	return write_resource_flags;
 }
@@ -119,15 +138,19 @@ blob_filtered(const struct blob_descriptor *blob,
 	wim = ctx->wim;
 
 	if (write_flags & WIMLIB_WRITE_FLAG_APPEND &&
-	    blob->blob_location == BLOB_IN_WIM &&
-	    blob->rdesc->wim == wim)
+	    blob_is_in_wim(blob, wim))
 		return 1;
 
 	if (write_flags & WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS &&
-	    blob->blob_location == BLOB_IN_WIM &&
+	    (blob->blob_location == BLOB_IN_WIM ||
+	     blob->blob_location == BLOB_IN_WIM_DELTA) &&
 	    blob->rdesc->wim != wim)
 		return -1;
 
+	if (write_flags & WIMLIB_WRITE_FLAG_BLOB_STORE_PACK &&
+	    blob->in_blob_store)
+		return -1;
+
 	return 0;
 }
 
@@ -147,7 +170,8 @@ may_soft_filter_blobs(const struct filter_context *ctx)
 static inline bool
 may_hard_filter_blobs(const struct filter_context *ctx)
 {
-	return ctx && (ctx->write_flags & WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS);
+	return ctx && (ctx->write_flags & (WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS |
+					   WIMLIB_WRITE_FLAG_BLOB_STORE_PACK));
 }
 
 static inline bool
@@ -179,10 +203,23 @@ can_raw_copy(const struct blob_descriptor *blob, int write_resource_flags,
 	if (rdesc->wim->being_compacted)
 		return true;
 
-	/* Otherwise, only reuse compressed resources.  */
-	if (out_ctype == WIMLIB_COMPRESSION_TYPE_NONE ||
-	    !(rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+	/* An uncompressed resource in a WIM file that uses the desired
+	 * compression type and chunk size was stored uncompressed because
+	 * compressing it didn't help, so compressing it again would just waste
+	 * time.  This is typically the case when joining a split WIM.  */
+	if (!(rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
 			      WIM_RESHDR_FLAG_SOLID)))
+	{
+		return out_ctype != WIMLIB_COMPRESSION_TYPE_NONE &&
+		       !(write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) &&
+		       rdesc->is_pipable ==
+				!!(write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE) &&
+		       rdesc->wim->compression_type == out_ctype &&
+		       rdesc->wim->chunk_size == out_chunk_size;
+	}
+
+	/* Otherwise, only reuse compressed resources.  */
+	if (out_ctype == WIMLIB_COMPRESSION_TYPE_NONE)
 		return false;
 
 	/* When writing a pipable WIM, we can only reuse pipable resources; and
@@ -248,6 +285,11 @@ blob_set_out_reshdr_for_reuse(struct blob_descriptor *blob)
 {
 	const struct wim_resource_descriptor *rdesc;
 
+	if (blob->blob_location == BLOB_IN_WIM_DELTA) {
+		delta_blob_get_reshdr(blob, &blob->out_reshdr);
+		return;
+	}
+
 	wimlib_assert(blob->blob_location == BLOB_IN_WIM);
 	rdesc = blob->rdesc;
 
@@ -360,6 +402,10 @@ struct write_blobs_ctx {
 
 	struct filter_context *filter_ctx;
 
+	/* If not NULL, the checkpoint in which to record each blob once its
+	 * data has been written; see WIMLIB_WRITE_FLAG_RESUMABLE.  */
+	struct write_checkpoint *checkpoint;
+
 	/* Pointer to the chunk_compressor implementation being used for
 	 * compressing chunks of data, or NULL if chunks are being written
 	 * uncompressed.  */
@@ -399,8 +445,49 @@ struct write_blobs_ctx {
 	/* Offset in the output file of the start of the chunks of the resource
 	 * currently being written.  */
 	u64 chunks_start_offset;
+
+	/* Set if write_blob_by_copy() found that the kernel can't copy data
+	 * from the files being captured to the output file.  */
+	bool copy_range_unsupported;
 };
 
+/* Return true if the resources being written have chunk tables in the format
+ * used by solid resources: preceded by a header and with one entry per chunk,
+ * giving the chunk's compressed size.  */
+static inline bool
+has_solid_chunk_table(const struct write_blobs_ctx *ctx)
+{
+	return ctx->write_resource_flags & (WRITE_RESOURCE_FLAG_SOLID |
+					    WRITE_RESOURCE_FLAG_SOLID_PER_BLOB);
+}
+
+/* Record in the checkpoint, if there is one, that the data of @blob has been
+ * written completely and where.  */
+static int
+checkpoint_blob(struct write_blobs_ctx *ctx, const struct blob_descriptor *blob)
+{
+	if (!ctx->checkpoint)
+		return 0;
+	return write_checkpoint_add_blob(ctx->checkpoint, blob, ctx->out_fd);
+}
+
+/* Like checkpoint_blob(), but for each blob in @blob_list.  */
+static int
+checkpoint_blobs(struct write_blobs_ctx *ctx, struct list_head *blob_list)
+{
+	struct blob_descriptor *blob;
+	int ret;
+
+	if (!ctx->checkpoint)
+		return 0;
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		ret = checkpoint_blob(ctx, blob);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 /* Reserve space for the chunk table and prepare to accumulate the chunk table
  * in memory.  */
 static int
@@ -418,7 +505,7 @@ begin_chunk_table(struct write_blobs_ctx *ctx, u64 res_expected_size)
 	 * decreasing the number of chunk entries needed.  */
 	expected_num_chunks = DIV_ROUND_UP(res_expected_size, ctx->out_chunk_size);
 	expected_num_chunk_entries = expected_num_chunks;
-	if (!(ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID))
+	if (!has_solid_chunk_table(ctx))
 		expected_num_chunk_entries--;
 
 	/* Make sure the chunk_csizes array is long enough to store the
@@ -452,9 +539,8 @@ begin_chunk_table(struct write_blobs_ctx *ctx, u64 res_expected_size)
 		 * are unknown.  */
 		reserve_size = expected_num_chunk_entries *
 			       get_chunk_entry_size(res_expected_size,
-						    0 != (ctx->write_resource_flags &
-							  WRITE_RESOURCE_FLAG_SOLID));
-		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID)
+						    has_solid_chunk_table(ctx));
+		if (has_solid_chunk_table(ctx))
 			reserve_size += sizeof(struct alt_chunk_table_header_disk);
 		memset(ctx->chunk_csizes, 0, reserve_size);
 		ret = full_write(ctx->out_fd, ctx->chunk_csizes, reserve_size);
@@ -499,12 +585,11 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 
 	actual_num_chunks = ctx->chunk_index;
 	actual_num_chunk_entries = actual_num_chunks;
-	if (!(ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID))
+	if (!has_solid_chunk_table(ctx))
 		actual_num_chunk_entries--;
 
 	chunk_entry_size = get_chunk_entry_size(res_actual_size,
-						0 != (ctx->write_resource_flags &
-						      WRITE_RESOURCE_FLAG_SOLID));
+						has_solid_chunk_table(ctx));
 
 	typedef le64 __attribute__((may_alias)) aliased_le64_t;
 	typedef le32 __attribute__((may_alias)) aliased_le32_t;
@@ -512,7 +597,7 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 	if (chunk_entry_size == 4) {
 		aliased_le32_t *entries = (aliased_le32_t*)ctx->chunk_csizes;
 
-		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
+		if (has_solid_chunk_table(ctx)) {
 			for (size_t i = 0; i < actual_num_chunk_entries; i++)
 				entries[i] = cpu_to_le32(ctx->chunk_csizes[i]);
 		} else {
@@ -526,7 +611,7 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 	} else {
 		aliased_le64_t *entries = (aliased_le64_t*)ctx->chunk_csizes;
 
-		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
+		if (has_solid_chunk_table(ctx)) {
 			for (size_t i = 0; i < actual_num_chunk_entries; i++)
 				entries[i] = cpu_to_le64(ctx->chunk_csizes[i]);
 		} else {
@@ -556,7 +641,7 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 
 		chunk_table_offset = ctx->chunks_start_offset - chunk_table_size;
 
-		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
+		if (has_solid_chunk_table(ctx)) {
 			struct alt_chunk_table_header_disk hdr;
 
 			hdr.res_usize = cpu_to_le64(res_actual_size);
@@ -677,6 +762,97 @@ done_with_blob(struct blob_descriptor *blob, struct write_blobs_ctx *ctx)
 				 ctx->progress_data.progctx);
 }
 
+/*
+ * When writing uncompressed non-solid resources, try to write a blob located in
+ * a file on disk by having the kernel copy its data into the output WIM file,
+ * which with copy_file_range() keeps the data out of user space and may even
+ * share it between the files.  The SHA-1 message digest is computed by reading
+ * back the data just written, which normally is still in the page cache, so
+ * that it always matches the data actually in the WIM file even if the file
+ * being captured is modified concurrently.
+ *
+ * Returns BEGIN_BLOB_STATUS_SKIP_BLOB if the blob was written this way, or 0 if
+ * it still needs to be written normally.
+ */
+static int
+write_blob_by_copy(struct write_blobs_ctx *ctx, struct blob_descriptor *blob)
+{
+	struct filedes *out_fd = ctx->out_fd;
+	u64 begin_offset = out_fd->offset;
+	struct sha1_ctx sha_ctx;
+	u8 hash[SHA1_HASH_SIZE];
+	u8 buf[BUFFER_SIZE];
+	size_t n;
+	int ret;
+
+	if (ctx->compressor != NULL ||
+	    (ctx->write_resource_flags & (WRITE_RESOURCE_FLAG_PIPABLE |
+					  WRITE_RESOURCE_FLAG_SOLID |
+					  WRITE_RESOURCE_FLAG_SOLID_PER_BLOB)) ||
+	    blob->blob_location != BLOB_IN_FILE_ON_DISK ||
+	    ctx->copy_range_unsupported)
+		return 0;
+
+	if (copy_file_on_disk_range(blob, out_fd) != blob->size) {
+		/* Don't keep trying if the kernel can't copy the data at all,
+		 * for example because the files are on different
+		 * filesystems.  */
+		if (out_fd->offset == begin_offset)
+			ctx->copy_range_unsupported = true;
+		goto fall_back;
+	}
+
+	sha1_init(&sha_ctx);
+	for (u64 offset = 0; offset < blob->size; offset += n) {
+		n = min(blob->size - offset, sizeof(buf));
+		if (full_pread(out_fd, buf, n, begin_offset + offset))
+			goto fall_back;
+		sha1_update(&sha_ctx, buf, n);
+	}
+	sha1_final(&sha_ctx, hash);
+
+	/* Like write_blob_end_read(), turn an unhashed blob into a hashed one.
+	 * If the blob was already hashed but the data doesn't match, leave it
+	 * to the normal write path to report the problem.  */
+	if (blob->unhashed) {
+		copy_hash(blob->hash, hash);
+		if (ctx->blob_table != NULL) {
+			blob_hash_computed(blob);
+			list_del(&blob->unhashed_list);
+			blob_table_insert(ctx->blob_table, blob);
+			blob->unhashed = 0;
+		}
+	} else if (!hashes_equal(hash, blob->hash)) {
+		goto fall_back;
+	}
+
+	blob->out_reshdr.offset_in_wim = begin_offset;
+	blob->out_reshdr.size_in_wim = blob->size;
+	blob->out_reshdr.uncompressed_size = blob->size;
+	blob->out_reshdr.flags = reshdr_flags_for_blob(blob);
+	list_del(&blob->write_blobs_list);
+
+	ret = checkpoint_blob(ctx, blob);
+	if (!ret)
+		ret = do_write_blobs_progress(&ctx->progress_data, blob->size,
+					      blob->size, 1, false);
+	if (!ret)
+		ret = done_with_blob(blob, ctx);
+	if (ret)
+		return ret;
+	return BEGIN_BLOB_STATUS_SKIP_BLOB;
+
+fall_back:
+	/* Anything copied will be overwritten by the normal write.  */
+	if (out_fd->offset != begin_offset &&
+	    filedes_seek(out_fd, begin_offset) == -1)
+	{
+		ERROR_WITH_ERRNO("Error seeking in WIM file");
+		return WIMLIB_ERR_WRITE;
+	}
+	return 0;
+}
+
 /* Begin processing a blob for writing.  */
 static int
 write_blob_begin_read(struct blob_descriptor *blob, void *_ctx)
@@ -751,6 +927,11 @@ write_blob_begin_read(struct blob_descriptor *blob, void *_ctx)
 			}
 		}
 	}
+
+	ret = write_blob_by_copy(ctx, blob);
+	if (ret)
+		return ret;
+
 	list_move_tail(&blob->write_blobs_list, &ctx->blobs_being_compressed);
 	return 0;
 }
@@ -864,6 +1045,22 @@ maybe_rewrite_blob_uncompressed(struct write_blobs_ctx *ctx,
 	return write_blob_uncompressed(blob, ctx->out_fd);
 }
 
+/* For WRITE_RESOURCE_FLAG_SOLID_PER_BLOB: the blob's @out_reshdr, which
+ * currently describes the resource just written, is changed to describe the
+ * blob as the only blob in that solid resource.  */
+static void
+set_solid_reshdr_for_single_blob(struct blob_descriptor *blob)
+{
+	blob->out_res_offset_in_wim = blob->out_reshdr.offset_in_wim;
+	blob->out_res_size_in_wim = blob->out_reshdr.size_in_wim;
+	blob->out_res_uncompressed_size = blob->out_reshdr.uncompressed_size;
+	blob->out_reshdr.offset_in_wim = 0;
+	blob->out_reshdr.size_in_wim = blob->size;
+	blob->out_reshdr.uncompressed_size = 0;
+	blob->out_reshdr.flags = reshdr_flags_for_blob(blob) |
+				 WIM_RESHDR_FLAG_SOLID;
+}
+
 /* Write the next chunk of (typically compressed) data to the output WIM,
  * handling the writing of the chunk table.  */
 static int
@@ -955,18 +1152,27 @@ write_chunk(struct write_blobs_ctx *ctx, const void *cchunk,
 			if (ret)
 				return ret;
 
-			blob->out_reshdr.flags = reshdr_flags_for_blob(blob);
-			if (ctx->compressor != NULL)
-				blob->out_reshdr.flags |= WIM_RESHDR_FLAG_COMPRESSED;
+			if (ctx->write_resource_flags &
+			    WRITE_RESOURCE_FLAG_SOLID_PER_BLOB) {
+				set_solid_reshdr_for_single_blob(blob);
+			} else {
+				blob->out_reshdr.flags = reshdr_flags_for_blob(blob);
+				if (ctx->compressor != NULL)
+					blob->out_reshdr.flags |= WIM_RESHDR_FLAG_COMPRESSED;
 
-			ret = maybe_rewrite_blob_uncompressed(ctx, blob);
-			if (ret)
-				return ret;
+				ret = maybe_rewrite_blob_uncompressed(ctx, blob);
+				if (ret)
+					return ret;
 
-			wimlib_assert(blob->out_reshdr.uncompressed_size == blob->size);
+				wimlib_assert(blob->out_reshdr.uncompressed_size ==
+					      blob->size);
+			}
 
 			ctx->cur_write_blob_offset = 0;
 
+			ret = checkpoint_blob(ctx, blob);
+			if (ret)
+				return ret;
 			ret = done_with_blob(blob, ctx);
 			if (ret)
 				return ret;
@@ -1001,7 +1207,10 @@ prepare_chunk_buffer(struct write_blobs_ctx *ctx)
 							       &cchunk,
 							       &csize,
 							       &usize);
-		wimlib_assert(bret);
+		/* No chunk buffer was available even though no chunks are
+		 * being compressed; this can only mean out of memory.  */
+		if (unlikely(!bret))
+			return WIMLIB_ERR_NOMEM;
 
 		ret = write_chunk(ctx, cchunk, csize, usize);
 		if (ret)
@@ -1098,6 +1307,7 @@ write_blob_end_read(struct blob_descriptor *blob, int status, void *_ctx)
 		 * Since we passed COMPUTE_MISSING_BLOB_HASHES to
 		 * read_blob_list(), blob->hash is now computed and valid.  So
 		 * turn this blob into a "hashed" blob.  */
+		blob_hash_computed(blob);
 		list_del(&blob->unhashed_list);
 		blob_table_insert(ctx->blob_table, blob);
 		blob->unhashed = 0;
@@ -1195,6 +1405,78 @@ find_raw_copy_blobs(struct list_head *blob_list, int write_resource_flags,
 	return num_nonraw_bytes;
 }
 
+/* Copy @size bytes of raw data at @offset in the WIM file open on @in_fd to the
+ * WIM file being written.  If possible, the kernel copies the data itself or
+ * shares it between the files.  */
+static int
+copy_raw_data(struct filedes *in_fd, u64 offset, u64 size,
+	      struct filedes *out_fd)
+{
+	u8 buf[BUFFER_SIZE];
+	size_t bytes_to_read;
+	const void *mapped;
+	u64 copied;
+	int ret;
+
+	copied = filedes_copy_range(in_fd, offset, out_fd, size);
+	offset += copied;
+	size -= copied;
+	if (size == 0)
+		return 0;
+
+	/* If the input WIM is mapped into memory, write the data directly from
+	 * the mapping.  */
+	mapped = filedes_mapped_range(in_fd, offset, size);
+	if (mapped) {
+		ret = full_write(out_fd, mapped, size);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing raw data to WIM file");
+			return ret;
+		}
+		return 0;
+	}
+
+	while (size) {
+		bytes_to_read = min(sizeof(buf), size);
+
+		ret = full_pread(in_fd, buf, bytes_to_read, offset);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error reading raw data from WIM file");
+			return ret;
+		}
+
+		ret = full_write(out_fd, buf, bytes_to_read);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing raw data to WIM file");
+			return ret;
+		}
+
+		offset += bytes_to_read;
+		size -= bytes_to_read;
+	}
+	return 0;
+}
+
+/* Record that the raw data of @in_rdesc has been copied to @out_offset_in_wim
+ * in the WIM file being written.  */
+static void
+set_raw_copy_out_offset(struct wim_resource_descriptor *in_rdesc,
+			u64 out_offset_in_wim)
+{
+	struct blob_descriptor *blob;
+
+	list_for_each_entry(blob, &in_rdesc->blob_list, rdesc_node) {
+		if (blob->will_be_in_output_wim) {
+			blob_set_out_reshdr_for_reuse(blob);
+			if (in_rdesc->flags & WIM_RESHDR_FLAG_SOLID)
+				blob->out_res_offset_in_wim = out_offset_in_wim;
+			else
+				blob->out_reshdr.offset_in_wim = out_offset_in_wim;
+
+		}
+	}
+}
+
 /* Copy a raw compressed resource located in another WIM file to the WIM file
  * being written.  */
 static int
@@ -1203,11 +1485,7 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 {
 	u64 cur_read_offset;
 	u64 end_read_offset;
-	u8 buf[BUFFER_SIZE];
-	size_t bytes_to_read;
 	int ret;
-	struct filedes *in_fd;
-	struct blob_descriptor *blob;
 	u64 out_offset_in_wim;
 
 	/* Copy the raw data.  */
@@ -1222,33 +1500,14 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 		cur_read_offset -= sizeof(struct pwm_blob_hdr);
 		out_offset_in_wim += sizeof(struct pwm_blob_hdr);
 	}
-	in_fd = &in_rdesc->wim->in_fd;
 	wimlib_assert(cur_read_offset != end_read_offset);
 
 	if (likely(!in_rdesc->wim->being_compacted) ||
 	    in_rdesc->offset_in_wim > out_fd->offset) {
-		do {
-			bytes_to_read = min(sizeof(buf),
-					    end_read_offset - cur_read_offset);
-
-			ret = full_pread(in_fd, buf, bytes_to_read,
-					 cur_read_offset);
-			if (ret) {
-				ERROR_WITH_ERRNO("Error reading raw data "
-						 "from WIM file");
-				return ret;
-			}
-
-			ret = full_write(out_fd, buf, bytes_to_read);
-			if (ret) {
-				ERROR_WITH_ERRNO("Error writing raw data "
-						 "to WIM file");
-				return ret;
-			}
-
-			cur_read_offset += bytes_to_read;
-
-		} while (cur_read_offset != end_read_offset);
+		ret = copy_raw_data(&in_rdesc->wim->in_fd, cur_read_offset,
+				    end_read_offset - cur_read_offset, out_fd);
+		if (ret)
+			return ret;
 	} else {
 		/* Optimization: the WIM file is being compacted and the
 		 * resource being written is already in the desired location.
@@ -1262,16 +1521,112 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 			return WIMLIB_ERR_WRITE;
 	}
 
-	list_for_each_entry(blob, &in_rdesc->blob_list, rdesc_node) {
-		if (blob->will_be_in_output_wim) {
-			blob_set_out_reshdr_for_reuse(blob);
-			if (in_rdesc->flags & WIM_RESHDR_FLAG_SOLID)
-				blob->out_res_offset_in_wim = out_offset_in_wim;
-			else
-				blob->out_reshdr.offset_in_wim = out_offset_in_wim;
+	set_raw_copy_out_offset(in_rdesc, out_offset_in_wim);
+	return 0;
+}
 
-		}
+/*
+ * Extend the run of raw resources to copy that begins with the resource of
+ * @first_blob over the resources of the following blobs in @raw_copy_blobs for
+ * as long as they directly follow it in the same WIM file, and return the end
+ * offset of the run.  Copying adjacent resources as one range means that when
+ * exporting images, the data is normally copied in a few large ranges, which
+ * the kernel may be able to copy or share between the files itself.  The
+ * resources in the run get their raw_copy_ok flag cleared.
+ */
+static u64
+extend_raw_copy_run(struct blob_descriptor *first_blob,
+		    struct list_head *raw_copy_blobs)
+{
+	struct wim_resource_descriptor *rdesc = first_blob->rdesc;
+	struct blob_descriptor *blob;
+	u64 end;
+
+	rdesc->raw_copy_ok = 0;
+	end = rdesc->offset_in_wim + rdesc->size_in_wim;
+	blob = first_blob;
+	list_for_each_entry_continue(blob, raw_copy_blobs, write_blobs_list) {
+		struct wim_resource_descriptor *next_rdesc = blob->rdesc;
+
+		/* Skip other blobs in a solid resource already in the run. */
+		if (!next_rdesc->raw_copy_ok)
+			continue;
+		if (next_rdesc->wim != rdesc->wim ||
+		    next_rdesc->is_pipable ||
+		    next_rdesc->offset_in_wim != end)
+			break;
+		next_rdesc->raw_copy_ok = 0;
+		end += next_rdesc->size_in_wim;
+	}
+	return end;
+}
+
+/*
+ * Set the output offsets of all the resources in the run that begins with the
+ * resource of @first_blob and covers [@start, @end) in its WIM file, given that
+ * the run is copied to @out_offset.  The resources in the run are the ones from
+ * the same WIM file in the copied range; blobs whose resources were copied
+ * earlier may be interspersed, but they can't overlap the range.
+ */
+static void
+set_raw_copy_run_out_offsets(struct blob_descriptor *first_blob,
+			     struct list_head *raw_copy_blobs,
+			     u64 start, u64 end, u64 out_offset)
+{
+	const struct wim_resource_descriptor *rdesc = first_blob->rdesc;
+	const struct wim_resource_descriptor *prev_rdesc = NULL;
+	struct blob_descriptor *blob = first_blob;
+
+	list_for_each_entry_from(blob, raw_copy_blobs, write_blobs_list) {
+		struct wim_resource_descriptor *next_rdesc = blob->rdesc;
+
+		if (next_rdesc->raw_copy_ok)
+			break;
+		if (next_rdesc != prev_rdesc && next_rdesc->wim == rdesc->wim &&
+		    next_rdesc->offset_in_wim >= start &&
+		    next_rdesc->offset_in_wim < end)
+			set_raw_copy_out_offset(next_rdesc, out_offset +
+					       (next_rdesc->offset_in_wim - start));
+		prev_rdesc = next_rdesc;
+	}
+}
+
+/*
+ * Copy the raw resource of @first_blob, along with the resources of the
+ * following blobs in @raw_copy_blobs for as long as they directly follow it in
+ * the same WIM file, to the WIM file being written.  The resources copied get
+ * their raw_copy_ok flag cleared, and their total size is returned in
+ * *@size_ret.
+ */
+static int
+write_raw_copy_run(struct blob_descriptor *first_blob,
+		   struct list_head *raw_copy_blobs, struct filedes *out_fd,
+		   u64 *size_ret)
+{
+	struct wim_resource_descriptor *rdesc = first_blob->rdesc;
+	u64 start, end, out_offset;
+	int ret;
+
+	/* Pipable resources have a header before each resource, and a WIM
+	 * being compacted may already have resources in place; copy these one
+	 * at a time.  */
+	if (rdesc->is_pipable || rdesc->wim->being_compacted) {
+		rdesc->raw_copy_ok = 0;
+		*size_ret = rdesc->size_in_wim;
+		return write_raw_copy_resource(rdesc, out_fd);
 	}
+
+	start = rdesc->offset_in_wim;
+	end = extend_raw_copy_run(first_blob, raw_copy_blobs);
+	*size_ret = end - start;
+
+	out_offset = out_fd->offset;
+	ret = copy_raw_data(&rdesc->wim->in_fd, start, end - start, out_fd);
+	if (ret)
+		return ret;
+
+	set_raw_copy_run_out_offsets(first_blob, raw_copy_blobs, start, end,
+				     out_offset);
 	return 0;
 }
 
@@ -1292,12 +1647,12 @@ write_raw_copy_resources(struct list_head *raw_copy_blobs,
 		u64 compressed_size = 0;
 
 		if (blob->rdesc->raw_copy_ok) {
-			/* Write each solid resource only one time.  */
-			ret = write_raw_copy_resource(blob->rdesc, out_fd);
+			/* Write each solid resource only one time, and
+			 * together with any resources directly following it. */
+			ret = write_raw_copy_run(blob, raw_copy_blobs, out_fd,
+						 &compressed_size);
 			if (ret)
 				return ret;
-			blob->rdesc->raw_copy_ok = 0;
-			compressed_size = blob->rdesc->size_in_wim;
 		}
 		ret = do_write_blobs_progress(progress_data, blob->size,
 					      compressed_size, 1, false);
@@ -1307,74 +1662,802 @@ write_raw_copy_resources(struct list_head *raw_copy_blobs,
 	return 0;
 }
 
-/* Wait for and write all chunks pending in the compressor.  */
+/* Don't bother copying raw resources in a separate thread if there is less
+ * than this much of them.  */
+#define MIN_CONCURRENT_RAW_COPY_SIZE	2000000
+
+struct raw_copy_range {
+	struct filedes *in_fd;
+	u64 in_offset;
+	u64 out_offset;
+	u64 size;
+};
+
+/* A thread which copies raw resources to the WIM file being written while the
+ * main thread compresses and writes the other blobs after them.  */
+struct raw_copy_thread {
+	struct thread thread;
+	bool started;
+	struct raw_copy_range *ranges;
+	size_t num_ranges;
+	u64 total_size;
+
+	/* The output file descriptor without the main thread's write buffer
+	 * and file position, which aren't safe to use from this thread.  */
+	struct filedes out_fd;
+	int ret;
+};
+
+/* Like copy_raw_data(), but copy the data to @out_offset rather than to the
+ * current position of @out_fd.  */
 static int
-finish_remaining_chunks(struct write_blobs_ctx *ctx)
+copy_raw_data_at(struct filedes *in_fd, u64 offset, u64 size,
+		 struct filedes *out_fd, u64 out_offset)
 {
-	const void *cdata;
-	u32 csize;
-	u32 usize;
+	u8 buf[BUFFER_SIZE];
+	size_t bytes_to_read;
+	const void *mapped;
+	u64 copied;
 	int ret;
 
-	if (ctx->compressor == NULL)
+	copied = filedes_copy_range_at(in_fd, offset, out_fd, out_offset, size);
+	offset += copied;
+	out_offset += copied;
+	size -= copied;
+	if (size == 0)
 		return 0;
 
-	if (ctx->cur_chunk_buf_filled != 0) {
-		ctx->compressor->signal_chunk_filled(ctx->compressor,
-						     ctx->cur_chunk_buf_filled);
+	mapped = filedes_mapped_range(in_fd, offset, size);
+	if (mapped) {
+		ret = full_pwrite(out_fd, mapped, size, out_offset);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing raw data to WIM file");
+			return ret;
+		}
+		return 0;
 	}
 
-	while (ctx->compressor->get_compression_result(ctx->compressor, &cdata,
-						       &csize, &usize))
-	{
-		ret = write_chunk(ctx, cdata, csize, usize);
-		if (ret)
+	while (size) {
+		bytes_to_read = min(sizeof(buf), size);
+
+		ret = full_pread(in_fd, buf, bytes_to_read, offset);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error reading raw data from WIM file");
+			return ret;
+		}
+
+		ret = full_pwrite(out_fd, buf, bytes_to_read, out_offset);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing raw data to WIM file");
 			return ret;
+		}
+
+		offset += bytes_to_read;
+		out_offset += bytes_to_read;
+		size -= bytes_to_read;
 	}
 	return 0;
 }
 
-static void
-validate_blob_list(struct list_head *blob_list)
+static void *
+raw_copy_thread_proc(void *_t)
 {
-	struct blob_descriptor *blob;
+	struct raw_copy_thread *t = _t;
 
-	list_for_each_entry(blob, blob_list, write_blobs_list) {
-		wimlib_assert(blob->will_be_in_output_wim);
-		wimlib_assert(blob->size != 0);
+	for (size_t i = 0; i < t->num_ranges && !t->ret; i++) {
+		const struct raw_copy_range *range = &t->ranges[i];
+
+		t->ret = copy_raw_data_at(range->in_fd, range->in_offset,
+					  range->size, &t->out_fd,
+					  range->out_offset);
 	}
+	return NULL;
 }
 
-static void
-init_done_with_file_info(struct list_head *blob_list)
+/*
+ * Can the resources on @raw_copy_blobs be copied by a separate thread while
+ * @num_nonraw_bytes of other data are compressed?  This requires that the
+ * output be a regular file which no one else observes the writes to (as the
+ * integrity table hasher does), and that the copies be plain ranges of files
+ * that can be read from multiple threads.
+ */
+static bool
+can_raw_copy_concurrently(struct list_head *raw_copy_blobs,
+			  struct filedes *out_fd, int write_resource_flags,
+			  u64 num_nonraw_bytes)
 {
 	struct blob_descriptor *blob;
+	u64 raw_size = 0;
 
-	list_for_each_entry(blob, blob_list, write_blobs_list) {
-		if (blob_is_in_file(blob)) {
-			blob->file_inode->i_num_remaining_streams = 0;
-			blob->may_send_done_with_file = 1;
-		} else {
-			blob->may_send_done_with_file = 0;
-		}
-	}
+	if (num_nonraw_bytes == 0 || list_empty(raw_copy_blobs) ||
+	    (write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE) ||
+	    out_fd->is_pipe || out_fd->reader || out_fd->write_hook ||
+	    out_fd->uncached)
+		return false;
 
-	list_for_each_entry(blob, blob_list, write_blobs_list)
-		if (blob->may_send_done_with_file)
-			blob->file_inode->i_num_remaining_streams++;
+	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list) {
+		const struct wim_resource_descriptor *rdesc = blob->rdesc;
+
+		if (rdesc->is_pipable || rdesc->wim->being_compacted ||
+		    rdesc->wim->in_fd.is_pipe || rdesc->wim->in_fd.reader)
+			return false;
+		raw_size += blob->size;
+	}
+	return raw_size >= MIN_CONCURRENT_RAW_COPY_SIZE;
 }
 
 /*
- * Write a list of blobs to the output WIM file.
- *
- * @blob_list
- *	The list of blobs to write, specified by a list of 'struct blob_descriptor' linked
- *	by the 'write_blobs_list' member.
- *
- * @out_fd
- *	The file descriptor, opened for writing, to which to write the blobs.
- *
- * @write_resource_flags
+ * Lay out the resources on @raw_copy_blobs at the current position of @out_fd,
+ * move @out_fd past them, and start a thread that copies them there.  If the
+ * thread can't be started, the data is copied before returning.
+ */
+static int
+start_raw_copy_thread(struct raw_copy_thread *t,
+		      struct list_head *raw_copy_blobs, struct filedes *out_fd)
+{
+	struct blob_descriptor *blob;
+	size_t max_ranges = 0;
+	u64 out_offset;
+
+	memset(t, 0, sizeof(*t));
+
+	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list) {
+		blob->rdesc->raw_copy_ok = 1;
+		max_ranges++;
+	}
+	t->ranges = MALLOC(max_ranges * sizeof(t->ranges[0]));
+	if (!t->ranges)
+		return WIMLIB_ERR_NOMEM;
+
+	out_offset = out_fd->offset;
+	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list) {
+		struct wim_resource_descriptor *rdesc = blob->rdesc;
+		struct raw_copy_range *range;
+		u64 start, end;
+
+		if (!rdesc->raw_copy_ok)
+			continue;
+		start = rdesc->offset_in_wim;
+		end = extend_raw_copy_run(blob, raw_copy_blobs);
+		set_raw_copy_run_out_offsets(blob, raw_copy_blobs, start, end,
+					     out_offset);
+		range = &t->ranges[t->num_ranges++];
+		range->in_fd = &rdesc->wim->in_fd;
+		range->in_offset = start;
+		range->out_offset = out_offset;
+		range->size = end - start;
+		out_offset += end - start;
+	}
+	t->total_size = out_offset - out_fd->offset;
+
+	if (filedes_seek(out_fd, out_offset) == -1) {
+		ERROR_WITH_ERRNO("Error seeking in WIM file");
+		return WIMLIB_ERR_WRITE;
+	}
+
+	filedes_init(&t->out_fd, out_fd->fd);
+	t->started = thread_create(&t->thread, raw_copy_thread_proc, t);
+	if (!t->started)
+		raw_copy_thread_proc(t);
+	return t->ret;
+}
+
+/* Wait for the raw copy thread to finish, and return its result.  */
+static int
+stop_raw_copy_thread(struct raw_copy_thread *t)
+{
+	if (t->started)
+		thread_join(&t->thread);
+	t->started = false;
+	FREE(t->ranges);
+	t->ranges = NULL;
+	return t->ret;
+}
+
+/* Report the progress of the blobs copied by the raw copy thread.  */
+static int
+raw_copy_thread_progress(const struct raw_copy_thread *t,
+			 struct list_head *raw_copy_blobs,
+			 struct write_blobs_progress_data *progress_data)
+{
+	struct blob_descriptor *blob;
+	int ret;
+
+	ret = do_write_blobs_progress(progress_data, 0, t->total_size, 0,
+				      false);
+	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list) {
+		if (ret)
+			break;
+		ret = do_write_blobs_progress(progress_data, blob->size, 0, 1,
+					      false);
+	}
+	return ret;
+}
+
+/*
+ * In-place compaction (WIMLIB_WRITE_FLAG_UNSAFE_COMPACT) moves each resource
+ * being kept toward the beginning of the WIM file, into the space freed by the
+ * resources before it.  Rather than copying the resources one at a time, all
+ * the moves are planned first; then the moves are run by several threads at
+ * once, each move starting as soon as the source data it could overwrite has
+ * been copied away by the earlier moves.
+ */
+
+/* The size of the buffer used by each thread to move data within the file.  The
+ * data is read and written in pieces of this size, aligned in the file being
+ * written.  */
+#define COMPACT_COPY_BUFFER_SIZE	(4 << 20)
+
+/* Don't bother with more than one thread if there is less data to move than
+ * this.  */
+#define MIN_CONCURRENT_COMPACT_SIZE	8000000
+
+/* The move of one resource to its new location in the WIM file.  */
+struct compact_move {
+	struct wim_resource_descriptor *rdesc;
+	u64 src;
+	u64 dst;
+	u64 size;
+
+	/* The uncompressed size and number of the blobs in the resource, for
+	 * reporting progress  */
+	u64 blobs_size;
+	u32 num_blobs;
+
+	/* The earlier moves whose source data overlaps this move's destination
+	 * and so must be done before this move can start: those with indices
+	 * in [first_dep, end_dep).  */
+	size_t first_dep;
+	size_t end_dep;
+
+	bool done;
+};
+
+struct compact_job;
+
+struct compact_queue {
+	struct compact_move *moves;
+	size_t num_moves;
+	struct filedes *in_fd;
+
+	/* The output file descriptor without the main thread's write buffer and
+	 * file position  */
+	struct filedes out_fd;
+
+	struct compact_job *jobs;
+	unsigned num_jobs;
+
+	struct mutex lock;
+	struct condvar cond;
+
+	/* The next move to start  */
+	size_t next_move;
+
+	unsigned num_running;
+	int ret;
+};
+
+struct compact_job {
+	struct thread_pool_work work;
+	struct compact_queue *q;
+
+	/* The move this job is running, or SIZE_MAX if none  */
+	size_t cur_move;
+};
+
+/* Can move @m start, given the moves that the jobs are running now?  */
+static bool
+compact_move_ready(const struct compact_queue *q, size_t m)
+{
+	for (unsigned i = 0; i < q->num_jobs; i++) {
+		size_t cur = q->jobs[i].cur_move;
+
+		if (cur != SIZE_MAX && cur >= q->moves[m].first_dep &&
+		    cur < q->moves[m].end_dep)
+			return false;
+	}
+	return true;
+}
+
+/* Copy the data of one move.  The destination may overlap the source, but it
+ * always precedes it, so copying forwards never overwrites data not yet read.
+ */
+static int
+do_compact_move(struct compact_queue *q, const struct compact_move *move,
+		u8 *buf)
+{
+	u64 src = move->src;
+	u64 dst = move->dst;
+	u64 size = move->size;
+	int ret;
+
+	if (src == dst) /* Already in place  */
+		return 0;
+
+	if (dst + size <= src) {
+		u64 copied = filedes_copy_range_at(q->in_fd, src, &q->out_fd,
+						   dst, size);
+		src += copied;
+		dst += copied;
+		size -= copied;
+	}
+
+	while (size) {
+		size_t n = min(COMPACT_COPY_BUFFER_SIZE -
+			       (dst % COMPACT_COPY_BUFFER_SIZE), size);
+
+		ret = full_pread(q->in_fd, buf, n, src);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error reading raw data from WIM file");
+			return ret;
+		}
+		ret = full_pwrite(&q->out_fd, buf, n, dst);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error writing raw data to WIM file");
+			return ret;
+		}
+		src += n;
+		dst += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static void
+compact_job_run(struct thread_pool_work *work)
+{
+	struct compact_job *job = container_of(work, struct compact_job, work);
+	struct compact_queue *q = job->q;
+	u8 *buf = MALLOC(COMPACT_COPY_BUFFER_SIZE);
+
+	mutex_lock(&q->lock);
+	if (!buf && !q->ret)
+		q->ret = WIMLIB_ERR_NOMEM;
+	while (!q->ret && q->next_move < q->num_moves) {
+		size_t m = q->next_move;
+		int ret;
+
+		if (!compact_move_ready(q, m)) {
+			condvar_wait(&q->cond, &q->lock);
+			continue;
+		}
+		q->next_move++;
+		job->cur_move = m;
+		mutex_unlock(&q->lock);
+
+		ret = do_compact_move(q, &q->moves[m], buf);
+
+		mutex_lock(&q->lock);
+		job->cur_move = SIZE_MAX;
+		q->moves[m].done = true;
+		if (ret && !q->ret)
+			q->ret = ret;
+		condvar_broadcast(&q->cond);
+	}
+	q->num_running--;
+	condvar_broadcast(&q->cond);
+	mutex_unlock(&q->lock);
+	FREE(buf);
+}
+
+/*
+ * Plan the moves of the raw resources on @raw_copy_blobs, which are in the WIM
+ * file being compacted, to the current position of @out_fd and after.  Return
+ * false if the resources can't be moved by compact_raw_copy_resources(), in
+ * which case the existing serial code must be used.
+ */
+static bool
+plan_compact_moves(struct list_head *raw_copy_blobs, struct filedes *out_fd,
+		   struct compact_move **moves_ret, size_t *num_moves_ret)
+{
+	struct blob_descriptor *blob;
+	struct wim_resource_descriptor *prev_rdesc = NULL;
+	WIMStruct *wim = NULL;
+	struct compact_move *moves;
+	size_t num_moves = 0;
+	size_t max_moves = 0;
+	size_t first_dep = 0;
+	size_t end_dep = 0;
+	u64 dst = out_fd->offset;
+
+	if (out_fd->is_pipe || out_fd->reader || out_fd->write_hook ||
+	    out_fd->uncached)
+		return false;
+
+	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list) {
+		struct wim_resource_descriptor *rdesc = blob->rdesc;
+
+		if (!wim)
+			wim = rdesc->wim;
+		if (rdesc->wim != wim || !wim->being_compacted ||
+		    rdesc->is_pipable || wim->in_fd.is_pipe ||
+		    wim->in_fd.reader)
+			return false;
+		rdesc->raw_copy_ok = 1;
+		max_moves++;
+	}
+	if (max_moves == 0)
+		return false;
+
+	moves = MALLOC(max_moves * sizeof(moves[0]));
+	if (!moves)
+		return false;
+
+	/* The blobs are sorted by the offsets of their resources.  Give each
+	 * resource the next location in the output, which can't be after its
+	 * current location, since the resources don't overlap.  */
+	list_for_each_entry(blob, raw_copy_blobs, write_blobs_list) {
+		struct wim_resource_descriptor *rdesc = blob->rdesc;
+		struct compact_move *move;
+
+		if (rdesc == prev_rdesc) {
+			/* Another blob in the same solid resource  */
+			moves[num_moves - 1].blobs_size += blob->size;
+			moves[num_moves - 1].num_blobs++;
+			continue;
+		}
+		if (!rdesc->raw_copy_ok || rdesc->offset_in_wim < dst) {
+			FREE(moves);
+			return false;
+		}
+		rdesc->raw_copy_ok = 0;
+		move = &moves[num_moves++];
+		move->rdesc = rdesc;
+		move->src = rdesc->offset_in_wim;
+		move->dst = dst;
+		move->size = rdesc->size_in_wim;
+		move->blobs_size = blob->size;
+		move->num_blobs = 1;
+		move->done = false;
+		dst += move->size;
+		prev_rdesc = rdesc;
+	}
+
+	/* Find the dependencies of each move.  The sources and destinations
+	 * both increase with the index of the move, so the range of earlier
+	 * moves whose sources overlap the destination only moves forward.  */
+	for (size_t m = 0; m < num_moves; m++) {
+		while (first_dep < m &&
+		       moves[first_dep].src + moves[first_dep].size <=
+				moves[m].dst)
+			first_dep++;
+		if (end_dep < first_dep)
+			end_dep = first_dep;
+		while (end_dep < m &&
+		       moves[end_dep].src < moves[m].dst + moves[m].size)
+			end_dep++;
+		moves[m].first_dep = first_dep;
+		moves[m].end_dep = end_dep;
+		set_raw_copy_out_offset(moves[m].rdesc, moves[m].dst);
+	}
+
+	*moves_ret = moves;
+	*num_moves_ret = num_moves;
+	return true;
+}
+
+/* Run the moves one at a time in this thread.  */
+static int
+run_compact_moves_serially(struct compact_queue *q,
+			   struct write_blobs_progress_data *progress_data)
+{
+	u8 *buf = MALLOC(COMPACT_COPY_BUFFER_SIZE);
+	int ret = 0;
+
+	if (!buf)
+		return WIMLIB_ERR_NOMEM;
+	for (size_t m = 0; m < q->num_moves && !ret; m++) {
+		const struct compact_move *move = &q->moves[m];
+
+		ret = do_compact_move(q, move, buf);
+		if (!ret)
+			ret = do_write_blobs_progress(progress_data,
+						      move->blobs_size,
+						      move->size,
+						      move->num_blobs, false);
+	}
+	FREE(buf);
+	return ret;
+}
+
+/*
+ * Run the moves planned by plan_compact_moves() on up to @num_threads threads
+ * of @thread_pool, or of a new pool if it is NULL, while reporting the progress
+ * of the moves as they complete in order.  Afterwards @out_fd is positioned
+ * after the moved data.
+ */
+static int
+run_compact_moves(struct compact_move *moves, size_t num_moves,
+		  struct filedes *in_fd, struct filedes *out_fd,
+		  unsigned num_threads, struct wimlib_thread_pool *thread_pool,
+		  struct write_blobs_progress_data *progress_data)
+{
+	struct compact_queue q = {
+		.moves = moves,
+		.num_moves = num_moves,
+		.in_fd = in_fd,
+	};
+	struct wimlib_thread_pool *pool = NULL;
+	u64 end = moves[num_moves - 1].dst + moves[num_moves - 1].size;
+	u64 total_size = end - moves[0].dst;
+	size_t reported = 0;
+	unsigned cursor = 0;
+	int ret;
+
+	/* The moves are done with positioned I/O on an unbuffered descriptor,
+	 * so write out anything buffered before them first.  */
+	ret = filedes_flush(out_fd);
+	if (ret) {
+		ERROR_WITH_ERRNO("Error writing WIM file");
+		return ret;
+	}
+	filedes_init(&q.out_fd, out_fd->fd);
+
+	if (num_moves > 1 && total_size >= MIN_CONCURRENT_COMPACT_SIZE &&
+	    num_threads != 1) {
+		if (thread_pool) {
+			pool = thread_pool;
+			thread_pool_get(pool);
+		} else if (thread_pool_create(num_threads, &pool)) {
+			pool = NULL;
+		}
+	}
+	if (pool)
+		q.num_jobs = min(thread_pool_num_threads(pool), num_moves);
+	if (q.num_jobs <= 1)
+		goto serial;
+
+	q.jobs = CALLOC(q.num_jobs, sizeof(q.jobs[0]));
+	if (!q.jobs)
+		goto serial;
+	if (!mutex_init(&q.lock))
+		goto serial_free_jobs;
+	if (!condvar_init(&q.cond)) {
+		mutex_destroy(&q.lock);
+		goto serial_free_jobs;
+	}
+
+	q.num_running = q.num_jobs;
+	for (unsigned i = 0; i < q.num_jobs; i++) {
+		q.jobs[i].work.run = compact_job_run;
+		q.jobs[i].work.name = "compact WIM";
+		q.jobs[i].q = &q;
+		q.jobs[i].cur_move = SIZE_MAX;
+		thread_pool_submit(pool, &q.jobs[i].work, &cursor);
+	}
+
+	/* Report the progress of the moves done so far, in order, until all
+	 * the jobs have finished.  If reporting progress fails, the jobs stop
+	 * after their current moves.  */
+	mutex_lock(&q.lock);
+	for (;;) {
+		u64 blobs_size = 0;
+		u64 size = 0;
+		u32 num_blobs = 0;
+
+		while (reported < num_moves && moves[reported].done) {
+			blobs_size += moves[reported].blobs_size;
+			size += moves[reported].size;
+			num_blobs += moves[reported].num_blobs;
+			reported++;
+		}
+		if (num_blobs && !q.ret) {
+			mutex_unlock(&q.lock);
+			ret = do_write_blobs_progress(progress_data, blobs_size,
+						      size, num_blobs, false);
+			mutex_lock(&q.lock);
+			if (ret && !q.ret) {
+				q.ret = ret;
+				condvar_broadcast(&q.cond);
+			}
+			continue;
+		}
+		if (q.num_running == 0)
+			break;
+		condvar_wait(&q.cond, &q.lock);
+	}
+	ret = q.ret;
+	mutex_unlock(&q.lock);
+
+	condvar_destroy(&q.cond);
+	mutex_destroy(&q.lock);
+	FREE(q.jobs);
+	goto out;
+
+serial_free_jobs:
+	FREE(q.jobs);
+serial:
+	q.jobs = NULL;
+	q.num_jobs = 0;
+	ret = run_compact_moves_serially(&q, progress_data);
+out:
+	if (pool)
+		thread_pool_put(pool);
+	if (!ret && filedes_seek(out_fd, end) == -1) {
+		ERROR_WITH_ERRNO("Error seeking in WIM file");
+		ret = WIMLIB_ERR_WRITE;
+	}
+	return ret;
+}
+
+/* Wait for and write all chunks pending in the compressor.  */
+static int
+finish_remaining_chunks(struct write_blobs_ctx *ctx)
+{
+	const void *cdata;
+	u32 csize;
+	u32 usize;
+	int ret;
+
+	if (ctx->compressor == NULL)
+		return 0;
+
+	if (ctx->cur_chunk_buf_filled != 0) {
+		ctx->compressor->signal_chunk_filled(ctx->compressor,
+						     ctx->cur_chunk_buf_filled);
+		ctx->cur_chunk_buf = NULL;
+		ctx->cur_chunk_buf_filled = 0;
+	}
+
+	while (ctx->compressor->get_compression_result(ctx->compressor, &cdata,
+						       &csize, &usize))
+	{
+		ret = write_chunk(ctx, cdata, csize, usize);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void
+validate_blob_list(struct list_head *blob_list)
+{
+	struct blob_descriptor *blob;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		wimlib_assert(blob->will_be_in_output_wim);
+		wimlib_assert(blob->size != 0);
+	}
+}
+
+static void
+init_done_with_file_info(struct list_head *blob_list)
+{
+	struct blob_descriptor *blob;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		if (blob_is_in_file(blob) && blob->file_inode) {
+			blob->file_inode->i_num_remaining_streams = 0;
+			blob->may_send_done_with_file = 1;
+		} else {
+			blob->may_send_done_with_file = 0;
+		}
+	}
+
+	list_for_each_entry(blob, blob_list, write_blobs_list)
+		if (blob->may_send_done_with_file)
+			blob->file_inode->i_num_remaining_streams++;
+}
+
+/* Write the blobs in @blob_list, which total at most @res_expected_size bytes,
+ * to a single solid resource.  */
+static int
+write_solid_resource(struct write_blobs_ctx *ctx, struct list_head *blob_list,
+		     u64 res_expected_size,
+		     const struct read_blob_callbacks *cbs, int read_flags)
+{
+	struct wim_reshdr reshdr;
+	struct blob_descriptor *blob;
+	u64 offset_in_res;
+	int ret;
+
+	INIT_LIST_HEAD(&ctx->blobs_in_solid_resource);
+
+	ret = begin_write_resource(ctx, res_expected_size);
+	if (ret)
+		return ret;
+
+	ret = read_blob_list(blob_list,
+			     offsetof(struct blob_descriptor, write_blobs_list),
+			     cbs, read_flags);
+	if (ret)
+		return ret;
+
+	ret = finish_remaining_chunks(ctx);
+	if (ret)
+		return ret;
+
+	ret = end_write_resource(ctx, &reshdr);
+	if (ret)
+		return ret;
+
+	offset_in_res = 0;
+	list_for_each_entry(blob, &ctx->blobs_in_solid_resource, write_blobs_list) {
+		blob->out_reshdr.size_in_wim = blob->size;
+		blob->out_reshdr.flags = reshdr_flags_for_blob(blob) |
+					 WIM_RESHDR_FLAG_SOLID;
+		blob->out_reshdr.uncompressed_size = 0;
+		blob->out_reshdr.offset_in_wim = offset_in_res;
+		blob->out_res_offset_in_wim = reshdr.offset_in_wim;
+		blob->out_res_size_in_wim = reshdr.size_in_wim;
+		blob->out_res_uncompressed_size = reshdr.uncompressed_size;
+		offset_in_res += blob->size;
+		ret = checkpoint_blob(ctx, blob);
+		if (ret)
+			return ret;
+	}
+	wimlib_assert(offset_in_res == reshdr.uncompressed_size);
+	return 0;
+}
+
+/*
+ * Write the blobs in @blob_list, which have been sorted in the order they are
+ * to be written and total @total_size bytes, to @num_resources solid resources
+ * of about the same uncompressed size, each holding a consecutive run of the
+ * blobs.  Each resource has its own chunk table, so it can be decompressed,
+ * and its files extracted, independently of the others, and damage to one
+ * resource doesn't affect the data in the others.  The cost is a somewhat worse
+ * compression ratio, since data in one resource can't be compressed using data
+ * in another.  The resources are written one after another, with their chunks
+ * compressed in parallel by the same chunk compressor.
+ */
+static int
+write_solid_resources(struct write_blobs_ctx *ctx, struct list_head *blob_list,
+		      u64 total_size, unsigned num_resources,
+		      const struct read_blob_callbacks *cbs, int read_flags)
+{
+	u64 remaining_size = total_size;
+	int ret = 0;
+
+	if (num_resources == 0)
+		num_resources = 1;
+
+	while (!list_empty(blob_list)) {
+		LIST_HEAD(res_blobs);
+		u64 res_size = 0;
+		u64 target_size = DIV_ROUND_UP(remaining_size, num_resources);
+
+		/* Take blobs while that brings the resource closer to its share
+		 * of the remaining data.  The last resource takes all of them.
+		 */
+		do {
+			struct blob_descriptor *blob =
+				list_first_entry(blob_list,
+						 struct blob_descriptor,
+						 write_blobs_list);
+
+			if (res_size != 0 && num_resources > 1 &&
+			    res_size + blob->size / 2 > target_size)
+				break;
+			res_size += blob->size;
+			list_move_tail(&blob->write_blobs_list, &res_blobs);
+		} while (!list_empty(blob_list));
+
+		remaining_size -= res_size;
+		if (num_resources > 1)
+			num_resources--;
+
+		ret = write_solid_resource(ctx, &res_blobs, res_size,
+					   cbs, read_flags);
+		if (ret) {
+			list_splice(&res_blobs, blob_list);
+			break;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Write a list of blobs to the output WIM file.
+ *
+ * @blob_list
+ *	The list of blobs to write, specified by a list of 'struct blob_descriptor' linked
+ *	by the 'write_blobs_list' member.
+ *
+ * @out_fd
+ *	The file descriptor, opened for writing, to which to write the blobs.
+ *
+ * @write_resource_flags
  *	Flags to modify how the blobs are written:
  *
  *	WRITE_RESOURCE_FLAG_RECOMPRESS:
@@ -1393,6 +2476,14 @@ init_done_with_file_info(struct list_head *blob_list)
  *		version number has been, or will be, set to WIM_VERSION_SOLID.
  *		This flag may not be combined with WRITE_RESOURCE_FLAG_PIPABLE.
  *
+ *	WRITE_RESOURCE_FLAG_SOLID_PER_BLOB:
+ *		Write each blob in a separate resource as usual, but make each
+ *		resource a solid resource containing just that blob.  Unlike a
+ *		non-solid resource, such a resource records its own chunk size,
+ *		so @out_chunk_size need not be the WIM's chunk size.  The same
+ *		restrictions apply as for WRITE_RESOURCE_FLAG_SOLID, and the two
+ *		flags may not be combined.
+ *
  * @out_ctype
  *	Compression format to use in the output resources, specified as one of
  *	the WIMLIB_COMPRESSION_TYPE_* constants.  WIMLIB_COMPRESSION_TYPE_NONE
@@ -1404,11 +2495,29 @@ init_done_with_file_info(struct list_head *blob_list)
  *	@out_ctype is WIMLIB_COMPRESSION_TYPE_NONE, in which case this parameter
  *	is ignored.
  *
+ * @num_solid_resources
+ *	With WRITE_RESOURCE_FLAG_SOLID, the number of solid resources into which
+ *	to divide the blobs that need to be compressed, or 1 (or 0) for a single
+ *	solid resource.  See write_solid_resources().  Otherwise ignored.
+ *
  * @num_threads
  *	Number of threads to use to compress data.  If 0, a default number of
  *	threads will be chosen.  The number of threads still may be decreased
  *	from the specified value if insufficient memory is detected.
  *
+ * @thread_pool
+ *	If not NULL, compress data using the threads of this pool rather than
+ *	creating new threads.  @num_threads is then ignored.
+ *
+ * @compression_target
+ *	Target compression rate in megabytes per second, or 0 for none.  See
+ *	wimlib_set_output_compression_target().
+ *
+ * @compression_workers
+ *	Comma-separated addresses of compression workers to which to send data
+ *	to be compressed, or NULL for none.  See
+ *	wimlib_set_output_compression_workers().
+ *
  * @blob_table
  *	If on-the-fly deduplication of unhashed blobs is desired, this parameter
  *	must be pointer to the blob table for the WIMStruct on whose behalf the
@@ -1421,8 +2530,8 @@ init_done_with_file_info(struct list_head *blob_list)
  *	hard-filtered or no blobs are unhashed, this parameter can be NULL.
  *
  * This function will write the blobs in @blob_list to resources in
- * consecutive positions in the output WIM file, or to a single solid resource
- * if WRITE_RESOURCE_FLAG_SOLID was specified in @write_resource_flags.  In both
+ * consecutive positions in the output WIM file, or to solid resources if
+ * WRITE_RESOURCE_FLAG_SOLID was specified in @write_resource_flags.  In both
  * cases, the @out_reshdr of the `struct blob_descriptor' for each blob written will be
  * updated to specify its location, size, and flags in the output WIM.  In the
  * solid resource case, WIM_RESHDR_FLAG_SOLID will be set in the @flags field of
@@ -1464,6 +2573,16 @@ init_done_with_file_info(struct list_head *blob_list)
  * hard-filtered, it is freed and the pre-existing duplicate is written instead,
  * taking ownership of the reference count and slot in the @blob_table_list.
  *
+ * Deduplication is only ever of whole blobs.  The WIM format has no way to
+ * describe a blob as a list of pieces of other resources: a blob is either a
+ * resource of its own or one contiguous range of a solid resource, and each
+ * chunk is decompressed independently of the others.  Deduplicating parts of
+ * files, such as two large disk images that differ in a few blocks, would
+ * therefore need a new resource type that no other WIM reader understands.  The
+ * closest the format allows is placing similar blobs next to each other in a
+ * solid resource (WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT), which only helps
+ * where the shared data falls within one solid chunk.
+ *
  * Returns 0 if every blob was either written successfully or did not need to be
  * written; otherwise returns a non-zero error code.
  */
@@ -1473,9 +2592,14 @@ write_blob_list(struct list_head *blob_list,
 		int write_resource_flags,
 		int out_ctype,
 		u32 out_chunk_size,
+		unsigned num_solid_resources,
 		unsigned num_threads,
+		struct wimlib_thread_pool *thread_pool,
+		unsigned compression_target,
+		const tchar *compression_workers,
 		struct blob_table *blob_table,
 		struct filter_context *filter_ctx,
+		struct write_checkpoint *checkpoint,
 		wimlib_progress_func_t progfunc,
 		void *progctx)
 {
@@ -1483,23 +2607,28 @@ write_blob_list(struct list_head *blob_list,
 	struct write_blobs_ctx ctx;
 	struct list_head raw_copy_blobs;
 	u64 num_nonraw_bytes;
+	int read_flags;
+	bool raw_copy_concurrently = false;
+	struct raw_copy_thread raw_copy_thread;
+	struct compact_move *compact_moves;
+	size_t num_compact_moves;
 
 	wimlib_assert((write_resource_flags &
 		       (WRITE_RESOURCE_FLAG_SOLID |
 			WRITE_RESOURCE_FLAG_PIPABLE)) !=
 				(WRITE_RESOURCE_FLAG_SOLID |
 				 WRITE_RESOURCE_FLAG_PIPABLE));
+	wimlib_assert(!(write_resource_flags &
+			WRITE_RESOURCE_FLAG_SOLID_PER_BLOB) ||
+		      !(write_resource_flags &
+			(WRITE_RESOURCE_FLAG_SOLID |
+			 WRITE_RESOURCE_FLAG_PIPABLE)));
 
 	validate_blob_list(blob_list);
 
 	if (list_empty(blob_list))
 		return 0;
 
-	/* If needed, set auxiliary information so that we can detect when the
-	 * library has finished using each external file.  */
-	if (unlikely(write_resource_flags & WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE))
-		init_done_with_file_info(blob_list);
-
 	memset(&ctx, 0, sizeof(ctx));
 
 	ctx.out_fd = out_fd;
@@ -1508,6 +2637,7 @@ write_blob_list(struct list_head *blob_list,
 	ctx.out_chunk_size = out_chunk_size;
 	ctx.write_resource_flags = write_resource_flags;
 	ctx.filter_ctx = filter_ctx;
+	ctx.checkpoint = checkpoint;
 
 	/*
 	 * We normally sort the blobs to write by a "sequential" order that is
@@ -1518,8 +2648,8 @@ write_blob_list(struct list_head *blob_list,
 	 * This is somewhat of a hack since a blob does not necessarily
 	 * correspond one-to-one with a filename, nor is there any guarantee
 	 * that two files with similar names or extensions are actually similar
-	 * in content.  A potential TODO is to sort the blobs based on some
-	 * measure of similarity of their actual contents.
+	 * in content.  With WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT, blobs whose
+	 * contents look similar are grouped together as well.
 	 */
 
 	ret = sort_blob_list_by_sequential_order(blob_list,
@@ -1533,7 +2663,9 @@ write_blob_list(struct list_head *blob_list,
 		return ret;
 
 	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID_SORT) {
-		ret = sort_blob_list_for_solid_compression(blob_list);
+		ret = sort_blob_list_for_solid_compression(blob_list,
+				write_resource_flags &
+				WRITE_RESOURCE_FLAG_SOLID_SORT_BY_CONTENT);
 		if (unlikely(ret))
 			WARNING("Failed to sort blobs for solid compression. Continuing anyways.");
 	}
@@ -1549,13 +2681,30 @@ write_blob_list(struct list_head *blob_list,
 	 * do compression.  There are serial and parallel implementations of the
 	 * chunk_compressor interface.  We default to parallel using the
 	 * specified number of threads, unless the upper bound on the number
-	 * bytes needing to be compressed is less than a heuristic value.  */
+	 * bytes needing to be compressed is less than a heuristic value.  The
+	 * parallel one also sends chunks to any compression workers.  */
 	if (num_nonraw_bytes != 0 && out_ctype != WIMLIB_COMPRESSION_TYPE_NONE) {
+		bool multi_candidate = (write_resource_flags &
+					WRITE_RESOURCE_FLAG_MULTI_CANDIDATE);
+
 		if (num_nonraw_bytes > max(2000000, out_chunk_size)) {
-			ret = new_parallel_chunk_compressor(out_ctype,
-							    out_chunk_size,
-							    num_threads, 0,
-							    &ctx.compressor);
+			if (compression_workers)
+				ret = new_remote_chunk_compressor(out_ctype,
+								  out_chunk_size,
+								  compression_workers,
+								  num_threads,
+								  thread_pool, 0,
+								  multi_candidate,
+								  compression_target,
+								  &ctx.compressor);
+			else
+				ret = new_parallel_chunk_compressor(out_ctype,
+								    out_chunk_size,
+								    num_threads,
+								    thread_pool, 0,
+								    multi_candidate,
+								    compression_target,
+								    &ctx.compressor);
 			if (ret > 0) {
 				WARNING("Couldn't create parallel chunk compressor: %"TS".\n"
 					"          Falling back to single-threaded compression.",
@@ -1565,6 +2714,8 @@ write_blob_list(struct list_head *blob_list,
 
 		if (ctx.compressor == NULL) {
 			ret = new_serial_chunk_compressor(out_ctype, out_chunk_size,
+							  thread_pool,
+							  multi_candidate,
 							  &ctx.compressor);
 			if (ret)
 				goto out_destroy_context;
@@ -1584,24 +2735,35 @@ write_blob_list(struct list_head *blob_list,
 		goto out_destroy_context;
 
 	/* Copy any compressed resources for which the raw data can be reused
-	 * without decompression.  */
-	ret = write_raw_copy_resources(&raw_copy_blobs, ctx.out_fd,
-				       &ctx.progress_data);
+	 * without decompression.  If there is also data to compress, then the
+	 * raw data is copied by another thread at the same time, into space
+	 * reserved before the compressed data.  */
+	raw_copy_concurrently = can_raw_copy_concurrently(&raw_copy_blobs,
+							  ctx.out_fd,
+							  write_resource_flags,
+							  num_nonraw_bytes);
+	if (raw_copy_concurrently) {
+		ret = start_raw_copy_thread(&raw_copy_thread, &raw_copy_blobs,
+					    ctx.out_fd);
+	} else if (plan_compact_moves(&raw_copy_blobs, ctx.out_fd,
+				      &compact_moves, &num_compact_moves)) {
+		ret = run_compact_moves(compact_moves, num_compact_moves,
+					&compact_moves[0].rdesc->wim->in_fd,
+					ctx.out_fd, num_threads, thread_pool,
+					&ctx.progress_data);
+		FREE(compact_moves);
+	} else {
+		ret = write_raw_copy_resources(&raw_copy_blobs, ctx.out_fd,
+					       &ctx.progress_data);
+	}
+	if (!ret && !raw_copy_concurrently)
+		ret = checkpoint_blobs(&ctx, &raw_copy_blobs);
 
 	if (ret || num_nonraw_bytes == 0)
 		goto out_destroy_context;
 
 	INIT_LIST_HEAD(&ctx.blobs_being_compressed);
 
-	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
-
-		INIT_LIST_HEAD(&ctx.blobs_in_solid_resource);
-
-		ret = begin_write_resource(&ctx, num_nonraw_bytes);
-		if (ret)
-			goto out_destroy_context;
-	}
-
 	/* Read the list of blobs needing to be compressed, using the specified
 	 * callbacks to execute processing of the data.  */
 
@@ -1612,45 +2774,44 @@ write_blob_list(struct list_head *blob_list,
 		.ctx		= &ctx,
 	};
 
-	ret = read_blob_list(blob_list,
-			     offsetof(struct blob_descriptor, write_blobs_list),
-			     &cbs,
-			     BLOB_LIST_ALREADY_SORTED |
-				VERIFY_BLOB_HASHES |
-				COMPUTE_MISSING_BLOB_HASHES);
-
-	if (ret)
-		goto out_destroy_context;
+	/* When compressing in parallel, this thread mostly just reads, hashes,
+	 * and writes data, so it can easily become the bottleneck.  Offload
+	 * the hashing to yet another thread in that case.  */
+	read_flags = BLOB_LIST_ALREADY_SORTED | VERIFY_BLOB_HASHES |
+		     COMPUTE_MISSING_BLOB_HASHES;
+	if (ctx.compressor && ctx.compressor->num_threads > 1)
+		read_flags |= HASH_BLOBS_ASYNC;
 
-	ret = finish_remaining_chunks(&ctx);
+	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
+		ret = write_solid_resources(&ctx, blob_list, num_nonraw_bytes,
+					    num_solid_resources, &cbs,
+					    read_flags);
+	} else {
+		ret = read_blob_list(blob_list,
+				     offsetof(struct blob_descriptor,
+					      write_blobs_list),
+				     &cbs, read_flags);
+		if (!ret)
+			ret = finish_remaining_chunks(&ctx);
+	}
 	if (ret)
 		goto out_destroy_context;
 
-	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
-		struct wim_reshdr reshdr;
-		struct blob_descriptor *blob;
-		u64 offset_in_res;
-
-		ret = end_write_resource(&ctx, &reshdr);
+	if (raw_copy_concurrently) {
+		raw_copy_concurrently = false;
+		ret = stop_raw_copy_thread(&raw_copy_thread);
 		if (ret)
 			goto out_destroy_context;
-
-		offset_in_res = 0;
-		list_for_each_entry(blob, &ctx.blobs_in_solid_resource, write_blobs_list) {
-			blob->out_reshdr.size_in_wim = blob->size;
-			blob->out_reshdr.flags = reshdr_flags_for_blob(blob) |
-						 WIM_RESHDR_FLAG_SOLID;
-			blob->out_reshdr.uncompressed_size = 0;
-			blob->out_reshdr.offset_in_wim = offset_in_res;
-			blob->out_res_offset_in_wim = reshdr.offset_in_wim;
-			blob->out_res_size_in_wim = reshdr.size_in_wim;
-			blob->out_res_uncompressed_size = reshdr.uncompressed_size;
-			offset_in_res += blob->size;
-		}
-		wimlib_assert(offset_in_res == reshdr.uncompressed_size);
+		ret = raw_copy_thread_progress(&raw_copy_thread,
+					       &raw_copy_blobs,
+					       &ctx.progress_data);
+		if (!ret)
+			ret = checkpoint_blobs(&ctx, &raw_copy_blobs);
 	}
 
 out_destroy_context:
+	if (raw_copy_concurrently)
+		(void)stop_raw_copy_thread(&raw_copy_thread);
 	FREE(ctx.chunk_csizes);
 	if (ctx.compressor)
 		ctx.compressor->destroy(ctx.compressor);
@@ -1658,6 +2819,387 @@ out_destroy_context:
 }
 
 
+/* The largest chunk size to use for the solid resources written by
+ * WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES.  This is kept small so that reading one
+ * small file needs to decompress little more than itself.  */
+#define SMALL_FILES_SOLID_CHUNK_SIZE	1048576
+
+/*
+ * For WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES: remove from @blob_list each blob that
+ * is smaller than one chunk and would not be reused as-is, and write those
+ * blobs into a solid resource that uses the WIM's main compression type with
+ * chunks of up to SMALL_FILES_SOLID_CHUNK_SIZE bytes.  This lets each small file
+ * be compressed using the data of similar files written before it, which it
+ * otherwise can't be, since each non-solid resource is compressed separately.
+ */
+static int
+write_small_blobs_solid(WIMStruct *wim, struct list_head *blob_list,
+			int write_flags, int write_resource_flags,
+			int out_ctype, u32 out_chunk_size,
+			unsigned num_threads, struct filter_context *filter_ctx)
+{
+	LIST_HEAD(small_blobs);
+	struct blob_descriptor *blob, *tmp;
+	u32 solid_chunk_size;
+
+	list_for_each_entry_safe(blob, tmp, blob_list, write_blobs_list) {
+		if (blob->size < out_chunk_size &&
+		    !can_raw_copy(blob, write_resource_flags,
+				  out_ctype, out_chunk_size))
+			list_move_tail(&blob->write_blobs_list, &small_blobs);
+	}
+
+	write_resource_flags |= WRITE_RESOURCE_FLAG_SOLID;
+	if (!(write_flags & WIMLIB_WRITE_FLAG_NO_SOLID_SORT)) {
+		write_resource_flags |= WRITE_RESOURCE_FLAG_SOLID_SORT;
+		if (write_flags & WIMLIB_WRITE_FLAG_SOLID_SORT_BY_CONTENT)
+			write_resource_flags |=
+				WRITE_RESOURCE_FLAG_SOLID_SORT_BY_CONTENT;
+	}
+
+	solid_chunk_size = min(SMALL_FILES_SOLID_CHUNK_SIZE,
+			       wim_max_chunk_size(out_ctype));
+	solid_chunk_size = max(solid_chunk_size, out_chunk_size);
+
+	return write_blob_list(&small_blobs,
+			       &wim->out_fd,
+			       write_resource_flags,
+			       out_ctype,
+			       solid_chunk_size,
+			       1,
+			       num_threads,
+			       wim->thread_pool,
+			       wim->out_compression_target,
+			       wim->out_compression_workers,
+			       wim->blob_table,
+			       filter_ctx,
+			       wim->write_checkpoint,
+			       wim->progfunc,
+			       wim->progctx);
+}
+
+/* The chunk size to use for the resources written by
+ * WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS, if the compression type allows it.  */
+#define LARGE_FILES_CHUNK_SIZE		2097152
+
+/* For WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS, the minimum number of chunks of the
+ * larger chunk size that a blob must span to be written with that chunk size.
+ * For smaller blobs, the compression ratio barely improves.  */
+#define LARGE_FILES_MIN_CHUNKS		4
+
+/*
+ * For WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS: remove from @blob_list each blob that
+ * spans at least LARGE_FILES_MIN_CHUNKS chunks of LARGE_FILES_CHUNK_SIZE bytes
+ * (or of the largest chunk size allowed for the compression type, if smaller)
+ * and would not be reused as-is, and write each of those blobs with that chunk
+ * size.  Non-solid resources must use the chunk size in the WIM header, so each
+ * blob is written as a solid resource containing only that blob, which records
+ * its own chunk size.  Reading any part of such a blob still requires
+ * decompressing at most one larger chunk.
+ */
+static int
+write_large_blobs_separately(WIMStruct *wim, struct list_head *blob_list,
+			     int write_resource_flags,
+			     int out_ctype, u32 out_chunk_size,
+			     unsigned num_threads,
+			     struct filter_context *filter_ctx)
+{
+	LIST_HEAD(large_blobs);
+	struct blob_descriptor *blob, *tmp;
+	u32 large_chunk_size;
+
+	large_chunk_size = min(LARGE_FILES_CHUNK_SIZE,
+			       wim_max_chunk_size(out_ctype));
+	if (large_chunk_size <= out_chunk_size)
+		return 0;
+
+	list_for_each_entry_safe(blob, tmp, blob_list, write_blobs_list) {
+		if (blob->size >= (u64)LARGE_FILES_MIN_CHUNKS * large_chunk_size &&
+		    !can_raw_copy(blob, write_resource_flags,
+				  out_ctype, out_chunk_size))
+			list_move_tail(&blob->write_blobs_list, &large_blobs);
+	}
+
+	return write_blob_list(&large_blobs,
+			       &wim->out_fd,
+			       write_resource_flags |
+					WRITE_RESOURCE_FLAG_SOLID_PER_BLOB,
+			       out_ctype,
+			       large_chunk_size,
+			       1,
+			       num_threads,
+			       wim->thread_pool,
+			       wim->out_compression_target,
+			       wim->out_compression_workers,
+			       wim->blob_table,
+			       filter_ctx,
+			       wim->write_checkpoint,
+			       wim->progfunc,
+			       wim->progctx);
+}
+
+/* For WIMLIB_WRITE_FLAG_BINARY_DELTA: return the blob against which @blob may
+ * be written as a delta, or NULL if there is none.  */
+static struct blob_descriptor *
+get_delta_base_for_write(const WIMStruct *wim,
+			 const struct blob_descriptor *blob)
+{
+	struct blob_descriptor *base;
+
+	if (!blob_is_in_file(blob))
+		return NULL;
+
+	/* The base blob must be in a referenced WIM, whose data isn't being
+	 * written (WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS).  */
+	base = blob->delta_base;
+	if (!base || base->blob_location != BLOB_IN_WIM ||
+	    base->rdesc->wim == wim)
+		return NULL;
+
+	if (blob->size < DELTA_MIN_BLOB_SIZE ||
+	    blob->size > DELTA_MAX_BLOB_SIZE ||
+	    base->size > DELTA_MAX_BLOB_SIZE)
+		return NULL;
+	return base;
+}
+
+/* Try to write @blob as a delta resource against @base.  If the delta doesn't
+ * save enough, nothing is written and @blob is left on its list of blobs to
+ * write; otherwise it is removed from that list.  */
+static int
+write_blob_as_delta(WIMStruct *wim, struct blob_descriptor *blob,
+		    struct blob_descriptor *base, int write_resource_flags)
+{
+	void *target = NULL;
+	void *base_data = NULL;
+	u8 *delta = NULL;
+	size_t delta_size;
+	u8 hash[SHA1_HASH_SIZE];
+	struct delta_resource_header_disk hdr;
+	struct wim_reshdr delta_reshdr;
+	u64 res_offset;
+	int ret;
+
+	ret = read_blob_into_alloc_buf(blob, &target);
+	if (ret)
+		goto out;
+	ret = read_blob_into_alloc_buf(base, &base_data);
+	if (ret)
+		goto out;
+
+	/* Use the delta only if at least about half the blob's data is copied
+	 * from the base blob.  */
+	delta = MALLOC(blob->size / 2);
+	if (!delta) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out;
+	}
+	delta_size = create_blob_delta(base_data, base->size, target,
+				       blob->size, delta, blob->size / 2);
+	if (!delta_size)
+		goto out;
+
+	/* Like write_blob_end_read(), turn an unhashed blob into a hashed one.
+	 * But if it turns out to be a duplicate, or if the blob was already
+	 * hashed but its data has changed since, leave it to the normal write
+	 * path to handle that.  */
+	sha1(target, blob->size, hash);
+	if (blob->unhashed) {
+		if (lookup_blob(wim->blob_table, hash))
+			goto out;
+		copy_hash(blob->hash, hash);
+		blob_hash_computed(blob);
+		list_del(&blob->unhashed_list);
+		blob_table_insert(wim->blob_table, blob);
+		blob->unhashed = 0;
+	} else if (!hashes_equal(hash, blob->hash)) {
+		goto out;
+	}
+
+	res_offset = wim->out_fd.offset;
+	hdr.delta_size = cpu_to_le64(delta_size);
+	copy_hash(hdr.base_hash, base->hash);
+	hdr.reserved = 0;
+	ret = full_write(&wim->out_fd, &hdr, sizeof(hdr));
+	if (ret) {
+		ERROR_WITH_ERRNO("Error writing delta resource header");
+		goto out;
+	}
+	ret = write_wim_resource_from_buffer(delta, delta_size, false,
+					     &wim->out_fd,
+					     wim->out_compression_type,
+					     wim->out_chunk_size,
+					     &delta_reshdr, NULL,
+					     write_resource_flags);
+	if (ret)
+		goto out;
+
+	blob->out_reshdr.offset_in_wim = res_offset;
+	blob->out_reshdr.size_in_wim = sizeof(hdr) + delta_reshdr.size_in_wim;
+	blob->out_reshdr.uncompressed_size = blob->size;
+	blob->out_reshdr.flags = WIM_RESHDR_FLAG_DELTA |
+		(delta_reshdr.flags & WIM_RESHDR_FLAG_COMPRESSED);
+	list_del(&blob->write_blobs_list);
+
+	if (wim->write_checkpoint) {
+		ret = write_checkpoint_add_blob(wim->write_checkpoint, blob,
+						&wim->out_fd);
+		if (ret)
+			goto out;
+	}
+
+	if (write_resource_flags & WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE)
+		ret = do_done_with_blob(blob, wim->progfunc, wim->progctx);
+out:
+	FREE(delta);
+	FREE(base_data);
+	FREE(target);
+	return ret;
+}
+
+/*
+ * For WIMLIB_WRITE_FLAG_BINARY_DELTA: remove from @blob_list each blob that is
+ * likely a modified version of a blob in a referenced WIM and that differs from
+ * it little enough, and write each of those blobs as a delta resource against
+ * that blob.  The delta data is compressed with the WIM's main compression type
+ * and chunk size, like the data of any non-solid resource.
+ */
+static int
+write_binary_delta_blobs(WIMStruct *wim, struct list_head *blob_list,
+			 int write_resource_flags)
+{
+	struct blob_descriptor *blob, *tmp;
+
+	list_for_each_entry_safe(blob, tmp, blob_list, write_blobs_list) {
+		struct blob_descriptor *base;
+		int ret;
+
+		base = get_delta_base_for_write(wim, blob);
+		if (!base)
+			continue;
+		ret = write_blob_as_delta(wim, blob, base,
+					  write_resource_flags &
+						~WRITE_RESOURCE_FLAG_SOLID);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * When writing a new WIM file, reserve space for the file data about to be
+ * written, so that the filesystem can lay the file out in a few large extents
+ * rather than extending it bit by bit as the compressed chunks come in.  This
+ * keeps the WIM file fast to read sequentially later.  finish_write() truncates
+ * the file to the size actually written.
+ *
+ * The size of each blob that is already in a WIM resource is estimated from
+ * how well that resource was compressed.  The size of the others is estimated
+ * from the overall ratio of those blobs, provided that they are being written
+ * with the same compression type, or else taken to be their uncompressed size,
+ * which is an upper bound.  The metadata resources, blob table, and XML data
+ * don't need to be accounted for, as they're small compared to the slack.
+ */
+static void
+preallocate_output_wim(WIMStruct *wim, struct list_head *blob_list,
+		       int out_ctype)
+{
+	struct blob_descriptor *blob;
+	u64 known_usize = 0, known_csize = 0, unknown_usize = 0;
+	bool same_ctype = true;
+	u64 estimate;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		const struct wim_resource_descriptor *rdesc;
+
+		if (blob->blob_location != BLOB_IN_WIM) {
+			unknown_usize += blob->size;
+			continue;
+		}
+		rdesc = blob->rdesc;
+		known_usize += blob->size;
+		known_csize += (double)blob->size * rdesc->size_in_wim /
+			       max(rdesc->uncompressed_size, 1);
+		if (rdesc->compression_type != out_ctype)
+			same_ctype = false;
+	}
+
+	estimate = known_csize + unknown_usize;
+	if (same_ctype && known_usize != 0 &&
+	    out_ctype != WIMLIB_COMPRESSION_TYPE_NONE)
+		estimate = known_csize + (double)unknown_usize * known_csize /
+					 known_usize;
+
+	filedes_preallocate(&wim->out_fd, wim->out_fd.offset + estimate);
+}
+
+static int
+sha1_blob_chunk(const struct blob_descriptor *blob, u64 offset,
+		const void *chunk, size_t size, void *_ctx)
+{
+	sha1_update(_ctx, chunk, size);
+	return 0;
+}
+
+/*
+ * For WIMLIB_WRITE_FLAG_RESUMABLE: remove from @blob_list each blob whose data
+ * was already written to the output file before the write was interrupted, as
+ * recorded in the checkpoint, and set its location in the output file to the
+ * recorded one.  An unhashed blob must be checksummed to look it up, which is
+ * only done if some blob of its size was recorded.  Like write_blob_as_delta(),
+ * this leaves unhashed blobs that turn out to be duplicates to the normal write
+ * path.
+ */
+static int
+skip_checkpointed_blobs(WIMStruct *wim, struct list_head *blob_list,
+			int write_resource_flags)
+{
+	struct write_checkpoint *cp = wim->write_checkpoint;
+	struct blob_descriptor *blob, *tmp;
+	int ret;
+
+	list_for_each_entry_safe(blob, tmp, blob_list, write_blobs_list) {
+		if (!write_checkpoint_has_size(cp, blob->size))
+			continue;
+
+		if (blob->unhashed) {
+			struct sha1_ctx sha_ctx;
+			struct read_blob_callbacks cbs = {
+				.continue_blob	= sha1_blob_chunk,
+				.ctx		= &sha_ctx,
+			};
+			u8 hash[SHA1_HASH_SIZE];
+
+			sha1_init(&sha_ctx);
+			ret = read_blob_with_cbs(blob, &cbs, false);
+			if (ret)
+				return ret;
+			sha1_final(&sha_ctx, hash);
+
+			if (lookup_blob(wim->blob_table, hash) ||
+			    !write_checkpoint_restore_blob(cp, hash, blob))
+				continue;
+			copy_hash(blob->hash, hash);
+			blob_hash_computed(blob);
+			list_del(&blob->unhashed_list);
+			blob_table_insert(wim->blob_table, blob);
+			blob->unhashed = 0;
+		} else if (!write_checkpoint_restore_blob(cp, blob->hash,
+							  blob)) {
+			continue;
+		}
+		list_del(&blob->write_blobs_list);
+
+		if (write_resource_flags & WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE) {
+			ret = do_done_with_blob(blob, wim->progfunc,
+						wim->progctx);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
 static int
 write_file_data_blobs(WIMStruct *wim,
 		      struct list_head *blob_list,
@@ -1671,6 +3213,22 @@ write_file_data_blobs(WIMStruct *wim,
 
 	write_resource_flags = write_flags_to_resource_flags(write_flags);
 
+	/* If needed, set auxiliary information so that we can detect when the
+	 * library has finished using each external file.  This is done here
+	 * rather than in write_blob_list() because the blobs of one file may be
+	 * split between the two lists written below.  */
+	if (unlikely(write_resource_flags & WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE))
+		init_done_with_file_info(blob_list);
+
+	if (wim->write_checkpoint &&
+	    write_checkpoint_resume_offset(wim->write_checkpoint))
+	{
+		int ret = skip_checkpointed_blobs(wim, blob_list,
+						  write_resource_flags);
+		if (ret)
+			return ret;
+	}
+
 	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
 		out_chunk_size = wim->out_solid_chunk_size;
 		out_ctype = wim->out_solid_compression_type;
@@ -1679,14 +3237,66 @@ write_file_data_blobs(WIMStruct *wim,
 		out_ctype = wim->out_compression_type;
 	}
 
+	/* Only preallocate space in files created for this write; appending
+	 * and writing to the caller's file descriptor leave the file size
+	 * alone until the end.  */
+	if (!(write_flags & (WIMLIB_WRITE_FLAG_APPEND |
+			     WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR |
+			     WIMLIB_WRITE_FLAG_PIPABLE |
+			     WIMLIB_WRITE_FLAG_UNSAFE_COMPACT |
+			     WIMLIB_WRITE_FLAG_NO_FILE_DATA)))
+		preallocate_output_wim(wim, blob_list, out_ctype);
+
+	if ((write_flags & WIMLIB_WRITE_FLAG_BINARY_DELTA) &&
+	    (write_flags & WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS) &&
+	    !(write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE))
+	{
+		int ret = write_binary_delta_blobs(wim, blob_list,
+						   write_resource_flags);
+		if (ret)
+			return ret;
+	}
+
+	if ((write_flags & WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES) &&
+	    !(write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) &&
+	    out_ctype != WIMLIB_COMPRESSION_TYPE_NONE)
+	{
+		int ret = write_small_blobs_solid(wim, blob_list,
+						  write_flags,
+						  write_resource_flags,
+						  out_ctype, out_chunk_size,
+						  num_threads, filter_ctx);
+		if (ret)
+			return ret;
+	}
+
+	if ((write_flags & WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS) &&
+	    !(write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) &&
+	    out_ctype != WIMLIB_COMPRESSION_TYPE_NONE)
+	{
+		int ret = write_large_blobs_separately(wim, blob_list,
+						       write_resource_flags,
+						       out_ctype,
+						       out_chunk_size,
+						       num_threads,
+						       filter_ctx);
+		if (ret)
+			return ret;
+	}
+
 	return write_blob_list(blob_list,
 			       &wim->out_fd,
 			       write_resource_flags,
 			       out_ctype,
 			       out_chunk_size,
+			       wim->out_num_solid_resources,
 			       num_threads,
+			       wim->thread_pool,
+			       wim->out_compression_target,
+			       wim->out_compression_workers,
 			       wim->blob_table,
 			       filter_ctx,
+			       wim->write_checkpoint,
 			       wim->progfunc,
 			       wim->progctx);
 }
@@ -1708,6 +3318,11 @@ write_wim_resource(struct blob_descriptor *blob,
 			       out_ctype,
 			       out_chunk_size,
 			       1,
+			       1,
+			       NULL,
+			       0,
+			       NULL,
+			       NULL,
 			       NULL,
 			       NULL,
 			       NULL,
@@ -1753,51 +3368,127 @@ write_wim_resource_from_buffer(const void *buf,
 	return 0;
 }
 
+/*
+ * A set of blob sizes, used to find the blobs whose size is unique and which
+ * therefore can't be duplicates of any other blob.  It is an open addressing
+ * hash table keyed by size, which remembers the first blob seen with each size.
+ * Only the sizes are compared while probing, so blob descriptors aren't
+ * dereferenced except to clear @unique_size when a second blob of the same size
+ * shows up.
+ */
+struct blob_size_entry {
+	u64 size;
+	struct blob_descriptor *first_blob; /* NULL if the entry is unused  */
+
+	/* Whether all the blobs of this size can be told apart by
+	 * sha1_file_on_disk_ends().  */
+	bool may_compare_ends;
+};
+
 struct blob_size_table {
-	struct hlist_head *array;
+	struct blob_size_entry *entries;
 	size_t num_entries;
-	size_t capacity;
+	size_t mask; /* capacity - 1; capacity is a power of 2  */
 };
 
+/* Blobs of the same size are first compared by the SHA-1 message digest of just
+ * this many bytes at their start plus this many bytes at their end, provided
+ * that they are in files on disk.  */
+#define BLOB_ENDS_SAMPLE_SIZE	65536
+
+static bool
+blob_may_compare_ends(const struct blob_descriptor *blob)
+{
+	return blob->unhashed &&
+	       blob->blob_location == BLOB_IN_FILE_ON_DISK &&
+	       blob->size > 2 * BLOB_ENDS_SAMPLE_SIZE;
+}
+
 static int
 init_blob_size_table(struct blob_size_table *tab, size_t capacity)
 {
-	tab->array = CALLOC(capacity, sizeof(tab->array[0]));
-	if (tab->array == NULL)
+	capacity = roundup_pow_of_2(capacity);
+	tab->entries = CALLOC(capacity, sizeof(tab->entries[0]));
+	if (tab->entries == NULL)
 		return WIMLIB_ERR_NOMEM;
 	tab->num_entries = 0;
-	tab->capacity = capacity;
+	tab->mask = capacity - 1;
 	return 0;
 }
 
 static void
 destroy_blob_size_table(struct blob_size_table *tab)
 {
-	FREE(tab->array);
+	FREE(tab->entries);
+}
+
+static struct blob_size_entry *
+blob_size_table_find(const struct blob_size_table *tab, u64 size)
+{
+	size_t pos = hash_u64(size) & tab->mask;
+
+	while (tab->entries[pos].first_blob &&
+	       tab->entries[pos].size != size)
+		pos = (pos + 1) & tab->mask;
+	return &tab->entries[pos];
+}
+
+static int
+enlarge_blob_size_table(struct blob_size_table *tab)
+{
+	struct blob_size_table new_tab;
+	int ret;
+
+	ret = init_blob_size_table(&new_tab, 2 * (tab->mask + 1));
+	if (ret)
+		return ret;
+	for (size_t i = 0; i <= tab->mask; i++)
+		if (tab->entries[i].first_blob)
+			*blob_size_table_find(&new_tab, tab->entries[i].size) =
+				tab->entries[i];
+	new_tab.num_entries = tab->num_entries;
+	destroy_blob_size_table(tab);
+	*tab = new_tab;
+	return 0;
 }
 
 static int
 blob_size_table_insert(struct blob_descriptor *blob, void *_tab)
 {
 	struct blob_size_table *tab = _tab;
-	size_t pos;
-	struct blob_descriptor *same_size_blob;
+	struct blob_size_entry *entry;
 
-	pos = hash_u64(blob->size) % tab->capacity;
-	blob->unique_size = 1;
-	hlist_for_each_entry(same_size_blob, &tab->array[pos], hash_list_2) {
-		if (same_size_blob->size == blob->size) {
-			blob->unique_size = 0;
-			same_size_blob->unique_size = 0;
-			break;
-		}
+	entry = blob_size_table_find(tab, blob->size);
+	if (entry->first_blob) {
+		blob->unique_size = 0;
+		entry->first_blob->unique_size = 0;
+		entry->may_compare_ends &= blob_may_compare_ends(blob);
+		return 0;
 	}
-
-	hlist_add_head(&blob->hash_list_2, &tab->array[pos]);
-	tab->num_entries++;
+	blob->unique_size = 1;
+	entry->size = blob->size;
+	entry->first_blob = blob;
+	entry->may_compare_ends = blob_may_compare_ends(blob);
+	if (++tab->num_entries > (tab->mask + 1) / 2)
+		return enlarge_blob_size_table(tab);
 	return 0;
 }
 
+/* Account for a blob that isn't in the size table itself, but whose size must
+ * still stop the blobs that are from being considered unique.  */
+static void
+blob_size_table_note_other(const struct blob_descriptor *blob,
+			   struct blob_size_table *tab)
+{
+	struct blob_size_entry *entry;
+
+	entry = blob_size_table_find(tab, blob->size);
+	if (entry->first_blob) {
+		entry->first_blob->unique_size = 0;
+		entry->may_compare_ends &= blob_may_compare_ends(blob);
+	}
+}
+
 struct find_blobs_ctx {
 	WIMStruct *wim;
 	int write_flags;
@@ -1856,6 +3547,15 @@ do_blob_set_not_in_output_wim(struct blob_descriptor *blob, void *_ignore)
 	return 0;
 }
 
+static int
+unloaded_inode_find_blobs_to_reference(struct wim_inode *inode, void *_wim)
+{
+	WIMStruct *wim = _wim;
+
+	return inode_find_blobs_to_reference(inode, wim->blob_table,
+					     wim->private);
+}
+
 static int
 image_find_blobs_to_reference(WIMStruct *wim)
 {
@@ -1867,6 +3567,10 @@ image_find_blobs_to_reference(WIMStruct *wim)
 
 	imd = wim_get_current_image_metadata(wim);
 
+	ret = finish_loading_unspilled_image(imd);
+	if (ret)
+		return ret;
+
 	image_for_each_unhashed_blob(blob, imd)
 		blob->will_be_in_output_wim = 0;
 
@@ -1878,7 +3582,9 @@ image_find_blobs_to_reference(WIMStruct *wim)
 		if (ret)
 			return ret;
 	}
-	return 0;
+	return visit_unloaded_inodes(imd,
+				     unloaded_inode_find_blobs_to_reference,
+				     wim);
 }
 
 static int
@@ -1915,7 +3621,8 @@ prepare_unfiltered_list_of_blobs_in_output_wim(WIMStruct *wim,
 		for_blob_in_table(wim->blob_table,
 				  do_blob_set_not_in_output_wim, NULL);
 		wim->private = blob_list_ret;
-		ret = for_image(wim, image, image_find_blobs_to_reference);
+		ret = for_image_lazily(wim, image,
+				       image_find_blobs_to_reference);
 		if (ret)
 			return ret;
 	}
@@ -1935,7 +3642,91 @@ insert_other_if_hard_filtered(struct blob_descriptor *blob, void *_ctx)
 
 	if (!blob->will_be_in_output_wim &&
 	    blob_hard_filtered(blob, ctx->filter_ctx))
-		blob_size_table_insert(blob, ctx->tab);
+		return blob_size_table_insert(blob, ctx->tab);
+	return 0;
+}
+
+struct blob_ends_hash {
+	u64 size;
+	struct blob_descriptor *blob;
+	u8 hash[SHA1_HASH_SIZE];
+};
+
+static int
+cmp_blob_ends_hashes(const void *p1, const void *p2)
+{
+	const struct blob_ends_hash *h1 = p1;
+	const struct blob_ends_hash *h2 = p2;
+
+	if (h1->size != h2->size)
+		return cmp_u64(h1->size, h2->size);
+	return memcmp(h1->hash, h2->hash, SHA1_HASH_SIZE);
+}
+
+static bool
+should_compare_blob_ends(const struct blob_descriptor *blob,
+			 const struct blob_size_table *tab)
+{
+	return !blob->unique_size && blob_may_compare_ends(blob) &&
+	       blob_size_table_find(tab, blob->size)->may_compare_ends;
+}
+
+/*
+ * Blobs that share their size with other blobs would have to be read twice:
+ * once to hash them, to find out whether they're duplicates, and once to write
+ * them.  But if a group of same-size blobs are all in files on disk, then
+ * comparing digests of just the ends of their data is enough to show that most
+ * of them are unique after all.  Set @unique_size on those blobs, so that
+ * they're hashed while being written rather than beforehand.
+ */
+static int
+compare_blob_ends(struct list_head *blob_list, struct blob_size_table *tab)
+{
+	struct blob_descriptor *blob;
+	struct blob_ends_hash *hashes;
+	size_t num_hashes = 0;
+	size_t i, j;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list)
+		if (should_compare_blob_ends(blob, tab))
+			num_hashes++;
+	if (num_hashes == 0)
+		return 0;
+
+	hashes = MALLOC(num_hashes * sizeof(hashes[0]));
+	if (!hashes)
+		return WIMLIB_ERR_NOMEM;
+
+	i = 0;
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		if (!should_compare_blob_ends(blob, tab))
+			continue;
+		if (sha1_file_on_disk_ends(blob, BLOB_ENDS_SAMPLE_SIZE,
+					   hashes[i].hash))
+		{
+			/* The other blobs of this size might be duplicates
+			 * of this one, so they all need to be fully hashed.  */
+			blob_size_table_find(tab, blob->size)->may_compare_ends =
+				false;
+			continue;
+		}
+		hashes[i].size = blob->size;
+		hashes[i].blob = blob;
+		i++;
+	}
+	num_hashes = i;
+
+	qsort(hashes, num_hashes, sizeof(hashes[0]), cmp_blob_ends_hashes);
+
+	for (i = 0; i < num_hashes; i = j) {
+		for (j = i + 1; j < num_hashes &&
+		     !cmp_blob_ends_hashes(&hashes[i], &hashes[j]); j++)
+			;
+		if (j == i + 1 &&
+		    blob_size_table_find(tab, hashes[i].size)->may_compare_ends)
+			hashes[i].blob->unique_size = 1;
+	}
+	FREE(hashes);
 	return 0;
 }
 
@@ -1948,7 +3739,7 @@ determine_blob_size_uniquity(struct list_head *blob_list,
 	struct blob_size_table tab;
 	struct blob_descriptor *blob;
 
-	ret = init_blob_size_table(&tab, 9001);
+	ret = init_blob_size_table(&tab, 1024);
 	if (ret)
 		return ret;
 
@@ -1957,14 +3748,21 @@ determine_blob_size_uniquity(struct list_head *blob_list,
 			.tab = &tab,
 			.filter_ctx = filter_ctx,
 		};
-		for_blob_in_table(lt, insert_other_if_hard_filtered, &ctx);
+		ret = for_blob_in_table(lt, insert_other_if_hard_filtered, &ctx);
+		if (ret)
+			goto out;
 	}
 
-	list_for_each_entry(blob, blob_list, write_blobs_list)
-		blob_size_table_insert(blob, &tab);
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		ret = blob_size_table_insert(blob, &tab);
+		if (ret)
+			goto out;
+	}
 
+	ret = compare_blob_ends(blob_list, &tab);
+out:
 	destroy_blob_size_table(&tab);
-	return 0;
+	return ret;
 }
 
 static void
@@ -1992,6 +3790,94 @@ filter_blob_list_for_write(struct list_head *blob_list,
 	}
 }
 
+struct append_blobs_ctx {
+	struct list_head *blob_list;
+	struct list_head *blob_table_list;
+	const struct filter_context *filter_ctx;
+	size_t num_to_write;
+};
+
+static int
+reference_blob_for_append(struct blob_descriptor *blob, void *_ctx)
+{
+	struct append_blobs_ctx *ctx = _ctx;
+
+	blob->will_be_in_output_wim = 1;
+	blob->out_refcnt = blob->refcnt;
+	list_add_tail(&blob->blob_table_list, ctx->blob_table_list);
+	if (!blob_filtered(blob, ctx->filter_ctx)) {
+		list_add_tail(&blob->write_blobs_list, ctx->blob_list);
+		ctx->num_to_write++;
+	}
+	return 0;
+}
+
+/*
+ * The same as prepare_blob_list_for_write() with WIMLIB_ALL_IMAGES and
+ * APPEND | STREAMS_OK, but much cheaper when the WIM is large and not much has
+ * been added to it.
+ *
+ * Everything already in @wim stays where it is, so it only needs to go into the
+ * blob table list, with its reference count taken as-is.  The only blobs that
+ * can need writing are the ones in the blob table which aren't in @wim yet and
+ * the unhashed blobs of the dirty images; images unchanged since being read
+ * from @wim can't have any of the latter.  So rather than putting every blob
+ * through the size table and then filtering nearly all of them out again, build
+ * the size table from just the blobs to write, then look up the sizes of the
+ * others in it.
+ */
+static int
+prepare_blob_list_for_append(WIMStruct *wim,
+			     struct list_head *blob_list_ret,
+			     struct list_head *blob_table_list_ret,
+			     const struct filter_context *filter_ctx)
+{
+	struct append_blobs_ctx ctx = {
+		.blob_list = blob_list_ret,
+		.blob_table_list = blob_table_list_ret,
+		.filter_ctx = filter_ctx,
+	};
+	struct blob_descriptor *blob;
+	struct blob_size_table tab;
+	int ret;
+
+	INIT_LIST_HEAD(blob_list_ret);
+	INIT_LIST_HEAD(blob_table_list_ret);
+
+	for_blob_in_table(wim->blob_table, reference_blob_for_append, &ctx);
+
+	for (int i = 0; i < wim->hdr.image_count; i++) {
+		struct wim_image_metadata *imd = wim->image_metadata[i];
+
+		if (!is_image_dirty(imd))
+			continue;
+		image_for_each_unhashed_blob(blob, imd)
+			reference_blob_for_append(blob, &ctx);
+	}
+
+	if (ctx.num_to_write == 0)
+		return 0;
+
+	ret = init_blob_size_table(&tab, max(2 * ctx.num_to_write, 16));
+	if (ret)
+		return ret;
+
+	list_for_each_entry(blob, blob_list_ret, write_blobs_list) {
+		ret = blob_size_table_insert(blob, &tab);
+		if (ret)
+			goto out;
+	}
+
+	list_for_each_entry(blob, blob_table_list_ret, blob_table_list)
+		if (blob_filtered(blob, filter_ctx))
+			blob_size_table_note_other(blob, &tab);
+
+	ret = compare_blob_ends(blob_list_ret, &tab);
+out:
+	destroy_blob_size_table(&tab);
+	return ret;
+}
+
 /*
  * prepare_blob_list_for_write() -
  *
@@ -2013,11 +3899,16 @@ filter_blob_list_for_write(struct list_head *blob_list,
  *	does not exclude filtering with APPEND and SKIP_EXTERNAL_WIMS, below.
  *
  *	APPEND:  Blobs already present in @wim shall not be returned in
- *	@blob_list_ret.
+ *	@blob_list_ret.  Together with STREAMS_OK, this means that only the
+ *	blobs not yet in @wim and the unhashed blobs of dirty images have to be
+ *	looked at closely; see prepare_blob_list_for_append().
  *
  *	SKIP_EXTERNAL_WIMS:  Blobs already present in a WIM file, but not @wim,
  *	shall be returned in neither @blob_list_ret nor @blob_table_list_ret.
  *
+ *	BLOB_STORE_PACK:  Likewise for blobs already present in the blob store
+ *	a pack is being written to (@in_blob_store set).
+ *
  * @blob_list_ret
  *	List of blobs, linked by write_blobs_list, that need to be written will
  *	be returned here.
@@ -2070,6 +3961,16 @@ prepare_blob_list_for_write(WIMStruct *wim, int image,
 	filter_ctx_ret->write_flags = write_flags;
 	filter_ctx_ret->wim = wim;
 
+	if (image == WIMLIB_ALL_IMAGES &&
+	    (write_flags & (WIMLIB_WRITE_FLAG_APPEND |
+			    WIMLIB_WRITE_FLAG_STREAMS_OK |
+			    WIMLIB_WRITE_FLAG_SKIP_EXTERNAL_WIMS |
+			    WIMLIB_WRITE_FLAG_BLOB_STORE_PACK)) ==
+	    (WIMLIB_WRITE_FLAG_APPEND | WIMLIB_WRITE_FLAG_STREAMS_OK))
+		return prepare_blob_list_for_append(wim, blob_list_ret,
+						    blob_table_list_ret,
+						    filter_ctx_ret);
+
 	ret = prepare_unfiltered_list_of_blobs_in_output_wim(
 				wim,
 				image,
@@ -2093,6 +3994,25 @@ prepare_blob_list_for_write(WIMStruct *wim, int image,
 	return 0;
 }
 
+/*
+ * For WIMLIB_WRITE_FLAG_NO_FILE_DATA: instead of writing the blobs in
+ * @blob_list, just give them output resource headers which record their sizes.
+ * The blobs keep their places in the blob table, where they'll be written with
+ * part number 0 to show that their data is not in the WIM file.
+ */
+static void
+omit_file_data_blobs(struct list_head *blob_list)
+{
+	struct blob_descriptor *blob;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list) {
+		blob->out_reshdr.offset_in_wim = 0;
+		blob->out_reshdr.size_in_wim = blob->size;
+		blob->out_reshdr.uncompressed_size = blob->size;
+		blob->out_reshdr.flags = 0;
+	}
+}
+
 static int
 write_file_data(WIMStruct *wim, int image, int write_flags,
 		unsigned num_threads,
@@ -2111,12 +4031,27 @@ write_file_data(WIMStruct *wim, int image, int write_flags,
 		 */
 		blob_list = &_blob_list;
 		filter_ctx = &_filter_ctx;
+
+		/* Without file data, the blobs must be hashed now, since
+		 * nothing else will read them.  This also merges duplicates
+		 * before the blob list is built.  */
+		if (write_flags & WIMLIB_WRITE_FLAG_NO_FILE_DATA) {
+			ret = wim_checksum_unhashed_blobs(wim);
+			if (ret)
+				return ret;
+		}
+
 		ret = prepare_blob_list_for_write(wim, image, write_flags,
 						  blob_list,
 						  blob_table_list_ret,
 						  filter_ctx);
 		if (ret)
 			return ret;
+
+		if (write_flags & WIMLIB_WRITE_FLAG_NO_FILE_DATA) {
+			omit_file_data_blobs(blob_list);
+			return 0;
+		}
 	} else {
 		/* Currently only as a result of wimlib_split() being called:
 		 * use blob list already explicitly provided.  Use existing
@@ -2139,13 +4074,57 @@ write_file_data(WIMStruct *wim, int image, int write_flags,
 				     filter_ctx);
 }
 
+/*
+ * Write the metadata resources queued on @blob_list, then fill in the
+ * resource headers and hashes of the images' metadata blobs from @tmp_blobs,
+ * which holds the blob descriptors of newly built metadata resources for images
+ * @first_image through @last_image (left BLOB_NONEXISTENT for images whose
+ * metadata resources weren't built).  All the resources are written with one
+ * call to write_blob_list(), so that the chunks of all of them are compressed
+ * in parallel, even when each image's metadata is small.
+ */
+static int
+write_metadata_batch(WIMStruct *wim, struct list_head *blob_list,
+		     struct blob_descriptor *tmp_blobs,
+		     int first_image, int last_image,
+		     int write_resource_flags, unsigned num_threads)
+{
+	int ret;
+
+	ret = write_blob_list(blob_list, &wim->out_fd, write_resource_flags,
+			      wim->out_compression_type, wim->out_chunk_size,
+			      1, num_threads, wim->thread_pool, 0, NULL,
+			      NULL, NULL, NULL, NULL, NULL);
+
+	for (int i = first_image; i <= last_image; i++) {
+		struct blob_descriptor *tmp = &tmp_blobs[i - first_image];
+		struct blob_descriptor *metadata_blob =
+			wim->image_metadata[i - 1]->metadata_blob;
+
+		if (tmp->blob_location != BLOB_IN_DENTRY_TREE)
+			continue;
+		if (ret == 0) {
+			copy_reshdr(&metadata_blob->out_reshdr,
+				    &tmp->out_reshdr);
+			copy_hash(metadata_blob->hash, tmp->hash);
+		}
+		tmp->blob_location = BLOB_NONEXISTENT;
+	}
+	INIT_LIST_HEAD(blob_list);
+	return ret;
+}
+
 static int
-write_metadata_resources(WIMStruct *wim, int image, int write_flags)
+write_metadata_resources(WIMStruct *wim, int image, int write_flags,
+			 unsigned num_threads)
 {
 	int ret;
 	int start_image;
 	int end_image;
+	int batch_start;
 	int write_resource_flags;
+	struct blob_descriptor *tmp_blobs;
+	LIST_HEAD(blob_list);
 
 	if (write_flags & WIMLIB_WRITE_FLAG_NO_METADATA)
 		return 0;
@@ -2168,6 +4147,14 @@ write_metadata_resources(WIMStruct *wim, int image, int write_flags)
 		end_image = image;
 	}
 
+	if (end_image < start_image)
+		goto done;
+
+	tmp_blobs = CALLOC(end_image - start_image + 1, sizeof(tmp_blobs[0]));
+	if (!tmp_blobs)
+		return WIMLIB_ERR_NOMEM;
+
+	batch_start = start_image;
 	for (int i = start_image; i <= end_image; i++) {
 		struct wim_image_metadata *imd;
 
@@ -2176,8 +4163,14 @@ write_metadata_resources(WIMStruct *wim, int image, int write_flags)
 			/* The image was modified from the original, or was
 			 * newly added, so we have to build and write a new
 			 * metadata resource.  */
-			ret = write_metadata_resource(wim, i,
-						      write_resource_flags);
+			struct blob_descriptor *tmp = &tmp_blobs[i - start_image];
+
+			ret = prepare_metadata_resource(wim, i, tmp);
+			if (ret)
+				goto out_free_batch;
+			tmp->is_metadata = 1;
+			tmp->will_be_in_output_wim = 1;
+			list_add_tail(&tmp->write_blobs_list, &blob_list);
 		} else if (is_image_unchanged_from_wim(imd, wim) &&
 			   (write_flags & (WIMLIB_WRITE_FLAG_UNSAFE_COMPACT |
 					   WIMLIB_WRITE_FLAG_APPEND)))
@@ -2188,25 +4181,41 @@ write_metadata_resources(WIMStruct *wim, int image, int write_flags)
 			 * along with the existing file resources, not here.  */
 			if (write_flags & WIMLIB_WRITE_FLAG_APPEND)
 				blob_set_out_reshdr_for_reuse(imd->metadata_blob);
-			ret = 0;
 		} else {
 			/* The metadata resource is in a WIM file other than the
 			 * one being written to.  We need to rewrite it,
 			 * possibly compressed differently; but rebuilding the
 			 * metadata itself isn't necessary.  */
-			ret = write_wim_resource(imd->metadata_blob,
-						 &wim->out_fd,
-						 wim->out_compression_type,
-						 wim->out_chunk_size,
-						 write_resource_flags);
+			imd->metadata_blob->will_be_in_output_wim = 1;
+			list_add_tail(&imd->metadata_blob->write_blobs_list,
+				      &blob_list);
 		}
-		if (ret)
-			return ret;
-	}
 
+		/* Pipable WIMs must contain the metadata resources in order by
+		 * image, but write_blob_list() may reorder the blobs it is
+		 * given; so for them, write each resource by itself.  */
+		if (i == end_image ||
+		    (write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE))
+		{
+			ret = write_metadata_batch(wim, &blob_list, tmp_blobs +
+						   (batch_start - start_image),
+						   batch_start, i,
+						   write_resource_flags,
+						   num_threads);
+			if (ret)
+				goto out_free_batch;
+			batch_start = i + 1;
+		}
+	}
+	FREE(tmp_blobs);
+done:
 	return call_progress(wim->progfunc,
 			     WIMLIB_PROGRESS_MSG_WRITE_METADATA_END,
 			     NULL, wim->progctx);
+
+out_free_batch:
+	FREE(tmp_blobs);
+	return ret;
 }
 
 static int
@@ -2226,10 +4235,14 @@ close_wim_writable(WIMStruct *wim, int write_flags)
 {
 	int ret = 0;
 
-	if (!(write_flags & WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR))
-		if (filedes_valid(&wim->out_fd))
+	if (filedes_valid(&wim->out_fd)) {
+		if (filedes_free_write_buffer(&wim->out_fd))
+			ret = WIMLIB_ERR_WRITE;
+		stop_integrity_hasher(wim);
+		if (!(write_flags & WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR))
 			if (filedes_close(&wim->out_fd))
 				ret = WIMLIB_ERR_WRITE;
+	}
 	filedes_invalidate(&wim->out_fd);
 	return ret;
 }
@@ -2268,11 +4281,8 @@ write_blob_table(WIMStruct *wim, int image, int write_flags,
 	if (write_flags & WIMLIB_WRITE_FLAG_APPEND) {
 		struct blob_descriptor *blob;
 		list_for_each_entry(blob, blob_table_list, blob_table_list) {
-			if (blob->blob_location == BLOB_IN_WIM &&
-			    blob->rdesc->wim == wim)
-			{
+			if (blob_is_in_wim(blob, wim))
 				blob_set_out_reshdr_for_reuse(blob);
-			}
 		}
 	}
 
@@ -2312,7 +4322,10 @@ write_blob_table(WIMStruct *wim, int image, int write_flags,
 					       &wim->out_fd,
 					       wim->out_hdr.part_number,
 					       &wim->out_hdr.blob_table_reshdr,
-					       write_flags_to_resource_flags(write_flags));
+					       (write_flags &
+						WIMLIB_WRITE_FLAG_PIPABLE) != 0,
+					       (write_flags &
+						WIMLIB_WRITE_FLAG_NO_FILE_DATA) != 0);
 }
 
 /*
@@ -2376,10 +4389,12 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 			goto out;
 	}
 
-	/* Write XML data.  */
+	/* Write XML data.  A pack of a blob store describes no images.  */
 	xml_totalbytes = wim->out_fd.offset;
 	if (write_flags & WIMLIB_WRITE_FLAG_USE_EXISTING_TOTALBYTES)
 		xml_totalbytes = WIM_TOTALBYTES_USE_EXISTING;
+	if (write_flags & WIMLIB_WRITE_FLAG_BLOB_STORE_PACK)
+		image = WIMLIB_NO_IMAGE;
 	ret = write_wim_xml_data(wim, image, xml_totalbytes,
 				 &wim->out_hdr.xml_data_reshdr,
 				 write_resource_flags);
@@ -2430,9 +4445,19 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 	if (ret)
 		goto out;
 
+	ret = filedes_flush(&wim->out_fd);
+	if (ret) {
+		ERROR_WITH_ERRNO("Error writing data to WIM file");
+		goto out;
+	}
+
 	ret = WIMLIB_ERR_WRITE;
-	if (unlikely(write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)) {
-		/* Truncate any data the compaction freed up.  */
+	if (unlikely(write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT) ||
+	    wim->out_fd.preallocated)
+	{
+		/* Truncate any data the compaction freed up, or the part of the
+		 * space reserved by preallocate_output_wim() that wasn't
+		 * needed.  */
 		if (ftruncate(wim->out_fd.fd, wim->out_fd.offset) &&
 		    errno != EINVAL) /* allow compaction on untruncatable files,
 					e.g. block devices  */
@@ -2448,6 +4473,10 @@ finish_write(WIMStruct *wim, int image, int write_flags,
 	 * the system is abruptly terminated when the metadata for the rename
 	 * operation has been written to disk, but the new file data has not.
 	 */
+	/* With WIMLIB_WRITE_FLAG_UNCACHED, write back the rest of the data and
+	 * drop it from the page cache.  */
+	filedes_drop_written_data(&wim->out_fd);
+
 	ret = WIMLIB_ERR_WRITE;
 	if (write_flags & WIMLIB_WRITE_FLAG_FSYNC) {
 		if (fsync(wim->out_fd.fd)) {
@@ -2614,7 +4643,7 @@ write_pipable_wim(WIMStruct *wim, int image, int write_flags,
 
 	/* Write metadata resources for the image(s) being included in the
 	 * output WIM.  */
-	ret = write_metadata_resources(wim, image, write_flags);
+	ret = write_metadata_resources(wim, image, write_flags, num_threads);
 	if (ret)
 		return ret;
 
@@ -2628,6 +4657,41 @@ write_pipable_wim(WIMStruct *wim, int image, int write_flags,
 	 * finish_write().  */
 }
 
+/*
+ * Unless a thread pool was set with wimlib_set_thread_pool(), give the WIMStruct
+ * a thread pool for the duration of one write.  Otherwise, each call to
+ * write_blob_list() would create its own threads and compressors, and the
+ * compressors created for the file data couldn't be reused for the metadata
+ * resources.  That matters most for LZMS, whose compressors are large and slow
+ * to set up.  Returns true if a pool was set, in which case
+ * end_write_thread_pool() must be called after the write.
+ */
+static bool
+begin_write_thread_pool(WIMStruct *wim, unsigned num_threads)
+{
+	struct wimlib_thread_pool *pool;
+
+	if (wim->thread_pool)
+		return false;
+	if (wim->out_compression_type == WIMLIB_COMPRESSION_TYPE_NONE &&
+	    wim->out_solid_compression_type == WIMLIB_COMPRESSION_TYPE_NONE)
+		return false;
+	/* On failure, just write without a pool as before.  */
+	if (thread_pool_create(num_threads, &pool))
+		return false;
+	wim->thread_pool = pool;
+	return true;
+}
+
+static void
+end_write_thread_pool(WIMStruct *wim, bool pool_was_set)
+{
+	if (pool_was_set) {
+		thread_pool_put(wim->thread_pool);
+		wim->thread_pool = NULL;
+	}
+}
+
 static bool
 should_default_to_solid_compression(WIMStruct *wim, int write_flags)
 {
@@ -2671,6 +4735,8 @@ write_wim_part(WIMStruct *wim,
 {
 	int ret;
 	struct list_head blob_table_list;
+	struct stats_phase phase;
+	bool pool_was_set = false;
 
 	/* Internally, this is always called with a valid part number and total
 	 * parts.  */
@@ -2706,6 +4772,21 @@ write_wim_part(WIMStruct *wim,
 	if (write_flags & WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)
 		return WIMLIB_ERR_INVALID_PARAM;
 
+	/* NO_FILE_DATA applies only to standalone, non-pipable WIMs.  */
+	if ((write_flags & WIMLIB_WRITE_FLAG_NO_FILE_DATA) &&
+	    (blob_list_override || total_parts != 1 ||
+	     (write_flags & WIMLIB_WRITE_FLAG_PIPABLE)))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	/* RESUMABLE applies only to standalone, non-pipable WIMs written to a
+	 * named file, with file data.  */
+	if ((write_flags & WIMLIB_WRITE_FLAG_RESUMABLE) &&
+	    (blob_list_override || total_parts != 1 ||
+	     (write_flags & (WIMLIB_WRITE_FLAG_PIPABLE |
+			     WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR |
+			     WIMLIB_WRITE_FLAG_NO_FILE_DATA))))
+		return WIMLIB_ERR_INVALID_PARAM;
+
 	/* Include an integrity table by default if no preference was given and
 	 * the WIM already had an integrity table.  */
 	if (!(write_flags & (WIMLIB_WRITE_FLAG_CHECK_INTEGRITY |
@@ -2717,15 +4798,16 @@ write_wim_part(WIMStruct *wim,
 	/* Write a pipable WIM by default if no preference was given and the WIM
 	 * was already pipable.  */
 	if (!(write_flags & (WIMLIB_WRITE_FLAG_PIPABLE |
-			     WIMLIB_WRITE_FLAG_NOT_PIPABLE))) {
+			     WIMLIB_WRITE_FLAG_NOT_PIPABLE |
+			     WIMLIB_WRITE_FLAG_NO_FILE_DATA))) {
 		if (wim_is_pipable(wim))
 			write_flags |= WIMLIB_WRITE_FLAG_PIPABLE;
 	}
 
-	if ((write_flags & (WIMLIB_WRITE_FLAG_PIPABLE |
-			    WIMLIB_WRITE_FLAG_SOLID))
-				    == (WIMLIB_WRITE_FLAG_PIPABLE |
-					WIMLIB_WRITE_FLAG_SOLID))
+	if ((write_flags & WIMLIB_WRITE_FLAG_PIPABLE) &&
+	    (write_flags & (WIMLIB_WRITE_FLAG_SOLID |
+			    WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES |
+			    WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS)))
 	{
 		ERROR("Solid compression is unsupported in pipable WIMs");
 		return WIMLIB_ERR_INVALID_PARAM;
@@ -2741,7 +4823,9 @@ write_wim_part(WIMStruct *wim,
 		wim->out_hdr.magic = WIM_MAGIC;
 
 	/* Set the version number.  */
-	if ((write_flags & WIMLIB_WRITE_FLAG_SOLID) ||
+	if ((write_flags & (WIMLIB_WRITE_FLAG_SOLID |
+			    WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES |
+			    WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS)) ||
 	    wim->out_compression_type == WIMLIB_COMPRESSION_TYPE_LZMS)
 		wim->out_hdr.wim_version = WIM_VERSION_SOLID;
 	else
@@ -2788,15 +4872,18 @@ write_wim_part(WIMStruct *wim,
 	wim->out_hdr.part_number = part_number;
 	wim->out_hdr.total_parts = total_parts;
 
-	/* Set the image count.  */
-	if (image == WIMLIB_ALL_IMAGES)
+	/* Set the image count.  A pack of a blob store holds only file data
+	 * for the image(s), not the images themselves.  */
+	if (write_flags & WIMLIB_WRITE_FLAG_BLOB_STORE_PACK)
+		wim->out_hdr.image_count = 0;
+	else if (image == WIMLIB_ALL_IMAGES)
 		wim->out_hdr.image_count = wim->hdr.image_count;
 	else
 		wim->out_hdr.image_count = 1;
 
 	/* Set the boot index.  */
 	wim->out_hdr.boot_idx = 0;
-	if (total_parts == 1) {
+	if (total_parts == 1 && wim->out_hdr.image_count != 0) {
 		if (image == WIMLIB_ALL_IMAGES)
 			wim->out_hdr.boot_idx = wim->hdr.boot_idx;
 		else if (image == wim->hdr.boot_idx)
@@ -2808,6 +4895,8 @@ write_wim_part(WIMStruct *wim,
 	if (ret)
 		return ret;
 
+	stats_begin_phase(&phase);
+
 	/* Set up the output file descriptor.  */
 	if (write_flags & WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR) {
 		/* File descriptor was explicitly provided.  */
@@ -2825,13 +4914,31 @@ write_wim_part(WIMStruct *wim,
 		}
 	} else {
 		/* Filename of WIM to write was provided; open file descriptor
-		 * to it.  */
+		 * to it.  When resuming an interrupted write, keep the data
+		 * that was already written.  */
+		int open_flags = O_TRUNC | O_CREAT | O_RDWR;
+
+		if (write_flags & WIMLIB_WRITE_FLAG_RESUMABLE) {
+			ret = write_checkpoint_open((const tchar *)path_or_fd,
+						    &wim->out_hdr,
+						    &wim->write_checkpoint);
+			if (ret)
+				goto out_cleanup;
+			if (write_checkpoint_resume_offset(wim->write_checkpoint))
+				open_flags &= ~O_TRUNC;
+		}
 		ret = open_wim_writable(wim, (const tchar*)path_or_fd,
-					O_TRUNC | O_CREAT | O_RDWR);
+					open_flags);
 		if (ret)
 			goto out_cleanup;
 	}
 
+	if (write_flags & WIMLIB_WRITE_FLAG_UNCACHED)
+		filedes_set_uncached(&wim->out_fd);
+	filedes_set_write_buffer(&wim->out_fd, wim->out_buffer_size);
+	if (write_flags & WIMLIB_WRITE_FLAG_CHECK_INTEGRITY)
+		start_integrity_hasher(wim);
+
 	/* Write initial header.  This is merely a "dummy" header since it
 	 * doesn't have resource entries filled in yet, so it will be
 	 * overwritten later (unless writing a pipable WIM).  */
@@ -2842,6 +4949,24 @@ write_wim_part(WIMStruct *wim,
 	if (ret)
 		goto out_cleanup;
 
+	/* Continue after the last resource recorded in the checkpoint,
+	 * discarding any partially written data after it.  */
+	if (wim->write_checkpoint &&
+	    write_checkpoint_resume_offset(wim->write_checkpoint))
+	{
+		off_t offset = write_checkpoint_resume_offset(wim->write_checkpoint);
+
+		if (filedes_seek(&wim->out_fd, offset) != offset ||
+		    ftruncate(wim->out_fd.fd, offset))
+		{
+			ERROR_WITH_ERRNO("Error resuming write of WIM file");
+			ret = WIMLIB_ERR_WRITE;
+			goto out_cleanup;
+		}
+	}
+
+	pool_was_set = begin_write_thread_pool(wim, num_threads);
+
 	/* Write file data and metadata resources.  */
 	if (!(write_flags & WIMLIB_WRITE_FLAG_PIPABLE)) {
 		/* Default case: create a normal (non-pipable) WIM.  */
@@ -2852,7 +4977,8 @@ write_wim_part(WIMStruct *wim,
 		if (ret)
 			goto out_cleanup;
 
-		ret = write_metadata_resources(wim, image, write_flags);
+		ret = write_metadata_resources(wim, image, write_flags,
+					       num_threads);
 		if (ret)
 			goto out_cleanup;
 	} else {
@@ -2867,7 +4993,19 @@ write_wim_part(WIMStruct *wim,
 	/* Write blob table, XML data, and (optional) integrity table.  */
 	ret = finish_write(wim, image, write_flags, &blob_table_list);
 out_cleanup:
+	end_write_thread_pool(wim, pool_was_set);
+	/* Commit the blobs written so far so that the write can be resumed,
+	 * unless the failure may have lost data that was already buffered.  */
+	if (ret && ret != WIMLIB_ERR_WRITE && wim->write_checkpoint &&
+	    filedes_valid(&wim->out_fd))
+		(void)write_checkpoint_commit(wim->write_checkpoint,
+					      &wim->out_fd);
 	(void)close_wim_writable(wim, write_flags);
+	write_checkpoint_close(wim->write_checkpoint, ret == 0);
+	wim->write_checkpoint = NULL;
+	stats_end_phase(&phase, write);
+	if (!ret)
+		ret = report_stats(wim->progfunc, wim->progctx);
 	return ret;
 }
 
@@ -2930,8 +5068,7 @@ check_resource_offset(struct blob_descriptor *blob, void *_wim)
 	const WIMStruct *wim = _wim;
 	off_t end_offset = *(const off_t*)wim->private;
 
-	if (blob->blob_location == BLOB_IN_WIM &&
-	    blob->rdesc->wim == wim &&
+	if (blob_is_in_wim(blob, wim) &&
 	    blob->rdesc->offset_in_wim + blob->rdesc->size_in_wim > end_offset)
 		return WIMLIB_ERR_RESOURCE_ORDER;
 	return 0;
@@ -2964,8 +5101,7 @@ free_blob_if_invalidated(struct blob_descriptor *blob, void *_wim)
 {
 	const WIMStruct *wim = _wim;
 
-	if (!blob->will_be_in_output_wim &&
-	    blob->blob_location == BLOB_IN_WIM && blob->rdesc->wim == wim)
+	if (!blob->will_be_in_output_wim && blob_is_in_wim(blob, wim))
 	{
 		blob_table_unlink(wim->blob_table, blob);
 		free_blob_descriptor(blob);
@@ -2973,6 +5109,102 @@ free_blob_if_invalidated(struct blob_descriptor *blob, void *_wim)
 	return 0;
 }
 
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+
+struct wim_extent {
+	u64 offset;
+	u64 size;
+};
+
+static int
+cmp_extents_by_offset(const void *p1, const void *p2)
+{
+	const struct wim_extent *e1 = p1, *e2 = p2;
+
+	return cmp_u64(e1->offset, e2->offset);
+}
+
+/*
+ * After a soft delete has been committed, deallocate the parts of the old WIM
+ * file contents (before @old_wim_end) which are no longer referenced by the new
+ * blob table on @blob_table_list, such as the resources that only the deleted
+ * images used and the old blob table and XML data.  The file size and the
+ * offsets of all resources stay the same, so this is just as cheap and safe as
+ * the soft delete itself, but the disk space is reclaimed without rebuilding
+ * the WIM file.  This is best-effort: it does nothing if the filesystem doesn't
+ * support punching holes.
+ *
+ * This isn't done if the WIM file has an integrity table, since that covers
+ * the unreferenced data as well.
+ */
+static void
+punch_unreferenced_extents(WIMStruct *wim, struct list_head *blob_table_list,
+			   u64 old_wim_end)
+{
+	struct blob_descriptor *blob;
+	struct wim_extent *extents;
+	size_t num_extents = 0;
+	size_t i;
+	u64 pos;
+	int raw_fd;
+
+	list_for_each_entry(blob, blob_table_list, blob_table_list)
+		num_extents++;
+	extents = MALLOC((num_extents + 1) * sizeof(extents[0]));
+	if (!extents)
+		return;
+
+	i = 0;
+	list_for_each_entry(blob, blob_table_list, blob_table_list) {
+		if (blob->out_reshdr.flags & WIM_RESHDR_FLAG_SOLID) {
+			extents[i].offset = blob->out_res_offset_in_wim;
+			extents[i].size = blob->out_res_size_in_wim;
+		} else {
+			extents[i].offset = blob->out_reshdr.offset_in_wim;
+			extents[i].size = blob->out_reshdr.size_in_wim;
+		}
+		i++;
+	}
+	qsort(extents, num_extents, sizeof(extents[0]), cmp_extents_by_offset);
+
+	raw_fd = topen(wim->filename, O_WRONLY | O_BINARY);
+	if (raw_fd < 0)
+		goto out_free_extents;
+
+	/* The new header must be on disk before any data that the old header
+	 * references is deallocated.  */
+	if (fsync(raw_fd))
+		goto out_close;
+
+	pos = WIM_HEADER_DISK_SIZE;
+	for (i = 0; i <= num_extents && pos < old_wim_end; i++) {
+		u64 end = old_wim_end;
+
+		if (i < num_extents)
+			end = min(extents[i].offset, old_wim_end);
+		if (end > pos &&
+		    fallocate(raw_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      pos, end - pos))
+			break;
+		if (i < num_extents)
+			pos = max(pos, extents[i].offset + extents[i].size);
+	}
+out_close:
+	close(raw_fd);
+out_free_extents:
+	FREE(extents);
+}
+
+#else /* HAVE_FALLOCATE && FALLOC_FL_PUNCH_HOLE */
+
+static void
+punch_unreferenced_extents(WIMStruct *wim, struct list_head *blob_table_list,
+			   u64 old_wim_end)
+{
+}
+
+#endif /* !(HAVE_FALLOCATE && FALLOC_FL_PUNCH_HOLE) */
+
 /*
  * Overwrite a WIM, possibly appending new resources to it.
  *
@@ -3029,6 +5261,17 @@ free_blob_if_invalidated(struct blob_descriptor *blob, void *_wim)
  * and integrity table were.  (These usually only take up a small amount of
  * space compared to the blobs, however.)
  *
+ * Note that the new blob table always contains an entry for every blob in the
+ * WIM, not just the new ones, so appending a small image to a WIM with very
+ * many blobs still takes time proportional to the number of blobs.  This can't
+ * be avoided by writing only the new entries somewhere else, since the WIM
+ * format has exactly one blob table, and other software (and earlier versions
+ * of wimlib) would not see any blobs described elsewhere.  Also, the entries of
+ * existing blobs can't simply be copied from the old blob table, since their
+ * reference counts change when images are added or deleted.  The old integrity
+ * table, on the other hand, is reused for the data that precedes the old blob
+ * table; see write_integrity_table().
+ *
  * Finally, this function also supports "compaction" overwrites as an
  * alternative to the normal "append" overwrites described above.  In a
  * compaction, data is written starting immediately from the end of the header.
@@ -3050,6 +5293,10 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	struct list_head blob_list;
 	struct list_head blob_table_list;
 	struct filter_context filter_ctx;
+	struct stats_phase phase;
+	bool pool_was_set = false;
+
+	stats_begin_phase(&phase);
 
 	/* Include an integrity table by default if no preference was given and
 	 * the WIM already had an integrity table.  */
@@ -3058,12 +5305,18 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 		if (wim_has_integrity_table(wim))
 			write_flags |= WIMLIB_WRITE_FLAG_CHECK_INTEGRITY;
 
+	/* Data will be written to the WIM file, and it may be truncated on
+	 * failure, so stop reading it through a memory mapping.  */
+	filedes_unmap(&wim->in_fd);
+
 	/* Start preparing the updated file header.  */
 	memcpy(&wim->out_hdr, &wim->hdr, sizeof(wim->out_hdr));
 
 	/* If using solid compression, the version number must be set to
 	 * WIM_VERSION_SOLID.  */
-	if (write_flags & WIMLIB_WRITE_FLAG_SOLID)
+	if (write_flags & (WIMLIB_WRITE_FLAG_SOLID |
+			   WIMLIB_WRITE_FLAG_SOLID_SMALL_FILES |
+			   WIMLIB_WRITE_FLAG_LARGE_FILE_CHUNKS))
 		wim->out_hdr.wim_version = WIM_VERSION_SOLID;
 
 	/* Default to solid compression if it is valid in the chosen WIM file
@@ -3108,9 +5361,14 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	} else {
 		u64 old_blob_table_end, old_xml_begin, old_xml_end;
 
-		/* Set additional flags for append.  */
-		write_flags |= WIMLIB_WRITE_FLAG_APPEND |
-			       WIMLIB_WRITE_FLAG_STREAMS_OK;
+		/* Set additional flags for append.  After a soft delete, find
+		 * the blobs still referenced by walking the remaining images
+		 * rather than trusting the blob table, so that the blobs only
+		 * the deleted images used are dropped and their space can be
+		 * reclaimed; see punch_unreferenced_extents().  */
+		write_flags |= WIMLIB_WRITE_FLAG_APPEND;
+		if (!wim->image_deletion_occurred)
+			write_flags |= WIMLIB_WRITE_FLAG_STREAMS_OK;
 
 		/* Make sure there is no data after the XML data, except
 		 * possibily an integrity table.  If this were the case, then
@@ -3202,12 +5460,21 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 		goto out_restore_hdr;
 	}
 
+	if (write_flags & WIMLIB_WRITE_FLAG_UNCACHED)
+		filedes_set_uncached(&wim->out_fd);
+	filedes_set_write_buffer(&wim->out_fd, wim->out_buffer_size);
+	if (write_flags & WIMLIB_WRITE_FLAG_CHECK_INTEGRITY)
+		start_integrity_hasher(wim);
+
+	pool_was_set = begin_write_thread_pool(wim, num_threads);
+
 	ret = write_file_data_blobs(wim, &blob_list, write_flags,
 				    num_threads, &filter_ctx);
 	if (ret)
 		goto out_truncate;
 
-	ret = write_metadata_resources(wim, WIMLIB_ALL_IMAGES, write_flags);
+	ret = write_metadata_resources(wim, WIMLIB_ALL_IMAGES, write_flags,
+				       num_threads);
 	if (ret)
 		goto out_truncate;
 
@@ -3216,14 +5483,21 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (ret)
 		goto out_truncate;
 
+	if (wim->image_deletion_occurred &&
+	    !(write_flags & (WIMLIB_WRITE_FLAG_UNSAFE_COMPACT |
+			     WIMLIB_WRITE_FLAG_CHECK_INTEGRITY)))
+		punch_unreferenced_extents(wim, &blob_table_list, old_wim_end);
+
 	unlock_wim_for_append(wim);
-	return 0;
+	ret = 0;
+	goto out;
 
 out_truncate:
 	if (!(write_flags & (WIMLIB_WRITE_FLAG_NO_NEW_BLOBS |
 			     WIMLIB_WRITE_FLAG_UNSAFE_COMPACT))) {
 		WARNING("Truncating \"%"TS"\" to its original size "
 			"(%"PRIu64" bytes)", wim->filename, old_wim_end);
+		(void)filedes_free_write_buffer(&wim->out_fd);
 		if (ftruncate(wim->out_fd.fd, old_wim_end))
 			WARNING_WITH_ERRNO("Failed to truncate WIM file!");
 	}
@@ -3234,7 +5508,19 @@ out_unlock_wim:
 out_close_wim:
 	(void)close_wim_writable(wim, write_flags);
 out:
+	end_write_thread_pool(wim, pool_was_set);
+	/* Resources may have been moved by in-place compaction, and new data
+	 * may have been written where the old blob table was, so forget any
+	 * cached chunks, which are identified by resource offsets.  Chunks in
+	 * a shared cache are also identified by the modification time of the
+	 * file, so just stop matching the ones cached before.  */
+	if (wim->chunk_cache)
+		chunk_cache_clear(wim->chunk_cache);
+	shared_chunk_cache_set_file(wim->shared_chunk_cache, &wim->in_fd);
 	wim->being_compacted = 0;
+	stats_end_phase(&phase, write);
+	if (!ret)
+		ret = report_stats(wim->progfunc, wim->progctx);
 	return ret;
 }
 
@@ -3266,6 +5552,9 @@ overwrite_wim_via_tmpfile(WIMStruct *wim, int write_flags, unsigned num_threads)
 		filedes_close(&wim->in_fd);
 		filedes_invalidate(&wim->in_fd);
 	}
+	if (wim->chunk_cache)
+		chunk_cache_clear(wim->chunk_cache);
+	shared_chunk_cache_set_file(wim->shared_chunk_cache, &wim->in_fd);
 
 	/* Rename the new WIM file to the original WIM file.  Note: on Windows
 	 * this actually calls win32_rename_replacement(), not _wrename(), so
@@ -3330,6 +5619,15 @@ wimlib_overwrite(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (write_flags & ~WIMLIB_WRITE_MASK_PUBLIC)
 		return WIMLIB_ERR_INVALID_PARAM;
 
+	/* The file data in the WIM would be lost.  */
+	if (write_flags & WIMLIB_WRITE_FLAG_NO_FILE_DATA)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	/* A rebuild writes to a temporary file with a random name, so it
+	 * couldn't be resumed.  */
+	if (write_flags & WIMLIB_WRITE_FLAG_RESUMABLE)
+		return WIMLIB_ERR_INVALID_PARAM;
+
 	if (!wim->filename)
 		return WIMLIB_ERR_NO_FILENAME;
 
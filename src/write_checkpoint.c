@@ -0,0 +1,540 @@
+/*
+ * write_checkpoint.c
+ *
+ * Checkpoints that allow an interrupted write of a WIM file to be resumed.
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * With WIMLIB_WRITE_FLAG_RESUMABLE, wimlib_write() records where the data of
+ * each blob it has written ended up in a checkpoint file next to the WIM file,
+ * named by appending ".checkpoint" to the name of the WIM file.  If the write
+ * is interrupted and then started again with the same arguments, the file data
+ * already in the partially written WIM file is kept, and each blob that has a
+ * record in the checkpoint file is pointed to its data there instead of being
+ * written again.  The new data is appended after the last recorded resource.
+ *
+ * The checkpoint file holds a header, which identifies the WIM file being
+ * written and the settings that affect its non-solid resources, followed by
+ * batches of records.  A batch is appended only after the WIM file's data has
+ * been synced to disk, and it ends with the SHA-1 message digest of its
+ * contents, so a batch that was only partly written when the system crashed is
+ * recognized and ignored, together with anything after it.  A batch is
+ * committed after about CHECKPOINT_INTERVAL bytes have been written to the WIM
+ * file, and when the write fails.
+ *
+ * The records are only ever for resources that were complete, so the blobs of
+ * a solid resource are only recorded once the whole resource has been written.
+ * The checkpoint file is deleted once the write has succeeded.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wimlib/blob_table.h"
+#include "wimlib/endianness.h"
+#include "wimlib/error.h"
+#include "wimlib/file_io.h"
+#include "wimlib/header.h"
+#include "wimlib/resource.h"
+#include "wimlib/util.h"
+#include "wimlib/write_checkpoint.h"
+
+/* "WIMCKPT\0"  */
+#define CHECKPOINT_MAGIC	0x0054504b434d4957ULL
+#define CHECKPOINT_VERSION	1
+
+/* "BTCH"  */
+#define CHECKPOINT_BATCH_MAGIC	0x48435442
+
+/* Number of bytes written to the WIM file after which the records of the
+ * blobs written since the last commit are committed.  */
+#define CHECKPOINT_INTERVAL	(256ULL << 20)
+
+/* The header flags that affect the format of non-solid resources  */
+#define CHECKPOINT_HDR_FLAGS	(WIM_HDR_FLAG_COMPRESSION |		\
+				 WIM_HDR_FLAG_COMPRESS_XPRESS |		\
+				 WIM_HDR_FLAG_COMPRESS_LZX |		\
+				 WIM_HDR_FLAG_COMPRESS_LZMS)
+
+struct checkpoint_header_disk {
+	le64 magic;
+	le32 version;
+	le32 wim_version;
+	le32 wim_flags;
+	le32 chunk_size;
+	u8 guid[GUID_SIZE];
+} __attribute__((packed));
+
+/* A batch starts with this, is followed by @num_records records, and ends with
+ * the SHA-1 message digest of the header and records.  */
+struct checkpoint_batch_disk {
+	le32 magic;
+	le32 num_records;
+} __attribute__((packed));
+
+struct checkpoint_record_disk {
+	u8 hash[SHA1_HASH_SIZE];
+	le64 size;
+	le64 offset_in_wim;
+	le64 size_in_wim;
+	le64 uncompressed_size;
+	le64 res_offset_in_wim;
+	le64 res_size_in_wim;
+	le64 res_uncompressed_size;
+	le32 flags;
+} __attribute__((packed));
+
+struct checkpoint_record {
+	u8 hash[SHA1_HASH_SIZE];
+	u64 size;
+	struct wim_reshdr reshdr;
+	u64 res_offset_in_wim;
+	u64 res_size_in_wim;
+	u64 res_uncompressed_size;
+};
+
+struct write_checkpoint {
+	struct filedes fd;
+	tchar *path;
+
+	/* Size of the valid part of the checkpoint file  */
+	u64 file_size;
+
+	/* The records loaded from the checkpoint file, sorted by hash, and
+	 * their blob sizes, sorted  */
+	struct checkpoint_record *records;
+	u64 *sizes;
+	size_t num_records;
+
+	/* End of the last resource recorded in the loaded records, or 0 if
+	 * the write is not being resumed  */
+	u64 resume_offset;
+
+	/* The batch being built: a batch header followed by @num_pending
+	 * records.  Space for the digest is allocated too.  */
+	u8 *batch;
+	size_t num_pending;
+	size_t num_alloc_pending;
+
+	/* Offset in the WIM file at the time of the last commit  */
+	u64 commit_offset;
+};
+
+static void
+record_from_disk(struct checkpoint_record *rec,
+		 const struct checkpoint_record_disk *disk)
+{
+	copy_hash(rec->hash, disk->hash);
+	rec->size = le64_to_cpu(disk->size);
+	rec->reshdr.offset_in_wim = le64_to_cpu(disk->offset_in_wim);
+	rec->reshdr.size_in_wim = le64_to_cpu(disk->size_in_wim);
+	rec->reshdr.uncompressed_size = le64_to_cpu(disk->uncompressed_size);
+	rec->reshdr.flags = le32_to_cpu(disk->flags);
+	rec->res_offset_in_wim = le64_to_cpu(disk->res_offset_in_wim);
+	rec->res_size_in_wim = le64_to_cpu(disk->res_size_in_wim);
+	rec->res_uncompressed_size = le64_to_cpu(disk->res_uncompressed_size);
+}
+
+/* Return the offset in the WIM file of the end of the resource holding the
+ * recorded blob.  */
+static u64
+record_end(const struct checkpoint_record *rec)
+{
+	if (rec->reshdr.flags & WIM_RESHDR_FLAG_SOLID)
+		return rec->res_offset_in_wim + rec->res_size_in_wim;
+	return rec->reshdr.offset_in_wim + rec->reshdr.size_in_wim;
+}
+
+static int
+cmp_records_by_hash(const void *p1, const void *p2)
+{
+	const struct checkpoint_record *rec1 = p1, *rec2 = p2;
+
+	return hashes_cmp(rec1->hash, rec2->hash);
+}
+
+static int
+cmp_sizes(const void *p1, const void *p2)
+{
+	return cmp_u64(*(const u64 *)p1, *(const u64 *)p2);
+}
+
+/* Return true if the file at @wim_path is an unfinished WIM file with the GUID
+ * @guid and at least @size bytes long, i.e. presumably the one the checkpoint
+ * was written for.  */
+static bool
+is_unfinished_wim(const tchar *wim_path, const u8 guid[GUID_SIZE], u64 size)
+{
+	struct wim_header_disk disk_hdr __attribute__((aligned(8)));
+	struct filedes fd;
+	struct stat stbuf;
+	int raw_fd;
+	bool ret;
+
+	raw_fd = topen(wim_path, O_RDONLY | O_BINARY);
+	if (raw_fd < 0)
+		return false;
+	filedes_init(&fd, raw_fd);
+	ret = !fstat(raw_fd, &stbuf) && stbuf.st_size >= size &&
+	      !full_pread(&fd, &disk_hdr, sizeof(disk_hdr), 0) &&
+	      le64_to_cpu(disk_hdr.magic) == WIM_MAGIC &&
+	      (le32_to_cpu(disk_hdr.wim_flags) &
+	       WIM_HDR_FLAG_WRITE_IN_PROGRESS) &&
+	      guids_equal(disk_hdr.guid, guid);
+	filedes_close(&fd);
+	return ret;
+}
+
+/* Load the records from the checkpoint file.  Return true if the write of the
+ * WIM described by @out_hdr can be resumed from them, after setting the GUID in
+ * @out_hdr to the one of the partially written WIM file.  */
+static bool
+load_checkpoint(struct write_checkpoint *cp, const tchar *wim_path,
+		struct wim_header *out_hdr)
+{
+	const struct checkpoint_header_disk *hdr;
+	struct stat stbuf;
+	u8 *buf = NULL;
+	u64 size;
+	u64 pos;
+	size_t num_alloc = 0;
+	size_t i;
+
+	if (fstat(cp->fd.fd, &stbuf) || stbuf.st_size < sizeof(*hdr))
+		return false;
+	size = stbuf.st_size;
+	buf = MALLOC(size);
+	if (!buf)
+		return false;
+	if (full_pread(&cp->fd, buf, size, 0))
+		goto out_invalid;
+
+	hdr = (const struct checkpoint_header_disk *)buf;
+	if (le64_to_cpu(hdr->magic) != CHECKPOINT_MAGIC ||
+	    le32_to_cpu(hdr->version) != CHECKPOINT_VERSION)
+		goto out_invalid;
+
+	pos = sizeof(*hdr);
+	while (size - pos >= sizeof(struct checkpoint_batch_disk)) {
+		const struct checkpoint_batch_disk *batch =
+			(const struct checkpoint_batch_disk *)&buf[pos];
+		const struct checkpoint_record_disk *disk_recs =
+			(const struct checkpoint_record_disk *)(batch + 1);
+		u32 n = le32_to_cpu(batch->num_records);
+		u64 len = sizeof(*batch) + (u64)n * sizeof(disk_recs[0]);
+		u8 hash[SHA1_HASH_SIZE];
+
+		if (le32_to_cpu(batch->magic) != CHECKPOINT_BATCH_MAGIC ||
+		    size - pos < len + SHA1_HASH_SIZE)
+			break;
+		sha1(batch, len, hash);
+		if (!hashes_equal(hash, &buf[pos + len]))
+			break;
+
+		if (cp->num_records + n > num_alloc) {
+			size_t new_num_alloc = max(cp->num_records + n,
+						   2 * num_alloc);
+			void *p = REALLOC(cp->records, new_num_alloc *
+						       sizeof(cp->records[0]));
+			if (!p)
+				goto out_invalid;
+			cp->records = p;
+			num_alloc = new_num_alloc;
+		}
+		for (i = 0; i < n; i++) {
+			struct checkpoint_record *rec =
+				&cp->records[cp->num_records++];
+
+			record_from_disk(rec, &disk_recs[i]);
+			cp->resume_offset = max(cp->resume_offset,
+						record_end(rec));
+		}
+		pos += len + SHA1_HASH_SIZE;
+	}
+	if (cp->num_records == 0)
+		goto out_invalid;
+
+	/* Only resume writing the same kind of WIM file.  Solid resources
+	 * record their own compression settings, but non-solid resources must
+	 * use the ones from the WIM header.  */
+	if (le32_to_cpu(hdr->wim_version) != out_hdr->wim_version ||
+	    le32_to_cpu(hdr->wim_flags) !=
+			(out_hdr->flags & CHECKPOINT_HDR_FLAGS) ||
+	    le32_to_cpu(hdr->chunk_size) != out_hdr->chunk_size)
+	{
+		WARNING("Not resuming the write of \"%"TS"\" from the checkpoint\n"
+			"          since the compression settings have changed",
+			wim_path);
+		goto out_invalid;
+	}
+	if (!is_unfinished_wim(wim_path, hdr->guid, cp->resume_offset)) {
+		WARNING("Ignoring checkpoint \"%"TS"\", which doesn't match the\n"
+			"          WIM file being written", cp->path);
+		goto out_invalid;
+	}
+
+	cp->sizes = MALLOC(cp->num_records * sizeof(cp->sizes[0]));
+	if (!cp->sizes)
+		goto out_invalid;
+	qsort(cp->records, cp->num_records, sizeof(cp->records[0]),
+	      cmp_records_by_hash);
+	for (i = 0; i < cp->num_records; i++)
+		cp->sizes[i] = cp->records[i].size;
+	qsort(cp->sizes, cp->num_records, sizeof(cp->sizes[0]), cmp_sizes);
+
+	copy_guid(out_hdr->guid, hdr->guid);
+	cp->file_size = pos;
+	FREE(buf);
+	return true;
+
+out_invalid:
+	FREE(cp->records);
+	cp->records = NULL;
+	cp->num_records = 0;
+	cp->resume_offset = 0;
+	FREE(buf);
+	return false;
+}
+
+/* Discard the contents of the checkpoint file and write a new header to it.  */
+static int
+reset_checkpoint(struct write_checkpoint *cp, const struct wim_header *out_hdr)
+{
+	struct checkpoint_header_disk hdr;
+
+	hdr.magic = cpu_to_le64(CHECKPOINT_MAGIC);
+	hdr.version = cpu_to_le32(CHECKPOINT_VERSION);
+	hdr.wim_version = cpu_to_le32(out_hdr->wim_version);
+	hdr.wim_flags = cpu_to_le32(out_hdr->flags & CHECKPOINT_HDR_FLAGS);
+	hdr.chunk_size = cpu_to_le32(out_hdr->chunk_size);
+	copy_guid(hdr.guid, out_hdr->guid);
+
+	if (ftruncate(cp->fd.fd, 0) ||
+	    full_pwrite(&cp->fd, &hdr, sizeof(hdr), 0) ||
+	    fsync(cp->fd.fd))
+	{
+		ERROR_WITH_ERRNO("Error writing checkpoint \"%"TS"\"", cp->path);
+		return WIMLIB_ERR_WRITE;
+	}
+	cp->file_size = sizeof(hdr);
+	return 0;
+}
+
+/*
+ * Open the checkpoint file for writing the WIM file @wim_path with the header
+ * @out_hdr.  If the checkpoint file is left over from an interrupted write of
+ * that WIM file with the same compression settings, load its records, and set
+ * the GUID in @out_hdr to the one of the partially written WIM file; the write
+ * should then continue at write_checkpoint_resume_offset().  Otherwise, start
+ * a new checkpoint.
+ */
+int
+write_checkpoint_open(const tchar *wim_path, struct wim_header *out_hdr,
+		      struct write_checkpoint **cp_ret)
+{
+	static const tchar suffix[] = T(".checkpoint");
+	size_t path_len = tstrlen(wim_path);
+	struct write_checkpoint *cp;
+	int raw_fd;
+	int ret;
+
+	cp = CALLOC(1, sizeof(*cp));
+	if (!cp)
+		return WIMLIB_ERR_NOMEM;
+	cp->path = MALLOC((path_len + ARRAY_LEN(suffix)) * sizeof(tchar));
+	if (!cp->path) {
+		FREE(cp);
+		return WIMLIB_ERR_NOMEM;
+	}
+	tmemcpy(cp->path, wim_path, path_len);
+	tmemcpy(&cp->path[path_len], suffix, ARRAY_LEN(suffix));
+
+	raw_fd = topen(cp->path, O_RDWR | O_CREAT | O_BINARY, 0644);
+	if (raw_fd < 0) {
+		ERROR_WITH_ERRNO("Failed to open checkpoint \"%"TS"\"",
+				 cp->path);
+		FREE(cp->path);
+		FREE(cp);
+		return WIMLIB_ERR_OPEN;
+	}
+	filedes_init(&cp->fd, raw_fd);
+
+	if (!load_checkpoint(cp, wim_path, out_hdr)) {
+		ret = reset_checkpoint(cp, out_hdr);
+		if (ret) {
+			write_checkpoint_close(cp, false);
+			return ret;
+		}
+	}
+	cp->commit_offset = cp->resume_offset;
+	*cp_ret = cp;
+	return 0;
+}
+
+/* Return the offset in the WIM file at which the write should continue, or 0
+ * if it is a new write.  */
+u64
+write_checkpoint_resume_offset(const struct write_checkpoint *cp)
+{
+	return cp->resume_offset;
+}
+
+/* Return true if a blob of the given size was recorded, so that it is worth
+ * checksumming an unhashed blob of that size to look it up.  */
+bool
+write_checkpoint_has_size(const struct write_checkpoint *cp, u64 size)
+{
+	return cp->num_records &&
+	       bsearch(&size, cp->sizes, cp->num_records, sizeof(cp->sizes[0]),
+		       cmp_sizes) != NULL;
+}
+
+/* If a blob with the SHA-1 message digest @hash and the size of @blob was
+ * recorded, set the location of @blob in the WIM file being written to the
+ * recorded one and return true.  */
+bool
+write_checkpoint_restore_blob(const struct write_checkpoint *cp,
+			      const u8 hash[SHA1_HASH_SIZE],
+			      struct blob_descriptor *blob)
+{
+	struct checkpoint_record key;
+	const struct checkpoint_record *rec;
+
+	if (!cp->num_records)
+		return false;
+	copy_hash(key.hash, hash);
+	rec = bsearch(&key, cp->records, cp->num_records,
+		      sizeof(cp->records[0]), cmp_records_by_hash);
+	if (!rec || rec->size != blob->size)
+		return false;
+
+	blob->out_reshdr = rec->reshdr;
+	if (rec->reshdr.flags & WIM_RESHDR_FLAG_SOLID) {
+		blob->out_res_offset_in_wim = rec->res_offset_in_wim;
+		blob->out_res_size_in_wim = rec->res_size_in_wim;
+		blob->out_res_uncompressed_size = rec->res_uncompressed_size;
+	}
+	return true;
+}
+
+/* Record that the data of @blob, which was just written to @out_fd, is
+ * complete, and commit the records if enough has been written since the last
+ * commit.  */
+int
+write_checkpoint_add_blob(struct write_checkpoint *cp,
+			  const struct blob_descriptor *blob,
+			  struct filedes *out_fd)
+{
+	struct checkpoint_record_disk *disk;
+
+	if (cp->num_pending == cp->num_alloc_pending) {
+		size_t n = max(64, 2 * cp->num_alloc_pending);
+		u8 *batch = REALLOC(cp->batch,
+				    sizeof(struct checkpoint_batch_disk) +
+				    n * sizeof(*disk) + SHA1_HASH_SIZE);
+		if (!batch)
+			return WIMLIB_ERR_NOMEM;
+		cp->batch = batch;
+		cp->num_alloc_pending = n;
+	}
+	disk = (struct checkpoint_record_disk *)
+		(cp->batch + sizeof(struct checkpoint_batch_disk)) +
+		cp->num_pending++;
+
+	copy_hash(disk->hash, blob->hash);
+	disk->size = cpu_to_le64(blob->size);
+	disk->offset_in_wim = cpu_to_le64(blob->out_reshdr.offset_in_wim);
+	disk->size_in_wim = cpu_to_le64(blob->out_reshdr.size_in_wim);
+	disk->uncompressed_size =
+		cpu_to_le64(blob->out_reshdr.uncompressed_size);
+	disk->flags = cpu_to_le32(blob->out_reshdr.flags);
+	if (blob->out_reshdr.flags & WIM_RESHDR_FLAG_SOLID) {
+		disk->res_offset_in_wim =
+			cpu_to_le64(blob->out_res_offset_in_wim);
+		disk->res_size_in_wim = cpu_to_le64(blob->out_res_size_in_wim);
+		disk->res_uncompressed_size =
+			cpu_to_le64(blob->out_res_uncompressed_size);
+	} else {
+		disk->res_offset_in_wim = 0;
+		disk->res_size_in_wim = 0;
+		disk->res_uncompressed_size = 0;
+	}
+
+	if (out_fd->offset - cp->commit_offset < CHECKPOINT_INTERVAL)
+		return 0;
+	return write_checkpoint_commit(cp, out_fd);
+}
+
+/* Make the data written to @out_fd so far durable, then append the pending
+ * records to the checkpoint file.  */
+int
+write_checkpoint_commit(struct write_checkpoint *cp, struct filedes *out_fd)
+{
+	struct checkpoint_batch_disk *batch;
+	size_t len;
+
+	if (cp->num_pending == 0)
+		return 0;
+
+	if (filedes_flush(out_fd) || fsync(out_fd->fd)) {
+		ERROR_WITH_ERRNO("Error writing data to WIM file");
+		return WIMLIB_ERR_WRITE;
+	}
+
+	batch = (struct checkpoint_batch_disk *)cp->batch;
+	batch->magic = cpu_to_le32(CHECKPOINT_BATCH_MAGIC);
+	batch->num_records = cpu_to_le32(cp->num_pending);
+	len = sizeof(*batch) +
+	      cp->num_pending * sizeof(struct checkpoint_record_disk);
+	sha1(batch, len, &cp->batch[len]);
+	len += SHA1_HASH_SIZE;
+
+	if (full_pwrite(&cp->fd, batch, len, cp->file_size) ||
+	    fsync(cp->fd.fd))
+	{
+		ERROR_WITH_ERRNO("Error writing checkpoint \"%"TS"\"", cp->path);
+		return WIMLIB_ERR_WRITE;
+	}
+	cp->file_size += len;
+	cp->num_pending = 0;
+	cp->commit_offset = out_fd->offset;
+	return 0;
+}
+
+/* Close the checkpoint file, deleting it if @remove is true.  */
+void
+write_checkpoint_close(struct write_checkpoint *cp, bool remove)
+{
+	if (!cp)
+		return;
+	filedes_close(&cp->fd);
+	if (remove)
+		tunlink(cp->path);
+	FREE(cp->path);
+	FREE(cp->records);
+	FREE(cp->sizes);
+	FREE(cp->batch);
+	FREE(cp);
+}
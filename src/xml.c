@@ -368,6 +368,38 @@ append_image_node(struct wim_xml_info *info, struct xml_node *image_node)
 	return 0;
 }
 
+/*
+ * Return the IMAGE element for the specified image.  The contents of IMAGE
+ * elements read from a WIM file aren't parsed until they're first needed.  If
+ * that fails, which can only happen if memory runs out, then the element is
+ * returned without its contents, so it looks like an empty IMAGE element.  This
+ * is fine for callers which only read the element.
+ */
+static struct xml_node *
+get_image_node(const struct wim_xml_info *info, int image)
+{
+	struct xml_node *image_node = info->images[image - 1];
+
+	xml_element_parse_deferred(image_node);
+	return image_node;
+}
+
+/* Like get_image_node(), but fail if the contents of the IMAGE element can't be
+ * parsed.  This must be used by callers which will modify the element.  */
+static int
+get_image_node_for_update(const struct wim_xml_info *info, int image,
+			  struct xml_node **image_node_ret)
+{
+	struct xml_node *image_node = info->images[image - 1];
+	int ret;
+
+	ret = xml_element_parse_deferred(image_node);
+	if (ret)
+		return ret;
+	*image_node_ret = image_node;
+	return 0;
+}
+
 /*----------------------------------------------------------------------------*
  *                     Functions for internal library use                     *
  *----------------------------------------------------------------------------*/
@@ -421,7 +453,8 @@ xml_get_total_bytes(const struct wim_xml_info *info)
 u64
 xml_get_image_total_bytes(const struct wim_xml_info *info, int image)
 {
-	return xml_get_number_by_path(info->images[image - 1], T("TOTALBYTES"));
+	return xml_get_number_by_path(get_image_node(info, image),
+				      T("TOTALBYTES"));
 }
 
 /* Retrieve the HARDLINKBYTES value for the specified image, or 0 if this value
@@ -429,7 +462,7 @@ xml_get_image_total_bytes(const struct wim_xml_info *info, int image)
 u64
 xml_get_image_hard_link_bytes(const struct wim_xml_info *info, int image)
 {
-	return xml_get_number_by_path(info->images[image - 1],
+	return xml_get_number_by_path(get_image_node(info, image),
 				      T("HARDLINKBYTES"));
 }
 
@@ -438,7 +471,7 @@ xml_get_image_hard_link_bytes(const struct wim_xml_info *info, int image)
 bool
 xml_get_wimboot(const struct wim_xml_info *info, int image)
 {
-	return xml_get_number_by_path(info->images[image - 1], T("WIMBOOT"));
+	return xml_get_number_by_path(get_image_node(info, image), T("WIMBOOT"));
 }
 
 /* Retrieve the Windows build number for the specified image, or 0 if this
@@ -446,7 +479,7 @@ xml_get_wimboot(const struct wim_xml_info *info, int image)
 u64
 xml_get_windows_build_number(const struct wim_xml_info *info, int image)
 {
-	return xml_get_number_by_path(info->images[image - 1],
+	return xml_get_number_by_path(get_image_node(info, image),
 				      T("WINDOWS/VERSION/BUILD"));
 }
 
@@ -454,8 +487,36 @@ xml_get_windows_build_number(const struct wim_xml_info *info, int image)
 int
 xml_set_wimboot(struct wim_xml_info *info, int image)
 {
-	return xml_set_text_by_path(info->images[image - 1],
-				    T("WIMBOOT"), T("1"));
+	struct xml_node *image_node;
+	int ret;
+
+	ret = get_image_node_for_update(info, image, &image_node);
+	if (ret)
+		return ret;
+	return xml_set_text_by_path(image_node, T("WIMBOOT"), T("1"));
+}
+
+struct image_stats {
+	const struct blob_table *blob_table;
+	u64 dir_count;
+	u64 file_count;
+	u64 total_bytes;
+	u64 hard_link_bytes;
+};
+
+static int
+image_stats_add_inode(struct wim_inode *inode, void *_stats)
+{
+	struct image_stats *stats = _stats;
+	u64 size = inode_sum_stream_sizes(inode, stats->blob_table);
+
+	if (inode_is_directory(inode))
+		stats->dir_count += inode->i_nlink;
+	else
+		stats->file_count += inode->i_nlink;
+	stats->total_bytes += size * inode->i_nlink;
+	stats->hard_link_bytes += size * (inode->i_nlink - 1);
+	return 0;
 }
 
 /*
@@ -468,38 +529,40 @@ xml_set_wimboot(struct wim_xml_info *info, int image)
 int
 xml_update_image_info(WIMStruct *wim, int image)
 {
-	const struct wim_image_metadata *imd = wim->image_metadata[image - 1];
-	struct xml_node *image_node = wim->xml_info->images[image - 1];
-	const struct wim_inode *inode;
-	u64 dir_count = 0;
-	u64 file_count = 0;
-	u64 total_bytes = 0;
-	u64 hard_link_bytes = 0;
-	u64 size;
+	struct wim_image_metadata *imd = wim->image_metadata[image - 1];
+	struct xml_node *image_node;
+	struct wim_inode *inode;
+	struct image_stats stats = {
+		.blob_table = wim->blob_table,
+	};
 	struct xml_node *dircount_node;
 	struct xml_node *filecount_node;
 	struct xml_node *totalbytes_node;
 	struct xml_node *hardlinkbytes_node;
 	struct xml_node *lastmodificationtime_node;
+	int ret;
 
-	image_for_each_inode(inode, imd) {
-		if (inode_is_directory(inode))
-			dir_count += inode->i_nlink;
-		else
-			file_count += inode->i_nlink;
-		size = inode_sum_stream_sizes(inode, wim->blob_table);
-		total_bytes += size * inode->i_nlink;
-		hard_link_bytes += size * (inode->i_nlink - 1);
-	}
+	ret = get_image_node_for_update(wim->xml_info, image, &image_node);
+	if (ret)
+		return ret;
+
+	ret = finish_loading_unspilled_image(imd);
+	if (ret)
+		return ret;
+	image_for_each_inode(inode, imd)
+		image_stats_add_inode(inode, &stats);
+	ret = visit_unloaded_inodes(imd, image_stats_add_inode, &stats);
+	if (ret)
+		return ret;
 
 	dircount_node = xml_new_element_with_u64(NULL, T("DIRCOUNT"),
-						 dir_count);
+						 stats.dir_count);
 	filecount_node = xml_new_element_with_u64(NULL, T("FILECOUNT"),
-						  file_count);
+						  stats.file_count);
 	totalbytes_node = xml_new_element_with_u64(NULL, T("TOTALBYTES"),
-						   total_bytes);
+						   stats.total_bytes);
 	hardlinkbytes_node = xml_new_element_with_u64(NULL, T("HARDLINKBYTES"),
-						      hard_link_bytes);
+						      stats.hard_link_bytes);
 	lastmodificationtime_node = xml_new_element_with_timestamp(NULL,
 			T("LASTMODIFICATIONTIME"), now_as_wim_timestamp());
 
@@ -764,7 +827,7 @@ print_windows_info(struct xml_node *image_node)
 void
 xml_print_image_info(struct wim_xml_info *info, int image)
 {
-	struct xml_node * const image_node = info->images[image - 1];
+	struct xml_node * const image_node = get_image_node(info, image);
 	const tchar *text;
 	tchar timebuf[64];
 
@@ -887,7 +950,7 @@ parse_wim_xml_document(const utf16lechar *raw_doc, size_t raw_doc_size,
 	ret = utf16le_to_tstr(raw_doc, raw_doc_size, &doc, NULL);
 	if (ret)
 		return ret;
-	ret = xml_parse_document(doc, root_ret);
+	ret = xml_parse_document_lazily(doc, T("IMAGE"), root_ret);
 	FREE(doc);
 	return ret;
 }
@@ -983,7 +1046,12 @@ prepare_document_for_write(struct wim_xml_info *info, int image, u64 total_bytes
 	}
 
 	/* Adjust the IMAGE elements if needed.  */
-	if (image != WIMLIB_ALL_IMAGES) {
+	if (image == WIMLIB_NO_IMAGE) {
+		/* We're writing no images.  Temporarily unlink all IMAGE
+		 * elements from the document.  */
+		for (int i = 0; i < info->image_count; i++)
+			xml_unlink_node(info->images[i]);
+	} else if (image != WIMLIB_ALL_IMAGES) {
 		/* We're writing a single image only.  Temporarily unlink all
 		 * other IMAGE elements from the document.  */
 		for (int i = 0; i < info->image_count; i++)
@@ -1016,7 +1084,12 @@ restore_document_after_write(struct wim_xml_info *info, int image,
 			     struct xml_node *orig_totalbytes_element)
 {
 	/* Restore the IMAGE elements if needed.  */
-	if (image != WIMLIB_ALL_IMAGES) {
+	if (image == WIMLIB_NO_IMAGE) {
+		/* We wrote no images.  Re-link all IMAGE elements to the
+		 * document.  */
+		for (int i = 0; i < info->image_count; i++)
+			xml_add_child(info->root, info->images[i]);
+	} else if (image != WIMLIB_ALL_IMAGES) {
 		/* We wrote a single image only.  Re-link all other IMAGE
 		 * elements to the document.  */
 		for (int i = 0; i < info->image_count; i++)
@@ -1036,7 +1109,8 @@ restore_document_after_write(struct wim_xml_info *info, int image,
  * Writes the XML data to a WIM file.
  *
  * 'image' specifies the image(s) to include in the XML data.  Normally it is
- * WIMLIB_ALL_IMAGES, but it can also be a 1-based image index.
+ * WIMLIB_ALL_IMAGES, but it can also be a 1-based image index, or
+ * WIMLIB_NO_IMAGE to include no images.
  *
  * 'total_bytes' is the number to use in the top-level TOTALBYTES element, or
  * WIM_TOTALBYTES_USE_EXISTING to use the existing value from the XML document
@@ -1095,7 +1169,8 @@ wimlib_get_xml_data(WIMStruct *wim, void **buf_ret, size_t *bufsize_ret)
 {
 	const struct wim_reshdr *xml_reshdr;
 
-	if (wim->filename == NULL && filedes_is_seekable(&wim->in_fd))
+	if (wim->filename == NULL && !wim->in_fd.reader &&
+	    !wim->opened_from_fd && filedes_is_seekable(&wim->in_fd))
 		return WIMLIB_ERR_NO_FILENAME;
 
 	if (buf_ret == NULL || bufsize_ret == NULL)
@@ -1140,7 +1215,7 @@ image_name_in_use(const WIMStruct *wim, const tchar *name, int excluded_image)
 	for (int i = 0; i < info->image_count; i++) {
 		if (i + 1 == excluded_image)
 			continue;
-		existing_name = xml_get_text_by_path(info->images[i],
+		existing_name = xml_get_text_by_path(get_image_node(info, i + 1),
 						     T("NAME"));
 		if (existing_name && !tstrcmp(existing_name, name))
 			return true;
@@ -1182,7 +1257,7 @@ wimlib_get_image_property(const WIMStruct *wim, int image,
 		return NULL;
 	if (image < 1 || image > info->image_count)
 		return NULL;
-	return xml_get_text_by_path(info->images[image - 1], property_name);
+	return xml_get_text_by_path(get_image_node(info, image), property_name);
 }
 
 WIMLIBAPI int
@@ -1209,6 +1284,8 @@ wimlib_set_image_property(WIMStruct *wim, int image, const tchar *property_name,
 			  const tchar *property_value)
 {
 	struct wim_xml_info *info = wim->xml_info;
+	struct xml_node *image_node;
+	int ret;
 
 	if (!property_name || !*property_name)
 		return WIMLIB_ERR_INVALID_PARAM;
@@ -1231,6 +1308,8 @@ wimlib_set_image_property(WIMStruct *wim, int image, const tchar *property_name,
 	    image_name_in_use(wim, property_value, image))
 		return WIMLIB_ERR_IMAGE_NAME_COLLISION;
 
-	return xml_set_text_by_path(info->images[image - 1], property_name,
-				    property_value);
+	ret = get_image_node_for_update(info, image, &image_node);
+	if (ret)
+		return ret;
+	return xml_set_text_by_path(image_node, property_name, property_value);
 }
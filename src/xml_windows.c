@@ -36,15 +36,52 @@
 #include "wimlib/error.h"
 #include "wimlib/metadata.h"
 #include "wimlib/registry.h"
+#include "wimlib/resource.h"
+#include "wimlib/sha1.h"
 #include "wimlib/wim.h"
 #include "wimlib/xml_windows.h"
 
+/* The files from which information is gathered  */
+enum windows_info_source {
+	SOURCE_KERNEL32,
+	SOURCE_SOFTWARE_HIVE,
+	SOURCE_SYSTEM_HIVE,
+};
+
+/*
+ * The image properties which were set from one file, remembered by the file's
+ * SHA-1 message digest.  Consecutive images captured into the same WIMStruct
+ * often contain the same registry hives and kernel32.dll, e.g. when capturing
+ * an image updated from a previous one; for these the properties are copied
+ * from the cache instead of reading and parsing the files again.
+ */
+struct windows_info_cache_entry {
+	struct list_head list;
+	enum windows_info_source source;
+	u8 hash[SHA1_HASH_SIZE];
+	size_t num_properties;
+	tchar **properties;	/* name, value, name, value, ...  */
+};
+
+/* Cache of 'struct windows_info_cache_entry', most recently used first  */
+struct windows_info_cache {
+	struct list_head entries;
+	size_t num_entries;
+};
+
+#define MAX_WINDOWS_INFO_CACHE_ENTRIES	16
+
 /* Context for a call to set_windows_specific_info()  */
 struct windows_info_ctx {
 	WIMStruct *wim;
 	int image;
 	bool oom_encountered;
 	bool debug_enabled;
+
+	/* If not NULL, the cache entry to which the properties being set are
+	 * being recorded  */
+	struct windows_info_cache_entry *recording;
+	bool recording_failed;
 };
 
 /* For debugging purposes, the environmental variable WIMLIB_DEBUG_XML_INFO can
@@ -55,14 +92,44 @@ struct windows_info_ctx {
 	if (ctx->debug_enabled)			\
 		WARNING(format, ##__VA_ARGS__)
 
+/* Remember a property which was set, in the cache entry being recorded.  */
+static void
+record_property(struct windows_info_ctx *ctx,
+		const tchar *name, const tchar *value)
+{
+	struct windows_info_cache_entry *entry = ctx->recording;
+	tchar **props;
+
+	if (!entry || ctx->recording_failed)
+		return;
+	props = REALLOC(entry->properties,
+			(entry->num_properties + 2) * sizeof(props[0]));
+	if (!props)
+		goto fail;
+	entry->properties = props;
+	props[entry->num_properties] = TSTRDUP(name);
+	props[entry->num_properties + 1] = TSTRDUP(value);
+	entry->num_properties += 2;
+	if (!props[entry->num_properties - 2] ||
+	    !props[entry->num_properties - 1])
+		goto fail;
+	return;
+
+fail:
+	/* Just don't cache this file's information.  */
+	ctx->recording_failed = true;
+}
+
 /* Set a property in the XML document, with error checking.  */
 static void
 set_string_property(struct windows_info_ctx *ctx,
 		    const tchar *name, const tchar *value)
 {
 	int ret = wimlib_set_image_property(ctx->wim, ctx->image, name, value);
-	if (likely(!ret))
+	if (likely(!ret)) {
+		record_property(ctx, name, value);
 		return;
+	}
 
 	ctx->oom_encountered |= (ret == WIMLIB_ERR_NOMEM);
 	WARNING("Failed to set image property \"%"TS"\" to value "
@@ -88,62 +155,54 @@ check_hive_status(struct windows_info_ctx *ctx, enum hive_status status,
 		return true;
 
 	ctx->oom_encountered |= (status == HIVE_OUT_OF_MEMORY);
+	/* Don't cache information that is missing only due to a read error. */
+	ctx->recording_failed |= (status == HIVE_READ_ERROR);
 	XML_WARN("%s; key=%"TS" value=%"TS, hive_status_to_string(status),
 		 (key ? key : T("(null)")), (value ? value : T("(null)")));
 	return false;
 }
 
 static bool
-is_registry_valid(struct windows_info_ctx *ctx, const void *hive_mem,
-		  size_t hive_size)
-{
-	enum hive_status status;
-
-	status = hive_validate(hive_mem, hive_size);
-	return check_hive_status(ctx, status, NULL, NULL);
-}
-
-static bool
-get_string_from_registry(struct windows_info_ctx *ctx, const struct regf *regf,
+get_string_from_registry(struct windows_info_ctx *ctx, struct hive *hive,
 			 const tchar *key_name, const tchar *value_name,
 			 tchar **value_ret)
 {
 	enum hive_status status;
 
-	status = hive_get_string(regf, key_name, value_name, value_ret);
+	status = hive_get_string(hive, key_name, value_name, value_ret);
 	return check_hive_status(ctx, status, key_name, value_name);
 }
 
 static bool
-get_number_from_registry(struct windows_info_ctx *ctx, const struct regf *regf,
+get_number_from_registry(struct windows_info_ctx *ctx, struct hive *hive,
 			 const tchar *key_name, const tchar *value_name,
 			 s64 *value_ret)
 {
 	enum hive_status status;
 
-	status = hive_get_number(regf, key_name, value_name, value_ret);
+	status = hive_get_number(hive, key_name, value_name, value_ret);
 	return check_hive_status(ctx, status, key_name, value_name);
 }
 
 static bool
-list_subkeys_in_registry(struct windows_info_ctx *ctx, const struct regf *regf,
+list_subkeys_in_registry(struct windows_info_ctx *ctx, struct hive *hive,
 			 const tchar *key_name, tchar ***subkeys_ret)
 {
 	enum hive_status status;
 
-	status = hive_list_subkeys(regf, key_name, subkeys_ret);
+	status = hive_list_subkeys(hive, key_name, subkeys_ret);
 	return check_hive_status(ctx, status, key_name, NULL);
 }
 
 /* Copy a string value from a registry hive to the XML document.  */
 static void
-copy_registry_string(struct windows_info_ctx *ctx, const struct regf *regf,
+copy_registry_string(struct windows_info_ctx *ctx, struct hive *hive,
 		     const tchar *key_name, const tchar *value_name,
 		     const tchar *property_name)
 {
 	tchar *string;
 
-	if (get_string_from_registry(ctx, regf, key_name, value_name, &string)) {
+	if (get_string_from_registry(ctx, hive, key_name, value_name, &string)) {
 		set_string_property(ctx, property_name, string);
 		FREE(string);
 	}
@@ -386,30 +445,52 @@ pe_arch_to_windows_arch(unsigned pe_arch)
 	return -1;
 }
 
-/* Gather information from kernel32.dll.  */
+/* Gather information from kernel32.dll.  Only the headers are read.  */
 static void
 set_info_from_kernel32(struct windows_info_ctx *ctx,
-		       const void *contents, size_t size)
+		       const struct blob_descriptor *blob)
 {
+	u8 dos_hdr[0x40];
+	u8 *contents;
 	u32 e_lfanew;
 	const u8 *pe_hdr;
 	unsigned pe_arch;
 	int arch;
+	int ret;
 
 	/* Read the processor architecture from the executable header.  */
 
-	if (size < 0x40)
+	if (blob->size < sizeof(dos_hdr))
 		goto invalid;
 
-	e_lfanew = le32_to_cpu(*(le32 *)((u8 *)contents + 0x3C));
-	if (e_lfanew > size || size - e_lfanew < 6 || (e_lfanew & 3))
+	ret = read_blob_prefix_into_buf(blob, sizeof(dos_hdr), dos_hdr);
+	if (ret)
+		goto read_error;
+
+	e_lfanew = le32_to_cpu(*(le32 *)(dos_hdr + 0x3C));
+	if (e_lfanew > blob->size || blob->size - e_lfanew < 6 ||
+	    (e_lfanew & 3))
 		goto invalid;
 
-	pe_hdr = (u8 *)contents + e_lfanew;
-	if (*(le32 *)pe_hdr != cpu_to_le32(0x00004550))	/* "PE\0\0"  */
+	contents = MALLOC(e_lfanew + 6);
+	if (!contents) {
+		ctx->oom_encountered = true;
+		return;
+	}
+	ret = read_blob_prefix_into_buf(blob, e_lfanew + 6, contents);
+	if (ret) {
+		FREE(contents);
+		goto read_error;
+	}
+
+	pe_hdr = contents + e_lfanew;
+	if (*(le32 *)pe_hdr != cpu_to_le32(0x00004550)) {	/* "PE\0\0"  */
+		FREE(contents);
 		goto invalid;
+	}
 
 	pe_arch = le16_to_cpu(*(le16 *)(pe_hdr + 4));
+	FREE(contents);
 	arch = pe_arch_to_windows_arch(pe_arch);
 	if (arch >= 0) {
 		/* Save the processor architecture in the XML document.  */
@@ -422,12 +503,18 @@ set_info_from_kernel32(struct windows_info_ctx *ctx,
 
 invalid:
 	XML_WARN("kernel32.dll is not a valid PE binary.");
+	return;
+
+read_error:
+	XML_WARN("Error loading kernel32.dll: %"TS, wimlib_get_error_string(ret));
+	ctx->oom_encountered |= (ret == WIMLIB_ERR_NOMEM);
+	ctx->recording_failed = true;
 }
 
 /* Gather information from the SOFTWARE registry hive.  */
 static void
 set_info_from_software_hive(struct windows_info_ctx *ctx,
-			    const struct regf *regf)
+			    struct hive *hive)
 {
 	const tchar *version_key = T("Microsoft\\Windows NT\\CurrentVersion");
 	s64 major_version = -1;
@@ -436,27 +523,27 @@ set_info_from_software_hive(struct windows_info_ctx *ctx,
 	tchar *build_string;
 
 	/* Image flags  */
-	copy_registry_string(ctx, regf, version_key, T("EditionID"),
+	copy_registry_string(ctx, hive, version_key, T("EditionID"),
 			     T("FLAGS"));
 
 	/* Image display name  */
-	copy_registry_string(ctx, regf, version_key, T("ProductName"),
+	copy_registry_string(ctx, hive, version_key, T("ProductName"),
 			     T("DISPLAYNAME"));
 
 	/* Image display description  */
-	copy_registry_string(ctx, regf, version_key, T("ProductName"),
+	copy_registry_string(ctx, hive, version_key, T("ProductName"),
 			     T("DISPLAYDESCRIPTION"));
 
 	/* Edition ID  */
-	copy_registry_string(ctx, regf, version_key, T("EditionID"),
+	copy_registry_string(ctx, hive, version_key, T("EditionID"),
 			     T("WINDOWS/EDITIONID"));
 
 	/* Installation type  */
-	copy_registry_string(ctx, regf, version_key, T("InstallationType"),
+	copy_registry_string(ctx, hive, version_key, T("InstallationType"),
 			     T("WINDOWS/INSTALLATIONTYPE"));
 
 	/* Product name  */
-	copy_registry_string(ctx, regf, version_key, T("ProductName"),
+	copy_registry_string(ctx, hive, version_key, T("ProductName"),
 			     T("WINDOWS/PRODUCTNAME"));
 
 	/* Major and minor version number  */
@@ -465,14 +552,14 @@ set_info_from_software_hive(struct windows_info_ctx *ctx,
 	 * Instead, the new values CurrentMajorVersionNumber and
 	 * CurrentMinorVersionNumber should be used.  */
 
-	get_number_from_registry(ctx, regf, version_key,
+	get_number_from_registry(ctx, hive, version_key,
 				 T("CurrentMajorVersionNumber"), &major_version);
 
-	get_number_from_registry(ctx, regf, version_key,
+	get_number_from_registry(ctx, hive, version_key,
 				 T("CurrentMinorVersionNumber"), &minor_version);
 
 	if (major_version < 0 || minor_version < 0) {
-		if (get_string_from_registry(ctx, regf, version_key,
+		if (get_string_from_registry(ctx, hive, version_key,
 					     T("CurrentVersion"),
 					     &version_string))
 		{
@@ -502,13 +589,13 @@ set_info_from_software_hive(struct windows_info_ctx *ctx,
 	 * "CurrentBuildNumber" contains the correct value.  But oddly enough,
 	 * it is "CurrentBuild" that contains the correct value on *later*
 	 * versions of Windows.  */
-	if (get_string_from_registry(ctx, regf, version_key, T("CurrentBuild"),
+	if (get_string_from_registry(ctx, hive, version_key, T("CurrentBuild"),
 				     &build_string))
 	{
 		if (tstrchr(build_string, T('.'))) {
 			FREE(build_string);
 			build_string = NULL;
-			get_string_from_registry(ctx, regf, version_key,
+			get_string_from_registry(ctx, hive, version_key,
 						 T("CurrentBuildNumber"),
 						 &build_string);
 		}
@@ -522,12 +609,12 @@ set_info_from_software_hive(struct windows_info_ctx *ctx,
 
 /* Gather the default language from the SYSTEM registry hive.  */
 static void
-set_default_language(struct windows_info_ctx *ctx, const struct regf *regf)
+set_default_language(struct windows_info_ctx *ctx, struct hive *hive)
 {
 	tchar *string;
 	unsigned language_id;
 
-	if (!get_string_from_registry(ctx, regf,
+	if (!get_string_from_registry(ctx, hive,
 				      T("ControlSet001\\Control\\Nls\\Language"),
 				      T("InstallLanguage"), &string))
 		return;
@@ -551,7 +638,7 @@ set_default_language(struct windows_info_ctx *ctx, const struct regf *regf)
 
 /* Gather information from the SYSTEM registry hive.  */
 static void
-set_info_from_system_hive(struct windows_info_ctx *ctx, const struct regf *regf)
+set_info_from_system_hive(struct windows_info_ctx *ctx, struct hive *hive)
 {
 	const tchar *windows_key = T("ControlSet001\\Control\\Windows");
 	const tchar *uilanguages_key = T("ControlSet001\\Control\\MUI\\UILanguages");
@@ -561,31 +648,31 @@ set_info_from_system_hive(struct windows_info_ctx *ctx, const struct regf *regf)
 	tchar **subkeys;
 
 	/* Service pack build  */
-	if (get_number_from_registry(ctx, regf, windows_key,
+	if (get_number_from_registry(ctx, hive, windows_key,
 				     T("CSDBuildNumber"), &spbuild))
 		set_number_property(ctx, T("WINDOWS/VERSION/SPBUILD"), spbuild);
 
 	/* Service pack level  */
-	if (get_number_from_registry(ctx, regf, windows_key,
+	if (get_number_from_registry(ctx, hive, windows_key,
 				     T("CSDVersion"), &splevel))
 		set_number_property(ctx, T("WINDOWS/VERSION/SPLEVEL"), splevel >> 8);
 
 	/* Product type  */
-	copy_registry_string(ctx, regf, productoptions_key, T("ProductType"),
+	copy_registry_string(ctx, hive, productoptions_key, T("ProductType"),
 			     T("WINDOWS/PRODUCTTYPE"));
 
 	/* Product suite  */
-	copy_registry_string(ctx, regf, productoptions_key, T("ProductSuite"),
+	copy_registry_string(ctx, hive, productoptions_key, T("ProductSuite"),
 			     T("WINDOWS/PRODUCTSUITE"));
 
 	/* Hardware abstraction layer  */
-	copy_registry_string(ctx, regf,
+	copy_registry_string(ctx, hive,
 			     T("ControlSet001\\Control\\Class\\{4D36E966-E325-11CE-BFC1-08002BE10318}\\0000"),
 			     T("MatchingDeviceId"),
 			     T("WINDOWS/HAL"));
 
 	/* Languages  */
-	if (list_subkeys_in_registry(ctx, regf, uilanguages_key, &subkeys)) {
+	if (list_subkeys_in_registry(ctx, hive, uilanguages_key, &subkeys)) {
 		tchar property_name[64];
 		for (tchar **p = subkeys; *p; p++) {
 			tsprintf(property_name,
@@ -596,19 +683,16 @@ set_info_from_system_hive(struct windows_info_ctx *ctx, const struct regf *regf)
 	}
 
 	/* Default language  */
-	set_default_language(ctx, regf);
+	set_default_language(ctx, hive);
 }
 
-/* Load the contents of a file in the currently selected WIM image into memory.
- */
-static void *
-load_file_contents(struct windows_info_ctx *ctx,
-		   const struct wim_dentry *dentry, const char *filename,
-		   size_t *size_ret)
+/* Get the blob for the contents of a file in the currently selected WIM image,
+ * or NULL if the file doesn't exist or is empty.  */
+static const struct blob_descriptor *
+get_file_blob(struct windows_info_ctx *ctx,
+	      const struct wim_dentry *dentry, const char *filename)
 {
 	const struct blob_descriptor *blob;
-	void *contents;
-	int ret;
 
 	if (!dentry) {
 		XML_WARN("%s does not exist", filename);
@@ -621,35 +705,201 @@ load_file_contents(struct windows_info_ctx *ctx,
 		XML_WARN("%s has no contents", filename);
 		return NULL;
 	}
+	return blob;
+}
 
-	ret = read_blob_into_alloc_buf(blob, &contents);
-	if (ret) {
-		XML_WARN("Error loading %s (size=%"PRIu64"): %"TS,
-			 filename, blob->size, wimlib_get_error_string(ret));
-		ctx->oom_encountered |= (ret == WIMLIB_ERR_NOMEM &&
-					 blob->size < 100000000);
+static int
+read_hive_blob(void *blob, u64 offset, size_t size, void *buf)
+{
+	return read_partial_blob_into_buf(blob, offset, size, buf);
+}
+
+/* Open a registry hive file.  The hive is read on demand if the blob's
+ * location allows it, otherwise it is loaded into memory in full.  */
+static struct hive *
+open_hive(struct windows_info_ctx *ctx, const struct blob_descriptor *blob,
+	  const char *filename)
+{
+	struct hive *hive;
+	enum hive_status status;
+	void *contents;
+	int ret;
+
+	if (unlikely((size_t)blob->size != blob->size)) {
+		XML_WARN("%s is too large (size=%"PRIu64")",
+			 filename, blob->size);
 		return NULL;
 	}
 
-	*size_ret = blob->size;
-	return contents;
+	if (can_read_partial_blob(blob)) {
+		status = hive_open(blob->size, read_hive_blob, (void *)blob,
+				   &hive);
+	} else {
+		ret = read_blob_into_alloc_buf(blob, &contents);
+		if (ret) {
+			XML_WARN("Error loading %s (size=%"PRIu64"): %"TS,
+				 filename, blob->size,
+				 wimlib_get_error_string(ret));
+			ctx->oom_encountered |= (ret == WIMLIB_ERR_NOMEM &&
+						 blob->size < 100000000);
+			ctx->recording_failed = true;
+			return NULL;
+		}
+		status = hive_open_buffer(contents, blob->size, &hive);
+		if (status != HIVE_OK)
+			FREE(contents);
+	}
+
+	if (status != HIVE_OK) {
+		check_hive_status(ctx, status, NULL, NULL);
+		XML_WARN("%s is not a valid registry hive!", filename);
+		return NULL;
+	}
+	return hive;
 }
 
-/* Load and validate a registry hive file.  */
-static void *
-load_hive(struct windows_info_ctx *ctx, const struct wim_dentry *dentry,
-	  const char *filename)
+static void
+set_info_from_hive(struct windows_info_ctx *ctx,
+		   const struct blob_descriptor *blob,
+		   enum windows_info_source source)
 {
-	void *hive_mem;
-	size_t hive_size;
+	const char *filename = (source == SOURCE_SOFTWARE_HIVE) ?
+				"SOFTWARE" : "SYSTEM";
+	struct hive *hive = open_hive(ctx, blob, filename);
 
-	hive_mem = load_file_contents(ctx, dentry, filename, &hive_size);
-	if (hive_mem && !is_registry_valid(ctx, hive_mem, hive_size)) {
-		XML_WARN("%s is not a valid registry hive!", filename);
-		FREE(hive_mem);
-		hive_mem = NULL;
+	if (!hive)
+		return;
+	if (source == SOURCE_SOFTWARE_HIVE)
+		set_info_from_software_hive(ctx, hive);
+	else
+		set_info_from_system_hive(ctx, hive);
+	hive_close(hive);
+}
+
+static void
+free_windows_info_cache_entry(struct windows_info_cache_entry *entry)
+{
+	for (size_t i = 0; i < entry->num_properties; i++)
+		FREE(entry->properties[i]);
+	FREE(entry->properties);
+	FREE(entry);
+}
+
+/* Free the cache of Windows information attached to a WIMStruct.  */
+void
+free_windows_info_cache(WIMStruct *wim)
+{
+	struct windows_info_cache *cache = wim->windows_info_cache;
+	struct windows_info_cache_entry *entry, *tmp;
+
+	if (!cache)
+		return;
+	list_for_each_entry_safe(entry, tmp, &cache->entries, list)
+		free_windows_info_cache_entry(entry);
+	FREE(cache);
+	wim->windows_info_cache = NULL;
+}
+
+static struct windows_info_cache_entry *
+lookup_windows_info_cache(struct windows_info_cache *cache,
+			  enum windows_info_source source, const u8 *hash)
+{
+	struct windows_info_cache_entry *entry;
+
+	if (!cache)
+		return NULL;
+	list_for_each_entry(entry, &cache->entries, list) {
+		if (entry->source == source && hashes_equal(entry->hash, hash)) {
+			list_move(&entry->list, &cache->entries);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Add a newly recorded entry to the cache, evicting the least recently used
+ * entry if the cache is full.  */
+static void
+add_to_windows_info_cache(struct windows_info_ctx *ctx,
+			  struct windows_info_cache_entry *entry)
+{
+	struct windows_info_cache *cache = ctx->wim->windows_info_cache;
+
+	if (!cache) {
+		cache = MALLOC(sizeof(*cache));
+		if (!cache) {
+			free_windows_info_cache_entry(entry);
+			return;
+		}
+		INIT_LIST_HEAD(&cache->entries);
+		cache->num_entries = 0;
+		ctx->wim->windows_info_cache = cache;
+	}
+	if (cache->num_entries >= MAX_WINDOWS_INFO_CACHE_ENTRIES) {
+		struct windows_info_cache_entry *oldest =
+			list_last_entry(&cache->entries,
+					struct windows_info_cache_entry, list);
+		list_del(&oldest->list);
+		free_windows_info_cache_entry(oldest);
+		cache->num_entries--;
+	}
+	list_add(&entry->list, &cache->entries);
+	cache->num_entries++;
+}
+
+/*
+ * Set the properties which come from the file @dentry, which is a @source file.
+ * If the file's contents have already been hashed and the same contents were
+ * seen in an earlier image, copy the properties which were set then.
+ * Otherwise, read the file and remember the properties for next time.
+ */
+static void
+set_info_from_file(struct windows_info_ctx *ctx,
+		   const struct wim_dentry *dentry, const char *filename,
+		   enum windows_info_source source)
+{
+	const struct blob_descriptor *blob;
+	struct windows_info_cache_entry *entry;
+
+	blob = get_file_blob(ctx, dentry, filename);
+	if (!blob)
+		return;
+
+	/* Blobs of files just scanned from disk are not hashed until the WIM
+	 * is written, so they can't be looked up.  Don't hash them here, since
+	 * that would mean reading the whole file.  */
+	if (!blob->unhashed) {
+		entry = lookup_windows_info_cache(ctx->wim->windows_info_cache,
+						  source, blob->hash);
+		if (entry) {
+			for (size_t i = 0; i < entry->num_properties; i += 2) {
+				set_string_property(ctx, entry->properties[i],
+						    entry->properties[i + 1]);
+			}
+			return;
+		}
+		entry = CALLOC(1, sizeof(*entry));
+		if (entry) {
+			entry->source = source;
+			copy_hash(entry->hash, blob->hash);
+			ctx->recording = entry;
+			ctx->recording_failed = false;
+		}
+	}
+
+	if (source == SOURCE_KERNEL32)
+		set_info_from_kernel32(ctx, blob);
+	else
+		set_info_from_hive(ctx, blob, source);
+
+	if (ctx->recording) {
+		entry = ctx->recording;
+		ctx->recording = NULL;
+		if (ctx->recording_failed || ctx->oom_encountered)
+			free_windows_info_cache_entry(entry);
+		else
+			add_to_windows_info_cache(ctx, entry);
 	}
-	return hive_mem;
 }
 
 /* Set the WINDOWS/SYSTEMROOT property to the name of the directory specified by
@@ -694,8 +944,6 @@ do_set_windows_specific_info(WIMStruct *wim,
 			     const struct wim_dentry *software,
 			     const struct wim_dentry *system)
 {
-	void *contents;
-	size_t size;
 	struct windows_info_ctx _ctx = {
 		.wim = wim,
 		.image = wim->current_image,
@@ -705,20 +953,9 @@ do_set_windows_specific_info(WIMStruct *wim,
 
 	set_systemroot_property(ctx, systemroot);
 
-	if ((contents = load_file_contents(ctx, kernel32, "kernel32.dll", &size))) {
-		set_info_from_kernel32(ctx, contents, size);
-		FREE(contents);
-	}
-
-	if ((contents = load_hive(ctx, software, "SOFTWARE"))) {
-		set_info_from_software_hive(ctx, contents);
-		FREE(contents);
-	}
-
-	if ((contents = load_hive(ctx, system, "SYSTEM"))) {
-		set_info_from_system_hive(ctx, contents);
-		FREE(contents);
-	}
+	set_info_from_file(ctx, kernel32, "kernel32.dll", SOURCE_KERNEL32);
+	set_info_from_file(ctx, software, "SOFTWARE", SOURCE_SOFTWARE_HIVE);
+	set_info_from_file(ctx, system, "SYSTEM", SOURCE_SYSTEM_HIVE);
 
 	if (ctx->oom_encountered) {
 		ERROR("Ran out of memory while setting Windows-specific "
@@ -770,11 +1007,21 @@ static const utf16lechar system_name[] = {
 	cpu_to_le16('T'), cpu_to_le16('E'), cpu_to_le16('M'),
 };
 
+/* Look up a child of a directory in the current image, loading the children
+ * first in case the directory was spilled during capture.  */
+static const struct wim_dentry *
+get_child(WIMStruct *wim, const struct wim_dentry *parent,
+	  const utf16lechar *name, size_t name_nbytes)
+{
+	if (load_dentry_children(wim_get_current_image_metadata(wim),
+				 (struct wim_dentry *)parent))
+		return NULL;
+	return get_dentry_child_with_utf16le_name(parent, name, name_nbytes,
+						  WIMLIB_CASE_INSENSITIVE);
+}
+
 #define GET_CHILD(parent, child_name)				\
-	get_dentry_child_with_utf16le_name(parent,		\
-					   child_name,		\
-					   sizeof(child_name),	\
-					   WIMLIB_CASE_INSENSITIVE)
+	get_child(wim, parent, child_name, sizeof(child_name))
 
 static bool
 is_default_systemroot(const struct wim_dentry *potential_systemroot)
@@ -804,10 +1051,15 @@ set_windows_specific_info(WIMStruct *wim)
 				*best_software = NULL,
 				*best_system = NULL;
 	int best_score = 0;
+	int ret;
 
 	root = wim_get_current_root_dentry(wim);
 	if (!root)
 		return 0;
+	ret = load_dentry_children(wim_get_current_image_metadata(wim),
+				   (struct wim_dentry *)root);
+	if (ret)
+		return ret;
 
 	/* Find the system root.  This is usually the toplevel directory
 	 * "Windows", but it might be a different toplevel directory.  Choose
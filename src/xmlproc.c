@@ -143,6 +143,7 @@ xml_free_node(struct xml_node *node)
 		xml_free_children(node);
 		FREE(node->name);
 		FREE(node->value);
+		FREE(node->deferred_contents);
 		FREE(node);
 	}
 }
@@ -271,6 +272,13 @@ xml_clone_tree(struct xml_node *orig)
 			orig->value, orig->value ? tstrlen(orig->value) : 0);
 	if (!clone)
 		return NULL;
+	if (orig->deferred_contents) {
+		clone->deferred_contents =
+			tstrdupz(orig->deferred_contents,
+				 tstrlen(orig->deferred_contents));
+		if (!clone->deferred_contents)
+			goto oom;
+	}
 	xml_node_for_each_child(orig, orig_child) {
 		clone_child = xml_clone_tree(orig_child);
 		if (!clone_child)
@@ -358,7 +366,7 @@ xml_legal_value(const tchar *p)
  *                               XML parsing                                  *
  *----------------------------------------------------------------------------*/
 
-#define CHECK(cond)	if (!(cond)) goto bad
+#define CHECK(cond)	do { if (!(cond)) goto bad; } while (0)
 
 static inline void
 skip_whitespace(const tchar **pp)
@@ -472,12 +480,163 @@ bad:
 	return WIMLIB_ERR_XML;
 }
 
+/* Return the length of the escape sequence at @p, which begins with '&', or 0
+ * if it isn't a valid escape sequence.  */
+static size_t
+escape_seq_len(const tchar *p)
+{
+	static const tchar * const seqs[] = {
+		T("&lt;"), T("&gt;"), T("&amp;"), T("&apos;"), T("&quot;"),
+	};
+
+	for (size_t i = 0; i < ARRAY_LEN(seqs); i++) {
+		size_t len = tstrlen(seqs[i]);
+
+		if (!tstrncmp(p, seqs[i], len))
+			return len;
+	}
+	return 0;
+}
+
+/*
+ * Check that the contents of an element at the given @depth, starting at *pp
+ * just after the element's start tag, are well-formed, and advance *pp to the
+ * element's end tag.  This accepts exactly what parse_contents() does, but it
+ * doesn't build any nodes.
+ */
+static int
+skip_contents(const tchar **pp, int depth)
+{
+	const tchar *p = *pp;
+	const tchar *open_names[50];
+	size_t open_name_lens[50];
+	int nesting = 0;
+
+	for (;;) {
+		for (; *p != '<'; p++) {
+			CHECK(*p != '\0');
+			if (*p == '&') {
+				size_t len = escape_seq_len(p);
+
+				CHECK(len != 0);
+				p += len - 1;
+			}
+		}
+		if (p[1] == '/') {
+			if (nesting == 0)
+				break; /* Reached the end tag of the element */
+			nesting--;
+			p += 2;
+			CHECK(!tstrncmp(p, open_names[nesting],
+					open_name_lens[nesting]));
+			p += open_name_lens[nesting];
+			skip_whitespace(&p);
+			CHECK(*p == '>');
+			p++;
+		} else if (p[1] == '?') {
+			p += 2;
+			CHECK(find_and_skip(&p, T("?>")));
+		} else if (p[1] == '!') {
+			if (skip_string(&p, T("<![CDATA["))) {
+				CHECK(find_and_skip(&p, T("]]>")));
+			} else if (skip_string(&p, T("<!--"))) {
+				CHECK(find_and_skip(&p, T("-->")));
+			} else {
+				goto bad;
+			}
+		} else {
+			const tchar *name_start;
+
+			/* Start tag of a child element */
+			CHECK(depth + 1 + nesting < 50);
+			p++;
+			name_start = p;
+			while (!is_whitespace(*p) && *p != '>' && *p != '/' &&
+			       *p != '\0')
+				p++;
+			CHECK(p > name_start);
+			while (is_whitespace(*p)) {
+				const tchar *attr_name_start;
+				tchar quote;
+
+				skip_whitespace(&p);
+				if (*p == '/' || *p == '>')
+					break;
+				attr_name_start = p;
+				while (*p != '=' && !is_whitespace(*p) &&
+				       *p != '\0')
+					p++;
+				CHECK(p > attr_name_start);
+				skip_whitespace(&p);
+				CHECK(*p == '=');
+				p++;
+				skip_whitespace(&p);
+				quote = *p;
+				CHECK(quote == '\'' || quote == '"');
+				for (p++; *p != quote; p++) {
+					CHECK(*p != '\0');
+					if (*p == '&') {
+						size_t len = escape_seq_len(p);
+
+						CHECK(len != 0);
+						p += len - 1;
+					}
+				}
+				p++;
+			}
+			if (*p == '/') {
+				/* Empty element tag */
+				p++;
+				CHECK(*p == '>');
+				p++;
+			} else {
+				CHECK(*p == '>');
+				p++;
+				open_names[nesting] = name_start;
+				open_name_lens[nesting] = p - 1 - name_start;
+				nesting++;
+			}
+		}
+	}
+	*pp = p;
+	return 0;
+
+bad:
+	return WIMLIB_ERR_XML;
+}
+
+/* Save the contents of @element, which start at *pp, to be parsed later by
+ * xml_element_parse_deferred().  */
+static int
+defer_contents(const tchar **pp, struct xml_node *element, int depth)
+{
+	const tchar *p = *pp;
+	size_t len;
+	int ret;
+
+	ret = skip_contents(&p, depth);
+	if (ret)
+		return ret;
+
+	/* Append "</" so that parse_contents() will stop at the end.  */
+	len = p - *pp;
+	element->deferred_contents = CALLOC(len + 3, sizeof(tchar));
+	if (!element->deferred_contents)
+		return WIMLIB_ERR_NOMEM;
+	tmemcpy(element->deferred_contents, *pp, len);
+	element->deferred_contents[len] = '<';
+	element->deferred_contents[len + 1] = '/';
+	*pp = p;
+	return 0;
+}
+
 static int
 parse_element(const tchar **pp, struct xml_node *parent, int depth,
-	      struct xml_node **node_ret);
+	      const tchar *lazy_name, struct xml_node **node_ret);
 
 static int
-parse_contents(const tchar **pp, struct xml_node *element, int depth)
+parse_contents(const tchar **pp, struct xml_node *element, int depth,
+	       const tchar *lazy_name)
 {
 	const tchar *p = *pp;
 	int ret;
@@ -526,7 +685,7 @@ parse_contents(const tchar **pp, struct xml_node *element, int depth)
 			}
 			return WIMLIB_ERR_XML;
 		}
-		ret = parse_element(&p, element, depth + 1, NULL);
+		ret = parse_element(&p, element, depth + 1, lazy_name, NULL);
 		if (ret)
 			return ret;
 	}
@@ -536,7 +695,7 @@ parse_contents(const tchar **pp, struct xml_node *element, int depth)
 
 static int
 parse_element(const tchar **pp, struct xml_node *parent, int depth,
-	      struct xml_node **element_ret)
+	      const tchar *lazy_name, struct xml_node **element_ret)
 {
 	const tchar *p = *pp;
 	struct xml_node *element = NULL;
@@ -605,7 +764,10 @@ parse_element(const tchar **pp, struct xml_node *parent, int depth,
 		CHECK(*p == '>');
 		p++;
 		/* Parse the contents, then the end tag. */
-		ret = parse_contents(&p, element, depth);
+		if (depth == 1 && lazy_name && !tstrcmp(element->name, lazy_name))
+			ret = defer_contents(&p, element, depth);
+		else
+			ret = parse_contents(&p, element, depth, lazy_name);
 		if (ret)
 			goto error;
 		CHECK(*p == '<');
@@ -639,6 +801,20 @@ bad:
  */
 int
 xml_parse_document(const tchar *p, struct xml_node **doc_ret)
+{
+	return xml_parse_document_lazily(p, NULL, doc_ret);
+}
+
+/*
+ * Like xml_parse_document(), but only check the contents of the elements named
+ * @lazy_name directly below the root element for well-formedness, and save
+ * them to be parsed later by xml_element_parse_deferred().  Until then, they
+ * are written back out exactly as they were read.  This avoids building nodes
+ * for parts of the document that may never be needed.
+ */
+int
+xml_parse_document_lazily(const tchar *p, const tchar *lazy_name,
+			  struct xml_node **doc_ret)
 {
 	int ret;
 	struct xml_node *doc;
@@ -646,7 +822,7 @@ xml_parse_document(const tchar *p, struct xml_node **doc_ret)
 	skip_string(&p, BYTE_ORDER_MARK);
 	if (!skip_misc(&p))
 		return WIMLIB_ERR_XML;
-	ret = parse_element(&p, NULL, 0, &doc);
+	ret = parse_element(&p, NULL, 0, lazy_name, &doc);
 	if (ret)
 		return ret;
 	if (!skip_misc(&p) || *p) {
@@ -657,6 +833,39 @@ xml_parse_document(const tchar *p, struct xml_node **doc_ret)
 	return 0;
 }
 
+/*
+ * Parse the contents of @element if they were deferred by
+ * xml_parse_document_lazily().  Since they were already checked, this can
+ * only fail by running out of memory, in which case they remain deferred.
+ */
+int
+xml_element_parse_deferred(struct xml_node *element)
+{
+	const tchar *p = element->deferred_contents;
+	const struct xml_node *ancestor;
+	struct xml_node *child, *tmp;
+	int depth = 0;
+	int ret;
+
+	if (likely(!p))
+		return 0;
+
+	for (ancestor = element->parent; ancestor; ancestor = ancestor->parent)
+		depth++;
+
+	ret = parse_contents(&p, element, depth, NULL);
+	if (unlikely(ret)) {
+		list_for_each_entry_safe(child, tmp, &element->children,
+					 sibling_link)
+			if (child->type != XML_ATTRIBUTE_NODE)
+				xml_free_node(child);
+		return ret;
+	}
+	FREE(element->deferred_contents);
+	element->deferred_contents = NULL;
+	return 0;
+}
+
 /*----------------------------------------------------------------------------*
  *                               XML writing                                  *
  *----------------------------------------------------------------------------*/
@@ -720,7 +929,11 @@ xml_write_element(struct xml_node *element, struct xml_out_buf *buf)
 	}
 	xml_puts(buf, T(">"));
 
-	/* Write the contents. */
+	/* Write the contents.  If they haven't been parsed, copy them over
+	 * as-is, excluding the "</" that was appended to them.  */
+	if (element->deferred_contents)
+		xml_write(buf, element->deferred_contents,
+			  tstrlen(element->deferred_contents) - 2);
 	xml_node_for_each_child(element, child) {
 		if (child->type == XML_TEXT_NODE)
 			xml_escape_and_puts(buf, child->value);
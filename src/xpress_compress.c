@@ -270,18 +270,26 @@ xpress_init_output(struct xpress_output_bitstream *os, void *buffer, size_t size
 	os->end = os->start + size;
 }
 
+/*
+ * The maximum number of bytes that writing one match or literal can add to the
+ * output buffer: two coding units, plus three extra length bytes.
+ */
+#define XPRESS_MAX_ITEM_BYTES	7
+
 /*
  * Write some bits to the output bitstream.
  *
  * The bits are given by the low-order @num_bits bits of @bits.  Higher-order
  * bits in @bits cannot be set.  At most 16 bits can be written at once.
  *
- * If the output buffer space is exhausted, then the bits will be ignored, and
- * xpress_flush_output() will return 0 when it gets called.
+ * If @checked is %true and the output buffer space is exhausted, then the bits
+ * will be ignored, and xpress_flush_output() will return 0 when it gets called.
+ * If @checked is %false, then the caller must have verified that there is
+ * enough space.
  */
 static forceinline void
 xpress_write_bits(struct xpress_output_bitstream *os,
-		  const u32 bits, const unsigned num_bits)
+		  const u32 bits, const unsigned num_bits, const bool checked)
 {
 	/* This code is optimized for XPRESS, which never needs to write more
 	 * than 16 bits at once.  */
@@ -291,7 +299,7 @@ xpress_write_bits(struct xpress_output_bitstream *os,
 
 	if (os->bitcount > 16) {
 		os->bitcount -= 16;
-		if (os->end - os->next_byte >= 2) {
+		if (!checked || os->end - os->next_byte >= 2) {
 			put_unaligned_le16(os->bitbuf >> os->bitcount, os->next_bits);
 			os->next_bits = os->next_bits2;
 			os->next_bits2 = os->next_byte;
@@ -304,9 +312,10 @@ xpress_write_bits(struct xpress_output_bitstream *os,
  * Interweave a literal byte into the output bitstream.
  */
 static forceinline void
-xpress_write_byte(struct xpress_output_bitstream *os, u8 byte)
+xpress_write_byte(struct xpress_output_bitstream *os, u8 byte,
+		  const bool checked)
 {
-	if (os->next_byte < os->end)
+	if (!checked || os->next_byte < os->end)
 		*os->next_byte++ = byte;
 }
 
@@ -314,14 +323,24 @@ xpress_write_byte(struct xpress_output_bitstream *os, u8 byte)
  * Interweave two literal bytes into the output bitstream.
  */
 static forceinline void
-xpress_write_u16(struct xpress_output_bitstream *os, u16 v)
+xpress_write_u16(struct xpress_output_bitstream *os, u16 v, const bool checked)
 {
-	if (os->end - os->next_byte >= 2) {
+	if (!checked || os->end - os->next_byte >= 2) {
 		put_unaligned_le16(v, os->next_byte);
 		os->next_byte += 2;
 	}
 }
 
+/*
+ * Return %true if the next match or literal can be written without checking for
+ * the end of the output buffer.
+ */
+static forceinline bool
+xpress_have_room_for_item(const struct xpress_output_bitstream *os)
+{
+	return os->end - os->next_byte >= XPRESS_MAX_ITEM_BYTES;
+}
+
 /*
  * Flush the last coding unit to the output buffer if needed.  Return the total
  * number of bytes written to the output buffer, or 0 if an overflow occurred.
@@ -340,47 +359,91 @@ xpress_flush_output(struct xpress_output_bitstream *os)
 
 static forceinline void
 xpress_write_extra_length_bytes(struct xpress_output_bitstream *os,
-				unsigned adjusted_len)
+				unsigned adjusted_len, const bool checked)
 {
 	/* If length >= 18, output one extra length byte.
 	 * If length >= 273, output three (total) extra length bytes.  */
 	if (adjusted_len >= 0xF) {
 		u8 byte1 = min(adjusted_len - 0xF, 0xFF);
-		xpress_write_byte(os, byte1);
+		xpress_write_byte(os, byte1, checked);
 		if (byte1 == 0xFF)
-			xpress_write_u16(os, adjusted_len);
+			xpress_write_u16(os, adjusted_len, checked);
 	}
 }
 
 /* Output a match or literal.  */
 static forceinline void
 xpress_write_item(struct xpress_item item, struct xpress_output_bitstream *os,
-		  const u32 codewords[], const u8 lens[])
+		  const u32 codewords[], const u8 lens[], const bool checked)
 {
 	u64 data = item.data;
 	unsigned symbol = data & 0x1FF;
 
-	xpress_write_bits(os, codewords[symbol], lens[symbol]);
+	xpress_write_bits(os, codewords[symbol], lens[symbol], checked);
 
 	if (symbol >= XPRESS_NUM_CHARS) {
 		/* Match, not a literal  */
-		xpress_write_extra_length_bytes(os, (data >> 9) & 0xFFFF);
-		xpress_write_bits(os, data >> 29, (data >> 25) & 0xF);
+		xpress_write_extra_length_bytes(os, (data >> 9) & 0xFFFF,
+						checked);
+		xpress_write_bits(os, data >> 29, (data >> 25) & 0xF, checked);
 	}
 }
 
-/* Output a sequence of XPRESS matches and literals.  */
+/*
+ * Output a sequence of XPRESS matches and literals.  While the output buffer has
+ * plenty of space left, skip the end-of-buffer checks for the individual
+ * writes, and only do them once per item.
+ */
 static void
 xpress_write_items(struct xpress_output_bitstream *os,
 		   const struct xpress_item items[], size_t num_items,
 		   const u32 codewords[], const u8 lens[])
 {
-	for (size_t i = 0; i < num_items; i++)
-		xpress_write_item(items[i], os, codewords, lens);
+	size_t i = 0;
+
+	for (; i < num_items && xpress_have_room_for_item(os); i++)
+		xpress_write_item(items[i], os, codewords, lens, false);
+
+	for (; i < num_items; i++)
+		xpress_write_item(items[i], os, codewords, lens, true);
 }
 
 #if SUPPORT_NEAR_OPTIMAL_PARSING
 
+/* Output the match or literal chosen at one node of the minimum cost path.  */
+static forceinline void
+xpress_write_optimum_item(struct xpress_output_bitstream *os,
+			  const struct xpress_optimum_node *cur_node,
+			  const u32 codewords[], const u8 lens[],
+			  const bool checked)
+{
+	unsigned length = cur_node->item & OPTIMUM_LEN_MASK;
+	unsigned offset = cur_node->item >> OPTIMUM_OFFSET_SHIFT;
+
+	if (length == 1) {
+		/* Literal  */
+		unsigned literal = offset;
+
+		xpress_write_bits(os, codewords[literal], lens[literal], checked);
+	} else {
+		/* Match  */
+		unsigned adjusted_len;
+		unsigned log2_offset;
+		unsigned len_hdr;
+		unsigned sym;
+
+		adjusted_len = length - XPRESS_MIN_MATCH_LEN;
+		log2_offset = bsr32(offset);
+		len_hdr = min(0xF, adjusted_len);
+		sym = XPRESS_NUM_CHARS + ((log2_offset << 4) | len_hdr);
+
+		xpress_write_bits(os, codewords[sym], lens[sym], checked);
+		xpress_write_extra_length_bytes(os, adjusted_len, checked);
+		xpress_write_bits(os, offset - (1U << log2_offset), log2_offset,
+				  checked);
+	}
+}
+
 /*
  * Follow the minimum cost path in the graph of possible match/literal choices
  * and write out the matches/literals using the specified Huffman code.
@@ -396,34 +459,15 @@ xpress_write_item_list(struct xpress_output_bitstream *os,
 {
 	struct xpress_optimum_node *cur_node = optimum_nodes;
 	struct xpress_optimum_node *end_node = optimum_nodes + count;
-	do {
-		unsigned length = cur_node->item & OPTIMUM_LEN_MASK;
-		unsigned offset = cur_node->item >> OPTIMUM_OFFSET_SHIFT;
 
-		if (length == 1) {
-			/* Literal  */
-			unsigned literal = offset;
-
-			xpress_write_bits(os, codewords[literal], lens[literal]);
-		} else {
-			/* Match  */
-			unsigned adjusted_len;
-			unsigned log2_offset;
-			unsigned len_hdr;
-			unsigned sym;
-
-			adjusted_len = length - XPRESS_MIN_MATCH_LEN;
-			log2_offset = bsr32(offset);
-			len_hdr = min(0xF, adjusted_len);
-			sym = XPRESS_NUM_CHARS + ((log2_offset << 4) | len_hdr);
-
-			xpress_write_bits(os, codewords[sym], lens[sym]);
-			xpress_write_extra_length_bytes(os, adjusted_len);
-			xpress_write_bits(os, offset - (1U << log2_offset),
-					  log2_offset);
-		}
-		cur_node += length;
-	} while (cur_node != end_node);
+	while (cur_node != end_node && xpress_have_room_for_item(os)) {
+		xpress_write_optimum_item(os, cur_node, codewords, lens, false);
+		cur_node += cur_node->item & OPTIMUM_LEN_MASK;
+	}
+	while (cur_node != end_node) {
+		xpress_write_optimum_item(os, cur_node, codewords, lens, true);
+		cur_node += cur_node->item & OPTIMUM_LEN_MASK;
+	}
 }
 #endif /* SUPPORT_NEAR_OPTIMAL_PARSING */
 
@@ -471,7 +515,7 @@ xpress_write(struct xpress_compressor *c, void *out, size_t out_nbytes_avail,
 
 	/* Write the end-of-data symbol (needed for MS compatibility)  */
 	xpress_write_bits(&os, c->codewords[XPRESS_END_OF_DATA],
-			  c->lens[XPRESS_END_OF_DATA]);
+			  c->lens[XPRESS_END_OF_DATA], true);
 
 	/* Flush any pending data.  Then return the compressed size if the
 	 * compressed data fit in the output buffer, or 0 if it did not.  */
@@ -536,7 +580,7 @@ xpress_compress_greedy(struct xpress_compressor * restrict c,
 	else
 		len_3_too_far = 4096;
 
-	hc_matchfinder_init(&c->hc_mf);
+	hc_matchfinder_init(&c->hc_mf, in_nbytes);
 
 	do {
 		unsigned length;
@@ -599,7 +643,7 @@ xpress_compress_lazy(struct xpress_compressor * restrict c,
 	else
 		len_3_too_far = 4096;
 
-	hc_matchfinder_init(&c->hc_mf);
+	hc_matchfinder_init(&c->hc_mf, in_nbytes);
 
 	do {
 		unsigned cur_len;
@@ -1077,7 +1121,7 @@ xpress_create_compressor(size_t max_bufsize, unsigned compression_level,
 	if (max_bufsize > XPRESS_MAX_BUFSIZE)
 		return WIMLIB_ERR_INVALID_PARAM;
 
-	c = MALLOC(xpress_get_compressor_size(max_bufsize, compression_level));
+	c = LARGE_MALLOC(xpress_get_compressor_size(max_bufsize, compression_level));
 	if (!c)
 		goto oom0;
 
@@ -1109,14 +1153,14 @@ xpress_create_compressor(size_t max_bufsize, unsigned compression_level,
 #if SUPPORT_NEAR_OPTIMAL_PARSING
 	else {
 
-		c->optimum_nodes = MALLOC((max_bufsize + 1) *
-					  sizeof(struct xpress_optimum_node));
-		c->match_cache = MALLOC(((max_bufsize * CACHE_RESERVE_PER_POS) +
-					 XPRESS_MAX_MATCH_LEN + max_bufsize) *
-					sizeof(struct lz_match));
+		c->optimum_nodes = LARGE_MALLOC((max_bufsize + 1) *
+						sizeof(struct xpress_optimum_node));
+		c->match_cache = LARGE_MALLOC(((max_bufsize * CACHE_RESERVE_PER_POS) +
+					       XPRESS_MAX_MATCH_LEN + max_bufsize) *
+					      sizeof(struct lz_match));
 		if (!c->optimum_nodes || !c->match_cache) {
-			FREE(c->optimum_nodes);
-			FREE(c->match_cache);
+			LARGE_FREE(c->optimum_nodes);
+			LARGE_FREE(c->match_cache);
 			goto oom1;
 		}
 		c->cache_overflow_mark =
@@ -1137,7 +1181,7 @@ xpress_create_compressor(size_t max_bufsize, unsigned compression_level,
 	return 0;
 
 oom1:
-	FREE(c);
+	LARGE_FREE(c);
 oom0:
 	return WIMLIB_ERR_NOMEM;
 }
@@ -1167,12 +1211,12 @@ xpress_free_compressor(void *_c)
 
 #if SUPPORT_NEAR_OPTIMAL_PARSING
 	if (c->impl == xpress_compress_near_optimal) {
-		FREE(c->optimum_nodes);
-		FREE(c->match_cache);
+		LARGE_FREE(c->optimum_nodes);
+		LARGE_FREE(c->match_cache);
 	} else
 #endif
 		FREE(c->chosen_items);
-	FREE(c);
+	LARGE_FREE(c);
 }
 
 const struct compressor_ops xpress_compressor_ops = {
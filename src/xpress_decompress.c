@@ -70,12 +70,168 @@
 #include "wimlib/decompressor_ops.h"
 #include "wimlib/decompress_common.h"
 #include "wimlib/error.h"
+#include "wimlib/unaligned.h"
 #include "wimlib/util.h"
 #include "wimlib/xpress_constants.h"
 
 /* This value is chosen for fast decompression.  */
 #define XPRESS_TABLEBITS 11
 
+/*
+ * XPRESS doesn't use the generic input_bitstream, which reads one 16-bit coding
+ * unit whenever it runs low on bits.  Instead, the bit buffer is 64 bits and is
+ * refilled with as many coding units as fit, which is enough for at least three
+ * codewords.  This makes it possible to decode two literals and a match header
+ * per refill.
+ *
+ * The catch is that the extra length bytes of matches are interleaved in the
+ * bitstream at the position that a decoder which refills lazily, 16 bits at a
+ * time, would have reached.  Such a decoder always holds between 16 and 31 bits
+ * after preparing to read the offset bits of a match.  So before reading these
+ * bytes, the coding units that were read ahead of that are given back; see
+ * xpress_unread_units().
+ */
+struct xpress_input_bitstream {
+
+	/* Bits that have been read from the input buffer.  The bits are
+	 * left-justified; the next bit is always bit 63.  The bits after the
+	 * first @bitsleft are either 0 or the bits that follow in the input.  */
+	u64 bitbuf;
+
+	/* Number of bits currently held in @bitbuf.  */
+	unsigned bitsleft;
+
+	/* Number of coding units past the end of the input that have been
+	 * "read" as zeroes.  */
+	unsigned overrun_units;
+
+	/* Pointer to the next byte to be retrieved from the input buffer.  */
+	const u8 *next;
+
+	/* Pointer past the end of the input buffer.  */
+	const u8 *end;
+};
+
+static forceinline void
+xpress_init_input_bitstream(struct xpress_input_bitstream *is,
+			    const u8 *buffer, size_t size)
+{
+	is->bitbuf = 0;
+	is->bitsleft = 0;
+	is->overrun_units = 0;
+	is->next = buffer;
+	is->end = buffer + size;
+}
+
+/*
+ * Fill the bit buffer with as many whole coding units as fit, so that it
+ * contains at least 48 bits.  As with the generic bitstream, if the input is
+ * exhausted then the missing bits are taken to be zeroes.
+ */
+static forceinline void
+xpress_refill_bits(struct xpress_input_bitstream *is)
+{
+	if (likely(is->end - is->next >= 8)) {
+		/* Load the next four coding units and put the first one in the
+		 * high-order bits.  Bits of a unit that doesn't entirely fit
+		 * are also added, but not consumed; they will be added again
+		 * in the same place by the next refill.  */
+		u64 v = le64_to_cpu(load_le64_unaligned(is->next));
+
+		v = (v << 32) | (v >> 32);
+		v = ((v & 0x0000FFFF0000FFFF) << 16) |
+		    ((v >> 16) & 0x0000FFFF0000FFFF);
+		is->bitbuf |= v >> is->bitsleft;
+		is->next += 2 * (3 - (is->bitsleft >> 4));
+		is->bitsleft = 48 | (is->bitsleft & 15);
+	} else {
+		while (is->bitsleft < 48) {
+			if (is->end - is->next >= 2) {
+				is->bitbuf |= (u64)get_unaligned_le16(is->next) <<
+					      (48 - is->bitsleft);
+				is->next += 2;
+			} else {
+				is->overrun_units++;
+			}
+			is->bitsleft += 16;
+		}
+	}
+}
+
+/* Remove and return the next @num_bits bits, where @num_bits <= 32.  */
+static forceinline u32
+xpress_pop_bits(struct xpress_input_bitstream *is, unsigned num_bits)
+{
+	u32 bits = (is->bitbuf >> 1) >> (63 - num_bits);
+
+	is->bitbuf <<= num_bits;
+	is->bitsleft -= num_bits;
+	return bits;
+}
+
+/*
+ * Give back the coding units that a decoder refilling 16 bits at a time would
+ * not have read yet, so that the next byte is the next byte such a decoder
+ * would read.  There must be at least 16 bits in the buffer.
+ */
+static forceinline void
+xpress_unread_units(struct xpress_input_bitstream *is)
+{
+	unsigned excess = (is->bitsleft >> 4) - 1;
+
+	is->bitsleft -= excess * 16;
+	is->bitbuf &= ~(~(u64)0 >> is->bitsleft);
+	if (excess > is->overrun_units) {
+		is->next -= 2 * (excess - is->overrun_units);
+		is->overrun_units = 0;
+	} else {
+		is->overrun_units -= excess;
+	}
+}
+
+/* Read the next Huffman-encoded symbol.  There must be at least
+ * XPRESS_MAX_CODEWORD_LEN bits in the buffer.  */
+static forceinline unsigned
+xpress_decode_symbol(struct xpress_input_bitstream *is, const u16 decode_table[])
+{
+	unsigned entry;
+
+	entry = decode_table[is->bitbuf >> (64 - XPRESS_TABLEBITS)];
+	if (entry >= (1U << (XPRESS_TABLEBITS + DECODE_TABLE_SYMBOL_SHIFT))) {
+		/* Subtable required  */
+		is->bitbuf <<= XPRESS_TABLEBITS;
+		is->bitsleft -= XPRESS_TABLEBITS;
+		entry = decode_table[(entry >> DECODE_TABLE_SYMBOL_SHIFT) +
+				     (is->bitbuf >> (64 - (entry &
+						DECODE_TABLE_LENGTH_MASK)))];
+	}
+	is->bitbuf <<= entry & DECODE_TABLE_LENGTH_MASK;
+	is->bitsleft -= entry & DECODE_TABLE_LENGTH_MASK;
+	return entry >> DECODE_TABLE_SYMBOL_SHIFT;
+}
+
+/* Read the next literal byte embedded in the bitstream.  */
+static forceinline u8
+xpress_read_byte(struct xpress_input_bitstream *is)
+{
+	if (unlikely(is->end == is->next))
+		return 0;
+	return *is->next++;
+}
+
+/* Read the next 16-bit integer embedded in the bitstream.  */
+static forceinline u16
+xpress_read_u16(struct xpress_input_bitstream *is)
+{
+	u16 v;
+
+	if (unlikely(is->end - is->next < 2))
+		return 0;
+	v = get_unaligned_le16(is->next);
+	is->next += 2;
+	return v;
+}
+
 struct xpress_decompressor {
 	union {
 		DECODE_TABLE(decode_table, XPRESS_NUM_SYMBOLS,
@@ -96,7 +252,7 @@ xpress_decompress(const void *restrict compressed_data, size_t compressed_size,
 	u8 * const out_begin = uncompressed_data;
 	u8 *out_next = out_begin;
 	u8 * const out_end = out_begin + uncompressed_size;
-	struct input_bitstream is;
+	struct xpress_input_bitstream is;
 
 	/* Read the Huffman codeword lengths.  */
 	if (compressed_size < XPRESS_NUM_SYMBOLS / 2)
@@ -115,8 +271,8 @@ xpress_decompress(const void *restrict compressed_data, size_t compressed_size,
 
 	/* Decode the matches and literals.  */
 
-	init_input_bitstream(&is, in_begin + XPRESS_NUM_SYMBOLS / 2,
-			     compressed_size - XPRESS_NUM_SYMBOLS / 2);
+	xpress_init_input_bitstream(&is, in_begin + XPRESS_NUM_SYMBOLS / 2,
+				    compressed_size - XPRESS_NUM_SYMBOLS / 2);
 
 	while (out_next != out_end) {
 		unsigned sym;
@@ -124,35 +280,46 @@ xpress_decompress(const void *restrict compressed_data, size_t compressed_size,
 		u32 length;
 		u32 offset;
 
-		sym = read_huffsym(&is, d->decode_table,
-				   XPRESS_TABLEBITS, XPRESS_MAX_CODEWORD_LEN);
+		/* After the refill there are enough bits for two symbols and
+		 * the offset bits of a match.  */
+		xpress_refill_bits(&is);
+
+		sym = xpress_decode_symbol(&is, d->decode_table);
 		if (sym < XPRESS_NUM_CHARS) {
 			/* Literal  */
 			*out_next++ = sym;
-		} else {
-			/* Match  */
-			length = sym & 0xf;
-			log2_offset = (sym >> 4) & 0xf;
+			if (out_next == out_end)
+				break;
+			sym = xpress_decode_symbol(&is, d->decode_table);
+			if (sym < XPRESS_NUM_CHARS) {
+				*out_next++ = sym;
+				continue;
+			}
+		}
 
-			bitstream_ensure_bits(&is, 16);
+		/* Match  */
+		length = sym & 0xf;
+		log2_offset = (sym >> 4) & 0xf;
 
+		if (length == 0xf) {
+			xpress_unread_units(&is);
 			offset = ((u32)1 << log2_offset) |
-				 bitstream_pop_bits(&is, log2_offset);
-
-			if (length == 0xf) {
-				length += bitstream_read_byte(&is);
-				if (length == 0xf + 0xff)
-					length = bitstream_read_u16(&is);
-			}
-			length += XPRESS_MIN_MATCH_LEN;
+				 xpress_pop_bits(&is, log2_offset);
+			length += xpress_read_byte(&is);
+			if (length == 0xf + 0xff)
+				length = xpress_read_u16(&is);
+		} else {
+			offset = ((u32)1 << log2_offset) |
+				 xpress_pop_bits(&is, log2_offset);
+		}
+		length += XPRESS_MIN_MATCH_LEN;
 
-			if (unlikely(lz_copy(length, offset,
-					     out_begin, out_next, out_end,
-					     XPRESS_MIN_MATCH_LEN)))
-				return -1;
+		if (unlikely(lz_copy(length, offset,
+				     out_begin, out_next, out_end,
+				     XPRESS_MIN_MATCH_LEN)))
+			return -1;
 
-			out_next += length;
-		}
+		out_next += length;
 	}
 	return 0;
 }
@@ -0,0 +1,395 @@
+/*
+ * A program to test library operations that run at the same time as others,
+ * or that are interrupted and then done again
+ *
+ * Usage: concurrent-ops async SOURCE_DIR
+ *        concurrent-ops add-images SOURCE_DIR
+ *        concurrent-ops resume SOURCE_DIR
+ *
+ * 'async' captures SOURCE_DIR into async-base.wim, then starts, all at once,
+ * more asynchronous jobs than the library has job threads: writes of the image
+ * to async-write-N.wim and extractions of it to async-extract-N.  Then it
+ * cancels one write before it runs, and another from its own progress
+ * function.  It checks the results of all the jobs, that each completion
+ * callback was called once, and that the job cancelled before it ran didn't
+ * create its output file.  Comparing the output files with SOURCE_DIR is left
+ * to the calling script.
+ *
+ * 'add-images' adds SOURCE_DIR to one new WIMStruct as several images at once,
+ * from several threads, half of them with WIMLIB_ADD_FLAG_HASH_DURING_SCAN.
+ * Two of the threads use the same image name, so exactly one of them must fail.
+ * It checks the image count and names, then writes the WIM to add-images.wim.
+ * Checking its blob table and contents is left to the calling script.
+ *
+ * 'resume' captures SOURCE_DIR into resume.wim with WIMLIB_WRITE_FLAG_RESUMABLE
+ * and aborts the write from its progress function once about half of the file
+ * data has been written.  Then it does the same write again, which must resume
+ * from the checkpoint: it must succeed and write less file data than the first
+ * attempt meant to.  Checking resume.wim is left to the calling script.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "wimlib.h"
+
+#define NUM_JOBS	6
+#define NUM_ADDERS	6
+
+static void
+fail(const char *format, ...)
+{
+	va_list va;
+
+	va_start(va, format);
+	fputs("concurrent-ops: ", stderr);
+	vfprintf(stderr, format, va);
+	putc('\n', stderr);
+	va_end(va);
+	exit(1);
+}
+
+static void
+check(int ret, const char *what)
+{
+	if (ret)
+		fail("%s failed: %s", what, wimlib_get_error_string(ret));
+}
+
+static bool
+file_exists(const char *path)
+{
+	struct stat stbuf;
+
+	return stat(path, &stbuf) == 0 || errno != ENOENT;
+}
+
+/* Capture @dir into a new WIM file at @path.  */
+static void
+capture_dir(const char *dir, const char *path)
+{
+	WIMStruct *wim;
+
+	check(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_LZX, &wim),
+	      "wimlib_create_new_wim()");
+	check(wimlib_add_image(wim, dir, "base", NULL, 0),
+	      "wimlib_add_image()");
+	check(wimlib_write(wim, path, WIMLIB_ALL_IMAGES, 0, 0),
+	      "wimlib_write()");
+	wimlib_free(wim);
+}
+
+static WIMStruct *
+open_wim(const char *path)
+{
+	WIMStruct *wim;
+
+	check(wimlib_open_wim(path, 0, &wim), "wimlib_open_wim()");
+	return wim;
+}
+
+/************************** Asynchronous jobs ********************************/
+
+struct job_info {
+	struct wimlib_job *job;
+	WIMStruct *wim;
+	char path[64];
+	int expected_result;
+	bool expect_no_output;
+	int done_result;
+	int num_done_calls;
+};
+
+/* The job handle is only stored after the job has been started, so callbacks
+ * from the job may have to wait for it.  */
+static struct wimlib_job *
+get_job(struct job_info *info)
+{
+	struct wimlib_job *job;
+
+	while ((job = __atomic_load_n(&info->job, __ATOMIC_ACQUIRE)) == NULL)
+		;
+	return job;
+}
+
+static void
+job_done(struct wimlib_job *job, int result, void *done_ctx)
+{
+	struct job_info *info = done_ctx;
+
+	if (job != get_job(info))
+		fail("completion callback got the wrong job");
+	info->done_result = result;
+	__atomic_add_fetch(&info->num_done_calls, 1, __ATOMIC_RELAXED);
+}
+
+/* Progress function that cancels its job when it starts writing data  */
+static enum wimlib_progress_status
+cancel_on_write(enum wimlib_progress_msg msg,
+		union wimlib_progress_info *progress, void *progctx)
+{
+	struct job_info *info = progctx;
+
+	if (msg == WIMLIB_PROGRESS_MSG_WRITE_STREAMS)
+		wimlib_cancel_job(get_job(info));
+	return WIMLIB_PROGRESS_STATUS_CONTINUE;
+}
+
+static void
+start_write(struct job_info *info, WIMStruct *wim, int i, int ctype)
+{
+	struct wimlib_job *job;
+
+	info->wim = wim;
+	snprintf(info->path, sizeof(info->path), "async-write-%d.wim", i);
+	check(wimlib_set_output_compression_type(info->wim, ctype),
+	      "wimlib_set_output_compression_type()");
+	check(wimlib_write_async(info->wim, info->path, WIMLIB_ALL_IMAGES,
+				 WIMLIB_WRITE_FLAG_RECOMPRESS, 1,
+				 job_done, info, &job),
+	      "wimlib_write_async()");
+	__atomic_store_n(&info->job, job, __ATOMIC_RELEASE);
+}
+
+static void
+start_extract(struct job_info *info, WIMStruct *wim, int i)
+{
+	struct wimlib_job *job;
+
+	info->wim = wim;
+	snprintf(info->path, sizeof(info->path), "async-extract-%d", i);
+	check(wimlib_extract_image_async(info->wim, 1, info->path, 0,
+					 job_done, info, &job),
+	      "wimlib_extract_image_async()");
+	__atomic_store_n(&info->job, job, __ATOMIC_RELEASE);
+}
+
+static void
+test_async(const char *dir)
+{
+	static const int ctypes[] = {
+		WIMLIB_COMPRESSION_TYPE_LZX,
+		WIMLIB_COMPRESSION_TYPE_XPRESS,
+		WIMLIB_COMPRESSION_TYPE_LZMS,
+	};
+	struct job_info jobs[NUM_JOBS + 2] = {};
+	struct job_info *queued = &jobs[NUM_JOBS];
+	struct job_info *running = &jobs[NUM_JOBS + 1];
+
+	capture_dir(dir, "async-base.wim");
+
+	for (int i = 0; i < NUM_JOBS; i++) {
+		WIMStruct *wim = open_wim("async-base.wim");
+
+		if (i % 2 == 0)
+			start_write(&jobs[i], wim, i, ctypes[(i / 2) % 3]);
+		else
+			start_extract(&jobs[i], wim, i);
+	}
+
+	/* The job threads are all busy, so this job hasn't started yet.  */
+	start_write(queued, open_wim("async-base.wim"), NUM_JOBS, ctypes[0]);
+	wimlib_cancel_job(queued->job);
+	queued->expected_result = WIMLIB_ERR_ABORTED_BY_PROGRESS;
+	queued->expect_no_output = true;
+
+	/* This job cancels itself once it is underway.  */
+	running->wim = open_wim("async-base.wim");
+	wimlib_register_progress_function(running->wim, cancel_on_write,
+					  running);
+	start_write(running, running->wim, NUM_JOBS + 1, ctypes[2]);
+	running->expected_result = WIMLIB_ERR_ABORTED_BY_PROGRESS;
+
+	for (int i = 0; i < NUM_JOBS + 2; i++) {
+		struct job_info *info = &jobs[i];
+		int ret = wimlib_wait_job(info->job);
+
+		if (ret != info->expected_result)
+			fail("job %d returned %d, expected %d", i, ret,
+			     info->expected_result);
+		if (info->num_done_calls != 1 || info->done_result != ret)
+			fail("job %d: completion callback called %d times "
+			     "with %d", i, info->num_done_calls,
+			     info->done_result);
+		if (info->expect_no_output && file_exists(info->path))
+			fail("cancelled job %d left \"%s\" behind", i,
+			     info->path);
+		wimlib_free(info->wim);
+	}
+}
+
+/************************** Concurrent image additions ***********************/
+
+struct adder {
+	pthread_t thread;
+	WIMStruct *wim;
+	const char *dir;
+	char name[32];
+	int add_flags;
+	int result;
+};
+
+static void *
+add_image_thread(void *arg)
+{
+	struct adder *adder = arg;
+
+	adder->result = wimlib_add_image(adder->wim, adder->dir, adder->name,
+					 NULL, adder->add_flags);
+	return NULL;
+}
+
+static void
+test_add_images(const char *dir)
+{
+	struct adder adders[NUM_ADDERS];
+	struct wimlib_wim_info info;
+	WIMStruct *wim;
+	int num_collisions = 0;
+
+	check(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_LZX, &wim),
+	      "wimlib_create_new_wim()");
+
+	for (int i = 0; i < NUM_ADDERS; i++) {
+		struct adder *adder = &adders[i];
+
+		adder->wim = wim;
+		adder->dir = dir;
+		/* The last two threads add images with the same name.  */
+		snprintf(adder->name, sizeof(adder->name), "image-%d",
+			 i < NUM_ADDERS - 1 ? i : i - 1);
+		adder->add_flags = (i % 2) ? WIMLIB_ADD_FLAG_HASH_DURING_SCAN : 0;
+		if (pthread_create(&adder->thread, NULL, add_image_thread,
+				   adder))
+			fail("pthread_create() failed");
+	}
+
+	for (int i = 0; i < NUM_ADDERS; i++) {
+		struct adder *adder = &adders[i];
+
+		pthread_join(adder->thread, NULL);
+		if (adder->result == WIMLIB_ERR_IMAGE_NAME_COLLISION &&
+		    i >= NUM_ADDERS - 2)
+			num_collisions++;
+		else
+			check(adder->result, "wimlib_add_image()");
+	}
+	if (num_collisions != 1)
+		fail("%d images with a duplicate name were rejected, expected 1",
+		     num_collisions);
+
+	check(wimlib_get_wim_info(wim, &info), "wimlib_get_wim_info()");
+	if (info.image_count != NUM_ADDERS - 1)
+		fail("WIM has %d images, expected %d", info.image_count,
+		     NUM_ADDERS - 1);
+	for (int i = 0; i < NUM_ADDERS - 1; i++) {
+		char name[32];
+		int image;
+
+		snprintf(name, sizeof(name), "image-%d", i);
+		image = wimlib_resolve_image(wim, name);
+		if (image == WIMLIB_NO_IMAGE)
+			fail("image \"%s\" is missing", name);
+		for (int j = 1; j <= info.image_count; j++)
+			if (j != image &&
+			    !strcmp(wimlib_get_image_name(wim, j), name))
+				fail("image \"%s\" was added twice", name);
+	}
+
+	check(wimlib_write(wim, "add-images.wim", WIMLIB_ALL_IMAGES, 0, 0),
+	      "wimlib_write()");
+	wimlib_free(wim);
+}
+
+/************************** Resumed writes ***********************************/
+
+struct resume_info {
+	bool abort_halfway;
+	bool aborted;
+	uint64_t total_bytes;
+};
+
+/* Progress function that records how much file data the write has to write,
+ * and that aborts the write halfway through if asked to.  */
+static enum wimlib_progress_status
+abort_halfway(enum wimlib_progress_msg msg,
+	      union wimlib_progress_info *progress, void *progctx)
+{
+	struct resume_info *info = progctx;
+
+	if (msg != WIMLIB_PROGRESS_MSG_WRITE_STREAMS)
+		return WIMLIB_PROGRESS_STATUS_CONTINUE;
+	info->total_bytes = progress->write_streams.total_bytes;
+	if (info->abort_halfway &&
+	    progress->write_streams.completed_bytes >= info->total_bytes / 2)
+	{
+		info->aborted = true;
+		return WIMLIB_PROGRESS_STATUS_ABORT;
+	}
+	return WIMLIB_PROGRESS_STATUS_CONTINUE;
+}
+
+static int
+write_resumable(const char *dir, struct resume_info *info)
+{
+	WIMStruct *wim;
+	int ret;
+
+	check(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_LZX, &wim),
+	      "wimlib_create_new_wim()");
+	wimlib_register_progress_function(wim, abort_halfway, info);
+	check(wimlib_add_image(wim, dir, "base", NULL, 0),
+	      "wimlib_add_image()");
+	ret = wimlib_write(wim, "resume.wim", WIMLIB_ALL_IMAGES,
+			   WIMLIB_WRITE_FLAG_RESUMABLE, 1);
+	wimlib_free(wim);
+	return ret;
+}
+
+static void
+test_resume(const char *dir)
+{
+	struct resume_info first = { .abort_halfway = true };
+	struct resume_info second = {};
+	int ret;
+
+	ret = write_resumable(dir, &first);
+	if (ret != WIMLIB_ERR_ABORTED_BY_PROGRESS || !first.aborted)
+		fail("interrupted write returned %d, expected %d", ret,
+		     WIMLIB_ERR_ABORTED_BY_PROGRESS);
+	if (!file_exists("resume.wim.checkpoint"))
+		fail("interrupted write didn't leave a checkpoint");
+
+	check(write_resumable(dir, &second), "resumed wimlib_write()");
+	if (file_exists("resume.wim.checkpoint"))
+		fail("resumed write didn't delete the checkpoint");
+	if (second.total_bytes >= first.total_bytes)
+		fail("resumed write wrote all %llu bytes of file data again",
+		     (unsigned long long)second.total_bytes);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 3)
+		fail("usage: concurrent-ops {async,add-images,resume} SOURCE_DIR");
+
+	if (!strcmp(argv[1], "async"))
+		test_async(argv[2]);
+	else if (!strcmp(argv[1], "add-images"))
+		test_add_images(argv[2]);
+	else if (!strcmp(argv[1], "resume"))
+		test_resume(argv[2]);
+	else
+		fail("unknown test \"%s\"", argv[1]);
+
+	wimlib_global_cleanup();
+	return 0;
+}
@@ -0,0 +1,338 @@
+/*
+ * benchmark_compression.c
+ *
+ * Program to measure the compression ratio and speed of wimlib's compressors
+ * and decompressors, using only the public compression API.  The input files
+ * are concatenated into a corpus, which is split into chunks of each requested
+ * size and compressed independently, as in a WIM resource.  One JSON object is
+ * printed per (compression type, chunk size, compression level) combination,
+ * so that the results can be compared between builds by a script.
+ *
+ * Usage: benchmark_compression [-t TYPES] [-s CHUNK_SIZES] [-l LEVELS]
+ *				[-r REPEATS] FILE...
+ *
+ * TYPES is a comma-separated list of XPRESS, LZX, and LZMS; CHUNK_SIZES and
+ * LEVELS are comma-separated lists of numbers.  Combinations that a compression
+ * type doesn't support, such as 1 MiB XPRESS chunks, are skipped.  Each
+ * compression and decompression pass is repeated REPEATS times, and the fastest
+ * pass is reported.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+
+#define MAX_LIST_LEN	32
+
+static const char *default_ctypes = "XPRESS,LZX,LZMS";
+static const char *default_chunk_sizes = "32768,65536,1048576,67108864";
+static const char *default_levels = "10,20,50,80,100";
+
+static void
+fatal(const char *msg)
+{
+	fprintf(stderr, "benchmark_compression: %s\n", msg);
+	exit(1);
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (!p)
+		fatal("out of memory");
+	return p;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parse a comma-separated list of unsigned numbers.  */
+static size_t
+parse_num_list(const char *str, uint64_t list[MAX_LIST_LEN])
+{
+	size_t n = 0;
+	char *end;
+
+	for (;;) {
+		if (n == MAX_LIST_LEN)
+			fatal("too many list items");
+		errno = 0;
+		list[n++] = strtoull(str, &end, 10);
+		if (errno || end == str || (*end != ',' && *end != '\0'))
+			fatal("invalid number in list");
+		if (*end == '\0')
+			return n;
+		str = end + 1;
+	}
+}
+
+/* Parse a comma-separated list of compression type names.  */
+static size_t
+parse_ctype_list(const char *str, enum wimlib_compression_type list[MAX_LIST_LEN])
+{
+	static const enum wimlib_compression_type ctypes[] = {
+		WIMLIB_COMPRESSION_TYPE_XPRESS,
+		WIMLIB_COMPRESSION_TYPE_LZX,
+		WIMLIB_COMPRESSION_TYPE_LZMS,
+	};
+	size_t n = 0;
+
+	while (*str) {
+		size_t len = strcspn(str, ",");
+		size_t i;
+
+		for (i = 0; i < sizeof(ctypes) / sizeof(ctypes[0]); i++) {
+			const char *name =
+				wimlib_get_compression_type_string(ctypes[i]);
+
+			if (strlen(name) == len && !strncmp(str, name, len))
+				break;
+		}
+		if (i == sizeof(ctypes) / sizeof(ctypes[0]))
+			fatal("unknown compression type");
+		if (n == MAX_LIST_LEN)
+			fatal("too many list items");
+		list[n++] = ctypes[i];
+		str += len;
+		if (*str == ',')
+			str++;
+	}
+	return n;
+}
+
+/* Concatenate the files into one buffer.  */
+static uint8_t *
+read_corpus(char **paths, int num_paths, size_t *size_ret)
+{
+	uint8_t *buf = NULL;
+	size_t size = 0;
+
+	for (int i = 0; i < num_paths; i++) {
+		FILE *fp = fopen(paths[i], "rb");
+		size_t n;
+
+		if (!fp) {
+			fprintf(stderr, "benchmark_compression: %s: %s\n",
+				paths[i], strerror(errno));
+			exit(1);
+		}
+		do {
+			buf = realloc(buf, size + 65536);
+			if (!buf)
+				fatal("out of memory");
+			n = fread(buf + size, 1, 65536, fp);
+			size += n;
+		} while (n == 65536);
+		if (ferror(fp))
+			fatal("error reading input file");
+		fclose(fp);
+	}
+	*size_ret = size;
+	return buf;
+}
+
+struct result {
+	uint64_t compressed_size;
+	uint64_t compress_ns;
+	uint64_t decompress_ns;
+};
+
+/*
+ * Compress and decompress the corpus in chunks of @chunk_size bytes.  A chunk
+ * that doesn't get smaller is stored as-is, as in a WIM resource, so it counts
+ * at its original size and isn't decompressed.  Returns false if the
+ * compression type doesn't support the chunk size or compression level.
+ */
+static bool
+run_one(enum wimlib_compression_type ctype, size_t chunk_size, unsigned level,
+	const uint8_t *corpus, size_t corpus_size, unsigned repeats,
+	struct result *result)
+{
+	struct wimlib_compressor *c;
+	struct wimlib_decompressor *d;
+	size_t num_chunks = (corpus_size + chunk_size - 1) / chunk_size;
+	uint8_t *cbuf = xmalloc(corpus_size);
+	size_t *csizes = xmalloc(num_chunks * sizeof(csizes[0]));
+	uint8_t *dbuf = xmalloc(chunk_size);
+
+	if (wimlib_create_compressor(ctype, chunk_size, level, &c)) {
+		free(dbuf);
+		free(csizes);
+		free(cbuf);
+		return false;
+	}
+	if (wimlib_create_decompressor(ctype, chunk_size, &d))
+		fatal("failed to create decompressor");
+
+	result->compress_ns = UINT64_MAX;
+	result->decompress_ns = UINT64_MAX;
+
+	for (unsigned r = 0; r < repeats; r++) {
+		uint64_t start = now_ns(), elapsed;
+		size_t out = 0;
+
+		for (size_t i = 0; i < num_chunks; i++) {
+			size_t offset = i * chunk_size;
+			size_t usize = corpus_size - offset < chunk_size ?
+				       corpus_size - offset : chunk_size;
+
+			csizes[i] = wimlib_compress(corpus + offset, usize,
+						    cbuf + out, usize - 1, c);
+			out += csizes[i] ? csizes[i] : usize;
+		}
+		elapsed = now_ns() - start;
+		if (elapsed < result->compress_ns)
+			result->compress_ns = elapsed;
+		result->compressed_size = out;
+	}
+
+	for (unsigned r = 0; r < repeats; r++) {
+		uint64_t start = now_ns(), elapsed;
+		size_t in = 0;
+
+		for (size_t i = 0; i < num_chunks; i++) {
+			size_t offset = i * chunk_size;
+			size_t usize = corpus_size - offset < chunk_size ?
+				       corpus_size - offset : chunk_size;
+
+			if (!csizes[i]) {
+				in += usize;
+				continue;
+			}
+			if (wimlib_decompress(cbuf + in, csizes[i],
+					      dbuf, usize, d) ||
+			    memcmp(dbuf, corpus + offset, usize))
+				fatal("data did not round-trip");
+			in += csizes[i];
+		}
+		elapsed = now_ns() - start;
+		if (elapsed < result->decompress_ns)
+			result->decompress_ns = elapsed;
+	}
+
+	wimlib_free_decompressor(d);
+	wimlib_free_compressor(c);
+	free(dbuf);
+	free(csizes);
+	free(cbuf);
+	return true;
+}
+
+static double
+mb_per_sec(size_t size, uint64_t ns)
+{
+	return ns ? (double)size / 1e6 / ((double)ns / 1e9) : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *ctypes_str = default_ctypes;
+	const char *chunk_sizes_str = default_chunk_sizes;
+	const char *levels_str = default_levels;
+	unsigned repeats = 1;
+	enum wimlib_compression_type ctypes[MAX_LIST_LEN];
+	uint64_t chunk_sizes[MAX_LIST_LEN];
+	uint64_t levels[MAX_LIST_LEN];
+	size_t num_ctypes, num_chunk_sizes, num_levels;
+	uint8_t *corpus;
+	size_t corpus_size;
+	bool first = true;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:s:l:r:")) != -1) {
+		switch (c) {
+		case 't':
+			ctypes_str = optarg;
+			break;
+		case 's':
+			chunk_sizes_str = optarg;
+			break;
+		case 'l':
+			levels_str = optarg;
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			if (repeats == 0)
+				fatal("invalid repeat count");
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc)
+		goto usage;
+
+	num_ctypes = parse_ctype_list(ctypes_str, ctypes);
+	num_chunk_sizes = parse_num_list(chunk_sizes_str, chunk_sizes);
+	num_levels = parse_num_list(levels_str, levels);
+
+	corpus = read_corpus(&argv[optind], argc - optind, &corpus_size);
+	if (corpus_size == 0)
+		fatal("the input is empty");
+
+	printf("[\n");
+	for (size_t i = 0; i < num_ctypes; i++) {
+		for (size_t j = 0; j < num_chunk_sizes; j++) {
+			size_t chunk_size = chunk_sizes[j];
+
+			for (size_t k = 0; k < num_levels; k++) {
+				struct result res;
+
+				if (!run_one(ctypes[i], chunk_size, levels[k],
+					     corpus, corpus_size, repeats,
+					     &res))
+					continue;
+				printf("%s  {\"ctype\": \"%s\", "
+				       "\"chunk_size\": %zu, "
+				       "\"level\": %u, "
+				       "\"uncompressed_size\": %zu, "
+				       "\"compressed_size\": %"PRIu64", "
+				       "\"ratio\": %.4f, "
+				       "\"compress_mb_per_sec\": %.2f, "
+				       "\"decompress_mb_per_sec\": %.2f, "
+				       "\"compressor_memory\": %"PRIu64"}",
+				       first ? "" : ",\n",
+				       wimlib_get_compression_type_string(ctypes[i]),
+				       chunk_size, (unsigned)levels[k],
+				       corpus_size, res.compressed_size,
+				       (double)res.compressed_size / corpus_size,
+				       mb_per_sec(corpus_size, res.compress_ns),
+				       mb_per_sec(corpus_size, res.decompress_ns),
+				       wimlib_get_compressor_needed_memory(
+						ctypes[i], chunk_size,
+						levels[k]));
+				fflush(stdout);
+				first = false;
+			}
+		}
+	}
+	printf("\n]\n");
+	free(corpus);
+	return 0;
+
+usage:
+	fprintf(stderr,
+		"Usage: %s [-t TYPES] [-s CHUNK_SIZES] [-l LEVELS] "
+		"[-r REPEATS] FILE...\n", argv[0]);
+	return 2;
+}
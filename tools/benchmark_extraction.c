@@ -0,0 +1,424 @@
+/*
+ * benchmark_extraction.c
+ *
+ * Program to measure wimlib end to end on a reproducible synthetic directory
+ * tree: capture, write, verify, and extract.  The tree is generated from a
+ * seed, so every run with the same options works on exactly the same files,
+ * and a change to the capture or extraction code can be compared against a
+ * baseline.  One JSON object is printed with the parameters and the time taken
+ * by each phase.
+ *
+ * Usage: benchmark_extraction [OPTION]... WORKDIR
+ *
+ *   -f NUM_FILES     number of file names to create (default 10000)
+ *   -s MEAN_SIZE     mean file size in bytes; sizes are exponentially
+ *		      distributed (default 32768)
+ *   -D PERCENT       percentage of files whose contents duplicate an
+ *		      earlier file's contents (default 10)
+ *   -H PERCENT       percentage of file names that are hard links to an
+ *		      earlier file (default 5)
+ *   -c CTYPE         compression type: none, XPRESS, LZX, or LZMS
+ *		      (default LZX)
+ *   -t THREADS       number of compression threads (default: all processors)
+ *   -S SEED          seed of the tree generator (default 1)
+ *   -n DEVICE        also extract to the NTFS volume DEVICE, which will be
+ *		      overwritten (only if wimlib was built with ntfs-3g support)
+ *   -k               keep the files in WORKDIR
+ *
+ * WORKDIR is created, and must not already exist.  Generating the tree is not
+ * timed.  The file data compresses about 2:1, like typical executables.
+ * Capture only scans the tree; the file data is read and hashed while writing.
+ * Nothing is done about the page cache, so the write and verify phases
+ * generally read data that is still cached from the previous phase.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wimlib.h"
+
+#define FILES_PER_DIR	128
+#define NUM_WORDS	1024
+#define MAX_FILE_SIZE	(UINT64_C(1) << 30)
+
+static unsigned num_files = 10000;
+static uint64_t mean_size = 32768;
+static unsigned dedup_percent = 10;
+static unsigned hardlink_percent = 5;
+static enum wimlib_compression_type ctype = WIMLIB_COMPRESSION_TYPE_LZX;
+static unsigned num_threads = 0;
+static uint64_t seed = 1;
+static const char *ntfs_device;
+static bool keep_files;
+
+static void
+fatal(const char *msg)
+{
+	fprintf(stderr, "benchmark_extraction: %s\n", msg);
+	exit(1);
+}
+
+static void
+fatal_errno(const char *msg, const char *path)
+{
+	fprintf(stderr, "benchmark_extraction: %s \"%s\": %s\n",
+		msg, path, strerror(errno));
+	exit(1);
+}
+
+static void
+check_wimlib(int ret, const char *what)
+{
+	if (ret) {
+		fprintf(stderr, "benchmark_extraction: %s failed: %s\n",
+			what, wimlib_get_error_string(ret));
+		exit(1);
+	}
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (!p)
+		fatal("out of memory");
+	return p;
+}
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*  */
+static uint64_t
+next_rand(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * UINT64_C(2685821657736338717);
+}
+
+/* Return a random number in [0, 1).  */
+static double
+rand_unit(uint64_t *state)
+{
+	return (next_rand(state) >> 11) / 9007199254740992.0;
+}
+
+/* The "words" from which file data is built  */
+static uint8_t words[NUM_WORDS][16];
+static uint8_t word_lens[NUM_WORDS];
+
+static void
+init_words(uint64_t *state)
+{
+	for (int i = 0; i < NUM_WORDS; i++) {
+		word_lens[i] = 2 + next_rand(state) % 15;
+		for (int j = 0; j < word_lens[i]; j++)
+			words[i][j] = next_rand(state);
+	}
+}
+
+/* Write @size bytes of data, determined by @content_seed, to @path.  The data
+ * is mostly a sequence of words chosen with a skewed distribution, with some
+ * random bytes mixed in.  */
+static void
+write_file(const char *path, uint64_t content_seed, uint64_t size)
+{
+	static uint8_t buf[65536 + 16];
+	uint64_t state = content_seed | 1;
+	FILE *fp = fopen(path, "wb");
+
+	if (!fp)
+		fatal_errno("can't create", path);
+	while (size) {
+		size_t n = 0;
+		size_t len = size < 65536 ? size : 65536;
+
+		while (n < len) {
+			uint64_t r = next_rand(&state);
+
+			if ((r & 15) == 0) {
+				buf[n++] = r >> 8;
+			} else {
+				/* Squaring favors the low-numbered words.  */
+				unsigned w = (((r >> 16) & 0xFFFF) *
+					      ((r >> 32) & 0xFFFF) >> 22) %
+					     NUM_WORDS;
+
+				memcpy(&buf[n], words[w], word_lens[w]);
+				n += word_lens[w];
+			}
+		}
+		if (fwrite(buf, 1, len, fp) != len)
+			fatal_errno("error writing", path);
+		size -= len;
+	}
+	if (fclose(fp))
+		fatal_errno("error writing", path);
+}
+
+struct tree_stats {
+	uint64_t total_bytes;	/* of all files, not counting hard links  */
+	uint64_t unique_bytes;	/* of all distinct file contents  */
+	unsigned num_links;
+	unsigned num_dups;
+};
+
+/* Generate the synthetic tree in @dir.  */
+static void
+generate_tree(const char *dir, struct tree_stats *stats)
+{
+	uint64_t state = seed * UINT64_C(0x9E3779B97F4A7C15) + 1;
+	uint64_t *content_seeds = xmalloc(num_files * sizeof(content_seeds[0]));
+	uint64_t *content_sizes = xmalloc(num_files * sizeof(content_sizes[0]));
+	unsigned *regular_files = xmalloc(num_files * sizeof(regular_files[0]));
+	unsigned num_contents = 0, num_regular = 0;
+	size_t pathlen = strlen(dir) + 32;
+	char *path = xmalloc(pathlen);
+	char *target = xmalloc(pathlen);
+
+	memset(stats, 0, sizeof(*stats));
+	init_words(&state);
+	if (mkdir(dir, 0755))
+		fatal_errno("can't create directory", dir);
+
+	for (unsigned i = 0; i < num_files; i++) {
+		if (i % FILES_PER_DIR == 0) {
+			snprintf(path, pathlen, "%s/d%05u", dir,
+				 i / FILES_PER_DIR);
+			if (mkdir(path, 0755))
+				fatal_errno("can't create directory", path);
+		}
+		snprintf(path, pathlen, "%s/d%05u/f%07u", dir,
+			 i / FILES_PER_DIR, i);
+
+		if (num_regular && next_rand(&state) % 100 < hardlink_percent) {
+			unsigned j = regular_files[next_rand(&state) %
+						   num_regular];
+
+			snprintf(target, pathlen, "%s/d%05u/f%07u", dir,
+				 j / FILES_PER_DIR, j);
+			if (link(target, path))
+				fatal_errno("can't create hard link", path);
+			stats->num_links++;
+			continue;
+		}
+
+		if (num_contents && next_rand(&state) % 100 < dedup_percent) {
+			unsigned j = next_rand(&state) % num_contents;
+
+			write_file(path, content_seeds[j], content_sizes[j]);
+			stats->total_bytes += content_sizes[j];
+			stats->num_dups++;
+		} else {
+			uint64_t size = -log(1 - rand_unit(&state)) * mean_size;
+
+			if (size > MAX_FILE_SIZE)
+				size = MAX_FILE_SIZE;
+			content_seeds[num_contents] = next_rand(&state);
+			content_sizes[num_contents] = size;
+			write_file(path, content_seeds[num_contents], size);
+			num_contents++;
+			stats->total_bytes += size;
+			stats->unique_bytes += size;
+		}
+		regular_files[num_regular++] = i;
+	}
+	free(target);
+	free(path);
+	free(regular_files);
+	free(content_sizes);
+	free(content_seeds);
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int type, struct FTW *f)
+{
+	return remove(path);
+}
+
+static void
+remove_tree(const char *path)
+{
+	if (nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS))
+		fatal_errno("can't remove", path);
+}
+
+static double
+mb_per_sec(uint64_t bytes, double sec)
+{
+	return sec > 0 ? bytes / 1e6 / sec : 0;
+}
+
+static void
+print_phase(const char *name, double sec, uint64_t bytes)
+{
+	printf(",\n  \"%s_sec\": %.3f, \"%s_mb_per_sec\": %.2f",
+	       name, sec, name, mb_per_sec(bytes, sec));
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *workdir;
+	char *src, *wimfile, *out;
+	struct tree_stats stats;
+	WIMStruct *wim;
+	struct stat st;
+	double start, capture_sec, write_sec, verify_sec, extract_sec;
+	double ntfs_sec = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:s:D:H:c:t:S:n:k")) != -1) {
+		switch (c) {
+		case 'f':
+			num_files = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			mean_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'D':
+			dedup_percent = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			hardlink_percent = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			if (!strcmp(optarg, "none"))
+				ctype = WIMLIB_COMPRESSION_TYPE_NONE;
+			else if (!strcmp(optarg, "XPRESS"))
+				ctype = WIMLIB_COMPRESSION_TYPE_XPRESS;
+			else if (!strcmp(optarg, "LZX"))
+				ctype = WIMLIB_COMPRESSION_TYPE_LZX;
+			else if (!strcmp(optarg, "LZMS"))
+				ctype = WIMLIB_COMPRESSION_TYPE_LZMS;
+			else
+				fatal("unknown compression type");
+			break;
+		case 't':
+			num_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			ntfs_device = optarg;
+			break;
+		case 'k':
+			keep_files = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	if (num_files == 0 || dedup_percent > 100 || hardlink_percent > 100)
+		fatal("invalid parameters");
+
+	workdir = argv[optind];
+	src = xmalloc(strlen(workdir) + 16);
+	wimfile = xmalloc(strlen(workdir) + 16);
+	out = xmalloc(strlen(workdir) + 16);
+	sprintf(src, "%s/src", workdir);
+	sprintf(wimfile, "%s/bench.wim", workdir);
+	sprintf(out, "%s/out", workdir);
+
+	if (mkdir(workdir, 0755))
+		fatal_errno("can't create directory", workdir);
+	generate_tree(src, &stats);
+
+	check_wimlib(wimlib_global_init(0), "initializing wimlib");
+
+	/* Capture  */
+	check_wimlib(wimlib_create_new_wim(ctype, &wim), "creating WIM");
+	start = now_sec();
+	check_wimlib(wimlib_add_image(wim, src, "bench", NULL, 0), "capture");
+	capture_sec = now_sec() - start;
+
+	/* Write  */
+	start = now_sec();
+	check_wimlib(wimlib_write(wim, wimfile, WIMLIB_ALL_IMAGES, 0,
+				  num_threads), "write");
+	write_sec = now_sec() - start;
+	wimlib_free(wim);
+
+	/* Verify  */
+	check_wimlib(wimlib_open_wim(wimfile, 0, &wim), "opening WIM");
+	wimlib_set_decompression_threads(wim, num_threads);
+	start = now_sec();
+	check_wimlib(wimlib_verify_wim(wim, 0), "verify");
+	verify_sec = now_sec() - start;
+
+	/* Extract  */
+	start = now_sec();
+	check_wimlib(wimlib_extract_image(wim, 1, out, 0), "extract");
+	extract_sec = now_sec() - start;
+
+	if (ntfs_device) {
+		start = now_sec();
+		check_wimlib(wimlib_extract_image(wim, 1, ntfs_device,
+						  WIMLIB_EXTRACT_FLAG_NTFS),
+			     "NTFS extract");
+		ntfs_sec = now_sec() - start;
+	}
+	wimlib_free(wim);
+
+	if (stat(wimfile, &st))
+		fatal_errno("can't stat", wimfile);
+
+	printf("{\"num_files\": %u, \"hard_links\": %u, \"duplicates\": %u, "
+	       "\"mean_size\": %"PRIu64", \"seed\": %"PRIu64", "
+	       "\"ctype\": \"%s\",\n"
+	       "  \"total_bytes\": %"PRIu64", \"unique_bytes\": %"PRIu64", "
+	       "\"wim_bytes\": %"PRIu64,
+	       num_files, stats.num_links, stats.num_dups, mean_size, seed,
+	       wimlib_get_compression_type_string(ctype),
+	       stats.total_bytes, stats.unique_bytes, (uint64_t)st.st_size);
+	print_phase("capture", capture_sec, stats.total_bytes);
+	print_phase("write", write_sec, stats.unique_bytes);
+	print_phase("verify", verify_sec, stats.unique_bytes);
+	print_phase("extract", extract_sec, stats.total_bytes);
+	if (ntfs_device)
+		print_phase("ntfs_extract", ntfs_sec, stats.total_bytes);
+	printf("\n}\n");
+
+	wimlib_global_cleanup();
+	if (!keep_files)
+		remove_tree(workdir);
+	free(out);
+	free(wimfile);
+	free(src);
+	return 0;
+
+usage:
+	fprintf(stderr,
+		"Usage: %s [-f NUM_FILES] [-s MEAN_SIZE] [-D DEDUP_PERCENT] "
+		"[-H HARDLINK_PERCENT]\n"
+		"       [-c CTYPE] [-t THREADS] [-S SEED] [-n NTFS_DEVICE] "
+		"[-k] WORKDIR\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,403 @@
+/*
+ * benchmark_matchfinders.c
+ *
+ * Program to measure the speed of the Lempel-Ziv matchfinders in isolation
+ * from the compressors that use them.  The input files are concatenated into a
+ * corpus, which is split into windows of each requested size.  Each
+ * matchfinder is run over every window twice: once searching for matches at
+ * every position ("find"), and once only advancing over every position
+ * ("skip").  One JSON object is printed per (matchfinder, window size,
+ * operation) combination, so that the results can be compared between builds
+ * by a script.
+ *
+ * Usage: benchmark_matchfinders [-m MATCHFINDERS] [-w WINDOW_SIZES]
+ *				 [-n NICE_LEN] [-d MAX_SEARCH_DEPTH]
+ *				 [-r REPEATS] FILE...
+ *
+ * MATCHFINDERS is a comma-separated list of bt, hc, and lcpit; WINDOW_SIZES is
+ * a comma-separated list of numbers.  NICE_LEN and MAX_SEARCH_DEPTH are passed
+ * to the matchfinders, although lcpit has no search depth.  Each pass is
+ * repeated REPEATS times, and the fastest pass is reported.
+ *
+ * For "find", avg_matches is the average number of matches found per position,
+ * and avg_longest_match is the average length of the longest match at the
+ * positions where any was found.  hc only finds the longest match, so for it
+ * avg_matches is the fraction of positions where a match was found.  The time
+ * for lcpit includes building the suffix array of each window.
+ *
+ * Since the matchfinders are internal to the library, this program must be
+ * linked with the static library.
+ *
+ * The author dedicates this file to the public domain.
+ * You can do whatever you want with this file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define mf_pos_t	u32
+#define MF_SUFFIX
+#include "wimlib/bt_matchfinder.h"
+#include "wimlib/hc_matchfinder.h"
+#include "wimlib/lcpit_matchfinder.h"
+
+#define MAX_LIST_LEN	32
+#define MAX_MATCH_LEN	258
+#define MAX_MATCHES	(MAX_MATCH_LEN + 1)
+
+enum mf_type {
+	MF_BT,
+	MF_HC,
+	MF_LCPIT,
+	NUM_MF_TYPES,
+};
+
+static const char * const mf_names[NUM_MF_TYPES] = {
+	[MF_BT]		= "bt",
+	[MF_HC]		= "hc",
+	[MF_LCPIT]	= "lcpit",
+};
+
+static const char *default_mf_types = "bt,hc,lcpit";
+static const char *default_window_sizes = "65536,1048576,8388608";
+
+static u32 nice_len = 64;
+static u32 max_search_depth = 50;
+
+static void
+fatal(const char *msg)
+{
+	fprintf(stderr, "benchmark_matchfinders: %s\n", msg);
+	exit(1);
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+
+	if (!p)
+		fatal("out of memory");
+	return p;
+}
+
+static u64
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parse a comma-separated list of unsigned numbers.  */
+static size_t
+parse_num_list(const char *str, u64 list[MAX_LIST_LEN])
+{
+	size_t n = 0;
+	char *end;
+
+	for (;;) {
+		if (n == MAX_LIST_LEN)
+			fatal("too many list items");
+		errno = 0;
+		list[n++] = strtoull(str, &end, 10);
+		if (errno || end == str || (*end != ',' && *end != '\0'))
+			fatal("invalid number in list");
+		if (*end == '\0')
+			return n;
+		str = end + 1;
+	}
+}
+
+/* Parse a comma-separated list of matchfinder names.  */
+static size_t
+parse_mf_list(const char *str, enum mf_type list[MAX_LIST_LEN])
+{
+	size_t n = 0;
+
+	while (*str) {
+		size_t len = strcspn(str, ",");
+		int i;
+
+		for (i = 0; i < NUM_MF_TYPES; i++)
+			if (strlen(mf_names[i]) == len &&
+			    !strncmp(str, mf_names[i], len))
+				break;
+		if (i == NUM_MF_TYPES)
+			fatal("unknown matchfinder");
+		if (n == MAX_LIST_LEN)
+			fatal("too many list items");
+		list[n++] = i;
+		str += len;
+		if (*str == ',')
+			str++;
+	}
+	return n;
+}
+
+/* Concatenate the files into one buffer.  */
+static u8 *
+read_corpus(char **paths, int num_paths, size_t *size_ret)
+{
+	u8 *buf = NULL;
+	size_t size = 0;
+
+	for (int i = 0; i < num_paths; i++) {
+		FILE *fp = fopen(paths[i], "rb");
+		size_t n;
+
+		if (!fp) {
+			fprintf(stderr, "benchmark_matchfinders: %s: %s\n",
+				paths[i], strerror(errno));
+			exit(1);
+		}
+		do {
+			buf = realloc(buf, size + 65536);
+			if (!buf)
+				fatal("out of memory");
+			n = fread(buf + size, 1, 65536, fp);
+			size += n;
+		} while (n == 65536);
+		if (ferror(fp))
+			fatal("error reading input file");
+		fclose(fp);
+	}
+	*size_ret = size;
+	return buf;
+}
+
+struct result {
+	u64 positions;
+	u64 matches;
+	u64 total_best_len;
+	u64 ns;
+};
+
+/*
+ * Run a matchfinder over one window.  Searching stops a few bytes before the
+ * end of the window, where the bt and hc matchfinders can't search, so that all
+ * matchfinders are measured over the same positions.
+ */
+static void
+run_window(enum mf_type type, void *mf, const u8 *in, u32 n, bool find,
+	   struct lz_match *matches, struct result *res)
+{
+	u32 next_hashes[2] = {0, 0};
+	u32 end = n - BT_MATCHFINDER_REQUIRED_NBYTES;
+	u32 best_len, offset;
+
+	switch (type) {
+	case MF_BT:
+		bt_matchfinder_init(mf);
+		for (u32 pos = 0; pos < end; pos++) {
+			u32 max_len = min(n - pos, MAX_MATCH_LEN);
+			u32 nice = min(nice_len, max_len);
+
+			if (find) {
+				u32 num = bt_matchfinder_get_matches(
+						mf, in, pos, max_len, nice,
+						max_search_depth, next_hashes,
+						&best_len, matches) - matches;
+				res->matches += num;
+				if (num)
+					res->total_best_len += best_len;
+			} else {
+				bt_matchfinder_skip_byte(mf, in, pos, nice,
+							 max_search_depth,
+							 next_hashes);
+			}
+		}
+		break;
+	case MF_HC:
+		hc_matchfinder_init(mf, n);
+		for (u32 pos = 0; pos < end; pos++) {
+			u32 max_len = min(n - pos, MAX_MATCH_LEN);
+
+			if (find) {
+				best_len = hc_matchfinder_longest_match(
+						mf, in, in + pos, 2, max_len,
+						min(nice_len, max_len),
+						max_search_depth, next_hashes,
+						&offset);
+				if (best_len > 2) {
+					res->matches++;
+					res->total_best_len += best_len;
+				}
+			} else {
+				hc_matchfinder_skip_bytes(mf, in, in + pos,
+							  in + n, 1,
+							  next_hashes);
+			}
+		}
+		break;
+	default:
+		lcpit_matchfinder_load_buffer(mf, in, n);
+		for (u32 pos = 0; pos < end; pos++) {
+			if (find) {
+				u32 num = lcpit_matchfinder_get_matches(mf,
+									matches);
+				res->matches += num;
+				if (num)
+					res->total_best_len += matches[0].length;
+			} else {
+				lcpit_matchfinder_skip_bytes(mf, 1);
+			}
+		}
+		break;
+	}
+	res->positions += end;
+}
+
+/* Run a matchfinder over the corpus in windows of @window_size bytes.  */
+static void
+run_one(enum mf_type type, size_t window_size, const u8 *corpus,
+	size_t corpus_size, bool find, unsigned repeats, struct result *result)
+{
+	struct lcpit_matchfinder lcpit;
+	struct lz_match *matches = xmalloc(MAX_MATCHES * sizeof(matches[0]));
+	void *mf;
+
+	if (type == MF_BT) {
+		mf = xmalloc(bt_matchfinder_size(window_size));
+	} else if (type == MF_HC) {
+		mf = xmalloc(hc_matchfinder_size(window_size));
+	} else {
+		if (!lcpit_matchfinder_init(&lcpit, window_size, 2,
+					    min(nice_len, MAX_MATCH_LEN - 3)))
+			fatal("failed to initialize lcpit matchfinder");
+		mf = &lcpit;
+	}
+
+	result->ns = UINT64_MAX;
+	for (unsigned r = 0; r < repeats; r++) {
+		struct result res = { 0 };
+		u64 start = now_ns();
+
+		for (size_t offset = 0; offset < corpus_size;
+		     offset += window_size) {
+			u32 n = min(corpus_size - offset, window_size);
+
+			if (n > BT_MATCHFINDER_REQUIRED_NBYTES)
+				run_window(type, mf, corpus + offset, n, find,
+					   matches, &res);
+		}
+		res.ns = now_ns() - start;
+		if (res.ns < result->ns)
+			*result = res;
+	}
+
+	if (type == MF_LCPIT)
+		lcpit_matchfinder_destroy(&lcpit);
+	else
+		free(mf);
+	free(matches);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *mf_types_str = default_mf_types;
+	const char *window_sizes_str = default_window_sizes;
+	unsigned repeats = 1;
+	enum mf_type mf_types[MAX_LIST_LEN];
+	u64 window_sizes[MAX_LIST_LEN];
+	size_t num_mf_types, num_window_sizes;
+	u8 *corpus;
+	size_t corpus_size;
+	bool first = true;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:w:n:d:r:")) != -1) {
+		switch (c) {
+		case 'm':
+			mf_types_str = optarg;
+			break;
+		case 'w':
+			window_sizes_str = optarg;
+			break;
+		case 'n':
+			nice_len = atoi(optarg);
+			if (nice_len < 3 || nice_len > MAX_MATCH_LEN)
+				fatal("invalid nice match length");
+			break;
+		case 'd':
+			max_search_depth = atoi(optarg);
+			if (max_search_depth == 0)
+				fatal("invalid search depth");
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			if (repeats == 0)
+				fatal("invalid repeat count");
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc)
+		goto usage;
+
+	num_mf_types = parse_mf_list(mf_types_str, mf_types);
+	num_window_sizes = parse_num_list(window_sizes_str, window_sizes);
+	for (size_t j = 0; j < num_window_sizes; j++)
+		if (window_sizes[j] <= BT_MATCHFINDER_REQUIRED_NBYTES ||
+		    window_sizes[j] > 0x7FFFFFFF)
+			fatal("invalid window size");
+
+	corpus = read_corpus(&argv[optind], argc - optind, &corpus_size);
+	if (corpus_size == 0)
+		fatal("the input is empty");
+
+	printf("[\n");
+	for (size_t i = 0; i < num_mf_types; i++) {
+		for (size_t j = 0; j < num_window_sizes; j++) {
+			for (int find = 1; find >= 0; find--) {
+				struct result res;
+
+				run_one(mf_types[i], window_sizes[j], corpus,
+					corpus_size, find, repeats, &res);
+				printf("%s  {\"matchfinder\": \"%s\", "
+				       "\"window_size\": %"PRIu64", "
+				       "\"operation\": \"%s\", "
+				       "\"positions\": %"PRIu64", "
+				       "\"positions_per_sec\": %.0f",
+				       first ? "" : ",\n",
+				       mf_names[mf_types[i]], window_sizes[j],
+				       find ? "find" : "skip", res.positions,
+				       res.ns ? res.positions /
+						((double)res.ns / 1e9) : 0);
+				if (find) {
+					printf(", \"avg_matches\": %.4f, "
+					       "\"avg_longest_match\": %.2f",
+					       res.positions ?
+					       (double)res.matches / res.positions : 0,
+					       res.matches ?
+					       (double)res.total_best_len /
+					       res.matches : 0);
+				}
+				printf("}");
+				fflush(stdout);
+				first = false;
+			}
+		}
+	}
+	printf("\n]\n");
+	free(corpus);
+	return 0;
+
+usage:
+	fprintf(stderr,
+		"Usage: %s [-m MATCHFINDERS] [-w WINDOW_SIZES] [-n NICE_LEN] "
+		"[-d MAX_SEARCH_DEPTH] [-r REPEATS] FILE...\n", argv[0]);
+	return 2;
+}
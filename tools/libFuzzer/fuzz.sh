@@ -19,8 +19,14 @@ Options:
    --asan          Enable AddressSanitizer
    --input=INPUT   Test a single input file only
    --max-len=LEN   Maximum length of generated inputs (default: $MAX_LEN)
+   --max-ns-per-byte=NS
+                   With --speed, fail if any input takes longer than this
    --msan          Enable MemorySanitizer
+   --speed         Instead of fuzzing, time the inputs in the corpus (or
+                   INPUT) and print the throughput of each group of inputs
    --time=SECONDS  Stop after the given time has passed
+   --timeout=SECONDS
+                   Treat any input taking longer than this as a failure
    --ubsan         Enable UndefinedBehaviorSanitizer
 
 Available fuzz targets: ${AVAILABLE_TARGETS[*]}
@@ -43,14 +49,19 @@ EXTRA_SANITIZERS=
 EXTRA_FUZZER_ARGS=()
 INPUT=
 MAX_LEN=32768
+MAX_NS_PER_BYTE=
+SPEED=false
 
 longopts_array=(
 asan
 help
 input:
 max-len:
+max-ns-per-byte:
 msan
+speed
 time:
+timeout:
 ubsan
 )
 longopts=$(echo "${longopts_array[@]}" | tr ' ' ',')
@@ -77,13 +88,24 @@ while true; do
 		MAX_LEN=$2
 		shift
 		;;
+	--max-ns-per-byte)
+		MAX_NS_PER_BYTE=$2
+		shift
+		;;
 	--msan)
 		EXTRA_SANITIZERS+=",memory"
 		;;
+	--speed)
+		SPEED=true
+		;;
 	--time)
 		EXTRA_FUZZER_ARGS+=("-max_total_time=$2")
 		shift
 		;;
+	--timeout)
+		EXTRA_FUZZER_ARGS+=("-timeout=$2")
+		shift
+		;;
 	--ubsan)
 		EXTRA_SANITIZERS+=",undefined"
 		;;
@@ -123,7 +145,13 @@ if ! [ -e config.log ] || ! grep -q -- "'CFLAGS=$cflags'" config.log; then
 fi
 run_cmd make "-j$(getconf _NPROCESSORS_ONLN)"
 cd "$SCRIPTDIR"
-if [ -n "$INPUT" ]; then
+if $SPEED; then
+	run_cmd clang -g -O1 -fsanitize=fuzzer-no-link$EXTRA_SANITIZERS -Wall -Werror \
+		-I "$TOPDIR/include" "$TARGET/fuzz.c" time-inputs.c fault-injection.c \
+		"$TOPDIR/.libs/libwim.a" -o time-inputs
+	run_cmd ./time-inputs ${MAX_NS_PER_BYTE:+-m "$MAX_NS_PER_BYTE"} \
+		"${INPUT:-$TARGET/corpus}"
+elif [ -n "$INPUT" ]; then
 	run_cmd clang -g -O1 -fsanitize=fuzzer-no-link$EXTRA_SANITIZERS -Wall -Werror \
 		-I "$TOPDIR/include" "$TARGET/fuzz.c" test-one-input.c fault-injection.c \
 		"$TOPDIR/.libs/libwim.a" -o test-one-input
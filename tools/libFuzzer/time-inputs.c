@@ -0,0 +1,202 @@
+/*
+ * Run a fuzz target over a corpus and report how long each group of inputs
+ * took, so that throughput regressions and pathologically slow inputs can be
+ * caught.  Inputs are grouped by the part of their file name before the first
+ * '-', so for the decompress target the inputs "lzx" and "lzx-text" are both
+ * reported under "lzx".  Each input is run REPEATS times and the fastest run is
+ * used.  If any input takes more than MAX_NS_PER_BYTE nanoseconds per byte of
+ * input, it is reported and the exit status is 1.
+ *
+ * Usage: time-inputs [-r REPEATS] [-m MAX_NS_PER_BYTE] FILE_OR_DIR...
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_GROUPS	64
+
+int LLVMFuzzerTestOneInput(const uint8_t *in, size_t insize);
+
+struct group {
+	char name[64];
+	unsigned num_inputs;
+	uint64_t bytes;
+	uint64_t ns;
+	char slowest_input[256];
+	double slowest_ns_per_byte;
+};
+
+static struct group groups[MAX_GROUPS];
+static unsigned num_groups;
+static unsigned repeats = 3;
+static double max_ns_per_byte;
+static int status;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct group *
+get_group(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	size_t len;
+	unsigned i;
+
+	name = name ? name + 1 : path;
+	len = strcspn(name, "-");
+	if (len >= sizeof(groups[0].name))
+		len = sizeof(groups[0].name) - 1;
+	for (i = 0; i < num_groups; i++)
+		if (strlen(groups[i].name) == len &&
+		    !strncmp(groups[i].name, name, len))
+			return &groups[i];
+	if (num_groups == MAX_GROUPS) {
+		fprintf(stderr, "too many groups\n");
+		exit(2);
+	}
+	memcpy(groups[num_groups].name, name, len);
+	return &groups[num_groups++];
+}
+
+static void
+time_input(const char *path)
+{
+	struct group *g;
+	struct stat stbuf;
+	uint8_t *in;
+	uint64_t best = UINT64_MAX;
+	double ns_per_byte;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &stbuf) != 0) {
+		perror(path);
+		exit(2);
+	}
+	in = malloc(stbuf.st_size ? stbuf.st_size : 1);
+	if (read(fd, in, stbuf.st_size) != stbuf.st_size) {
+		perror(path);
+		exit(2);
+	}
+	close(fd);
+
+	for (unsigned r = 0; r < repeats; r++) {
+		uint64_t start = now_ns(), elapsed;
+
+		LLVMFuzzerTestOneInput(in, stbuf.st_size);
+		elapsed = now_ns() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	free(in);
+
+	g = get_group(path);
+	g->num_inputs++;
+	g->bytes += stbuf.st_size;
+	g->ns += best;
+	ns_per_byte = (double)best / (stbuf.st_size ? stbuf.st_size : 1);
+	if (ns_per_byte > g->slowest_ns_per_byte) {
+		g->slowest_ns_per_byte = ns_per_byte;
+		snprintf(g->slowest_input, sizeof(g->slowest_input), "%s",
+			 path);
+	}
+	if (max_ns_per_byte && ns_per_byte > max_ns_per_byte) {
+		fprintf(stderr, "%s: too slow (%.1f ns per byte)\n",
+			path, ns_per_byte);
+		status = 1;
+	}
+}
+
+static void
+time_path(const char *path)
+{
+	struct stat stbuf;
+	struct dirent **entries;
+	int n;
+
+	if (stat(path, &stbuf) != 0) {
+		perror(path);
+		exit(2);
+	}
+	if (!S_ISDIR(stbuf.st_mode)) {
+		time_input(path);
+		return;
+	}
+	/* Sort the entries so that the output doesn't depend on the order of
+	 * the directory.  */
+	n = scandir(path, &entries, NULL, alphasort);
+	if (n < 0) {
+		perror(path);
+		exit(2);
+	}
+	for (int i = 0; i < n; i++) {
+		char child[4096];
+
+		if (entries[i]->d_name[0] != '.') {
+			snprintf(child, sizeof(child), "%s/%s", path,
+				 entries[i]->d_name);
+			time_path(child);
+		}
+		free(entries[i]);
+	}
+	free(entries);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "r:m:")) != -1) {
+		switch (c) {
+		case 'r':
+			repeats = atoi(optarg);
+			if (repeats == 0)
+				goto usage;
+			break;
+		case 'm':
+			max_ns_per_byte = atof(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc)
+		goto usage;
+
+	for (int i = optind; i < argc; i++)
+		time_path(argv[i]);
+
+	printf("[\n");
+	for (unsigned i = 0; i < num_groups; i++) {
+		const struct group *g = &groups[i];
+
+		printf("%s  {\"group\": \"%s\", \"inputs\": %u, "
+		       "\"bytes\": %"PRIu64", \"ns\": %"PRIu64", "
+		       "\"mb_per_sec\": %.2f, \"slowest_input\": \"%s\", "
+		       "\"slowest_ns_per_byte\": %.1f}",
+		       i ? ",\n" : "", g->name, g->num_inputs, g->bytes, g->ns,
+		       g->ns ? (double)g->bytes / 1e6 / ((double)g->ns / 1e9) : 0,
+		       g->slowest_input, g->slowest_ns_per_byte);
+	}
+	printf("\n]\n");
+	return status;
+
+usage:
+	fprintf(stderr, "Usage: %s [-r REPEATS] [-m MAX_NS_PER_BYTE] "
+		"FILE_OR_DIR...\n", argv[0]);
+	return 2;
+}